@@ -31,6 +31,11 @@
 #include "lib/util/debug.h"
 #include "lib/util/byteorder.h"
 #include "lib/util/bytearray.h"
+#include "lib/pthreadpool/pthreadpool.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 /*
  * DEBUG_NO_LZ77_MATCHES toggles the encoding of matches as matches. If it is
@@ -126,6 +131,12 @@ struct lzxhuff_compressor_context {
 	uint8_t *output;
 	size_t available_size;
 	size_t output_pos;
+	/*
+	 * more_input means the input continues in another, independently
+	 * compressed block, so the EOF marker is not written.
+	 */
+	bool more_input;
+	bool fast;
 };
 
 static int compare_huffman_node_count(struct huffman_node *a,
@@ -632,9 +643,17 @@ static int generate_huffman_codes(struct huffman_node *leaf_nodes,
  */
 #define LZX_HUFF_COMP_HASH_SEARCH_ATTEMPTS 5
 
+/*
+ * In fast mode we only look at the slot the hash points to, and evict
+ * whatever is in it. This roughly halves the time spent in the LZ77
+ * stage, at the cost of missing some matches.
+ */
+#define LZX_HUFF_COMP_HASH_SEARCH_ATTEMPTS_FAST 1
+
 static inline void store_match(uint16_t *hash_table,
 			       uint16_t h,
-			       uint16_t offset)
+			       uint16_t offset,
+			       int attempts)
 {
 	int i;
 	uint16_t o = hash_table[h];
@@ -647,7 +666,7 @@ static inline void store_match(uint16_t *hash_table,
 		hash_table[h] = offset;
 		return;
 	}
-	for (i = 1; i < LZX_HUFF_COMP_HASH_SEARCH_ATTEMPTS; i++) {
+	for (i = 1; i < attempts; i++) {
 		h2 = (h + i) & HASH_MASK;
 		if (hash_table[h2] == 0xffff) {
 			hash_table[h2] = offset;
@@ -660,7 +679,7 @@ static inline void store_match(uint16_t *hash_table,
 	 */
 	worst_h = h;
 	worst_score = offset - o;
-	for (i = 1; i < LZX_HUFF_COMP_HASH_SEARCH_ATTEMPTS; i++) {
+	for (i = 1; i < attempts; i++) {
 		int score;
 		h2 = (h + i) & HASH_MASK;
 		o = hash_table[h2];
@@ -687,7 +706,8 @@ static inline struct match lookup_match(uint16_t *hash_table,
 					uint16_t h,
 					const uint8_t *data,
 					const uint8_t *here,
-					size_t max_len)
+					size_t max_len,
+					int attempts)
 {
 	int i;
 	uint16_t o = hash_table[h];
@@ -696,7 +716,7 @@ static inline struct match lookup_match(uint16_t *hash_table,
 	const uint8_t *there = NULL;
 	struct match best = {0};
 
-	for (i = 0; i < LZX_HUFF_COMP_HASH_SEARCH_ATTEMPTS; i++) {
+	for (i = 0; i < attempts; i++) {
 		h2 = (h + i) & HASH_MASK;
 		o = hash_table[h2];
 		if (o == 0xffff) {
@@ -757,6 +777,11 @@ static ssize_t lz77_encode_block(struct lzxhuff_compressor_context *cmp_ctx,
 	size_t block_end = MIN(65536, remaining_size);
 	struct match match;
 	int n_symbols;
+	int attempts = LZX_HUFF_COMP_HASH_SEARCH_ATTEMPTS;
+
+	if (cmp_ctx->fast) {
+		attempts = LZX_HUFF_COMP_HASH_SEARCH_ATTEMPTS_FAST;
+	}
 
 	if (cmp_ctx->input_size < cmp_ctx->input_pos) {
 		return LZXPRESS_ERROR;
@@ -806,7 +831,8 @@ static ssize_t lz77_encode_block(struct lzxhuff_compressor_context *cmp_ctx,
 					     h,
 					     data,
 					     here,
-					     max_len);
+					     max_len,
+					     attempts);
 
 			if (match.there == NULL && prev_hash_table != NULL) {
 				/*
@@ -820,10 +846,11 @@ static ssize_t lz77_encode_block(struct lzxhuff_compressor_context *cmp_ctx,
 						     h,
 						     prev_block,
 						     here,
-						     remaining_size - i);
+						     remaining_size - i,
+						     attempts);
 			}
 
-			store_match(hash_table, h, i);
+			store_match(hash_table, h, i, attempts);
 
 			if (match.there == NULL) {
 				/* add a literal and move on. */
@@ -869,7 +896,7 @@ static ssize_t lz77_encode_block(struct lzxhuff_compressor_context *cmp_ctx,
 		j++;
 	}
 
-	if (i == remaining_size) {
+	if (i == remaining_size && !cmp_ctx->more_input) {
 		/* add a trailing EOF marker (256) */
 		intermediate[j] = 0xffff;
 		intermediate[j + 1] = 0;
@@ -1376,6 +1403,465 @@ ssize_t lzxpress_huffman_compress(struct lzxhuff_compressor_mem *cmp_mem,
 	return cmp_ctx.output_pos;
 }
 
+/*
+ * The streaming compressor cuts the input into independent 64k blocks.
+ *
+ * Unlike lzxpress_huffman_compress(), matches never refer back into the
+ * previous block, nor extend past the end of the current one, and only
+ * the very last block has the EOF marker. The output is still a normal
+ * LZ77 + Huffman stream, but each block can be compressed on its own,
+ * so a number of blocks can be compressed in parallel on a thread pool.
+ *
+ * Each job has its own compressor memory and output buffer, and the
+ * outputs are copied into the caller's buffer in order once the whole
+ * batch has finished. The calling thread compresses the last block of
+ * each batch itself.
+ */
+
+#define LZXHUFF_STREAM_BLOCK_SIZE 65536
+
+struct lzxhuff_block_job {
+	struct lzxhuff_compressor_mem *cmp_mem;
+	const uint8_t *input_bytes;
+	size_t input_size;
+	bool last;
+	bool fast;
+	uint8_t *output;
+	size_t available_size;
+	ssize_t output_size;
+};
+
+struct lzxhuff_compress_stream {
+	bool fast;
+	bool broken;
+	struct pthreadpool *pool;
+	struct lzxhuff_block_job *jobs;
+	size_t max_jobs;
+	size_t n_jobs;
+	uint8_t *pending;
+	size_t pending_size;
+	size_t jobs_done;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+static void lzxhuff_block_job_fn(void *private_data)
+{
+	struct lzxhuff_block_job *job = private_data;
+	struct lzxhuff_compressor_context cmp_ctx = {
+		.input_bytes = job->input_bytes,
+		.input_size = job->input_size,
+		.input_pos = 0,
+		.prev_block_pos = 0,
+		.output = job->output,
+		.available_size = job->available_size,
+		.output_pos = 0,
+		.more_input = !job->last,
+		.fast = job->fast
+	};
+	ssize_t ret;
+
+	ret = lzx_huffman_compress_block(&cmp_ctx, job->cmp_mem, 0);
+	if (ret < 0 || cmp_ctx.input_pos != job->input_size) {
+		job->output_size = LZXPRESS_ERROR;
+		return;
+	}
+	job->output_size = cmp_ctx.output_pos;
+}
+
+static int lzxhuff_compress_stream_signal(int jobid,
+					  void (*job_fn)(void *private_data),
+					  void *job_private_data,
+					  void *private_data)
+{
+	struct lzxhuff_compress_stream *stream = private_data;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&stream->mutex);
+	stream->jobs_done++;
+	pthread_cond_signal(&stream->cond);
+	pthread_mutex_unlock(&stream->mutex);
+#else
+	stream->jobs_done++;
+#endif
+	return 0;
+}
+
+static int lzxhuff_compress_stream_destructor(
+	struct lzxhuff_compress_stream *stream)
+{
+	/*
+	 * Jobs are always waited for in lzxpress_huffman_compress_stream(),
+	 * so there is nothing running by now.
+	 */
+	if (stream->pool != NULL) {
+		pthreadpool_destroy(stream->pool);
+		stream->pool = NULL;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_cond_destroy(&stream->cond);
+	pthread_mutex_destroy(&stream->mutex);
+#endif
+	return 0;
+}
+
+/*
+ * lzxpress_huffman_compress_stream_init()
+ *
+ * @param mem_ctx  TALLOC_CTX parent for the stream.
+ * @param flags    LZXHUFF_COMPRESS_FAST, or 0.
+ * @param threads  number of worker threads, 0 to do all the work in the
+ *                 calling thread.
+ *
+ * @return a stream, or NULL on error.
+ */
+struct lzxhuff_compress_stream *lzxpress_huffman_compress_stream_init(
+	TALLOC_CTX *mem_ctx,
+	unsigned flags,
+	unsigned threads)
+{
+	struct lzxhuff_compress_stream *stream = NULL;
+	size_t block_output_size = lzxpress_huffman_max_compressed_size(
+		LZXHUFF_STREAM_BLOCK_SIZE);
+	size_t i;
+	int ret;
+
+	if (flags & ~LZXHUFF_COMPRESS_FAST) {
+		return NULL;
+	}
+
+	stream = talloc_zero(mem_ctx, struct lzxhuff_compress_stream);
+	if (stream == NULL) {
+		return NULL;
+	}
+	stream->fast = (flags & LZXHUFF_COMPRESS_FAST);
+	stream->max_jobs = threads + 1;
+
+	stream->pending = talloc_array(stream,
+				       uint8_t,
+				       LZXHUFF_STREAM_BLOCK_SIZE);
+	if (stream->pending == NULL) {
+		goto fail;
+	}
+
+	stream->jobs = talloc_zero_array(stream,
+					 struct lzxhuff_block_job,
+					 stream->max_jobs);
+	if (stream->jobs == NULL) {
+		goto fail;
+	}
+	for (i = 0; i < stream->max_jobs; i++) {
+		struct lzxhuff_block_job *job = &stream->jobs[i];
+
+		job->cmp_mem = talloc(stream->jobs,
+				      struct lzxhuff_compressor_mem);
+		if (job->cmp_mem == NULL) {
+			goto fail;
+		}
+		job->output = talloc_array(stream->jobs,
+					   uint8_t,
+					   block_output_size);
+		if (job->output == NULL) {
+			goto fail;
+		}
+		job->available_size = block_output_size;
+		job->fast = stream->fast;
+	}
+
+#ifdef HAVE_PTHREAD
+	ret = pthread_mutex_init(&stream->mutex, NULL);
+	if (ret != 0) {
+		goto fail;
+	}
+	ret = pthread_cond_init(&stream->cond, NULL);
+	if (ret != 0) {
+		pthread_mutex_destroy(&stream->mutex);
+		goto fail;
+	}
+#endif
+	talloc_set_destructor(stream, lzxhuff_compress_stream_destructor);
+
+	if (threads > 0) {
+		ret = pthreadpool_init(threads,
+				       &stream->pool,
+				       lzxhuff_compress_stream_signal,
+				       stream);
+		if (ret != 0) {
+			/*
+			 * Not fatal, we compress in the calling thread
+			 * instead.
+			 */
+			DBG_NOTICE("pthreadpool_init failed: %s\n",
+				   strerror(ret));
+			stream->pool = NULL;
+		}
+	}
+
+	return stream;
+fail:
+	TALLOC_FREE(stream);
+	return NULL;
+}
+
+/*
+ * Run the queued jobs and append their output to the output buffer.
+ */
+static ssize_t lzxhuff_compress_stream_run(
+	struct lzxhuff_compress_stream *stream,
+	uint8_t *output,
+	size_t available_size)
+{
+	size_t n_jobs = stream->n_jobs;
+	size_t n_queued = 0;
+	size_t output_pos = 0;
+	size_t i;
+
+	if (n_jobs == 0) {
+		return 0;
+	}
+	stream->n_jobs = 0;
+	stream->jobs_done = 0;
+
+	for (i = 0; i + 1 < n_jobs; i++) {
+		struct lzxhuff_block_job *job = &stream->jobs[i];
+		int ret;
+
+		if (stream->pool != NULL) {
+			ret = pthreadpool_add_job(stream->pool,
+						  i,
+						  lzxhuff_block_job_fn,
+						  job);
+			if (ret == 0) {
+				n_queued++;
+				continue;
+			}
+		}
+		lzxhuff_block_job_fn(job);
+	}
+	lzxhuff_block_job_fn(&stream->jobs[n_jobs - 1]);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&stream->mutex);
+	while (stream->jobs_done < n_queued) {
+		pthread_cond_wait(&stream->cond, &stream->mutex);
+	}
+	pthread_mutex_unlock(&stream->mutex);
+#endif
+
+	for (i = 0; i < n_jobs; i++) {
+		struct lzxhuff_block_job *job = &stream->jobs[i];
+
+		if (job->output_size < 0) {
+			return LZXPRESS_ERROR;
+		}
+		if ((size_t)job->output_size > available_size - output_pos) {
+			return LZXPRESS_ERROR;
+		}
+		memcpy(output + output_pos, job->output, job->output_size);
+		output_pos += job->output_size;
+	}
+	return output_pos;
+}
+
+/*
+ * Queue a block, and run the batch if it is full.
+ */
+static ssize_t lzxhuff_compress_stream_add(
+	struct lzxhuff_compress_stream *stream,
+	const uint8_t *input_bytes,
+	size_t input_size,
+	bool last,
+	uint8_t *output,
+	size_t available_size)
+{
+	struct lzxhuff_block_job *job = &stream->jobs[stream->n_jobs];
+
+	job->input_bytes = input_bytes;
+	job->input_size = input_size;
+	job->last = last;
+	job->output_size = 0;
+	stream->n_jobs++;
+
+	if (stream->n_jobs < stream->max_jobs) {
+		return 0;
+	}
+	return lzxhuff_compress_stream_run(stream, output, available_size);
+}
+
+/*
+ * lzxpress_huffman_compress_stream_max_output()
+ *
+ * Return the most bytes the next lzxpress_huffman_compress_stream() call
+ * with input_size bytes can write.
+ */
+size_t lzxpress_huffman_compress_stream_max_output(
+	struct lzxhuff_compress_stream *stream,
+	size_t input_size)
+{
+	size_t n_blocks = stream->pending_size + input_size;
+
+	n_blocks /= LZXHUFF_STREAM_BLOCK_SIZE;
+	n_blocks += 1;
+
+	return n_blocks * lzxpress_huffman_max_compressed_size(
+		LZXHUFF_STREAM_BLOCK_SIZE);
+}
+
+/*
+ * lzxpress_huffman_compress_stream()
+ *
+ * Feed input into the stream, and get back whatever could be compressed
+ * so far. Input that does not fill a block is kept in the stream until
+ * the next call, as is the last full block, because we can't know
+ * whether it needs the EOF marker until we see the next input or final.
+ * That means a call can return 0 without that being an error.
+ *
+ * When final is true, all the remaining input is compressed, and the
+ * stream is ready to compress something new, even if there was an
+ * error. After an error in a call without final, the stream is of no
+ * further use.
+ *
+ * The concatenated output of all calls is something that
+ * lzxpress_huffman_decompress() can decompress.
+ *
+ * @param stream          from lzxpress_huffman_compress_stream_init().
+ * @param input_bytes     memory to be compressed.
+ * @param input_size      length of the input buffer.
+ * @param final           whether this is the end of the input.
+ * @param output          destination for the compressed data.
+ * @param available_size  allocated output bytes, see
+ *                        lzxpress_huffman_compress_stream_max_output().
+ *
+ * @return the number of bytes written or -1 on error.
+ */
+static ssize_t lzxhuff_compress_stream_internal(
+	struct lzxhuff_compress_stream *stream,
+	const uint8_t *input_bytes,
+	size_t input_size,
+	bool final,
+	uint8_t *output,
+	size_t available_size)
+{
+	size_t output_pos = 0;
+	bool pending_used = false;
+	ssize_t ret;
+
+	if (input_size > SSIZE_MAX ||
+	    input_size > UINT32_MAX ||
+	    available_size > SSIZE_MAX ||
+	    available_size > UINT32_MAX ||
+	    output == NULL ||
+	    (input_bytes == NULL && input_size != 0)) {
+		return LZXPRESS_ERROR;
+	}
+
+	if (final && stream->pending_size + input_size == 0) {
+		/* see lzxpress_huffman_compress() */
+		return LZXPRESS_ERROR;
+	}
+
+	if (stream->pending_size != 0) {
+		size_t n = MIN(input_size,
+			       LZXHUFF_STREAM_BLOCK_SIZE - stream->pending_size);
+
+		memcpy(stream->pending + stream->pending_size, input_bytes, n);
+		stream->pending_size += n;
+		input_bytes += n;
+		input_size -= n;
+
+		if (input_size == 0 && !final) {
+			/* still waiting for more */
+			return 0;
+		}
+
+		ret = lzxhuff_compress_stream_add(stream,
+						  stream->pending,
+						  stream->pending_size,
+						  final && input_size == 0,
+						  output,
+						  available_size);
+		if (ret < 0) {
+			return ret;
+		}
+		output_pos += ret;
+		pending_used = true;
+	}
+
+	while (input_size > LZXHUFF_STREAM_BLOCK_SIZE ||
+	       (final && input_size != 0)) {
+		size_t block_size = MIN(input_size, LZXHUFF_STREAM_BLOCK_SIZE);
+
+		ret = lzxhuff_compress_stream_add(stream,
+						  input_bytes,
+						  block_size,
+						  final && block_size == input_size,
+						  output + output_pos,
+						  available_size - output_pos);
+		if (ret < 0) {
+			return ret;
+		}
+		output_pos += ret;
+		input_bytes += block_size;
+		input_size -= block_size;
+	}
+
+	ret = lzxhuff_compress_stream_run(stream,
+					  output + output_pos,
+					  available_size - output_pos);
+	if (ret < 0) {
+		return ret;
+	}
+	output_pos += ret;
+
+	/*
+	 * Only now that all jobs are done can the pending buffer be
+	 * refilled.
+	 */
+	if (pending_used) {
+		stream->pending_size = 0;
+	}
+	if (input_size != 0) {
+		memcpy(stream->pending, input_bytes, input_size);
+		stream->pending_size = input_size;
+	}
+
+	return output_pos;
+}
+
+ssize_t lzxpress_huffman_compress_stream(
+	struct lzxhuff_compress_stream *stream,
+	const uint8_t *input_bytes,
+	size_t input_size,
+	bool final,
+	uint8_t *output,
+	size_t available_size)
+{
+	ssize_t ret;
+
+	if (stream == NULL || stream->broken) {
+		return LZXPRESS_ERROR;
+	}
+
+	ret = lzxhuff_compress_stream_internal(stream,
+					       input_bytes,
+					       input_size,
+					       final,
+					       output,
+					       available_size);
+	if (final) {
+		/*
+		 * All jobs have been waited for, even on error.
+		 */
+		stream->n_jobs = 0;
+		stream->pending_size = 0;
+	} else if (ret < 0) {
+		stream->broken = true;
+	}
+	return ret;
+}
+
 static void debug_tree_codes(struct bitstream *input)
 {
 	/*
@@ -2043,3 +2529,175 @@ uint8_t *lzxpress_huffman_decompress_talloc(TALLOC_CTX *mem_ctx,
 	}
 	return output;
 }
+
+
+/*
+ * The streaming decompressor takes the compressed data in pieces of any
+ * size, and decompresses each block as soon as all of it has arrived.
+ *
+ * We don't know where a block ends until we have decoded it, so a block
+ * that is cut short is tried again when more input turns up. A block is
+ * only accepted before the final call if there is clearly another block
+ * after it, otherwise we can't check for the EOF marker.
+ *
+ * Matches can refer back up to 64k and extend beyond the block, so the
+ * caller provides the whole output buffer up front.
+ */
+
+struct lzxhuff_decompress_stream {
+	uint8_t *output;
+	size_t output_size;
+	size_t output_pos;
+	uint8_t *input;
+	size_t input_size;
+	bool finished;
+	uint16_t table[65536];
+};
+
+/*
+ * lzxpress_huffman_decompress_stream_init()
+ *
+ * @param mem_ctx      TALLOC_CTX parent for the stream.
+ * @param output       destination for the decompressed data.
+ * @param output_size  exact expected length of the decompressed data.
+ *
+ * @return a stream, or NULL on error.
+ */
+struct lzxhuff_decompress_stream *lzxpress_huffman_decompress_stream_init(
+	TALLOC_CTX *mem_ctx,
+	uint8_t *output,
+	size_t output_size)
+{
+	struct lzxhuff_decompress_stream *stream = NULL;
+
+	if (output == NULL ||
+	    output_size == 0 ||
+	    output_size > SSIZE_MAX ||
+	    output_size > UINT32_MAX) {
+		return NULL;
+	}
+
+	stream = talloc_zero(mem_ctx, struct lzxhuff_decompress_stream);
+	if (stream == NULL) {
+		return NULL;
+	}
+	stream->output = output;
+	stream->output_size = output_size;
+	return stream;
+}
+
+/*
+ * lzxpress_huffman_decompress_stream()
+ *
+ * Add some compressed bytes, and decompress as much as possible.
+ *
+ * When final is true, this must be the end of the compressed data, and
+ * the output must be complete. The stream can't be used after that, nor
+ * after an error.
+ *
+ * @param stream       from lzxpress_huffman_decompress_stream_init().
+ * @param input_bytes  the next part of the compressed data.
+ * @param input_size   length of input_bytes.
+ * @param final        whether this is the end of the compressed data.
+ *
+ * @return the number of bytes of the output that are complete, or -1 on
+ *         error.
+ */
+ssize_t lzxpress_huffman_decompress_stream(
+	struct lzxhuff_decompress_stream *stream,
+	const uint8_t *input_bytes,
+	size_t input_size,
+	bool final)
+{
+	size_t input_pos = 0;
+
+	if (stream == NULL || stream->finished) {
+		return LZXPRESS_ERROR;
+	}
+	if (input_bytes == NULL && input_size != 0) {
+		return LZXPRESS_ERROR;
+	}
+	if (input_size > UINT32_MAX - stream->input_size) {
+		return LZXPRESS_ERROR;
+	}
+
+	/*
+	 * The stream is only usable again if we get all the way through.
+	 */
+	stream->finished = true;
+
+	if (input_size != 0) {
+		uint8_t *tmp = talloc_realloc(stream,
+					      stream->input,
+					      uint8_t,
+					      stream->input_size + input_size);
+		if (tmp == NULL) {
+			return LZXPRESS_ERROR;
+		}
+		memcpy(tmp + stream->input_size, input_bytes, input_size);
+		stream->input = tmp;
+		stream->input_size += input_size;
+	}
+
+	while (stream->output_pos < stream->output_size) {
+		struct bitstream input = {
+			.bytes = stream->input + input_pos,
+			.byte_size = stream->input_size - input_pos,
+			.table = stream->table
+		};
+		size_t remaining_output_size = stream->output_size -
+			stream->output_pos;
+		size_t block_output_size = MIN(65536, remaining_output_size);
+		ssize_t block_output_pos;
+
+		block_output_pos = lzx_huffman_decompress_block(
+			&input,
+			stream->output + stream->output_pos,
+			block_output_size,
+			remaining_output_size,
+			stream->output_pos);
+
+		if (block_output_pos < 0 ||
+		    (size_t)block_output_pos < block_output_size) {
+			if (final) {
+				return LZXPRESS_ERROR;
+			}
+			/* probably just short of input */
+			break;
+		}
+		if (!final && input.byte_pos + 256 >= input.byte_size) {
+			/*
+			 * This might be the last block, which is only
+			 * right if it has the EOF marker, and we won't
+			 * know until we've seen everything.
+			 */
+			break;
+		}
+		input_pos += input.byte_pos;
+		stream->output_pos += block_output_pos;
+		if (stream->output_pos > stream->output_size) {
+			/* not expecting to get here. */
+			return LZXPRESS_ERROR;
+		}
+	}
+
+	if (final) {
+		if (input_pos != stream->input_size ||
+		    stream->output_pos != stream->output_size) {
+			return LZXPRESS_ERROR;
+		}
+		TALLOC_FREE(stream->input);
+		stream->input_size = 0;
+		return stream->output_pos;
+	}
+
+	if (input_pos != 0) {
+		memmove(stream->input,
+			stream->input + input_pos,
+			stream->input_size - input_pos);
+		stream->input_size -= input_pos;
+	}
+
+	stream->finished = false;
+	return stream->output_pos;
+}
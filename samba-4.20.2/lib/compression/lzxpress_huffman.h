@@ -91,5 +91,50 @@ uint8_t *lzxpress_huffman_decompress_talloc(TALLOC_CTX *mem_ctx,
  */
 size_t lzxpress_huffman_max_compressed_size(size_t input_size);
 
+/*
+ * Streaming compression, in independent 64k blocks that can be
+ * compressed in parallel on up to `threads` worker threads.
+ *
+ * LZXHUFF_COMPRESS_FAST uses a cheaper match finder, which is faster but
+ * compresses a bit less.
+ */
+#define LZXHUFF_COMPRESS_FAST 0x0001
+
+struct lzxhuff_compress_stream;
+
+struct lzxhuff_compress_stream *lzxpress_huffman_compress_stream_init(
+	TALLOC_CTX *mem_ctx,
+	unsigned flags,
+	unsigned threads);
+
+size_t lzxpress_huffman_compress_stream_max_output(
+	struct lzxhuff_compress_stream *stream,
+	size_t input_size);
+
+ssize_t lzxpress_huffman_compress_stream(
+	struct lzxhuff_compress_stream *stream,
+	const uint8_t *input_bytes,
+	size_t input_size,
+	bool final,
+	uint8_t *output,
+	size_t available_size);
+
+/*
+ * Streaming decompression into a buffer of known size, with the
+ * compressed data arriving in pieces.
+ */
+struct lzxhuff_decompress_stream;
+
+struct lzxhuff_decompress_stream *lzxpress_huffman_decompress_stream_init(
+	TALLOC_CTX *mem_ctx,
+	uint8_t *output,
+	size_t output_size);
+
+ssize_t lzxpress_huffman_decompress_stream(
+	struct lzxhuff_decompress_stream *stream,
+	const uint8_t *input_bytes,
+	size_t input_size,
+	bool final);
+
 
 #endif /* HAVE_LZXPRESS_HUFFMAN_H */
@@ -1226,6 +1226,293 @@ static void test_lzxpress_huffman_decompress_empty_or_null(void **state)
 }
 
 
+/*
+ * Compress `original` through the stream API in pieces of `chunk` bytes,
+ * check that the normal decompressor and the stream decompressor (fed in
+ * pieces of `chunk` compressed bytes) both get the original back, and
+ * return the compressed size.
+ */
+static ssize_t attempt_stream_round_trip(TALLOC_CTX *mem_ctx,
+					 DATA_BLOB original,
+					 unsigned flags,
+					 unsigned threads,
+					 size_t chunk)
+{
+	struct lzxhuff_compress_stream *cstream = NULL;
+	struct lzxhuff_decompress_stream *dstream = NULL;
+	DATA_BLOB compressed = data_blob_talloc(
+		mem_ctx,
+		NULL,
+		lzxpress_huffman_max_compressed_size(65536) *
+		(original.length / 65536 + 2));
+	DATA_BLOB decompressed = data_blob_talloc(mem_ctx,
+						  NULL,
+						  original.length);
+	size_t comp_size = 0;
+	size_t pos;
+	ssize_t ret;
+
+	cstream = lzxpress_huffman_compress_stream_init(mem_ctx,
+							flags,
+							threads);
+	assert_non_null(cstream);
+
+	for (pos = 0; pos < original.length; pos += chunk) {
+		size_t len = MIN(chunk, original.length - pos);
+		bool final = (pos + len == original.length);
+		size_t max_output = lzxpress_huffman_compress_stream_max_output(
+			cstream, len);
+
+		ret = lzxpress_huffman_compress_stream(
+			cstream,
+			original.data + pos,
+			len,
+			final,
+			compressed.data + comp_size,
+			compressed.length - comp_size);
+		assert_true(ret >= 0);
+		assert_true(ret <= max_output);
+		comp_size += ret;
+	}
+	/* after final, the stream starts over */
+	if (original.length <= 65536) {
+		DATA_BLOB again = data_blob_talloc(mem_ctx,
+						   NULL,
+						   compressed.length);
+		ret = lzxpress_huffman_compress_stream(cstream,
+						       original.data,
+						       original.length,
+						       true,
+						       again.data,
+						       again.length);
+		assert_int_equal(ret, comp_size);
+		assert_memory_equal(again.data, compressed.data, comp_size);
+		data_blob_free(&again);
+	}
+	TALLOC_FREE(cstream);
+
+	ret = lzxpress_huffman_decompress(compressed.data,
+					  comp_size,
+					  decompressed.data,
+					  decompressed.length);
+	assert_int_equal(ret, original.length);
+	assert_memory_equal(decompressed.data,
+			    original.data,
+			    original.length);
+
+	memset(decompressed.data, 0, decompressed.length);
+	dstream = lzxpress_huffman_decompress_stream_init(mem_ctx,
+							  decompressed.data,
+							  decompressed.length);
+	assert_non_null(dstream);
+
+	for (pos = 0; pos < comp_size; pos += chunk) {
+		size_t len = MIN(chunk, comp_size - pos);
+		bool final = (pos + len == comp_size);
+
+		ret = lzxpress_huffman_decompress_stream(dstream,
+							 compressed.data + pos,
+							 len,
+							 final);
+		assert_true(ret >= 0);
+		if (final) {
+			assert_int_equal(ret, original.length);
+		} else {
+			assert_true(ret < original.length);
+			/* what we have so far is right */
+			assert_memory_equal(decompressed.data,
+					    original.data,
+					    ret);
+		}
+	}
+	assert_memory_equal(decompressed.data,
+			    original.data,
+			    original.length);
+	TALLOC_FREE(dstream);
+
+	data_blob_free(&compressed);
+	data_blob_free(&decompressed);
+	return comp_size;
+}
+
+
+static void test_lzxpress_huffman_stream_round_trip(void **state)
+{
+	size_t i, j;
+	TALLOC_CTX *mem_ctx = talloc_new(NULL);
+	DATA_BLOB original = data_blob_talloc(mem_ctx, NULL, 1024 * 1024 + 7);
+	uint8_t *d = original.data;
+	struct jsf_rng rng;
+	static const size_t lengths[] = {
+		1, 3, 41, 4096, 65535, 65536, 65537,
+		3 * 65536, 3 * 65536 + 100, 1024 * 1024 + 7,
+	};
+	static const size_t chunks[] = {
+		1000, 65536, 100000, 1024 * 1024 + 7,
+	};
+	static const unsigned threads[] = { 0, 1, 4 };
+
+	/*
+	 * Runs of repeated text with some noise, so that there are plenty
+	 * of matches, including some across the block boundaries.
+	 */
+	jsf32_init(&rng, 2);
+	for (i = 0; i < original.length; i++) {
+		uint32_t r = jsf32(&rng);
+		if (i > 100 && (r & 7) != 0) {
+			d[i] = d[i - 100 + (r >> 29)];
+		} else {
+			d[i] = 'a' + (r >> 8) % 26;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+		DATA_BLOB in = data_blob_const(original.data, lengths[i]);
+		for (j = 0; j < ARRAY_SIZE(chunks); j++) {
+			size_t k;
+			if (j != 0 && chunks[j] > in.length * 2) {
+				continue;
+			}
+			for (k = 0; k < ARRAY_SIZE(threads); k++) {
+				ssize_t slow, fast;
+				slow = attempt_stream_round_trip(mem_ctx,
+								 in,
+								 0,
+								 threads[k],
+								 chunks[j]);
+				fast = attempt_stream_round_trip(
+					mem_ctx,
+					in,
+					LZXHUFF_COMPRESS_FAST,
+					threads[k],
+					chunks[j]);
+				debug_message("len %zu chunk %zu threads %u: "
+					      "%zd, fast %zd\n",
+					      in.length, chunks[j],
+					      threads[k], slow, fast);
+				assert_true(slow > 0);
+				assert_true(fast > 0);
+				if (in.length > 4096) {
+					assert_true(slow < in.length);
+					assert_true(fast < in.length);
+				}
+			}
+		}
+	}
+
+	talloc_free(mem_ctx);
+}
+
+
+static void test_lzxpress_huffman_stream_same_output(void **state)
+{
+	/*
+	 * The output does not depend on how the input is chunked or on the
+	 * number of threads.
+	 */
+	size_t i;
+	TALLOC_CTX *mem_ctx = talloc_new(NULL);
+	DATA_BLOB original = data_blob_talloc(mem_ctx, NULL, 500000);
+	DATA_BLOB ref = data_blob_talloc(mem_ctx, NULL, 600000);
+	DATA_BLOB out = data_blob_talloc(mem_ctx, NULL, 600000);
+	struct lzxhuff_compress_stream *cstream = NULL;
+	struct jsf_rng rng;
+	ssize_t ref_size, out_size, ret;
+
+	jsf32_init(&rng, 3);
+	for (i = 0; i < original.length; i++) {
+		original.data[i] = "abcdefgh"[jsf32(&rng) % 8];
+	}
+
+	cstream = lzxpress_huffman_compress_stream_init(mem_ctx, 0, 0);
+	assert_non_null(cstream);
+	ref_size = lzxpress_huffman_compress_stream(cstream,
+						    original.data,
+						    original.length,
+						    true,
+						    ref.data,
+						    ref.length);
+	assert_true(ref_size > 0);
+	TALLOC_FREE(cstream);
+
+	cstream = lzxpress_huffman_compress_stream_init(mem_ctx, 0, 3);
+	assert_non_null(cstream);
+	out_size = 0;
+	for (i = 0; i < original.length; i += 12345) {
+		size_t len = MIN(12345, original.length - i);
+		ret = lzxpress_huffman_compress_stream(
+			cstream,
+			original.data + i,
+			len,
+			i + len == original.length,
+			out.data + out_size,
+			out.length - out_size);
+		assert_true(ret >= 0);
+		out_size += ret;
+	}
+	TALLOC_FREE(cstream);
+
+	assert_int_equal(out_size, ref_size);
+	assert_memory_equal(out.data, ref.data, ref_size);
+
+	talloc_free(mem_ctx);
+}
+
+
+static void test_lzxpress_huffman_stream_bad_input(void **state)
+{
+	TALLOC_CTX *mem_ctx = talloc_new(NULL);
+	struct lzxhuff_compress_stream *cstream = NULL;
+	struct lzxhuff_decompress_stream *dstream = NULL;
+	uint8_t input[300] = {0};
+	uint8_t output[1000];
+	ssize_t ret;
+
+	cstream = lzxpress_huffman_compress_stream_init(mem_ctx, 0xff, 0);
+	assert_null(cstream);
+
+	cstream = lzxpress_huffman_compress_stream_init(mem_ctx, 0, 0);
+	assert_non_null(cstream);
+	/* empty input is not allowed */
+	ret = lzxpress_huffman_compress_stream(cstream, NULL, 0, true,
+					       output, sizeof(output));
+	assert_int_equal(ret, -1LL);
+	TALLOC_FREE(cstream);
+
+	cstream = lzxpress_huffman_compress_stream_init(mem_ctx, 0, 0);
+	assert_non_null(cstream);
+	/* no room, but the stream is still usable after final */
+	ret = lzxpress_huffman_compress_stream(cstream, input, sizeof(input),
+					       true, output, 100);
+	assert_int_equal(ret, -1LL);
+	ret = lzxpress_huffman_compress_stream(cstream, input, sizeof(input),
+					       true, output, sizeof(output));
+	assert_true(ret > 0);
+	TALLOC_FREE(cstream);
+
+	dstream = lzxpress_huffman_decompress_stream_init(mem_ctx, NULL, 10);
+	assert_null(dstream);
+
+	/* a table of zeroes is garbage */
+	dstream = lzxpress_huffman_decompress_stream_init(mem_ctx,
+							  output,
+							  sizeof(output));
+	assert_non_null(dstream);
+	ret = lzxpress_huffman_decompress_stream(dstream, input, 100, false);
+	assert_int_equal(ret, 0);
+	ret = lzxpress_huffman_decompress_stream(dstream,
+						 input + 100,
+						 sizeof(input) - 100,
+						 true);
+	assert_int_equal(ret, -1LL);
+	ret = lzxpress_huffman_decompress_stream(dstream, input, 1, true);
+	assert_int_equal(ret, -1LL);
+	TALLOC_FREE(dstream);
+
+	talloc_free(mem_ctx);
+}
+
+
 int main(void) {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_lzxpress_huffman_short_boring_strings),
@@ -1246,6 +1533,9 @@ int main(void) {
 		cmocka_unit_test(test_lzxpress_huffman_overlong_matches),
 		cmocka_unit_test(test_lzxpress_huffman_decompress_empty_or_null),
 		cmocka_unit_test(test_lzxpress_huffman_compress_empty_or_null),
+		cmocka_unit_test(test_lzxpress_huffman_stream_round_trip),
+		cmocka_unit_test(test_lzxpress_huffman_stream_same_output),
+		cmocka_unit_test(test_lzxpress_huffman_stream_bad_input),
 	};
 	if (!isatty(1)) {
 		cmocka_set_message_output(CM_OUTPUT_SUBUNIT);
@@ -0,0 +1,1080 @@
+/*
+   Unix SMB/CIFS implementation.
+   Database interface wrapper around an in-memory B+tree
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "dbwrap/dbwrap.h"
+#include "dbwrap/dbwrap_private.h"
+#include "dbwrap/dbwrap_btree.h"
+#include "lib/util/bytearray.h"
+
+/*
+ * A B+tree with the records hanging off the leaves. Next to the
+ * record pointer every slot carries the first 8 bytes of its key as a
+ * big endian integer, so a lookup mostly compares integers inside one
+ * node and only looks at record keys when the prefixes are equal.
+ *
+ * The tree nodes are carved out of slabs and recycled through a free
+ * list, the leaves are chained for traverse. In an interior node the
+ * slot i > 0 points at the smallest record below children[i], slot 0
+ * is never looked at. Deleting does not merge nodes, it only drops
+ * the ones that became empty.
+ */
+
+#define DBWRAP_BTREE_ALIGN(_size_) (((_size_)+15)&~15)
+
+#define DB_BTREE_SLOTS 15
+#define DB_BTREE_SLAB 64
+#define DB_BTREE_MAX_HEIGHT 24
+
+/* The structure that holds a record */
+
+struct db_btree_entry {
+	size_t keysize, valuesize;
+};
+
+struct db_btree_node {
+	uint64_t prefix[DB_BTREE_SLOTS];
+	uint16_t num;
+	bool leaf;
+	struct db_btree_entry *entries[DB_BTREE_SLOTS];
+	union {
+		struct db_btree_node *children[DB_BTREE_SLOTS];
+		struct {
+			struct db_btree_node *prev, *next;
+		} chain;
+	} u;
+};
+
+struct db_btree_ctx {
+	struct db_btree_node *root;
+	unsigned height;
+
+	struct db_btree_node *free_nodes;
+	size_t num_free;
+
+	/*
+	 * Bumped whenever a record is added, removed or moved, so a
+	 * traverse knows when it has to look up its position again.
+	 */
+	uint64_t generation;
+
+	size_t traverse_read;
+	struct db_btree_entry *traverse_entry;
+	bool traverse_entry_gone;
+};
+
+struct db_btree_path {
+	struct db_btree_node *nodes[DB_BTREE_MAX_HEIGHT];
+	unsigned idx[DB_BTREE_MAX_HEIGHT];
+};
+
+struct db_btree_rec {
+	struct db_btree_entry *entry;
+
+	/*
+	 * Where fetch_locked found the key, saves the second lookup
+	 * in store and delete while nobody changed the tree
+	 */
+	bool have_path;
+	uint64_t generation;
+	struct db_btree_path path;
+};
+
+/*
+ * Compare two keys
+ */
+
+static int db_btree_compare(TDB_DATA a, TDB_DATA b)
+{
+	int res;
+
+	res = memcmp(a.dptr, b.dptr, MIN(a.dsize, b.dsize));
+
+	if ((res < 0) || ((res == 0) && (a.dsize < b.dsize))) {
+		return -1;
+	}
+	if ((res > 0) || ((res == 0) && (a.dsize > b.dsize))) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Zero-padded, so comparing prefixes never contradicts
+ * db_btree_compare()
+ */
+
+static uint64_t db_btree_prefix(TDB_DATA key)
+{
+	uint8_t buf[8] = { 0 };
+
+	if (key.dsize > 0) {
+		memcpy(buf, key.dptr, MIN(key.dsize, sizeof(buf)));
+	}
+	return PULL_BE_U64(buf, 0);
+}
+
+/*
+ * dissect a db_btree_entry into its implicit key and value parts
+ */
+
+static void db_btree_parse_entry(struct db_btree_entry *entry,
+				 TDB_DATA *key, TDB_DATA *value)
+{
+	size_t key_offset, value_offset;
+
+	key_offset = DBWRAP_BTREE_ALIGN(sizeof(struct db_btree_entry));
+	key->dptr = ((uint8_t *)entry) + key_offset;
+	key->dsize = entry->keysize;
+
+	value_offset = DBWRAP_BTREE_ALIGN(entry->keysize);
+	value->dptr = key->dptr + value_offset;
+	value->dsize = entry->valuesize;
+}
+
+static ssize_t db_btree_entrylen(size_t keylen, size_t valuelen)
+{
+	size_t len, tmp;
+
+	len = DBWRAP_BTREE_ALIGN(sizeof(struct db_btree_entry));
+
+	tmp = DBWRAP_BTREE_ALIGN(keylen);
+	if (tmp < keylen) {
+		goto overflow;
+	}
+
+	len += tmp;
+	if (len < tmp) {
+		goto overflow;
+	}
+
+	len += valuelen;
+	if (len < valuelen) {
+		goto overflow;
+	}
+
+	return len;
+overflow:
+	return -1;
+}
+
+static int db_btree_compare_slot(const struct db_btree_node *node,
+				 unsigned idx, TDB_DATA key, uint64_t prefix)
+{
+	TDB_DATA slot_key, slot_val;
+
+	if (prefix != node->prefix[idx]) {
+		return (prefix < node->prefix[idx]) ? -1 : 1;
+	}
+
+	db_btree_parse_entry(node->entries[idx], &slot_key, &slot_val);
+	return db_btree_compare(key, slot_key);
+}
+
+/*
+ * In a leaf, return the first slot not smaller than key. In an
+ * interior node, return the child key belongs to.
+ */
+
+static unsigned db_btree_node_find(const struct db_btree_node *node,
+				   TDB_DATA key, uint64_t prefix,
+				   bool *exact)
+{
+	unsigned lo, hi;
+
+	*exact = false;
+
+	if (node->leaf) {
+		lo = 0;
+		hi = node->num;
+
+		while (lo < hi) {
+			unsigned mid = (lo + hi) / 2;
+			int res = db_btree_compare_slot(node, mid, key, prefix);
+
+			if (res == 0) {
+				*exact = true;
+				return mid;
+			}
+			if (res < 0) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
+		return lo;
+	}
+
+	lo = 1;
+	hi = node->num;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		int res = db_btree_compare_slot(node, mid, key, prefix);
+
+		if (res == 0) {
+			return mid;
+		}
+		if (res < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return lo - 1;
+}
+
+static struct db_btree_entry *db_btree_find(struct db_btree_ctx *ctx,
+					    TDB_DATA key)
+{
+	uint64_t prefix = db_btree_prefix(key);
+	struct db_btree_node *node = ctx->root;
+	unsigned idx;
+	bool exact;
+
+	if (node == NULL) {
+		return NULL;
+	}
+
+	while (!node->leaf) {
+		idx = db_btree_node_find(node, key, prefix, &exact);
+		node = node->u.children[idx];
+	}
+
+	idx = db_btree_node_find(node, key, prefix, &exact);
+	if (!exact) {
+		return NULL;
+	}
+	return node->entries[idx];
+}
+
+/*
+ * Walk down to the leaf key belongs to, remembering the way
+ */
+
+static bool db_btree_descend(struct db_btree_ctx *ctx, TDB_DATA key,
+			     struct db_btree_path *path)
+{
+	uint64_t prefix = db_btree_prefix(key);
+	struct db_btree_node *node = ctx->root;
+	bool exact = false;
+	unsigned level;
+
+	for (level = 0; level < ctx->height; level++) {
+		unsigned idx = db_btree_node_find(node, key, prefix, &exact);
+
+		path->nodes[level] = node;
+		path->idx[level] = idx;
+
+		if (!node->leaf) {
+			node = node->u.children[idx];
+		}
+	}
+
+	return exact;
+}
+
+/*
+ * Make sure a store can't fail halfway through splitting nodes
+ */
+
+static bool db_btree_reserve(struct db_btree_ctx *ctx, size_t num)
+{
+	struct db_btree_node *slab;
+	size_t i;
+
+	if (ctx->num_free >= num) {
+		return true;
+	}
+
+	slab = talloc_array(ctx, struct db_btree_node, DB_BTREE_SLAB);
+	if (slab == NULL) {
+		return false;
+	}
+
+	for (i=0; i<DB_BTREE_SLAB; i++) {
+		slab[i].u.chain.next = ctx->free_nodes;
+		ctx->free_nodes = &slab[i];
+	}
+	ctx->num_free += DB_BTREE_SLAB;
+
+	return true;
+}
+
+static struct db_btree_node *db_btree_node_get(struct db_btree_ctx *ctx,
+					       bool leaf)
+{
+	struct db_btree_node *node = ctx->free_nodes;
+
+	SMB_ASSERT(node != NULL);
+
+	ctx->free_nodes = node->u.chain.next;
+	ctx->num_free -= 1;
+
+	*node = (struct db_btree_node) { .leaf = leaf };
+	return node;
+}
+
+static void db_btree_node_put(struct db_btree_ctx *ctx,
+			      struct db_btree_node *node)
+{
+	node->u.chain.next = ctx->free_nodes;
+	ctx->free_nodes = node;
+	ctx->num_free += 1;
+}
+
+static void db_btree_slot_insert(struct db_btree_node *node, unsigned idx,
+				 uint64_t prefix,
+				 struct db_btree_entry *entry,
+				 struct db_btree_node *child)
+{
+	unsigned num = node->num - idx;
+
+	memmove(&node->prefix[idx+1], &node->prefix[idx],
+		num * sizeof(node->prefix[0]));
+	memmove(&node->entries[idx+1], &node->entries[idx],
+		num * sizeof(node->entries[0]));
+	node->prefix[idx] = prefix;
+	node->entries[idx] = entry;
+
+	if (!node->leaf) {
+		memmove(&node->u.children[idx+1], &node->u.children[idx],
+			num * sizeof(node->u.children[0]));
+		node->u.children[idx] = child;
+	}
+
+	node->num += 1;
+}
+
+static void db_btree_slot_remove(struct db_btree_node *node, unsigned idx)
+{
+	unsigned num = node->num - idx - 1;
+
+	memmove(&node->prefix[idx], &node->prefix[idx+1],
+		num * sizeof(node->prefix[0]));
+	memmove(&node->entries[idx], &node->entries[idx+1],
+		num * sizeof(node->entries[0]));
+
+	if (!node->leaf) {
+		memmove(&node->u.children[idx], &node->u.children[idx+1],
+			num * sizeof(node->u.children[0]));
+	}
+
+	node->num -= 1;
+}
+
+/*
+ * The interior slot pointing at the smallest entry of the leaf at the
+ * end of path, -1 if that leaf is the leftmost one
+ */
+
+static int db_btree_separator(struct db_btree_ctx *ctx,
+			      const struct db_btree_path *path)
+{
+	int level;
+
+	for (level = ctx->height - 2; level >= 0; level--) {
+		if (path->idx[level] != 0) {
+			return level;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Insert entry at the position db_btree_descend() found, splitting
+ * full nodes on the way up. The caller has reserved the nodes.
+ */
+
+static void db_btree_insert(struct db_btree_ctx *ctx,
+			    struct db_btree_path *path,
+			    struct db_btree_entry *entry, uint64_t prefix)
+{
+	struct db_btree_node *child = NULL;
+	unsigned level, idx;
+
+	if (ctx->root == NULL) {
+		ctx->root = db_btree_node_get(ctx, true);
+		ctx->height = 1;
+		path->nodes[0] = ctx->root;
+		path->idx[0] = 0;
+	}
+
+	level = ctx->height - 1;
+	idx = path->idx[level];
+
+	while (true) {
+		struct db_btree_node *node = path->nodes[level];
+		struct db_btree_node *right, *root;
+		unsigned half;
+
+		if (node->num < DB_BTREE_SLOTS) {
+			db_btree_slot_insert(node, idx, prefix, entry, child);
+			return;
+		}
+
+		right = db_btree_node_get(ctx, node->leaf);
+
+		half = (DB_BTREE_SLOTS + 1) / 2;
+		right->num = node->num - half;
+		node->num = half;
+
+		memcpy(right->prefix, &node->prefix[half],
+		       right->num * sizeof(right->prefix[0]));
+		memcpy(right->entries, &node->entries[half],
+		       right->num * sizeof(right->entries[0]));
+
+		if (node->leaf) {
+			right->u.chain.prev = node;
+			right->u.chain.next = node->u.chain.next;
+			if (right->u.chain.next != NULL) {
+				right->u.chain.next->u.chain.prev = right;
+			}
+			node->u.chain.next = right;
+		} else {
+			memcpy(right->u.children, &node->u.children[half],
+			       right->num * sizeof(right->u.children[0]));
+		}
+
+		/*
+		 * Never insert at slot 0 of the new node, that one is
+		 * the separator we hand up
+		 */
+		if (idx <= half) {
+			db_btree_slot_insert(node, idx, prefix, entry, child);
+		} else {
+			db_btree_slot_insert(right, idx - half, prefix, entry,
+					     child);
+		}
+
+		prefix = right->prefix[0];
+		entry = right->entries[0];
+		child = right;
+
+		if (level > 0) {
+			level -= 1;
+			idx = path->idx[level] + 1;
+			continue;
+		}
+
+		SMB_ASSERT(ctx->height < DB_BTREE_MAX_HEIGHT);
+
+		root = db_btree_node_get(ctx, false);
+		root->num = 2;
+		root->prefix[0] = node->prefix[0];
+		root->entries[0] = node->entries[0];
+		root->u.children[0] = node;
+		root->prefix[1] = prefix;
+		root->entries[1] = entry;
+		root->u.children[1] = child;
+
+		ctx->root = root;
+		ctx->height += 1;
+		return;
+	}
+}
+
+/*
+ * Remove the entry db_btree_descend() found
+ */
+
+static void db_btree_remove(struct db_btree_ctx *ctx,
+			    struct db_btree_path *path)
+{
+	unsigned level = ctx->height - 1;
+	struct db_btree_node *leaf = path->nodes[level];
+	unsigned idx = path->idx[level];
+	struct db_btree_entry *next = NULL;
+	uint64_t next_prefix = 0;
+	int sep = -1;
+
+	if (idx == 0) {
+		/*
+		 * The successor becomes the smallest entry of the
+		 * subtree the separator describes
+		 */
+		sep = db_btree_separator(ctx, path);
+
+		if (leaf->num > 1) {
+			next = leaf->entries[1];
+			next_prefix = leaf->prefix[1];
+		} else if (leaf->u.chain.next != NULL) {
+			next = leaf->u.chain.next->entries[0];
+			next_prefix = leaf->u.chain.next->prefix[0];
+		}
+	}
+
+	db_btree_slot_remove(leaf, idx);
+
+	while ((level > 0) && (path->nodes[level]->num == 0)) {
+		struct db_btree_node *node = path->nodes[level];
+
+		if (node->leaf) {
+			struct db_btree_node *prev = node->u.chain.prev;
+			struct db_btree_node *nxt = node->u.chain.next;
+
+			if (prev != NULL) {
+				prev->u.chain.next = nxt;
+			}
+			if (nxt != NULL) {
+				nxt->u.chain.prev = prev;
+			}
+		}
+		db_btree_node_put(ctx, node);
+
+		level -= 1;
+		db_btree_slot_remove(path->nodes[level], path->idx[level]);
+	}
+
+	/*
+	 * If the cascade reached the separator's level, the separator
+	 * went away together with its child
+	 */
+	if ((sep != -1) && ((unsigned)sep < level)) {
+		SMB_ASSERT(next != NULL);
+		path->nodes[sep]->prefix[path->idx[sep]] = next_prefix;
+		path->nodes[sep]->entries[path->idx[sep]] = next;
+	}
+
+	if (ctx->root->num == 0) {
+		db_btree_node_put(ctx, ctx->root);
+		ctx->root = NULL;
+		ctx->height = 0;
+		return;
+	}
+
+	while (!ctx->root->leaf && (ctx->root->num == 1)) {
+		struct db_btree_node *root = ctx->root;
+
+		ctx->root = root->u.children[0];
+		ctx->height -= 1;
+		db_btree_node_put(ctx, root);
+	}
+}
+
+/*
+ * Point the slot db_btree_descend() found to a reallocated entry for
+ * the same key
+ */
+
+static void db_btree_replace(struct db_btree_ctx *ctx,
+			     struct db_btree_path *path,
+			     struct db_btree_entry *entry)
+{
+	unsigned level = ctx->height - 1;
+	unsigned idx = path->idx[level];
+	int sep;
+
+	path->nodes[level]->entries[idx] = entry;
+
+	if (idx != 0) {
+		return;
+	}
+
+	sep = db_btree_separator(ctx, path);
+	if (sep != -1) {
+		path->nodes[sep]->entries[path->idx[sep]] = entry;
+	}
+}
+
+/*
+ * A traverse still needs the key of the entry it handed out
+ */
+
+static void db_btree_entry_free(struct db_btree_ctx *ctx,
+				struct db_btree_entry *entry)
+{
+	if (entry == ctx->traverse_entry) {
+		ctx->traverse_entry_gone = true;
+		return;
+	}
+	TALLOC_FREE(entry);
+}
+
+static NTSTATUS db_btree_storev(struct db_record *rec,
+				const TDB_DATA *dbufs, int num_dbufs, int flag)
+{
+	struct db_btree_ctx *db_ctx = talloc_get_type_abort(
+		rec->db->private_data, struct db_btree_ctx);
+	struct db_btree_rec *rec_priv = (struct db_btree_rec *)rec->private_data;
+	struct db_btree_entry *entry;
+	ssize_t entrylen;
+	TDB_DATA data, this_key, this_val;
+	void *to_free = NULL;
+	bool exact;
+
+	if (db_ctx->traverse_read > 0) {
+		return NT_STATUS_MEDIA_WRITE_PROTECTED;
+	}
+
+	if ((flag == TDB_INSERT) && (rec_priv->entry != NULL)) {
+		return NT_STATUS_OBJECT_NAME_COLLISION;
+	}
+
+	if ((flag == TDB_MODIFY) && (rec_priv->entry == NULL)) {
+		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+
+	if (num_dbufs == 1) {
+		data = dbufs[0];
+	} else {
+		NTSTATUS status;
+
+		data = (TDB_DATA) {0};
+		status = dbwrap_merge_dbufs(&data, rec, dbufs, num_dbufs);
+		if (!NT_STATUS_IS_OK(status)) {
+			return status;
+		}
+		to_free = data.dptr;
+	}
+
+	if (rec_priv->entry != NULL) {
+
+		/*
+		 * The record was around previously
+		 */
+
+		db_btree_parse_entry(rec_priv->entry, &this_key, &this_val);
+
+		SMB_ASSERT(this_key.dsize == rec->key.dsize);
+		SMB_ASSERT(memcmp(this_key.dptr, rec->key.dptr,
+				  this_key.dsize) == 0);
+
+		if (this_val.dsize >= data.dsize) {
+			/*
+			 * The new value fits into the old space
+			 */
+			memcpy(this_val.dptr, data.dptr, data.dsize);
+			rec_priv->entry->valuesize = data.dsize;
+			TALLOC_FREE(to_free);
+			return NT_STATUS_OK;
+		}
+	}
+
+	entrylen = db_btree_entrylen(rec->key.dsize, data.dsize);
+	if (entrylen == -1) {
+		TALLOC_FREE(to_free);
+		return NT_STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (!db_btree_reserve(db_ctx, db_ctx->height + 1)) {
+		TALLOC_FREE(to_free);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	entry = talloc_size(db_ctx, entrylen);
+	if (entry == NULL) {
+		TALLOC_FREE(to_free);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	entry->keysize = rec->key.dsize;
+	entry->valuesize = data.dsize;
+
+	db_btree_parse_entry(entry, &this_key, &this_val);
+
+	memcpy(this_key.dptr, rec->key.dptr, entry->keysize);
+	if (entry->valuesize > 0) {
+		memcpy(this_val.dptr, data.dptr, entry->valuesize);
+	}
+
+	if (rec_priv->have_path &&
+	    (rec_priv->generation == db_ctx->generation)) {
+		exact = (rec_priv->entry != NULL);
+	} else {
+		exact = db_btree_descend(db_ctx, this_key, &rec_priv->path);
+	}
+	rec_priv->have_path = false;
+
+	if (rec_priv->entry != NULL) {
+		/*
+		 * Not enough space in the existing entry, swap in the
+		 * new one. rec->key pointed into the old one.
+		 */
+		SMB_ASSERT(exact);
+		db_btree_replace(db_ctx, &rec_priv->path, entry);
+		db_btree_entry_free(db_ctx, rec_priv->entry);
+		rec->key = this_key;
+	} else {
+		if (exact) {
+			smb_panic("someone messed with the tree");
+		}
+		db_btree_insert(db_ctx, &rec_priv->path, entry,
+				db_btree_prefix(this_key));
+	}
+
+	rec_priv->entry = entry;
+	db_ctx->generation += 1;
+
+	TALLOC_FREE(to_free);
+
+	return NT_STATUS_OK;
+}
+
+static NTSTATUS db_btree_delete(struct db_record *rec)
+{
+	struct db_btree_ctx *db_ctx = talloc_get_type_abort(
+		rec->db->private_data, struct db_btree_ctx);
+	struct db_btree_rec *rec_priv = (struct db_btree_rec *)rec->private_data;
+	bool exact;
+
+	if (db_ctx->traverse_read > 0) {
+		return NT_STATUS_MEDIA_WRITE_PROTECTED;
+	}
+
+	if (rec_priv->entry == NULL) {
+		return NT_STATUS_OK;
+	}
+
+	if (!rec_priv->have_path ||
+	    (rec_priv->generation != db_ctx->generation)) {
+		exact = db_btree_descend(db_ctx, rec->key, &rec_priv->path);
+		SMB_ASSERT(exact);
+	}
+	rec_priv->have_path = false;
+
+	db_btree_remove(db_ctx, &rec_priv->path);
+	db_btree_entry_free(db_ctx, rec_priv->entry);
+	rec_priv->entry = NULL;
+
+	db_ctx->generation += 1;
+
+	return NT_STATUS_OK;
+}
+
+static struct db_record *db_btree_fetch_locked(struct db_context *db_ctx,
+					       TALLOC_CTX *mem_ctx,
+					       TDB_DATA key)
+{
+	struct db_btree_ctx *ctx = talloc_get_type_abort(
+		db_ctx->private_data, struct db_btree_ctx);
+	struct db_btree_rec *rec_priv;
+	struct db_btree_entry *entry = NULL;
+	struct db_btree_path path;
+	struct db_record *result;
+	size_t size;
+	bool exact;
+
+	exact = db_btree_descend(ctx, key, &path);
+	if (exact) {
+		unsigned level = ctx->height - 1;
+		entry = path.nodes[level]->entries[path.idx[level]];
+	}
+
+	/*
+	 * Like dbwrap_rbt, one talloc for the record, its private
+	 * data and the key of a new record
+	 */
+
+	size = DBWRAP_BTREE_ALIGN(sizeof(struct db_record))
+		+ sizeof(struct db_btree_rec);
+
+	if (entry == NULL) {
+		size += key.dsize;
+	}
+
+	result = (struct db_record *)talloc_size(mem_ctx, size);
+	if (result == NULL) {
+		return NULL;
+	}
+
+	rec_priv = (struct db_btree_rec *)
+		((char *)result + DBWRAP_BTREE_ALIGN(sizeof(struct db_record)));
+
+	result->storev = db_btree_storev;
+	result->delete_rec = db_btree_delete;
+	result->private_data = rec_priv;
+
+	rec_priv->entry = entry;
+	rec_priv->have_path = true;
+	rec_priv->generation = ctx->generation;
+	rec_priv->path = path;
+	result->value_valid = true;
+
+	if (entry != NULL) {
+		db_btree_parse_entry(entry, &result->key, &result->value);
+	} else {
+		result->key.dptr = (uint8_t *)
+			((char *)rec_priv + sizeof(*rec_priv));
+		result->key.dsize = key.dsize;
+		memcpy(result->key.dptr, key.dptr, key.dsize);
+		result->value = (TDB_DATA) { .dptr = NULL };
+	}
+
+	return result;
+}
+
+static int db_btree_exists(struct db_context *db, TDB_DATA key)
+{
+	struct db_btree_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_btree_ctx);
+
+	return (db_btree_find(ctx, key) != NULL);
+}
+
+static int db_btree_wipe(struct db_context *db)
+{
+	struct db_btree_ctx *old_ctx = talloc_get_type_abort(
+		db->private_data, struct db_btree_ctx);
+	struct db_btree_ctx *new_ctx = talloc_zero(db, struct db_btree_ctx);
+	if (new_ctx == NULL) {
+		return -1;
+	}
+	/* records fetched before must not use their path */
+	new_ctx->generation = old_ctx->generation + 1;
+	db->private_data = new_ctx;
+	talloc_free(old_ctx);
+	return 0;
+}
+
+static NTSTATUS db_btree_parse_record(struct db_context *db, TDB_DATA key,
+				      void (*parser)(TDB_DATA key,
+						     TDB_DATA data,
+						     void *private_data),
+				      void *private_data)
+{
+	struct db_btree_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_btree_ctx);
+	struct db_btree_entry *entry;
+	TDB_DATA entry_key, entry_val;
+
+	entry = db_btree_find(ctx, key);
+	if (entry == NULL) {
+		return NT_STATUS_NOT_FOUND;
+	}
+
+	db_btree_parse_entry(entry, &entry_key, &entry_val);
+	parser(entry_key, entry_val, private_data);
+	return NT_STATUS_OK;
+}
+
+/*
+ * Position behind key, for a traverse whose callback changed the tree
+ */
+
+static void db_btree_seek_after(struct db_btree_ctx *ctx, TDB_DATA key,
+				struct db_btree_node **pleaf, unsigned *pidx)
+{
+	struct db_btree_path path;
+	unsigned level;
+	bool exact;
+
+	if (ctx->root == NULL) {
+		*pleaf = NULL;
+		*pidx = 0;
+		return;
+	}
+
+	exact = db_btree_descend(ctx, key, &path);
+	level = ctx->height - 1;
+
+	*pleaf = path.nodes[level];
+	*pidx = path.idx[level] + (exact ? 1 : 0);
+}
+
+static int db_btree_traverse_internal(struct db_context *db,
+				      int (*f)(struct db_record *db,
+					       void *private_data),
+				      void *private_data, uint32_t *count,
+				      bool rw)
+{
+	struct db_btree_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_btree_ctx);
+	struct db_btree_node *leaf = ctx->root;
+	unsigned idx = 0;
+	int ret;
+
+	if (leaf != NULL) {
+		while (!leaf->leaf) {
+			leaf = leaf->u.children[0];
+		}
+	}
+
+	while (leaf != NULL) {
+		struct db_btree_entry *entry;
+		struct db_record rec;
+		struct db_btree_rec rec_priv;
+		uint64_t generation;
+		TDB_DATA key;
+
+		if (idx == leaf->num) {
+			leaf = leaf->u.chain.next;
+			idx = 0;
+			continue;
+		}
+
+		entry = leaf->entries[idx];
+		rec_priv.entry = entry;
+		rec_priv.have_path = false;
+
+		ZERO_STRUCT(rec);
+		rec.db = db;
+		rec.private_data = &rec_priv;
+		rec.storev = db_btree_storev;
+		rec.delete_rec = db_btree_delete;
+		db_btree_parse_entry(entry, &rec.key, &rec.value);
+		rec.value_valid = true;
+
+		if (!rw) {
+			/*
+			 * Nobody can change the tree, just walk the
+			 * leaves
+			 */
+			ret = f(&rec, private_data);
+			(*count) ++;
+			if (ret != 0) {
+				return ret;
+			}
+			idx += 1;
+			continue;
+		}
+
+		key = rec.key;
+		generation = ctx->generation;
+
+		ctx->traverse_entry = entry;
+		ret = f(&rec, private_data);
+		(*count) ++;
+		ctx->traverse_entry = NULL;
+
+		if (ctx->generation == generation) {
+			idx += 1;
+		} else {
+			db_btree_seek_after(ctx, key, &leaf, &idx);
+		}
+
+		if (ctx->traverse_entry_gone) {
+			ctx->traverse_entry_gone = false;
+			TALLOC_FREE(entry);
+		}
+
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int db_btree_traverse_read(struct db_context *db,
+				  int (*f)(struct db_record *db,
+					   void *private_data),
+				  void *private_data)
+{
+	struct db_btree_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_btree_ctx);
+	uint32_t count = 0;
+	int ret;
+
+	ctx->traverse_read++;
+	ret = db_btree_traverse_internal(db,
+					 f, private_data, &count,
+					 false /* rw */);
+	ctx->traverse_read--;
+	if (ret != 0) {
+		return -1;
+	}
+	if (count > INT_MAX) {
+		return -1;
+	}
+	return count;
+}
+
+static int db_btree_traverse(struct db_context *db,
+			     int (*f)(struct db_record *db,
+				      void *private_data),
+			     void *private_data)
+{
+	struct db_btree_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_btree_ctx);
+	uint32_t count = 0;
+	int ret;
+
+	if (ctx->traverse_entry != NULL) {
+		return -1;
+	}
+
+	if (ctx->traverse_read > 0) {
+		return db_btree_traverse_read(db, f, private_data);
+	}
+
+	ret = db_btree_traverse_internal(db,
+					 f, private_data, &count,
+					 true /* rw */);
+	if (ret != 0) {
+		return -1;
+	}
+	if (count > INT_MAX) {
+		return -1;
+	}
+	return count;
+}
+
+static int db_btree_get_seqnum(struct db_context *db)
+{
+	return 0;
+}
+
+static int db_btree_trans_dummy(struct db_context *db)
+{
+	/*
+	 * Transactions are pretty pointless in-memory, just return success.
+	 */
+	return 0;
+}
+
+static size_t db_btree_id(struct db_context *db, uint8_t *id, size_t idlen)
+{
+	if (idlen >= sizeof(struct db_context *)) {
+		memcpy(id, &db, sizeof(struct db_context *));
+	}
+	return sizeof(struct db_context *);
+}
+
+struct db_context *db_open_btree(TALLOC_CTX *mem_ctx)
+{
+	struct db_context *result;
+
+	result = talloc_zero(mem_ctx, struct db_context);
+
+	if (result == NULL) {
+		return NULL;
+	}
+
+	result->private_data = talloc_zero(result, struct db_btree_ctx);
+
+	if (result->private_data == NULL) {
+		TALLOC_FREE(result);
+		return NULL;
+	}
+
+	result->fetch_locked = db_btree_fetch_locked;
+	result->traverse = db_btree_traverse;
+	result->traverse_read = db_btree_traverse_read;
+	result->get_seqnum = db_btree_get_seqnum;
+	result->transaction_start = db_btree_trans_dummy;
+	result->transaction_commit = db_btree_trans_dummy;
+	result->transaction_cancel = db_btree_trans_dummy;
+	result->exists = db_btree_exists;
+	result->wipe = db_btree_wipe;
+	result->parse_record = db_btree_parse_record;
+	result->id = db_btree_id;
+	result->name = "dbwrap btree";
+
+	return result;
+}
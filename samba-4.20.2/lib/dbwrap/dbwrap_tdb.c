@@ -28,8 +28,10 @@
 #include "system/filesys.h"
 #include "lib/param/param.h"
 #include "libcli/util/error.h"
+#include "lib/util/dlinklist.h"
 
 struct db_tdb_ctx {
+	struct db_tdb_ctx *prev, *next;
 	struct tdb_wrap *wtdb;
 
 	struct {
@@ -38,6 +40,9 @@ struct db_tdb_ctx {
 	} id;
 };
 
+/* The TDB_REHASH databases, see dbwrap_tdb_rehash_if_wanted() */
+static struct db_tdb_ctx *db_tdb_rehashing;
+
 static NTSTATUS db_tdb_storev(struct db_record *rec,
 			      const TDB_DATA *dbufs, int num_dbufs, int flag);
 static NTSTATUS db_tdb_delete(struct db_record *rec);
@@ -454,6 +459,31 @@ static size_t db_tdb_id(struct db_context *db, uint8_t *id, size_t idlen)
 	return sizeof(db_ctx->id);
 }
 
+static int db_tdb_rehashing_destructor(struct db_tdb_ctx *db_tdb)
+{
+	DLIST_REMOVE(db_tdb_rehashing, db_tdb);
+	return 0;
+}
+
+int dbwrap_tdb_rehash_if_wanted(void)
+{
+	struct db_tdb_ctx *db_tdb = NULL;
+	int ret = 0;
+
+	for (db_tdb = db_tdb_rehashing; db_tdb != NULL; db_tdb = db_tdb->next) {
+		struct tdb_context *tdb = db_tdb->wtdb->tdb;
+
+		if (tdb_rehash_if_wanted(tdb) == -1) {
+			DBG_WARNING("Could not grow %s: %s\n",
+				    tdb_name(tdb),
+				    tdb_errorstr(tdb));
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
 struct db_context *db_open_tdb(TALLOC_CTX *mem_ctx,
 			       const char *name,
 			       int hash_size, int tdb_flags,
@@ -471,7 +501,7 @@ struct db_context *db_open_tdb(TALLOC_CTX *mem_ctx,
 		goto fail;
 	}
 
-	result->private_data = db_tdb = talloc(result, struct db_tdb_ctx);
+	result->private_data = db_tdb = talloc_zero(result, struct db_tdb_ctx);
 	if (db_tdb == NULL) {
 		DEBUG(0, ("talloc failed\n"));
 		goto fail;
@@ -494,6 +524,12 @@ struct db_context *db_open_tdb(TALLOC_CTX *mem_ctx,
 	db_tdb->id.dev = st.st_dev;
 	db_tdb->id.ino = st.st_ino;
 
+	if ((tdb_flags & TDB_REHASH) &&
+	    (tdb_get_flags(db_tdb->wtdb->tdb) & TDB_REHASH)) {
+		DLIST_ADD(db_tdb_rehashing, db_tdb);
+		talloc_set_destructor(db_tdb, db_tdb_rehashing_destructor);
+	}
+
 	result->fetch_locked = db_tdb_fetch_locked;
 	result->do_locked = db_tdb_do_locked;
 	result->traverse = db_tdb_traverse;
@@ -31,5 +31,10 @@ struct db_context *db_open_tdb(TALLOC_CTX *mem_ctx,
 			       enum dbwrap_lock_order lock_order,
 			       uint64_t dbwrap_flags);
 
+/*
+ * Grow the hash tables of all TDB_REHASH databases this process opened
+ * that asked for it, see tdb_rehash_if_wanted().
+ */
+int dbwrap_tdb_rehash_if_wanted(void);
 
 #endif /* __DBWRAP_TDB_H__ */
@@ -100,6 +100,8 @@ int ldb_schema_attribute_add_with_syntax(struct ldb_context *ldb,
 		return -1;
 	}
 	ldb->schema.attributes = a;
+	/* the realloc may have moved the table */
+	ldb->schema.generation++;
 
 	for (i = 0; i < ldb->schema.num_attributes; i++) {
 		int cmp = ldb_attr_cmp(attribute, a[i].name);
@@ -248,6 +250,7 @@ void ldb_schema_attribute_remove(struct ldb_context *ldb, const char *name)
 	}
 
 	ldb->schema.num_attributes--;
+	ldb->schema.generation++;
 }
 
 /*
@@ -280,6 +283,7 @@ void ldb_schema_attribute_remove_flagged(struct ldb_context *ldb, unsigned int f
 		}
 
 		ldb->schema.num_attributes--;
+		ldb->schema.generation++;
 	}
 }
 
@@ -382,6 +386,7 @@ void ldb_schema_attribute_set_override_handler(struct ldb_context *ldb,
 {
 	ldb->schema.attribute_handler_override_private = private_data;
 	ldb->schema.attribute_handler_override = override;
+	ldb->schema.generation++;
 }
 
 /*
@@ -83,9 +83,9 @@ int ldb_match_scope(struct ldb_context *ldb,
 static int ldb_match_present(struct ldb_context *ldb, 
 			     const struct ldb_message *msg,
 			     const struct ldb_parse_tree *tree,
-			     enum ldb_scope scope, bool *matched)
+			     const struct ldb_schema_attribute *a,
+			     bool *matched)
 {
-	const struct ldb_schema_attribute *a;
 	struct ldb_message_element *el;
 
 	if (ldb_attr_dn(tree->u.present.attr) == 0) {
@@ -99,7 +99,9 @@ static int ldb_match_present(struct ldb_context *ldb,
 		return LDB_SUCCESS;
 	}
 
-	a = ldb_schema_attribute_by_name(ldb, el->name);
+	if (a == NULL) {
+		a = ldb_schema_attribute_by_name(ldb, el->name);
+	}
 	if (!a) {
 		return LDB_ERR_INVALID_ATTRIBUTE_SYNTAX;
 	}
@@ -122,12 +124,11 @@ static int ldb_match_present(struct ldb_context *ldb,
 static int ldb_match_comparison(struct ldb_context *ldb, 
 				const struct ldb_message *msg,
 				const struct ldb_parse_tree *tree,
-				enum ldb_scope scope,
+				const struct ldb_schema_attribute *a,
 				enum ldb_parse_op comp_op, bool *matched)
 {
 	unsigned int i;
 	struct ldb_message_element *el;
-	const struct ldb_schema_attribute *a;
 
 	/* FIXME: APPROX comparison not handled yet */
 	if (comp_op == LDB_OP_APPROX) {
@@ -140,7 +141,9 @@ static int ldb_match_comparison(struct ldb_context *ldb,
 		return LDB_SUCCESS;
 	}
 
-	a = ldb_schema_attribute_by_name(ldb, el->name);
+	if (a == NULL) {
+		a = ldb_schema_attribute_by_name(ldb, el->name);
+	}
 	if (!a) {
 		return LDB_ERR_INVALID_ATTRIBUTE_SYNTAX;
 	}
@@ -175,28 +178,35 @@ static int ldb_match_comparison(struct ldb_context *ldb,
 
 /*
   match a simple leaf node
+
+  a and valuedn may be passed in pre-computed by a compiled filter
 */
 static int ldb_match_equality(struct ldb_context *ldb, 
 			      const struct ldb_message *msg,
 			      const struct ldb_parse_tree *tree,
-			      enum ldb_scope scope,
+			      const struct ldb_schema_attribute *a,
+			      struct ldb_dn *valuedn,
 			      bool *matched)
 {
 	unsigned int i;
 	struct ldb_message_element *el;
-	const struct ldb_schema_attribute *a;
-	struct ldb_dn *valuedn;
 	int ret;
 
 	if (ldb_attr_dn(tree->u.equality.attr) == 0) {
-		valuedn = ldb_dn_from_ldb_val(ldb, ldb, &tree->u.equality.value);
+		struct ldb_dn *to_free = NULL;
+
 		if (valuedn == NULL) {
-			return LDB_ERR_INVALID_DN_SYNTAX;
+			valuedn = ldb_dn_from_ldb_val(ldb, ldb,
+						      &tree->u.equality.value);
+			if (valuedn == NULL) {
+				return LDB_ERR_INVALID_DN_SYNTAX;
+			}
+			to_free = valuedn;
 		}
 
 		ret = ldb_dn_compare(msg->dn, valuedn);
 
-		talloc_free(valuedn);
+		talloc_free(to_free);
 
 		*matched = (ret == 0);
 		return LDB_SUCCESS;
@@ -210,7 +220,9 @@ static int ldb_match_equality(struct ldb_context *ldb,
 		return LDB_SUCCESS;
 	}
 
-	a = ldb_schema_attribute_by_name(ldb, el->name);
+	if (a == NULL) {
+		a = ldb_schema_attribute_by_name(ldb, el->name);
+	}
 	if (a == NULL) {
 		return LDB_ERR_INVALID_ATTRIBUTE_SYNTAX;
 	}
@@ -234,14 +246,47 @@ static int ldb_match_equality(struct ldb_context *ldb,
 	return LDB_SUCCESS;
 }
 
+/*
+  get chunk c of a substring filter in canonical form, either from the
+  pre-computed chunks of a compiled filter or by canonicalising it now
+*/
+static int ldb_wildcard_chunk(struct ldb_context *ldb,
+			      const struct ldb_schema_attribute *a,
+			      const struct ldb_parse_tree *tree,
+			      const struct ldb_val *chunks,
+			      unsigned int c,
+			      struct ldb_val *cnk,
+			      uint8_t **cnk_to_free)
+{
+	struct ldb_val *chunk = tree->u.substring.chunks[c];
+
+	*cnk_to_free = NULL;
+
+	if (chunks != NULL) {
+		*cnk = chunks[c];
+		return 0;
+	}
+
+	/* No need to just copy this value for a binary match */
+	if (a->syntax->canonicalise_fn != ldb_handler_copy) {
+		if (a->syntax->canonicalise_fn(ldb, ldb, chunk, cnk) != 0) {
+			return -1;
+		}
+		*cnk_to_free = cnk->data;
+	} else {
+		*cnk = *chunk;
+	}
+	return 0;
+}
+
 static int ldb_wildcard_compare(struct ldb_context *ldb,
 				const struct ldb_parse_tree *tree,
+				const struct ldb_schema_attribute *a,
+				const struct ldb_val *chunks,
 				const struct ldb_val value, bool *matched)
 {
-	const struct ldb_schema_attribute *a;
 	struct ldb_val val;
 	struct ldb_val cnk;
-	struct ldb_val *chunk;
 	uint8_t *save_p = NULL;
 	unsigned int c = 0;
 
@@ -250,7 +295,9 @@ static int ldb_wildcard_compare(struct ldb_context *ldb,
 		return LDB_ERR_INAPPROPRIATE_MATCHING;
 	}
 
-	a = ldb_schema_attribute_by_name(ldb, tree->u.substring.attr);
+	if (a == NULL) {
+		a = ldb_schema_attribute_by_name(ldb, tree->u.substring.attr);
+	}
 	if (!a) {
 		return LDB_ERR_INVALID_ATTRIBUTE_SYNTAX;
 	}
@@ -281,16 +328,9 @@ static int ldb_wildcard_compare(struct ldb_context *ldb,
 	if ( ! tree->u.substring.start_with_wildcard ) {
 		uint8_t *cnk_to_free = NULL;
 
-		chunk = tree->u.substring.chunks[c];
-		/* No need to just copy this value for a binary match */
-		if (a->syntax->canonicalise_fn != ldb_handler_copy) {
-			if (a->syntax->canonicalise_fn(ldb, ldb, chunk, &cnk) != 0) {
-				goto mismatch;
-			}
-
-			cnk_to_free = cnk.data;
-		} else {
-			cnk = *chunk;
+		if (ldb_wildcard_chunk(ldb, a, tree, chunks, c,
+				       &cnk, &cnk_to_free) != 0) {
+			goto mismatch;
 		}
 
 		/* This deals with wildcard prefix searches on binary attributes (eg objectGUID) */
@@ -323,16 +363,9 @@ static int ldb_wildcard_compare(struct ldb_context *ldb,
 		uint8_t *p;
 		uint8_t *cnk_to_free = NULL;
 
-		chunk = tree->u.substring.chunks[c];
-		/* No need to just copy this value for a binary match */
-		if (a->syntax->canonicalise_fn != ldb_handler_copy) {
-			if (a->syntax->canonicalise_fn(ldb, ldb, chunk, &cnk) != 0) {
-				goto mismatch;
-			}
-
-			cnk_to_free = cnk.data;
-		} else {
-			cnk = *chunk;
+		if (ldb_wildcard_chunk(ldb, a, tree, chunks, c,
+				       &cnk, &cnk_to_free) != 0) {
+			goto mismatch;
 		}
 		/*
 		 * Empty strings are returned as length 0. Ensure
@@ -399,7 +432,9 @@ mismatch:
 static int ldb_match_substring(struct ldb_context *ldb, 
 			       const struct ldb_message *msg,
 			       const struct ldb_parse_tree *tree,
-			       enum ldb_scope scope, bool *matched)
+			       const struct ldb_schema_attribute *a,
+			       const struct ldb_val *chunks,
+			       bool *matched)
 {
 	unsigned int i;
 	struct ldb_message_element *el;
@@ -412,7 +447,8 @@ static int ldb_match_substring(struct ldb_context *ldb,
 
 	for (i = 0; i < el->num_values; i++) {
 		int ret;
-		ret = ldb_wildcard_compare(ldb, tree, el->values[i], matched);
+		ret = ldb_wildcard_compare(ldb, tree, a, chunks,
+					   el->values[i], matched);
 		if (ret != LDB_SUCCESS) return ret;
 		if (*matched) return LDB_SUCCESS;
 	}
@@ -538,10 +574,9 @@ static const struct ldb_extended_match_rule *ldb_find_extended_match_rule(struct
 static int ldb_match_extended(struct ldb_context *ldb, 
 			      const struct ldb_message *msg,
 			      const struct ldb_parse_tree *tree,
-			      enum ldb_scope scope, bool *matched)
+			      const struct ldb_extended_match_rule *rule,
+			      bool *matched)
 {
-	const struct ldb_extended_match_rule *rule;
-
 	if (tree->u.extended.dnAttributes) {
 		/* FIXME: We really need to find out what this ":dn" part in
 		 * an extended match means and how to handle it. For now print
@@ -558,7 +593,10 @@ static int ldb_match_extended(struct ldb_context *ldb,
 		return LDB_ERR_INAPPROPRIATE_MATCHING;
 	}
 
-	rule = ldb_find_extended_match_rule(ldb, tree->u.extended.rule_id);
+	if (rule == NULL) {
+		rule = ldb_find_extended_match_rule(ldb,
+						    tree->u.extended.rule_id);
+	}
 	if (rule == NULL) {
 		*matched = false;
 		ldb_debug(ldb, LDB_DEBUG_ERROR, "ldb: unknown extended rule_id %s",
@@ -652,30 +690,471 @@ int ldb_match_message(struct ldb_context *ldb,
 		return LDB_SUCCESS;
 
 	case LDB_OP_EQUALITY:
-		return ldb_match_equality(ldb, msg, tree, scope, matched);
+		return ldb_match_equality(ldb, msg, tree, NULL, NULL, matched);
 
 	case LDB_OP_SUBSTRING:
-		return ldb_match_substring(ldb, msg, tree, scope, matched);
+		return ldb_match_substring(ldb, msg, tree, NULL, NULL, matched);
 
 	case LDB_OP_GREATER:
-		return ldb_match_comparison(ldb, msg, tree, scope, LDB_OP_GREATER, matched);
+		return ldb_match_comparison(ldb, msg, tree, NULL, LDB_OP_GREATER, matched);
 
 	case LDB_OP_LESS:
-		return ldb_match_comparison(ldb, msg, tree, scope, LDB_OP_LESS, matched);
+		return ldb_match_comparison(ldb, msg, tree, NULL, LDB_OP_LESS, matched);
 
 	case LDB_OP_PRESENT:
-		return ldb_match_present(ldb, msg, tree, scope, matched);
+		return ldb_match_present(ldb, msg, tree, NULL, matched);
 
 	case LDB_OP_APPROX:
-		return ldb_match_comparison(ldb, msg, tree, scope, LDB_OP_APPROX, matched);
+		return ldb_match_comparison(ldb, msg, tree, NULL, LDB_OP_APPROX, matched);
 
 	case LDB_OP_EXTENDED:
-		return ldb_match_extended(ldb, msg, tree, scope, matched);
+		return ldb_match_extended(ldb, msg, tree, NULL, matched);
 	}
 
 	return LDB_ERR_INAPPROPRIATE_MATCHING;
 }
 
+/*
+  A parse tree prepared for matching many messages: the attribute
+  handlers, extended match rules, "dn" values and substring chunks are
+  looked up and canonicalised once instead of for every message.
+*/
+struct ldb_match_filter {
+	const struct ldb_parse_tree *tree;
+	const struct ldb_schema_attribute *a;
+	struct ldb_dn *valuedn;
+	struct ldb_val *chunks;
+	const struct ldb_extended_match_rule *rule;
+	unsigned int num_children;
+	struct ldb_match_filter *children;
+	/* ldb->schema.generation the handlers above were taken from */
+	uint64_t generation;
+
+	/*
+	 * Only set on the top level: the attributes the filter looks
+	 * at, unless it needs the whole message (DN or extended
+	 * matches), and whether it has a NOT
+	 */
+	const char **attrs;
+	unsigned int num_attrs;
+	bool whole_msg;
+	bool has_not;
+};
+
+static int ldb_match_filter_add_attr(struct ldb_match_filter *filter,
+				     const char *attr)
+{
+	const char **attrs = NULL;
+
+	if (ldb_attr_in_list(filter->attrs, attr)) {
+		return LDB_SUCCESS;
+	}
+
+	attrs = talloc_realloc(filter, filter->attrs, const char *,
+			       filter->num_attrs + 2);
+	if (attrs == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	attrs[filter->num_attrs++] = attr;
+	attrs[filter->num_attrs] = NULL;
+	filter->attrs = attrs;
+
+	return LDB_SUCCESS;
+}
+
+static int ldb_match_filter_collect(struct ldb_match_filter *filter,
+				    const struct ldb_parse_tree *tree)
+{
+	unsigned int i;
+	int ret;
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+	case LDB_OP_OR:
+		for (i = 0; i < tree->u.list.num_elements; i++) {
+			ret = ldb_match_filter_collect(filter,
+						       tree->u.list.elements[i]);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+		}
+		return LDB_SUCCESS;
+	case LDB_OP_NOT:
+		filter->has_not = true;
+		return ldb_match_filter_collect(filter, tree->u.isnot.child);
+	case LDB_OP_EQUALITY:
+		if (ldb_attr_dn(tree->u.equality.attr) == 0) {
+			filter->whole_msg = true;
+			return LDB_SUCCESS;
+		}
+		return ldb_match_filter_add_attr(filter,
+						 tree->u.equality.attr);
+	case LDB_OP_GREATER:
+	case LDB_OP_LESS:
+	case LDB_OP_APPROX:
+		return ldb_match_filter_add_attr(filter,
+						 tree->u.comparison.attr);
+	case LDB_OP_PRESENT:
+		if (ldb_attr_dn(tree->u.present.attr) == 0) {
+			/* always there */
+			return LDB_SUCCESS;
+		}
+		return ldb_match_filter_add_attr(filter,
+						 tree->u.present.attr);
+	case LDB_OP_SUBSTRING:
+		return ldb_match_filter_add_attr(filter,
+						 tree->u.substring.attr);
+	case LDB_OP_EXTENDED:
+		/* match rules can look at anything */
+		filter->whole_msg = true;
+		return LDB_SUCCESS;
+	}
+
+	return LDB_ERR_INAPPROPRIATE_MATCHING;
+}
+
+static int ldb_match_filter_build(struct ldb_context *ldb,
+				  TALLOC_CTX *mem_ctx,
+				  const struct ldb_parse_tree *tree,
+				  struct ldb_match_filter *f)
+{
+	unsigned int i;
+	int ret;
+
+	*f = (struct ldb_match_filter) {
+		.tree = tree,
+		.generation = ldb->schema.generation,
+	};
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+	case LDB_OP_OR:
+		f->num_children = tree->u.list.num_elements;
+		f->children = talloc_array(mem_ctx,
+					   struct ldb_match_filter,
+					   f->num_children);
+		if (f->children == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		for (i = 0; i < f->num_children; i++) {
+			ret = ldb_match_filter_build(ldb,
+						     mem_ctx,
+						     tree->u.list.elements[i],
+						     &f->children[i]);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+		}
+		return LDB_SUCCESS;
+
+	case LDB_OP_NOT:
+		f->num_children = 1;
+		f->children = talloc(mem_ctx, struct ldb_match_filter);
+		if (f->children == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		return ldb_match_filter_build(ldb,
+					      mem_ctx,
+					      tree->u.isnot.child,
+					      f->children);
+
+	case LDB_OP_EQUALITY:
+		if (ldb_attr_dn(tree->u.equality.attr) == 0) {
+			const struct ldb_val *v = &tree->u.equality.value;
+
+			if ((v->data != NULL) &&
+			    (strnlen((const char *)v->data, v->length) !=
+			     v->length)) {
+				/*
+				 * ldb_dn_from_ldb_val() refuses this, leave
+				 * it to ldb_match_equality() to fail like
+				 * without a compiled filter.
+				 */
+				return LDB_SUCCESS;
+			}
+			f->valuedn = ldb_dn_from_ldb_val(mem_ctx, ldb, v);
+			if (f->valuedn == NULL) {
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+			return LDB_SUCCESS;
+		}
+		f->a = ldb_schema_attribute_by_name(ldb,
+						    tree->u.equality.attr);
+		return LDB_SUCCESS;
+
+	case LDB_OP_GREATER:
+	case LDB_OP_LESS:
+	case LDB_OP_APPROX:
+		f->a = ldb_schema_attribute_by_name(ldb,
+						    tree->u.comparison.attr);
+		return LDB_SUCCESS;
+
+	case LDB_OP_PRESENT:
+		f->a = ldb_schema_attribute_by_name(ldb,
+						    tree->u.present.attr);
+		return LDB_SUCCESS;
+
+	case LDB_OP_SUBSTRING:
+		f->a = ldb_schema_attribute_by_name(ldb,
+						    tree->u.substring.attr);
+		if (tree->u.substring.chunks == NULL) {
+			return LDB_SUCCESS;
+		}
+		for (i = 0; tree->u.substring.chunks[i] != NULL; i++) {
+			/* count */
+		}
+		f->chunks = talloc_zero_array(mem_ctx, struct ldb_val, i);
+		if (f->chunks == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		for (i = 0; tree->u.substring.chunks[i] != NULL; i++) {
+			struct ldb_val *chunk = tree->u.substring.chunks[i];
+
+			if (f->a->syntax->canonicalise_fn == ldb_handler_copy) {
+				f->chunks[i] = *chunk;
+				continue;
+			}
+			ret = f->a->syntax->canonicalise_fn(ldb,
+							    f->chunks,
+							    chunk,
+							    &f->chunks[i]);
+			if (ret != 0) {
+				/*
+				 * An empty chunk never matches, just
+				 * as a chunk that can't be canonicalised
+				 */
+				f->chunks[i] = (struct ldb_val) {
+					.length = 0,
+				};
+			}
+		}
+		return LDB_SUCCESS;
+
+	case LDB_OP_EXTENDED:
+		if (tree->u.extended.rule_id != NULL) {
+			f->rule = ldb_find_extended_match_rule(
+				ldb, tree->u.extended.rule_id);
+		}
+		return LDB_SUCCESS;
+	}
+
+	return LDB_ERR_INAPPROPRIATE_MATCHING;
+}
+
+/*
+  prepare a parse tree for ldb_match_filter_message(). The tree must
+  stay around as long as the filter does.
+*/
+int ldb_match_filter_compile(struct ldb_context *ldb,
+			     TALLOC_CTX *mem_ctx,
+			     const struct ldb_parse_tree *tree,
+			     struct ldb_match_filter **_filter)
+{
+	struct ldb_match_filter *filter = NULL;
+	int ret;
+
+	filter = talloc(mem_ctx, struct ldb_match_filter);
+	if (filter == NULL) {
+		return ldb_oom(ldb);
+	}
+
+	ret = ldb_match_filter_build(ldb, filter, tree, filter);
+	if (ret == LDB_SUCCESS) {
+		filter->attrs = talloc_zero_array(filter, const char *, 1);
+		if (filter->attrs == NULL) {
+			ret = LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+	if (ret == LDB_SUCCESS) {
+		ret = ldb_match_filter_collect(filter, tree);
+	}
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(filter);
+		if (ret == LDB_ERR_OPERATIONS_ERROR) {
+			return ldb_oom(ldb);
+		}
+		return ret;
+	}
+
+	*_filter = filter;
+	return LDB_SUCCESS;
+}
+
+/*
+  With nots_match every NOT is taken to match, which makes the result
+  an upper bound of the real one: AND and OR never turn a match of a
+  child into a mismatch.
+ */
+static int ldb_match_filter_node(struct ldb_context *ldb,
+				 const struct ldb_message *msg,
+				 const struct ldb_match_filter *f,
+				 bool nots_match,
+				 bool *matched)
+{
+	const struct ldb_parse_tree *tree = f->tree;
+	unsigned int i;
+	int ret;
+
+	*matched = false;
+
+	/* See ldb_match_message() */
+	if (tree->operation != LDB_OP_EXTENDED) {
+		if (ldb_must_suppress_match(msg, tree)) {
+			return LDB_SUCCESS;
+		}
+	}
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+		for (i = 0; i < f->num_children; i++) {
+			ret = ldb_match_filter_node(ldb, msg, &f->children[i],
+						    nots_match, matched);
+			if (ret != LDB_SUCCESS) return ret;
+			if (!*matched) return LDB_SUCCESS;
+		}
+		*matched = true;
+		return LDB_SUCCESS;
+
+	case LDB_OP_OR:
+		for (i = 0; i < f->num_children; i++) {
+			ret = ldb_match_filter_node(ldb, msg, &f->children[i],
+						    nots_match, matched);
+			if (ret != LDB_SUCCESS) return ret;
+			if (*matched) return LDB_SUCCESS;
+		}
+		*matched = false;
+		return LDB_SUCCESS;
+
+	case LDB_OP_NOT:
+		if (nots_match) {
+			*matched = true;
+			return LDB_SUCCESS;
+		}
+		ret = ldb_match_filter_node(ldb, msg, f->children,
+					    nots_match, matched);
+		if (ret != LDB_SUCCESS) return ret;
+		*matched = ! *matched;
+		return LDB_SUCCESS;
+
+	case LDB_OP_EQUALITY:
+		return ldb_match_equality(ldb, msg, tree, f->a, f->valuedn,
+					  matched);
+
+	case LDB_OP_SUBSTRING:
+		return ldb_match_substring(ldb, msg, tree, f->a, f->chunks,
+					   matched);
+
+	case LDB_OP_GREATER:
+	case LDB_OP_LESS:
+	case LDB_OP_APPROX:
+		return ldb_match_comparison(ldb, msg, tree, f->a,
+					    tree->operation, matched);
+
+	case LDB_OP_PRESENT:
+		return ldb_match_present(ldb, msg, tree, f->a, matched);
+
+	case LDB_OP_EXTENDED:
+		return ldb_match_extended(ldb, msg, tree, f->rule, matched);
+	}
+
+	return LDB_ERR_INAPPROPRIATE_MATCHING;
+}
+
+/*
+  same as ldb_match_message(), using a filter from
+  ldb_match_filter_compile()
+ */
+int ldb_match_filter_message(struct ldb_context *ldb,
+			     const struct ldb_message *msg,
+			     const struct ldb_match_filter *filter,
+			     enum ldb_scope scope, bool *matched)
+{
+	*matched = false;
+
+	if (filter->generation != ldb->schema.generation) {
+		/*
+		 * The attribute handlers changed under us (a callback
+		 * modified @ATTRIBUTES or the schema), the cached ones
+		 * might be gone.
+		 */
+		return ldb_match_message(ldb, msg, filter->tree,
+					 scope, matched);
+	}
+
+	if (scope != LDB_SCOPE_BASE && ldb_dn_is_special(msg->dn)) {
+		/* don't match special records except on base searches */
+		return LDB_SUCCESS;
+	}
+
+	return ldb_match_filter_node(ldb, msg, filter, false, matched);
+}
+
+/*
+  the attributes a compiled filter looks at, NULL if it might look at
+  the DN or any other part of the message
+ */
+const char * const *ldb_match_filter_attrs(
+	const struct ldb_match_filter *filter)
+{
+	if (filter->whole_msg) {
+		return NULL;
+	}
+	return filter->attrs;
+}
+
+/*
+  check a packed record against a compiled filter without unpacking
+  the DN or the attributes the filter doesn't look at.
+
+  *matched is only set to false if the record can't match, it is true
+  if the record needs to be unpacked and checked with
+  ldb_match_filter_message().
+ */
+int ldb_match_filter_packed(struct ldb_context *ldb,
+			    const struct ldb_val *data,
+			    const struct ldb_match_filter *filter,
+			    bool *matched)
+{
+	struct ldb_message *msg = NULL;
+	bool nots_match;
+	int ret;
+
+	*matched = true;
+
+	if (filter->whole_msg) {
+		return LDB_SUCCESS;
+	}
+
+	if (filter->generation != ldb->schema.generation) {
+		return LDB_SUCCESS;
+	}
+
+	msg = ldb_msg_new(NULL);
+	if (msg == NULL) {
+		return ldb_oom(ldb);
+	}
+
+	ret = ldb_unpack_data_attrs(ldb, data, msg, filter->attrs,
+				    LDB_UNPACK_DATA_FLAG_NO_DN |
+				    LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC);
+	if (ret != 0) {
+		talloc_free(msg);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/*
+	 * Redaction only ever hides attributes, so a record that
+	 * doesn't match now won't match once redacted either. Under
+	 * a NOT a hidden attribute can make it match, though, so
+	 * the NOTs are left to ldb_match_filter_message().
+	 */
+	nots_match = filter->has_not && (ldb->redact.callback != NULL);
+
+	ret = ldb_match_filter_node(ldb, msg, filter, nots_match, matched);
+	talloc_free(msg);
+	return ret;
+}
+
 /*
   return 0 if the given parse tree matches the given message. Assumes
   the message is in sorted order
@@ -824,3 +1303,22 @@ int ldb_register_redact_callback(struct ldb_context *ldb,
 	ldb->redact.module = module;
 	return LDB_SUCCESS;
 }
+
+/*
+  the attributes the redaction callback looks at on top of the ones in
+  the search filter, so a backend can leave the rest packed
+ */
+int ldb_register_redact_attrs(struct ldb_context *ldb,
+			      const char * const *attrs)
+{
+	const char **copy = NULL;
+
+	copy = ldb_attr_list_copy(ldb, attrs);
+	if (copy == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	talloc_free(ldb->redact.attrs);
+	ldb->redact.attrs = copy;
+	return LDB_SUCCESS;
+}
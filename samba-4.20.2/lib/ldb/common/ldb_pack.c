@@ -762,17 +762,81 @@ failed:
 	return -1;
 }
 
+/*
+ * Step over the value lengths and values of an element that is not
+ * wanted, without decoding it
+ */
+static int ldb_unpack_skip_values_v2(uint8_t **_p,
+				     const uint8_t *value_section_p,
+				     uint8_t **_q,
+				     const uint8_t *end_p)
+{
+	uint8_t *p = *_p;
+	uint8_t *q = *_q;
+	uint32_t num_values;
+	uint8_t val_len_width;
+	size_t len;
+	unsigned int j;
+
+	num_values = PULL_LE_U32(p, 0);
+	p += U32_LEN;
+
+	val_len_width = *p;
+	p += U8_LEN;
+
+	if (val_len_width != U8_LEN &&
+	    val_len_width != U16_LEN &&
+	    val_len_width != U32_LEN) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	if ((size_t)val_len_width * num_values > value_section_p - p) {
+		errno = EIO;
+		return -1;
+	}
+
+	for (j = 0; j < num_values; j++) {
+		if (val_len_width == U8_LEN) {
+			len = PULL_LE_U8(p, 0);
+		} else if (val_len_width == U16_LEN) {
+			len = PULL_LE_U16(p, 0);
+		} else {
+			len = PULL_LE_U32(p, 0);
+		}
+		p += val_len_width;
+
+		if (len + NULL_PAD_BYTE_LEN < len) {
+			errno = EIO;
+			return -1;
+		}
+		if (len + NULL_PAD_BYTE_LEN > end_p - q) {
+			errno = EIO;
+			return -1;
+		}
+		q += len + NULL_PAD_BYTE_LEN;
+	}
+
+	*_p = p;
+	*_q = q;
+	return 0;
+}
+
 /*
  * Unpack a ldb message from a linear buffer in ldb_val
+ *
+ * If attrs is not NULL only the elements named in it are unpacked.
  */
 static int ldb_unpack_data_flags_v2(struct ldb_context *ldb,
 				    const struct ldb_val *data,
 				    struct ldb_message *message,
+				    const char * const *attrs,
 				    unsigned int flags)
 {
 	uint8_t *p, *q, *end_p, *value_section_p;
 	unsigned int i, j;
 	unsigned int nelem = 0;
+	unsigned int max_elem;
 	size_t len;
 	struct ldb_val *ldb_val_single_array = NULL;
 	uint8_t val_len_width;
@@ -855,9 +919,27 @@ static int ldb_unpack_data_flags_v2(struct ldb_context *ldb,
 		goto failed;
 	}
 
+	/*
+	 * Records never hold the same attribute twice, so when only
+	 * some attributes are wanted we need at most that many
+	 * elements.
+	 */
+	max_elem = message->num_elements;
+	if (attrs != NULL) {
+		for (i = 0; attrs[i] != NULL && i < max_elem; i++) {
+			/* count */
+		}
+		max_elem = i;
+	}
+
+	if (max_elem == 0) {
+		message->num_elements = 0;
+		return 0;
+	}
+
 	message->elements = talloc_zero_array(message,
 					      struct ldb_message_element,
-					      message->num_elements);
+					      max_elem);
 	if (!message->elements) {
 		errno = ENOMEM;
 		goto failed;
@@ -875,7 +957,7 @@ static int ldb_unpack_data_flags_v2(struct ldb_context *ldb,
 	if (flags & LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC) {
 		ldb_val_single_array = talloc_array(message->elements,
 						    struct ldb_val,
-						    message->num_elements);
+						    max_elem);
 		if (ldb_val_single_array == NULL) {
 			errno = ENOMEM;
 			goto failed;
@@ -926,6 +1008,22 @@ static int ldb_unpack_data_flags_v2(struct ldb_context *ldb,
 			goto failed;
 		}
 
+		if (attrs != NULL && !ldb_attr_in_list(attrs, attr)) {
+			if (ldb_unpack_skip_values_v2(&p, value_section_p,
+						      &q, end_p) != 0) {
+				goto failed;
+			}
+			continue;
+		}
+
+		if (nelem == max_elem) {
+			ldb_debug(ldb, LDB_DEBUG_ERROR,
+				  "Error: Attribute '%s' repeated in "
+				  "ldb_unpack_data_flags", attr);
+			errno = EIO;
+			goto failed;
+		}
+
 		element = &message->elements[nelem];
 		element->name = attr;
 		element->flags = 0;
@@ -1072,7 +1170,8 @@ int ldb_unpack_data_flags(struct ldb_context *ldb,
 
 	format = PULL_LE_U32(data->data, 0);
 	if (format == LDB_PACKING_FORMAT_V2) {
-		return ldb_unpack_data_flags_v2(ldb, data, message, flags);
+		return ldb_unpack_data_flags_v2(ldb, data, message, NULL,
+						flags);
 	}
 
 	/*
@@ -1085,6 +1184,58 @@ int ldb_unpack_data_flags(struct ldb_context *ldb,
 }
 
 
+/*
+ * Unpack only the attributes named in attrs from a linear buffer in
+ * ldb_val, the other attributes are stepped over without being
+ * decoded or allocated.
+ */
+int ldb_unpack_data_attrs(struct ldb_context *ldb,
+			  const struct ldb_val *data,
+			  struct ldb_message *message,
+			  const char * const *attrs,
+			  unsigned int flags)
+{
+	unsigned format;
+	unsigned int i;
+	unsigned int num_del = 0;
+	int ret;
+
+	if (attrs == NULL) {
+		return ldb_unpack_data_flags(ldb, data, message, flags);
+	}
+
+	if (data->length < U32_LEN) {
+		errno = EIO;
+		return -1;
+	}
+
+	format = PULL_LE_U32(data->data, 0);
+	if (format == LDB_PACKING_FORMAT_V2) {
+		return ldb_unpack_data_flags_v2(ldb, data, message, attrs,
+						flags);
+	}
+
+	/*
+	 * The old format is not worth optimising, unpack everything
+	 * and drop what was not asked for.
+	 */
+	ret = ldb_unpack_data_flags_v1(ldb, data, message, flags, format);
+	if (ret != 0) {
+		return ret;
+	}
+
+	for (i = 0; i < message->num_elements; i++) {
+		if (!ldb_attr_in_list(attrs, message->elements[i].name)) {
+			num_del++;
+		} else if (num_del != 0) {
+			message->elements[i - num_del] = message->elements[i];
+		}
+	}
+	message->num_elements -= num_del;
+
+	return 0;
+}
+
 /*
  * Unpack a ldb message from a linear buffer in ldb_val
  *
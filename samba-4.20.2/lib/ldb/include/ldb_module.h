@@ -530,6 +530,8 @@ typedef int (*ldb_redact_fn)(struct ldb_module *, struct ldb_request *, struct l
 int ldb_register_redact_callback(struct ldb_context *ldb,
 			       ldb_redact_fn redact_fn,
 			       struct ldb_module *module);
+int ldb_register_redact_attrs(struct ldb_context *ldb,
+			      const char * const *attrs);
 
 /*
  * these pack/unpack functions are exposed in the library for use by
@@ -587,6 +589,17 @@ int ldb_unpack_data_flags(struct ldb_context *ldb,
 			  struct ldb_message *message,
 			  unsigned int flags);
 
+/*
+ * Like ldb_unpack_data_flags(), but only the attributes in the NULL
+ * terminated attrs list are unpacked, the others are skipped without
+ * being decoded. A NULL attrs unpacks all attributes.
+ */
+int ldb_unpack_data_attrs(struct ldb_context *ldb,
+			  const struct ldb_val *data,
+			  struct ldb_message *message,
+			  const char * const *attrs,
+			  unsigned int flags);
+
 int ldb_unpack_get_format(const struct ldb_val *data,
 			  uint32_t *pack_format_version);
 
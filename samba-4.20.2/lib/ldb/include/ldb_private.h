@@ -101,6 +101,13 @@ struct ldb_schema {
 
 	const char *GUID_index_attribute;
 	const char *GUID_index_dn_component;
+
+	/*
+	 * Bumped whenever attribute handlers are added, removed or
+	 * overridden, so cached ldb_schema_attribute pointers can be
+	 * checked for staleness
+	 */
+	uint64_t generation;
 };
 
 /*
@@ -122,6 +129,8 @@ struct ldb_context {
 	struct {
 		struct ldb_module *module;
 		ldb_redact_fn callback;
+		/* see ldb_register_redact_attrs() */
+		const char **attrs;
 	} redact;
 
 	/* custom utf8 functions */
@@ -322,6 +331,30 @@ int ldb_match_message(struct ldb_context *ldb,
 		      const struct ldb_parse_tree *tree,
 		      enum ldb_scope scope, bool *matched);
 
+/*
+  a parse tree with its attribute handlers, match rules and constant
+  values prepared once, for matching against many messages
+ */
+struct ldb_match_filter;
+
+int ldb_match_filter_compile(struct ldb_context *ldb,
+			     TALLOC_CTX *mem_ctx,
+			     const struct ldb_parse_tree *tree,
+			     struct ldb_match_filter **filter);
+
+int ldb_match_filter_message(struct ldb_context *ldb,
+			     const struct ldb_message *msg,
+			     const struct ldb_match_filter *filter,
+			     enum ldb_scope scope, bool *matched);
+
+const char * const *ldb_match_filter_attrs(
+	const struct ldb_match_filter *filter);
+
+int ldb_match_filter_packed(struct ldb_context *ldb,
+			    const struct ldb_val *data,
+			    const struct ldb_match_filter *filter,
+			    bool *matched);
+
 /*
   check if the scope matches in a search result
 */
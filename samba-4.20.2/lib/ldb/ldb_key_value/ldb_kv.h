@@ -167,6 +167,9 @@ struct ldb_kv_context {
 
 	/* search stuff */
 	const struct ldb_parse_tree *tree;
+	struct ldb_match_filter *filter;
+	/* attributes to unpack from candidate records, NULL for all */
+	const char **unpack_attrs;
 	struct ldb_dn *base;
 	enum ldb_scope scope;
 	const char * const *attrs;
@@ -301,6 +304,12 @@ int ldb_kv_search_key(struct ldb_module *module,
 		      const struct ldb_val ldb_key,
 		      struct ldb_message *msg,
 		      unsigned int unpack_flags);
+int ldb_kv_search_key_attrs(struct ldb_module *module,
+			    struct ldb_kv_private *ldb_kv,
+			    const struct ldb_val ldb_key,
+			    struct ldb_message *msg,
+			    const char * const *attrs,
+			    unsigned int unpack_flags);
 int ldb_kv_filter_attrs_in_place(struct ldb_message *msg,
 				 const char *const *attrs);
 int ldb_kv_search(struct ldb_kv_context *ctx);
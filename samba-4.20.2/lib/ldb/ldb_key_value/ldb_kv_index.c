@@ -261,6 +261,97 @@ static int ldb_val_equal_exact_ordered(const struct ldb_val v1,
 	return memcmp(v1.data, v2->data, v1.length);
 }
 
+/*
+  compare two GUID index values. These are always LDB_KV_GUID_SIZE
+  long (checked when the index is loaded or written), so unlike
+  ldb_val_equal_exact_ordered() this is a fixed size memcmp() the
+  compiler can inline as a couple of word compares.
+*/
+static inline int ldb_kv_guid_cmp(const struct ldb_val *v1,
+				  const struct ldb_val *v2)
+{
+	return memcmp(v1->data, v2->data, LDB_KV_GUID_SIZE);
+}
+
+/*
+  find the first entry at or after 'lo' in a sorted GUID list that
+  is not less than v. The step doubles until it overshoots, so
+  walking a long list for the values of a short one costs
+  O(log(distance)) per value rather than O(log(count)).
+ */
+static unsigned int ldb_kv_guid_list_gallop(const struct dn_list *list,
+					    unsigned int lo,
+					    const struct ldb_val *v)
+{
+	unsigned int hi = lo;
+	unsigned int step = 1;
+
+	while (hi < list->count && ldb_kv_guid_cmp(&list->dn[hi], v) < 0) {
+		lo = hi + 1;
+		if (list->count - hi > step) {
+			hi += step;
+		} else {
+			hi = list->count;
+		}
+		step *= 2;
+	}
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (ldb_kv_guid_cmp(&list->dn[mid], v) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/*
+ * When one list is at least this many times longer than the other
+ * we gallop through it, otherwise we walk both in step.
+ */
+#define LDB_KV_GUID_GALLOP_RATIO 8
+
+/*
+  intersect two sorted GUID lists into dn, which must have room for
+  short_list->count entries. Returns the number of entries.
+ */
+static unsigned int ldb_kv_guid_list_intersect(const struct dn_list *short_list,
+					       const struct dn_list *long_list,
+					       struct ldb_val *dn)
+{
+	unsigned int i = 0, j = 0, n = 0;
+	bool gallop = long_list->count / short_list->count >=
+		LDB_KV_GUID_GALLOP_RATIO;
+
+	while (i < short_list->count && j < long_list->count) {
+		int cmp;
+
+		if (gallop) {
+			j = ldb_kv_guid_list_gallop(long_list, j,
+						    &short_list->dn[i]);
+			if (j == long_list->count) {
+				break;
+			}
+		}
+
+		cmp = ldb_kv_guid_cmp(&short_list->dn[i], &long_list->dn[j]);
+		if (cmp == 0) {
+			dn[n++] = short_list->dn[i];
+			i++;
+			j++;
+		} else if (cmp < 0) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+
+	return n;
+}
 
 /*
   find a entry in a dn_list, using a ldb_val. Uses a case sensitive
@@ -1460,12 +1551,18 @@ static bool list_intersect(struct ldb_kv_private *ldb_kv,
 	}
 	list3->count = 0;
 
-	for (i=0;i<short_list->count;i++) {
-		/* For the GUID index case, this is a binary search */
-		if (ldb_kv_dn_list_find_val(
-			ldb_kv, long_list, &short_list->dn[i]) != -1) {
-			list3->dn[list3->count] = short_list->dn[i];
-			list3->count++;
+	if (ldb_kv->cache->GUID_index_attribute != NULL) {
+		/* Both lists are sorted */
+		list3->count = ldb_kv_guid_list_intersect(short_list,
+							  long_list,
+							  list3->dn);
+	} else {
+		for (i=0;i<short_list->count;i++) {
+			if (ldb_kv_dn_list_find_val(
+				ldb_kv, long_list, &short_list->dn[i]) != -1) {
+				list3->dn[list3->count] = short_list->dn[i];
+				list3->count++;
+			}
 		}
 	}
 
@@ -1489,6 +1586,7 @@ static bool list_union(struct ldb_context *ldb,
 {
 	struct ldb_val *dn3;
 	unsigned int i = 0, j = 0, k = 0;
+	bool guid_index = ldb_kv->cache->GUID_index_attribute != NULL;
 
 	if (list2->count == 0) {
 		/* X | 0 == X */
@@ -1529,6 +1627,8 @@ static bool list_union(struct ldb_context *ldb,
 			cmp = 1;
 		} else if (j >= list2->count) {
 			cmp = -1;
+		} else if (guid_index) {
+			cmp = ldb_kv_guid_cmp(&list->dn[i], &list2->dn[j]);
 		} else {
 			cmp = ldb_val_equal_exact_ordered(list->dn[i],
 							  &list2->dn[j]);
@@ -2399,17 +2499,18 @@ static int ldb_kv_index_filter(struct ldb_kv_private *ldb_kv,
 		}
 
 		ret =
-		    ldb_kv_search_key(ac->module,
-				      ldb_kv,
-				      keys[i],
-				      msg,
-				      LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC |
-				      /*
-				       * The entry point ldb_kv_search_indexed is
-				       * only called from the read-locked
-				       * ldb_kv_search.
-				       */
-				      LDB_UNPACK_DATA_FLAG_READ_LOCKED);
+		    ldb_kv_search_key_attrs(ac->module,
+					    ldb_kv,
+					    keys[i],
+					    msg,
+					    ac->unpack_attrs,
+					    LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC |
+					    /*
+					     * The entry point ldb_kv_search_indexed is
+					     * only called from the read-locked
+					     * ldb_kv_search.
+					     */
+					    LDB_UNPACK_DATA_FLAG_READ_LOCKED);
 		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
 			/*
 			 * the record has disappeared? yes, this can
@@ -2457,8 +2558,8 @@ static int ldb_kv_index_filter(struct ldb_kv_private *ldb_kv,
 			}
 		}
 
-		ret = ldb_match_message(ldb, msg, ac->tree,
-					ac->scope, &matched);
+		ret = ldb_match_filter_message(ldb, msg, ac->filter,
+					       ac->scope, &matched);
 		if (ret != LDB_SUCCESS) {
 			talloc_free(keys);
 			talloc_free(msg);
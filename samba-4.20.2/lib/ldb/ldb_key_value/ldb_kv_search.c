@@ -101,6 +101,7 @@ struct ldb_kv_parse_data_unpack_ctx {
 	struct ldb_message *msg;
 	struct ldb_module *module;
 	struct ldb_kv_private *ldb_kv;
+	const char * const *attrs;
 	unsigned int unpack_flags;
 };
 
@@ -151,8 +152,8 @@ static int ldb_kv_parse_data_unpack(struct ldb_val key,
 		}
 	}
 
-	ret = ldb_unpack_data_flags(ldb, &data_parse,
-				    ctx->msg, ctx->unpack_flags);
+	ret = ldb_unpack_data_attrs(ldb, &data_parse,
+				    ctx->msg, ctx->attrs, ctx->unpack_flags);
 	if (ret == -1) {
 		if (data_parse.data != data.data) {
 			talloc_free(data_parse.data);
@@ -178,11 +179,26 @@ int ldb_kv_search_key(struct ldb_module *module,
 		      const struct ldb_val ldb_key,
 		      struct ldb_message *msg,
 		      unsigned int unpack_flags)
+{
+	return ldb_kv_search_key_attrs(module, ldb_kv, ldb_key, msg,
+				       NULL, unpack_flags);
+}
+
+/*
+  as ldb_kv_search_key(), but only unpack the attributes in attrs
+*/
+int ldb_kv_search_key_attrs(struct ldb_module *module,
+			    struct ldb_kv_private *ldb_kv,
+			    const struct ldb_val ldb_key,
+			    struct ldb_message *msg,
+			    const char * const *attrs,
+			    unsigned int unpack_flags)
 {
 	int ret;
 	struct ldb_kv_parse_data_unpack_ctx ctx = {
 		.msg = msg,
 		.module = module,
+		.attrs = attrs,
 		.unpack_flags = unpack_flags,
 		.ldb_kv = ldb_kv
 	};
@@ -371,6 +387,20 @@ static int search_func(_UNUSED_ struct ldb_kv_private *ldb_kv,
 		}
 	}
 
+	/*
+	 * Most records of a full scan don't match, look only at the
+	 * attributes in the filter before unpacking the DN and the
+	 * rest of the record.
+	 */
+	ret = ldb_match_filter_packed(ldb, &val, ac->filter, &matched);
+	if (ret != LDB_SUCCESS) {
+		ac->error = ret;
+		return -1;
+	}
+	if (!matched) {
+		return 0;
+	}
+
 	msg = ldb_msg_new(ac);
 	if (!msg) {
 		ac->error = LDB_ERR_OPERATIONS_ERROR;
@@ -378,7 +408,7 @@ static int search_func(_UNUSED_ struct ldb_kv_private *ldb_kv,
 	}
 
 	/* unpack the record */
-	ret = ldb_unpack_data_flags(ldb, &val, msg,
+	ret = ldb_unpack_data_attrs(ldb, &val, msg, ac->unpack_attrs,
 				    LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC);
 	if (ret == -1) {
 		talloc_free(msg);
@@ -415,8 +445,8 @@ static int search_func(_UNUSED_ struct ldb_kv_private *ldb_kv,
 	}
 
 	/* see if it matches the given expression */
-	ret = ldb_match_message(ldb, msg,
-				ac->tree, ac->scope, &matched);
+	ret = ldb_match_filter_message(ldb, msg,
+				       ac->filter, ac->scope, &matched);
 	if (ret != LDB_SUCCESS) {
 		talloc_free(msg);
 		ac->error = LDB_ERR_OPERATIONS_ERROR;
@@ -633,6 +663,70 @@ static int ldb_kv_search_and_return_base(struct ldb_kv_private *ldb_kv,
 	return LDB_SUCCESS;
 }
 
+/*
+ * Work out which attributes of the candidate records are needed: the
+ * ones asked for, the ones the filter looks at and the ones the
+ * redaction callback looks at. The rest is never unpacked.
+ */
+static int ldb_kv_search_unpack_attrs(struct ldb_kv_context *ctx)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ctx->module);
+	const char * const *filter_attrs = NULL;
+	const char * const *redact_attrs = NULL;
+	unsigned int i, n = 0;
+
+	ctx->unpack_attrs = NULL;
+
+	if (ctx->attrs == NULL || ldb_attr_in_list(ctx->attrs, "*")) {
+		return LDB_SUCCESS;
+	}
+
+	if (ldb->redact.callback != NULL) {
+		/*
+		 * Without ldb_register_redact_attrs() the
+		 * callback may look at any attribute
+		 */
+		if (ldb->redact.attrs == NULL) {
+			return LDB_SUCCESS;
+		}
+		redact_attrs = ldb->redact.attrs;
+	}
+
+	filter_attrs = ldb_match_filter_attrs(ctx->filter);
+	if (filter_attrs == NULL) {
+		return LDB_SUCCESS;
+	}
+
+	for (i = 0; ctx->attrs[i] != NULL; i++) {
+		n++;
+	}
+	for (i = 0; filter_attrs[i] != NULL; i++) {
+		n++;
+	}
+	for (i = 0; redact_attrs != NULL && redact_attrs[i] != NULL; i++) {
+		n++;
+	}
+
+	ctx->unpack_attrs = talloc_array(ctx->filter, const char *, n + 1);
+	if (ctx->unpack_attrs == NULL) {
+		return ldb_oom(ldb);
+	}
+
+	n = 0;
+	for (i = 0; ctx->attrs[i] != NULL; i++) {
+		ctx->unpack_attrs[n++] = ctx->attrs[i];
+	}
+	for (i = 0; filter_attrs[i] != NULL; i++) {
+		ctx->unpack_attrs[n++] = filter_attrs[i];
+	}
+	for (i = 0; redact_attrs != NULL && redact_attrs[i] != NULL; i++) {
+		ctx->unpack_attrs[n++] = redact_attrs[i];
+	}
+	ctx->unpack_attrs[n] = NULL;
+
+	return LDB_SUCCESS;
+}
+
 /*
   search the database with a LDAP-like expression.
   choses a search method
@@ -733,6 +827,19 @@ int ldb_kv_search(struct ldb_kv_context *ctx)
 		ret = LDB_SUCCESS;
 	}
 
+	if (ret == LDB_SUCCESS) {
+		/*
+		 * Every candidate record is checked against the
+		 * filter, only look up the attribute handlers once.
+		 */
+		ret = ldb_match_filter_compile(ldb, ctx, ctx->tree,
+					       &ctx->filter);
+	}
+
+	if (ret == LDB_SUCCESS) {
+		ret = ldb_kv_search_unpack_attrs(ctx);
+	}
+
 	if (ret == LDB_SUCCESS) {
 		uint32_t match_count = 0;
 
@@ -771,6 +878,7 @@ int ldb_kv_search(struct ldb_kv_context *ctx)
 				 * full search or we may return
 				 * duplicate entries
 				 */
+				TALLOC_FREE(ctx->filter);
 				ldb_kv->kv_ops->unlock_read(module);
 				return LDB_ERR_OPERATIONS_ERROR;
 			}
@@ -778,6 +886,7 @@ int ldb_kv_search(struct ldb_kv_context *ctx)
 			if (ldb_kv->disable_full_db_scan) {
 				ldb_set_errstring(ldb,
 						  "ldb FULL SEARCH disabled");
+				TALLOC_FREE(ctx->filter);
 				ldb_kv->kv_ops->unlock_read(module);
 				return LDB_ERR_INAPPROPRIATE_MATCHING;
 			}
@@ -789,6 +898,7 @@ int ldb_kv_search(struct ldb_kv_context *ctx)
 		}
 	}
 
+	TALLOC_FREE(ctx->filter);
 	ldb_kv->kv_ops->unlock_read(module);
 
 	return ret;
@@ -351,6 +351,155 @@ static void test_init_store_set_index_cache_size_range(void **state)
 	TALLOC_FREE(ldb);
 }
 
+/*
+ * Build a sorted GUID dn_list of count values, value i being
+ * first + i * stride.
+ */
+static struct dn_list *guid_list(TALLOC_CTX *mem_ctx,
+				 unsigned int count,
+				 unsigned int first,
+				 unsigned int stride)
+{
+	struct dn_list *list = NULL;
+	uint8_t *guids = NULL;
+	unsigned int i;
+
+	list = talloc_zero(mem_ctx, struct dn_list);
+	assert_non_null(list);
+	list->dn = talloc_array(list, struct ldb_val, count);
+	assert_non_null(list->dn);
+	guids = talloc_zero_array(list, uint8_t, count * LDB_KV_GUID_SIZE);
+	assert_non_null(guids);
+
+	for (i = 0; i < count; i++) {
+		uint8_t *g = &guids[i * LDB_KV_GUID_SIZE];
+		uint32_t v = first + i * stride;
+
+		g[12] = v >> 24;
+		g[13] = v >> 16;
+		g[14] = v >> 8;
+		g[15] = v;
+		list->dn[i].data = g;
+		list->dn[i].length = LDB_KV_GUID_SIZE;
+	}
+	list->count = count;
+
+	return list;
+}
+
+static bool guid_list_has(const struct dn_list *list, uint32_t v)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->count; i++) {
+		const uint8_t *g = list->dn[i].data;
+		uint32_t x = ((uint32_t)g[12] << 24) | (g[13] << 16) |
+			(g[14] << 8) | g[15];
+		if (x == v) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Test list_intersect() and list_union() on GUID lists, for lists of
+ * similar length (merged in step) and very different length (the
+ * long one is galloped through).
+ */
+static void test_guid_list_intersect_union(void **state)
+{
+	struct test_ctx *test_ctx = talloc_get_type_abort(
+		*state,
+		struct test_ctx);
+	struct ldb_kv_private *ldb_kv = NULL;
+	struct {
+		unsigned int count1, first1, stride1;
+		unsigned int count2, first2, stride2;
+	} cases[] = {
+		{ 500, 0, 2, 600, 0, 3 },
+		{ 600, 1, 3, 500, 0, 2 },
+		{ 10, 7, 97, 5000, 0, 1 },
+		{ 5000, 0, 1, 10, 7, 97 },
+		{ 20, 5000, 1, 3000, 0, 2 },
+		{ 300, 0, 2, 300, 1, 2 },
+		{ 300, 0, 1, 300, 0, 1 },
+	};
+	unsigned int c;
+
+	ldb_kv = talloc_zero(test_ctx, struct ldb_kv_private);
+	assert_non_null(ldb_kv);
+	ldb_kv->cache = talloc_zero(ldb_kv, struct ldb_kv_cache);
+	assert_non_null(ldb_kv->cache);
+	ldb_kv->cache->GUID_index_attribute = "objectGUID";
+
+	for (c = 0; c < ARRAY_SIZE(cases); c++) {
+		struct dn_list *l1 = NULL, *l2 = NULL, *and = NULL, *or = NULL;
+		unsigned int n_and = 0, n_or = 0;
+		unsigned int max, v, i;
+		bool ok;
+
+		l1 = guid_list(test_ctx, cases[c].count1,
+			       cases[c].first1, cases[c].stride1);
+		l2 = guid_list(test_ctx, cases[c].count2,
+			       cases[c].first2, cases[c].stride2);
+
+		and = guid_list(test_ctx, 0, 0, 0);
+		and->dn = l1->dn;
+		and->count = l1->count;
+		ok = list_intersect(ldb_kv, and, l2);
+		assert_true(ok);
+
+		or = guid_list(test_ctx, 0, 0, 0);
+		or->dn = l1->dn;
+		or->count = l1->count;
+		ok = list_union(NULL, ldb_kv, or, l2);
+		assert_true(ok);
+
+		max = MAX(cases[c].first1 +
+			  cases[c].count1 * cases[c].stride1,
+			  cases[c].first2 +
+			  cases[c].count2 * cases[c].stride2);
+		for (v = 0; v < max; v++) {
+			bool in1 = guid_list_has(l1, v);
+			bool in2 = guid_list_has(l2, v);
+
+			if (in1 && in2) {
+				n_and++;
+			}
+			if (in1 || in2) {
+				n_or++;
+			}
+		}
+		assert_int_equal(and->count, n_and);
+		assert_int_equal(or->count, n_or);
+
+		for (i = 1; i < and->count; i++) {
+			assert_true(ldb_kv_guid_cmp(&and->dn[i - 1],
+						    &and->dn[i]) < 0);
+		}
+		for (i = 1; i < or->count; i++) {
+			assert_true(ldb_kv_guid_cmp(&or->dn[i - 1],
+						    &or->dn[i]) < 0);
+		}
+		for (i = 0; i < and->count; i++) {
+			assert_int_not_equal(
+				ldb_kv_dn_list_find_val(ldb_kv, l1,
+							&and->dn[i]), -1);
+			assert_int_not_equal(
+				ldb_kv_dn_list_find_val(ldb_kv, l2,
+							&and->dn[i]), -1);
+		}
+
+		TALLOC_FREE(l1);
+		TALLOC_FREE(l2);
+		TALLOC_FREE(and);
+		TALLOC_FREE(or);
+	}
+
+	TALLOC_FREE(ldb_kv);
+}
+
 int main(int argc, const char **argv)
 {
 	const struct CMUnitTest tests[] = {
@@ -382,6 +531,10 @@ int main(int argc, const char **argv)
 			test_init_store_set_index_cache_size_range,
 			setup,
 			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_guid_list_intersect_union,
+			setup,
+			teardown),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
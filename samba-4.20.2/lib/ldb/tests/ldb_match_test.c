@@ -140,7 +140,7 @@ static void test_wildcard_match_star(void **state)
 	struct ldb_parse_tree *tree = ldb_parse_tree(ctx, "a=*");
 	assert_non_null(tree);
 
-	ret = ldb_wildcard_compare(ctx->ldb, tree, val, &matched);
+	ret = ldb_wildcard_compare(ctx->ldb, tree, NULL, NULL, val, &matched);
 	assert_false(matched);
 	assert_int_equal(LDB_ERR_INAPPROPRIATE_MATCHING, ret);
 }
@@ -234,7 +234,8 @@ static void test_wildcard_match(void **state)
 						attr, tests[i].search);
 		struct ldb_parse_tree *tree = ldb_parse_tree(ctx, s);
 		assert_non_null(tree);
-		ret = ldb_wildcard_compare(ctx->ldb, tree, val, &matched);
+		ret = ldb_wildcard_compare(ctx->ldb, tree, NULL, NULL,
+					   val, &matched);
 		if (ret != LDB_SUCCESS) {
 			uint8_t buf[100];
 			escape_string(buf, sizeof(buf),
@@ -282,10 +283,141 @@ static void test_wildcard_match_end_condition(void **state)
 	struct ldb_parse_tree *tree = ldb_parse_tree(ctx, "a=*hello*mynameis*bob");
 	assert_non_null(tree);
 
-	ldb_wildcard_compare(ctx->ldb, tree, val, &matched);
+	ldb_wildcard_compare(ctx->ldb, tree, NULL, NULL, val, &matched);
 	assert_true(matched);
 }
 
+/*
+ * A compiled filter has to give the same answers as ldb_match_message(),
+ * also after the attribute handlers changed underneath it.
+ */
+static void test_match_filter(void **state)
+{
+	struct ldbtest_ctx *ctx = *state;
+	struct ldb_message *msg = NULL;
+	const char *filters[] = {
+		"(objectclass=user)",
+		"(objectClass=USER)",
+		"(objectclass=group)",
+		"(cn=*)",
+		"(sn=*)",
+		"(cn=Fr*d*)",
+		"(cn=*RED)",
+		"(cn=*fox*)",
+		"(birthLocation=*lon*)",
+		"(birthLocation=*Lon*)",
+		"(dn=cn=fred,dc=samba,dc=org)",
+		"(dn=CN=Fred,DC=samba,DC=org)",
+		"(dn=cn=bob,dc=samba,dc=org)",
+		"(uSNChanged>=10)",
+		"(uSNChanged<=10)",
+		"(uSNChanged:1.2.840.113556.1.4.803:=4)",
+		"(uSNChanged:1.2.840.113556.1.4.804:=8)",
+		"(&(objectclass=user)(cn=fred))",
+		"(&(objectclass=user)(!(cn=fred)))",
+		"(|(cn=bob)(cn=fred))",
+		"(|(cn=bob)(sn=fred))",
+		"(!(|(cn=bob)(sn=fred)))",
+		"(&(|(cn=*r*)(sn=x))(!(birthLocation=*york)))",
+	};
+	size_t i;
+	int ret;
+
+	msg = ldb_msg_new(ctx);
+	assert_non_null(msg);
+	msg->dn = ldb_dn_new(msg, ctx->ldb, "cn=fred,dc=samba,dc=org");
+	assert_non_null(msg->dn);
+	ret = ldb_msg_add_string(msg, "objectClass", "top");
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_msg_add_string(msg, "objectClass", "user");
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_msg_add_string(msg, "cn", "Fred");
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_msg_add_string(msg, "birthLocation", "London");
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_msg_add_string(msg, "uSNChanged", "20");
+	assert_int_equal(ret, LDB_SUCCESS);
+
+	for (i = 0; i < ARRAY_SIZE(filters); i++) {
+		struct ldb_parse_tree *tree = NULL;
+		struct ldb_match_filter *filter = NULL;
+		bool expected = false;
+		bool matched = false;
+
+		tree = ldb_parse_tree(ctx, filters[i]);
+		assert_non_null(tree);
+
+		ret = ldb_match_message(ctx->ldb, msg, tree,
+					LDB_SCOPE_SUBTREE, &expected);
+		assert_int_equal(ret, LDB_SUCCESS);
+
+		ret = ldb_match_filter_compile(ctx->ldb, ctx, tree, &filter);
+		assert_int_equal(ret, LDB_SUCCESS);
+
+		ret = ldb_match_filter_message(ctx->ldb, msg, filter,
+					       LDB_SCOPE_SUBTREE, &matched);
+		assert_int_equal(ret, LDB_SUCCESS);
+		if (matched != expected) {
+			fail_msg("%s: compiled filter %s\n", filters[i],
+				 matched ? "matched" : "did not match");
+		}
+
+		/* "cn" is case sensitive now, the filter must notice */
+		ret = ldb_schema_attribute_add(ctx->ldb, "cn", 0,
+					       LDB_SYNTAX_OCTET_STRING);
+		assert_int_equal(ret, LDB_SUCCESS);
+
+		ret = ldb_match_message(ctx->ldb, msg, tree,
+					LDB_SCOPE_SUBTREE, &expected);
+		assert_int_equal(ret, LDB_SUCCESS);
+		ret = ldb_match_filter_message(ctx->ldb, msg, filter,
+					       LDB_SCOPE_SUBTREE, &matched);
+		assert_int_equal(ret, LDB_SUCCESS);
+		if (matched != expected) {
+			fail_msg("%s: stale compiled filter %s\n", filters[i],
+				 matched ? "matched" : "did not match");
+		}
+
+		ldb_schema_attribute_remove(ctx->ldb, "cn");
+		TALLOC_FREE(filter);
+		TALLOC_FREE(tree);
+	}
+}
+
+/*
+ * A DN value ldb_dn_from_ldb_val() refuses is not an allocation
+ * failure, the compiled filter fails the match like the parse tree.
+ */
+static void test_match_filter_invalid_dn(void **state)
+{
+	struct ldbtest_ctx *ctx = *state;
+	struct ldb_message *msg = NULL;
+	struct ldb_parse_tree *tree = NULL;
+	struct ldb_match_filter *filter = NULL;
+	bool matched = false;
+	int expected;
+	int ret;
+
+	msg = ldb_msg_new(ctx);
+	assert_non_null(msg);
+	msg->dn = ldb_dn_new(msg, ctx->ldb, "cn=fred,dc=samba,dc=org");
+	assert_non_null(msg->dn);
+
+	tree = ldb_parse_tree(ctx, "(dn=cn=fred\\00,dc=samba,dc=org)");
+	assert_non_null(tree);
+
+	expected = ldb_match_message(ctx->ldb, msg, tree,
+				     LDB_SCOPE_SUBTREE, &matched);
+	assert_int_equal(expected, LDB_ERR_INVALID_DN_SYNTAX);
+
+	ret = ldb_match_filter_compile(ctx->ldb, ctx, tree, &filter);
+	assert_int_equal(ret, LDB_SUCCESS);
+
+	ret = ldb_match_filter_message(ctx->ldb, msg, filter,
+				       LDB_SCOPE_SUBTREE, &matched);
+	assert_int_equal(ret, expected);
+}
+
 /*
  * Note: to run under valgrind use:
  *       valgrind \
@@ -307,6 +439,14 @@ int main(int argc, const char **argv)
 			test_wildcard_match_end_condition,
 			setup,
 			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_match_filter,
+			setup,
+			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_match_filter_invalid_dn,
+			setup,
+			teardown),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
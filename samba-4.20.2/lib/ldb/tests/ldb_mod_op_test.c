@@ -1394,6 +1394,82 @@ static void test_search_match_both(void **state)
 	assert_expected(search_test_ctx, result->msgs[1]);
 }
 
+static bool redact_test_saw_uuid;
+
+/* hide the uid of the first entry, which is only known by objectUUID */
+static int redact_test_callback(struct ldb_module *module,
+				struct ldb_request *req,
+				struct ldb_message *msg)
+{
+	const char *uuid = NULL;
+	struct ldb_message_element *el = NULL;
+
+	uuid = ldb_msg_find_attr_as_string(msg, "objectUUID", NULL);
+	if (uuid == NULL) {
+		return LDB_SUCCESS;
+	}
+	redact_test_saw_uuid = true;
+
+	if (strcmp(uuid, "0123456789abcde0") != 0) {
+		return LDB_SUCCESS;
+	}
+
+	el = ldb_msg_find_element(msg, "uid");
+	if (el != NULL) {
+		ldb_msg_element_mark_inaccessible(el);
+	}
+	return LDB_SUCCESS;
+}
+
+static void test_search_redact_not(void **state)
+{
+	struct search_test_ctx *search_test_ctx = talloc_get_type_abort(*state,
+			struct search_test_ctx);
+	struct ldb_context *ldb = search_test_ctx->ldb_test_ctx->ldb;
+	const char *redact_attrs[] = { "objectUUID", NULL };
+	const char *attrs[] = { "cn", NULL };
+	struct ldb_result *result = NULL;
+	struct ldb_dn *basedn;
+	char *full_dn;
+	int ret;
+
+	ret = ldb_register_redact_callback(ldb, redact_test_callback, NULL);
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_register_redact_attrs(ldb, redact_attrs);
+	assert_int_equal(ret, LDB_SUCCESS);
+
+	basedn = ldb_dn_new_fmt(search_test_ctx, ldb, "%s",
+				search_test_ctx->base_dn);
+	assert_non_null(basedn);
+
+	/*
+	 * The hidden uid doesn't match, so the NOT does: the
+	 * check of the packed record must not drop the entry.
+	 */
+	redact_test_saw_uuid = false;
+	ret = ldb_search(ldb, search_test_ctx, &result, basedn,
+			 LDB_SCOPE_SUBTREE, attrs,
+			 "(&(cn=test_search_cn)(!(uid=test_search_uid)))");
+	assert_int_equal(ret, LDB_SUCCESS);
+	assert_int_equal(result->count, 1);
+	assert_true(redact_test_saw_uuid);
+
+	full_dn = get_full_dn(search_test_ctx, search_test_ctx,
+			      "cn=test_search_cn");
+	assert_true(has_dn(result->msgs[0], full_dn));
+	assert_has_no_attr(result->msgs[0], "uid");
+	assert_has_no_attr(result->msgs[0], "objectUUID");
+	TALLOC_FREE(result);
+
+	/* A visible uid still makes the NOT fail */
+	ret = ldb_search(ldb, search_test_ctx, &result, basedn,
+			 LDB_SCOPE_SUBTREE, attrs,
+			 "(&(cn=test_search_2_cn)(!(uid=test_search_2_uid)))");
+	assert_int_equal(ret, LDB_SUCCESS);
+	assert_int_equal(result->count, 0);
+	TALLOC_FREE(result);
+}
+
 static void test_search_match_basedn(void **state)
 {
 	struct search_test_ctx *search_test_ctx = talloc_get_type_abort(*state,
@@ -4589,6 +4665,9 @@ int main(int argc, const char **argv)
 		cmocka_unit_test_setup_teardown(test_search_match_filter,
 						ldb_search_test_setup,
 						ldb_search_test_teardown),
+		cmocka_unit_test_setup_teardown(test_search_redact_not,
+						ldb_search_test_setup,
+						ldb_search_test_teardown),
 		cmocka_unit_test_setup_teardown(test_search_match_both,
 						ldb_search_test_setup,
 						ldb_search_test_teardown),
@@ -363,6 +363,90 @@ static void test_ldb_msg_find_common_values(void **state)
 }
 
 
+static void test_ldb_unpack_data_attrs(void **state)
+{
+	struct test_ctx *test_ctx = talloc_get_type_abort(*state,
+							  struct test_ctx);
+	struct ldb_message *msg = test_ctx->msg;
+	struct ldb_context *ldb = NULL;
+	const char *attrs[] = { "MEMBER", "description", "missing", NULL };
+	const char *no_attrs[] = { NULL };
+	const uint32_t formats[] = {
+		LDB_PACKING_FORMAT,
+		LDB_PACKING_FORMAT_V2,
+	};
+	unsigned int i, j;
+	int ret;
+
+	ldb = ldb_init(test_ctx, NULL);
+	assert_non_null(ldb);
+
+	msg->dn = ldb_dn_new(msg, ldb, "cn=test,dc=samba,dc=org");
+	assert_non_null(msg->dn);
+	ret = ldb_msg_add_string(msg, "cn", "test");
+	assert_int_equal(ret, LDB_SUCCESS);
+	for (i = 0; i < 300; i++) {
+		add_uint_value(test_ctx, msg, "member", i);
+	}
+	ret = ldb_msg_add_string(msg, "objectClass", "group");
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_msg_add_string(msg, "description", "a group");
+	assert_int_equal(ret, LDB_SUCCESS);
+
+	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+		struct ldb_message *out = NULL;
+		struct ldb_message_element *el = NULL;
+		struct ldb_val data;
+
+		ret = ldb_pack_data(ldb, msg, &data, formats[i]);
+		assert_int_equal(ret, 0);
+
+		out = ldb_msg_new(test_ctx);
+		assert_non_null(out);
+		ret = ldb_unpack_data_attrs(ldb, &data, out, attrs,
+					    LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC);
+		assert_int_equal(ret, 0);
+		assert_non_null(out->dn);
+		assert_int_equal(ldb_dn_compare(out->dn, msg->dn), 0);
+		assert_int_equal(out->num_elements, 2);
+
+		el = ldb_msg_find_element(out, "member");
+		assert_non_null(el);
+		assert_int_equal(el->num_values, 300);
+		for (j = 0; j < el->num_values; j++) {
+			assert_int_equal(
+				ldb_val_equal_exact(&el->values[j],
+					&msg->elements[1].values[j]), 1);
+		}
+		assert_string_equal(ldb_msg_find_attr_as_string(
+					    out, "description", NULL),
+				    "a group");
+		assert_null(ldb_msg_find_element(out, "cn"));
+		assert_null(ldb_msg_find_element(out, "objectClass"));
+		TALLOC_FREE(out);
+
+		out = ldb_msg_new(test_ctx);
+		assert_non_null(out);
+		ret = ldb_unpack_data_attrs(ldb, &data, out, no_attrs,
+					    LDB_UNPACK_DATA_FLAG_NO_DN);
+		assert_int_equal(ret, 0);
+		assert_null(out->dn);
+		assert_int_equal(out->num_elements, 0);
+		TALLOC_FREE(out);
+
+		/* a truncated record is still noticed */
+		data.length -= 1;
+		out = ldb_msg_new(test_ctx);
+		assert_non_null(out);
+		ret = ldb_unpack_data_attrs(ldb, &data, out, attrs, 0);
+		assert_int_equal(ret, -1);
+		TALLOC_FREE(out);
+
+		TALLOC_FREE(data.data);
+	}
+}
+
+
 
 int main(int argc, const char **argv)
 {
@@ -374,6 +458,10 @@ int main(int argc, const char **argv)
 			test_ldb_msg_find_common_values,
 			ldb_msg_setup,
 			ldb_msg_teardown),
+		cmocka_unit_test_setup_teardown(
+			test_ldb_unpack_data_attrs,
+			ldb_msg_setup,
+			ldb_msg_teardown),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
@@ -23,8 +23,10 @@
 #include "system/filesys.h"
 #include "system/dir.h"
 #include "system/select.h"
+#include "system/wait.h"
 #include "lib/util/debug.h"
 #include "messages_dgm.h"
+#include "messages_dgm_shm.h"
 #include "lib/util/genrand.h"
 #include "lib/util/dlinklist.h"
 #include "lib/pthreadpool/pthreadpool_tevent.h"
@@ -34,8 +36,71 @@
 #include "lib/util/tevent_unix.h"
 #include "lib/util/smb_strtox.h"
 
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
 #define MESSAGING_DGM_FRAGMENT_LENGTH 1024
 
+/*
+ * In coalescing mode, fragments to the same destination are
+ * collected until the next event loop iteration and sent with one
+ * sendmmsg call. The receiver picks up to MESSAGING_DGM_RECV_BATCH
+ * datagrams with one recvmmsg.
+ */
+#define MESSAGING_DGM_SEND_BATCH 64
+#define MESSAGING_DGM_RECV_BATCH 8
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+#define messaging_dgm_mmsghdr mmsghdr
+#define MESSAGING_DGM_HAVE_MMSG 1
+#else
+struct messaging_dgm_mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif
+
+/*
+ * Shared memory rings between pairs of processes, see
+ * messaging_dgm_out_shm_send(). The ring is set up with control
+ * datagrams carrying MESSAGING_DGM_COOKIE_SHM, we never hand out
+ * this as a fragment cookie.
+ */
+#define MESSAGING_DGM_COOKIE_SHM UINT64_MAX
+
+/*
+ * Only set up a ring after that many messages to a destination,
+ * and keep it for a bit longer than an idle socket.
+ */
+#define MESSAGING_DGM_SHM_SETUP_THRESHOLD 16
+#define MESSAGING_DGM_SHM_IDLE_SECS 10
+#define MESSAGING_DGM_SHM_MAX_INS 4096
+
+enum messaging_dgm_shm_op {
+	MESSAGING_DGM_SHM_OP_SETUP = 1,	/* sender: fd is the ring */
+	MESSAGING_DGM_SHM_OP_ACK = 2,	/* receiver: fd is its eventfd */
+	MESSAGING_DGM_SHM_OP_START = 3,	/* sender: read the ring */
+};
+
+struct messaging_dgm_shm_ctrl {
+	uint32_t op;
+	pid_t pid;
+	uint64_t id;
+};
+
+enum messaging_dgm_shm_state {
+	MESSAGING_DGM_SHM_NONE = 0,
+	MESSAGING_DGM_SHM_SETUP_SENT,
+	MESSAGING_DGM_SHM_ACTIVE,
+	MESSAGING_DGM_SHM_STOPPED,
+	MESSAGING_DGM_SHM_FAILED,
+};
+
 struct sun_path_buf {
 	/*
 	 * This will carry enough for a socket path
@@ -60,6 +125,13 @@ struct messaging_dgm_fde_ev {
 
 	struct tevent_context *ev;
 	struct tevent_fd *fde;
+	struct tevent_fd *shm_fde;
+
+	/*
+	 * messaging_dgm_flush_handler on ev, for nested event loops
+	 * that don't run ctx->ev
+	 */
+	struct tevent_immediate *flush_im;
 };
 
 struct messaging_dgm_out {
@@ -73,6 +145,40 @@ struct messaging_dgm_out {
 
 	struct tevent_queue *queue;
 	struct tevent_timer *idle_timer;
+
+	/*
+	 * Fragments waiting for messaging_dgm_flush_handler, they
+	 * are always newer than anything in the queue.
+	 */
+	struct iovec pending[MESSAGING_DGM_SEND_BATCH];
+	size_t num_pending;
+
+	/*
+	 * Ring to the receiver and its eventfd once it acked the
+	 * ring. shm_pidfd becomes readable when the receiver exits,
+	 * see messaging_dgm_out_shm_alive().
+	 */
+	enum messaging_dgm_shm_state shm_state;
+	struct messaging_dgm_shm_ring *shm;
+	uint64_t shm_id;
+	int shm_doorbell;
+	int shm_pidfd;
+	uint64_t shm_probe_tail;
+	unsigned num_msgs;
+};
+
+struct messaging_dgm_shm_in {
+	struct messaging_dgm_shm_in *prev, *next;
+	struct messaging_dgm_context *ctx;
+	pid_t pid;
+	uint64_t id;
+	struct messaging_dgm_shm_ring *ring;
+	bool started;
+
+	/*
+	 * Set by the destructor for messaging_dgm_shm_in_drain()
+	 */
+	bool *destroyed;
 };
 
 struct messaging_dgm_in_msg {
@@ -109,8 +215,29 @@ struct messaging_dgm_context {
 
 	struct pthreadpool_tevent *pool;
 	struct messaging_dgm_out *outsocks;
+
+	struct tevent_immediate *flush_im;
+
+	/*
+	 * Set by the destructor, messaging_dgm_read_handler can't
+	 * continue with the rest of a batch then.
+	 */
+	bool *recv_destroyed;
+
+	/*
+	 * Rings other processes write to us, with our eventfd for
+	 * them to wake us up.
+	 */
+	struct messaging_dgm_shm_in *shm_ins;
+	int shm_doorbell;
+	uint64_t shm_next_id;
+
+	struct messaging_dgm_stats stats;
 };
 
+static bool messaging_dgm_coalesce = false;
+static size_t messaging_dgm_shm_size = 0;
+
 /* Set socket close on exec. */
 static int prepare_socket_cloexec(int sock)
 {
@@ -143,6 +270,26 @@ static void close_fd_array(int *fds, size_t num_fds)
 	}
 }
 
+static void messaging_dgm_count_batch(struct messaging_dgm_batch_stats *s,
+				      size_t num)
+{
+	size_t bucket = 0;
+
+	if (num == 0) {
+		return;
+	}
+
+	s->batches += 1;
+	s->datagrams += num;
+	s->max_batch = MAX(s->max_batch, num);
+
+	while ((num >>= 1) != 0) {
+		bucket += 1;
+	}
+	bucket = MIN(bucket, ARRAY_SIZE(s->hist) - 1);
+	s->hist[bucket] += 1;
+}
+
 /*
  * The idle handler can free the struct messaging_dgm_out *,
  * if it's unused (qlen of zero) which closes the socket.
@@ -160,7 +307,7 @@ static void messaging_dgm_out_idle_handler(struct tevent_context *ev,
 	out->idle_timer = NULL;
 
 	qlen = tevent_queue_length(out->queue);
-	if (qlen == 0) {
+	if ((qlen == 0) && (out->num_pending == 0)) {
 		TALLOC_FREE(out);
 	}
 }
@@ -172,6 +319,7 @@ static void messaging_dgm_out_idle_handler(struct tevent_context *ev,
 
 static void messaging_dgm_out_rearm_idle_timer(struct messaging_dgm_out *out)
 {
+	uint32_t secs = (out->shm != NULL) ? MESSAGING_DGM_SHM_IDLE_SECS : 1;
 	size_t qlen;
 
 	qlen = tevent_queue_length(out->queue);
@@ -182,12 +330,12 @@ static void messaging_dgm_out_rearm_idle_timer(struct messaging_dgm_out *out)
 
 	if (out->idle_timer != NULL) {
 		tevent_update_timer(out->idle_timer,
-				    tevent_timeval_current_ofs(1, 0));
+				    tevent_timeval_current_ofs(secs, 0));
 		return;
 	}
 
 	out->idle_timer = tevent_add_timer(
-		out->ctx->ev, out, tevent_timeval_current_ofs(1, 0),
+		out->ctx->ev, out, tevent_timeval_current_ofs(secs, 0),
 		messaging_dgm_out_idle_handler, out);
 	/*
 	 * No NULL check, we'll come back here. Worst case we're
@@ -196,6 +344,11 @@ static void messaging_dgm_out_rearm_idle_timer(struct messaging_dgm_out *out)
 }
 
 static int messaging_dgm_out_destructor(struct messaging_dgm_out *dst);
+static int messaging_dgm_out_flush(struct messaging_dgm_out *out,
+				   bool may_queue);
+static void messaging_dgm_out_drop_pending(struct messaging_dgm_out *out,
+					   size_t num);
+static void messaging_dgm_out_flush_detached(struct messaging_dgm_out *out);
 static void messaging_dgm_out_idle_handler(struct tevent_context *ev,
 					   struct tevent_timer *te,
 					   struct timeval current_time,
@@ -224,7 +377,9 @@ static int messaging_dgm_out_create(TALLOC_CTX *mem_ctx,
 	*out = (struct messaging_dgm_out) {
 		.pid = pid,
 		.ctx = ctx,
-		.cookie = 1
+		.cookie = 1,
+		.shm_doorbell = -1,
+		.shm_pidfd = -1,
 	};
 
 	out_pathlen = snprintf(addr_buf, sizeof(addr_buf),
@@ -280,6 +435,38 @@ fail:
 
 static int messaging_dgm_out_destructor(struct messaging_dgm_out *out)
 {
+	if (out->shm != NULL) {
+		if (tevent_cached_getpid() == out->ctx->pid) {
+			/*
+			 * The receiver drops the ring once it has
+			 * read everything.
+			 */
+			messaging_dgm_shm_ring_close(out->shm);
+		}
+		TALLOC_FREE(out->shm);
+	}
+	if (out->shm_doorbell != -1) {
+		close(out->shm_doorbell);
+		out->shm_doorbell = -1;
+	}
+	if (out->shm_pidfd != -1) {
+		close(out->shm_pidfd);
+		out->shm_pidfd = -1;
+	}
+
+	if (out->num_pending != 0) {
+		if (tevent_cached_getpid() == out->ctx->pid) {
+			/*
+			 * Last chance for the coalesced fragments,
+			 * whatever does not fit into the socket
+			 * buffer right now is pushed by a helper
+			 * thread that outlives us.
+			 */
+			messaging_dgm_out_flush_detached(out);
+		}
+		messaging_dgm_out_drop_pending(out, out->num_pending);
+	}
+
 	DLIST_REMOVE(out->ctx->outsocks, out);
 
 	if ((tevent_queue_length(out->queue) != 0) &&
@@ -383,6 +570,51 @@ static ssize_t messaging_dgm_sendmsg(int sock,
 	return ret;
 }
 
+/*
+ * Send a batch of fds-less datagrams. Like sendmmsg this returns the
+ * number of datagrams sent, an error is only reported if the first
+ * one could not be sent.
+ */
+
+static int messaging_dgm_sendmmsg(int sock,
+				  struct messaging_dgm_mmsghdr *msgs,
+				  unsigned int num_msgs,
+				  int *perrno)
+{
+	int ret;
+
+#ifdef MESSAGING_DGM_HAVE_MMSG
+	do {
+		ret = sendmmsg(sock, msgs, num_msgs, 0);
+	} while ((ret == -1) && (errno == EINTR));
+
+	if (ret == -1) {
+		*perrno = errno;
+	}
+#else
+	unsigned int i;
+
+	for (i=0; i<num_msgs; i++) {
+		ssize_t sent;
+
+		do {
+			sent = sendmsg(sock, &msgs[i].msg_hdr, 0);
+		} while ((sent == -1) && (errno == EINTR));
+
+		if (sent == -1) {
+			if (i == 0) {
+				*perrno = errno;
+				return -1;
+			}
+			break;
+		}
+		msgs[i].msg_len = sent;
+	}
+	ret = i;
+#endif
+	return ret;
+}
+
 struct messaging_dgm_out_queue_state {
 	struct tevent_context *ev;
 	struct pthreadpool_tevent *pool;
@@ -395,6 +627,13 @@ struct messaging_dgm_out_queue_state {
 	int *fds;
 	uint8_t *buf;
 
+	/*
+	 * Coalesced fragments, sent with sendmmsg instead of buf
+	 */
+	struct iovec *batch;
+	size_t num_batch;
+
+	size_t num_sent;
 	ssize_t sent;
 	int err;
 };
@@ -413,16 +652,13 @@ static void messaging_dgm_out_queue_done(struct tevent_req *subreq);
  * event to schedule the write.
  */
 
-static struct tevent_req *messaging_dgm_out_queue_send(
+static struct tevent_req *messaging_dgm_out_queue_create(
 	TALLOC_CTX *mem_ctx, struct tevent_context *ev,
 	struct messaging_dgm_out *out,
-	const struct iovec *iov, int iovlen, const int *fds, size_t num_fds)
+	struct messaging_dgm_out_queue_state **pstate)
 {
 	struct tevent_req *req;
 	struct messaging_dgm_out_queue_state *state;
-	struct tevent_queue_entry *e;
-	size_t i;
-	ssize_t buflen;
 
 	req = tevent_req_create(out, &state,
 				struct messaging_dgm_out_queue_state);
@@ -434,6 +670,8 @@ static struct tevent_req *messaging_dgm_out_queue_send(
 	state->sock = out->sock;
 	state->req = req;
 
+	*pstate = state;
+
 	/*
 	 * Go blocking in a thread
 	 */
@@ -446,6 +684,25 @@ static struct tevent_req *messaging_dgm_out_queue_send(
 		out->is_blocking = true;
 	}
 
+	return req;
+}
+
+static struct tevent_req *messaging_dgm_out_queue_send(
+	TALLOC_CTX *mem_ctx, struct tevent_context *ev,
+	struct messaging_dgm_out *out,
+	const struct iovec *iov, int iovlen, const int *fds, size_t num_fds)
+{
+	struct tevent_req *req;
+	struct messaging_dgm_out_queue_state *state;
+	struct tevent_queue_entry *e;
+	size_t i;
+	ssize_t buflen;
+
+	req = messaging_dgm_out_queue_create(mem_ctx, ev, out, &state);
+	if ((req == NULL) || !tevent_req_is_in_progress(req)) {
+		return req;
+	}
+
 	buflen = iov_buflen(iov, iovlen);
 	if (buflen == -1) {
 		tevent_req_error(req, EMSGSIZE);
@@ -491,6 +748,55 @@ static struct tevent_req *messaging_dgm_out_queue_send(
 	return req;
 }
 
+/*
+ * Queue coalesced fragments in one go, so the helper thread can push
+ * them with sendmmsg. Takes over the fragment buffers.
+ */
+
+static struct tevent_req *messaging_dgm_out_queue_batch_send(
+	TALLOC_CTX *mem_ctx, struct tevent_context *ev,
+	struct messaging_dgm_out *out,
+	struct iovec *iovs, size_t num_iovs)
+{
+	struct tevent_req *req;
+	struct messaging_dgm_out_queue_state *state;
+	struct tevent_queue_entry *e;
+	size_t i;
+
+	req = messaging_dgm_out_queue_create(mem_ctx, ev, out, &state);
+	if ((req == NULL) || !tevent_req_is_in_progress(req)) {
+		return req;
+	}
+
+	state->batch = talloc_array(state, struct iovec, num_iovs);
+	if (tevent_req_nomem(state->batch, req)) {
+		return tevent_req_post(req, ev);
+	}
+	state->num_batch = num_iovs;
+
+	for (i=0; i<num_iovs; i++) {
+		state->batch[i] = (struct iovec) {
+			.iov_base = talloc_move(state->batch,
+						&iovs[i].iov_base),
+			.iov_len = iovs[i].iov_len,
+		};
+	}
+
+	state->fds = talloc_array(state, int, 0);
+	if (tevent_req_nomem(state->fds, req)) {
+		return tevent_req_post(req, ev);
+	}
+
+	talloc_set_destructor(state, messaging_dgm_out_queue_state_destructor);
+
+	e = tevent_queue_add_entry(out->queue, ev, req,
+				   messaging_dgm_out_queue_trigger, req);
+	if (tevent_req_nomem(e, req)) {
+		return tevent_req_post(req, ev);
+	}
+	return req;
+}
+
 static int messaging_dgm_out_queue_state_destructor(
 	struct messaging_dgm_out_queue_state *state)
 {
@@ -538,6 +844,40 @@ static void messaging_dgm_out_queue_trigger(struct tevent_req *req,
 				req);
 }
 
+/*
+ * Blocking sendmmsg of a batch of coalesced fragments, called from
+ * the helper thread.
+ */
+
+static ssize_t messaging_dgm_out_send_batch(
+	struct messaging_dgm_out_queue_state *state)
+{
+	while (state->num_sent < state->num_batch) {
+		struct messaging_dgm_mmsghdr msgs[MESSAGING_DGM_SEND_BATCH];
+		size_t i, num_msgs;
+		int ret;
+
+		num_msgs = MIN(state->num_batch - state->num_sent,
+			       ARRAY_SIZE(msgs));
+
+		for (i=0; i<num_msgs; i++) {
+			msgs[i] = (struct messaging_dgm_mmsghdr) {
+				.msg_hdr.msg_iov =
+					&state->batch[state->num_sent + i],
+				.msg_hdr.msg_iovlen = 1,
+			};
+		}
+
+		ret = messaging_dgm_sendmmsg(state->sock, msgs, num_msgs,
+					     &state->err);
+		if (ret == -1) {
+			return -1;
+		}
+		state->num_sent += ret;
+	}
+	return 0;
+}
+
 /*
  * Wrapper function run by the pthread that calls
  * messaging_dgm_sendmsg() to actually do the sendmsg().
@@ -556,8 +896,16 @@ static void messaging_dgm_out_threaded_job(void *private_data)
 	while (true) {
 		int ret;
 
-		state->sent = messaging_dgm_sendmsg(state->sock, &iov, 1,
-					    state->fds, num_fds, &state->err);
+		if (state->batch != NULL) {
+			state->sent = messaging_dgm_out_send_batch(state);
+		} else {
+			state->sent = messaging_dgm_sendmsg(
+				state->sock, &iov, 1,
+				state->fds, num_fds, &state->err);
+			if (state->sent != -1) {
+				state->num_sent = 1;
+			}
+		}
 
 		if (state->sent != -1) {
 			return;
@@ -621,56 +969,16 @@ static int messaging_dgm_out_queue_recv(struct tevent_req *req)
 static void messaging_dgm_out_sent_fragment(struct tevent_req *req);
 
 /*
- * Core function to send a message fragment given a
- * connected struct messaging_dgm_out * destination.
- * If no current queue tries to send nonblocking
- * directly. If not, queues the fragment (which makes
- * a copy of it) and adds a 60-second timeout on the send.
+ * Pick up a queued send with messaging_dgm_out_sent_fragment, adding
+ * a 60-second timeout on the send.
  */
 
-static int messaging_dgm_out_send_fragment(
-	struct tevent_context *ev, struct messaging_dgm_out *out,
-	const struct iovec *iov, int iovlen, const int *fds, size_t num_fds)
+static int messaging_dgm_out_queued(struct tevent_context *ev,
+				    struct messaging_dgm_out *out,
+				    struct tevent_req *req)
 {
-	struct tevent_req *req;
-	size_t qlen;
 	bool ok;
 
-	qlen = tevent_queue_length(out->queue);
-	if (qlen == 0) {
-		ssize_t nsent;
-		int err = 0;
-
-		if (out->is_blocking) {
-			int ret = set_blocking(out->sock, false);
-			if (ret == -1) {
-				return errno;
-			}
-			out->is_blocking = false;
-		}
-
-		nsent = messaging_dgm_sendmsg(out->sock, iov, iovlen, fds,
-					      num_fds, &err);
-		if (nsent >= 0) {
-			return 0;
-		}
-
-		if (err == ENOBUFS) {
-			/*
-			 * FreeBSD's way of telling us the dst socket
-			 * is full. EWOULDBLOCK makes us spawn a
-			 * polling helper thread.
-			 */
-			err = EWOULDBLOCK;
-		}
-
-		if (err != EWOULDBLOCK) {
-			return err;
-		}
-	}
-
-	req = messaging_dgm_out_queue_send(out, ev, out, iov, iovlen,
-					   fds, num_fds);
 	if (req == NULL) {
 		return ENOMEM;
 	}
@@ -687,214 +995,923 @@ static int messaging_dgm_out_send_fragment(
 }
 
 /*
- * Pickup the result of the fragment send. Reset idle timer
- * if queue empty.
+ * Send the coalesced fragments with as few sendmmsg calls as
+ * possible. Whatever does not fit into the destination socket goes
+ * into the queue in order if may_queue is set, otherwise it's
+ * dropped.
  */
 
-static void messaging_dgm_out_sent_fragment(struct tevent_req *req)
+static int messaging_dgm_out_flush(struct messaging_dgm_out *out,
+				   bool may_queue)
 {
-	struct messaging_dgm_out *out = tevent_req_callback_data(
-		req, struct messaging_dgm_out);
-	int ret;
+	struct messaging_dgm_context *ctx = out->ctx;
+	struct messaging_dgm_mmsghdr msgs[MESSAGING_DGM_SEND_BATCH];
+	struct tevent_req *req = NULL;
+	size_t i, num_sent = 0;
+	int ret = 0;
 
-	ret = messaging_dgm_out_queue_recv(req);
-	TALLOC_FREE(req);
+	if (out->num_pending == 0) {
+		return 0;
+	}
 
-	if (ret != 0) {
-		DBG_WARNING("messaging_out_queue_recv returned %s\n",
-			    strerror(ret));
+	if (tevent_queue_length(out->queue) != 0) {
+		/*
+		 * Don't overtake the queue
+		 */
+		if (!may_queue) {
+			ret = EBUSY;
+			goto done;
+		}
+		req = messaging_dgm_out_queue_batch_send(
+			out, ctx->ev, out, out->pending, out->num_pending);
+		ret = messaging_dgm_out_queued(ctx->ev, out, req);
+		if (ret == 0) {
+			num_sent = out->num_pending;
+		}
+		goto done;
 	}
 
-	messaging_dgm_out_rearm_idle_timer(out);
-}
+	if (out->is_blocking) {
+		ret = set_blocking(out->sock, false);
+		if (ret == -1) {
+			ret = errno;
+			goto done;
+		}
+		out->is_blocking = false;
+	}
 
+	for (i=0; i<out->num_pending; i++) {
+		msgs[i] = (struct messaging_dgm_mmsghdr) {
+			.msg_hdr.msg_iov = &out->pending[i],
+			.msg_hdr.msg_iovlen = 1,
+		};
+	}
 
-struct messaging_dgm_fragment_hdr {
-	size_t msglen;
-	pid_t pid;
-	int sock;
-};
+	while (num_sent < out->num_pending) {
+		int nsent;
+		int err = 0;
 
-/*
- * Fragment a message into MESSAGING_DGM_FRAGMENT_LENGTH - 64-bit cookie
- * size chunks and send it.
- *
- * Message fragments are prefixed by a 64-bit cookie that
- * stays the same for all fragments. This allows the receiver
- * to recognise fragments of the same message and re-assemble
- * them on the other end.
- *
- * Note that this allows other message fragments from other
- * senders to be interleaved in the receive read processing,
- * the combination of the cookie and header info allows unique
- * identification of the message from a specific sender in
- * re-assembly.
- *
- * If the message is smaller than MESSAGING_DGM_FRAGMENT_LENGTH - cookie
- * then send a single message with cookie set to zero.
- *
- * Otherwise the message is fragmented into chunks and added
- * to the sending queue. Any file descriptors are passed only
- * in the last fragment.
- *
- * Finally the cookie is incremented (wrap over zero) to
- * prepare for the next message sent to this channel.
- *
+		nsent = messaging_dgm_sendmmsg(out->sock,
+					       msgs + num_sent,
+					       out->num_pending - num_sent,
+					       &err);
+		if (nsent > 0) {
+			messaging_dgm_count_batch(&ctx->stats.send, nsent);
+			num_sent += nsent;
+			continue;
+		}
+
+		if (err == ENOBUFS) {
+			/*
+			 * FreeBSD's way of telling us the dst socket
+			 * is full.
+			 */
+			err = EWOULDBLOCK;
+		}
+		if ((err != EWOULDBLOCK) || !may_queue) {
+			ret = err;
+			break;
+		}
+
+		req = messaging_dgm_out_queue_batch_send(
+			out, ctx->ev, out, out->pending + num_sent,
+			out->num_pending - num_sent);
+		ret = messaging_dgm_out_queued(ctx->ev, out, req);
+		if (ret == 0) {
+			num_sent = out->num_pending;
+		}
+		break;
+	}
+
+done:
+	if ((ret == ECONNREFUSED) || ((ret != 0) && !may_queue)) {
+		/*
+		 * Keep what was not sent. The caller reconnects or
+		 * hands it to a helper thread.
+		 */
+		messaging_dgm_out_drop_pending(out, num_sent);
+		return ret;
+	}
+
+	if (ret != 0) {
+		DBG_NOTICE("Dropped %zu of %zu messages to %u: %s\n",
+			   out->num_pending - num_sent,
+			   out->num_pending,
+			   (unsigned)out->pid,
+			   strerror(ret));
+	}
+
+	messaging_dgm_out_drop_pending(out, out->num_pending);
+
+	return ret;
+}
+
+/*
+ * Free the first num coalesced fragments, the rest moves up.
  */
 
-static int messaging_dgm_out_send_fragmented(struct tevent_context *ev,
-					     struct messaging_dgm_out *out,
-					     const struct iovec *iov,
-					     int iovlen,
-					     const int *fds, size_t num_fds)
+static void messaging_dgm_out_drop_pending(struct messaging_dgm_out *out,
+					   size_t num)
 {
-	ssize_t msglen, sent;
-	int ret = 0;
-	struct iovec iov_copy[iovlen+2];
-	struct messaging_dgm_fragment_hdr hdr;
-	struct iovec src_iov;
+	size_t i;
 
-	if (iovlen < 0) {
-		return EINVAL;
+	num = MIN(num, out->num_pending);
+
+	for (i=0; i<num; i++) {
+		TALLOC_FREE(out->pending[i].iov_base);
 	}
+	memmove(out->pending, out->pending + num,
+		(out->num_pending - num) * sizeof(struct iovec));
+	out->num_pending -= num;
+}
 
-	msglen = iov_buflen(iov, iovlen);
-	if (msglen == -1) {
-		return EMSGSIZE;
+static void messaging_dgm_out_detached_done(struct tevent_req *subreq);
+
+/*
+ * out is going away: Send what fits into the socket right now and
+ * give the remaining coalesced fragments to a helper thread on a
+ * copy of the socket. Nobody waits for that job, it cleans up after
+ * itself.
+ */
+
+static void messaging_dgm_out_flush_detached(struct messaging_dgm_out *out)
+{
+	struct messaging_dgm_context *ctx = out->ctx;
+	struct messaging_dgm_out_queue_state *state = NULL;
+	struct tevent_req *subreq = NULL;
+	size_t i;
+	int ret;
+
+	ret = messaging_dgm_out_flush(out, false);
+	if ((out->num_pending == 0) || (ret == ECONNREFUSED)) {
+		return;
 	}
-	if (num_fds > INT8_MAX) {
-		return EINVAL;
+
+	state = talloc_zero(NULL, struct messaging_dgm_out_queue_state);
+	if (state == NULL) {
+		goto fail;
 	}
+	state->ev = ctx->ev;
+	state->pool = ctx->pool;
 
-	if ((size_t) msglen <=
-	    (MESSAGING_DGM_FRAGMENT_LENGTH - sizeof(uint64_t))) {
-		uint64_t cookie = 0;
+	state->batch = talloc_array(state, struct iovec, out->num_pending);
+	if (state->batch == NULL) {
+		goto fail;
+	}
+	state->fds = talloc_array(state, int, 0);
+	if (state->fds == NULL) {
+		goto fail;
+	}
 
-		iov_copy[0].iov_base = &cookie;
-		iov_copy[0].iov_len = sizeof(cookie);
-		if (iovlen > 0) {
-			memcpy(&iov_copy[1], iov,
-			       sizeof(struct iovec) * iovlen);
-		}
+	state->sock = dup(out->sock);
+	if (state->sock == -1) {
+		goto fail;
+	}
+	ret = set_blocking(state->sock, true);
+	if (ret == -1) {
+		close(state->sock);
+		goto fail;
+	}
 
-		return messaging_dgm_out_send_fragment(
-			ev, out, iov_copy, iovlen+1, fds, num_fds);
+	for (i=0; i<out->num_pending; i++) {
+		state->batch[i] = (struct iovec) {
+			.iov_base = talloc_move(state->batch,
+						&out->pending[i].iov_base),
+			.iov_len = out->pending[i].iov_len,
+		};
+	}
+	state->num_batch = out->num_pending;
 
+	subreq = pthreadpool_tevent_job_send(
+		state, state->ev, state->pool,
+		messaging_dgm_out_threaded_job, state);
+	if (subreq == NULL) {
+		close(state->sock);
+		goto fail;
 	}
+	tevent_req_set_callback(subreq, messaging_dgm_out_detached_done,
+				state);
 
-	hdr = (struct messaging_dgm_fragment_hdr) {
-		.msglen = msglen,
-		.pid = tevent_cached_getpid(),
-		.sock = out->sock
-	};
+	out->num_pending = 0;
+	return;
 
-	iov_copy[0].iov_base = &out->cookie;
-	iov_copy[0].iov_len = sizeof(out->cookie);
-	iov_copy[1].iov_base = &hdr;
-	iov_copy[1].iov_len = sizeof(hdr);
+fail:
+	DBG_NOTICE("Dropped %zu messages to %u\n",
+		   out->num_pending,
+		   (unsigned)out->pid);
+	TALLOC_FREE(state);
+}
 
-	sent = 0;
-	src_iov = iov[0];
+static void messaging_dgm_out_detached_done(struct tevent_req *subreq)
+{
+	struct messaging_dgm_out_queue_state *state = tevent_req_callback_data(
+		subreq, struct messaging_dgm_out_queue_state);
+	int ret;
 
-	/*
-	 * The following write loop sends the user message in pieces. We have
-	 * filled the first two iovecs above with "cookie" and "hdr". In the
-	 * following loops we pull message chunks from the user iov array and
-	 * fill iov_copy piece by piece, possibly truncating chunks from the
-	 * caller's iov array. Ugly, but hopefully efficient.
-	 */
+	ret = pthreadpool_tevent_job_recv(subreq);
+	TALLOC_FREE(subreq);
 
-	while (sent < msglen) {
-		size_t fragment_len;
-		size_t iov_index = 2;
+	if ((ret == 0) && (state->sent == -1)) {
+		ret = state->err;
+	}
+	if (ret != 0) {
+		DBG_NOTICE("Dropped %zu of %zu messages: %s\n",
+			   state->num_batch - state->num_sent,
+			   state->num_batch,
+			   strerror(ret));
+	}
 
-		fragment_len = sizeof(out->cookie) + sizeof(hdr);
+	close(state->sock);
+	TALLOC_FREE(state);
+}
 
-		while (fragment_len < MESSAGING_DGM_FRAGMENT_LENGTH) {
-			size_t space, chunk;
+/*
+ * The receiver has re-opened its socket or is gone. Move the
+ * coalesced fragments the old socket refused to a new one, out is
+ * freed.
+ */
 
-			space = MESSAGING_DGM_FRAGMENT_LENGTH - fragment_len;
-			chunk = MIN(space, src_iov.iov_len);
+static void messaging_dgm_out_reconnect(struct messaging_dgm_out *out)
+{
+	struct messaging_dgm_context *ctx = out->ctx;
+	struct messaging_dgm_out *new_out = NULL;
+	size_t i;
+	int ret;
 
-			iov_copy[iov_index].iov_base = src_iov.iov_base;
-			iov_copy[iov_index].iov_len = chunk;
-			iov_index += 1;
+	if (out->num_pending == 0) {
+		TALLOC_FREE(out);
+		return;
+	}
 
-			src_iov.iov_base = (char *)src_iov.iov_base + chunk;
-			src_iov.iov_len -= chunk;
-			fragment_len += chunk;
+	ret = messaging_dgm_out_create(ctx, ctx, out->pid, &new_out);
+	if (ret != 0) {
+		DBG_NOTICE("Dropped %zu messages to %u: %s\n",
+			   out->num_pending,
+			   (unsigned)out->pid,
+			   strerror(ret));
+		messaging_dgm_out_drop_pending(out, out->num_pending);
+		TALLOC_FREE(out);
+		return;
+	}
 
-			if (src_iov.iov_len == 0) {
-				iov += 1;
-				iovlen -= 1;
-				if (iovlen == 0) {
-					break;
-				}
-				src_iov = iov[0];
-			}
-		}
-		sent += (fragment_len - sizeof(out->cookie) - sizeof(hdr));
+	for (i=0; i<out->num_pending; i++) {
+		new_out->pending[i] = (struct iovec) {
+			.iov_base = talloc_move(new_out,
+						&out->pending[i].iov_base),
+			.iov_len = out->pending[i].iov_len,
+		};
+	}
+	new_out->num_pending = out->num_pending;
+	out->num_pending = 0;
+	TALLOC_FREE(out);
 
-		/*
-		 * only the last fragment should pass the fd array.
-		 * That simplifies the receiver a lot.
-		 */
-		if (sent < msglen) {
-			ret = messaging_dgm_out_send_fragment(
-				ev, out, iov_copy, iov_index, NULL, 0);
-		} else {
-			ret = messaging_dgm_out_send_fragment(
-				ev, out, iov_copy, iov_index, fds, num_fds);
+	ret = messaging_dgm_out_flush(new_out, true);
+	if (ret == ECONNREFUSED) {
+		DBG_NOTICE("Dropped %zu messages to %u: %s\n",
+			   new_out->num_pending,
+			   (unsigned)new_out->pid,
+			   strerror(ret));
+		messaging_dgm_out_drop_pending(new_out,
+					       new_out->num_pending);
+		TALLOC_FREE(new_out);
+		return;
+	}
+	messaging_dgm_out_rearm_idle_timer(new_out);
+}
+
+/*
+ * Called once per event loop iteration after something was
+ * coalesced.
+ */
+
+static void messaging_dgm_flush_all(struct messaging_dgm_context *ctx)
+{
+	struct messaging_dgm_out *out, *next;
+
+	for (out = ctx->outsocks; out != NULL; out = next) {
+		int ret;
+
+		next = out->next;
+
+		if (tevent_cached_getpid() != ctx->pid) {
+			/*
+			 * Our parent will send those
+			 */
+			TALLOC_FREE(out);
+			continue;
 		}
-		if (ret != 0) {
-			break;
+
+		ret = messaging_dgm_out_flush(out, true);
+		if (ret == ECONNREFUSED) {
+			messaging_dgm_out_reconnect(out);
+			continue;
 		}
+		messaging_dgm_out_rearm_idle_timer(out);
 	}
+}
 
-	out->cookie += 1;
-	if (out->cookie == 0) {
-		out->cookie += 1;
-	}
+static void messaging_dgm_flush_handler(struct tevent_context *ev,
+					struct tevent_immediate *im,
+					void *private_data)
+{
+	struct messaging_dgm_context *ctx = talloc_get_type_abort(
+		private_data, struct messaging_dgm_context);
 
-	return ret;
+	messaging_dgm_flush_all(ctx);
 }
 
-static struct messaging_dgm_context *global_dgm_context;
+/*
+ * Flush in the next iteration of whichever event loop runs first. A
+ * nested loop on a private tevent context registered with
+ * messaging_dgm_register_tevent_context() does not run ctx->ev.
+ */
 
-static int messaging_dgm_context_destructor(struct messaging_dgm_context *c);
+static void messaging_dgm_schedule_flush(struct messaging_dgm_context *ctx)
+{
+	struct messaging_dgm_fde_ev *fde_ev;
 
-static int messaging_dgm_lockfile_create(struct messaging_dgm_context *ctx,
-					 pid_t pid, int *plockfile_fd,
-					 uint64_t *punique)
+	tevent_schedule_immediate(ctx->flush_im, ctx->ev,
+				  messaging_dgm_flush_handler, ctx);
+
+	for (fde_ev = ctx->fde_evs; fde_ev != NULL; fde_ev = fde_ev->next) {
+		if ((fde_ev->ev == ctx->ev) ||
+		    (tevent_fd_get_flags(fde_ev->fde) == 0)) {
+			/*
+			 * Scheduled above, or the event context is
+			 * gone
+			 */
+			continue;
+		}
+		tevent_schedule_immediate(fde_ev->flush_im, fde_ev->ev,
+					  messaging_dgm_flush_handler, ctx);
+	}
+}
+
+/*
+ * Make a copy of the fragment for the next messaging_dgm_flush_handler
+ * run.
+ */
+
+static int messaging_dgm_out_coalesce_fragment(struct messaging_dgm_out *out,
+					       const struct iovec *iov,
+					       int iovlen)
 {
-	char buf[64];
-	int lockfile_fd;
-	struct sun_path_buf lockfile_name;
-	struct flock lck;
-	uint64_t unique;
-	int unique_len, ret;
-	ssize_t written;
+	struct messaging_dgm_context *ctx = out->ctx;
+	ssize_t buflen;
+	uint8_t *buf;
 
-	ret = snprintf(lockfile_name.buf, sizeof(lockfile_name.buf),
-		       "%s/%u", ctx->lockfile_dir.buf, (unsigned)pid);
-	if (ret < 0) {
-		return errno;
+	buflen = iov_buflen(iov, iovlen);
+	if (buflen == -1) {
+		return EMSGSIZE;
 	}
-	if ((unsigned)ret >= sizeof(lockfile_name.buf)) {
-		return ENAMETOOLONG;
+
+	buf = talloc_array(out, uint8_t, buflen);
+	if (buf == NULL) {
+		return ENOMEM;
 	}
+	iov_buf(iov, iovlen, buf, buflen);
 
-	/* no O_EXCL, existence check is via the fcntl lock */
+	out->pending[out->num_pending] = (struct iovec) {
+		.iov_base = buf, .iov_len = buflen,
+	};
+	out->num_pending += 1;
 
-	lockfile_fd = open(lockfile_name.buf, O_NONBLOCK|O_CREAT|O_RDWR,
-			   0644);
+	if (out->num_pending == 1) {
+		messaging_dgm_schedule_flush(ctx);
+	}
 
-        if ((lockfile_fd == -1) &&
-	    ((errno == ENXIO) /* Linux */ ||
-	     (errno == ENODEV) /* Linux kernel bug */ ||
-	     (errno == EOPNOTSUPP) /* FreeBSD */)) {
-		/*
-                 * Huh -- a socket? This might be a stale socket from
+	return 0;
+}
+
+/*
+ * Core function to send a message fragment given a
+ * connected struct messaging_dgm_out * destination.
+ * In coalescing mode defers the fragment to the next event
+ * loop iteration. Otherwise if no current queue tries to send
+ * nonblocking directly. If not, queues the fragment (which makes
+ * a copy of it) and adds a 60-second timeout on the send.
+ */
+
+static int messaging_dgm_out_send_fragment(
+	struct tevent_context *ev, struct messaging_dgm_out *out,
+	const struct iovec *iov, int iovlen, const int *fds, size_t num_fds)
+{
+	struct tevent_req *req;
+	size_t qlen;
+
+	if ((out->num_pending == ARRAY_SIZE(out->pending)) ||
+	    ((out->num_pending != 0) && (num_fds != 0))) {
+		/*
+		 * Batch full or we need to pass fds, which we don't
+		 * coalesce. Send what we have to keep the order.
+		 */
+		int ret = messaging_dgm_out_flush(out, true);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	if ((num_fds == 0) && messaging_dgm_coalesce) {
+		return messaging_dgm_out_coalesce_fragment(out, iov, iovlen);
+	}
+
+	qlen = tevent_queue_length(out->queue);
+
+	if (qlen == 0) {
+		ssize_t nsent;
+		int err = 0;
+
+		if (out->is_blocking) {
+			int ret = set_blocking(out->sock, false);
+			if (ret == -1) {
+				return errno;
+			}
+			out->is_blocking = false;
+		}
+
+		nsent = messaging_dgm_sendmsg(out->sock, iov, iovlen, fds,
+					      num_fds, &err);
+		if (nsent >= 0) {
+			messaging_dgm_count_batch(&out->ctx->stats.send, 1);
+			return 0;
+		}
+
+		if (err == ENOBUFS) {
+			/*
+			 * FreeBSD's way of telling us the dst socket
+			 * is full. EWOULDBLOCK makes us spawn a
+			 * polling helper thread.
+			 */
+			err = EWOULDBLOCK;
+		}
+
+		if (err != EWOULDBLOCK) {
+			return err;
+		}
+	}
+
+	req = messaging_dgm_out_queue_send(out, ev, out, iov, iovlen,
+					   fds, num_fds);
+	return messaging_dgm_out_queued(ev, out, req);
+}
+
+/*
+ * Pickup the result of the fragment send. Reset idle timer
+ * if queue empty.
+ */
+
+static void messaging_dgm_out_sent_fragment(struct tevent_req *req)
+{
+	struct messaging_dgm_out *out = tevent_req_callback_data(
+		req, struct messaging_dgm_out);
+	struct messaging_dgm_out_queue_state *state = tevent_req_data(
+		req, struct messaging_dgm_out_queue_state);
+	int ret;
+
+	messaging_dgm_count_batch(&out->ctx->stats.send, state->num_sent);
+
+	ret = messaging_dgm_out_queue_recv(req);
+	TALLOC_FREE(req);
+
+	if (ret != 0) {
+		DBG_WARNING("messaging_out_queue_recv returned %s\n",
+			    strerror(ret));
+	}
+
+	messaging_dgm_out_rearm_idle_timer(out);
+}
+
+
+struct messaging_dgm_fragment_hdr {
+	size_t msglen;
+	pid_t pid;
+	int sock;
+};
+
+/*
+ * Fragment a message into MESSAGING_DGM_FRAGMENT_LENGTH - 64-bit cookie
+ * size chunks and send it.
+ *
+ * Message fragments are prefixed by a 64-bit cookie that
+ * stays the same for all fragments. This allows the receiver
+ * to recognise fragments of the same message and re-assemble
+ * them on the other end.
+ *
+ * Note that this allows other message fragments from other
+ * senders to be interleaved in the receive read processing,
+ * the combination of the cookie and header info allows unique
+ * identification of the message from a specific sender in
+ * re-assembly.
+ *
+ * If the message is smaller than MESSAGING_DGM_FRAGMENT_LENGTH - cookie
+ * then send a single message with cookie set to zero.
+ *
+ * Otherwise the message is fragmented into chunks and added
+ * to the sending queue. Any file descriptors are passed only
+ * in the last fragment.
+ *
+ * Finally the cookie is incremented (wrap over zero) to
+ * prepare for the next message sent to this channel.
+ *
+ */
+
+static int messaging_dgm_out_send_fragmented(struct tevent_context *ev,
+					     struct messaging_dgm_out *out,
+					     const struct iovec *iov,
+					     int iovlen,
+					     const int *fds, size_t num_fds)
+{
+	ssize_t msglen, sent;
+	int ret = 0;
+	struct iovec iov_copy[iovlen+2];
+	struct messaging_dgm_fragment_hdr hdr;
+	struct iovec src_iov;
+
+	if (iovlen < 0) {
+		return EINVAL;
+	}
+
+	msglen = iov_buflen(iov, iovlen);
+	if (msglen == -1) {
+		return EMSGSIZE;
+	}
+	if (num_fds > INT8_MAX) {
+		return EINVAL;
+	}
+
+	if ((size_t) msglen <=
+	    (MESSAGING_DGM_FRAGMENT_LENGTH - sizeof(uint64_t))) {
+		uint64_t cookie = 0;
+
+		iov_copy[0].iov_base = &cookie;
+		iov_copy[0].iov_len = sizeof(cookie);
+		if (iovlen > 0) {
+			memcpy(&iov_copy[1], iov,
+			       sizeof(struct iovec) * iovlen);
+		}
+
+		return messaging_dgm_out_send_fragment(
+			ev, out, iov_copy, iovlen+1, fds, num_fds);
+
+	}
+
+	hdr = (struct messaging_dgm_fragment_hdr) {
+		.msglen = msglen,
+		.pid = tevent_cached_getpid(),
+		.sock = out->sock
+	};
+
+	iov_copy[0].iov_base = &out->cookie;
+	iov_copy[0].iov_len = sizeof(out->cookie);
+	iov_copy[1].iov_base = &hdr;
+	iov_copy[1].iov_len = sizeof(hdr);
+
+	sent = 0;
+	src_iov = iov[0];
+
+	/*
+	 * The following write loop sends the user message in pieces. We have
+	 * filled the first two iovecs above with "cookie" and "hdr". In the
+	 * following loops we pull message chunks from the user iov array and
+	 * fill iov_copy piece by piece, possibly truncating chunks from the
+	 * caller's iov array. Ugly, but hopefully efficient.
+	 */
+
+	while (sent < msglen) {
+		size_t fragment_len;
+		size_t iov_index = 2;
+
+		fragment_len = sizeof(out->cookie) + sizeof(hdr);
+
+		while (fragment_len < MESSAGING_DGM_FRAGMENT_LENGTH) {
+			size_t space, chunk;
+
+			space = MESSAGING_DGM_FRAGMENT_LENGTH - fragment_len;
+			chunk = MIN(space, src_iov.iov_len);
+
+			iov_copy[iov_index].iov_base = src_iov.iov_base;
+			iov_copy[iov_index].iov_len = chunk;
+			iov_index += 1;
+
+			src_iov.iov_base = (char *)src_iov.iov_base + chunk;
+			src_iov.iov_len -= chunk;
+			fragment_len += chunk;
+
+			if (src_iov.iov_len == 0) {
+				iov += 1;
+				iovlen -= 1;
+				if (iovlen == 0) {
+					break;
+				}
+				src_iov = iov[0];
+			}
+		}
+		sent += (fragment_len - sizeof(out->cookie) - sizeof(hdr));
+
+		/*
+		 * only the last fragment should pass the fd array.
+		 * That simplifies the receiver a lot.
+		 */
+		if (sent < msglen) {
+			ret = messaging_dgm_out_send_fragment(
+				ev, out, iov_copy, iov_index, NULL, 0);
+		} else {
+			ret = messaging_dgm_out_send_fragment(
+				ev, out, iov_copy, iov_index, fds, num_fds);
+		}
+		if (ret != 0) {
+			break;
+		}
+	}
+
+	out->cookie += 1;
+	if ((out->cookie == 0) || (out->cookie == MESSAGING_DGM_COOKIE_SHM)) {
+		out->cookie = 1;
+	}
+
+	return ret;
+}
+
+/*
+ * Control datagrams go through messaging_dgm_out_send_fragment() like
+ * everything else, so they are ordered with the message fragments.
+ */
+
+static int messaging_dgm_out_send_shm_ctrl(struct messaging_dgm_out *out,
+					   enum messaging_dgm_shm_op op,
+					   uint64_t id,
+					   const int *fds, size_t num_fds)
+{
+	uint64_t cookie = MESSAGING_DGM_COOKIE_SHM;
+	struct messaging_dgm_shm_ctrl ctrl = {
+		.op = op, .pid = tevent_cached_getpid(), .id = id,
+	};
+	struct iovec iov[] = {
+		{ .iov_base = &cookie, .iov_len = sizeof(cookie) },
+		{ .iov_base = &ctrl, .iov_len = sizeof(ctrl) },
+	};
+
+	return messaging_dgm_out_send_fragment(
+		out->ctx->ev, out, iov, ARRAY_SIZE(iov), fds, num_fds);
+}
+
+static void messaging_dgm_shm_wake(int doorbell)
+{
+	uint64_t one = 1;
+	ssize_t nwritten;
+
+	/*
+	 * Nonblocking eventfd. If the counter is full, the receiver
+	 * has a wakeup pending anyway.
+	 */
+	nwritten = write(doorbell, &one, sizeof(one));
+	(void)nwritten;
+}
+
+static int messaging_dgm_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void messaging_dgm_out_shm_setup(struct messaging_dgm_out *out)
+{
+	struct messaging_dgm_context *ctx = out->ctx;
+	int fd = -1;
+	int ret;
+
+	out->shm_state = MESSAGING_DGM_SHM_FAILED;
+
+	/*
+	 * Without a socket send we'd never see ECONNREFUSED from
+	 * a dead receiver. Pin the process we talk to, the ring
+	 * is not an option if we can't.
+	 */
+	out->shm_pidfd = messaging_dgm_pidfd_open(out->pid);
+	if (out->shm_pidfd == -1) {
+		DBG_DEBUG("pidfd_open(%u) failed: %s\n",
+			  (unsigned)out->pid, strerror(errno));
+		return;
+	}
+
+	out->shm = messaging_dgm_shm_ring_create(
+		out, messaging_dgm_shm_size, &fd);
+	if (out->shm == NULL) {
+		DBG_DEBUG("messaging_dgm_shm_ring_create failed: %s\n",
+			  strerror(errno));
+		return;
+	}
+	out->shm_id = ctx->shm_next_id++;
+
+	ret = messaging_dgm_out_send_shm_ctrl(
+		out, MESSAGING_DGM_SHM_OP_SETUP, out->shm_id, &fd, 1);
+	close(fd);
+	if (ret != 0) {
+		DBG_DEBUG("Could not send ring setup to %u: %s\n",
+			  (unsigned)out->pid, strerror(ret));
+		TALLOC_FREE(out->shm);
+		return;
+	}
+
+	out->shm_state = MESSAGING_DGM_SHM_SETUP_SENT;
+}
+
+/*
+ * The receiver might have died with the ring still active. Unless it
+ * read from the ring since we last looked, check its pidfd. This
+ * only costs a syscall if the receiver is idle anyway or does not
+ * keep up.
+ */
+
+static bool messaging_dgm_out_shm_alive(struct messaging_dgm_out *out)
+{
+	uint64_t tail = messaging_dgm_shm_ring_tail(out->shm);
+	bool idle = (messaging_dgm_shm_ring_used(out->shm) == 0);
+	struct pollfd pfd = { .fd = out->shm_pidfd, .events = POLLIN };
+	int ret;
+
+	if (!idle && (tail != out->shm_probe_tail)) {
+		out->shm_probe_tail = tail;
+		return true;
+	}
+	out->shm_probe_tail = tail;
+
+	ret = poll(&pfd, 1, 0);
+
+	/*
+	 * On error let the socket tell us
+	 */
+	return (ret == 0);
+}
+
+static void messaging_dgm_out_shm_teardown(struct messaging_dgm_out *out)
+{
+	messaging_dgm_shm_ring_close(out->shm);
+	TALLOC_FREE(out->shm);
+	if (out->shm_doorbell != -1) {
+		close(out->shm_doorbell);
+		out->shm_doorbell = -1;
+	}
+	if (out->shm_pidfd != -1) {
+		close(out->shm_pidfd);
+		out->shm_pidfd = -1;
+	}
+	out->shm_state = MESSAGING_DGM_SHM_FAILED;
+}
+
+/*
+ * Try to put a message into the ring to out->pid, return false if it
+ * has to go through the socket.
+ *
+ * The ring is offered to the receiver after a few messages. Once the
+ * receiver has acked it and we've sent a START datagram, all messages
+ * go into the ring. Messages passing fds, messages too large for the
+ * ring and whatever does not fit into a full ring go through the
+ * socket: We put a STOP marker into the ring first, and the receiver
+ * reads its rings up to the STOP marker before it looks at the next
+ * datagram. Going back to the ring takes another START datagram
+ * behind the socket messages, the receiver won't look at the ring
+ * before it has seen that.
+ *
+ * If the receiver is gone we drop the ring, so that the socket
+ * reports ECONNREFUSED like it would have without the ring.
+ */
+
+static bool messaging_dgm_out_shm_send(struct messaging_dgm_out *out,
+				       const struct iovec *iov, int iovlen,
+				       size_t num_fds)
+{
+	struct messaging_dgm_context *ctx = out->ctx;
+	bool use_ring = ((messaging_dgm_shm_size != 0) && (num_fds == 0));
+	bool wake = false;
+	ssize_t msglen;
+	int ret;
+
+	if (tevent_cached_getpid() != ctx->pid) {
+		/*
+		 * Forked child, the ring is our parent's
+		 */
+		return false;
+	}
+
+	if (iovlen < 0) {
+		return false;
+	}
+	msglen = iov_buflen(iov, iovlen);
+	if (msglen == -1) {
+		return false;
+	}
+
+	switch (out->shm_state) {
+	case MESSAGING_DGM_SHM_NONE:
+		out->num_msgs += 1;
+		if (use_ring &&
+		    (out->num_msgs >= MESSAGING_DGM_SHM_SETUP_THRESHOLD)) {
+			messaging_dgm_out_shm_setup(out);
+		}
+		return false;
+	case MESSAGING_DGM_SHM_SETUP_SENT:
+	case MESSAGING_DGM_SHM_FAILED:
+		return false;
+	case MESSAGING_DGM_SHM_STOPPED:
+		if (!use_ring ||
+		    ((size_t)msglen >
+		     messaging_dgm_shm_ring_max_msglen(out->shm)) ||
+		    (messaging_dgm_shm_ring_used(out->shm) >
+		     messaging_dgm_shm_ring_size(out->shm) / 2)) {
+			return false;
+		}
+		ret = messaging_dgm_out_send_shm_ctrl(
+			out, MESSAGING_DGM_SHM_OP_START, out->shm_id,
+			NULL, 0);
+		if (ret != 0) {
+			return false;
+		}
+		out->shm_state = MESSAGING_DGM_SHM_ACTIVE;
+		FALL_THROUGH;
+	case MESSAGING_DGM_SHM_ACTIVE:
+		break;
+	}
+
+	if (!messaging_dgm_out_shm_alive(out)) {
+		DBG_DEBUG("Receiver %u is gone, dropping the ring\n",
+			  (unsigned)out->pid);
+		messaging_dgm_out_shm_teardown(out);
+		return false;
+	}
+
+	if (use_ring) {
+		ret = messaging_dgm_shm_ring_push(
+			out->shm, MESSAGING_DGM_SHM_DATA, iov, iovlen, &wake);
+		if (ret == 0) {
+			ctx->stats.shm.sent += 1;
+			if (wake) {
+				messaging_dgm_shm_wake(out->shm_doorbell);
+				ctx->stats.shm.wakeups += 1;
+			}
+			return true;
+		}
+	}
+
+	ret = messaging_dgm_shm_ring_push(
+		out->shm, MESSAGING_DGM_SHM_STOP, NULL, 0, &wake);
+	if (ret != 0) {
+		/*
+		 * Can't happen, there's always space for STOP. Never
+		 * write to the ring again, the receiver reads all of
+		 * it before the next datagram.
+		 */
+		DBG_WARNING("Could not stop ring to %u: %s\n",
+			    (unsigned)out->pid, strerror(ret));
+		out->shm_state = MESSAGING_DGM_SHM_FAILED;
+		return false;
+	}
+
+	ctx->stats.shm.fallbacks += 1;
+	out->shm_state = MESSAGING_DGM_SHM_STOPPED;
+	return false;
+}
+
+static struct messaging_dgm_context *global_dgm_context;
+
+static int messaging_dgm_context_destructor(struct messaging_dgm_context *c);
+
+static int messaging_dgm_lockfile_create(struct messaging_dgm_context *ctx,
+					 pid_t pid, int *plockfile_fd,
+					 uint64_t *punique)
+{
+	char buf[64];
+	int lockfile_fd;
+	struct sun_path_buf lockfile_name;
+	struct flock lck;
+	uint64_t unique;
+	int unique_len, ret;
+	ssize_t written;
+
+	ret = snprintf(lockfile_name.buf, sizeof(lockfile_name.buf),
+		       "%s/%u", ctx->lockfile_dir.buf, (unsigned)pid);
+	if (ret < 0) {
+		return errno;
+	}
+	if ((unsigned)ret >= sizeof(lockfile_name.buf)) {
+		return ENAMETOOLONG;
+	}
+
+	/* no O_EXCL, existence check is via the fcntl lock */
+
+	lockfile_fd = open(lockfile_name.buf, O_NONBLOCK|O_CREAT|O_RDWR,
+			   0644);
+
+        if ((lockfile_fd == -1) &&
+	    ((errno == ENXIO) /* Linux */ ||
+	     (errno == ENODEV) /* Linux kernel bug */ ||
+	     (errno == EOPNOTSUPP) /* FreeBSD */)) {
+		/*
+                 * Huh -- a socket? This might be a stale socket from
                  * an upgrade of Samba. Just unlink and retry, nobody
                  * else is supposed to be here at this time.
                  *
@@ -903,417 +1920,872 @@ static int messaging_dgm_lockfile_create(struct messaging_dgm_context *ctx,
                  */
 		unlink(lockfile_name.buf);
 
-		lockfile_fd = open(lockfile_name.buf,
-				   O_NONBLOCK|O_CREAT|O_WRONLY,
-				   0644);
-	}
+		lockfile_fd = open(lockfile_name.buf,
+				   O_NONBLOCK|O_CREAT|O_WRONLY,
+				   0644);
+	}
+
+	if (lockfile_fd == -1) {
+		ret = errno;
+		DEBUG(1, ("%s: open failed: %s\n", __func__, strerror(errno)));
+		return ret;
+	}
+
+	lck = (struct flock) {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET
+	};
+
+	ret = fcntl(lockfile_fd, F_SETLK, &lck);
+	if (ret == -1) {
+		ret = errno;
+		DEBUG(1, ("%s: fcntl failed: %s\n", __func__, strerror(ret)));
+		goto fail_close;
+	}
+
+	/*
+	 * Directly using the binary value for
+	 * SERVERID_UNIQUE_ID_NOT_TO_VERIFY is a layering
+	 * violation. But including all of ndr here just for this
+	 * seems to be a bit overkill to me. Also, messages_dgm might
+	 * be replaced sooner or later by something streams-based,
+	 * where unique_id generation will be handled differently.
+	 */
+
+	do {
+		generate_random_buffer((uint8_t *)&unique, sizeof(unique));
+	} while (unique == UINT64_C(0xFFFFFFFFFFFFFFFF));
+
+	unique_len = snprintf(buf, sizeof(buf), "%"PRIu64"\n", unique);
+
+	/* shorten a potentially preexisting file */
+
+	ret = ftruncate(lockfile_fd, unique_len);
+	if (ret == -1) {
+		ret = errno;
+		DEBUG(1, ("%s: ftruncate failed: %s\n", __func__,
+			  strerror(ret)));
+		goto fail_unlink;
+	}
+
+	written = write(lockfile_fd, buf, unique_len);
+	if (written != unique_len) {
+		ret = errno;
+		DEBUG(1, ("%s: write failed: %s\n", __func__, strerror(ret)));
+		goto fail_unlink;
+	}
+
+	*plockfile_fd = lockfile_fd;
+	*punique = unique;
+	return 0;
+
+fail_unlink:
+	unlink(lockfile_name.buf);
+fail_close:
+	close(lockfile_fd);
+	return ret;
+}
+
+static void messaging_dgm_read_handler(struct tevent_context *ev,
+				       struct tevent_fd *fde,
+				       uint16_t flags,
+				       void *private_data);
+
+/*
+ * Create the rendezvous point in the file system
+ * that other processes can use to send messages to
+ * this pid.
+ */
+
+int messaging_dgm_init(struct tevent_context *ev,
+		       uint64_t *punique,
+		       const char *socket_dir,
+		       const char *lockfile_dir,
+		       void (*recv_cb)(struct tevent_context *ev,
+				       const uint8_t *msg,
+				       size_t msg_len,
+				       int *fds,
+				       size_t num_fds,
+				       void *private_data),
+		       void *recv_cb_private_data)
+{
+	struct messaging_dgm_context *ctx;
+	int ret;
+	struct sockaddr_un socket_address;
+	size_t len;
+	static bool have_dgm_context = false;
+
+	if (have_dgm_context) {
+		return EEXIST;
+	}
+
+	if ((socket_dir == NULL) || (lockfile_dir == NULL)) {
+		return EINVAL;
+	}
+
+	ctx = talloc_zero(NULL, struct messaging_dgm_context);
+	if (ctx == NULL) {
+		goto fail_nomem;
+	}
+	ctx->ev = ev;
+	ctx->pid = tevent_cached_getpid();
+	ctx->shm_doorbell = -1;
+	ctx->recv_cb = recv_cb;
+	ctx->recv_cb_private_data = recv_cb_private_data;
+
+	len = strlcpy(ctx->lockfile_dir.buf, lockfile_dir,
+		      sizeof(ctx->lockfile_dir.buf));
+	if (len >= sizeof(ctx->lockfile_dir.buf)) {
+		TALLOC_FREE(ctx);
+		return ENAMETOOLONG;
+	}
+
+	len = strlcpy(ctx->socket_dir.buf, socket_dir,
+		      sizeof(ctx->socket_dir.buf));
+	if (len >= sizeof(ctx->socket_dir.buf)) {
+		TALLOC_FREE(ctx);
+		return ENAMETOOLONG;
+	}
+
+	socket_address = (struct sockaddr_un) { .sun_family = AF_UNIX };
+	len = snprintf(socket_address.sun_path,
+		       sizeof(socket_address.sun_path),
+		       "%s/%u", socket_dir, (unsigned)ctx->pid);
+	if (len >= sizeof(socket_address.sun_path)) {
+		TALLOC_FREE(ctx);
+		return ENAMETOOLONG;
+	}
+
+	ret = messaging_dgm_lockfile_create(ctx, ctx->pid, &ctx->lockfile_fd,
+					    punique);
+	if (ret != 0) {
+		DEBUG(1, ("%s: messaging_dgm_create_lockfile failed: %s\n",
+			  __func__, strerror(ret)));
+		TALLOC_FREE(ctx);
+		return ret;
+	}
+
+	unlink(socket_address.sun_path);
+
+	ctx->sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (ctx->sock == -1) {
+		ret = errno;
+		DBG_WARNING("socket failed: %s\n", strerror(ret));
+		TALLOC_FREE(ctx);
+		return ret;
+	}
+
+	ret = prepare_socket_cloexec(ctx->sock);
+	if (ret == -1) {
+		ret = errno;
+		DBG_WARNING("prepare_socket_cloexec failed: %s\n",
+			    strerror(ret));
+		TALLOC_FREE(ctx);
+		return ret;
+	}
+
+	ret = bind(ctx->sock, (struct sockaddr *)(void *)&socket_address,
+		   sizeof(socket_address));
+	if (ret == -1) {
+		ret = errno;
+		DBG_WARNING("bind failed: %s\n", strerror(ret));
+		TALLOC_FREE(ctx);
+		return ret;
+	}
+
+	talloc_set_destructor(ctx, messaging_dgm_context_destructor);
+
+	ctx->have_dgm_context = &have_dgm_context;
+
+	ret = pthreadpool_tevent_init(ctx, UINT_MAX, &ctx->pool);
+	if (ret != 0) {
+		DBG_WARNING("pthreadpool_tevent_init failed: %s\n",
+			    strerror(ret));
+		TALLOC_FREE(ctx);
+		return ret;
+	}
+
+	ctx->flush_im = tevent_create_immediate(ctx);
+	if (ctx->flush_im == NULL) {
+		TALLOC_FREE(ctx);
+		return ENOMEM;
+	}
+
+#ifdef HAVE_EVENTFD
+	/*
+	 * Without it we just don't accept shared memory rings
+	 */
+	ctx->shm_doorbell = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (ctx->shm_doorbell == -1) {
+		DBG_DEBUG("eventfd failed: %s\n", strerror(errno));
+	}
+#endif
+
+	global_dgm_context = ctx;
+	return 0;
+
+fail_nomem:
+	TALLOC_FREE(ctx);
+	return ENOMEM;
+}
+
+/*
+ * Remove the rendezvous point in the filesystem
+ * if we're the owner.
+ */
+
+static int messaging_dgm_context_destructor(struct messaging_dgm_context *c)
+{
+	while (c->outsocks != NULL) {
+		TALLOC_FREE(c->outsocks);
+	}
+	while (c->in_msgs != NULL) {
+		TALLOC_FREE(c->in_msgs);
+	}
+	while (c->shm_ins != NULL) {
+		TALLOC_FREE(c->shm_ins);
+	}
+	while (c->fde_evs != NULL) {
+		tevent_fd_set_flags(c->fde_evs->fde, 0);
+		TALLOC_FREE(c->fde_evs->shm_fde);
+		TALLOC_FREE(c->fde_evs->flush_im);
+		c->fde_evs->ctx = NULL;
+		DLIST_REMOVE(c->fde_evs, c->fde_evs);
+	}
+
+	close(c->sock);
+	if (c->shm_doorbell != -1) {
+		close(c->shm_doorbell);
+		c->shm_doorbell = -1;
+	}
+
+	if (c->recv_destroyed != NULL) {
+		*c->recv_destroyed = true;
+	}
+
+	if (tevent_cached_getpid() == c->pid) {
+		struct sun_path_buf name;
+		int ret;
+
+		ret = snprintf(name.buf, sizeof(name.buf), "%s/%u",
+			       c->socket_dir.buf, (unsigned)c->pid);
+		if ((ret < 0) || ((size_t)ret >= sizeof(name.buf))) {
+			/*
+			 * We've checked the length when creating, so this
+			 * should never happen
+			 */
+			abort();
+		}
+		unlink(name.buf);
+
+		ret = snprintf(name.buf, sizeof(name.buf), "%s/%u",
+			       c->lockfile_dir.buf, (unsigned)c->pid);
+		if ((ret < 0) || ((size_t)ret >= sizeof(name.buf))) {
+			/*
+			 * We've checked the length when creating, so this
+			 * should never happen
+			 */
+			abort();
+		}
+		unlink(name.buf);
+	}
+	close(c->lockfile_fd);
+
+	if (c->have_dgm_context != NULL) {
+		*c->have_dgm_context = false;
+	}
+
+	return 0;
+}
+
+static void messaging_dgm_validate(struct messaging_dgm_context *ctx)
+{
+#ifdef DEVELOPER
+	pid_t pid = tevent_cached_getpid();
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	struct sockaddr_un *un_addr;
+	struct sun_path_buf pathbuf;
+	struct stat st1, st2;
+	int ret;
+
+	/*
+	 * Protect against using the wrong messaging context after a
+	 * fork without reinit_after_fork.
+	 */
+
+	ret = getsockname(ctx->sock, (struct sockaddr *)&addr, &addrlen);
+	if (ret == -1) {
+		DBG_ERR("getsockname failed: %s\n", strerror(errno));
+		goto fail;
+	}
+	if (addr.ss_family != AF_UNIX) {
+		DBG_ERR("getsockname returned family %d\n",
+			(int)addr.ss_family);
+		goto fail;
+	}
+	un_addr = (struct sockaddr_un *)&addr;
+
+	ret = snprintf(pathbuf.buf, sizeof(pathbuf.buf),
+		       "%s/%u", ctx->socket_dir.buf, (unsigned)pid);
+	if (ret < 0) {
+		DBG_ERR("snprintf failed: %s\n", strerror(errno));
+		goto fail;
+	}
+	if ((size_t)ret >= sizeof(pathbuf.buf)) {
+		DBG_ERR("snprintf returned %d chars\n", (int)ret);
+		goto fail;
+	}
+
+	if (strcmp(pathbuf.buf, un_addr->sun_path) != 0) {
+		DBG_ERR("sockname wrong: Expected %s, got %s\n",
+			pathbuf.buf, un_addr->sun_path);
+		goto fail;
+	}
+
+	ret = snprintf(pathbuf.buf, sizeof(pathbuf.buf),
+		       "%s/%u", ctx->lockfile_dir.buf, (unsigned)pid);
+	if (ret < 0) {
+		DBG_ERR("snprintf failed: %s\n", strerror(errno));
+		goto fail;
+	}
+	if ((size_t)ret >= sizeof(pathbuf.buf)) {
+		DBG_ERR("snprintf returned %d chars\n", (int)ret);
+		goto fail;
+	}
+
+	ret = stat(pathbuf.buf, &st1);
+	if (ret == -1) {
+		DBG_ERR("stat failed: %s\n", strerror(errno));
+		goto fail;
+	}
+	ret = fstat(ctx->lockfile_fd, &st2);
+	if (ret == -1) {
+		DBG_ERR("fstat failed: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	if ((st1.st_dev != st2.st_dev) || (st1.st_ino != st2.st_ino)) {
+		DBG_ERR("lockfile differs, expected (%d/%d), got (%d/%d)\n",
+			(int)st2.st_dev, (int)st2.st_ino,
+			(int)st1.st_dev, (int)st1.st_ino);
+		goto fail;
+	}
+
+	return;
+fail:
+	abort();
+#else
+	return;
+#endif
+}
+
+static void messaging_dgm_recv(struct messaging_dgm_context *ctx,
+			       struct tevent_context *ev,
+			       uint8_t *msg, size_t msg_len,
+			       int *fds, size_t num_fds);
+
+/*
+ * Receive up to num_msgs datagrams without blocking, return the
+ * number of datagrams received.
+ */
+
+static int messaging_dgm_recvmmsg(int sock,
+				  struct messaging_dgm_mmsghdr *msgs,
+				  unsigned int num_msgs,
+				  int *perrno)
+{
+	int flags = MSG_DONTWAIT;
+	int ret;
 
-	if (lockfile_fd == -1) {
-		ret = errno;
-		DEBUG(1, ("%s: open failed: %s\n", __func__, strerror(errno)));
-		return ret;
-	}
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
 
-	lck = (struct flock) {
-		.l_type = F_WRLCK,
-		.l_whence = SEEK_SET
-	};
+#ifdef MESSAGING_DGM_HAVE_MMSG
+	ret = recvmmsg(sock, msgs, num_msgs, flags, NULL);
+#else
+	{
+		ssize_t received;
+
+		received = recvmsg(sock, &msgs[0].msg_hdr, flags);
+		if (received != -1) {
+			msgs[0].msg_len = received;
+		}
+		ret = (received == -1) ? -1 : 1;
+	}
+#endif
 
-	ret = fcntl(lockfile_fd, F_SETLK, &lck);
 	if (ret == -1) {
-		ret = errno;
-		DEBUG(1, ("%s: fcntl failed: %s\n", __func__, strerror(ret)));
-		goto fail_close;
+		*perrno = errno;
 	}
+	return ret;
+}
 
-	/*
-	 * Directly using the binary value for
-	 * SERVERID_UNIQUE_ID_NOT_TO_VERIFY is a layering
-	 * violation. But including all of ndr here just for this
-	 * seems to be a bit overkill to me. Also, messages_dgm might
-	 * be replaced sooner or later by something streams-based,
-	 * where unique_id generation will be handled differently.
-	 */
+static void messaging_dgm_close_msg_fds(struct msghdr *msg)
+{
+	size_t num_fds = msghdr_extract_fds(msg, NULL, 0);
+	int fds[MAX(num_fds, 1)];
 
-	do {
-		generate_random_buffer((uint8_t *)&unique, sizeof(unique));
-	} while (unique == UINT64_C(0xFFFFFFFFFFFFFFFF));
+	msghdr_extract_fds(msg, fds, num_fds);
+	close_fd_array(fds, num_fds);
+}
 
-	unique_len = snprintf(buf, sizeof(buf), "%"PRIu64"\n", unique);
+/*
+ * Pass one received datagram to messaging_dgm_recv()
+ */
 
-	/* shorten a potentially preexisting file */
+static void messaging_dgm_recv_one(struct messaging_dgm_context *ctx,
+				   struct tevent_context *ev,
+				   struct msghdr *msg,
+				   size_t received)
+{
+	uint8_t *buf = msg->msg_iov[0].iov_base;
+	size_t num_fds;
 
-	ret = ftruncate(lockfile_fd, unique_len);
-	if (ret == -1) {
-		ret = errno;
-		DEBUG(1, ("%s: ftruncate failed: %s\n", __func__,
-			  strerror(ret)));
-		goto fail_unlink;
+	if ((received > msg->msg_iov[0].iov_len) ||
+	    ((msg->msg_flags & MSG_TRUNC) != 0)) {
+		/* More than we expected, not for us */
+		messaging_dgm_close_msg_fds(msg);
+		return;
 	}
 
-	written = write(lockfile_fd, buf, unique_len);
-	if (written != unique_len) {
-		ret = errno;
-		DEBUG(1, ("%s: write failed: %s\n", __func__, strerror(ret)));
-		goto fail_unlink;
-	}
+	num_fds = msghdr_extract_fds(msg, NULL, 0);
+	if (num_fds == 0) {
+		int fds[1];
 
-	*plockfile_fd = lockfile_fd;
-	*punique = unique;
-	return 0;
+		messaging_dgm_recv(ctx, ev, buf, received, fds, 0);
+	} else {
+		size_t i;
+		int fds[num_fds];
 
-fail_unlink:
-	unlink(lockfile_name.buf);
-fail_close:
-	close(lockfile_fd);
-	return ret;
-}
+		msghdr_extract_fds(msg, fds, num_fds);
 
-static void messaging_dgm_read_handler(struct tevent_context *ev,
-				       struct tevent_fd *fde,
-				       uint16_t flags,
-				       void *private_data);
+		for (i = 0; i < num_fds; i++) {
+			int err;
+
+			err = prepare_socket_cloexec(fds[i]);
+			if (err != 0) {
+				close_fd_array(fds, num_fds);
+				num_fds = 0;
+			}
+		}
+
+		messaging_dgm_recv(ctx, ev, buf, received, fds, num_fds);
+	}
+}
 
 /*
- * Create the rendezvous point in the file system
- * that other processes can use to send messages to
- * this pid.
+ * Raw read callback handler - passes to messaging_dgm_recv()
+ * for fragment reassembly processing. Picks up to
+ * MESSAGING_DGM_RECV_BATCH datagrams in one go.
  */
 
-int messaging_dgm_init(struct tevent_context *ev,
-		       uint64_t *punique,
-		       const char *socket_dir,
-		       const char *lockfile_dir,
-		       void (*recv_cb)(struct tevent_context *ev,
-				       const uint8_t *msg,
-				       size_t msg_len,
-				       int *fds,
-				       size_t num_fds,
-				       void *private_data),
-		       void *recv_cb_private_data)
+static void messaging_dgm_read_handler(struct tevent_context *ev,
+				       struct tevent_fd *fde,
+				       uint16_t flags,
+				       void *private_data)
 {
-	struct messaging_dgm_context *ctx;
-	int ret;
-	struct sockaddr_un socket_address;
-	size_t len;
-	static bool have_dgm_context = false;
+	struct messaging_dgm_context *ctx = talloc_get_type_abort(
+		private_data, struct messaging_dgm_context);
+	struct messaging_dgm_mmsghdr msgs[MESSAGING_DGM_RECV_BATCH];
+	struct iovec iovs[MESSAGING_DGM_RECV_BATCH];
+	size_t msgbufsize = msghdr_prep_recv_fds(NULL, NULL, 0, INT8_MAX);
+	uint8_t msgbufs[MESSAGING_DGM_RECV_BATCH][msgbufsize];
+	uint8_t bufs[MESSAGING_DGM_RECV_BATCH][MESSAGING_DGM_FRAGMENT_LENGTH];
+	bool *prev_destroyed = ctx->recv_destroyed;
+	bool destroyed = false;
+	int i, received;
+	int err = 0;
 
-	if (have_dgm_context) {
-		return EEXIST;
-	}
+	messaging_dgm_validate(ctx);
 
-	if ((socket_dir == NULL) || (lockfile_dir == NULL)) {
-		return EINVAL;
+	if ((flags & TEVENT_FD_READ) == 0) {
+		return;
 	}
 
-	ctx = talloc_zero(NULL, struct messaging_dgm_context);
-	if (ctx == NULL) {
-		goto fail_nomem;
+	for (i = 0; i < MESSAGING_DGM_RECV_BATCH; i++) {
+		iovs[i] = (struct iovec) {
+			.iov_base = bufs[i], .iov_len = sizeof(bufs[i])
+		};
+		msgs[i] = (struct messaging_dgm_mmsghdr) {
+			.msg_hdr.msg_iov = &iovs[i],
+			.msg_hdr.msg_iovlen = 1,
+		};
+		msghdr_prep_recv_fds(&msgs[i].msg_hdr, msgbufs[i], msgbufsize,
+				     INT8_MAX);
 	}
-	ctx->ev = ev;
-	ctx->pid = tevent_cached_getpid();
-	ctx->recv_cb = recv_cb;
-	ctx->recv_cb_private_data = recv_cb_private_data;
 
-	len = strlcpy(ctx->lockfile_dir.buf, lockfile_dir,
-		      sizeof(ctx->lockfile_dir.buf));
-	if (len >= sizeof(ctx->lockfile_dir.buf)) {
-		TALLOC_FREE(ctx);
-		return ENAMETOOLONG;
+	received = messaging_dgm_recvmmsg(ctx->sock, msgs,
+					  MESSAGING_DGM_RECV_BATCH, &err);
+	if (received == -1) {
+		if ((err == EAGAIN) ||
+		    (err == EWOULDBLOCK) ||
+		    (err == EINTR) ||
+		    (err == ENOMEM)) {
+			/* Not really an error - just try again. */
+			return;
+		}
+		/* Problem with the socket. Set it unreadable. */
+		tevent_fd_set_flags(fde, 0);
+		return;
 	}
 
-	len = strlcpy(ctx->socket_dir.buf, socket_dir,
-		      sizeof(ctx->socket_dir.buf));
-	if (len >= sizeof(ctx->socket_dir.buf)) {
-		TALLOC_FREE(ctx);
-		return ENAMETOOLONG;
+	messaging_dgm_count_batch(&ctx->stats.recv, received);
+
+	/*
+	 * The callback might destroy the context, nested event loops
+	 * might run this handler again.
+	 */
+	ctx->recv_destroyed = &destroyed;
+
+	for (i = 0; i < received; i++) {
+		if (destroyed) {
+			messaging_dgm_close_msg_fds(&msgs[i].msg_hdr);
+			continue;
+		}
+		messaging_dgm_recv_one(ctx, ev, &msgs[i].msg_hdr,
+				       msgs[i].msg_len);
 	}
 
-	socket_address = (struct sockaddr_un) { .sun_family = AF_UNIX };
-	len = snprintf(socket_address.sun_path,
-		       sizeof(socket_address.sun_path),
-		       "%s/%u", socket_dir, (unsigned)ctx->pid);
-	if (len >= sizeof(socket_address.sun_path)) {
-		TALLOC_FREE(ctx);
-		return ENAMETOOLONG;
+	if (destroyed) {
+		if (prev_destroyed != NULL) {
+			*prev_destroyed = true;
+		}
+		return;
 	}
+	ctx->recv_destroyed = prev_destroyed;
+}
 
-	ret = messaging_dgm_lockfile_create(ctx, ctx->pid, &ctx->lockfile_fd,
-					    punique);
-	if (ret != 0) {
-		DEBUG(1, ("%s: messaging_dgm_create_lockfile failed: %s\n",
-			  __func__, strerror(ret)));
-		TALLOC_FREE(ctx);
-		return ret;
+static int messaging_dgm_shm_in_destructor(struct messaging_dgm_shm_in *in)
+{
+	DLIST_REMOVE(in->ctx->shm_ins, in);
+	if (in->destroyed != NULL) {
+		*in->destroyed = true;
 	}
+	return 0;
+}
 
-	unlink(socket_address.sun_path);
+/*
+ * Dispatch what was in the ring when we started, the sender might
+ * keep on writing. Returns false if a callback destroyed "in".
+ */
 
-	ctx->sock = socket(AF_UNIX, SOCK_DGRAM, 0);
-	if (ctx->sock == -1) {
-		ret = errno;
-		DBG_WARNING("socket failed: %s\n", strerror(ret));
-		TALLOC_FREE(ctx);
-		return ret;
-	}
+static bool messaging_dgm_shm_in_drain(struct messaging_dgm_shm_in *in,
+				       struct tevent_context *ev)
+{
+	struct messaging_dgm_context *ctx = in->ctx;
+	uint64_t limit = messaging_dgm_shm_ring_head(in->ring);
+
+	while (in->started) {
+		uint8_t stackbuf[MESSAGING_DGM_FRAGMENT_LENGTH];
+		uint8_t *buf = stackbuf;
+		const uint8_t *data = NULL;
+		size_t len = 0;
+		uint32_t type = 0;
+		bool *prev_destroyed = in->destroyed;
+		bool destroyed = false;
+		int fds[1];
+		int ret;
 
-	ret = prepare_socket_cloexec(ctx->sock);
-	if (ret == -1) {
-		ret = errno;
-		DBG_WARNING("prepare_socket_cloexec failed: %s\n",
-			    strerror(ret));
-		TALLOC_FREE(ctx);
-		return ret;
-	}
+		ret = messaging_dgm_shm_ring_peek(
+			in->ring, limit, &type, &data, &len);
+		if (ret == ENOENT) {
+			break;
+		}
+		if (ret != 0) {
+			DBG_WARNING("Dropping corrupt ring from %u\n",
+				    (unsigned)in->pid);
+			TALLOC_FREE(in);
+			return false;
+		}
 
-	ret = bind(ctx->sock, (struct sockaddr *)(void *)&socket_address,
-		   sizeof(socket_address));
-	if (ret == -1) {
-		ret = errno;
-		DBG_WARNING("bind failed: %s\n", strerror(ret));
-		TALLOC_FREE(ctx);
-		return ret;
-	}
+		if (type == MESSAGING_DGM_SHM_STOP) {
+			messaging_dgm_shm_ring_consume(in->ring);
+			in->started = false;
+			break;
+		}
 
-	talloc_set_destructor(ctx, messaging_dgm_context_destructor);
+		if (len > sizeof(stackbuf)) {
+			buf = talloc_size(NULL, len);
+			if (buf == NULL) {
+				/*
+				 * Try again with the next wakeup
+				 */
+				break;
+			}
+		}
+		memcpy(buf, data, len);
+		messaging_dgm_shm_ring_consume(in->ring);
 
-	ctx->have_dgm_context = &have_dgm_context;
+		ctx->stats.shm.received += 1;
 
-	ret = pthreadpool_tevent_init(ctx, UINT_MAX, &ctx->pool);
-	if (ret != 0) {
-		DBG_WARNING("pthreadpool_tevent_init failed: %s\n",
-			    strerror(ret));
-		TALLOC_FREE(ctx);
-		return ret;
-	}
+		in->destroyed = &destroyed;
 
-	global_dgm_context = ctx;
-	return 0;
+		ctx->recv_cb(ev, buf, len, fds, 0, ctx->recv_cb_private_data);
 
-fail_nomem:
-	TALLOC_FREE(ctx);
-	return ENOMEM;
+		if (buf != stackbuf) {
+			TALLOC_FREE(buf);
+		}
+
+		if (destroyed) {
+			if (prev_destroyed != NULL) {
+				*prev_destroyed = true;
+			}
+			return false;
+		}
+		in->destroyed = prev_destroyed;
+	}
+
+	return true;
 }
 
 /*
- * Remove the rendezvous point in the filesystem
- * if we're the owner.
+ * Read all rings up to their STOP markers. Returns false if a
+ * callback destroyed the context.
  */
 
-static int messaging_dgm_context_destructor(struct messaging_dgm_context *c)
+static bool messaging_dgm_shm_drain(struct messaging_dgm_context *ctx,
+				    struct tevent_context *ev)
 {
-	while (c->outsocks != NULL) {
-		TALLOC_FREE(c->outsocks);
-	}
-	while (c->in_msgs != NULL) {
-		TALLOC_FREE(c->in_msgs);
-	}
-	while (c->fde_evs != NULL) {
-		tevent_fd_set_flags(c->fde_evs->fde, 0);
-		c->fde_evs->ctx = NULL;
-		DLIST_REMOVE(c->fde_evs, c->fde_evs);
+	struct messaging_dgm_shm_in *in, *next;
+	bool *prev_destroyed = ctx->recv_destroyed;
+	bool destroyed = false;
+
+	if (tevent_cached_getpid() != ctx->pid) {
+		/*
+		 * Forked child, the rings are our parent's
+		 */
+		return true;
 	}
 
-	close(c->sock);
+	ctx->recv_destroyed = &destroyed;
 
-	if (tevent_cached_getpid() == c->pid) {
-		struct sun_path_buf name;
-		int ret;
+	in = ctx->shm_ins;
 
-		ret = snprintf(name.buf, sizeof(name.buf), "%s/%u",
-			       c->socket_dir.buf, (unsigned)c->pid);
-		if ((ret < 0) || ((size_t)ret >= sizeof(name.buf))) {
+	while (in != NULL) {
+		bool ok;
+
+		ok = messaging_dgm_shm_in_drain(in, ev);
+
+		if (destroyed) {
+			if (prev_destroyed != NULL) {
+				*prev_destroyed = true;
+			}
+			return false;
+		}
+		if (!ok) {
 			/*
-			 * We've checked the length when creating, so this
-			 * should never happen
+			 * The list changed under us
 			 */
-			abort();
+			in = ctx->shm_ins;
+			continue;
 		}
-		unlink(name.buf);
 
-		ret = snprintf(name.buf, sizeof(name.buf), "%s/%u",
-			       c->lockfile_dir.buf, (unsigned)c->pid);
-		if ((ret < 0) || ((size_t)ret >= sizeof(name.buf))) {
-			/*
-			 * We've checked the length when creating, so this
-			 * should never happen
-			 */
-			abort();
+		next = in->next;
+
+		if (messaging_dgm_shm_ring_closed(in->ring) &&
+		    messaging_dgm_shm_ring_empty(in->ring)) {
+			TALLOC_FREE(in);
 		}
-		unlink(name.buf);
-	}
-	close(c->lockfile_fd);
 
-	if (c->have_dgm_context != NULL) {
-		*c->have_dgm_context = false;
+		in = next;
 	}
 
-	return 0;
+	ctx->recv_destroyed = prev_destroyed;
+	return true;
 }
 
-static void messaging_dgm_validate(struct messaging_dgm_context *ctx)
+static void messaging_dgm_shm_doorbell_handler(struct tevent_context *ev,
+					       struct tevent_fd *fde,
+					       uint16_t flags,
+					       void *private_data)
 {
-#ifdef DEVELOPER
-	pid_t pid = tevent_cached_getpid();
-	struct sockaddr_storage addr;
-	socklen_t addrlen = sizeof(addr);
-	struct sockaddr_un *un_addr;
-	struct sun_path_buf pathbuf;
-	struct stat st1, st2;
-	int ret;
-
-	/*
-	 * Protect against using the wrong messaging context after a
-	 * fork without reinit_after_fork.
-	 */
+	struct messaging_dgm_context *ctx = talloc_get_type_abort(
+		private_data, struct messaging_dgm_context);
+	struct messaging_dgm_shm_in *in;
+	uint64_t val;
+	ssize_t nread;
+	bool ok;
 
-	ret = getsockname(ctx->sock, (struct sockaddr *)&addr, &addrlen);
-	if (ret == -1) {
-		DBG_ERR("getsockname failed: %s\n", strerror(errno));
-		goto fail;
-	}
-	if (addr.ss_family != AF_UNIX) {
-		DBG_ERR("getsockname returned family %d\n",
-			(int)addr.ss_family);
-		goto fail;
+	if (tevent_cached_getpid() != ctx->pid) {
+		/*
+		 * The eventfd is our parent's, don't steal its
+		 * wakeups.
+		 */
+		tevent_fd_set_flags(fde, 0);
+		return;
 	}
-	un_addr = (struct sockaddr_un *)&addr;
 
-	ret = snprintf(pathbuf.buf, sizeof(pathbuf.buf),
-		       "%s/%u", ctx->socket_dir.buf, (unsigned)pid);
-	if (ret < 0) {
-		DBG_ERR("snprintf failed: %s\n", strerror(errno));
-		goto fail;
-	}
-	if ((size_t)ret >= sizeof(pathbuf.buf)) {
-		DBG_ERR("snprintf returned %d chars\n", (int)ret);
-		goto fail;
-	}
+	nread = read(ctx->shm_doorbell, &val, sizeof(val));
+	(void)nread;
 
-	if (strcmp(pathbuf.buf, un_addr->sun_path) != 0) {
-		DBG_ERR("sockname wrong: Expected %s, got %s\n",
-			pathbuf.buf, un_addr->sun_path);
-		goto fail;
+	ok = messaging_dgm_shm_drain(ctx, ev);
+	if (!ok) {
+		return;
 	}
 
-	ret = snprintf(pathbuf.buf, sizeof(pathbuf.buf),
-		       "%s/%u", ctx->lockfile_dir.buf, (unsigned)pid);
-	if (ret < 0) {
-		DBG_ERR("snprintf failed: %s\n", strerror(errno));
-		goto fail;
+	for (in = ctx->shm_ins; in != NULL; in = in->next) {
+		if (in->started && !messaging_dgm_shm_ring_empty(in->ring)) {
+			/*
+			 * The sender only wakes us up once we've
+			 * caught up with it.
+			 */
+			messaging_dgm_shm_wake(ctx->shm_doorbell);
+			break;
+		}
 	}
-	if ((size_t)ret >= sizeof(pathbuf.buf)) {
-		DBG_ERR("snprintf returned %d chars\n", (int)ret);
-		goto fail;
+}
+
+static void messaging_dgm_shm_setup_recv(struct messaging_dgm_context *ctx,
+					 pid_t pid, uint64_t id,
+					 int *fds, size_t num_fds)
+{
+	struct messaging_dgm_shm_in *in, *next;
+	struct messaging_dgm_out *out = NULL;
+	size_t num_ins = 0;
+	int ret;
+
+	if ((ctx->shm_doorbell == -1) || (num_fds != 1)) {
+		/*
+		 * The sender stays on the socket
+		 */
+		return;
 	}
 
-	ret = stat(pathbuf.buf, &st1);
-	if (ret == -1) {
-		DBG_ERR("stat failed: %s\n", strerror(errno));
-		goto fail;
+	for (in = ctx->shm_ins; in != NULL; in = next) {
+		next = in->next;
+
+		/*
+		 * A new ring replaces the old one from the same
+		 * sender, we've read that up to its STOP marker
+		 * before we got here. Rings from senders that died
+		 * were never closed.
+		 */
+		if ((in->pid == pid) ||
+		    ((kill(in->pid, 0) == -1) && (errno == ESRCH))) {
+			TALLOC_FREE(in);
+			continue;
+		}
+		num_ins += 1;
 	}
-	ret = fstat(ctx->lockfile_fd, &st2);
-	if (ret == -1) {
-		DBG_ERR("fstat failed: %s\n", strerror(errno));
-		goto fail;
+
+	if (num_ins >= MESSAGING_DGM_SHM_MAX_INS) {
+		DBG_DEBUG("Too many rings, rejecting %u\n", (unsigned)pid);
+		return;
 	}
 
-	if ((st1.st_dev != st2.st_dev) || (st1.st_ino != st2.st_ino)) {
-		DBG_ERR("lockfile differs, expected (%d/%d), got (%d/%d)\n",
-			(int)st2.st_dev, (int)st2.st_ino,
-			(int)st1.st_dev, (int)st1.st_ino);
-		goto fail;
+	in = talloc(ctx, struct messaging_dgm_shm_in);
+	if (in == NULL) {
+		return;
 	}
+	*in = (struct messaging_dgm_shm_in) {
+		.ctx = ctx, .pid = pid, .id = id,
+	};
 
-	return;
-fail:
-	abort();
-#else
-	return;
-#endif
-}
+	in->ring = messaging_dgm_shm_ring_map(in, fds[0]);
+	if (in->ring == NULL) {
+		DBG_DEBUG("Could not map ring from %u\n", (unsigned)pid);
+		TALLOC_FREE(in);
+		return;
+	}
 
-static void messaging_dgm_recv(struct messaging_dgm_context *ctx,
-			       struct tevent_context *ev,
-			       uint8_t *msg, size_t msg_len,
-			       int *fds, size_t num_fds);
+	DLIST_ADD(ctx->shm_ins, in);
+	talloc_set_destructor(in, messaging_dgm_shm_in_destructor);
 
-/*
- * Raw read callback handler - passes to messaging_dgm_recv()
- * for fragment reassembly processing.
- */
+	ret = messaging_dgm_out_get(ctx, pid, &out);
+	if (ret == 0) {
+		ret = messaging_dgm_out_send_shm_ctrl(
+			out, MESSAGING_DGM_SHM_OP_ACK, id,
+			&ctx->shm_doorbell, 1);
+	}
+	if (ret != 0) {
+		DBG_DEBUG("Could not ack ring from %u: %s\n",
+			  (unsigned)pid, strerror(ret));
+		TALLOC_FREE(in);
+	}
+}
 
-static void messaging_dgm_read_handler(struct tevent_context *ev,
-				       struct tevent_fd *fde,
-				       uint16_t flags,
-				       void *private_data)
+static void messaging_dgm_shm_ack_recv(struct messaging_dgm_context *ctx,
+				       pid_t pid, uint64_t id,
+				       int *fds, size_t num_fds)
 {
-	struct messaging_dgm_context *ctx = talloc_get_type_abort(
-		private_data, struct messaging_dgm_context);
-	ssize_t received;
-	struct msghdr msg;
-	struct iovec iov;
-	size_t msgbufsize = msghdr_prep_recv_fds(NULL, NULL, 0, INT8_MAX);
-	uint8_t msgbuf[msgbufsize];
-	uint8_t buf[MESSAGING_DGM_FRAGMENT_LENGTH];
-	size_t num_fds;
+	struct messaging_dgm_out *out;
+	int ret;
 
-	messaging_dgm_validate(ctx);
+	for (out = ctx->outsocks; out != NULL; out = out->next) {
+		if (out->pid == pid) {
+			break;
+		}
+	}
 
-	if ((flags & TEVENT_FD_READ) == 0) {
+	if ((out == NULL) ||
+	    (out->shm_state != MESSAGING_DGM_SHM_SETUP_SENT) ||
+	    (out->shm_id != id) ||
+	    (num_fds != 1)) {
 		return;
 	}
 
-	iov = (struct iovec) { .iov_base = buf, .iov_len = sizeof(buf) };
-	msg = (struct msghdr) { .msg_iov = &iov, .msg_iovlen = 1 };
+	ret = messaging_dgm_out_send_shm_ctrl(
+		out, MESSAGING_DGM_SHM_OP_START, id, NULL, 0);
+	if (ret != 0) {
+		out->shm_state = MESSAGING_DGM_SHM_FAILED;
+		return;
+	}
 
-	msghdr_prep_recv_fds(&msg, msgbuf, msgbufsize, INT8_MAX);
+	out->shm_doorbell = fds[0];
+	fds[0] = -1;
+	out->shm_state = MESSAGING_DGM_SHM_ACTIVE;
+}
 
-#ifdef MSG_CMSG_CLOEXEC
-	msg.msg_flags |= MSG_CMSG_CLOEXEC;
-#endif
+static void messaging_dgm_shm_start_recv(struct messaging_dgm_context *ctx,
+					 pid_t pid, uint64_t id)
+{
+	struct messaging_dgm_shm_in *in;
 
-	received = recvmsg(ctx->sock, &msg, 0);
-	if (received == -1) {
-		if ((errno == EAGAIN) ||
-		    (errno == EWOULDBLOCK) ||
-		    (errno == EINTR) ||
-		    (errno == ENOMEM)) {
-			/* Not really an error - just try again. */
-			return;
+	for (in = ctx->shm_ins; in != NULL; in = in->next) {
+		if ((in->pid == pid) && (in->id == id)) {
+			break;
 		}
-		/* Problem with the socket. Set it unreadable. */
-		tevent_fd_set_flags(fde, 0);
-		return;
 	}
-
-	if ((size_t)received > sizeof(buf)) {
-		/* More than we expected, not for us */
+	if (in == NULL) {
 		return;
 	}
 
-	num_fds = msghdr_extract_fds(&msg, NULL, 0);
-	if (num_fds == 0) {
-		int fds[1];
-
-		messaging_dgm_recv(ctx, ev, buf, received, fds, 0);
-	} else {
-		size_t i;
-		int fds[num_fds];
-
-		msghdr_extract_fds(&msg, fds, num_fds);
+	in->started = true;
 
-		for (i = 0; i < num_fds; i++) {
-			int err;
+	/*
+	 * Read it from the doorbell handler, we're in the middle of
+	 * messaging_dgm_recv()
+	 */
+	messaging_dgm_shm_wake(ctx->shm_doorbell);
+}
 
-			err = prepare_socket_cloexec(fds[i]);
-			if (err != 0) {
-				close_fd_array(fds, num_fds);
-				num_fds = 0;
-			}
-		}
+static void messaging_dgm_shm_ctrl_recv(struct messaging_dgm_context *ctx,
+					const uint8_t *buf, size_t buflen,
+					int *fds, size_t num_fds)
+{
+	struct messaging_dgm_shm_ctrl ctrl;
 
-		messaging_dgm_recv(ctx, ev, buf, received, fds, num_fds);
+	if (buflen != sizeof(ctrl)) {
+		return;
+	}
+	memcpy(&ctrl, buf, sizeof(ctrl));
+
+	switch (ctrl.op) {
+	case MESSAGING_DGM_SHM_OP_SETUP:
+		messaging_dgm_shm_setup_recv(
+			ctx, ctrl.pid, ctrl.id, fds, num_fds);
+		break;
+	case MESSAGING_DGM_SHM_OP_ACK:
+		messaging_dgm_shm_ack_recv(
+			ctx, ctrl.pid, ctrl.id, fds, num_fds);
+		break;
+	case MESSAGING_DGM_SHM_OP_START:
+		messaging_dgm_shm_start_recv(ctx, ctrl.pid, ctrl.id);
+		break;
+	default:
+		break;
 	}
 }
 
@@ -1351,6 +2823,17 @@ static void messaging_dgm_recv(struct messaging_dgm_context *ctx,
 	size_t space;
 	uint64_t cookie;
 
+	if (ctx->shm_ins != NULL) {
+		/*
+		 * The rings hold what was sent before this datagram,
+		 * see messaging_dgm_out_shm_send()
+		 */
+		bool ok = messaging_dgm_shm_drain(ctx, ev);
+		if (!ok) {
+			goto close_fds;
+		}
+	}
+
 	if (buflen < sizeof(cookie)) {
 		goto close_fds;
 	}
@@ -1358,6 +2841,12 @@ static void messaging_dgm_recv(struct messaging_dgm_context *ctx,
 	buf += sizeof(cookie);
 	buflen -= sizeof(cookie);
 
+	if (cookie == MESSAGING_DGM_COOKIE_SHM) {
+		messaging_dgm_shm_ctrl_recv(ctx, buf, buflen, fds, num_fds);
+		messaging_dgm_close_unconsumed(fds, num_fds);
+		return;
+	}
+
 	if (cookie == 0) {
 		ctx->recv_cb(ev, buf, buflen, fds, num_fds,
 			     ctx->recv_cb_private_data);
@@ -1462,16 +2951,22 @@ again:
 
 	DEBUG(10, ("%s: Sending message to %u\n", __func__, (unsigned)pid));
 
+	if (messaging_dgm_out_shm_send(out, iov, iovlen, num_fds)) {
+		return 0;
+	}
+
 	ret = messaging_dgm_out_send_fragmented(ctx->ev, out, iov, iovlen,
 						fds, num_fds);
 	if (ret == ECONNREFUSED) {
 		/*
 		 * We cache outgoing sockets. If the receiver has
 		 * closed and re-opened the socket since our last
-		 * message, we get connection refused. Retry.
+		 * message, we get connection refused. Retry, with
+		 * the coalesced fragments the old socket refused
+		 * first.
 		 */
 
-		TALLOC_FREE(out);
+		messaging_dgm_out_reconnect(out);
 
 		if (retries < 5) {
 			retries += 1;
@@ -1749,6 +3244,7 @@ struct messaging_dgm_fde *messaging_dgm_register_tevent_context(
 		if (fde_ev == NULL) {
 			return NULL;
 		}
+		fde_ev->shm_fde = NULL;
 		fde_ev->fde = tevent_add_fd(
 			ev, fde_ev, ctx->sock, TEVENT_FD_READ,
 			messaging_dgm_read_handler, ctx);
@@ -1756,6 +3252,20 @@ struct messaging_dgm_fde *messaging_dgm_register_tevent_context(
 			TALLOC_FREE(fde);
 			return NULL;
 		}
+		fde_ev->flush_im = tevent_create_immediate(fde_ev);
+		if (fde_ev->flush_im == NULL) {
+			TALLOC_FREE(fde);
+			return NULL;
+		}
+		if (ctx->shm_doorbell != -1) {
+			fde_ev->shm_fde = tevent_add_fd(
+				ev, fde_ev, ctx->shm_doorbell, TEVENT_FD_READ,
+				messaging_dgm_shm_doorbell_handler, ctx);
+			if (fde_ev->shm_fde == NULL) {
+				TALLOC_FREE(fde);
+				return NULL;
+			}
+		}
 		fde_ev->ev = ev;
 		fde_ev->ctx = ctx;
 		DLIST_ADD(ctx->fde_evs, fde_ev);
@@ -1774,6 +3284,15 @@ struct messaging_dgm_fde *messaging_dgm_register_tevent_context(
 		}
 	}
 
+	if (ev != ctx->ev) {
+		/*
+		 * The caller is about to wait in a nested event
+		 * loop, don't leave coalesced fragments behind in
+		 * ctx->ev.
+		 */
+		messaging_dgm_flush_all(ctx);
+	}
+
 	fde->fde = fde_ev->fde;
 	return fde;
 }
@@ -1788,3 +3307,56 @@ bool messaging_dgm_fde_active(struct messaging_dgm_fde *fde)
 	flags = tevent_fd_get_flags(fde->fde);
 	return (flags != 0);
 }
+
+void messaging_dgm_set_coalesce(bool coalesce)
+{
+	struct messaging_dgm_context *ctx = global_dgm_context;
+	struct messaging_dgm_out *out, *next;
+
+	messaging_dgm_coalesce = coalesce;
+
+	if (coalesce || (ctx == NULL)) {
+		return;
+	}
+
+	for (out = ctx->outsocks; out != NULL; out = next) {
+		int ret;
+
+		next = out->next;
+
+		ret = messaging_dgm_out_flush(out, true);
+		if (ret == ECONNREFUSED) {
+			messaging_dgm_out_reconnect(out);
+		}
+	}
+}
+
+void messaging_dgm_set_shm_ring_size(size_t size)
+{
+	size_t ring_size = 4096;
+
+	if (size == 0) {
+		messaging_dgm_shm_size = 0;
+		return;
+	}
+
+	size = MIN(size, 64*1024*1024);
+
+	while (ring_size < size) {
+		ring_size *= 2;
+	}
+
+	messaging_dgm_shm_size = ring_size;
+}
+
+int messaging_dgm_get_stats(struct messaging_dgm_stats *stats)
+{
+	struct messaging_dgm_context *ctx = global_dgm_context;
+
+	if (ctx == NULL) {
+		return ENOTCONN;
+	}
+
+	*stats = ctx->stats;
+	return 0;
+}
@@ -45,6 +45,52 @@ int messaging_dgm_wipe(void);
 int messaging_dgm_forall(int (*fn)(pid_t pid, void *private_data),
 			 void *private_data);
 
+/*
+ * Collect messages to the same destination until the next event loop
+ * iteration and send them with one sendmmsg() call. Messages passing
+ * file descriptors are never deferred.
+ */
+void messaging_dgm_set_coalesce(bool coalesce);
+
+/*
+ * Offer a shared memory ring of that size (rounded up to a power of
+ * two) to processes we send a lot of messages to, 0 disables
+ * it. Messages passing file descriptors always go through the
+ * socket.
+ */
+void messaging_dgm_set_shm_ring_size(size_t size);
+
+#define MESSAGING_DGM_STATS_BUCKETS 8
+
+struct messaging_dgm_batch_stats {
+	uint64_t batches;
+	uint64_t datagrams;
+	uint64_t max_batch;
+	/*
+	 * hist[i] counts the batches of 2^i to 2^(i+1)-1
+	 * datagrams, the last bucket also counts larger ones.
+	 */
+	uint64_t hist[MESSAGING_DGM_STATS_BUCKETS];
+};
+
+struct messaging_dgm_shm_stats {
+	uint64_t sent;
+	uint64_t received;
+	uint64_t wakeups;
+	/*
+	 * Switches from the ring back to the socket
+	 */
+	uint64_t fallbacks;
+};
+
+struct messaging_dgm_stats {
+	struct messaging_dgm_batch_stats send;
+	struct messaging_dgm_batch_stats recv;
+	struct messaging_dgm_shm_stats shm;
+};
+
+int messaging_dgm_get_stats(struct messaging_dgm_stats *stats);
+
 struct messaging_dgm_fde;
 struct messaging_dgm_fde *messaging_dgm_register_tevent_context(
 	TALLOC_CTX *mem_ctx, struct tevent_context *ev);
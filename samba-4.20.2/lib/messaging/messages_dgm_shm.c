@@ -0,0 +1,395 @@
+/*
+ * Unix SMB/CIFS implementation.
+ * Single producer single consumer shared memory ring for messages_dgm
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "replace.h"
+#include "system/filesys.h"
+#include "system/shmem.h"
+#include "messages_dgm_shm.h"
+#include "lib/util/iov_buf.h"
+#include "lib/util/debug.h"
+
+#define MESSAGING_DGM_SHM_MAGIC UINT64_C(0x4d5347444d534852) /* MSGDMSHR */
+
+/*
+ * Internal, fills the space up to the end of the ring
+ */
+#define MESSAGING_DGM_SHM_PAD 0xFFFF
+
+/*
+ * head and tail count bytes and never wrap. They live in separate
+ * cache lines, they are hammered by different processes.
+ */
+struct messaging_dgm_shm_hdr {
+	uint64_t magic;
+	uint64_t size;
+	uint64_t closed;
+	uint8_t pad1[40];
+	uint64_t head;
+	uint8_t pad2[56];
+	uint64_t tail;
+	uint8_t pad3[56];
+};
+
+struct messaging_dgm_shm_entry {
+	uint32_t len;
+	uint32_t type;
+};
+
+#define MESSAGING_DGM_SHM_ENTRY_SIZE(len) \
+	(sizeof(struct messaging_dgm_shm_entry) + (((len) + 7) & ~(size_t)7))
+
+struct messaging_dgm_shm_ring {
+	struct messaging_dgm_shm_hdr *hdr;
+	uint8_t *data;
+
+	/*
+	 * Our own copy, the other side could change the shared one
+	 */
+	size_t size;
+	size_t mapsize;
+
+	/*
+	 * Consumer: tail behind the entry returned by
+	 * messaging_dgm_shm_ring_peek()
+	 */
+	uint64_t next_tail;
+};
+
+static int messaging_dgm_shm_ring_destructor(
+	struct messaging_dgm_shm_ring *ring)
+{
+	if (ring->hdr != NULL) {
+		munmap(ring->hdr, ring->mapsize);
+		ring->hdr = NULL;
+	}
+	return 0;
+}
+
+static struct messaging_dgm_shm_ring *messaging_dgm_shm_ring_mmap(
+	TALLOC_CTX *mem_ctx, int fd, size_t size)
+{
+	struct messaging_dgm_shm_ring *ring = NULL;
+	void *ptr;
+
+	ring = talloc(mem_ctx, struct messaging_dgm_shm_ring);
+	if (ring == NULL) {
+		return NULL;
+	}
+	*ring = (struct messaging_dgm_shm_ring) {
+		.size = size,
+		.mapsize = sizeof(struct messaging_dgm_shm_hdr) + size,
+	};
+
+	ptr = mmap(NULL, ring->mapsize, PROT_READ|PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (ptr == MAP_FAILED) {
+		DBG_DEBUG("mmap failed: %s\n", strerror(errno));
+		TALLOC_FREE(ring);
+		return NULL;
+	}
+	ring->hdr = ptr;
+	ring->data = (uint8_t *)ptr + sizeof(struct messaging_dgm_shm_hdr);
+	talloc_set_destructor(ring, messaging_dgm_shm_ring_destructor);
+
+	return ring;
+}
+
+/*
+ * size must be a power of two
+ */
+
+struct messaging_dgm_shm_ring *messaging_dgm_shm_ring_create(
+	TALLOC_CTX *mem_ctx, size_t size, int *pfd)
+{
+#ifdef HAVE_MEMFD_CREATE
+	struct messaging_dgm_shm_ring *ring = NULL;
+	unsigned flags = MFD_CLOEXEC;
+	int fd, ret;
+
+	if ((size < 4096) || ((size & (size-1)) != 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+#ifdef F_ADD_SEALS
+	flags |= MFD_ALLOW_SEALING;
+#endif
+
+	fd = memfd_create("messaging_dgm_shm", flags);
+	if (fd == -1) {
+		DBG_DEBUG("memfd_create failed: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	ret = ftruncate(fd, sizeof(struct messaging_dgm_shm_hdr) + size);
+	if (ret == -1) {
+		DBG_DEBUG("ftruncate failed: %s\n", strerror(errno));
+		goto fail;
+	}
+
+#ifdef F_ADD_SEALS
+	/*
+	 * The receiver checks this, we can't shrink the file under
+	 * its mapping and SIGBUS it.
+	 */
+	ret = fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL);
+	if (ret == -1) {
+		DBG_DEBUG("F_ADD_SEALS failed: %s\n", strerror(errno));
+		goto fail;
+	}
+#endif
+
+	ring = messaging_dgm_shm_ring_mmap(mem_ctx, fd, size);
+	if (ring == NULL) {
+		goto fail;
+	}
+
+	ring->hdr->size = size;
+	ring->hdr->closed = 0;
+	ring->hdr->head = 0;
+	ring->hdr->tail = 0;
+	__atomic_store_n(&ring->hdr->magic, MESSAGING_DGM_SHM_MAGIC,
+			 __ATOMIC_RELEASE);
+
+	*pfd = fd;
+	return ring;
+
+fail:
+	close(fd);
+	return NULL;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+struct messaging_dgm_shm_ring *messaging_dgm_shm_ring_map(
+	TALLOC_CTX *mem_ctx, int fd)
+{
+	struct messaging_dgm_shm_ring *ring = NULL;
+	struct messaging_dgm_shm_hdr hdr;
+	struct stat st;
+	ssize_t nread;
+	int ret;
+
+#ifdef F_GET_SEALS
+	ret = fcntl(fd, F_GET_SEALS);
+	if ((ret == -1) || ((ret & F_SEAL_SHRINK) == 0)) {
+		DBG_DEBUG("ring is not sealed\n");
+		return NULL;
+	}
+#endif
+
+	ret = fstat(fd, &st);
+	if (ret == -1) {
+		return NULL;
+	}
+
+	nread = pread(fd, &hdr, sizeof(hdr), 0);
+	if (nread != sizeof(hdr)) {
+		return NULL;
+	}
+
+	if ((hdr.magic != MESSAGING_DGM_SHM_MAGIC) ||
+	    (hdr.size < 4096) ||
+	    (hdr.size > SIZE_MAX/2) ||
+	    ((hdr.size & (hdr.size-1)) != 0) ||
+	    ((uint64_t)st.st_size < sizeof(hdr) + hdr.size)) {
+		DBG_DEBUG("invalid ring header\n");
+		return NULL;
+	}
+
+	ring = messaging_dgm_shm_ring_mmap(mem_ctx, fd, hdr.size);
+	if (ring == NULL) {
+		return NULL;
+	}
+	ring->next_tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+
+	return ring;
+}
+
+size_t messaging_dgm_shm_ring_size(const struct messaging_dgm_shm_ring *ring)
+{
+	return ring->size;
+}
+
+size_t messaging_dgm_shm_ring_max_msglen(
+	const struct messaging_dgm_shm_ring *ring)
+{
+	return ring->size / 4;
+}
+
+int messaging_dgm_shm_ring_push(struct messaging_dgm_shm_ring *ring,
+				uint32_t type,
+				const struct iovec *iov, int iovlen,
+				bool *wake)
+{
+	struct messaging_dgm_shm_hdr *hdr = ring->hdr;
+	struct messaging_dgm_shm_entry entry;
+	uint64_t head, old_head, tail;
+	size_t pos, to_end, need, pad, reserve;
+	ssize_t len;
+
+	len = iov_buflen(iov, iovlen);
+	if (len == -1) {
+		return EMSGSIZE;
+	}
+	if ((size_t)len > messaging_dgm_shm_ring_max_msglen(ring)) {
+		return EMSGSIZE;
+	}
+
+	need = MESSAGING_DGM_SHM_ENTRY_SIZE(len);
+	reserve = (type == MESSAGING_DGM_SHM_STOP) ?
+		0 : MESSAGING_DGM_SHM_ENTRY_SIZE(0);
+
+	head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+	old_head = head;
+
+	pos = head & (ring->size - 1);
+	to_end = ring->size - pos;
+	pad = (need > to_end) ? to_end : 0;
+
+	if ((head - tail) + pad + need + reserve > ring->size) {
+		return ENOSPC;
+	}
+
+	if (pad != 0) {
+		entry = (struct messaging_dgm_shm_entry) {
+			.len = pad - sizeof(entry),
+			.type = MESSAGING_DGM_SHM_PAD,
+		};
+		memcpy(ring->data + pos, &entry, sizeof(entry));
+		head += pad;
+		pos = 0;
+	}
+
+	entry = (struct messaging_dgm_shm_entry) {
+		.len = len, .type = type,
+	};
+	memcpy(ring->data + pos, &entry, sizeof(entry));
+	iov_buf(iov, iovlen, ring->data + pos + sizeof(entry), len);
+	head += need;
+
+	/*
+	 * Pairs with the consumer storing the tail in
+	 * messaging_dgm_shm_ring_consume() and then looking at the
+	 * head again: Either it sees our entry or we see that it had
+	 * caught up with us.
+	 */
+	__atomic_store_n(&hdr->head, head, __ATOMIC_SEQ_CST);
+	tail = __atomic_load_n(&hdr->tail, __ATOMIC_SEQ_CST);
+
+	*wake = (tail == old_head);
+	return 0;
+}
+
+size_t messaging_dgm_shm_ring_used(struct messaging_dgm_shm_ring *ring)
+{
+	uint64_t head = __atomic_load_n(&ring->hdr->head, __ATOMIC_RELAXED);
+	uint64_t tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+
+	return head - tail;
+}
+
+/*
+ * Producer side: How far the consumer got, this only ever grows
+ */
+uint64_t messaging_dgm_shm_ring_tail(struct messaging_dgm_shm_ring *ring)
+{
+	return __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+}
+
+void messaging_dgm_shm_ring_close(struct messaging_dgm_shm_ring *ring)
+{
+	__atomic_store_n(&ring->hdr->closed, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t messaging_dgm_shm_ring_head(struct messaging_dgm_shm_ring *ring)
+{
+	return __atomic_load_n(&ring->hdr->head, __ATOMIC_SEQ_CST);
+}
+
+int messaging_dgm_shm_ring_peek(struct messaging_dgm_shm_ring *ring,
+				uint64_t limit,
+				uint32_t *type,
+				const uint8_t **data,
+				size_t *len)
+{
+	struct messaging_dgm_shm_hdr *hdr = ring->hdr;
+	struct messaging_dgm_shm_entry entry;
+	uint64_t tail;
+	size_t pos;
+
+	tail = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+
+	while (true) {
+		if (tail == limit) {
+			return ENOENT;
+		}
+		if ((limit - tail) > ring->size) {
+			return EINVAL;
+		}
+
+		pos = tail & (ring->size - 1);
+		if ((pos % 8) != 0) {
+			return EINVAL;
+		}
+
+		memcpy(&entry, ring->data + pos, sizeof(entry));
+
+		if (entry.len > ring->size - pos - sizeof(entry)) {
+			return EINVAL;
+		}
+		if (MESSAGING_DGM_SHM_ENTRY_SIZE(entry.len) > (limit - tail)) {
+			return EINVAL;
+		}
+
+		if (entry.type != MESSAGING_DGM_SHM_PAD) {
+			break;
+		}
+
+		tail += MESSAGING_DGM_SHM_ENTRY_SIZE(entry.len);
+		__atomic_store_n(&hdr->tail, tail, __ATOMIC_SEQ_CST);
+	}
+
+	ring->next_tail = tail + MESSAGING_DGM_SHM_ENTRY_SIZE(entry.len);
+
+	*type = entry.type;
+	*data = ring->data + pos + sizeof(entry);
+	*len = entry.len;
+	return 0;
+}
+
+void messaging_dgm_shm_ring_consume(struct messaging_dgm_shm_ring *ring)
+{
+	__atomic_store_n(&ring->hdr->tail, ring->next_tail, __ATOMIC_SEQ_CST);
+}
+
+bool messaging_dgm_shm_ring_empty(struct messaging_dgm_shm_ring *ring)
+{
+	uint64_t head = __atomic_load_n(&ring->hdr->head, __ATOMIC_SEQ_CST);
+	uint64_t tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_RELAXED);
+
+	return (head == tail);
+}
+
+bool messaging_dgm_shm_ring_closed(struct messaging_dgm_shm_ring *ring)
+{
+	return (__atomic_load_n(&ring->hdr->closed, __ATOMIC_ACQUIRE) != 0);
+}
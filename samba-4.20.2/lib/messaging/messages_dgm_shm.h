@@ -0,0 +1,82 @@
+/*
+ * Unix SMB/CIFS implementation.
+ * Single producer single consumer shared memory ring for messages_dgm
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MESSAGES_DGM_SHM_H_
+#define _MESSAGES_DGM_SHM_H_
+
+#include "replace.h"
+#include "system/filesys.h"
+#include <talloc.h>
+
+/*
+ * The sender creates the ring in a sealed memfd and passes the fd to
+ * the receiver, which maps it. Entries are variable length and never
+ * wrap around the end of the ring. Only the producer writes the head,
+ * only the consumer writes the tail.
+ */
+
+#define MESSAGING_DGM_SHM_DATA 1
+
+/*
+ * The producer continues on the socket, the consumer must not look
+ * at anything behind this until it's told to start again.
+ */
+#define MESSAGING_DGM_SHM_STOP 2
+
+struct messaging_dgm_shm_ring;
+
+struct messaging_dgm_shm_ring *messaging_dgm_shm_ring_create(
+	TALLOC_CTX *mem_ctx, size_t size, int *pfd);
+struct messaging_dgm_shm_ring *messaging_dgm_shm_ring_map(
+	TALLOC_CTX *mem_ctx, int fd);
+
+size_t messaging_dgm_shm_ring_size(const struct messaging_dgm_shm_ring *ring);
+size_t messaging_dgm_shm_ring_max_msglen(
+	const struct messaging_dgm_shm_ring *ring);
+
+/*
+ * Producer side. Returns ENOSPC if the ring is full, DATA entries
+ * always leave space for a final STOP entry. *wake is set if the
+ * consumer might have seen the ring empty and needs a wakeup.
+ */
+int messaging_dgm_shm_ring_push(struct messaging_dgm_shm_ring *ring,
+				uint32_t type,
+				const struct iovec *iov, int iovlen,
+				bool *wake);
+size_t messaging_dgm_shm_ring_used(struct messaging_dgm_shm_ring *ring);
+uint64_t messaging_dgm_shm_ring_tail(struct messaging_dgm_shm_ring *ring);
+void messaging_dgm_shm_ring_close(struct messaging_dgm_shm_ring *ring);
+
+/*
+ * Consumer side. messaging_dgm_shm_ring_peek() looks at the oldest
+ * entry before the "limit" taken from messaging_dgm_shm_ring_head(),
+ * returns ENOENT if there is none and EINVAL if the producer messed
+ * up the ring. *data is only valid until
+ * messaging_dgm_shm_ring_consume().
+ */
+uint64_t messaging_dgm_shm_ring_head(struct messaging_dgm_shm_ring *ring);
+int messaging_dgm_shm_ring_peek(struct messaging_dgm_shm_ring *ring,
+				uint64_t limit,
+				uint32_t *type,
+				const uint8_t **data,
+				size_t *len);
+void messaging_dgm_shm_ring_consume(struct messaging_dgm_shm_ring *ring);
+bool messaging_dgm_shm_ring_empty(struct messaging_dgm_shm_ring *ring);
+bool messaging_dgm_shm_ring_closed(struct messaging_dgm_shm_ring *ring);
+
+#endif
@@ -3012,6 +3012,8 @@ struct loadparm_context *loadparm_init(TALLOC_CTX *mem_ctx)
 
 	lpcfg_do_global_parameter_var(lp_ctx, "smb2 max read", "%u", DEFAULT_SMB2_MAX_READ);
 
+	lpcfg_do_global_parameter(lp_ctx, "smb2 compression threshold", "4096");
+
 	lpcfg_do_global_parameter(lp_ctx, "durable handles", "yes");
 
 	lpcfg_do_global_parameter(lp_ctx, "max stat cache size", "512");
@@ -343,3 +343,115 @@ _PUBLIC_ unsigned int tdb_jenkins_hash(TDB_DATA *key)
 {
 	return hashlittle(key->dptr, key->dsize);
 }
+
+/*
+ * tdb_fast_hash() follows the XXH64 construction by Yann Collet: four
+ * independent multiply/rotate lanes over 32 byte stripes, which keeps
+ * the multipliers busy and lets the compiler vectorise, then 8, 4 and
+ * 1 byte steps for the tail and a final avalanche. The input is read as
+ * little endian on all hosts so the hash is the same everywhere.
+ */
+
+#define FAST_PRIME1 0x9E3779B185EBCA87ULL
+#define FAST_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define FAST_PRIME3 0x165667B19E3779F9ULL
+#define FAST_PRIME4 0x85EBCA77C2B2AE63ULL
+#define FAST_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t fast_rotl64(uint64_t x, unsigned r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fast_read64(const uint8_t *p)
+{
+	return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) |
+		((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+		((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint64_t fast_read32(const uint8_t *p)
+{
+	return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) |
+		((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24);
+}
+
+static inline uint64_t fast_round(uint64_t acc, uint64_t input)
+{
+	acc += input * FAST_PRIME2;
+	acc = fast_rotl64(acc, 31);
+	return acc * FAST_PRIME1;
+}
+
+static inline uint64_t fast_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= fast_round(0, val);
+	return acc * FAST_PRIME1 + FAST_PRIME4;
+}
+
+static uint64_t fast_hash64(const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		const uint8_t *limit = end - 32;
+		uint64_t v1 = FAST_PRIME1 + FAST_PRIME2;
+		uint64_t v2 = FAST_PRIME2;
+		uint64_t v3 = 0;
+		uint64_t v4 = -FAST_PRIME1;
+
+		do {
+			v1 = fast_round(v1, fast_read64(p));
+			v2 = fast_round(v2, fast_read64(p+8));
+			v3 = fast_round(v3, fast_read64(p+16));
+			v4 = fast_round(v4, fast_read64(p+24));
+			p += 32;
+		} while (p <= limit);
+
+		h = fast_rotl64(v1, 1) + fast_rotl64(v2, 7) +
+			fast_rotl64(v3, 12) + fast_rotl64(v4, 18);
+		h = fast_merge(h, v1);
+		h = fast_merge(h, v2);
+		h = fast_merge(h, v3);
+		h = fast_merge(h, v4);
+	} else {
+		h = FAST_PRIME5;
+	}
+
+	h += (uint64_t)len;
+
+	while (p + 8 <= end) {
+		h ^= fast_round(0, fast_read64(p));
+		h = fast_rotl64(h, 27) * FAST_PRIME1 + FAST_PRIME4;
+		p += 8;
+	}
+
+	if (p + 4 <= end) {
+		h ^= fast_read32(p) * FAST_PRIME1;
+		h = fast_rotl64(h, 23) * FAST_PRIME2 + FAST_PRIME3;
+		p += 4;
+	}
+
+	while (p < end) {
+		h ^= (*p) * FAST_PRIME5;
+		h = fast_rotl64(h, 11) * FAST_PRIME1;
+		p += 1;
+	}
+
+	h ^= h >> 33;
+	h *= FAST_PRIME2;
+	h ^= h >> 29;
+	h *= FAST_PRIME3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+_PUBLIC_ unsigned int tdb_fast_hash(TDB_DATA *key)
+{
+	uint64_t h = fast_hash64(key->dptr, key->dsize);
+
+	return (uint32_t)(h ^ (h >> 32));
+}
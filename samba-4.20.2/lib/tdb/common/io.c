@@ -208,6 +208,121 @@ static int tdb_notrans_oob(
 	return 0;
 }
 
+#ifdef TDB_HAVE_SEQLOCK
+static uint32_t *tdb_seqlock_counter(struct tdb_context *tdb, tdb_off_t ofs)
+{
+	return (uint32_t *)(ofs + (char *)tdb->map_ptr);
+}
+#endif
+
+/*
+ * Writers bump seqlock_begin before their first write and seqlock_end
+ * once they dropped their chain and allrecord locks again. Lockless
+ * readers only trust what they saw if both were equal before and
+ * seqlock_begin did not move until they were done.
+ */
+static void tdb_seqlock_write_begin(struct tdb_context *tdb)
+{
+#ifdef TDB_HAVE_SEQLOCK
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK) ||
+	    tdb->seqlock_writing || (tdb->map_ptr == NULL)) {
+		return;
+	}
+	__atomic_add_fetch(tdb_seqlock_counter(tdb, TDB_SEQLOCK_BEGIN_OFS), 1,
+			   __ATOMIC_SEQ_CST);
+	/*
+	 * The plain stores into the map that follow must not become
+	 * visible before the new seqlock_begin, pairs with the
+	 * acquire fence in tdb_seqlock_find().
+	 */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	tdb->seqlock_writing = true;
+#endif
+}
+
+void tdb_seqlock_write_end(struct tdb_context *tdb)
+{
+#ifdef TDB_HAVE_SEQLOCK
+	if (!tdb->seqlock_writing) {
+		return;
+	}
+	tdb->seqlock_writing = false;
+	if (tdb->map_ptr == NULL) {
+		/* tdb_seqlock_repair() will fix it */
+		return;
+	}
+	__atomic_add_fetch(tdb_seqlock_counter(tdb, TDB_SEQLOCK_END_OFS), 1,
+			   __ATOMIC_SEQ_CST);
+#endif
+}
+
+/*
+ * With the allrecord lock held for writing nobody else can be between
+ * seqlock_begin and seqlock_end. If a writer died in between, readers
+ * would take the locked path forever, so catch up seqlock_end.
+ */
+void tdb_seqlock_repair(struct tdb_context *tdb)
+{
+#ifdef TDB_HAVE_SEQLOCK
+	uint32_t begin, end;
+
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK) ||
+	    (tdb->map_ptr == NULL)) {
+		return;
+	}
+
+	__atomic_load(tdb_seqlock_counter(tdb, TDB_SEQLOCK_BEGIN_OFS), &begin,
+		      __ATOMIC_SEQ_CST);
+	__atomic_load(tdb_seqlock_counter(tdb, TDB_SEQLOCK_END_OFS), &end,
+		      __ATOMIC_SEQ_CST);
+
+	if (tdb->seqlock_writing) {
+		/* our own seqlock_end is still to come */
+		begin -= 1;
+	}
+	if (begin == end) {
+		return;
+	}
+
+	TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_seqlock_repair: %s: "
+		 "%"PRIu32" unfinished writes\n", tdb->name, begin - end));
+
+	__atomic_add_fetch(tdb_seqlock_counter(tdb, TDB_SEQLOCK_END_OFS),
+			   begin - end, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/*
+ * Copy into the map, leaving out the seqlock counters. A transaction
+ * commit writes back whole blocks including the header, which must not
+ * roll back the counters.
+ */
+static void tdb_map_write(struct tdb_context *tdb, tdb_off_t off,
+			  const void *buf, tdb_len_t len)
+{
+	const tdb_off_t skip_start = TDB_SEQLOCK_BEGIN_OFS;
+	const tdb_off_t skip_end = TDB_SEQLOCK_END_OFS + sizeof(uint32_t);
+
+	if ((tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK) &&
+	    (off < skip_end) && (off + len > skip_start)) {
+		const char *src = (const char *)buf;
+
+		if (off < skip_start) {
+			memcpy(off + (char *)tdb->map_ptr, src,
+			       skip_start - off);
+		}
+		if (off + len > skip_end) {
+			tdb_off_t ofs = MAX(off, skip_end);
+
+			memcpy(ofs + (char *)tdb->map_ptr, src + (ofs - off),
+			       off + len - ofs);
+		}
+		return;
+	}
+
+	memcpy(off + (char *)tdb->map_ptr, buf, len);
+}
+
 /* write a lump of data at a specified offset */
 static int tdb_write(struct tdb_context *tdb, tdb_off_t off,
 		     const void *buf, tdb_len_t len)
@@ -224,8 +339,16 @@ static int tdb_write(struct tdb_context *tdb, tdb_off_t off,
 	if (tdb_oob(tdb, off, len, 0) != 0)
 		return -1;
 
+	if (unlikely(tdb->wal.fd != -1) && !tdb->wal.applying &&
+	    (tdb->transaction == NULL) &&
+	    (tdb_wal_unlogged_write(tdb) != 0)) {
+		return -1;
+	}
+
+	tdb_seqlock_write_begin(tdb);
+
 	if (tdb->map_ptr) {
-		memcpy(off + (char *)tdb->map_ptr, buf, len);
+		tdb_map_write(tdb, off, buf, len);
 	} else {
 #ifdef HAVE_INCOHERENT_MMAP
 		tdb->ecode = TDB_ERR_IO;
@@ -259,6 +382,11 @@ static int tdb_write(struct tdb_context *tdb, tdb_off_t off,
 		}
 #endif
 	}
+
+	if (tdb->flags & TDB_NOLOCK) {
+		/* no unlock will tell readers we're done */
+		tdb_seqlock_write_end(tdb);
+	}
 	return 0;
 }
 
@@ -358,6 +486,10 @@ static bool should_mmap(const struct tdb_context *tdb)
 #ifdef HAVE_INCOHERENT_MMAP
 	return true;
 #else
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK) {
+		/* the seqlock counters live in the map */
+		return true;
+	}
 	return !(tdb->flags & TDB_NOMMAP);
 #endif
 }
@@ -386,6 +518,10 @@ int tdb_mmap(struct tdb_context *tdb)
 			tdb->ecode = TDB_ERR_IO;
 			return -1;
 #endif
+			if (tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK) {
+				tdb->ecode = TDB_ERR_IO;
+				return -1;
+			}
 		}
 	} else {
 		tdb->map_ptr = NULL;
@@ -312,6 +312,7 @@ int tdb_allrecord_upgrade(struct tdb_context *tdb)
 	if (ret == 0) {
 		tdb->allrecord_lock.ltype = F_WRLCK;
 		tdb->allrecord_lock.off = 0;
+		tdb_seqlock_repair(tdb);
 		return 0;
 	}
 fail:
@@ -319,6 +320,56 @@ fail:
 	return -1;
 }
 
+/*
+ * A traverse keeps a record locked while calling out and waits for
+ * its chain lock afterwards, with mutexes nobody notices the deadlock
+ * if we wait for that record lock. Used by tdb_rehash(), which can
+ * just try again later.
+ */
+int tdb_allrecord_upgrade_nowait(struct tdb_context *tdb)
+{
+	int ret;
+
+	if ((tdb->allrecord_lock.count != 1) ||
+	    (tdb->allrecord_lock.off != 1)) {
+		tdb->ecode = TDB_ERR_LOCK;
+		return -1;
+	}
+
+	if (tdb_have_mutexes(tdb)) {
+		ret = tdb_mutex_allrecord_upgrade(tdb);
+		if (ret == -1) {
+			return -1;
+		}
+	} else {
+		ret = tdb_brlock_retry(tdb, F_WRLCK, FREELIST_TOP,
+				       tdb->hash_size * 4,
+				       TDB_LOCK_WAIT|TDB_LOCK_PROBE);
+		if (ret == -1) {
+			tdb->ecode = TDB_ERR_LOCK;
+			return -1;
+		}
+	}
+
+	ret = tdb_brlock(tdb, F_WRLCK, lock_offset(tdb->hash_size), 0,
+			 TDB_LOCK_NOWAIT|TDB_LOCK_PROBE);
+	if (ret == -1) {
+		if (tdb_have_mutexes(tdb)) {
+			tdb_mutex_allrecord_downgrade(tdb);
+		} else {
+			tdb_brlock(tdb, F_RDLCK, FREELIST_TOP,
+				   tdb->hash_size * 4, TDB_LOCK_WAIT);
+		}
+		tdb->ecode = TDB_ERR_LOCK;
+		return -1;
+	}
+
+	tdb->allrecord_lock.ltype = F_WRLCK;
+	tdb->allrecord_lock.off = 0;
+	tdb_seqlock_repair(tdb);
+	return 0;
+}
+
 static struct tdb_lock_type *find_nestlock(struct tdb_context *tdb,
 					   tdb_off_t offset)
 {
@@ -489,9 +540,62 @@ static int tdb_lock_list(struct tdb_context *tdb, int list, int ltype,
 		}
 		return tdb_lock_list(tdb, list, ltype, waitflag);
 	}
+
+	/*
+	 * Check for tdb_rehash(): The records might have been moved
+	 * to a new file.
+	 */
+	if (ret == 0 && check && tdb_rehash_moved(tdb)) {
+		tdb_nest_unlock(tdb, lock_offset(list), ltype, false);
+
+		if (tdb_rehash_follow(tdb) == -1) {
+			return -1;
+		}
+		return tdb_lock_list(tdb, list, ltype, waitflag);
+	}
+	return ret;
+}
+
+/*
+ * Lock the hash chain for "hash". After following a tdb_rehash() the
+ * chain might be a different one than we locked.
+ */
+static int tdb_lock_hash_list(struct tdb_context *tdb, uint32_t hash,
+			      int ltype, enum tdb_lock_flags waitflag)
+{
+	while (true) {
+		uint32_t list = BUCKET(hash);
+		int ret;
+
+		ret = tdb_lock_list(tdb, list, ltype, waitflag);
+		if (ret != 0) {
+			return ret;
+		}
+		if (list == BUCKET(hash)) {
+			return 0;
+		}
+		tdb_unlock(tdb, list, ltype);
+	}
+}
+
+int tdb_lock_hash(struct tdb_context *tdb, uint32_t hash, int ltype)
+{
+	int ret;
+
+	ret = tdb_lock_hash_list(tdb, hash, ltype, TDB_LOCK_WAIT);
+	if (ret) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_lock failed on hash "
+			 "0x%08"PRIx32" ltype=%d (%s)\n",
+			 hash, ltype, strerror(errno)));
+	}
 	return ret;
 }
 
+int tdb_lock_hash_nonblock(struct tdb_context *tdb, uint32_t hash, int ltype)
+{
+	return tdb_lock_hash_list(tdb, hash, ltype, TDB_LOCK_NOWAIT);
+}
+
 /* lock a list in the database. list -1 is the alloc list */
 int tdb_lock(struct tdb_context *tdb, int list, int ltype)
 {
@@ -513,6 +617,33 @@ _PUBLIC_ int tdb_lock_nonblock(struct tdb_context *tdb, int list, int ltype)
 }
 
 
+/*
+ * All writes happen under chain, freelist or allrecord locks. Right
+ * before we drop the last of them, tell lockless readers we're done.
+ * This has to happen while we still hold the lock, tdb_seqlock_repair()
+ * relies on it.
+ */
+static void tdb_seqlock_unlocking(struct tdb_context *tdb,
+				  const struct tdb_lock_type *dropping)
+{
+	int i;
+
+	if (!tdb->seqlock_writing) {
+		return;
+	}
+	if ((dropping != NULL) && (tdb->allrecord_lock.count != 0)) {
+		return;
+	}
+	for (i=0; i<tdb->num_lockrecs; i++) {
+		const struct tdb_lock_type *lck = &tdb->lockrecs[i];
+
+		if ((lck != dropping) && (lck->off >= lock_offset(-1))) {
+			return;
+		}
+	}
+	tdb_seqlock_write_end(tdb);
+}
+
 int tdb_nest_unlock(struct tdb_context *tdb, uint32_t offset, int ltype,
 		    bool mark_lock)
 {
@@ -546,6 +677,8 @@ int tdb_nest_unlock(struct tdb_context *tdb, uint32_t offset, int ltype,
 	 * anyway.
 	 */
 
+	tdb_seqlock_unlocking(tdb, lck);
+
 	if (mark_lock) {
 		ret = 0;
 	} else {
@@ -733,6 +866,18 @@ int tdb_allrecord_lock(struct tdb_context *tdb, int ltype,
 		return tdb_allrecord_lock(tdb, ltype, flags, upgradable);
 	}
 
+	if (!(flags & TDB_LOCK_MARK_ONLY) && tdb_rehash_moved(tdb)) {
+		tdb_allrecord_unlock(tdb, ltype, false);
+		if (tdb_rehash_follow(tdb) == -1) {
+			return -1;
+		}
+		return tdb_allrecord_lock(tdb, ltype, flags, upgradable);
+	}
+
+	if ((ltype == F_WRLCK) && !(flags & TDB_LOCK_MARK_ONLY)) {
+		tdb_seqlock_repair(tdb);
+	}
+
 	return 0;
 }
 
@@ -764,6 +909,8 @@ int tdb_allrecord_unlock(struct tdb_context *tdb, int ltype, bool mark_lock)
 		return 0;
 	}
 
+	tdb_seqlock_unlocking(tdb, NULL);
+
 	if (!mark_lock) {
 		int ret;
 
@@ -853,7 +1000,7 @@ _PUBLIC_ int tdb_unlockall_read(struct tdb_context *tdb)
    contention - it cannot guarantee how many records will be locked */
 _PUBLIC_ int tdb_chainlock(struct tdb_context *tdb, TDB_DATA key)
 {
-	int ret = tdb_lock(tdb, BUCKET(tdb->hash_fn(&key)), F_WRLCK);
+	int ret = tdb_lock_hash(tdb, tdb->hash_fn(&key), F_WRLCK);
 	tdb_trace_1rec(tdb, "tdb_chainlock", key);
 	return ret;
 }
@@ -863,7 +1010,7 @@ _PUBLIC_ int tdb_chainlock(struct tdb_context *tdb, TDB_DATA key)
    locked */
 _PUBLIC_ int tdb_chainlock_nonblock(struct tdb_context *tdb, TDB_DATA key)
 {
-	int ret = tdb_lock_nonblock(tdb, BUCKET(tdb->hash_fn(&key)), F_WRLCK);
+	int ret = tdb_lock_hash_nonblock(tdb, tdb->hash_fn(&key), F_WRLCK);
 	tdb_trace_1rec_ret(tdb, "tdb_chainlock_nonblock", key, ret);
 	return ret;
 }
@@ -887,14 +1034,17 @@ _PUBLIC_ int tdb_chainlock_unmark(struct tdb_context *tdb, TDB_DATA key)
 
 _PUBLIC_ int tdb_chainunlock(struct tdb_context *tdb, TDB_DATA key)
 {
+	int ret;
 	tdb_trace_1rec(tdb, "tdb_chainunlock", key);
-	return tdb_unlock(tdb, BUCKET(tdb->hash_fn(&key)), F_WRLCK);
+	ret = tdb_unlock(tdb, BUCKET(tdb->hash_fn(&key)), F_WRLCK);
+	tdb_rehash_maybe(tdb);
+	return ret;
 }
 
 _PUBLIC_ int tdb_chainlock_read(struct tdb_context *tdb, TDB_DATA key)
 {
 	int ret;
-	ret = tdb_lock(tdb, BUCKET(tdb->hash_fn(&key)), F_RDLCK);
+	ret = tdb_lock_hash(tdb, tdb->hash_fn(&key), F_RDLCK);
 	tdb_trace_1rec(tdb, "tdb_chainlock_read", key);
 	return ret;
 }
@@ -907,7 +1057,7 @@ _PUBLIC_ int tdb_chainunlock_read(struct tdb_context *tdb, TDB_DATA key)
 
 _PUBLIC_ int tdb_chainlock_read_nonblock(struct tdb_context *tdb, TDB_DATA key)
 {
-	int ret = tdb_lock_nonblock(tdb, BUCKET(tdb->hash_fn(&key)), F_RDLCK);
+	int ret = tdb_lock_hash_nonblock(tdb, tdb->hash_fn(&key), F_RDLCK);
 	tdb_trace_1rec_ret(tdb, "tdb_chainlock_read_nonblock", key, ret);
 	return ret;
 }
@@ -998,6 +1148,9 @@ void tdb_release_transaction_locks(struct tdb_context *tdb)
 	int i;
 	unsigned int active = 0;
 
+	/* We're dropping everything but the active lock */
+	tdb_seqlock_write_end(tdb);
+
 	if (tdb->allrecord_lock.count != 0) {
 		tdb_allrecord_unlock(tdb, tdb->allrecord_lock.ltype, false);
 		tdb->allrecord_lock.count = 0;
@@ -453,8 +453,8 @@ int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb)
 	}
 
 	/*
-	 * Our only caller tdb_allrecord_upgrade()
-	 * guarantees that we already own the allrecord lock.
+	 * Our only callers tdb_allrecord_upgrade() and
+	 * tdb_allrecord_upgrade_nowait() guarantee that we already own the allrecord lock.
 	 *
 	 * Which means m->allrecord_mutex is still locked by us.
 	 */
@@ -501,8 +501,9 @@ void tdb_mutex_allrecord_downgrade(struct tdb_context *tdb)
 	struct tdb_mutexes *m = tdb->mutexes;
 
 	/*
-	 * Our only caller tdb_allrecord_upgrade() (in the error case)
-	 * guarantees that we already own the allrecord lock.
+	 * Our only callers tdb_allrecord_upgrade() and
+	 * tdb_allrecord_upgrade_nowait() (in the error case)
+	 * guarantee that we already own the allrecord lock.
 	 *
 	 * Which means m->allrecord_mutex is still locked by us.
 	 */
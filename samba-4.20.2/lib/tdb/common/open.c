@@ -84,6 +84,20 @@ static int tdb_new_database(struct tdb_context *tdb, struct tdb_header *header,
 	if (tdb->flags & TDB_MUTEX_LOCKING) {
 		newdb->feature_flags |= TDB_FEATURE_FLAG_MUTEX;
 	}
+	if (tdb->hash_fn == tdb_fast_hash) {
+		newdb->feature_flags |= TDB_FEATURE_FLAG_FAST_HASH;
+	}
+	if (tdb->flags & TDB_REHASH) {
+		newdb->feature_flags |= TDB_FEATURE_FLAG_REHASH;
+	}
+#ifdef TDB_HAVE_SEQLOCK
+	if ((tdb->flags & TDB_SEQLOCK) && !(tdb->flags & TDB_INTERNAL)) {
+		newdb->feature_flags |= TDB_FEATURE_FLAG_SEQLOCK;
+	}
+#endif
+	if ((tdb->flags & TDB_WAL) && !(tdb->flags & TDB_INTERNAL)) {
+		newdb->feature_flags |= TDB_FEATURE_FLAG_WAL;
+	}
 
 	/*
 	 * If we have any features we add the FEATURE_FLAG_MAGIC, overwriting the
@@ -116,6 +130,21 @@ static int tdb_new_database(struct tdb_context *tdb, struct tdb_header *header,
 	if (ftruncate(tdb->fd, 0) == -1)
 		goto fail;
 
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_WAL) {
+		/* a log left behind must not be replayed into the new file */
+		char *wal_name = tdb_wal_name(tdb->name);
+
+		if (wal_name == NULL) {
+			errno = ENOMEM;
+			goto fail;
+		}
+		if ((unlink(wal_name) == -1) && (errno != ENOENT)) {
+			SAFE_FREE(wal_name);
+			goto fail;
+		}
+		SAFE_FREE(wal_name);
+	}
+
 	if (newdb->feature_flags & TDB_FEATURE_FLAG_MUTEX) {
 		newdb->mutex_size = tdb_mutex_size(tdb);
 		tdb->hdr_ofs = newdb->mutex_size;
@@ -169,6 +198,69 @@ static int tdb_new_database(struct tdb_context *tdb, struct tdb_header *header,
 
 
 
+char *tdb_wal_name(const char *name)
+{
+	size_t len = strlen(name) + 5;
+	char *wal_name;
+
+	wal_name = (char *)malloc(len);
+	if (wal_name == NULL) {
+		return NULL;
+	}
+	snprintf(wal_name, len, "%s.wal", name);
+	return wal_name;
+}
+
+static int tdb_wal_open(struct tdb_context *tdb)
+{
+	struct stat st;
+	char *wal_name;
+	int v;
+
+	if (fstat(tdb->fd, &st) == -1) {
+		return -1;
+	}
+
+	wal_name = tdb_wal_name(tdb->name);
+	if (wal_name == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	tdb->wal.fd = open(wal_name, O_RDWR|O_CREAT, st.st_mode & 0777);
+	if (tdb->wal.fd == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: could not open "
+			 "log %s: %s\n", wal_name, strerror(errno)));
+		SAFE_FREE(wal_name);
+		return -1;
+	}
+	SAFE_FREE(wal_name);
+
+	v = fcntl(tdb->wal.fd, F_GETFD, 0);
+	fcntl(tdb->wal.fd, F_SETFD, v | FD_CLOEXEC);
+
+	return 0;
+}
+
+/*
+ * The last one to close the database checkpoints, so the next opener
+ * finds an empty log.
+ */
+static void tdb_wal_close(struct tdb_context *tdb)
+{
+	int ret;
+
+	ret = tdb_brlock(tdb, F_WRLCK, ACTIVE_LOCK, 1,
+			 TDB_LOCK_NOWAIT|TDB_LOCK_PROBE);
+	if ((ret == 0) && (tdb_wal_flush(tdb) == -1)) {
+		TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_close: "
+			 "checkpoint of %s failed\n", tdb->name));
+	}
+
+	close(tdb->wal.fd);
+	tdb->wal.fd = -1;
+}
+
 static int tdb_already_open(dev_t device,
 			    ino_t ino)
 {
@@ -258,6 +350,143 @@ static bool tdb_mutex_open_ok(struct tdb_context *tdb,
 	return true;
 }
 
+/*
+ * Read the header of a tdb that is not (yet) ours. For mutex tdbs
+ * the live header is the one behind the mutex area.
+ */
+static bool tdb_rehash_read_header(int fd, struct tdb_header *header)
+{
+	bool rev;
+	ssize_t nread;
+
+	nread = pread(fd, header, sizeof(*header), 0);
+	if (nread != sizeof(*header)) {
+		return false;
+	}
+	if (strncmp(header->magic_food, TDB_MAGIC_FOOD,
+		    sizeof(header->magic_food)) != 0) {
+		return false;
+	}
+
+	rev = (header->version == TDB_BYTEREV(TDB_VERSION));
+	if (!rev && (header->version != TDB_VERSION)) {
+		return false;
+	}
+	if (rev) {
+		tdb_convert(header, sizeof(*header));
+	}
+
+	if (header->rwlocks != TDB_FEATURE_FLAG_MAGIC) {
+		return false;
+	}
+
+	if (header->feature_flags & TDB_FEATURE_FLAG_MUTEX) {
+		tdb_len_t mutex_size = header->mutex_size;
+
+		nread = pread(fd, header, sizeof(*header), mutex_size);
+		if (nread != sizeof(*header)) {
+			return false;
+		}
+		if (rev) {
+			tdb_convert(header, sizeof(*header));
+		}
+	}
+
+	return true;
+}
+
+char *tdb_rehash_gen_name(const char *name, uint32_t gen)
+{
+	size_t len = strlen(name) + 16;
+	char *gen_name;
+
+	gen_name = (char *)malloc(len);
+	if (gen_name == NULL) {
+		return NULL;
+	}
+	snprintf(gen_name, len, "%s.gen%"PRIu32, name, gen);
+	return gen_name;
+}
+
+/*
+ * A CLEAR_IF_FIRST tdb that went through tdb_rehash() might still be
+ * used by processes that did not follow the rename yet. They hold the
+ * ACTIVE_LOCK on the old inode only, which tdb_rehash() keeps
+ * reachable as "<name>.gen<N>". Once nobody uses them anymore the
+ * generation links are removed.
+ */
+static bool tdb_rehash_generations_busy(struct tdb_context *tdb)
+{
+	struct tdb_header header;
+	struct stat st;
+	uint32_t gen;
+	bool busy = false;
+
+	if (!tdb_rehash_read_header(tdb->fd, &header)) {
+		return false;
+	}
+	if (!(header.feature_flags & TDB_FEATURE_FLAG_REHASH)) {
+		return false;
+	}
+	if (fstat(tdb->fd, &st) == -1) {
+		return false;
+	}
+
+	for (gen = 0; gen < header.rehash_gen && !busy; gen++) {
+		struct flock fl = {
+			.l_type = F_WRLCK,
+			.l_whence = SEEK_SET,
+			.l_start = ACTIVE_LOCK,
+			.l_len = 1,
+		};
+		struct stat gst;
+		char *gen_name;
+		int fd, ret;
+
+		gen_name = tdb_rehash_gen_name(tdb->name, gen);
+		if (gen_name == NULL) {
+			return true;
+		}
+
+		/*
+		 * Don't ever open our own inode: Closing it would
+		 * drop all our fcntl locks.
+		 */
+		ret = stat(gen_name, &gst);
+		if ((ret == -1) ||
+		    ((gst.st_dev == st.st_dev) && (gst.st_ino == st.st_ino))) {
+			SAFE_FREE(gen_name);
+			continue;
+		}
+
+		fd = open(gen_name, O_RDWR, 0);
+		SAFE_FREE(gen_name);
+		if (fd == -1) {
+			continue;
+		}
+
+		ret = fcntl(fd, F_GETLK, &fl);
+		if ((ret == -1) || (fl.l_type != F_UNLCK)) {
+			busy = true;
+		}
+		close(fd);
+	}
+
+	if (busy) {
+		return true;
+	}
+
+	for (gen = 0; gen < header.rehash_gen; gen++) {
+		char *gen_name = tdb_rehash_gen_name(tdb->name, gen);
+		if (gen_name != NULL) {
+			unlink(gen_name);
+			SAFE_FREE(gen_name);
+		}
+	}
+
+	return false;
+}
+
 _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 				int open_flags, mode_t mode,
 				const struct tdb_logging_context *log_ctx,
@@ -293,6 +522,7 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 	}
 
 	tdb->fd = -1;
+	tdb->wal.fd = -1;
 #ifdef TDB_TRACE
 	tdb->tracefd = -1;
 #endif
@@ -338,7 +568,9 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		hash_alg = "the user defined";
 	} else {
 		/* This controls what we use when creating a tdb. */
-		if (tdb->flags & TDB_INCOMPATIBLE_HASH) {
+		if (tdb->flags & TDB_FAST_HASH) {
+			tdb->hash_fn = tdb_fast_hash;
+		} else if (tdb->flags & TDB_INCOMPATIBLE_HASH) {
 			tdb->hash_fn = tdb_jenkins_hash;
 		} else {
 			tdb->hash_fn = tdb_old_hash;
@@ -429,6 +661,16 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		}
 	}
 
+	if ((tdb->flags & TDB_WAL) &&
+	    (tdb->flags & (TDB_CLEAR_IF_FIRST|TDB_MUTEX_LOCKING|TDB_REHASH))) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+			"invalid flags for %s - TDB_WAL is not allowed "
+			"together with TDB_CLEAR_IF_FIRST, TDB_MUTEX_LOCKING "
+			"or TDB_REHASH\n", name));
+		errno = EINVAL;
+		goto fail;
+	}
+
 	if (getenv("TDB_NO_FSYNC")) {
 		tdb->flags |= TDB_NOSYNC;
 	}
@@ -477,6 +719,15 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 				    TDB_LOCK_NOWAIT|TDB_LOCK_PROBE);
 		locked = (ret == 0);
 
+		if (locked && tdb_rehash_generations_busy(tdb)) {
+			ret = tdb_nest_unlock(tdb, ACTIVE_LOCK, F_WRLCK,
+					      false);
+			if (ret == -1) {
+				goto fail;
+			}
+			locked = false;
+		}
+
 		if (locked) {
 			ret = tdb_brlock(tdb, F_WRLCK, FREELIST_TOP, 0,
 					 TDB_LOCK_WAIT);
@@ -625,6 +876,31 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		}
 	}
 
+	if ((tdb->feature_flags & TDB_FEATURE_FLAG_WAL) &&
+	    (tdb_flags & TDB_CLEAR_IF_FIRST) && !tdb->read_only) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
+			 "%s has a write-ahead log, TDB_CLEAR_IF_FIRST "
+			 "is not allowed\n", name));
+		errno = EINVAL;
+		goto fail;
+	}
+
+	if (!hash_fn && (tdb->feature_flags & TDB_FEATURE_FLAG_FAST_HASH)) {
+		/*
+		 * check_header_hash() only knows about the two
+		 * traditional hashes to fall back to.
+		 */
+		tdb->hash_fn = tdb_fast_hash;
+	} else if (!hash_fn && (tdb->hash_fn == tdb_fast_hash)) {
+		/* TDB_FAST_HASH only applies to new databases */
+		tdb->hash_fn = tdb_jenkins_hash;
+	}
+
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_REHASH) {
+		tdb->rehash.chain_length = TDB_REHASH_CHAIN_LENGTH;
+		tdb->rehash.window = TDB_REHASH_WINDOW;
+	}
+
 	if ((header.magic1_hash == 0) && (header.magic2_hash == 0)) {
 		/* older TDB without magic hash references */
 		tdb->hash_fn = tdb_old_hash;
@@ -691,6 +967,28 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 		goto fail;
 	}
 
+	if ((tdb->feature_flags & TDB_FEATURE_FLAG_WAL) && !tdb->read_only) {
+		ret = tdb_wal_open(tdb);
+		if (ret == -1) {
+			goto fail;
+		}
+
+		/*
+		 * If nobody else has it open, the machine might have
+		 * crashed before the file was synced
+		 */
+		ret = tdb_nest_lock(tdb, ACTIVE_LOCK, F_WRLCK,
+				    TDB_LOCK_NOWAIT|TDB_LOCK_PROBE);
+		locked = (ret == 0);
+
+		if (locked && (tdb_wal_replay(tdb) == -1)) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_open_ex: "
+				 "failed to replay the log of %s\n", name));
+			errno = EIO;
+			goto fail;
+		}
+	}
+
 	if (locked) {
 		if (tdb_nest_unlock(tdb, ACTIVE_LOCK, F_WRLCK, false) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: "
@@ -702,12 +1000,13 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 
 	}
 
-	if (locked || (tdb_flags & TDB_CLEAR_IF_FIRST)) {
+	if (locked || (tdb_flags & TDB_CLEAR_IF_FIRST) ||
+	    (tdb->wal.fd != -1)) {
 		/*
 		 * We always need to do this if the CLEAR_IF_FIRST
 		 * flag is set, even if we didn't get the initial
 		 * exclusive lock as we need to let all other users
-		 * know we're using it.
+		 * know we're using it. The same is true for the log.
 		 */
 
 		ret = tdb_nest_lock(tdb, ACTIVE_LOCK, F_RDLCK, TDB_LOCK_WAIT);
@@ -767,6 +1066,9 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
 	if (tdb->fd != -1)
 		if (close(tdb->fd) != 0)
 			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: failed to close tdb->fd on error!\n"));
+	if (tdb->wal.fd != -1) {
+		close(tdb->wal.fd);
+	}
 	SAFE_FREE(tdb->lockrecs);
 	SAFE_FREE(tdb->name);
 	SAFE_FREE(tdb);
@@ -799,6 +1101,12 @@ _PUBLIC_ int tdb_close(struct tdb_context *tdb)
 	}
 	tdb_trace(tdb, "tdb_close");
 
+	if (tdb->wal.fd != -1) {
+		tdb_wal_close(tdb);
+	}
+
+	tdb_seqlock_write_end(tdb);
+
 	if (tdb->map_ptr) {
 		if (tdb->flags & TDB_INTERNAL)
 			SAFE_FREE(tdb->map_ptr);
@@ -844,6 +1152,266 @@ _PUBLIC_ void *tdb_get_logging_private(struct tdb_context *tdb)
 	return tdb->log.log_private;
 }
 
+bool tdb_rehash_moved(struct tdb_context *tdb)
+{
+	tdb_off_t rehashed = 0;
+	int ret;
+
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_REHASH)) {
+		return false;
+	}
+	if (tdb->flags & (TDB_NOLOCK|TDB_INTERNAL)) {
+		return false;
+	}
+
+	ret = tdb_ofs_read(tdb, TDB_REHASHED_OFS, &rehashed);
+	if (ret != 0) {
+		return false;
+	}
+
+	return ((rehashed != 0) && (rehashed != tdb->rehash.ignore));
+}
+
+/*
+ * Switch over to the file tdb_rehash() has renamed into place. We
+ * take our ACTIVE_LOCK and TRANSACTION_LOCK on the new inode before
+ * closing the old one, so CLEAR_IF_FIRST openers never see a gap.
+ * This means the fd number changes.
+ */
+static int tdb_rehash_adopt(struct tdb_context *tdb, int fd,
+			    const struct stat *st)
+{
+	struct tdb_header header;
+	uint32_t old_hash_size = tdb->hash_size;
+	uint32_t magic1, magic2;
+	size_t mutex_size;
+	int old_fd = tdb->fd;
+	int i, ret;
+
+	if (!tdb_rehash_read_header(fd, &header)) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_rehash_adopt: "
+			 "%s has an invalid header\n", tdb->name));
+		return -1;
+	}
+
+	tdb_header_hash(tdb, &magic1, &magic2);
+
+	if ((header.feature_flags != tdb->feature_flags) ||
+	    (header.hash_size == 0) ||
+	    (header.hash_size > UINT32_MAX/4) ||
+	    (header.magic1_hash != magic1) ||
+	    (header.magic2_hash != magic2)) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_rehash_adopt: "
+			 "%s is not compatible to the rehashed tdb\n",
+			 tdb->name));
+		return -1;
+	}
+
+	tdb->hash_size = header.hash_size;
+	mutex_size = tdb_mutex_size(tdb);
+	tdb->hash_size = old_hash_size;
+
+	if ((tdb->feature_flags & TDB_FEATURE_FLAG_MUTEX) &&
+	    (header.mutex_size != mutex_size)) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_rehash_adopt: "
+			 "%s has mutex size %"PRIu32", expected %zu\n",
+			 tdb->name, header.mutex_size, mutex_size));
+		return -1;
+	}
+
+	/*
+	 * Only ACTIVE_LOCK and TRANSACTION_LOCK can be held here,
+	 * tdb_rehash() made sure nobody holds data locks on the old
+	 * file while it was moved away.
+	 */
+	tdb->fd = fd;
+	for (i=0; i<tdb->num_lockrecs; i++) {
+		struct tdb_lock_type *lck = &tdb->lockrecs[i];
+
+		ret = tdb_brlock(tdb, lck->ltype, lck->off, 1,
+				 TDB_LOCK_WAIT);
+		if (ret == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_rehash_adopt: "
+				 "could not lock %s at %"PRIu32": %s\n",
+				 tdb->name, lck->off, strerror(errno)));
+			tdb->fd = old_fd;
+			/* Closing fd drops what we got so far */
+			return -1;
+		}
+	}
+	tdb->fd = old_fd;
+
+	/* Our seqlock_end belongs to the old file */
+	tdb_seqlock_write_end(tdb);
+
+	if (tdb_munmap(tdb) != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_rehash_adopt: "
+			 "munmap failed (%s)\n", strerror(errno)));
+		return -1;
+	}
+	if (tdb->mutexes != NULL) {
+		tdb_mutex_munmap(tdb);
+	}
+
+	if (old_fd != -1) {
+		close(old_fd);
+	}
+	tdb->fd = fd;
+	tdb->device = st->st_dev;
+	tdb->inode = st->st_ino;
+	tdb->hash_size = header.hash_size;
+	tdb->hdr_ofs = mutex_size;
+
+	tdb->rehash.ignore = 0;
+	tdb->rehash.lookups = 0;
+	tdb->rehash.walked = 0;
+
+	tdb->map_size = 0;
+	ret = tdb_oob(tdb, 0, 1, 0);
+	if (ret == -1) {
+		return -1;
+	}
+
+	if (tdb_have_mutexes(tdb)) {
+		ret = tdb_mutex_mmap(tdb);
+		if (ret == -1) {
+			return -1;
+		}
+	}
+
+	TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_rehash_adopt: "
+		 "%s now has %"PRIu32" hash chains\n",
+		 tdb->name, tdb->hash_size));
+
+	return 0;
+}
+
+/*
+ * Unlink generation links of earlier tdb_rehash() calls that nobody
+ * uses anymore. Only CLEAR_IF_FIRST tdbs care about them, see
+ * tdb_rehash_generations_busy().
+ */
+static void tdb_rehash_prune_generations(struct tdb_context *tdb)
+{
+	tdb_off_t rehash_gen = 0;
+	uint32_t gen;
+	int ret;
+
+	ret = tdb_ofs_read(tdb, TDB_REHASH_GEN_OFS, &rehash_gen);
+	if (ret != 0) {
+		return;
+	}
+
+	for (gen = 0; gen < rehash_gen; gen++) {
+		struct flock fl = {
+			.l_type = F_WRLCK,
+			.l_whence = SEEK_SET,
+			.l_start = ACTIVE_LOCK,
+			.l_len = 1,
+		};
+		struct stat st;
+		char *gen_name;
+		int fd;
+
+		gen_name = tdb_rehash_gen_name(tdb->name, gen);
+		if (gen_name == NULL) {
+			return;
+		}
+
+		ret = stat(gen_name, &st);
+		if ((ret == -1) ||
+		    ((st.st_dev == tdb->device) && (st.st_ino == tdb->inode))) {
+			SAFE_FREE(gen_name);
+			continue;
+		}
+
+		fd = open(gen_name, O_RDWR, 0);
+		if (fd == -1) {
+			SAFE_FREE(gen_name);
+			continue;
+		}
+
+		ret = fcntl(fd, F_GETLK, &fl);
+		if ((ret == 0) && (fl.l_type == F_UNLCK)) {
+			unlink(gen_name);
+		}
+		close(fd);
+		SAFE_FREE(gen_name);
+	}
+}
+
+/*
+ * Someone tdb_rehash()ed the tdb we have open: Follow to the file
+ * that replaced it. If the rename did not happen the tdb_rehash()
+ * was abandoned, remember to ignore its marker.
+ */
+int tdb_rehash_follow(struct tdb_context *tdb)
+{
+	tdb_off_t rehashed = 0;
+	struct stat st;
+	int fd, ret;
+
+	ret = tdb_ofs_read(tdb, TDB_REHASHED_OFS, &rehashed);
+	if (ret != 0) {
+		return -1;
+	}
+
+	ret = stat(tdb->name, &st);
+	if (ret == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_rehash_follow: "
+			 "stat of %s failed: %s\n",
+			 tdb->name, strerror(errno)));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+
+	if ((st.st_dev == tdb->device) && (st.st_ino == tdb->inode)) {
+		/*
+		 * Never open our own inode, closing it would drop
+		 * our locks.
+		 */
+		tdb->rehash.ignore = rehashed;
+		return 0;
+	}
+
+	/*
+	 * Names only ever move to freshly created files, so this can't
+	 * be our inode anymore.
+	 */
+	fd = open(tdb->name, tdb->open_flags & ~(O_CREAT|O_TRUNC|O_EXCL), 0);
+	if (fd == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_rehash_follow: "
+			 "open of %s failed: %s\n",
+			 tdb->name, strerror(errno)));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	ret = fcntl(fd, F_GETFD, 0);
+	fcntl(fd, F_SETFD, ret | FD_CLOEXEC);
+
+	ret = fstat(fd, &st);
+	if (ret == -1) {
+		close(fd);
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+
+	ret = tdb_rehash_adopt(tdb, fd, &st);
+	if (ret == -1) {
+		if (tdb->fd != fd) {
+			close(fd);
+		}
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+
+	if (tdb->flags & TDB_CLEAR_IF_FIRST) {
+		tdb_rehash_prune_generations(tdb);
+	}
+
+	return 0;
+}
+
 static int tdb_reopen_internal(struct tdb_context *tdb, bool active_lock)
 {
 #if !defined(LIBREPLACE_PREAD_NOT_REPLACED) || \
@@ -888,6 +1456,23 @@ static int tdb_reopen_internal(struct tdb_context *tdb, bool active_lock)
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_reopen: fstat failed (%s)\n", strerror(errno)));
 		goto fail;
 	}
+	if ((st.st_ino != tdb->inode || st.st_dev != tdb->device) &&
+	    (tdb->feature_flags & TDB_FEATURE_FLAG_REHASH)) {
+		/*
+		 * tdb_rehash() replaced the file, we re-take the
+		 * locks below.
+		 */
+		int fd = tdb->fd;
+
+		tdb->fd = -1;
+		tdb->num_lockrecs = 0;
+		if (tdb_rehash_adopt(tdb, fd, &st) != 0) {
+			if (tdb->fd != fd) {
+				close(fd);
+			}
+			goto fail;
+		}
+	}
 	if (st.st_ino != tdb->inode || st.st_dev != tdb->device) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_reopen: file dev/inode has changed!\n"));
 		goto fail;
@@ -929,6 +1514,7 @@ _PUBLIC_ int tdb_reopen(struct tdb_context *tdb)
 {
 	bool active_lock;
 	active_lock = (tdb->flags & (TDB_CLEAR_IF_FIRST|TDB_MUTEX_LOCKING));
+	active_lock |= (tdb->wal.fd != -1);
 
 	return tdb_reopen_internal(tdb, active_lock);
 }
@@ -943,6 +1529,7 @@ _PUBLIC_ int tdb_reopen_all(int parent_longlived)
 
 		active_lock =
 			(tdb->flags & (TDB_CLEAR_IF_FIRST|TDB_MUTEX_LOCKING));
+		active_lock |= (tdb->wal.fd != -1);
 
 		/*
 		 * If the parent is longlived (ie. a
@@ -131,10 +131,15 @@ static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, uint32_t hash,
 
 	tdb_chainwalk_init(&chainwalk, rec_ptr);
 
+	/* chain length statistics for tdb_rehash_maybe() */
+	tdb->rehash.lookups += 1;
+
 	/* keep looking until we find the right record */
 	while (rec_ptr) {
 		bool ok;
 
+		tdb->rehash.walked += 1;
+
 		if (tdb_rec_read(tdb, rec_ptr, r) == -1)
 			return 0;
 
@@ -156,13 +161,146 @@ static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, uint32_t hash,
 	return 0;
 }
 
+#ifdef TDB_HAVE_SEQLOCK
+
+static bool tdb_seqlock_usable(struct tdb_context *tdb)
+{
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK)) {
+		return false;
+	}
+	/*
+	 * Inside a transaction we have to see our own changes, and
+	 * while our own writes are pending we'd never get a stable
+	 * view anyway.
+	 */
+	if ((tdb->transaction != NULL) || tdb->seqlock_writing) {
+		return false;
+	}
+	if ((tdb->map_ptr == NULL) || (tdb->flags & TDB_CONVERT)) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Look up a record without the chain lock. If no writer was active
+ * when we started and none started until we were done, what we copied
+ * out of the map is consistent, see tdb_seqlock_write_begin().
+ *
+ * Anything we read can be garbage when racing with a writer, so all
+ * offsets are checked against our map before we follow them, and
+ * nothing is handed out before the final check.
+ *
+ * Returns 0 with *found set if we got a stable answer, with the data
+ * copied to buf if that's not NULL. Returns -1 if the caller has to
+ * take the locked path.
+ */
+static int tdb_seqlock_find(struct tdb_context *tdb, TDB_DATA key,
+			    uint32_t hash, uint8_t *buf, tdb_len_t *buflen,
+			    bool *found)
+{
+	const uint8_t *map = (const uint8_t *)tdb->map_ptr;
+	const tdb_len_t map_size = tdb->map_size;
+	const uint32_t *pbegin = (const uint32_t *)(map + TDB_SEQLOCK_BEGIN_OFS);
+	const uint32_t *pend = (const uint32_t *)(map + TDB_SEQLOCK_END_OFS);
+	const uint32_t *prehashed = (const uint32_t *)(map + TDB_REHASHED_OFS);
+	int i;
+
+	if (TDB_DATA_START(tdb->hash_size) > map_size) {
+		return -1;
+	}
+
+	for (i=0; i<TDB_SEQLOCK_RETRIES; i++) {
+		uint32_t begin, end, now, rehashed;
+		tdb_off_t rec_ptr;
+		tdb_len_t data_len = 0;
+		uint32_t walked = 0;
+
+		__atomic_load(pend, &end, __ATOMIC_SEQ_CST);
+		__atomic_load(pbegin, &begin, __ATOMIC_SEQ_CST);
+		if (begin != end) {
+			/* Someone is writing, wait for the lock */
+			return -1;
+		}
+
+		__atomic_load(prehashed, &rehashed, __ATOMIC_SEQ_CST);
+		if ((rehashed != 0) && (rehashed != tdb->rehash.ignore)) {
+			/* tdb_lock_list() follows */
+			return -1;
+		}
+
+		*found = false;
+		memcpy(&rec_ptr, map + TDB_HASH_TOP(hash), sizeof(rec_ptr));
+
+		while (rec_ptr != 0) {
+			struct tdb_record rec;
+			tdb_len_t avail;
+
+			if ((rec_ptr < TDB_DATA_START(tdb->hash_size)) ||
+			    (rec_ptr > map_size - sizeof(rec))) {
+				break;
+			}
+			if (walked++ > map_size / sizeof(rec)) {
+				/* circular chain, tdb_find() complains */
+				return -1;
+			}
+
+			memcpy(&rec, map + rec_ptr, sizeof(rec));
+
+			avail = map_size - rec_ptr - sizeof(rec);
+
+			if (!TDB_DEAD(&rec) && (rec.full_hash == hash) &&
+			    (rec.key_len == key.dsize) &&
+			    (rec.key_len <= avail) &&
+			    (rec.data_len <= avail - rec.key_len) &&
+			    (memcmp(map + rec_ptr + sizeof(rec), key.dptr,
+				    key.dsize) == 0)) {
+				*found = true;
+				data_len = rec.data_len;
+				if (buf == NULL) {
+					break;
+				}
+				if (data_len > *buflen) {
+					/* too large for the caller */
+					return -1;
+				}
+				memcpy(buf, map + rec_ptr + sizeof(rec) +
+				       rec.key_len, data_len);
+				break;
+			}
+			rec_ptr = rec.next;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		__atomic_load(pbegin, &now, __ATOMIC_SEQ_CST);
+		if (now != begin) {
+			continue;
+		}
+
+		if ((rec_ptr != 0) && !*found) {
+			/* stable, but out of our map */
+			return -1;
+		}
+
+		tdb->rehash.lookups += 1;
+		tdb->rehash.walked += walked;
+
+		*buflen = data_len;
+		return 0;
+	}
+
+	return -1;
+}
+
+#endif /* TDB_HAVE_SEQLOCK */
+
 /* As tdb_find, but if you succeed, keep the lock */
 tdb_off_t tdb_find_lock_hash(struct tdb_context *tdb, TDB_DATA key, uint32_t hash, int locktype,
 			   struct tdb_record *rec)
 {
 	uint32_t rec_ptr;
 
-	if (tdb_lock(tdb, BUCKET(hash), locktype) == -1)
+	if (tdb_lock_hash(tdb, hash, locktype) == -1)
 		return 0;
 	if (!(rec_ptr = tdb_find(tdb, key, hash, rec)))
 		tdb_unlock(tdb, BUCKET(hash), locktype);
@@ -326,6 +464,27 @@ _PUBLIC_ int tdb_parse_record(struct tdb_context *tdb, TDB_DATA key,
 	/* find which hash bucket it is in */
 	hash = tdb->hash_fn(&key);
 
+#ifdef TDB_HAVE_SEQLOCK
+	if (tdb_seqlock_usable(tdb)) {
+		uint8_t buf[TDB_SEQLOCK_MAX_DATA];
+		tdb_len_t buflen = sizeof(buf);
+		bool found;
+
+		ret = tdb_seqlock_find(tdb, key, hash, buf, &buflen, &found);
+		if ((ret == 0) && !found) {
+			tdb_trace_1rec_ret(tdb, "tdb_parse_record", key, -1);
+			tdb->ecode = TDB_ERR_NOEXIST;
+			return -1;
+		}
+		if (ret == 0) {
+			TDB_DATA data = { .dptr = buf, .dsize = buflen };
+
+			tdb_trace_1rec_ret(tdb, "tdb_parse_record", key, 0);
+			return parser(key, data, private_data);
+		}
+	}
+#endif
+
 	if (!(rec_ptr = tdb_find_lock_hash(tdb,key,hash,F_RDLCK,&rec))) {
 		/* record not found */
 		tdb_trace_1rec_ret(tdb, "tdb_parse_record", key, -1);
@@ -352,6 +511,17 @@ static int tdb_exists_hash(struct tdb_context *tdb, TDB_DATA key, uint32_t hash)
 {
 	struct tdb_record rec;
 
+#ifdef TDB_HAVE_SEQLOCK
+	if (tdb_seqlock_usable(tdb)) {
+		tdb_len_t len;
+		bool found;
+
+		if (tdb_seqlock_find(tdb, key, hash, NULL, &len, &found) == 0) {
+			return found ? 1 : 0;
+		}
+	}
+#endif
+
 	if (tdb_find_lock_hash(tdb, key, hash, F_RDLCK, &rec) == 0)
 		return 0;
 	tdb_unlock(tdb, BUCKET(rec.full_hash), F_RDLCK);
@@ -746,12 +916,13 @@ _PUBLIC_ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int
 
 	/* find which hash bucket it is in */
 	hash = tdb->hash_fn(&key);
-	if (tdb_lock(tdb, BUCKET(hash), F_WRLCK) == -1)
+	if (tdb_lock_hash(tdb, hash, F_WRLCK) == -1)
 		return -1;
 
 	ret = _tdb_store(tdb, key, dbuf, flag, hash);
 	tdb_trace_2rec_flag_ret(tdb, "tdb_store", key, dbuf, flag, ret);
 	tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
+	tdb_rehash_maybe(tdb);
 	return ret;
 }
 
@@ -770,13 +941,14 @@ _PUBLIC_ int tdb_storev(struct tdb_context *tdb, TDB_DATA key,
 
 	/* find which hash bucket it is in */
 	hash = tdb->hash_fn(&key);
-	if (tdb_lock(tdb, BUCKET(hash), F_WRLCK) == -1)
+	if (tdb_lock_hash(tdb, hash, F_WRLCK) == -1)
 		return -1;
 
 	ret = _tdb_storev(tdb, key, dbufs, num_dbufs, flag, hash);
 	tdb_trace_1plusn_rec_flag_ret(tdb, "tdb_storev", key,
 				      dbufs, num_dbufs, flag, -1);
 	tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
+	tdb_rehash_maybe(tdb);
 	return ret;
 }
 
@@ -789,7 +961,7 @@ _PUBLIC_ int tdb_append(struct tdb_context *tdb, TDB_DATA key, TDB_DATA new_dbuf
 
 	/* find which hash bucket it is in */
 	hash = tdb->hash_fn(&key);
-	if (tdb_lock(tdb, BUCKET(hash), F_WRLCK) == -1)
+	if (tdb_lock_hash(tdb, hash, F_WRLCK) == -1)
 		return -1;
 
 	dbufs[0] = _tdb_fetch(tdb, key);
@@ -852,6 +1024,11 @@ _PUBLIC_ int tdb_get_seqnum(struct tdb_context *tdb)
 		return seqnum;
 	}
 
+	if (tdb_rehash_moved(tdb) && !tdb_have_extra_locks(tdb)) {
+		/* Don't let seqnum caches miss changes in the new file */
+		tdb_rehash_follow(tdb);
+	}
+
 #if defined(HAVE___ATOMIC_ADD_FETCH) && defined(HAVE___ATOMIC_ADD_LOAD)
 	if (tdb->map_ptr != NULL) {
 		uint32_t *pseqnum = (uint32_t *)(
@@ -1150,6 +1327,357 @@ _PUBLIC_ int tdb_repack(struct tdb_context *tdb)
 	return 0;
 }
 
+/*
+  copy all records of a tdb_rehash() into the new file
+ */
+static int tdb_rehash_copy(struct tdb_context *tdb, struct tdb_context *ntdb)
+{
+	struct traverse_state state;
+	tdb_off_t seqnum = 0;
+	tdb_off_t rehash_gen = 0;
+	int ret;
+
+	ret = tdb_lockall(ntdb);
+	if (ret != 0) {
+		return -1;
+	}
+
+	state.error = false;
+	state.dest_db = ntdb;
+
+	ret = tdb_traverse_read(tdb, repack_traverse, &state);
+	if ((ret == -1) || state.error) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__
+			 " Failed to traverse copying out\n"));
+		tdb_unlockall(ntdb);
+		return -1;
+	}
+
+	/*
+	 * Make sure seqnum watchers see a change, the generation
+	 * counts the old files that might still be in use.
+	 */
+	if ((tdb_ofs_read(tdb, TDB_SEQNUM_OFS, &seqnum) == -1) ||
+	    (tdb_ofs_read(tdb, TDB_REHASH_GEN_OFS, &rehash_gen) == -1)) {
+		tdb_unlockall(ntdb);
+		return -1;
+	}
+	seqnum += 1;
+	rehash_gen += 1;
+
+	if ((tdb_ofs_write(ntdb, TDB_SEQNUM_OFS, &seqnum) == -1) ||
+	    (tdb_ofs_write(ntdb, TDB_REHASH_GEN_OFS, &rehash_gen) == -1)) {
+		tdb_unlockall(ntdb);
+		return -1;
+	}
+
+	ret = tdb_unlockall(ntdb);
+	if (ret != 0) {
+		return -1;
+	}
+
+	if (!(tdb->flags & (TDB_NOSYNC|TDB_CLEAR_IF_FIRST))) {
+		ret = fsync(ntdb->fd);
+		if (ret == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, __location__
+				 " fsync failed: %s\n", strerror(errno)));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+  move a tdb to a bigger hash table
+ */
+_PUBLIC_ int tdb_rehash(struct tdb_context *tdb, unsigned int hash_size)
+{
+	struct tdb_context *ntdb;
+	struct stat st;
+	char *tmp_name = NULL;
+	char *gen_name = NULL;
+	tdb_off_t rehash_gen = 0;
+	tdb_off_t rehashed = 0;
+	tdb_off_t token;
+	size_t len;
+	int tdb_flags;
+	int ret;
+
+	tdb_trace(tdb, "tdb_rehash");
+
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_REHASH) ||
+	    tdb->read_only || (tdb->flags & (TDB_INTERNAL|TDB_NOLOCK))) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_rehash: "
+			 "%s can't be rehashed\n", tdb->name));
+		tdb->ecode = TDB_ERR_EINVAL;
+		return -1;
+	}
+
+	if (tdb->transaction != NULL) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_rehash: "
+			 "not allowed inside a transaction\n"));
+		tdb->ecode = TDB_ERR_NESTING;
+		return -1;
+	}
+
+	if (hash_size > TDB_REHASH_MAX_HASH_SIZE) {
+		tdb->ecode = TDB_ERR_EINVAL;
+		return -1;
+	}
+
+	/*
+	 * The transaction keeps writers out while we copy. Starting
+	 * it follows earlier tdb_rehash() calls by others.
+	 */
+	if (tdb_transaction_start(tdb) != 0) {
+		return -1;
+	}
+
+	if (hash_size <= tdb->hash_size) {
+		tdb_transaction_cancel(tdb);
+		return 0;
+	}
+
+	if (fstat(tdb->fd, &st) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		goto fail;
+	}
+
+	len = strlen(tdb->name) + 32;
+	tmp_name = (char *)malloc(len);
+	if (tmp_name == NULL) {
+		tdb->ecode = TDB_ERR_OOM;
+		goto fail;
+	}
+	snprintf(tmp_name, len, "%s.rehash.%d", tdb->name, (int)getpid());
+
+	tdb_flags = tdb->flags & (TDB_CONVERT|TDB_NOSYNC|TDB_SEQNUM|
+				  TDB_VOLATILE|TDB_INCOMPATIBLE_HASH|
+				  TDB_FAST_HASH|TDB_NOMMAP);
+	tdb_flags |= TDB_REHASH;
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_MUTEX) {
+		tdb_flags |= TDB_MUTEX_LOCKING;
+	}
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK) {
+		tdb_flags |= TDB_SEQLOCK;
+	}
+
+	ntdb = tdb_open_ex(tmp_name, hash_size, tdb_flags,
+			   O_RDWR|O_CREAT|O_EXCL, st.st_mode & 0777,
+			   &tdb->log, tdb->hash_fn);
+	if (ntdb == NULL) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_rehash: "
+			 "could not create %s: %s\n",
+			 tmp_name, strerror(errno)));
+		tdb->ecode = TDB_ERR_IO;
+		goto fail;
+	}
+
+	if (fchown(ntdb->fd, st.st_uid, st.st_gid) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_rehash: "
+			 "fchown of %s failed: %s\n",
+			 tmp_name, strerror(errno)));
+	}
+
+	ret = tdb_rehash_copy(tdb, ntdb);
+	tdb_close(ntdb);
+	if (ret == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		goto fail_unlink;
+	}
+
+	/*
+	 * From here on nobody may look at the old file: Take the
+	 * write lock on all chains and mark the file as moved.
+	 */
+	if (tdb_allrecord_upgrade_nowait(tdb) == -1) {
+		goto fail_unlink;
+	}
+
+	if (tdb->flags & TDB_CLEAR_IF_FIRST) {
+		/*
+		 * Keep the old file reachable for
+		 * tdb_rehash_generations_busy().
+		 */
+		if (tdb_ofs_read(tdb, TDB_REHASH_GEN_OFS, &rehash_gen) == -1) {
+			goto fail_unlink;
+		}
+		gen_name = tdb_rehash_gen_name(tdb->name, rehash_gen);
+		if (gen_name == NULL) {
+			tdb->ecode = TDB_ERR_OOM;
+			goto fail_unlink;
+		}
+		ret = link(tdb->name, gen_name);
+		if ((ret == -1) && (errno == EEXIST)) {
+			unlink(gen_name);
+			ret = link(tdb->name, gen_name);
+		}
+		if (ret == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_rehash: "
+				 "link to %s failed: %s\n",
+				 gen_name, strerror(errno)));
+			tdb->ecode = TDB_ERR_IO;
+			SAFE_FREE(gen_name);
+			goto fail_unlink;
+		}
+	}
+
+	if (tdb_ofs_read(tdb, TDB_REHASHED_OFS, &rehashed) == -1) {
+		goto fail_unlink;
+	}
+	token = ((tdb_off_t)getpid() << 8) ^ (tdb_off_t)time(NULL);
+	if ((token == 0) || (token == rehashed)) {
+		token = rehashed + 1;
+	}
+
+	ret = tdb_transaction_ofs_write_direct(tdb, TDB_REHASHED_OFS, token);
+	if (ret == -1) {
+		goto fail_unlink;
+	}
+
+	ret = rename(tmp_name, tdb->name);
+	if (ret == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_rehash: "
+			 "rename of %s failed: %s\n",
+			 tmp_name, strerror(errno)));
+		tdb->ecode = TDB_ERR_IO;
+		tdb_transaction_ofs_write_direct(tdb, TDB_REHASHED_OFS, 0);
+		goto fail_unlink;
+	}
+
+	SAFE_FREE(gen_name);
+	SAFE_FREE(tmp_name);
+	tdb_transaction_cancel(tdb);
+
+	return tdb_rehash_follow(tdb);
+
+fail_unlink:
+	unlink(tmp_name);
+	if (gen_name != NULL) {
+		unlink(gen_name);
+		SAFE_FREE(gen_name);
+	}
+fail:
+	SAFE_FREE(tmp_name);
+	tdb_transaction_cancel(tdb);
+	return -1;
+}
+
+/*
+  the hash size tdb_rehash_if_wanted() grows to: the next prime above
+  four times the current size
+ */
+static uint32_t tdb_rehash_next_size(uint32_t hash_size)
+{
+	uint32_t n = hash_size * 4 + 1;
+
+	if (n > TDB_REHASH_MAX_HASH_SIZE) {
+		return TDB_REHASH_MAX_HASH_SIZE;
+	}
+
+	while (true) {
+		uint32_t i;
+
+		for (i=3; i*i <= n; i+=2) {
+			if ((n % i) == 0) {
+				break;
+			}
+		}
+		if ((n % 2 != 0) && (i*i > n)) {
+			return n;
+		}
+		n += 1;
+	}
+}
+
+/*
+  note in the header that lookups walk long chains. Called after
+  chain unlocks, so it must be cheap: Growing the table copies the
+  whole database, that's left to tdb_rehash_if_wanted().
+ */
+void tdb_rehash_maybe(struct tdb_context *tdb)
+{
+	uint64_t walked = tdb->rehash.walked;
+	uint32_t lookups = tdb->rehash.lookups;
+	tdb_off_t wanted = 0;
+
+	if ((tdb->rehash.chain_length == 0) ||
+	    (lookups < tdb->rehash.window)) {
+		return;
+	}
+
+	tdb->rehash.walked = 0;
+	tdb->rehash.lookups = 0;
+
+	if (walked < (uint64_t)lookups * tdb->rehash.chain_length) {
+		return;
+	}
+
+	if (tdb->read_only || (tdb->flags & TDB_NOLOCK) ||
+	    (tdb->transaction != NULL) ||
+	    (tdb->hash_size >= TDB_REHASH_MAX_HASH_SIZE)) {
+		return;
+	}
+
+	if (tdb_ofs_read(tdb, TDB_REHASH_WANTED_OFS, &wanted) == -1) {
+		return;
+	}
+	if (wanted == tdb->hash_size) {
+		return;
+	}
+
+	wanted = tdb->hash_size;
+	tdb_ofs_write(tdb, TDB_REHASH_WANTED_OFS, &wanted);
+}
+
+_PUBLIC_ int tdb_rehash_if_wanted(struct tdb_context *tdb)
+{
+	tdb_off_t wanted = 0;
+	int ret;
+
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_REHASH) ||
+	    tdb->read_only) {
+		return 0;
+	}
+
+	if (tdb_rehash_moved(tdb) && (tdb_rehash_follow(tdb) == -1)) {
+		return -1;
+	}
+
+	if (tdb_ofs_read(tdb, TDB_REHASH_WANTED_OFS, &wanted) == -1) {
+		return -1;
+	}
+	if ((wanted == 0) || (wanted != tdb->hash_size)) {
+		/* Nobody asked, or someone else was faster */
+		return 0;
+	}
+
+	ret = tdb_rehash(tdb, tdb_rehash_next_size(tdb->hash_size));
+	if (ret == -1) {
+		/* Lock conflicts with traverses are expected */
+		TDB_LOG((tdb,
+			 (tdb->ecode == TDB_ERR_LOCK) ?
+			 TDB_DEBUG_TRACE : TDB_DEBUG_WARNING,
+			 "tdb_rehash_if_wanted: growing %s with %"PRIu32
+			 " hash chains failed: %s\n",
+			 tdb->name, tdb->hash_size, tdb_errorstr(tdb)));
+	}
+	return ret;
+}
+
+_PUBLIC_ void tdb_set_rehash_chain_length(struct tdb_context *tdb,
+					  unsigned int chain_length)
+{
+	if (!(tdb->feature_flags & TDB_FEATURE_FLAG_REHASH)) {
+		return;
+	}
+	tdb->rehash.chain_length = chain_length;
+	tdb->rehash.window = TDB_REHASH_WINDOW;
+	tdb->rehash.lookups = 0;
+	tdb->rehash.walked = 0;
+}
+
 /* Even on files, we can get partial writes due to signals. */
 bool tdb_write_all(int fd, const void *buf, size_t count)
 {
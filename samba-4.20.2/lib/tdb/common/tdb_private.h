@@ -52,6 +52,8 @@ typedef uint32_t tdb_off_t;
 #define TDB_DEAD_MAGIC (0xFEE1DEAD)
 #define TDB_RECOVERY_MAGIC (0xf53bc0e7U)
 #define TDB_RECOVERY_INVALID_MAGIC (0x0)
+#define TDB_WAL_MAGIC (0xf53bc0e8U)
+#define TDB_WAL_COMMITTED (0xf53bc0e9U)
 #define TDB_HASH_RWLOCK_MAGIC (0xbad1a51U)
 #define TDB_FEATURE_FLAG_MAGIC (0xbad1a52U)
 #define TDB_ALIGNMENT 4
@@ -66,15 +68,50 @@ typedef uint32_t tdb_off_t;
 #define TDB_DATA_START(hash_size) (TDB_HASH_TOP(hash_size-1) + sizeof(tdb_off_t))
 #define TDB_RECOVERY_HEAD offsetof(struct tdb_header, recovery_start)
 #define TDB_SEQNUM_OFS    offsetof(struct tdb_header, sequence_number)
+#define TDB_REHASH_GEN_OFS offsetof(struct tdb_header, rehash_gen)
+#define TDB_REHASHED_OFS  offsetof(struct tdb_header, rehashed)
+#define TDB_REHASH_WANTED_OFS offsetof(struct tdb_header, rehash_wanted)
+#define TDB_SEQLOCK_BEGIN_OFS offsetof(struct tdb_header, seqlock_begin)
+#define TDB_SEQLOCK_END_OFS offsetof(struct tdb_header, seqlock_end)
+#define TDB_WAL_PENDING_OFS offsetof(struct tdb_header, wal_pending)
+#define TDB_WAL_APPLIED_OFS offsetof(struct tdb_header, wal_applied)
 #define TDB_PAD_BYTE 0x42
 #define TDB_PAD_U32  0x42424242
 
 #define TDB_FEATURE_FLAG_MUTEX 0x00000001
+#define TDB_FEATURE_FLAG_FAST_HASH 0x00000002
+#define TDB_FEATURE_FLAG_REHASH 0x00000004
+#define TDB_FEATURE_FLAG_SEQLOCK 0x00000008
+#define TDB_FEATURE_FLAG_WAL 0x00000010
+
+/* the seqlock counters are only ever touched with atomics via the mmap */
+#if defined(HAVE___ATOMIC_ADD_FETCH) && defined(HAVE___ATOMIC_ADD_LOAD)
+#define TDB_HAVE_SEQLOCK 1
+#define TDB_SEQLOCK_FEATURE_FLAG TDB_FEATURE_FLAG_SEQLOCK
+#else
+#define TDB_SEQLOCK_FEATURE_FLAG 0
+#endif
 
 #define TDB_SUPPORTED_FEATURE_FLAGS ( \
 	TDB_FEATURE_FLAG_MUTEX | \
+	TDB_FEATURE_FLAG_FAST_HASH | \
+	TDB_FEATURE_FLAG_REHASH | \
+	TDB_SEQLOCK_FEATURE_FLAG | \
+	TDB_FEATURE_FLAG_WAL | \
 	0)
 
+/* average chain walk that asks for tdb_rehash(), see tdb_rehash_maybe() */
+#define TDB_REHASH_CHAIN_LENGTH 4
+#define TDB_REHASH_WINDOW 1024
+#define TDB_REHASH_MAX_HASH_SIZE (16*1024*1024)
+
+/* lockless tdb_parse_record(), see tdb_seqlock_parse() */
+#define TDB_SEQLOCK_RETRIES 8
+#define TDB_SEQLOCK_MAX_DATA 2048
+
+/* log size that makes a commit checkpoint, see tdb_wal_flush() */
+#define TDB_WAL_CHECKPOINT_SIZE (4*1024*1024)
+
 /* NB assumes there is a local variable called "tdb" that is the
  * current context, also takes doubly-parenthesized print-style
  * argument. */
@@ -182,7 +219,14 @@ struct tdb_header {
 	uint32_t magic2_hash; /* hash of TDB_MAGIC. */
 	uint32_t feature_flags;
 	tdb_len_t mutex_size; /* set if TDB_FEATURE_FLAG_MUTEX is set */
-	tdb_off_t reserved[25];
+	uint32_t rehash_gen; /* bumped by every tdb_rehash() */
+	uint32_t rehashed; /* token of the tdb_rehash() moving the records away */
+	uint32_t seqlock_begin; /* writes started, TDB_FEATURE_FLAG_SEQLOCK */
+	uint32_t seqlock_end; /* writes finished, TDB_FEATURE_FLAG_SEQLOCK */
+	tdb_off_t wal_pending; /* end of the log being committed */
+	tdb_off_t wal_applied; /* end of the log written to the file */
+	uint32_t rehash_wanted; /* hash_size found too small, see tdb_rehash_maybe() */
+	tdb_off_t reserved[18];
 };
 
 struct tdb_lock_type {
@@ -259,6 +303,18 @@ struct tdb_context {
 	struct tdb_transaction *transaction;
 	int page_size;
 	int max_dead_records;
+	struct {
+		uint32_t chain_length; /* 0: never ask for tdb_rehash() */
+		uint32_t window;
+		uint32_t lookups;
+		uint64_t walked;
+		uint32_t ignore; /* "rehashed" of an abandoned tdb_rehash() */
+	} rehash;
+	bool seqlock_writing; /* we bumped seqlock_begin but not seqlock_end */
+	struct {
+		int fd; /* "<name>.wal", -1 without TDB_FEATURE_FLAG_WAL */
+		bool applying; /* writes that are already in the log */
+	} wal;
 #ifdef TDB_TRACE
 	int tracefd;
 #endif
@@ -271,8 +327,12 @@ struct tdb_context {
 */
 int tdb_munmap(struct tdb_context *tdb);
 int tdb_mmap(struct tdb_context *tdb);
+void tdb_seqlock_write_end(struct tdb_context *tdb);
+void tdb_seqlock_repair(struct tdb_context *tdb);
 int tdb_lock(struct tdb_context *tdb, int list, int ltype);
 int tdb_lock_nonblock(struct tdb_context *tdb, int list, int ltype);
+int tdb_lock_hash(struct tdb_context *tdb, uint32_t hash, int ltype);
+int tdb_lock_hash_nonblock(struct tdb_context *tdb, uint32_t hash, int ltype);
 int tdb_nest_lock(struct tdb_context *tdb, uint32_t offset, int ltype,
 		  enum tdb_lock_flags flags);
 int tdb_nest_unlock(struct tdb_context *tdb, uint32_t offset, int ltype,
@@ -296,6 +356,7 @@ int tdb_allrecord_lock(struct tdb_context *tdb, int ltype,
 		       enum tdb_lock_flags flags, bool upgradable);
 int tdb_allrecord_unlock(struct tdb_context *tdb, int ltype, bool mark_lock);
 int tdb_allrecord_upgrade(struct tdb_context *tdb);
+int tdb_allrecord_upgrade_nowait(struct tdb_context *tdb);
 int tdb_write_lock_record(struct tdb_context *tdb, tdb_off_t off);
 int tdb_write_unlock_record(struct tdb_context *tdb, tdb_off_t off);
 int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
@@ -343,6 +404,16 @@ int tdb_rec_free_read(struct tdb_context *tdb, tdb_off_t off,
 		      struct tdb_record *rec);
 bool tdb_write_all(int fd, const void *buf, size_t count);
 int tdb_transaction_recover(struct tdb_context *tdb);
+char *tdb_wal_name(const char *name);
+int tdb_wal_replay(struct tdb_context *tdb);
+int tdb_wal_flush(struct tdb_context *tdb);
+int tdb_wal_unlogged_write(struct tdb_context *tdb);
+int tdb_transaction_ofs_write_direct(struct tdb_context *tdb,
+				     tdb_off_t offset, tdb_off_t val);
+bool tdb_rehash_moved(struct tdb_context *tdb);
+int tdb_rehash_follow(struct tdb_context *tdb);
+void tdb_rehash_maybe(struct tdb_context *tdb);
+char *tdb_rehash_gen_name(const char *name, uint32_t gen);
 void tdb_header_hash(struct tdb_context *tdb,
 		     uint32_t *magic1_hash, uint32_t *magic2_hash);
 unsigned int tdb_old_hash(TDB_DATA *key);
@@ -81,6 +81,23 @@
     usual. This allows for smooth crash recovery with no administrator
     intervention.
 
+  - databases created with TDB_WAL don't use the recovery area. The
+    commit appends the new contents of all modified blocks to the
+    write-ahead log "<name>.wal" and syncs only that, then writes the
+    blocks into the file without syncing it. wal_pending != wal_applied
+    in the header means a commit died half way, the next locker then
+    replays the log. Replay stops at a record not marked as committed:
+    tdb_transaction_prepare_commit() writes and syncs the record, only
+    tdb_transaction_commit() marks it, so a writer dying in between is
+    rolled back. The file is synced and the log truncated at a
+    checkpoint: when the log gets too large, in tdb_wal_checkpoint(),
+    before writes outside of transactions (a later replay would undo
+    them) and when the last user closes the database. The first opener
+    replays the log, the file might have lost writes in a machine
+    crash. Commits are serialized by the allrecord lock and update the
+    file in place, so there's no group commit: one sync of a sequential
+    append replaces the 4 syncs of the recovery area.
+
   - if TDB_NOSYNC is passed to flags in tdb_open then transactions are
     still available, but no fsync/msync calls are made.  This means we
     are still proof against a process dying during transaction commit,
@@ -141,6 +158,23 @@ struct tdb_transaction {
 
 	/* did we expand in this transaction */
 	bool expanded;
+
+	/* our record in the write-ahead log, wal_end == 0 if none */
+	tdb_off_t wal_start;
+	tdb_off_t wal_end;
+	bool wal_committed;
+};
+
+/*
+  a commit in the write-ahead log, followed by the blocks as
+  {offset, length, data}
+*/
+struct tdb_wal_record {
+	uint32_t magic;
+	tdb_len_t len; /* bytes of blocks */
+	tdb_off_t map_size; /* file size after the commit */
+	uint32_t checksum; /* tdb_jenkins_hash() of the blocks */
+	uint32_t committed; /* TDB_WAL_COMMITTED, set by the commit */
 };
 
 
@@ -425,6 +459,24 @@ static const struct tdb_methods transaction_methods = {
 	transaction_expand_file,
 };
 
+/*
+  write a tdb_off_t to the file itself, bypassing the transaction. Used
+  by tdb_rehash() to mark a file it is about to abandon.
+*/
+int tdb_transaction_ofs_write_direct(struct tdb_context *tdb,
+				     tdb_off_t offset, tdb_off_t val)
+{
+	const struct tdb_methods *methods;
+
+	if (tdb->transaction == NULL) {
+		tdb->ecode = TDB_ERR_EINVAL;
+		return -1;
+	}
+	methods = tdb->transaction->io_methods;
+
+	return methods->tdb_write(tdb, offset, CONVERT(val), sizeof(val));
+}
+
 /*
  * Is a transaction currently active on this context?
  *
@@ -594,6 +646,505 @@ static int transaction_sync(struct tdb_context *tdb, tdb_off_t offset, tdb_len_t
 	return 0;
 }
 
+/*
+  sync the write-ahead log
+*/
+static int tdb_wal_sync(struct tdb_context *tdb)
+{
+	if (tdb->flags & TDB_NOSYNC) {
+		return 0;
+	}
+
+#ifdef HAVE_FDATASYNC
+	if (fdatasync(tdb->wal.fd) != 0) {
+#else
+	if (fsync(tdb->wal.fd) != 0) {
+#endif
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_sync: fsync failed - %s\n",
+			 strerror(errno)));
+		return -1;
+	}
+	return 0;
+}
+
+static const struct tdb_methods *tdb_wal_methods(struct tdb_context *tdb)
+{
+	/* tdb_transaction_start() recovers before hooking the methods */
+	if (tdb->methods == &transaction_methods) {
+		return tdb->transaction->io_methods;
+	}
+	return tdb->methods;
+}
+
+static int tdb_wal_get(struct tdb_context *tdb,
+		       tdb_off_t *pending, tdb_off_t *applied)
+{
+	const struct tdb_methods *methods = tdb_wal_methods(tdb);
+	tdb_off_t ofs[2];
+
+	if (methods->tdb_read(tdb, TDB_WAL_PENDING_OFS, ofs, sizeof(ofs),
+			      DOCONV()) == -1) {
+		return -1;
+	}
+	*pending = ofs[0];
+	*applied = ofs[1];
+	return 0;
+}
+
+static int tdb_wal_set(struct tdb_context *tdb,
+		       tdb_off_t pending, tdb_off_t applied)
+{
+	const struct tdb_methods *methods = tdb_wal_methods(tdb);
+	tdb_off_t ofs[2] = { pending, applied };
+	bool applying = tdb->wal.applying;
+	int ret;
+
+	if (DOCONV()) {
+		tdb_convert(ofs, sizeof(ofs));
+	}
+
+	tdb->wal.applying = true;
+	ret = methods->tdb_write(tdb, TDB_WAL_PENDING_OFS, ofs, sizeof(ofs));
+	tdb->wal.applying = applying;
+	if (ret == -1) {
+		return -1;
+	}
+
+	if ((tdb->transaction != NULL) && (tdb->transaction->blocks != NULL)) {
+		/* the commit must not write back the old values */
+		return transaction_write_existing(tdb, TDB_WAL_PENDING_OFS,
+						  ofs, sizeof(ofs));
+	}
+	return 0;
+}
+
+static uint32_t tdb_wal_checksum(unsigned char *p, tdb_len_t len)
+{
+	TDB_DATA data = { .dptr = p, .dsize = len };
+
+	return tdb_jenkins_hash(&data);
+}
+
+/*
+  append the new contents of the modified blocks to the write-ahead
+  log and sync it. Once the record is marked committed the commit
+  can't be lost anymore.
+*/
+static int transaction_setup_wal(struct tdb_context *tdb, bool committed)
+{
+	struct tdb_wal_record *rec;
+	unsigned char *p;
+	tdb_off_t pending, applied, wal_end;
+	tdb_len_t len = 0;
+	struct stat st;
+	ssize_t written;
+	uint32_t i;
+
+	if (tdb_wal_get(tdb, &pending, &applied) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_setup_wal: "
+			 "failed to read log offsets\n"));
+		return -1;
+	}
+
+	if (fstat(tdb->wal.fd, &st) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_setup_wal: "
+			 "fstat failed - %s\n", strerror(errno)));
+		return -1;
+	}
+
+	for (i=0;i<tdb->transaction->num_blocks;i++) {
+		tdb_len_t length;
+
+		if (tdb->transaction->blocks[i] == NULL) {
+			continue;
+		}
+		length = tdb->transaction->block_size;
+		if (i == tdb->transaction->num_blocks-1) {
+			length = tdb->transaction->last_block_size;
+		}
+		if (!tdb_add_len_t(len, 2*sizeof(tdb_off_t), &len) ||
+		    !tdb_add_len_t(len, length, &len)) {
+			goto overflow;
+		}
+	}
+
+	if ((st.st_size > UINT32_MAX) ||
+	    !tdb_add_off_t(st.st_size, sizeof(*rec), &wal_end) ||
+	    !tdb_add_off_t(wal_end, len, &wal_end)) {
+		goto overflow;
+	}
+
+	/* if we die from here on, the next locker replays the log */
+	if (tdb_wal_set(tdb, wal_end, applied) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_setup_wal: "
+			 "failed to write log offsets\n"));
+		return -1;
+	}
+
+	rec = malloc(sizeof(*rec) + len);
+	if (rec == NULL) {
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+
+	p = (unsigned char *)(rec + 1);
+	for (i=0;i<tdb->transaction->num_blocks;i++) {
+		tdb_off_t offset;
+		tdb_len_t length;
+
+		if (tdb->transaction->blocks[i] == NULL) {
+			continue;
+		}
+
+		offset = i * tdb->transaction->block_size;
+		length = tdb->transaction->block_size;
+		if (i == tdb->transaction->num_blocks-1) {
+			length = tdb->transaction->last_block_size;
+		}
+
+		memcpy(p, &offset, 4);
+		memcpy(p+4, &length, 4);
+		if (DOCONV()) {
+			tdb_convert(p, 8);
+		}
+		memcpy(p+8, tdb->transaction->blocks[i], length);
+		p += 8 + length;
+	}
+
+	rec->magic = TDB_WAL_MAGIC;
+	rec->len = len;
+	rec->map_size = tdb->map_size;
+	rec->checksum = tdb_wal_checksum((unsigned char *)(rec + 1), len);
+	rec->committed = committed ? TDB_WAL_COMMITTED : 0;
+	CONVERT(*rec);
+
+	written = pwrite(tdb->wal.fd, rec, sizeof(*rec) + len, st.st_size);
+	free(rec);
+	if (written != (ssize_t)(sizeof(*rec) + len)) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_setup_wal: "
+			 "failed to write %u bytes to the log - %s\n",
+			 (unsigned)(sizeof(*rec) + len),
+			 (written == -1) ? strerror(errno) : "short write"));
+		return -1;
+	}
+
+	tdb->transaction->wal_start = st.st_size;
+	tdb->transaction->wal_end = wal_end;
+	tdb->transaction->wal_committed = committed;
+
+	return tdb_wal_sync(tdb);
+
+overflow:
+	tdb->ecode = TDB_ERR_OOM;
+	TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_setup_wal: "
+		 "overflow log size\n"));
+	return -1;
+}
+
+/*
+  mark our record in the log as committed after a separate
+  tdb_transaction_prepare_commit(). Must be on disk before we touch
+  the file.
+*/
+static int transaction_commit_wal(struct tdb_context *tdb)
+{
+	uint32_t committed = TDB_WAL_COMMITTED;
+	tdb_off_t ofs;
+	ssize_t written;
+
+	if (tdb->transaction->wal_committed) {
+		return 0;
+	}
+
+	CONVERT(committed);
+
+	ofs = tdb->transaction->wal_start +
+		offsetof(struct tdb_wal_record, committed);
+	written = pwrite(tdb->wal.fd, &committed, sizeof(committed), ofs);
+	if (written != sizeof(committed)) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_commit_wal: "
+			 "failed to mark the log record committed - %s\n",
+			 (written == -1) ? strerror(errno) : "short write"));
+		return -1;
+	}
+	if (tdb_wal_sync(tdb) == -1) {
+		return -1;
+	}
+
+	tdb->transaction->wal_committed = true;
+	return 0;
+}
+
+/*
+  take our record out of the log again, the transaction was cancelled
+  after tdb_transaction_prepare_commit()
+*/
+static int transaction_undo_wal(struct tdb_context *tdb)
+{
+	tdb_off_t pending, applied;
+
+	if (tdb_wal_get(tdb, &pending, &applied) == -1) {
+		return -1;
+	}
+
+	if (pending != tdb->transaction->wal_end) {
+		/* already replayed by tdb_transaction_recover() */
+		return 0;
+	}
+
+	if (ftruncate(tdb->wal.fd, tdb->transaction->wal_start) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "transaction_undo_wal: "
+			 "ftruncate failed - %s\n", strerror(errno)));
+		return -1;
+	}
+	if (tdb_wal_sync(tdb) == -1) {
+		return -1;
+	}
+
+	tdb->transaction->wal_end = 0;
+
+	return tdb_wal_set(tdb, applied, applied);
+}
+
+/*
+  write one logged commit into the file
+*/
+static int tdb_wal_apply(struct tdb_context *tdb,
+			 const struct tdb_methods *methods,
+			 const struct tdb_wal_record *rec,
+			 unsigned char *p)
+{
+	unsigned char *end = p + rec->len;
+
+	if (rec->map_size > tdb->map_size) {
+		/* someone else might have expanded the file already */
+		methods->tdb_oob(tdb, tdb->map_size, 1, 1);
+	}
+	if (rec->map_size > tdb->map_size) {
+		if (methods->tdb_expand_file(tdb, tdb->map_size,
+					     rec->map_size - tdb->map_size)
+		    == -1) {
+			return -1;
+		}
+		methods->tdb_oob(tdb, tdb->map_size, 1, 1);
+	}
+
+	while (p + 8 <= end) {
+		uint32_t ofs, len;
+
+		if (DOCONV()) {
+			tdb_convert(p, 8);
+		}
+		memcpy(&ofs, p, 4);
+		memcpy(&len, p+4, 4);
+
+		if (len > (size_t)(end - (p + 8))) {
+			tdb->ecode = TDB_ERR_CORRUPT;
+			return -1;
+		}
+		if (methods->tdb_write(tdb, ofs, p+8, len) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_apply: failed to "
+				 "write %u bytes at offset %u\n", len, ofs));
+			return -1;
+		}
+		p += 8 + len;
+	}
+
+	return 0;
+}
+
+/*
+  write all complete records in the log into the file, then checkpoint.
+  Must be called with exclusive database write access.
+*/
+int tdb_wal_replay(struct tdb_context *tdb)
+{
+	const struct tdb_methods *methods = tdb_wal_methods(tdb);
+	tdb_off_t pending, applied;
+	unsigned char *data = NULL;
+	size_t ofs = 0;
+	unsigned int count = 0;
+	struct stat st;
+	int ret = 0;
+
+	if (tdb_wal_get(tdb, &pending, &applied) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+
+	if (fstat(tdb->wal.fd, &st) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_replay: "
+			 "fstat failed - %s\n", strerror(errno)));
+		return -1;
+	}
+
+	if ((st.st_size == 0) && (pending == 0) && (applied == 0)) {
+		return 0;
+	}
+
+	if (tdb->read_only) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_replay: "
+			 "attempt to recover read only database\n"));
+		tdb->ecode = TDB_ERR_CORRUPT;
+		return -1;
+	}
+
+	if (st.st_size > 0) {
+		data = malloc(st.st_size);
+		if (data == NULL) {
+			tdb->ecode = TDB_ERR_OOM;
+			return -1;
+		}
+		if (pread(tdb->wal.fd, data, st.st_size, 0) != st.st_size) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_replay: "
+				 "failed to read the log\n"));
+			tdb->ecode = TDB_ERR_IO;
+			free(data);
+			return -1;
+		}
+	}
+
+	tdb->wal.applying = true;
+
+	/*
+	  a torn record at the end is a commit that never completed, an
+	  uncommitted one belongs to a writer that died after
+	  tdb_transaction_prepare_commit() and is rolled back
+	*/
+	while (ofs + sizeof(struct tdb_wal_record) <= (size_t)st.st_size) {
+		struct tdb_wal_record rec;
+		unsigned char *p = data + ofs + sizeof(rec);
+
+		memcpy(&rec, data + ofs, sizeof(rec));
+		CONVERT(rec);
+
+		if ((rec.magic != TDB_WAL_MAGIC) ||
+		    (rec.len > st.st_size - ofs - sizeof(rec)) ||
+		    (rec.checksum != tdb_wal_checksum(p, rec.len)) ||
+		    (rec.committed != TDB_WAL_COMMITTED)) {
+			break;
+		}
+
+		ret = tdb_wal_apply(tdb, methods, &rec, p);
+		if (ret == -1) {
+			break;
+		}
+
+		ofs += sizeof(rec) + rec.len;
+		count += 1;
+	}
+
+	tdb->wal.applying = false;
+	SAFE_FREE(data);
+
+	if (ret == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_replay: "
+			 "failed to replay the log\n"));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+
+	TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_wal_replay: %s: "
+		 "replayed %u transactions\n", tdb->name, count));
+
+	return tdb_wal_flush(tdb);
+}
+
+/*
+  checkpoint: sync the file, after that the log is not needed
+  anymore. Writers have to be locked out.
+*/
+int tdb_wal_flush(struct tdb_context *tdb)
+{
+	tdb_off_t pending, applied;
+	struct stat st;
+
+	if (tdb->wal.fd == -1) {
+		return 0;
+	}
+
+	if (tdb_wal_get(tdb, &pending, &applied) == -1) {
+		return -1;
+	}
+
+	if (fstat(tdb->wal.fd, &st) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_flush: "
+			 "fstat failed - %s\n", strerror(errno)));
+		return -1;
+	}
+
+	if ((st.st_size == 0) && (pending == 0) && (applied == 0)) {
+		return 0;
+	}
+
+	if (transaction_sync(tdb, 0, tdb->map_size) == -1) {
+		return -1;
+	}
+
+	if (ftruncate(tdb->wal.fd, 0) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_flush: "
+			 "ftruncate failed - %s\n", strerror(errno)));
+		return -1;
+	}
+	if (tdb_wal_sync(tdb) == -1) {
+		return -1;
+	}
+
+	return tdb_wal_set(tdb, 0, 0);
+}
+
+/*
+  Writes outside of transactions don't go through the log. A later
+  replay of older commits would overwrite them, so checkpoint first.
+*/
+int tdb_wal_unlogged_write(struct tdb_context *tdb)
+{
+	tdb_off_t applied;
+
+	if (tdb_ofs_read(tdb, TDB_WAL_APPLIED_OFS, &applied) == -1) {
+		return -1;
+	}
+	if (applied == 0) {
+		return 0;
+	}
+	return tdb_wal_flush(tdb);
+}
+
+_PUBLIC_ int tdb_wal_checkpoint(struct tdb_context *tdb)
+{
+	int ret;
+
+	if (tdb->wal.fd == -1) {
+		return 0;
+	}
+
+	if (tdb->transaction != NULL) {
+		tdb->ecode = TDB_ERR_EINVAL;
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_wal_checkpoint: "
+			 "not allowed inside a transaction\n"));
+		return -1;
+	}
+
+	/* keeps writers out, readers can continue */
+	if (tdb_allrecord_lock(tdb, F_RDLCK, TDB_LOCK_WAIT, false) == -1) {
+		return -1;
+	}
+
+	ret = tdb_wal_flush(tdb);
+
+	tdb_allrecord_unlock(tdb, F_RDLCK, false);
+
+	return ret;
+}
+
 
 static int _tdb_transaction_cancel(struct tdb_context *tdb)
 {
@@ -613,6 +1164,13 @@ static int _tdb_transaction_cancel(struct tdb_context *tdb)
 
 	tdb->map_size = tdb->transaction->old_map_size;
 
+	if (tdb->transaction->wal_end != 0) {
+		if (transaction_undo_wal(tdb) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_cancel: failed to remove log record\n"));
+			ret = -1;
+		}
+	}
+
 	/* free all the transaction blocks */
 	for (i=0;i<tdb->transaction->num_blocks;i++) {
 		if ((tdb->transaction->blocks != NULL) &&
@@ -973,7 +1531,12 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 	return 0;
 }
 
-static int _tdb_transaction_prepare_commit(struct tdb_context *tdb)
+/*
+  commit is true if we're called from tdb_transaction_commit(), there
+  is no point in marking the log record committed separately then
+*/
+static int _tdb_transaction_prepare_commit(struct tdb_context *tdb,
+					   bool commit)
 {
 	const struct tdb_methods *methods;
 
@@ -1048,8 +1611,15 @@ static int _tdb_transaction_prepare_commit(struct tdb_context *tdb)
 		return -1;
 	}
 
-	/* write the recovery data to the end of the file */
-	if (transaction_setup_recovery(tdb, &tdb->transaction->magic_offset) == -1) {
+	if (tdb->wal.fd != -1) {
+		/* log the new data, no recovery area needed */
+		if (transaction_setup_wal(tdb, commit) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_prepare_commit: failed to write the log\n"));
+			_tdb_transaction_cancel(tdb);
+			return -1;
+		}
+	} else if (transaction_setup_recovery(tdb, &tdb->transaction->magic_offset) == -1) {
+		/* write the recovery data to the end of the file */
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_prepare_commit: failed to setup recovery data\n"));
 		_tdb_transaction_cancel(tdb);
 		return -1;
@@ -1082,7 +1652,7 @@ static int _tdb_transaction_prepare_commit(struct tdb_context *tdb)
 _PUBLIC_ int tdb_transaction_prepare_commit(struct tdb_context *tdb)
 {
 	tdb_trace(tdb, "tdb_transaction_prepare_commit");
-	return _tdb_transaction_prepare_commit(tdb);
+	return _tdb_transaction_prepare_commit(tdb, false);
 }
 
 /* A repack is worthwhile if the largest is less than half total free. */
@@ -1143,13 +1713,19 @@ _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb)
 	}
 
 	if (!tdb->transaction->prepared) {
-		int ret = _tdb_transaction_prepare_commit(tdb);
+		int ret = _tdb_transaction_prepare_commit(tdb, true);
 		if (ret)
 			return ret;
 	}
 
 	methods = tdb->transaction->io_methods;
 
+	if ((tdb->transaction->wal_end != 0) &&
+	    (transaction_commit_wal(tdb) == -1)) {
+		_tdb_transaction_cancel(tdb);
+		return -1;
+	}
+
 	/* perform all the writes */
 	for (i=0;i<tdb->transaction->num_blocks;i++) {
 		tdb_off_t offset;
@@ -1190,8 +1766,21 @@ _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb)
 	SAFE_FREE(tdb->transaction->blocks);
 	tdb->transaction->num_blocks = 0;
 
-	/* ensure the new data is on disk */
-	if (transaction_sync(tdb, 0, tdb->map_size) == -1) {
+	if (tdb->transaction->wal_end != 0) {
+		tdb_off_t wal_end = tdb->transaction->wal_end;
+
+		/* the log has it, the file is synced at the checkpoint */
+		if (tdb_wal_set(tdb, wal_end, wal_end) == -1) {
+			return -1;
+		}
+		tdb->transaction->wal_end = 0;
+
+		if ((wal_end >= TDB_WAL_CHECKPOINT_SIZE) &&
+		    (tdb_wal_flush(tdb) == -1)) {
+			return -1;
+		}
+	} else if (transaction_sync(tdb, 0, tdb->map_size) == -1) {
+		/* ensure the new data is on disk */
 		return -1;
 	}
 
@@ -1256,6 +1845,25 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 	uint32_t zero = 0;
 	struct tdb_record rec;
 
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_WAL) {
+		tdb_off_t pending, applied;
+
+		if (tdb_wal_get(tdb, &pending, &applied) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to read log offsets\n"));
+			tdb->ecode = TDB_ERR_IO;
+			return -1;
+		}
+		if (pending == applied) {
+			return 0;
+		}
+		if (tdb->wal.fd == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: attempt to recover read only database\n"));
+			tdb->ecode = TDB_ERR_CORRUPT;
+			return -1;
+		}
+		return tdb_wal_replay(tdb);
+	}
+
 	/* find the recovery area */
 	if (tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &recovery_head) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to read recovery head\n"));
@@ -1368,6 +1976,15 @@ bool tdb_needs_recovery(struct tdb_context *tdb)
 	tdb_off_t recovery_head;
 	struct tdb_record rec;
 
+	if (tdb->feature_flags & TDB_FEATURE_FLAG_WAL) {
+		tdb_off_t pending, applied;
+
+		if (tdb_wal_get(tdb, &pending, &applied) == -1) {
+			return true;
+		}
+		return (pending != applied);
+	}
+
 	/* find the recovery area */
 	if (tdb_ofs_read(tdb, TDB_RECOVERY_HEAD, &recovery_head) == -1) {
 		return true;
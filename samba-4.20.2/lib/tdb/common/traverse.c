@@ -399,31 +399,19 @@ _PUBLIC_ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 	return key;
 }
 
-_PUBLIC_ int tdb_traverse_chain(struct tdb_context *tdb,
-				unsigned chain,
-				tdb_traverse_func fn,
-				void *private_data)
+/*
+ * Walk a chain the caller has read locked, the lock is released
+ */
+static int tdb_traverse_locked_chain(struct tdb_context *tdb,
+				     unsigned chain,
+				     tdb_traverse_func fn,
+				     void *private_data)
 {
 	tdb_off_t rec_ptr;
 	struct tdb_chainwalk_ctx chainwalk;
 	int count = 0;
 	int ret;
 
-	if (chain >= tdb->hash_size) {
-		tdb->ecode = TDB_ERR_EINVAL;
-		return -1;
-	}
-
-	if (tdb->traverse_read != 0) {
-		tdb->ecode = TDB_ERR_LOCK;
-		return -1;
-	}
-
-	ret = tdb_lock(tdb, chain, F_RDLCK);
-	if (ret == -1) {
-		return -1;
-	}
-
 	tdb->traverse_read += 1;
 
 	ret = tdb_ofs_read(tdb, TDB_HASH_TOP(chain), &rec_ptr);
@@ -494,17 +482,53 @@ fail:
 	return -1;
 }
 
+_PUBLIC_ int tdb_traverse_chain(struct tdb_context *tdb,
+				unsigned chain,
+				tdb_traverse_func fn,
+				void *private_data)
+{
+	int ret;
+
+	if (chain >= tdb->hash_size) {
+		tdb->ecode = TDB_ERR_EINVAL;
+		return -1;
+	}
+
+	if (tdb->traverse_read != 0) {
+		tdb->ecode = TDB_ERR_LOCK;
+		return -1;
+	}
+
+	ret = tdb_lock(tdb, chain, F_RDLCK);
+	if (ret == -1) {
+		return -1;
+	}
+
+	return tdb_traverse_locked_chain(tdb, chain, fn, private_data);
+}
+
 _PUBLIC_ int tdb_traverse_key_chain(struct tdb_context *tdb,
 				    TDB_DATA key,
 				    tdb_traverse_func fn,
 				    void *private_data)
 {
-	uint32_t hash, chain;
+	uint32_t hash;
 	int ret;
 
+	if (tdb->traverse_read != 0) {
+		tdb->ecode = TDB_ERR_LOCK;
+		return -1;
+	}
+
+	/*
+	 * Lock by hash, a tdb_rehash() might change the chain the key
+	 * lives in.
+	 */
 	hash = tdb->hash_fn(&key);
-	chain = BUCKET(hash);
-	ret = tdb_traverse_chain(tdb, chain, fn, private_data);
+	ret = tdb_lock_hash(tdb, hash, F_RDLCK);
+	if (ret == -1) {
+		return -1;
+	}
 
-	return ret;
+	return tdb_traverse_locked_chain(tdb, BUCKET(hash), fn, private_data);
 }
@@ -97,6 +97,13 @@ extern "C" {
 #define TDB_MUTEX_LOCKING 4096 /** optimized locking using robust mutexes if supported,
                                    only with tdb >= 1.3.0 and TDB_CLEAR_IF_FIRST
                                    after checking tdb_runtime_check_for_robust_mutexes() */
+#define TDB_FAST_HASH 8192 /** Create with tdb_fast_hash(): can't be opened by tdb < 1.4.11 */
+#define TDB_REHASH 16384 /** Allow tdb_rehash() and detect long chains,
+                             can't be opened by tdb < 1.4.11 */
+#define TDB_SEQLOCK 32768 /** tdb_parse_record() and tdb_exists() don't take chain locks,
+                              can't be opened by tdb < 1.4.11 */
+#define TDB_WAL 65536 /** Commit transactions to a write-ahead log "<name>.wal",
+                          can't be opened by tdb < 1.4.11 */
 
 /** The tdb error codes */
 enum TDB_ERROR {TDB_SUCCESS=0, TDB_ERR_CORRUPT, TDB_ERR_IO, TDB_ERR_LOCK, 
@@ -165,6 +172,17 @@ struct tdb_logging_context {
  *                                             can't be opened by tdb < 1.3.0.
  *                                             Only valid in combination with TDB_CLEAR_IF_FIRST
  *                                             after checking tdb_runtime_check_for_robust_mutexes()\n
+ *                         TDB_FAST_HASH - Create the database with tdb_fast_hash(),
+ *                                         can't be opened by tdb < 1.4.11.\n
+ *                         TDB_REHASH - Allow tdb_rehash() and detect long
+ *                                      chains for tdb_rehash_if_wanted(),
+ *                                      can't be opened by tdb < 1.4.11.\n
+ *                         TDB_SEQLOCK - Create the database for lockless
+ *                                       readers, can't be opened by
+ *                                       tdb < 1.4.11.\n
+ *                         TDB_WAL - Create the database with a write-ahead
+ *                                   log for transactions, can't be opened
+ *                                   by tdb < 1.4.11.\n
  *
  * @param[in]  open_flags Flags for the open(2) function.
  *
@@ -206,6 +224,17 @@ _PUBLIC_ struct tdb_context *tdb_open(const char *name, int hash_size, int tdb_f
  *                                             can't be opened by tdb < 1.3.0.
  *                                             Only valid in combination with TDB_CLEAR_IF_FIRST
  *                                             after checking tdb_runtime_check_for_robust_mutexes()\n
+ *                         TDB_FAST_HASH - Create the database with tdb_fast_hash(),
+ *                                         can't be opened by tdb < 1.4.11.\n
+ *                         TDB_REHASH - Allow tdb_rehash() and detect long
+ *                                      chains for tdb_rehash_if_wanted(),
+ *                                      can't be opened by tdb < 1.4.11.\n
+ *                         TDB_SEQLOCK - Create the database for lockless
+ *                                       readers, can't be opened by
+ *                                       tdb < 1.4.11.\n
+ *                         TDB_WAL - Create the database with a write-ahead
+ *                                   log for transactions, can't be opened
+ *                                   by tdb < 1.4.11.\n
  *
  * @param[in]  open_flags Flags for the open(2) function.
  *
@@ -233,6 +262,63 @@ _PUBLIC_ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int td
  */
 _PUBLIC_ void tdb_set_max_dead(struct tdb_context *tdb, int max_dead);
 
+/**
+ * @brief Move the database to a bigger hash table.
+ *
+ * The records are copied into a new file with the given hash size which
+ * then replaces the database file. Readers can continue during the copy,
+ * writers wait for it. Other processes switch to the new file the next
+ * time they lock a hash chain or the whole database.
+ *
+ * This is only possible if the database was created with TDB_REHASH. It
+ * fails if the caller holds any locks or is inside a transaction.
+ *
+ * @param[in]  tdb      The database to grow.
+ *
+ * @param[in]  hash_size The new hash size, nothing is done if it is not
+ *                       bigger than the current one.
+ *
+ * @return              0 on success, -1 on error with error code set.
+ *
+ * @see tdb_rehash_if_wanted()
+ */
+_PUBLIC_ int tdb_rehash(struct tdb_context *tdb, unsigned int hash_size);
+
+/**
+ * @brief Grow the hash table if lookups asked for it.
+ *
+ * For databases created with TDB_REHASH the lookups of all processes
+ * note in the database when they walk long chains, see
+ * tdb_set_rehash_chain_length(). The rehash itself copies all records
+ * and holds off all writers while doing so, this function lets a
+ * process with nothing better to do run it, e.g. from a timer.
+ *
+ * It calls tdb_rehash() with a hash size roughly four times as big if
+ * a lookup asked for it since the last rehash.
+ *
+ * @param[in]  tdb      The database to grow.
+ *
+ * @return              0 if nothing was to be done or on success, -1 on
+ *                      error with error code set.
+ */
+_PUBLIC_ int tdb_rehash_if_wanted(struct tdb_context *tdb);
+
+/**
+ * @brief Set the chain length that asks for a bigger hash table.
+ *
+ * For databases created with TDB_REHASH the lookups count how many records
+ * they have to walk. Once the average over a window of lookups reaches
+ * this length, the next store or chain unlock notes in the database
+ * that tdb_rehash_if_wanted() should grow it.
+ *
+ * @param[in]  tdb      The database to configure.
+ *
+ * @param[in]  chain_length The average chain walk that triggers a
+ *                          rehash, 0 disables it. The default is 4.
+ */
+_PUBLIC_ void tdb_set_rehash_chain_length(struct tdb_context *tdb,
+					  unsigned int chain_length);
+
 /**
  * @brief Reopen a tdb.
  *
@@ -320,6 +406,11 @@ _PUBLIC_ TDB_DATA tdb_fetch(struct tdb_context *tdb, TDB_DATA key);
  * call other tdb routines from within the parser. Also, for good performance
  * you should make the parser fast to allow parallel operations.
  *
+ * For databases created with TDB_SEQLOCK small records are copied out of
+ * the shared memory without taking a lock, the copy is retried if a
+ * writer got in the way. The parser is then called without any lock held
+ * and "data" points to the private copy.
+ *
  * @param[in]  tdb      The tdb to parse the record.
  *
  * @param[in]  key      The key to parse.
@@ -802,6 +893,10 @@ _PUBLIC_ int tdb_transaction_start_nonblock(struct tdb_context *tdb);
  * updates, so a subsequent commit should succeed (barring any hardware
  * failures).
  *
+ * For databases created with TDB_WAL this already writes and syncs the
+ * log. If the process dies before the commit, the transaction is rolled
+ * back by the next user.
+ *
  * @param[in]  tdb      The database to prepare the commit.
  *
  * @return              0 on success, -1 on error with error code set.
@@ -816,15 +911,41 @@ _PUBLIC_ int tdb_transaction_prepare_commit(struct tdb_context *tdb);
  *
  * This updates the database and releases the current transaction locks.
  *
+ * For databases created with TDB_WAL the changes are appended to the
+ * write-ahead log and only the log is synced. The database file itself
+ * is synced at the next checkpoint. After a separate
+ * tdb_transaction_prepare_commit() the commit syncs the log once more
+ * to mark the transaction as committed.
+ *
  * @param[in]  tdb      The database to commit the transaction.
  *
  * @return              0 on success, -1 on error with error code set.
  *
  * @see tdb_error()
  * @see tdb_errorstr()
+ * @see tdb_wal_checkpoint()
  */
 _PUBLIC_ int tdb_transaction_commit(struct tdb_context *tdb);
 
+/**
+ * @brief Write back the write-ahead log of a TDB_WAL database.
+ *
+ * This syncs the database file and empties the log. It only blocks
+ * writers, readers can continue. Checkpoints also happen when the log
+ * grows too large, before writes outside of transactions and when the
+ * last user closes the database, so calling this is optional. It's
+ * meant to be called when the caller is idle anyway.
+ *
+ * @param[in]  tdb      The database to checkpoint.
+ *
+ * @return              0 on success or if the database has no log,
+ *                      -1 on error with error code set.
+ *
+ * @see tdb_error()
+ * @see tdb_errorstr()
+ */
+_PUBLIC_ int tdb_wal_checkpoint(struct tdb_context *tdb);
+
 /**
  * @brief Cancel a current transaction.
  *
@@ -936,6 +1057,18 @@ _PUBLIC_ void tdb_increment_seqnum_nonblock(struct tdb_context *tdb);
  */
 _PUBLIC_ unsigned int tdb_jenkins_hash(TDB_DATA *key);
 
+/**
+ * @brief Create a hash of the key with a fast 64 bit hash.
+ *
+ * This is what TDB_FAST_HASH databases use. It runs four independent
+ * 64 bit multiply lanes over long keys and folds the result to 32 bits.
+ *
+ * @param[in]  key      The key to hash
+ *
+ * @return              The hash.
+ */
+_PUBLIC_ unsigned int tdb_fast_hash(TDB_DATA *key);
+
 /**
  * @brief Check the consistency of the database.
  *
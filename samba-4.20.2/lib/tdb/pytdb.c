@@ -809,6 +809,10 @@ PyObject* module_init(void)
 	PyModule_AddIntConstant(m, "ALLOW_NESTING", TDB_ALLOW_NESTING);
 	PyModule_AddIntConstant(m, "DISALLOW_NESTING", TDB_DISALLOW_NESTING);
 	PyModule_AddIntConstant(m, "INCOMPATIBLE_HASH", TDB_INCOMPATIBLE_HASH);
+	PyModule_AddIntConstant(m, "FAST_HASH", TDB_FAST_HASH);
+	PyModule_AddIntConstant(m, "REHASH", TDB_REHASH);
+	PyModule_AddIntConstant(m, "SEQLOCK", TDB_SEQLOCK);
+	PyModule_AddIntConstant(m, "WAL", TDB_WAL);
 
 	PyModule_AddStringConstant(m, "__docformat__", "restructuredText");
 
@@ -0,0 +1,233 @@
+#include "../common/tdb_private.h"
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "../common/mutex.c"
+#include "tap-interface.h"
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+#define NUM_RECORDS 1000
+
+static TDB_DATA mkdata(const char *str)
+{
+	TDB_DATA d;
+
+	d.dptr = discard_const_p(uint8_t, str);
+	d.dsize = strlen(str);
+	return d;
+}
+
+static TDB_DATA make_key(unsigned int i, char *buf, size_t buflen)
+{
+	TDB_DATA key;
+
+	snprintf(buf, buflen, "key-%u", i);
+	key.dptr = (unsigned char *)buf;
+	key.dsize = strlen(buf);
+	return key;
+}
+
+static bool check_records(struct tdb_context *tdb, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		char buf[32];
+		TDB_DATA key = make_key(i, buf, sizeof(buf));
+		TDB_DATA data = tdb_fetch(tdb, key);
+		bool same;
+
+		if (data.dptr == NULL) {
+			return false;
+		}
+		same = (data.dsize == sizeof(i)) &&
+			(memcmp(data.dptr, &i, sizeof(i)) == 0);
+		free(data.dptr);
+		if (!same) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool store_records(struct tdb_context *tdb, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		char buf[32];
+		TDB_DATA key = make_key(i, buf, sizeof(buf));
+		TDB_DATA data = { .dptr = (unsigned char *)&i,
+				  .dsize = sizeof(i) };
+
+		if (tdb_store(tdb, key, data, TDB_REPLACE) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int do_child(const char *name, int tdb_flags, int to, int from)
+{
+	struct tdb_context *tdb;
+	char c = 0;
+	int ret;
+
+	tdb = tdb_open_ex(name, 0, tdb_flags, O_RDWR, 0,
+			  &taplogctx, NULL);
+	if (tdb == NULL) {
+		return 1;
+	}
+	tdb_set_rehash_chain_length(tdb, 0);
+	if (tdb_hash_size(tdb) != 7) {
+		return 2;
+	}
+
+	write(to, &c, sizeof(c));
+	read(from, &c, sizeof(c));
+
+	/* The parent has rehashed, we have to follow */
+	if (!check_records(tdb, NUM_RECORDS)) {
+		return 3;
+	}
+	if (tdb_hash_size(tdb) != 1031) {
+		return 4;
+	}
+
+	ret = tdb_store(tdb, mkdata("child"),
+			mkdata("done"), TDB_INSERT);
+	if (ret != 0) {
+		return 5;
+	}
+	tdb_close(tdb);
+	return 0;
+}
+
+static void test_rehash(const char *name, int tdb_flags)
+{
+	struct tdb_context *tdb;
+	int tochild[2], fromchild[2];
+	int status;
+	pid_t child;
+	TDB_DATA data;
+	char c = 0;
+
+	tdb = tdb_open_ex(name, 7, tdb_flags,
+			  O_RDWR|O_CREAT|O_TRUNC, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	/* Only rehash when we ask for it */
+	tdb_set_rehash_chain_length(tdb, 0);
+	ok1(store_records(tdb, NUM_RECORDS));
+
+	pipe(tochild);
+	pipe(fromchild);
+
+	child = fork();
+	if (child == 0) {
+		close(tochild[1]);
+		close(fromchild[0]);
+		tdb_close(tdb);
+		exit(do_child(name, tdb_flags, fromchild[1], tochild[0]));
+	}
+	close(tochild[0]);
+	close(fromchild[1]);
+
+	read(fromchild[0], &c, sizeof(c));
+
+	/* Shrinking is a no-op */
+	ok1(tdb_rehash(tdb, 5) == 0);
+	ok1(tdb_hash_size(tdb) == 7);
+
+	ok1(tdb_rehash(tdb, 1031) == 0);
+	ok1(tdb_hash_size(tdb) == 1031);
+	ok1(check_records(tdb, NUM_RECORDS));
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+
+	write(tochild[1], &c, sizeof(c));
+
+	ok1(waitpid(child, &status, 0) == child);
+	ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	data = tdb_fetch(tdb, mkdata("child"));
+	ok1(data.dsize == 4 && memcmp(data.dptr, "done", 4) == 0);
+	free(data.dptr);
+
+	/* The temporary file is gone */
+	ok1(tdb_close(tdb) == 0);
+	close(tochild[1]);
+	close(fromchild[0]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	TDB_DATA key;
+	unsigned int i;
+
+	plan_tests(18 + 2 * 12);
+
+	/* XXH64 of the same inputs, folded to 32 bits */
+	key = mkdata("");
+	ok1(tdb_fast_hash(&key) == 0xbe9e32ae);
+	key = mkdata("a");
+	ok1(tdb_fast_hash(&key) == 0x7bc2aaaa);
+	key = mkdata("abc");
+	ok1(tdb_fast_hash(&key) == 0xe9cb256c);
+
+	/* TDB_FAST_HASH is remembered in the header */
+	tdb = tdb_open_ex("run-rehash.tdb", 0, TDB_FAST_HASH,
+			  O_RDWR|O_CREAT|O_TRUNC, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(store_records(tdb, 10));
+	tdb_close(tdb);
+
+	tdb = tdb_open_ex("run-rehash.tdb", 0, 0, O_RDWR, 0,
+			  &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->hash_fn == tdb_fast_hash);
+	ok1(check_records(tdb, 10));
+
+	/* Without TDB_REHASH there is no rehashing */
+	ok1(tdb_rehash(tdb, 1031) == -1);
+	tdb_close(tdb);
+
+	test_rehash("run-rehash.tdb", TDB_REHASH);
+	if (tdb_runtime_check_for_robust_mutexes()) {
+		test_rehash("run-rehash-mutex.tdb",
+			    TDB_REHASH|TDB_FAST_HASH|TDB_MUTEX_LOCKING|
+			    TDB_INCOMPATIBLE_HASH);
+	} else {
+		skip(12, "no robust mutex support");
+	}
+
+	/* Long chains ask for a bigger hash table */
+	tdb = tdb_open_ex("run-rehash.tdb", 1, TDB_REHASH,
+			  O_RDWR|O_CREAT|O_TRUNC, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb_rehash_if_wanted(tdb) == 0);
+	ok1(tdb_hash_size(tdb) == 1);
+	for (i = 0; i < TDB_REHASH_WINDOW; i++) {
+		store_records(tdb, 10);
+	}
+	/* The stores themselves don't copy the database */
+	ok1(tdb_hash_size(tdb) == 1);
+	ok1(tdb_rehash_if_wanted(tdb) == 0);
+	ok1(tdb_hash_size(tdb) > 1);
+	ok1(check_records(tdb, 10));
+	/* Only once */
+	ok1(tdb_rehash_if_wanted(tdb) == 0);
+	ok1(tdb_hash_size(tdb) == 5);
+	tdb_close(tdb);
+
+	return exit_status();
+}
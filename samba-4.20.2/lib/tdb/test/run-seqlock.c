@@ -0,0 +1,190 @@
+#include "../common/tdb_private.h"
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "../common/mutex.c"
+#include "tap-interface.h"
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+static TDB_DATA mkdata(const char *str)
+{
+	TDB_DATA d;
+
+	d.dptr = discard_const_p(uint8_t, str);
+	d.dsize = strlen(str);
+	return d;
+}
+
+static int parse_fn(TDB_DATA key, TDB_DATA data, void *private_data)
+{
+	TDB_DATA *expected = private_data;
+
+	if (data.dsize != expected->dsize) {
+		return -2;
+	}
+	return memcmp(data.dptr, expected->dptr, data.dsize);
+}
+
+static void seqlock_counters(struct tdb_context *tdb,
+			     uint32_t *begin, uint32_t *end)
+{
+	tdb_off_t ofs;
+
+	tdb_ofs_read(tdb, TDB_SEQLOCK_BEGIN_OFS, &ofs);
+	*begin = ofs;
+	tdb_ofs_read(tdb, TDB_SEQLOCK_END_OFS, &ofs);
+	*end = ofs;
+}
+
+static int do_child(const char *name, int tdb_flags, int to, int from)
+{
+	struct tdb_context *tdb;
+	char c = 0;
+
+	tdb = tdb_open_ex(name, 0, tdb_flags, O_RDWR, 0,
+			  &taplogctx, NULL);
+	if (tdb == NULL) {
+		return 1;
+	}
+	if (tdb_chainlock(tdb, mkdata("key")) != 0) {
+		return 2;
+	}
+
+	write(to, &c, sizeof(c));
+	read(from, &c, sizeof(c));
+
+	/* Now write while holding the chain lock */
+	if (tdb_store(tdb, mkdata("key"), mkdata("child"), TDB_REPLACE) != 0) {
+		return 3;
+	}
+
+	write(to, &c, sizeof(c));
+	read(from, &c, sizeof(c));
+
+	tdb_chainunlock(tdb, mkdata("key"));
+	tdb_close(tdb);
+	return 0;
+}
+
+static void test_seqlock(const char *name, int tdb_flags)
+{
+	struct tdb_context *tdb;
+	int tochild[2], fromchild[2];
+	int status;
+	pid_t child;
+	TDB_DATA value = mkdata("value");
+	TDB_DATA other = mkdata("child");
+	uint32_t begin, end;
+	char c = 0;
+
+	tdb = tdb_open_ex(name, 0, tdb_flags,
+			  O_RDWR|O_CREAT|O_TRUNC, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->feature_flags & TDB_FEATURE_FLAG_SEQLOCK);
+	ok1(tdb_store(tdb, mkdata("key"), value, TDB_INSERT) == 0);
+
+	seqlock_counters(tdb, &begin, &end);
+	ok1(begin != 0 && begin == end);
+
+	ok1(tdb_parse_record(tdb, mkdata("key"), parse_fn, &value) == 0);
+	ok1(tdb_parse_record(tdb, mkdata("nokey"), parse_fn, &value) == -1);
+	ok1(tdb_error(tdb) == TDB_ERR_NOEXIST);
+	ok1(tdb_exists(tdb, mkdata("key")) == 1);
+	ok1(tdb_exists(tdb, mkdata("nokey")) == 0);
+
+	/* A transaction commit must not roll back the counters */
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_store(tdb, mkdata("tkey"), value, TDB_INSERT) == 0);
+	ok1(tdb_transaction_commit(tdb) == 0);
+	seqlock_counters(tdb, &begin, &end);
+	ok1(begin == end);
+	ok1(tdb_parse_record(tdb, mkdata("tkey"), parse_fn, &value) == 0);
+
+	pipe(tochild);
+	pipe(fromchild);
+
+	child = fork();
+	if (child == 0) {
+		close(tochild[1]);
+		close(fromchild[0]);
+		tdb_close(tdb);
+		exit(do_child(name, tdb_flags, fromchild[1], tochild[0]));
+	}
+	close(tochild[0]);
+	close(fromchild[1]);
+
+	read(fromchild[0], &c, sizeof(c));
+
+	/* The child holds the chain lock, we must not block */
+	alarm(10);
+	ok1(tdb_parse_record(tdb, mkdata("key"), parse_fn, &value) == 0);
+	ok1(tdb_exists(tdb, mkdata("key")) == 1);
+	alarm(0);
+
+	write(tochild[1], &c, sizeof(c));
+	read(fromchild[0], &c, sizeof(c));
+
+	/* The child has written but not yet unlocked */
+	seqlock_counters(tdb, &begin, &end);
+	ok1(begin == end + 1);
+
+	write(tochild[1], &c, sizeof(c));
+
+	/* We wait for the lock */
+	ok1(tdb_parse_record(tdb, mkdata("key"), parse_fn, &other) == 0);
+
+	ok1(waitpid(child, &status, 0) == child);
+	ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	seqlock_counters(tdb, &begin, &end);
+	ok1(begin == end);
+
+	/* Pretend a writer died, tdb_lockall() repairs the counters */
+	*(uint32_t *)(TDB_SEQLOCK_BEGIN_OFS + (char *)tdb->map_ptr) += 1;
+	ok1(tdb_parse_record(tdb, mkdata("key"), parse_fn, &other) == 0);
+	ok1(tdb_lockall(tdb) == 0);
+	ok1(tdb_unlockall(tdb) == 0);
+	seqlock_counters(tdb, &begin, &end);
+	ok1(begin == end);
+
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+	ok1(tdb_close(tdb) == 0);
+	close(tochild[1]);
+	close(fromchild[0]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+
+	plan_tests(4 + 2 * 27);
+
+	/* TDB_NOMMAP is ignored, readers need the map */
+	tdb = tdb_open_ex("run-seqlock.tdb", 0, TDB_SEQLOCK|TDB_NOMMAP,
+			  O_RDWR|O_CREAT|O_TRUNC, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->map_ptr != NULL);
+	ok1(tdb_store(tdb, mkdata("key"), mkdata("value"), TDB_INSERT) == 0);
+	ok1(tdb_close(tdb) == 0);
+
+	test_seqlock("run-seqlock.tdb", TDB_SEQLOCK);
+	if (tdb_runtime_check_for_robust_mutexes()) {
+		test_seqlock("run-seqlock-mutex.tdb",
+			     TDB_SEQLOCK|TDB_MUTEX_LOCKING|
+			     TDB_INCOMPATIBLE_HASH|TDB_CLEAR_IF_FIRST);
+	} else {
+		skip(27, "no robust mutex support");
+	}
+
+	return exit_status();
+}
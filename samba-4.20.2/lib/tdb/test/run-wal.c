@@ -0,0 +1,208 @@
+#include "../common/tdb_private.h"
+#include "../common/io.c"
+#include "../common/tdb.c"
+#include "../common/lock.c"
+#include "../common/freelist.c"
+#include "../common/traverse.c"
+#include "../common/transaction.c"
+#include "../common/error.c"
+#include "../common/open.c"
+#include "../common/check.c"
+#include "../common/hash.c"
+#include "../common/mutex.c"
+#include "tap-interface.h"
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "logging.h"
+
+#define TEST_DB "run-wal.tdb"
+#define TEST_WAL "run-wal.tdb.wal"
+
+static TDB_DATA mkdata(const char *str)
+{
+	TDB_DATA d;
+
+	d.dptr = discard_const_p(uint8_t, str);
+	d.dsize = strlen(str);
+	return d;
+}
+
+static off_t wal_size(void)
+{
+	struct stat st;
+
+	if (stat(TEST_WAL, &st) != 0) {
+		return -1;
+	}
+	return st.st_size;
+}
+
+static void wal_header(struct tdb_context *tdb,
+		       tdb_off_t *pending, tdb_off_t *applied)
+{
+	tdb_ofs_read(tdb, TDB_WAL_PENDING_OFS, pending);
+	tdb_ofs_read(tdb, TDB_WAL_APPLIED_OFS, applied);
+}
+
+static bool exists(struct tdb_context *tdb, const char *key)
+{
+	return tdb_exists(tdb, mkdata(key)) == 1;
+}
+
+static int crash_child(bool commit)
+{
+	struct tdb_context *tdb;
+
+	tdb = tdb_open_ex(TEST_DB, 0, TDB_WAL, O_RDWR, 0,
+			  &taplogctx, NULL);
+	if (tdb == NULL) {
+		return 1;
+	}
+	if (tdb_transaction_start(tdb) != 0) {
+		return 2;
+	}
+	if (tdb_store(tdb, mkdata(commit ? "crash2" : "crash1"),
+		      mkdata("value"), TDB_INSERT) != 0) {
+		return 3;
+	}
+	if (commit) {
+		if (tdb_transaction_commit(tdb) != 0) {
+			return 4;
+		}
+	} else {
+		if (tdb_transaction_prepare_commit(tdb) != 0) {
+			return 4;
+		}
+	}
+	/* Die without closing, the log must not be checkpointed */
+	return 0;
+}
+
+static bool run_crash_child(struct tdb_context *parent, bool commit)
+{
+	pid_t child;
+	int status;
+
+	child = fork();
+	if (child == 0) {
+		if (parent != NULL) {
+			tdb_close(parent);
+		}
+		_exit(crash_child(commit));
+	}
+	if (waitpid(child, &status, 0) != child) {
+		return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tdb_context *tdb;
+	tdb_off_t pending, applied;
+	struct stat st;
+	uint8_t *copy;
+	ssize_t nread;
+	off_t size;
+	int fd;
+
+	plan_tests(45);
+
+	/* The log replaces CLEAR_IF_FIRST and the mutex/rehash machinery */
+	suppress_logging = true;
+	tdb = tdb_open_ex(TEST_DB, 0, TDB_WAL|TDB_CLEAR_IF_FIRST,
+			  O_RDWR|O_CREAT|O_TRUNC, 0600, &taplogctx, NULL);
+	suppress_logging = false;
+	ok1(tdb == NULL && errno == EINVAL);
+
+	tdb = tdb_open_ex(TEST_DB, 0, TDB_WAL,
+			  O_RDWR|O_CREAT|O_TRUNC, 0600, &taplogctx, NULL);
+	ok1(tdb);
+	ok1(tdb->feature_flags & TDB_FEATURE_FLAG_WAL);
+	ok1(tdb->wal.fd != -1);
+	ok1(wal_size() == 0);
+
+	/* A commit appends to the log and marks it applied */
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_store(tdb, mkdata("key1"), mkdata("value"), TDB_INSERT) == 0);
+	ok1(tdb_transaction_commit(tdb) == 0);
+	size = wal_size();
+	ok1(size > 0);
+	wal_header(tdb, &pending, &applied);
+	ok1(pending == applied && applied == size);
+	ok1(exists(tdb, "key1"));
+
+	/* A second commit appends behind the first */
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_store(tdb, mkdata("key2"), mkdata("value"), TDB_INSERT) == 0);
+	ok1(tdb_transaction_commit(tdb) == 0);
+	ok1(wal_size() > size);
+
+	/* Writing outside a transaction checkpoints first */
+	ok1(tdb_store(tdb, mkdata("key3"), mkdata("value"), TDB_INSERT) == 0);
+	ok1(wal_size() == 0);
+	wal_header(tdb, &pending, &applied);
+	ok1(pending == 0 && applied == 0);
+
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_store(tdb, mkdata("key4"), mkdata("value"), TDB_INSERT) == 0);
+	ok1(tdb_transaction_commit(tdb) == 0);
+	ok1(tdb_wal_checkpoint(tdb) == 0);
+	ok1(wal_size() == 0);
+
+	/* Cancelling a prepared commit takes the record back out */
+	ok1(tdb_transaction_start(tdb) == 0);
+	ok1(tdb_store(tdb, mkdata("key5"), mkdata("value"), TDB_INSERT) == 0);
+	ok1(tdb_transaction_prepare_commit(tdb) == 0);
+	wal_header(tdb, &pending, &applied);
+	ok1(pending != applied && pending == wal_size());
+	suppress_logging = true;
+	ok1(tdb_wal_checkpoint(tdb) == -1);
+	suppress_logging = false;
+	ok1(tdb_transaction_cancel(tdb) == 0);
+	wal_header(tdb, &pending, &applied);
+	ok1(pending == applied && wal_size() == 0);
+	ok1(!exists(tdb, "key5"));
+
+	/* A writer died after prepare_commit: we roll back */
+	ok1(run_crash_child(tdb, false));
+	ok1(!exists(tdb, "crash1"));
+	ok1(wal_size() == 0);
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+	ok1(tdb_close(tdb) == 0);
+
+	/*
+	 * Power loss: the log reached the disk, the main file did
+	 * not. Save the file, let a child commit, put the old
+	 * contents back and append a torn record to the log.
+	 */
+	fd = open(TEST_DB, O_RDWR);
+	fstat(fd, &st);
+	copy = malloc(st.st_size);
+	nread = pread(fd, copy, st.st_size, 0);
+
+	ok1(run_crash_child(NULL, true));
+	ok1(wal_size() > 0);
+
+	ok1(nread == st.st_size &&
+	    pwrite(fd, copy, st.st_size, 0) == st.st_size &&
+	    ftruncate(fd, st.st_size) == 0);
+	close(fd);
+	free(copy);
+
+	fd = open(TEST_WAL, O_WRONLY|O_APPEND);
+	write(fd, "torn record", 11);
+	close(fd);
+
+	tdb = tdb_open_ex(TEST_DB, 0, TDB_WAL, O_RDWR, 0,
+			  &taplogctx, NULL);
+	ok1(tdb);
+	ok1(exists(tdb, "crash2"));
+	ok1(!exists(tdb, "crash1") && exists(tdb, "key4"));
+	ok1(wal_size() == 0);
+	ok1(tdb_check(tdb, NULL, NULL) == 0);
+	ok1(tdb_close(tdb) == 0);
+
+	return exit_status();
+}
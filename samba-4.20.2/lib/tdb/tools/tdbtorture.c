@@ -22,6 +22,9 @@
 #define LOCKSTORE_PROB 5
 #define TRAVERSE_PROB 20
 #define TRAVERSE_READ_PROB 20
+#define REHASH_PROB 500
+#define REHASH_MAX_HASH_SIZE 1000
+#define CHECKPOINT_PROB 200
 #define CULL_PROB 100
 #define KEYLEN 3
 #define DATALEN 100
@@ -34,6 +37,9 @@ static int hash_size = 2;
 static unsigned loopnum;
 static int count_pipe;
 static bool mutex = false;
+static bool rehash = false;
+static bool seqlock = false;
+static bool wal = false;
 static struct tdb_logging_context log_ctx;
 
 #ifdef PRINTF_ATTRIBUTE
@@ -106,6 +112,11 @@ static bool do_transaction(void)
 	return false;
 }
 
+static int parse_fn(TDB_DATA key, TDB_DATA data, void *private_data)
+{
+	return 0;
+}
+
 static void addrec_db(void)
 {
 	int klen, dlen;
@@ -159,6 +170,29 @@ static void addrec_db(void)
 		goto next;
 	}
 
+#if REHASH_PROB
+	if (rehash && in_transaction == 0 && random() % REHASH_PROB == 0) {
+		int size = tdb_hash_size(db);
+
+		/* Traverses holding a record lock make it fail */
+		if (size < REHASH_MAX_HASH_SIZE &&
+		    tdb_rehash(db, size + 1 + (random() % 8)) != 0 &&
+		    tdb_error(db) != TDB_ERR_LOCK) {
+			fatal("tdb_rehash failed");
+		}
+		goto next;
+	}
+#endif
+
+#if CHECKPOINT_PROB
+	if (wal && in_transaction == 0 && random() % CHECKPOINT_PROB == 0) {
+		if (tdb_wal_checkpoint(db) != 0) {
+			fatal("tdb_wal_checkpoint failed");
+		}
+		goto next;
+	}
+#endif
+
 #if DELETE_PROB
 	if (random() % DELETE_PROB == 0) {
 		tdb_delete(db, key);
@@ -211,6 +245,11 @@ static void addrec_db(void)
 	}
 #endif
 
+	if (seqlock) {
+		tdb_parse_record(db, key, parse_fn, NULL);
+		goto next;
+	}
+
 	data = tdb_fetch(db, key);
 	if (data.dptr) free(data.dptr);
 
@@ -228,7 +267,7 @@ static int traverse_fn(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
 
 static void usage(void)
 {
-	printf("Usage: tdbtorture [-t] [-k] [-m] [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE]\n");
+	printf("Usage: tdbtorture [-t] [-k] [-m] [-r] [-q] [-w] [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE]\n");
 	exit(0);
 }
 
@@ -251,6 +290,16 @@ static int run_child(const char *filename, int i, int seed, unsigned num_loops,
 	if (mutex) {
 		tdb_flags |= TDB_MUTEX_LOCKING;
 	}
+	if (rehash) {
+		tdb_flags |= TDB_REHASH|TDB_FAST_HASH;
+	}
+	if (seqlock) {
+		tdb_flags |= TDB_SEQLOCK;
+	}
+	if (wal) {
+		tdb_flags &= ~TDB_CLEAR_IF_FIRST;
+		tdb_flags |= TDB_WAL;
+	}
 
 	db = tdb_open_ex(filename, hash_size, tdb_flags,
 			 O_RDWR | O_CREAT, 0600, &log_ctx, NULL);
@@ -324,7 +373,7 @@ int main(int argc, char * const *argv)
 
 	log_ctx.log_fn = tdb_log;
 
-	while ((c = getopt(argc, argv, "n:l:s:H:thkm")) != -1) {
+	while ((c = getopt(argc, argv, "n:l:s:H:thkmrqw")) != -1) {
 		switch (c) {
 		case 'n':
 			num_procs = strtol(optarg, NULL, 0);
@@ -351,11 +400,25 @@ int main(int argc, char * const *argv)
 				exit(1);
 			}
 			break;
+		case 'r':
+			rehash = true;
+			break;
+		case 'q':
+			seqlock = true;
+			break;
+		case 'w':
+			wal = true;
+			break;
 		default:
 			usage();
 		}
 	}
 
+	if (wal && (mutex || rehash)) {
+		/* not allowed together with TDB_WAL */
+		usage();
+	}
+
 	test_tdb = test_path("torture.tdb");
 
 	unlink(test_tdb);
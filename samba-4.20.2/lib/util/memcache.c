@@ -21,10 +21,17 @@
 #include <talloc.h>
 #include "../lib/util/debug.h"
 #include "../lib/util/samba_util.h"
-#include "../lib/util/dlinklist.h"
-#include "../lib/util/rbtree.h"
 #include "memcache.h"
 
+/*
+ * Elements are found via a chained hash table. Each memcache_number
+ * has its own ring of elements with a CLOCK hand for eviction: a
+ * lookup only sets the "referenced" flag, the hand gives referenced
+ * elements a second chance when it passes over them.
+ */
+
+#define MEMCACHE_MIN_BUCKETS 16
+
 static struct memcache *global_cache;
 
 struct memcache_talloc_value {
@@ -33,18 +40,29 @@ struct memcache_talloc_value {
 };
 
 struct memcache_element {
-	struct rb_node rb_node;
-	struct memcache_element *prev, *next;
-	size_t keylength, valuelength;
+	struct memcache_element *hash_next;
+	struct memcache_element *prev, *next;	/* ring of this number */
+	uint32_t hash;
 	uint8_t n;		/* This is really an enum, but save memory */
+	bool referenced;
+	size_t keylength, valuelength;
 	char data[1];		/* placeholder for offsetof */
 };
 
+struct memcache_type {
+	struct memcache_element *hand;
+	size_t size;
+	size_t max_size;
+	struct memcache_stats stats;
+};
+
 struct memcache {
-	struct memcache_element *mru;
-	struct rb_root tree;
+	struct memcache_element **buckets;
+	uint32_t num_buckets;
+	size_t num_elements;
 	size_t size;
 	size_t max_size;
+	struct memcache_type types[MEMCACHE_NUMBER_MAX];
 };
 
 static void memcache_element_parse(struct memcache_element *e,
@@ -71,16 +89,6 @@ static bool memcache_is_talloc(enum memcache_number n)
 	return result;
 }
 
-static int memcache_destructor(struct memcache *cache) {
-	struct memcache_element *e, *next;
-
-	for (e = cache->mru; e != NULL; e = next) {
-		next = e->next;
-		TALLOC_FREE(e);
-	}
-	return 0;
-}
-
 struct memcache *memcache_init(TALLOC_CTX *mem_ctx, size_t max_size)
 {
 	struct memcache *result;
@@ -89,8 +97,15 @@ struct memcache *memcache_init(TALLOC_CTX *mem_ctx, size_t max_size)
 	if (result == NULL) {
 		return NULL;
 	}
+	result->buckets = talloc_zero_array(result,
+					    struct memcache_element *,
+					    MEMCACHE_MIN_BUCKETS);
+	if (result->buckets == NULL) {
+		TALLOC_FREE(result);
+		return NULL;
+	}
+	result->num_buckets = MEMCACHE_MIN_BUCKETS;
 	result->max_size = max_size;
-	talloc_set_destructor(result, memcache_destructor);
 	return result;
 }
 
@@ -100,10 +115,46 @@ void memcache_set_global(struct memcache *cache)
 	global_cache = cache;
 }
 
-static struct memcache_element *memcache_node2elem(struct rb_node *node)
+void memcache_set_limit(struct memcache *cache, enum memcache_number n,
+			size_t max_size)
+{
+	if (cache == NULL) {
+		cache = global_cache;
+	}
+	if ((cache == NULL) || (n >= MEMCACHE_NUMBER_MAX)) {
+		return;
+	}
+	cache->types[n].max_size = max_size;
+}
+
+void memcache_get_stats(struct memcache *cache, enum memcache_number n,
+			struct memcache_stats *stats)
 {
-	return (struct memcache_element *)
-		((char *)node - offsetof(struct memcache_element, rb_node));
+	if (cache == NULL) {
+		cache = global_cache;
+	}
+	if ((cache == NULL) || (n >= MEMCACHE_NUMBER_MAX)) {
+		*stats = (struct memcache_stats) { .size = 0, };
+		return;
+	}
+	*stats = cache->types[n].stats;
+	stats->size = cache->types[n].size;
+}
+
+void memcache_reset_stats(struct memcache *cache, enum memcache_number n)
+{
+	struct memcache_stats *stats = NULL;
+
+	if (cache == NULL) {
+		cache = global_cache;
+	}
+	if ((cache == NULL) || (n >= MEMCACHE_NUMBER_MAX)) {
+		return;
+	}
+	stats = &cache->types[n].stats;
+	stats->hits = 0;
+	stats->misses = 0;
+	stats->evictions = 0;
 }
 
 static void memcache_element_parse(struct memcache_element *e,
@@ -120,37 +171,41 @@ static size_t memcache_element_size(size_t key_length, size_t value_length)
 	return sizeof(struct memcache_element) - 1 + key_length + value_length;
 }
 
-static int memcache_compare(struct memcache_element *e, enum memcache_number n,
-			    DATA_BLOB key)
+static uint32_t memcache_hash(enum memcache_number n, DATA_BLOB key)
 {
-	DATA_BLOB this_key, this_value;
+	uint32_t hash = 2166136261u ^ (uint32_t)n;	/* FNV-1a */
+	size_t i;
 
-	if ((int)e->n < (int)n) return 1;
-	if ((int)e->n > (int)n) return -1;
-
-	if (e->keylength < key.length) return 1;
-	if (e->keylength > key.length) return -1;
+	for (i=0; i<key.length; i++) {
+		hash ^= key.data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
-	memcache_element_parse(e, &this_key, &this_value);
-	return memcmp(this_key.data, key.data, key.length);
+static struct memcache_element **memcache_bucket(struct memcache *cache,
+						 uint32_t hash)
+{
+	return &cache->buckets[hash & (cache->num_buckets - 1)];
 }
 
 static struct memcache_element *memcache_find(
 	struct memcache *cache, enum memcache_number n, DATA_BLOB key)
 {
-	struct rb_node *node;
-
-	node = cache->tree.rb_node;
+	uint32_t hash = memcache_hash(n, key);
+	struct memcache_element *e;
 
-	while (node != NULL) {
-		struct memcache_element *elem = memcache_node2elem(node);
-		int cmp;
+	for (e = *memcache_bucket(cache, hash); e != NULL; e = e->hash_next) {
+		DATA_BLOB this_key, this_value;
 
-		cmp = memcache_compare(elem, n, key);
-		if (cmp == 0) {
-			return elem;
+		if ((e->hash != hash) || (e->n != n) ||
+		    (e->keylength != key.length)) {
+			continue;
+		}
+		memcache_element_parse(e, &this_key, &this_value);
+		if (memcmp(this_key.data, key.data, key.length) == 0) {
+			return e;
 		}
-		node = (cmp < 0) ? node->rb_left : node->rb_right;
 	}
 
 	return NULL;
@@ -170,12 +225,12 @@ bool memcache_lookup(struct memcache *cache, enum memcache_number n,
 
 	e = memcache_find(cache, n, key);
 	if (e == NULL) {
+		cache->types[n].stats.misses += 1;
 		return false;
 	}
 
-	if (cache->size != 0) {
-		DLIST_PROMOTE(cache->mru, e);
-	}
+	cache->types[n].stats.hits += 1;
+	e->referenced = true;
 
 	memcache_element_parse(e, &key, value);
 	return true;
@@ -200,12 +255,118 @@ void *memcache_lookup_talloc(struct memcache *cache, enum memcache_number n,
 	return mtv.ptr;
 }
 
+static void memcache_grow(struct memcache *cache)
+{
+	struct memcache_element **old_buckets = cache->buckets;
+	uint32_t i, old_num = cache->num_buckets;
+
+	if (old_num > UINT32_MAX / 2) {
+		return;
+	}
+
+	cache->buckets = talloc_zero_array(cache, struct memcache_element *,
+					   old_num * 2);
+	if (cache->buckets == NULL) {
+		/* Longer chains, but still correct */
+		cache->buckets = old_buckets;
+		return;
+	}
+	cache->num_buckets = old_num * 2;
+
+	for (i=0; i<old_num; i++) {
+		struct memcache_element *e, *next;
+
+		for (e = old_buckets[i]; e != NULL; e = next) {
+			struct memcache_element **b;
+
+			next = e->hash_next;
+			b = memcache_bucket(cache, e->hash);
+			e->hash_next = *b;
+			*b = e;
+		}
+	}
+	TALLOC_FREE(old_buckets);
+}
+
+static void memcache_link(struct memcache *cache, struct memcache_element *e)
+{
+	struct memcache_type *t = &cache->types[e->n];
+	struct memcache_element **b = memcache_bucket(cache, e->hash);
+
+	e->hash_next = *b;
+	*b = e;
+
+	/*
+	 * New elements go right behind the hand, so they are the last
+	 * ones it will look at.
+	 */
+	if (t->hand == NULL) {
+		e->prev = e->next = e;
+		t->hand = e;
+	} else {
+		e->next = t->hand;
+		e->prev = t->hand->prev;
+		e->prev->next = e;
+		e->next->prev = e;
+	}
+
+	cache->num_elements += 1;
+	t->stats.num_elements += 1;
+}
+
+static void memcache_unlink(struct memcache *cache, struct memcache_element *e)
+{
+	struct memcache_type *t = &cache->types[e->n];
+	struct memcache_element **p = memcache_bucket(cache, e->hash);
+
+	while (*p != e) {
+		p = &(*p)->hash_next;
+	}
+	*p = e->hash_next;
+
+	if (e->next == e) {
+		t->hand = NULL;
+	} else {
+		e->prev->next = e->next;
+		e->next->prev = e->prev;
+		if (t->hand == e) {
+			t->hand = e->next;
+		}
+	}
+
+	cache->num_elements -= 1;
+	t->stats.num_elements -= 1;
+}
+
+static size_t memcache_talloc_len(struct memcache_element *e)
+{
+	DATA_BLOB cache_key, cache_value;
+	struct memcache_talloc_value mtv;
+
+	memcache_element_parse(e, &cache_key, &cache_value);
+	SMB_ASSERT(cache_value.length == sizeof(mtv));
+	memcpy(&mtv, cache_value.data, sizeof(mtv));
+	return mtv.len;
+}
+
+static void memcache_account_add(struct memcache *cache,
+				 enum memcache_number n, size_t len)
+{
+	cache->size += len;
+	cache->types[n].size += len;
+}
+
+static void memcache_account_sub(struct memcache *cache,
+				 enum memcache_number n, size_t len)
+{
+	cache->size -= len;
+	cache->types[n].size -= len;
+}
+
 static void memcache_delete_element(struct memcache *cache,
 				    struct memcache_element *e)
 {
-	rb_erase(&e->rb_node, &cache->tree);
-
-	DLIST_REMOVE(cache->mru, e);
+	memcache_unlink(cache, e);
 
 	if (memcache_is_talloc(e->n)) {
 		DATA_BLOB cache_key, cache_value;
@@ -214,34 +375,96 @@ static void memcache_delete_element(struct memcache *cache,
 		memcache_element_parse(e, &cache_key, &cache_value);
 		SMB_ASSERT(cache_value.length == sizeof(mtv));
 		memcpy(&mtv, cache_value.data, sizeof(mtv));
-		cache->size -= mtv.len;
+		memcache_account_sub(cache, e->n, mtv.len);
 		TALLOC_FREE(mtv.ptr);
 	}
 
-	cache->size -= memcache_element_size(e->keylength, e->valuelength);
+	memcache_account_sub(cache, e->n,
+			     memcache_element_size(e->keylength,
+						   e->valuelength));
 
 	TALLOC_FREE(e);
 }
 
+/*
+ * Run the CLOCK hand of number n until it finds an element that was
+ * not looked at since the hand passed it the last time. "keep" is
+ * the element we are just adding, it is never evicted.
+ */
+static bool memcache_evict_one(struct memcache *cache,
+			       enum memcache_number n,
+			       struct memcache_element *keep)
+{
+	struct memcache_type *t = &cache->types[n];
+	struct memcache_element *e;
+
+	while (true) {
+		e = t->hand;
+		if (e == NULL) {
+			return false;
+		}
+		if (e == keep) {
+			if (e->next == e) {
+				return false;
+			}
+			t->hand = e->next;
+			continue;
+		}
+		if (e->referenced) {
+			e->referenced = false;
+			t->hand = e->next;
+			continue;
+		}
+		break;
+	}
+
+	memcache_delete_element(cache, e);
+	t->stats.evictions += 1;
+	return true;
+}
+
 static void memcache_trim(struct memcache *cache, struct memcache_element *e)
 {
-	struct memcache_element *tail = NULL;
+	struct memcache_type *t = &cache->types[e->n];
+
+	/*
+	 * First keep the number we just added within its own budget
+	 */
+	while ((t->max_size != 0) && (t->size > t->max_size)) {
+		if (!memcache_evict_one(cache, e->n, e)) {
+			break;
+		}
+	}
 
 	if (cache->max_size == 0) {
 		return;
 	}
 
-	for (tail = DLIST_TAIL(cache->mru);
-	     (cache->size > cache->max_size) && (tail != NULL);
-	     tail = DLIST_TAIL(cache->mru))
-	{
-		if (tail == e) {
-			tail = DLIST_PREV(tail);
-			if (tail == NULL) {
-				break;
+	/*
+	 * Then take from the number that uses most memory, so that
+	 * one busy cache does not flush out all the small ones.
+	 */
+	while (cache->size > cache->max_size) {
+		enum memcache_number victim = MEMCACHE_NUMBER_MAX;
+		size_t victim_size = 0;
+		int i;
+
+		for (i=0; i<MEMCACHE_NUMBER_MAX; i++) {
+			struct memcache_type *ti = &cache->types[i];
+
+			if ((ti->hand == NULL) ||
+			    ((ti->hand == e) && (e->next == e))) {
+				continue;
 			}
+			if (ti->size > victim_size) {
+				victim = i;
+				victim_size = ti->size;
+			}
+		}
+		if (victim == MEMCACHE_NUMBER_MAX) {
+			break;
 		}
-		memcache_delete_element(cache, tail);
+		memcache_evict_one(cache, victim, e);
 	}
 }
 
@@ -269,8 +492,6 @@ bool memcache_add(struct memcache *cache, enum memcache_number n,
 		  DATA_BLOB key, DATA_BLOB value)
 {
 	struct memcache_element *e;
-	struct rb_node **p;
-	struct rb_node *parent;
 	DATA_BLOB cache_key, cache_value;
 	size_t element_size;
 
@@ -296,21 +517,20 @@ bool memcache_add(struct memcache *cache, enum memcache_number n,
 
 				SMB_ASSERT(cache_value.length == sizeof(mtv));
 				memcpy(&mtv, cache_value.data, sizeof(mtv));
-				cache->size -= mtv.len;
+				memcache_account_sub(cache, n, mtv.len);
 				TALLOC_FREE(mtv.ptr);
 			}
 			/*
 			 * We can reuse the existing record
 			 */
 			memcpy(cache_value.data, value.data, value.length);
+			memcache_account_sub(
+				cache, n, cache_value.length - value.length);
 			e->valuelength = value.length;
 
 			if (memcache_is_talloc(e->n)) {
-				struct memcache_talloc_value mtv;
-
-				SMB_ASSERT(cache_value.length == sizeof(mtv));
-				memcpy(&mtv, cache_value.data, sizeof(mtv));
-				cache->size += mtv.len;
+				memcache_account_add(
+					cache, n, memcache_talloc_len(e));
 			}
 			return true;
 		}
@@ -328,6 +548,8 @@ bool memcache_add(struct memcache *cache, enum memcache_number n,
 	talloc_set_type(e, struct memcache_element);
 
 	e->n = n;
+	e->referenced = false;
+	e->hash = memcache_hash(n, key);
 	e->keylength = key.length;
 	e->valuelength = value.length;
 
@@ -335,32 +557,14 @@ bool memcache_add(struct memcache *cache, enum memcache_number n,
 	memcpy(cache_key.data, key.data, key.length);
 	memcpy(cache_value.data, value.data, value.length);
 
-	parent = NULL;
-	p = &cache->tree.rb_node;
-
-	while (*p) {
-		struct memcache_element *elem = memcache_node2elem(*p);
-		int cmp;
-
-		parent = (*p);
-
-		cmp = memcache_compare(elem, n, key);
-
-		p = (cmp < 0) ? &(*p)->rb_left : &(*p)->rb_right;
+	if (cache->num_elements >= cache->num_buckets) {
+		memcache_grow(cache);
 	}
+	memcache_link(cache, e);
 
-	rb_link_node(&e->rb_node, parent, p);
-	rb_insert_color(&e->rb_node, &cache->tree);
-
-	DLIST_ADD(cache->mru, e);
-
-	cache->size += element_size;
+	memcache_account_add(cache, n, element_size);
 	if (memcache_is_talloc(e->n)) {
-		struct memcache_talloc_value mtv;
-
-		SMB_ASSERT(cache_value.length == sizeof(mtv));
-		memcpy(&mtv, cache_value.data, sizeof(mtv));
-		cache->size += mtv.len;
+		memcache_account_add(cache, n, memcache_talloc_len(e));
 	}
 	memcache_trim(cache, e);
 
@@ -388,7 +592,7 @@ bool memcache_add_talloc(struct memcache *cache, enum memcache_number n,
 
 void memcache_flush(struct memcache *cache, enum memcache_number n)
 {
-	struct rb_node *node;
+	struct memcache_type *t;
 
 	if (cache == NULL) {
 		cache = global_cache;
@@ -397,67 +601,10 @@ void memcache_flush(struct memcache *cache, enum memcache_number n)
 		return;
 	}
 
-	/*
-	 * Find the smallest element of number n
-	 */
-
-	node = cache->tree.rb_node;
-	if (node == NULL) {
-		return;
-	}
-
-	/*
-	 * First, find *any* element of number n
-	 */
-
-	while (true) {
-		struct memcache_element *elem = memcache_node2elem(node);
-		struct rb_node *next;
-
-		if ((int)elem->n == (int)n) {
-			break;
-		}
-
-		if ((int)elem->n < (int)n) {
-			next = node->rb_right;
-		}
-		else {
-			next = node->rb_left;
-		}
-		if (next == NULL) {
-			break;
-		}
-		node = next;
-	}
-
-	/*
-	 * Then, find the leftmost element with number n
-	 */
+	t = &cache->types[n];
 
-	while (true) {
-		struct rb_node *prev = rb_prev(node);
-		struct memcache_element *elem;
-
-		if (prev == NULL) {
-			break;
-		}
-		elem = memcache_node2elem(prev);
-		if ((int)elem->n != (int)n) {
-			break;
-		}
-		node = prev;
-	}
-
-	while (node != NULL) {
-		struct memcache_element *e = memcache_node2elem(node);
-		struct rb_node *next = rb_next(node);
-
-		if (e->n != n) {
-			break;
-		}
-
-		memcache_delete_element(cache, e);
-		node = next;
+	while (t->hand != NULL) {
+		memcache_delete_element(cache, t->hand);
 	}
 }
 
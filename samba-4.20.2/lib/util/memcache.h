@@ -47,6 +47,19 @@ enum memcache_number {
 	SHARE_MODE_LOCK_CACHE,	/* talloc */
 	VIRUSFILTER_SCAN_RESULTS_CACHE_TALLOC, /* talloc */
 	DFREE_CACHE,
+	MEMCACHE_NUMBER_MAX,	/* keep last */
+};
+
+/*
+ * Per-number counters, see memcache_get_stats()
+ */
+
+struct memcache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t num_elements;
+	size_t size;		/* bytes, including talloc'ed values */
 };
 
 /*
@@ -64,6 +77,24 @@ struct memcache *memcache_init(TALLOC_CTX *mem_ctx, size_t max_size);
 
 void memcache_set_global(struct memcache *cache);
 
+/*
+ * Give one cache subset its own budget in bytes. Adding to a subset
+ * over its budget evicts from that subset only, so it can't push out
+ * the others. 0, the default, means only the overall max_size applies.
+ */
+
+void memcache_set_limit(struct memcache *cache, enum memcache_number n,
+			size_t max_size);
+
+/*
+ * Fetch the hit/miss/eviction counters and the current usage of a cache
+ * subset. memcache_reset_stats() sets the counters back to 0.
+ */
+
+void memcache_get_stats(struct memcache *cache, enum memcache_number n,
+			struct memcache_stats *stats);
+void memcache_reset_stats(struct memcache *cache, enum memcache_number n);
+
 /*
  * Add a data blob to the cache
  */
@@ -139,6 +139,163 @@ static void torture_memcache_add_oversize(void **state)
 	TALLOC_FREE(cache);
 }
 
+static void torture_memcache_second_chance(void **state)
+{
+	TALLOC_CTX *mem_ctx = *state;
+	struct memcache *cache = NULL;
+	struct memcache_stats stats;
+	DATA_BLOB k1, k2, k3, k4, v;
+	uint8_t buf[16] = { 0, };
+	bool ok;
+
+	k1 = data_blob_const("key1", 4);
+	k2 = data_blob_const("key2", 4);
+	k3 = data_blob_const("key3", 4);
+	k4 = data_blob_const("key4", 4);
+	v = data_blob_const(buf, sizeof(buf));
+
+	/* Find out how much one element takes */
+	cache = memcache_init(mem_ctx, 0);
+	assert_non_null(cache);
+	memcache_add(cache, STAT_CACHE, k1, v);
+	memcache_get_stats(cache, STAT_CACHE, &stats);
+	TALLOC_FREE(cache);
+
+	cache = memcache_init(mem_ctx, 3 * stats.size);
+	assert_non_null(cache);
+
+	memcache_add(cache, STAT_CACHE, k1, v);
+	memcache_add(cache, STAT_CACHE, k2, v);
+	memcache_add(cache, STAT_CACHE, k3, v);
+
+	/* k1 is the oldest, but it is in use */
+	ok = memcache_lookup(cache, STAT_CACHE, k1, &v);
+	assert_true(ok);
+
+	memcache_add(cache, STAT_CACHE, k4, v);
+
+	ok = memcache_lookup(cache, STAT_CACHE, k2, &v);
+	assert_false(ok);
+	ok = memcache_lookup(cache, STAT_CACHE, k1, &v);
+	assert_true(ok);
+	ok = memcache_lookup(cache, STAT_CACHE, k3, &v);
+	assert_true(ok);
+	ok = memcache_lookup(cache, STAT_CACHE, k4, &v);
+	assert_true(ok);
+
+	memcache_get_stats(cache, STAT_CACHE, &stats);
+	assert_int_equal(stats.hits, 4);
+	assert_int_equal(stats.misses, 1);
+	assert_int_equal(stats.evictions, 1);
+	assert_int_equal(stats.num_elements, 3);
+
+	memcache_reset_stats(cache, STAT_CACHE);
+	memcache_get_stats(cache, STAT_CACHE, &stats);
+	assert_int_equal(stats.hits, 0);
+	assert_int_equal(stats.misses, 0);
+	assert_int_equal(stats.evictions, 0);
+	assert_int_equal(stats.num_elements, 3);
+
+	TALLOC_FREE(cache);
+}
+
+static void torture_memcache_limit(void **state)
+{
+	TALLOC_CTX *mem_ctx = *state;
+	struct memcache *cache = NULL;
+	struct memcache_stats stats;
+	DATA_BLOB key, value;
+	char *pw = NULL;
+	uint32_t i;
+
+	cache = memcache_init(mem_ctx, 4096);
+	assert_non_null(cache);
+	memcache_set_limit(cache, STAT_CACHE, 1024);
+
+	pw = talloc_strdup(mem_ctx, "pwentry");
+	assert_non_null(pw);
+	memcache_add_talloc(cache, GETPWNAM_CACHE,
+			    data_blob_string_const("user"), &pw);
+	assert_null(pw);
+
+	/* A directory scan worth of entries */
+	for (i=0; i<1000; i++) {
+		key = data_blob_const(&i, sizeof(i));
+		memcache_add(cache, STAT_CACHE, key, key);
+	}
+
+	memcache_get_stats(cache, STAT_CACHE, &stats);
+	assert_true(stats.size <= 1024);
+	assert_true(stats.evictions > 0);
+
+	pw = memcache_lookup_talloc(cache, GETPWNAM_CACHE,
+				    data_blob_string_const("user"));
+	assert_non_null(pw);
+	assert_string_equal(pw, "pwentry");
+
+	memcache_get_stats(cache, GETPWNAM_CACHE, &stats);
+	assert_int_equal(stats.evictions, 0);
+
+	/* Without a limit the biggest subset pays for the overall max_size */
+	memcache_set_limit(cache, STAT_CACHE, 0);
+	for (i=0; i<1000; i++) {
+		key = data_blob_const(&i, sizeof(i));
+		memcache_add(cache, STAT_CACHE, key, key);
+	}
+	memcache_get_stats(cache, STAT_CACHE, &stats);
+	assert_true(stats.size > 1024);
+
+	pw = memcache_lookup_talloc(cache, GETPWNAM_CACHE,
+				    data_blob_string_const("user"));
+	assert_non_null(pw);
+
+	memcache_flush(cache, STAT_CACHE);
+	memcache_get_stats(cache, STAT_CACHE, &stats);
+	assert_int_equal(stats.num_elements, 0);
+	assert_int_equal(stats.size, 0);
+
+	i = 0;
+	key = data_blob_const(&i, sizeof(i));
+	assert_false(memcache_lookup(cache, STAT_CACHE, key, &value));
+
+	TALLOC_FREE(cache);
+}
+
+static void torture_memcache_many(void **state)
+{
+	TALLOC_CTX *mem_ctx = *state;
+	struct memcache *cache = NULL;
+	DATA_BLOB key, value;
+	uint32_t i;
+	bool ok;
+
+	cache = memcache_init(mem_ctx, 0);
+	assert_non_null(cache);
+
+	for (i=0; i<100000; i++) {
+		key = data_blob_const(&i, sizeof(i));
+		ok = memcache_add(cache, MANGLE_HASH2_CACHE, key, key);
+		assert_true(ok);
+	}
+	for (i=0; i<100000; i += 2) {
+		key = data_blob_const(&i, sizeof(i));
+		memcache_delete(cache, MANGLE_HASH2_CACHE, key);
+	}
+	for (i=0; i<100000; i++) {
+		key = data_blob_const(&i, sizeof(i));
+		ok = memcache_lookup(cache, MANGLE_HASH2_CACHE, key, &value);
+		assert_int_equal(ok, (i % 2) == 1);
+		if (ok) {
+			assert_memory_equal(value.data, &i, sizeof(i));
+		}
+		/* Same key, other subset */
+		ok = memcache_lookup(cache, STAT_CACHE, key, &value);
+		assert_false(ok);
+	}
+
+	TALLOC_FREE(cache);
+}
+
 int main(int argc, char *argv[])
 {
 	int rc;
@@ -146,6 +303,9 @@ int main(int argc, char *argv[])
 		cmocka_unit_test(torture_memcache_init),
 		cmocka_unit_test(torture_memcache_add_lookup_delete),
 		cmocka_unit_test(torture_memcache_add_oversize),
+		cmocka_unit_test(torture_memcache_second_chance),
+		cmocka_unit_test(torture_memcache_limit),
+		cmocka_unit_test(torture_memcache_many),
 	};
 
 	if (argc == 2) {
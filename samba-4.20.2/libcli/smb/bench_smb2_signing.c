@@ -0,0 +1,200 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   Microbenchmark for SMB2 signing, compares the gnutls code
+   path with the AES-NI/PCLMULQDQ engine.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "lib/util/time.h"
+#include "libcli/smb/smb_common.h"
+#include "libcli/smb/smb2_signing_accel.h"
+
+static const uint8_t bench_master_key[16] = {
+	0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+	0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10,
+};
+
+static bool bench_sign(TALLOC_CTX *mem_ctx,
+		       uint16_t sign_algo_id,
+		       bool accel,
+		       size_t body_len,
+		       unsigned iterations,
+		       uint8_t signature[16],
+		       double *_nsecs)
+{
+	DATA_BLOB master_key = data_blob_const(bench_master_key,
+					       sizeof(bench_master_key));
+	struct smb2_signing_key *key = NULL;
+	uint8_t hdr[SMB2_HDR_BODY] = { 0, };
+	uint8_t *body = NULL;
+	struct iovec vector[2];
+	struct timespec start, end;
+	unsigned i;
+	NTSTATUS status;
+
+	smb2_signing_accel_set_enabled(accel);
+
+	status = smb2_signing_key_sign_create(mem_ctx,
+					      sign_algo_id,
+					      &master_key,
+					      NULL,
+					      &key);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "smb2_signing_key_sign_create: %s\n",
+			nt_errstr(status));
+		return false;
+	}
+
+	body = talloc_zero_array(mem_ctx, uint8_t, body_len);
+	if (body == NULL) {
+		TALLOC_FREE(key);
+		return false;
+	}
+	for (i = 0; i < body_len; i++) {
+		body[i] = i;
+	}
+
+	SIVAL(hdr, SMB2_HDR_PROTOCOL_ID, SMB2_MAGIC);
+	SSVAL(hdr, SMB2_HDR_LENGTH, SMB2_HDR_BODY);
+	SSVAL(hdr, SMB2_HDR_OPCODE, SMB2_OP_READ);
+	SIVAL(hdr, SMB2_HDR_FLAGS, SMB2_HDR_FLAG_REDIRECT);
+	SBVAL(hdr, SMB2_HDR_SESSION_ID, 1);
+
+	vector[0] = (struct iovec) {
+		.iov_base = hdr,
+		.iov_len = sizeof(hdr),
+	};
+	vector[1] = (struct iovec) {
+		.iov_base = body,
+		.iov_len = body_len,
+	};
+
+	clock_gettime_mono(&start);
+	for (i = 0; i < iterations; i++) {
+		SBVAL(hdr, SMB2_HDR_MESSAGE_ID, i + 1);
+
+		status = smb2_signing_sign_pdu(key, vector, 2);
+		if (!NT_STATUS_IS_OK(status)) {
+			fprintf(stderr, "smb2_signing_sign_pdu: %s\n",
+				nt_errstr(status));
+			TALLOC_FREE(body);
+			TALLOC_FREE(key);
+			return false;
+		}
+	}
+	clock_gettime_mono(&end);
+
+	memcpy(signature, hdr + SMB2_HDR_SIGNATURE, 16);
+	*_nsecs = (double)nsec_time_diff(&end, &start) / iterations;
+
+	TALLOC_FREE(body);
+	TALLOC_FREE(key);
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	TALLOC_CTX *frame = talloc_stackframe();
+	static const struct {
+		uint16_t sign_algo_id;
+		const char *name;
+	} algos[] = {
+		{ SMB2_SIGNING_AES128_CMAC, "AES-128-CMAC" },
+		{ SMB2_SIGNING_AES128_GMAC, "AES-128-GMAC" },
+	};
+	static const size_t body_lens[] = {
+		24, 128, 1024, 4096, 65536, 1048576,
+	};
+	unsigned iterations = 100000;
+	bool have_accel = smb2_signing_accel_available();
+	size_t a, s;
+	int ret = 0;
+
+	if (argc == 2) {
+		iterations = atoi(argv[1]);
+	}
+	if (iterations == 0) {
+		fprintf(stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+		TALLOC_FREE(frame);
+		return 1;
+	}
+
+	if (!have_accel) {
+		printf("AES-NI/PCLMULQDQ engine not available, "
+		       "only measuring gnutls\n");
+	}
+
+	printf("%-14s %10s %14s %14s %8s\n",
+	       "algorithm", "body", "gnutls ns/op", "accel ns/op",
+	       "speedup");
+
+	for (a = 0; a < ARRAY_SIZE(algos); a++) {
+		for (s = 0; s < ARRAY_SIZE(body_lens); s++) {
+			size_t body_len = body_lens[s];
+			unsigned n = iterations;
+			uint8_t sig_gnutls[16];
+			uint8_t sig_accel[16];
+			double ns_gnutls = 0;
+			double ns_accel = 0;
+			bool ok;
+
+			/* keep the amount of data per run reasonable */
+			if (body_len > 4096) {
+				n = MAX(1, iterations / (body_len / 4096));
+			}
+
+			ok = bench_sign(frame, algos[a].sign_algo_id, false,
+					body_len, n, sig_gnutls, &ns_gnutls);
+			if (!ok) {
+				ret = 1;
+				goto done;
+			}
+
+			if (!have_accel) {
+				printf("%-14s %10zu %14.1f %14s %8s\n",
+				       algos[a].name, body_len, ns_gnutls,
+				       "-", "-");
+				continue;
+			}
+
+			ok = bench_sign(frame, algos[a].sign_algo_id, true,
+					body_len, n, sig_accel, &ns_accel);
+			if (!ok) {
+				ret = 1;
+				goto done;
+			}
+
+			if (memcmp(sig_gnutls, sig_accel, 16) != 0) {
+				fprintf(stderr, "%s: signature mismatch for "
+					"body length %zu\n",
+					algos[a].name, body_len);
+				ret = 1;
+				goto done;
+			}
+
+			printf("%-14s %10zu %14.1f %14.1f %7.2fx\n",
+			       algos[a].name, body_len, ns_gnutls, ns_accel,
+			       ns_gnutls / ns_accel);
+		}
+	}
+
+done:
+	smb2_signing_accel_set_enabled(true);
+	TALLOC_FREE(frame);
+	return ret;
+}
@@ -0,0 +1,732 @@
+/*
+   Unix SMB/CIFS implementation.
+   SMB2 compression transform
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+#include "system/filesys.h"
+#include "libcli/smb/smb_common.h"
+#include "libcli/smb/smb2_compression.h"
+#include "lib/util/iov_buf.h"
+#include "lib/compression/lzxpress.h"
+#include "lib/compression/lzxpress_huffman.h"
+
+/*
+ * Runs of the same byte shorter than this are not worth a
+ * SMB2_COMPRESSION_PATTERN_V1 payload.
+ */
+#define SMB2_COMPRESSION_PATTERN_MIN 64
+
+/*
+ * The sample smb2_compression_worthwhile() looks at.
+ */
+#define SMB2_COMPRESSION_SAMPLE_SLICES 64
+#define SMB2_COMPRESSION_SAMPLE_SLICE_SIZE 64
+
+/*
+ * Data with more than 7.5 bits of entropy per byte (in 1/16ths of a
+ * bit) is very unlikely to get any smaller.
+ */
+#define SMB2_COMPRESSION_MAX_ENTROPY_Q4 120
+
+struct smb2_compression_ctx {
+	uint16_t algo;
+	bool chained;
+	bool pattern;
+	struct lzxhuff_compress_stream *huffman;
+};
+
+bool smb2_compression_algo_supported(uint16_t algo)
+{
+	switch (algo) {
+	case SMB2_COMPRESSION_LZ77:
+	case SMB2_COMPRESSION_LZ77_HUFFMAN:
+	case SMB2_COMPRESSION_PATTERN_V1:
+		return true;
+	}
+	return false;
+}
+
+static bool smb2_compression_algo_allowed(const uint16_t *algos,
+					  size_t num_algos,
+					  uint16_t algo)
+{
+	size_t i;
+
+	for (i = 0; i < num_algos; i++) {
+		if (algos[i] == algo) {
+			return true;
+		}
+	}
+	return false;
+}
+
+struct smb2_compression_ctx *smb2_compression_ctx_create(
+	TALLOC_CTX *mem_ctx,
+	const uint16_t *algos,
+	size_t num_algos,
+	bool chained,
+	unsigned threads)
+{
+	struct smb2_compression_ctx *ctx = NULL;
+	size_t i;
+
+	ctx = talloc_zero(mem_ctx, struct smb2_compression_ctx);
+	if (ctx == NULL) {
+		return NULL;
+	}
+	ctx->algo = SMB2_COMPRESSION_NONE;
+	ctx->chained = chained;
+
+	for (i = 0; i < num_algos; i++) {
+		switch (algos[i]) {
+		case SMB2_COMPRESSION_LZ77:
+		case SMB2_COMPRESSION_LZ77_HUFFMAN:
+			if (ctx->algo == SMB2_COMPRESSION_NONE) {
+				ctx->algo = algos[i];
+			}
+			break;
+		case SMB2_COMPRESSION_PATTERN_V1:
+			ctx->pattern = chained;
+			break;
+		}
+	}
+
+	if (ctx->algo == SMB2_COMPRESSION_NONE && !ctx->pattern) {
+		TALLOC_FREE(ctx);
+		return NULL;
+	}
+
+	if (ctx->algo == SMB2_COMPRESSION_LZ77_HUFFMAN) {
+		ctx->huffman = lzxpress_huffman_compress_stream_init(ctx,
+								     0,
+								     threads);
+		if (ctx->huffman == NULL) {
+			TALLOC_FREE(ctx);
+			return NULL;
+		}
+	}
+
+	return ctx;
+}
+
+/*
+ * log2(x) in 1/16ths, with the fraction interpolated linearly.
+ */
+static uint32_t log2_q4(uint32_t x)
+{
+	uint32_t n = 0;
+	uint32_t frac;
+
+	while ((x >> n) > 1) {
+		n++;
+	}
+	if (n >= 4) {
+		frac = (x >> (n - 4)) & 15;
+	} else {
+		frac = (x << (4 - n)) & 15;
+	}
+	return n * 16 + frac;
+}
+
+bool smb2_compression_worthwhile(const uint8_t *data, size_t len)
+{
+	uint32_t counts[256] = { 0, };
+	size_t sample_len = SMB2_COMPRESSION_SAMPLE_SLICES *
+		SMB2_COMPRESSION_SAMPLE_SLICE_SIZE;
+	uint64_t bits_q4;
+	uint32_t n;
+	size_t i;
+
+	if (len == 0) {
+		return false;
+	}
+
+	if (len <= sample_len) {
+		for (i = 0; i < len; i++) {
+			counts[data[i]]++;
+		}
+		n = len;
+	} else {
+		size_t stride = (len - SMB2_COMPRESSION_SAMPLE_SLICE_SIZE) /
+			(SMB2_COMPRESSION_SAMPLE_SLICES - 1);
+		size_t s;
+
+		for (s = 0; s < SMB2_COMPRESSION_SAMPLE_SLICES; s++) {
+			const uint8_t *p = data + s * stride;
+
+			for (i = 0; i < SMB2_COMPRESSION_SAMPLE_SLICE_SIZE; i++) {
+				counts[p[i]]++;
+			}
+		}
+		n = sample_len;
+	}
+
+	/*
+	 * The Shannon entropy of the sample is
+	 * log2(n) - sum(c * log2(c)) / n bits per byte.
+	 */
+	bits_q4 = (uint64_t)n * log2_q4(n);
+	for (i = 0; i < ARRAY_SIZE(counts); i++) {
+		if (counts[i] != 0) {
+			bits_q4 -= (uint64_t)counts[i] * log2_q4(counts[i]);
+		}
+	}
+
+	return bits_q4 < (uint64_t)n * SMB2_COMPRESSION_MAX_ENTROPY_Q4;
+}
+
+static ssize_t smb2_compression_compress_algo(struct smb2_compression_ctx *ctx,
+					      const uint8_t *data,
+					      size_t data_len,
+					      uint8_t *out,
+					      size_t out_len)
+{
+	if (data_len > UINT32_MAX || out_len > UINT32_MAX) {
+		return -1;
+	}
+
+	switch (ctx->algo) {
+	case SMB2_COMPRESSION_LZ77:
+		return lzxpress_compress(data, data_len, out, out_len);
+	case SMB2_COMPRESSION_LZ77_HUFFMAN:
+		return lzxpress_huffman_compress_stream(ctx->huffman,
+							data,
+							data_len,
+							true,
+							out,
+							out_len);
+	}
+
+	return -1;
+}
+
+static ssize_t smb2_compression_decompress_algo(uint16_t algo,
+						const uint8_t *in,
+						size_t in_len,
+						uint8_t *out,
+						size_t out_len)
+{
+	if (out_len == 0) {
+		return (in_len == 0) ? 0 : -1;
+	}
+	if (in_len > UINT32_MAX || out_len > UINT32_MAX) {
+		return -1;
+	}
+
+	switch (algo) {
+	case SMB2_COMPRESSION_LZ77:
+		return lzxpress_decompress(in, in_len, out, out_len);
+	case SMB2_COMPRESSION_LZ77_HUFFMAN:
+		return lzxpress_huffman_decompress(in, in_len, out, out_len);
+	}
+
+	return -1;
+}
+
+static size_t smb2_compression_run_length(const uint8_t *data,
+					  size_t len,
+					  bool backwards)
+{
+	size_t i;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	if (backwards) {
+		uint8_t c = data[len - 1];
+
+		for (i = 1; i < len; i++) {
+			if (data[len - 1 - i] != c) {
+				break;
+			}
+		}
+	} else {
+		uint8_t c = data[0];
+
+		for (i = 1; i < len; i++) {
+			if (data[i] != c) {
+				break;
+			}
+		}
+	}
+
+	if (i < SMB2_COMPRESSION_PATTERN_MIN) {
+		return 0;
+	}
+	return i;
+}
+
+/*
+ * Appends a chained payload header, returns false if it doesn't fit.
+ */
+static bool smb2_compression_push_payload_hdr(uint8_t *buf,
+					      size_t buflen,
+					      size_t *ofs,
+					      uint16_t algo,
+					      size_t length)
+{
+	/*
+	 * Only the first payload header has the chained flag, it is
+	 * what tells the receiver this is not an unchained message.
+	 */
+	uint16_t flags = (*ofs == SMB2_COMP_CHAINED_HDR_SIZE) ?
+		SMB2_COMPRESSION_FLAG_CHAINED : SMB2_COMPRESSION_FLAG_NONE;
+
+	if (buflen - *ofs < SMB2_COMP_PAYLOAD_HDR_SIZE) {
+		return false;
+	}
+	if (length > UINT32_MAX) {
+		return false;
+	}
+
+	SSVAL(buf, *ofs + SMB2_COMP_PAYLOAD_ALGORITHM, algo);
+	SSVAL(buf, *ofs + SMB2_COMP_PAYLOAD_FLAGS, flags);
+	SIVAL(buf, *ofs + SMB2_COMP_PAYLOAD_LENGTH, length);
+	*ofs += SMB2_COMP_PAYLOAD_HDR_SIZE;
+	return true;
+}
+
+static bool smb2_compression_push_pattern(uint8_t *buf,
+					  size_t buflen,
+					  size_t *ofs,
+					  uint8_t pattern,
+					  size_t repetitions)
+{
+	bool ok;
+
+	ok = smb2_compression_push_payload_hdr(buf,
+					       buflen,
+					       ofs,
+					       SMB2_COMPRESSION_PATTERN_V1,
+					       SMB2_COMP_PATTERN_SIZE);
+	if (!ok) {
+		return false;
+	}
+	if (buflen - *ofs < SMB2_COMP_PATTERN_SIZE) {
+		return false;
+	}
+
+	memset(buf + *ofs, 0, SMB2_COMP_PATTERN_SIZE);
+	SCVAL(buf, *ofs + SMB2_COMP_PATTERN_PATTERN, pattern);
+	SIVAL(buf, *ofs + SMB2_COMP_PATTERN_REPETITIONS, repetitions);
+	*ofs += SMB2_COMP_PATTERN_SIZE;
+	return true;
+}
+
+static bool smb2_compression_compress_chained(struct smb2_compression_ctx *ctx,
+					      uint8_t *buf,
+					      size_t buflen,
+					      size_t *ofs,
+					      const struct iovec *prefix,
+					      int prefix_count,
+					      size_t prefix_len,
+					      const uint8_t *data,
+					      size_t data_len)
+{
+	size_t lead = 0;
+	size_t trail = 0;
+	const uint8_t *mid = NULL;
+	size_t mid_len;
+	bool ok;
+
+	SIVAL(buf, SMB2_COMP_PROTOCOL_ID, SMB2_COMP_MAGIC);
+	SIVAL(buf, SMB2_COMP_ORIG_SIZE, prefix_len + data_len);
+	*ofs = SMB2_COMP_CHAINED_HDR_SIZE;
+
+	/* The prefix (SMB2 header and body) goes as it is */
+	ok = smb2_compression_push_payload_hdr(buf,
+					       buflen,
+					       ofs,
+					       SMB2_COMPRESSION_NONE,
+					       prefix_len);
+	if (!ok || buflen - *ofs < prefix_len) {
+		return false;
+	}
+	iov_buf(prefix, prefix_count, buf + *ofs, prefix_len);
+	*ofs += prefix_len;
+
+	if (ctx->pattern) {
+		lead = smb2_compression_run_length(data, data_len, false);
+		trail = smb2_compression_run_length(data + lead,
+						    data_len - lead,
+						    true);
+	}
+	mid = data + lead;
+	mid_len = data_len - lead - trail;
+
+	if (lead != 0) {
+		ok = smb2_compression_push_pattern(buf,
+						   buflen,
+						   ofs,
+						   data[0],
+						   lead);
+		if (!ok) {
+			return false;
+		}
+	}
+
+	if (mid_len != 0) {
+		ssize_t clen = -1;
+		size_t hdr_len = SMB2_COMP_PAYLOAD_HDR_SIZE + 4;
+
+		if (ctx->algo != SMB2_COMPRESSION_NONE &&
+		    buflen - *ofs > hdr_len)
+		{
+			clen = smb2_compression_compress_algo(
+				ctx,
+				mid,
+				mid_len,
+				buf + *ofs + hdr_len,
+				MIN(buflen - *ofs - hdr_len, mid_len));
+		}
+		if (clen > 0 && (size_t)clen + 4 < mid_len) {
+			ok = smb2_compression_push_payload_hdr(buf,
+							       buflen,
+							       ofs,
+							       ctx->algo,
+							       clen + 4);
+			if (!ok) {
+				return false;
+			}
+			/* OriginalPayloadSize */
+			SIVAL(buf, *ofs, mid_len);
+			*ofs += 4 + clen;
+		} else {
+			ok = smb2_compression_push_payload_hdr(
+				buf,
+				buflen,
+				ofs,
+				SMB2_COMPRESSION_NONE,
+				mid_len);
+			if (!ok || buflen - *ofs < mid_len) {
+				return false;
+			}
+			memcpy(buf + *ofs, mid, mid_len);
+			*ofs += mid_len;
+		}
+	}
+
+	if (trail != 0) {
+		ok = smb2_compression_push_pattern(buf,
+						   buflen,
+						   ofs,
+						   data[data_len - 1],
+						   trail);
+		if (!ok) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool smb2_compression_compress_unchained(
+	struct smb2_compression_ctx *ctx,
+	uint8_t *buf,
+	size_t buflen,
+	size_t *ofs,
+	const struct iovec *prefix,
+	int prefix_count,
+	size_t prefix_len,
+	const uint8_t *data,
+	size_t data_len)
+{
+	ssize_t clen;
+
+	if (ctx->algo == SMB2_COMPRESSION_NONE) {
+		return false;
+	}
+	if (buflen < SMB2_COMP_HDR_SIZE + prefix_len + 1) {
+		return false;
+	}
+
+	SIVAL(buf, SMB2_COMP_PROTOCOL_ID, SMB2_COMP_MAGIC);
+	SIVAL(buf, SMB2_COMP_ORIG_SIZE, data_len);
+	SSVAL(buf, SMB2_COMP_ALGORITHM, ctx->algo);
+	SSVAL(buf, SMB2_COMP_FLAGS, SMB2_COMPRESSION_FLAG_NONE);
+	SIVAL(buf, SMB2_COMP_OFFSET, prefix_len);
+	*ofs = SMB2_COMP_HDR_SIZE;
+
+	iov_buf(prefix, prefix_count, buf + *ofs, prefix_len);
+	*ofs += prefix_len;
+
+	clen = smb2_compression_compress_algo(ctx,
+					      data,
+					      data_len,
+					      buf + *ofs,
+					      buflen - *ofs);
+	if (clen <= 0) {
+		return false;
+	}
+	*ofs += clen;
+	return true;
+}
+
+NTSTATUS smb2_compression_compress(struct smb2_compression_ctx *ctx,
+				   TALLOC_CTX *mem_ctx,
+				   const struct iovec *prefix,
+				   int prefix_count,
+				   const uint8_t *data,
+				   size_t data_len,
+				   DATA_BLOB *out)
+{
+	ssize_t prefix_len = iov_buflen(prefix, prefix_count);
+	size_t total;
+	uint8_t *buf = NULL;
+	size_t ofs = 0;
+	bool ok;
+
+	*out = data_blob_null;
+
+	if (prefix_len < 0) {
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+	total = prefix_len + data_len;
+	if (total < data_len || total > UINT32_MAX) {
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+	if (data_len == 0) {
+		return NT_STATUS_OK;
+	}
+
+	/*
+	 * If the result doesn't fit into the size of the original,
+	 * it isn't worth it.
+	 */
+	buf = talloc_array(mem_ctx, uint8_t, total);
+	if (buf == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	if (ctx->chained) {
+		ok = smb2_compression_compress_chained(ctx,
+						       buf,
+						       total,
+						       &ofs,
+						       prefix,
+						       prefix_count,
+						       prefix_len,
+						       data,
+						       data_len);
+	} else {
+		ok = smb2_compression_compress_unchained(ctx,
+							 buf,
+							 total,
+							 &ofs,
+							 prefix,
+							 prefix_count,
+							 prefix_len,
+							 data,
+							 data_len);
+	}
+	if (!ok || ofs >= total) {
+		TALLOC_FREE(buf);
+		return NT_STATUS_OK;
+	}
+
+	*out = data_blob_const(buf, ofs);
+	return NT_STATUS_OK;
+}
+
+static NTSTATUS smb2_compression_decompress_chained(const uint8_t *buf,
+						    size_t buflen,
+						    const uint16_t *algos,
+						    size_t num_algos,
+						    uint8_t *out,
+						    size_t out_len)
+{
+	size_t pos = SMB2_COMP_CHAINED_HDR_SIZE;
+	size_t opos = 0;
+
+	while (pos < buflen) {
+		const uint8_t *payload = NULL;
+		uint16_t algo;
+		size_t length;
+
+		if (buflen - pos < SMB2_COMP_PAYLOAD_HDR_SIZE) {
+			return NT_STATUS_INVALID_PARAMETER;
+		}
+		algo = SVAL(buf, pos + SMB2_COMP_PAYLOAD_ALGORITHM);
+		length = IVAL(buf, pos + SMB2_COMP_PAYLOAD_LENGTH);
+		pos += SMB2_COMP_PAYLOAD_HDR_SIZE;
+
+		if (length > buflen - pos) {
+			return NT_STATUS_INVALID_PARAMETER;
+		}
+		payload = buf + pos;
+		pos += length;
+
+		if (algo == SMB2_COMPRESSION_NONE) {
+			if (length > out_len - opos) {
+				return NT_STATUS_BAD_COMPRESSION_BUFFER;
+			}
+			memcpy(out + opos, payload, length);
+			opos += length;
+			continue;
+		}
+
+		if (!smb2_compression_algo_allowed(algos, num_algos, algo)) {
+			return NT_STATUS_UNSUPPORTED_COMPRESSION;
+		}
+
+		if (algo == SMB2_COMPRESSION_PATTERN_V1) {
+			size_t repetitions;
+
+			if (length != SMB2_COMP_PATTERN_SIZE) {
+				return NT_STATUS_BAD_COMPRESSION_BUFFER;
+			}
+			repetitions = IVAL(payload,
+					   SMB2_COMP_PATTERN_REPETITIONS);
+			if (repetitions > out_len - opos) {
+				return NT_STATUS_BAD_COMPRESSION_BUFFER;
+			}
+			memset(out + opos,
+			       CVAL(payload, SMB2_COMP_PATTERN_PATTERN),
+			       repetitions);
+			opos += repetitions;
+		} else {
+			size_t orig_len;
+			ssize_t ret;
+
+			if (length < 4) {
+				return NT_STATUS_BAD_COMPRESSION_BUFFER;
+			}
+			/* OriginalPayloadSize */
+			orig_len = IVAL(payload, 0);
+			if (orig_len > out_len - opos) {
+				return NT_STATUS_BAD_COMPRESSION_BUFFER;
+			}
+			ret = smb2_compression_decompress_algo(algo,
+							       payload + 4,
+							       length - 4,
+							       out + opos,
+							       orig_len);
+			if (ret < 0 || (size_t)ret != orig_len) {
+				return NT_STATUS_BAD_COMPRESSION_BUFFER;
+			}
+			opos += orig_len;
+		}
+	}
+
+	if (opos != out_len) {
+		return NT_STATUS_BAD_COMPRESSION_BUFFER;
+	}
+	return NT_STATUS_OK;
+}
+
+NTSTATUS smb2_compression_decompress(TALLOC_CTX *mem_ctx,
+				     const uint8_t *buf,
+				     size_t buflen,
+				     const uint16_t *algos,
+				     size_t num_algos,
+				     bool chained,
+				     size_t max_size,
+				     DATA_BLOB *out)
+{
+	uint32_t orig_size;
+	uint16_t algo;
+	uint16_t flags;
+	uint8_t *data = NULL;
+	NTSTATUS status;
+
+	*out = data_blob_null;
+
+	if (buflen < SMB2_COMP_HDR_SIZE) {
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+	if (IVAL(buf, SMB2_COMP_PROTOCOL_ID) != SMB2_COMP_MAGIC) {
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	orig_size = IVAL(buf, SMB2_COMP_ORIG_SIZE);
+	algo = SVAL(buf, SMB2_COMP_ALGORITHM);
+	flags = SVAL(buf, SMB2_COMP_FLAGS);
+
+	if (flags == SMB2_COMPRESSION_FLAG_CHAINED) {
+		if (!chained) {
+			return NT_STATUS_INVALID_PARAMETER;
+		}
+		if (orig_size == 0 || orig_size > max_size) {
+			return NT_STATUS_INVALID_PARAMETER;
+		}
+
+		data = talloc_array(mem_ctx, uint8_t, orig_size);
+		if (data == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+
+		status = smb2_compression_decompress_chained(buf,
+							     buflen,
+							     algos,
+							     num_algos,
+							     data,
+							     orig_size);
+		if (!NT_STATUS_IS_OK(status)) {
+			TALLOC_FREE(data);
+			return status;
+		}
+
+		*out = data_blob_const(data, orig_size);
+		return NT_STATUS_OK;
+	}
+
+	if (flags == SMB2_COMPRESSION_FLAG_NONE) {
+		uint32_t offset = IVAL(buf, SMB2_COMP_OFFSET);
+		size_t total = (size_t)offset + orig_size;
+		const uint8_t *payload = NULL;
+		size_t payload_len;
+		ssize_t ret;
+
+		if (algo == SMB2_COMPRESSION_NONE ||
+		    algo == SMB2_COMPRESSION_PATTERN_V1) {
+			return NT_STATUS_INVALID_PARAMETER;
+		}
+		if (!smb2_compression_algo_allowed(algos, num_algos, algo)) {
+			return NT_STATUS_UNSUPPORTED_COMPRESSION;
+		}
+		if (offset > buflen - SMB2_COMP_HDR_SIZE) {
+			return NT_STATUS_INVALID_PARAMETER;
+		}
+		if (total == 0 || total > max_size) {
+			return NT_STATUS_INVALID_PARAMETER;
+		}
+		payload = buf + SMB2_COMP_HDR_SIZE + offset;
+		payload_len = buflen - SMB2_COMP_HDR_SIZE - offset;
+
+		data = talloc_array(mem_ctx, uint8_t, total);
+		if (data == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+		memcpy(data, buf + SMB2_COMP_HDR_SIZE, offset);
+
+		ret = smb2_compression_decompress_algo(algo,
+						       payload,
+						       payload_len,
+						       data + offset,
+						       orig_size);
+		if (ret < 0 || (size_t)ret != orig_size) {
+			TALLOC_FREE(data);
+			return NT_STATUS_BAD_COMPRESSION_BUFFER;
+		}
+
+		*out = data_blob_const(data, total);
+		return NT_STATUS_OK;
+	}
+
+	return NT_STATUS_INVALID_PARAMETER;
+}
@@ -0,0 +1,91 @@
+/*
+   Unix SMB/CIFS implementation.
+   SMB2 compression transform
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBCLI_SMB_SMB2_COMPRESSION_H_
+#define _LIBCLI_SMB_SMB2_COMPRESSION_H_
+
+#include "lib/util/data_blob.h"
+#include "libcli/util/ntstatus.h"
+
+struct iovec;
+struct smb2_compression_ctx;
+
+/*
+ * Whether smb2_compression_decompress() can handle algo, and
+ * smb2_compression_ctx_create() can use it.
+ */
+bool smb2_compression_algo_supported(uint16_t algo);
+
+/*
+ * algos are the negotiated CompressionIds, in order of preference.
+ * With chained compression, SMB2_COMPRESSION_PATTERN_V1 is used for
+ * runs of the same byte at the start and end of the data, if it is
+ * in algos.
+ *
+ * threads are used for LZ77+Huffman, see
+ * lzxpress_huffman_compress_stream_init().
+ *
+ * Returns NULL if algos has nothing we can compress with.
+ */
+struct smb2_compression_ctx *smb2_compression_ctx_create(
+	TALLOC_CTX *mem_ctx,
+	const uint16_t *algos,
+	size_t num_algos,
+	bool chained,
+	unsigned threads);
+
+/*
+ * A cheap estimate of whether data is worth compressing at all,
+ * based on the byte distribution in a sample of it. Already
+ * compressed or encrypted data is not.
+ */
+bool smb2_compression_worthwhile(const uint8_t *data, size_t len);
+
+/*
+ * Builds a SMB2 COMPRESSION_TRANSFORM message of prefix, which is
+ * left uncompressed (usually the SMB2 header and body), followed by
+ * the compressed data.
+ *
+ * If that wouldn't be smaller than the original, NT_STATUS_OK is
+ * returned with an empty *out.
+ */
+NTSTATUS smb2_compression_compress(struct smb2_compression_ctx *ctx,
+				   TALLOC_CTX *mem_ctx,
+				   const struct iovec *prefix,
+				   int prefix_count,
+				   const uint8_t *data,
+				   size_t data_len,
+				   DATA_BLOB *out);
+
+/*
+ * Decompresses a SMB2 COMPRESSION_TRANSFORM message, chained or
+ * unchained, into a new buffer of at most max_size bytes.
+ *
+ * Only the algorithms in algos are accepted, plus
+ * SMB2_COMPRESSION_NONE in chained messages.
+ */
+NTSTATUS smb2_compression_decompress(TALLOC_CTX *mem_ctx,
+				     const uint8_t *buf,
+				     size_t buflen,
+				     const uint16_t *algos,
+				     size_t num_algos,
+				     bool chained,
+				     size_t max_size,
+				     DATA_BLOB *out);
+
+#endif /* _LIBCLI_SMB_SMB2_COMPRESSION_H_ */
@@ -26,6 +26,7 @@
 #include "../libcli/smb/smb_common.h"
 #include "../lib/crypto/crypto.h"
 #include "lib/util/iov_buf.h"
+#include "libcli/smb/smb2_signing_accel.h"
 
 #include "lib/crypto/gnutls_helpers.h"
 
@@ -97,6 +98,9 @@ static int smb2_signing_key_destructor(struct smb2_signing_key *key)
 		key->cipher_hnd = NULL;
 	}
 
+	smb2_signing_accel_destroy(key->accel);
+	key->accel = NULL;
+
 	return 0;
 }
 
@@ -339,10 +343,59 @@ static NTSTATUS smb2_signing_gmac(gnutls_aead_cipher_hd_t cipher_hnd,
 	return NT_STATUS_OK;
 }
 
+static bool smb2_signing_calc_accel(struct smb2_signing_key *signing_key,
+				    uint16_t sign_algo_id,
+				    const uint8_t *iv,
+				    const struct iovec *vector,
+				    int count,
+				    uint8_t signature[16])
+{
+	static const uint8_t zero_sig[16] = { 0, };
+	struct iovec auth_iov[count+1];
+	int auth_iovcnt = 0;
+	int i;
+
+	if (signing_key->accel == NULL) {
+		/*
+		 * The key schedule is computed once per key,
+		 * this also happens for keys copied to worker
+		 * threads, as smb2_signing_accel_create()
+		 * doesn't use talloc.
+		 */
+		signing_key->accel = smb2_signing_accel_create(
+			sign_algo_id,
+			signing_key->blob.data,
+			signing_key->blob.length);
+	}
+	if (signing_key->accel == NULL) {
+		return false;
+	}
+
+	auth_iov[auth_iovcnt++] = (struct iovec) {
+		.iov_base = discard_const_p(uint8_t, vector[0].iov_base),
+		.iov_len  = SMB2_HDR_SIGNATURE,
+	};
+	auth_iov[auth_iovcnt++] = (struct iovec) {
+		.iov_base = discard_const_p(uint8_t, zero_sig),
+		.iov_len  = 16,
+	};
+	for (i=1; i < count; i++) {
+		auth_iov[auth_iovcnt++] = vector[i];
+	}
+
+	smb2_signing_accel_tag(signing_key->accel,
+			       iv,
+			       auth_iov,
+			       auth_iovcnt,
+			       signature);
+	return true;
+}
+
 static NTSTATUS smb2_signing_calc_signature(struct smb2_signing_key *signing_key,
 					    uint16_t sign_algo_id,
 					    const struct iovec *vector,
 					    int count,
+					    bool log,
 					    uint8_t signature[16])
 {
 	const uint8_t *hdr = (uint8_t *)vector[0].iov_base;
@@ -369,11 +422,17 @@ static NTSTATUS smb2_signing_calc_signature(struct smb2_signing_key *signing_key
 	if (flags & SMB2_HDR_FLAG_REDIRECT) {
 		NTSTATUS pdu_status = NT_STATUS(IVAL(hdr, SMB2_HDR_STATUS));
 		if (NT_STATUS_EQUAL(pdu_status, NT_STATUS_PENDING)) {
-			DBG_ERR("opcode[%u] NT_STATUS_PENDING\n", opcode);
+			if (log) {
+				DBG_ERR("opcode[%u] NT_STATUS_PENDING\n",
+					opcode);
+			}
 			return NT_STATUS_INTERNAL_ERROR;
 		}
 		if (opcode == SMB2_OP_CANCEL) {
-			DBG_ERR("SMB2_OP_CANCEL response should not be signed\n");
+			if (log) {
+				DBG_ERR("SMB2_OP_CANCEL response should "
+					"not be signed\n");
+			}
 			return NT_STATUS_INTERNAL_ERROR;
 		}
 	}
@@ -382,7 +441,9 @@ static NTSTATUS smb2_signing_calc_signature(struct smb2_signing_key *signing_key
 		if (opcode != SMB2_OP_CANCEL ||
 		    sign_algo_id >= SMB2_SIGNING_AES128_GMAC)
 		{
-			DBG_ERR("opcode[%u] msg_id == 0\n", opcode);
+			if (log) {
+				DBG_ERR("opcode[%u] msg_id == 0\n", opcode);
+			}
 			return NT_STATUS_INTERNAL_ERROR;
 		}
 		/*
@@ -391,7 +452,9 @@ static NTSTATUS smb2_signing_calc_signature(struct smb2_signing_key *signing_key
 		 */
 	}
 	if (msg_id == UINT64_MAX) {
-		DBG_ERR("opcode[%u] msg_id == UINT64_MAX\n", opcode);
+		if (log) {
+			DBG_ERR("opcode[%u] msg_id == UINT64_MAX\n", opcode);
+		}
 		return NT_STATUS_INTERNAL_ERROR;
 	}
 
@@ -419,6 +482,15 @@ static NTSTATUS smb2_signing_calc_signature(struct smb2_signing_key *signing_key
 		SBVAL(iv, 0, msg_id);
 		SBVAL(iv, 8, high_bits);
 
+		if (smb2_signing_calc_accel(signing_key,
+					    sign_algo_id,
+					    iv,
+					    vector,
+					    count,
+					    signature)) {
+			return NT_STATUS_OK;
+		}
+
 		if (signing_key->cipher_hnd == NULL) {
 			rc = gnutls_aead_cipher_init(&signing_key->cipher_hnd,
 						     algo,
@@ -463,6 +535,14 @@ static NTSTATUS smb2_signing_calc_signature(struct smb2_signing_key *signing_key
 	}	break;
 
 	case SMB2_SIGNING_AES128_CMAC:
+		if (smb2_signing_calc_accel(signing_key,
+					    sign_algo_id,
+					    NULL,
+					    vector,
+					    count,
+					    signature)) {
+			return NT_STATUS_OK;
+		}
 		hmac_algo = GNUTLS_MAC_AES_CMAC_128;
 		break;
 	case SMB2_SIGNING_HMAC_SHA256:
@@ -521,9 +601,16 @@ static NTSTATUS smb2_signing_calc_signature(struct smb2_signing_key *signing_key
 	return NT_STATUS_HMAC_NOT_SUPPORTED;
 }
 
-NTSTATUS smb2_signing_sign_pdu(struct smb2_signing_key *signing_key,
-			       struct iovec *vector,
-			       int count)
+/*
+ * The *_nolog() variants of smb2_signing_{sign,encrypt,decrypt}_pdu()
+ * are for worker threads: they don't log, the caller has to report
+ * the returned error from the main thread.
+ */
+
+static NTSTATUS smb2_signing_sign_pdu_ex(struct smb2_signing_key *signing_key,
+					 struct iovec *vector,
+					 int count,
+					 bool log)
 {
 	uint16_t sign_algo_id;
 	uint8_t *hdr;
@@ -554,7 +641,9 @@ NTSTATUS smb2_signing_sign_pdu(struct smb2_signing_key *signing_key,
 	}
 
 	if (!smb2_signing_key_valid(signing_key)) {
-		DBG_WARNING("No signing key for SMB2 signing\n");
+		if (log) {
+			DBG_WARNING("No signing key for SMB2 signing\n");
+		}
 		return NT_STATUS_ACCESS_DENIED;
 	}
 
@@ -568,8 +657,12 @@ NTSTATUS smb2_signing_sign_pdu(struct smb2_signing_key *signing_key,
 					     sign_algo_id,
 					     vector,
 					     count,
+					     log,
 					     res);
 	if (!NT_STATUS_IS_OK(status)) {
+		if (!log) {
+			return status;
+		}
 		DBG_ERR("smb2_signing_calc_signature(sign_algo_id=%u) - %s\n",
 			(unsigned)sign_algo_id, nt_errstr(status));
 		if (NT_STATUS_EQUAL(status, NT_STATUS_INTERNAL_ERROR)) {
@@ -578,14 +671,30 @@ NTSTATUS smb2_signing_sign_pdu(struct smb2_signing_key *signing_key,
 		return status;
 	}
 
-	DEBUG(5,("signed SMB2 message (sign_algo_id=%u)\n",
-		 (unsigned)sign_algo_id));
+	if (log) {
+		DEBUG(5,("signed SMB2 message (sign_algo_id=%u)\n",
+			 (unsigned)sign_algo_id));
+	}
 
 	memcpy(hdr + SMB2_HDR_SIGNATURE, res, 16);
 
 	return NT_STATUS_OK;
 }
 
+NTSTATUS smb2_signing_sign_pdu(struct smb2_signing_key *signing_key,
+			       struct iovec *vector,
+			       int count)
+{
+	return smb2_signing_sign_pdu_ex(signing_key, vector, count, true);
+}
+
+NTSTATUS smb2_signing_sign_pdu_nolog(struct smb2_signing_key *signing_key,
+				     struct iovec *vector,
+				     int count)
+{
+	return smb2_signing_sign_pdu_ex(signing_key, vector, count, false);
+}
+
 NTSTATUS smb2_signing_check_pdu(struct smb2_signing_key *signing_key,
 				const struct iovec *vector,
 				int count)
@@ -632,6 +741,7 @@ NTSTATUS smb2_signing_check_pdu(struct smb2_signing_key *signing_key,
 					     sign_algo_id,
 					     vector,
 					     count,
+					     true,
 					     res);
 	if (!NT_STATUS_IS_OK(status)) {
 		DBG_ERR("smb2_signing_calc_signature(sign_algo_id=%u) - %s\n",
@@ -653,9 +763,11 @@ NTSTATUS smb2_signing_check_pdu(struct smb2_signing_key *signing_key,
 	return NT_STATUS_OK;
 }
 
-NTSTATUS smb2_signing_encrypt_pdu(struct smb2_signing_key *encryption_key,
-				  struct iovec *vector,
-				  int count)
+static NTSTATUS smb2_signing_encrypt_pdu_ex(
+	struct smb2_signing_key *encryption_key,
+	struct iovec *vector,
+	int count,
+	bool log)
 {
 	bool use_encryptv2 = false;
 	uint16_t cipher_id;
@@ -682,7 +794,9 @@ NTSTATUS smb2_signing_encrypt_pdu(struct smb2_signing_key *encryption_key,
 	tf = (uint8_t *)vector[0].iov_base;
 
 	if (!smb2_signing_key_valid(encryption_key)) {
-		DBG_WARNING("No encryption key for SMB2 signing\n");
+		if (log) {
+			DBG_WARNING("No encryption key for SMB2 signing\n");
+		}
 		return NT_STATUS_ACCESS_DENIED;
 	}
 	cipher_id = encryption_key->cipher_algo_id;
@@ -868,16 +982,35 @@ NTSTATUS smb2_signing_encrypt_pdu(struct smb2_signing_key *encryption_key,
 		TALLOC_FREE(ctext);
 	}
 
-	DBG_INFO("Encrypted SMB2 message\n");
+	if (log) {
+		DBG_INFO("Encrypted SMB2 message\n");
+	}
 
 	status = NT_STATUS_OK;
 out:
 	return status;
 }
 
-NTSTATUS smb2_signing_decrypt_pdu(struct smb2_signing_key *decryption_key,
+NTSTATUS smb2_signing_encrypt_pdu(struct smb2_signing_key *encryption_key,
 				  struct iovec *vector,
 				  int count)
+{
+	return smb2_signing_encrypt_pdu_ex(encryption_key, vector, count, true);
+}
+
+NTSTATUS smb2_signing_encrypt_pdu_nolog(
+	struct smb2_signing_key *encryption_key,
+	struct iovec *vector,
+	int count)
+{
+	return smb2_signing_encrypt_pdu_ex(encryption_key, vector, count, false);
+}
+
+static NTSTATUS smb2_signing_decrypt_pdu_ex(
+	struct smb2_signing_key *decryption_key,
+	struct iovec *vector,
+	int count,
+	bool log)
 {
 	bool use_encryptv2 = false;
 	uint16_t cipher_id;
@@ -906,7 +1039,9 @@ NTSTATUS smb2_signing_decrypt_pdu(struct smb2_signing_key *decryption_key,
 	tf = (uint8_t *)vector[0].iov_base;
 
 	if (!smb2_signing_key_valid(decryption_key)) {
-		DBG_WARNING("No decryption key for SMB2 signing\n");
+		if (log) {
+			DBG_WARNING("No decryption key for SMB2 signing\n");
+		}
 		return NT_STATUS_ACCESS_DENIED;
 	}
 	cipher_id = decryption_key->cipher_algo_id;
@@ -1102,9 +1237,26 @@ NTSTATUS smb2_signing_decrypt_pdu(struct smb2_signing_key *decryption_key,
 		TALLOC_FREE(ctext);
 	}
 
-	DBG_INFO("Decrypted SMB2 message\n");
+	if (log) {
+		DBG_INFO("Decrypted SMB2 message\n");
+	}
 
 	status = NT_STATUS_OK;
 out:
 	return status;
 }
+
+NTSTATUS smb2_signing_decrypt_pdu(struct smb2_signing_key *decryption_key,
+				  struct iovec *vector,
+				  int count)
+{
+	return smb2_signing_decrypt_pdu_ex(decryption_key, vector, count, true);
+}
+
+NTSTATUS smb2_signing_decrypt_pdu_nolog(
+	struct smb2_signing_key *decryption_key,
+	struct iovec *vector,
+	int count)
+{
+	return smb2_signing_decrypt_pdu_ex(decryption_key, vector, count, false);
+}
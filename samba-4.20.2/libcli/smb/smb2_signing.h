@@ -50,6 +50,8 @@ void smb2_signing_derivations_fill_const_stack(struct smb2_signing_derivations *
 					       enum protocol_types protocol,
 					       const DATA_BLOB preauth_hash);
 
+struct smb2_signing_accel;
+
 struct smb2_signing_key {
 	DATA_BLOB blob;
 	uint16_t sign_algo_id;
@@ -66,6 +68,8 @@ struct smb2_signing_key {
 #endif
 		void *__cipher_hnd;
 	};
+	/* see smb2_signing_accel.h, NULL if not supported */
+	struct smb2_signing_accel *accel;
 };
 
 NTSTATUS smb2_signing_key_copy(TALLOC_CTX *mem_ctx,
@@ -99,4 +103,19 @@ NTSTATUS smb2_signing_decrypt_pdu(struct smb2_signing_key *decryption_key,
 				  struct iovec *vector,
 				  int count);
 
+/*
+ * For worker threads, they don't log
+ */
+NTSTATUS smb2_signing_sign_pdu_nolog(struct smb2_signing_key *signing_key,
+				     struct iovec *vector,
+				     int count);
+NTSTATUS smb2_signing_encrypt_pdu_nolog(
+	struct smb2_signing_key *encryption_key,
+	struct iovec *vector,
+	int count);
+NTSTATUS smb2_signing_decrypt_pdu_nolog(
+	struct smb2_signing_key *decryption_key,
+	struct iovec *vector,
+	int count);
+
 #endif /* _LIBCLI_SMB_SMB2_SIGNING_H_ */
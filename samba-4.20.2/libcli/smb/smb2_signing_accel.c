@@ -0,0 +1,573 @@
+/*
+   Unix SMB/CIFS implementation.
+   SMB2 signing, AES-NI/PCLMULQDQ engine for AES-CMAC and AES-GMAC
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * gnutls needs a handle per key and goes through its generic
+ * MAC/AEAD layers for every PDU. SMB2 signatures are computed
+ * over a few small iovecs, so for metadata heavy workloads
+ * that overhead dominates. This engine keeps the AES key
+ * schedule together with the CMAC subkeys or the GHASH key
+ * powers per key and runs the AES rounds and the GF(2^128)
+ * multiplications directly on AES-NI and PCLMULQDQ.
+ *
+ * GHASH aggregates four blocks per reduction. AES-CMAC is
+ * a CBC-MAC and inherently serial, wider vectors would not
+ * help there.
+ */
+
+#include "replace.h"
+#include "lib/util/iov_buf.h"
+#include "lib/util/bytearray.h"
+#include "libcli/smb/smb2_constants.h"
+#include "libcli/smb/smb2_signing_accel.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SMB2_SIGNING_ACCEL_X86_64 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define SMB2_SIGNING_ACCEL_BLOCK 16
+#define SMB2_SIGNING_ACCEL_AES128_ROUNDS 10
+
+struct smb2_signing_accel {
+	uint16_t sign_algo_id;
+	uint8_t round_keys[SMB2_SIGNING_ACCEL_AES128_ROUNDS + 1]
+			  [SMB2_SIGNING_ACCEL_BLOCK];
+	union {
+		struct {
+			uint8_t k1[SMB2_SIGNING_ACCEL_BLOCK];
+			uint8_t k2[SMB2_SIGNING_ACCEL_BLOCK];
+		} cmac;
+		struct {
+			/* H^1 .. H^4, byte reflected */
+			uint8_t h[4][SMB2_SIGNING_ACCEL_BLOCK];
+		} gmac;
+	};
+};
+
+static bool smb2_signing_accel_disabled;
+
+void smb2_signing_accel_set_enabled(bool enabled)
+{
+	smb2_signing_accel_disabled = !enabled;
+}
+
+#ifdef SMB2_SIGNING_ACCEL_X86_64
+
+#define SMB2_SIGNING_ACCEL_TARGET __attribute__((target("aes,pclmul,ssse3")))
+
+static bool smb2_signing_accel_cpu_supported(void)
+{
+	/*
+	 * Racing threads compute the same value,
+	 * so no locking needed.
+	 */
+	static int supported = -1;
+
+	if (supported == -1) {
+		unsigned int eax, ebx, ecx, edx;
+		bool ok = false;
+
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+			ok = (ecx & bit_AES) &&
+			     (ecx & bit_PCLMUL) &&
+			     (ecx & bit_SSSE3);
+		}
+		supported = ok ? 1 : 0;
+	}
+
+	return supported == 1;
+}
+
+static inline SMB2_SIGNING_ACCEL_TARGET
+__m128i aes128_expand_step(__m128i key, __m128i assist)
+{
+	__m128i tmp;
+
+	assist = _mm_shuffle_epi32(assist, 0xff);
+	tmp = _mm_slli_si128(key, 4);
+	key = _mm_xor_si128(key, tmp);
+	tmp = _mm_slli_si128(tmp, 4);
+	key = _mm_xor_si128(key, tmp);
+	tmp = _mm_slli_si128(tmp, 4);
+	key = _mm_xor_si128(key, tmp);
+	return _mm_xor_si128(key, assist);
+}
+
+static SMB2_SIGNING_ACCEL_TARGET
+void aes128_expand_key(const uint8_t key[16], __m128i rk[11])
+{
+	/* _mm_aeskeygenassist_si128() needs an immediate rcon */
+#define AES128_EXPAND(i, rcon) \
+	rk[i] = aes128_expand_step(rk[i-1], \
+			_mm_aeskeygenassist_si128(rk[i-1], rcon))
+
+	rk[0] = _mm_loadu_si128((const __m128i *)key);
+	AES128_EXPAND(1, 0x01);
+	AES128_EXPAND(2, 0x02);
+	AES128_EXPAND(3, 0x04);
+	AES128_EXPAND(4, 0x08);
+	AES128_EXPAND(5, 0x10);
+	AES128_EXPAND(6, 0x20);
+	AES128_EXPAND(7, 0x40);
+	AES128_EXPAND(8, 0x80);
+	AES128_EXPAND(9, 0x1b);
+	AES128_EXPAND(10, 0x36);
+
+#undef AES128_EXPAND
+}
+
+static inline SMB2_SIGNING_ACCEL_TARGET
+__m128i aes128_encrypt(const __m128i rk[11], __m128i block)
+{
+	int i;
+
+	block = _mm_xor_si128(block, rk[0]);
+	for (i = 1; i < SMB2_SIGNING_ACCEL_AES128_ROUNDS; i++) {
+		block = _mm_aesenc_si128(block, rk[i]);
+	}
+	return _mm_aesenclast_si128(block, rk[10]);
+}
+
+static inline SMB2_SIGNING_ACCEL_TARGET
+void aes128_load_key(const struct smb2_signing_accel *accel, __m128i rk[11])
+{
+	int i;
+
+	for (i = 0; i <= SMB2_SIGNING_ACCEL_AES128_ROUNDS; i++) {
+		rk[i] = _mm_loadu_si128(
+			(const __m128i *)accel->round_keys[i]);
+	}
+}
+
+/*
+ * Carry-less multiplication in GF(2^128) on byte reflected
+ * operands, see the Intel white paper "Intel Carry-Less
+ * Multiplication Instruction and its Usage for Computing the
+ * GCM Mode". The 256 bit product is kept unreduced, so that
+ * several products can be summed up and reduced once.
+ */
+static inline SMB2_SIGNING_ACCEL_TARGET
+void gf128_mul_wide(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+	__m128i t0, t1, t2, t3;
+
+	t0 = _mm_clmulepi64_si128(a, b, 0x00);
+	t1 = _mm_clmulepi64_si128(a, b, 0x10);
+	t2 = _mm_clmulepi64_si128(a, b, 0x01);
+	t3 = _mm_clmulepi64_si128(a, b, 0x11);
+
+	t1 = _mm_xor_si128(t1, t2);
+	t2 = _mm_slli_si128(t1, 8);
+	t1 = _mm_srli_si128(t1, 8);
+
+	*lo = _mm_xor_si128(t0, t2);
+	*hi = _mm_xor_si128(t3, t1);
+}
+
+static inline SMB2_SIGNING_ACCEL_TARGET
+__m128i gf128_reduce(__m128i lo, __m128i hi)
+{
+	__m128i t2, t4, t5, t7, t8, t9;
+
+	/* shift the 256 bit product left by one bit */
+	t7 = _mm_srli_epi32(lo, 31);
+	t8 = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+	t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	lo = _mm_or_si128(lo, t7);
+	hi = _mm_or_si128(hi, t8);
+	hi = _mm_or_si128(hi, t9);
+
+	/* reduce modulo x^128 + x^7 + x^2 + x + 1 */
+	t7 = _mm_slli_epi32(lo, 31);
+	t8 = _mm_slli_epi32(lo, 30);
+	t9 = _mm_slli_epi32(lo, 25);
+	t7 = _mm_xor_si128(t7, t8);
+	t7 = _mm_xor_si128(t7, t9);
+	t8 = _mm_srli_si128(t7, 4);
+	t7 = _mm_slli_si128(t7, 12);
+	lo = _mm_xor_si128(lo, t7);
+
+	t2 = _mm_srli_epi32(lo, 1);
+	t4 = _mm_srli_epi32(lo, 2);
+	t5 = _mm_srli_epi32(lo, 7);
+	t2 = _mm_xor_si128(t2, t4);
+	t2 = _mm_xor_si128(t2, t5);
+	t2 = _mm_xor_si128(t2, t8);
+	lo = _mm_xor_si128(lo, t2);
+
+	return _mm_xor_si128(hi, lo);
+}
+
+static inline SMB2_SIGNING_ACCEL_TARGET
+__m128i gf128_mul(__m128i a, __m128i b)
+{
+	__m128i lo, hi;
+
+	gf128_mul_wide(a, b, &lo, &hi);
+	return gf128_reduce(lo, hi);
+}
+
+static inline SMB2_SIGNING_ACCEL_TARGET
+__m128i bswap128(__m128i v)
+{
+	const __m128i mask = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					  8, 9, 10, 11, 12, 13, 14, 15);
+
+	return _mm_shuffle_epi8(v, mask);
+}
+
+static SMB2_SIGNING_ACCEL_TARGET
+void smb2_signing_accel_setup(struct smb2_signing_accel *accel,
+			      const uint8_t key[16])
+{
+	__m128i rk[11];
+	__m128i l;
+	int i;
+
+	aes128_expand_key(key, rk);
+	for (i = 0; i <= SMB2_SIGNING_ACCEL_AES128_ROUNDS; i++) {
+		_mm_storeu_si128((__m128i *)accel->round_keys[i], rk[i]);
+	}
+
+	l = aes128_encrypt(rk, _mm_setzero_si128());
+
+	if (accel->sign_algo_id == SMB2_SIGNING_AES128_CMAC) {
+		uint8_t *k1 = accel->cmac.k1;
+		uint8_t *k2 = accel->cmac.k2;
+		uint8_t lb[SMB2_SIGNING_ACCEL_BLOCK];
+		uint8_t carry;
+
+		/* RFC 4493 2.3: Subkey Generation */
+		_mm_storeu_si128((__m128i *)lb, l);
+
+		carry = lb[0] >> 7;
+		for (i = 0; i < 15; i++) {
+			k1[i] = (lb[i] << 1) | (lb[i+1] >> 7);
+		}
+		k1[15] = (lb[15] << 1) ^ (carry ? 0x87 : 0);
+
+		carry = k1[0] >> 7;
+		for (i = 0; i < 15; i++) {
+			k2[i] = (k1[i] << 1) | (k1[i+1] >> 7);
+		}
+		k2[15] = (k1[15] << 1) ^ (carry ? 0x87 : 0);
+
+		BURN_DATA(lb);
+	} else {
+		__m128i h = bswap128(l);
+		__m128i hn = h;
+
+		for (i = 0; i < 4; i++) {
+			_mm_storeu_si128((__m128i *)accel->gmac.h[i], hn);
+			hn = gf128_mul(hn, h);
+		}
+	}
+}
+
+static SMB2_SIGNING_ACCEL_TARGET
+void smb2_signing_accel_cmac(const struct smb2_signing_accel *accel,
+			     const struct iovec *vector,
+			     int count,
+			     uint8_t tag[16])
+{
+	__m128i rk[11];
+	__m128i x = _mm_setzero_si128();
+	__m128i last;
+	uint8_t buf[SMB2_SIGNING_ACCEL_BLOCK];
+	size_t buflen = 0;
+	int i;
+
+	aes128_load_key(accel, rk);
+
+	/*
+	 * The last block is special, so we always keep
+	 * at least one byte in buf until we know there's
+	 * more data.
+	 */
+	for (i = 0; i < count; i++) {
+		const uint8_t *p = (const uint8_t *)vector[i].iov_base;
+		size_t len = vector[i].iov_len;
+
+		while (len > 0) {
+			size_t n;
+
+			if (buflen == SMB2_SIGNING_ACCEL_BLOCK) {
+				x = _mm_xor_si128(x,
+					_mm_loadu_si128((const __m128i *)buf));
+				x = aes128_encrypt(rk, x);
+				buflen = 0;
+			}
+
+			if (buflen == 0) {
+				while (len > SMB2_SIGNING_ACCEL_BLOCK) {
+					x = _mm_xor_si128(x,
+						_mm_loadu_si128(
+						(const __m128i *)p));
+					x = aes128_encrypt(rk, x);
+					p += SMB2_SIGNING_ACCEL_BLOCK;
+					len -= SMB2_SIGNING_ACCEL_BLOCK;
+				}
+			}
+
+			n = MIN(SMB2_SIGNING_ACCEL_BLOCK - buflen, len);
+			memcpy(buf + buflen, p, n);
+			buflen += n;
+			p += n;
+			len -= n;
+		}
+	}
+
+	if (buflen == SMB2_SIGNING_ACCEL_BLOCK) {
+		last = _mm_loadu_si128((const __m128i *)accel->cmac.k1);
+	} else {
+		buf[buflen] = 0x80;
+		memset(buf + buflen + 1, 0,
+		       SMB2_SIGNING_ACCEL_BLOCK - buflen - 1);
+		last = _mm_loadu_si128((const __m128i *)accel->cmac.k2);
+	}
+	last = _mm_xor_si128(last, _mm_loadu_si128((const __m128i *)buf));
+
+	x = _mm_xor_si128(x, last);
+	x = aes128_encrypt(rk, x);
+	_mm_storeu_si128((__m128i *)tag, x);
+}
+
+static inline SMB2_SIGNING_ACCEL_TARGET
+__m128i ghash_4blocks(__m128i y, const uint8_t *p, const __m128i h[4])
+{
+	__m128i lo, hi, tlo, thi;
+	__m128i x;
+
+	x = bswap128(_mm_loadu_si128((const __m128i *)p));
+	gf128_mul_wide(_mm_xor_si128(y, x), h[3], &lo, &hi);
+
+	x = bswap128(_mm_loadu_si128((const __m128i *)(p + 16)));
+	gf128_mul_wide(x, h[2], &tlo, &thi);
+	lo = _mm_xor_si128(lo, tlo);
+	hi = _mm_xor_si128(hi, thi);
+
+	x = bswap128(_mm_loadu_si128((const __m128i *)(p + 32)));
+	gf128_mul_wide(x, h[1], &tlo, &thi);
+	lo = _mm_xor_si128(lo, tlo);
+	hi = _mm_xor_si128(hi, thi);
+
+	x = bswap128(_mm_loadu_si128((const __m128i *)(p + 48)));
+	gf128_mul_wide(x, h[0], &tlo, &thi);
+	lo = _mm_xor_si128(lo, tlo);
+	hi = _mm_xor_si128(hi, thi);
+
+	return gf128_reduce(lo, hi);
+}
+
+static inline SMB2_SIGNING_ACCEL_TARGET
+__m128i ghash_block(__m128i y, const uint8_t *p, __m128i h)
+{
+	__m128i x = bswap128(_mm_loadu_si128((const __m128i *)p));
+
+	return gf128_mul(_mm_xor_si128(y, x), h);
+}
+
+static SMB2_SIGNING_ACCEL_TARGET
+void smb2_signing_accel_gmac(const struct smb2_signing_accel *accel,
+			     const uint8_t iv[12],
+			     const struct iovec *vector,
+			     int count,
+			     uint8_t tag[16])
+{
+	__m128i rk[11];
+	__m128i h[4];
+	__m128i y = _mm_setzero_si128();
+	__m128i s;
+	uint8_t buf[4 * SMB2_SIGNING_ACCEL_BLOCK];
+	size_t buflen = 0;
+	uint64_t total = 0;
+	size_t ofs;
+	int i;
+
+	aes128_load_key(accel, rk);
+	for (i = 0; i < 4; i++) {
+		h[i] = _mm_loadu_si128((const __m128i *)accel->gmac.h[i]);
+	}
+
+	/*
+	 * GMAC is GCM without plaintext, everything
+	 * is additional authenticated data.
+	 */
+	for (i = 0; i < count; i++) {
+		const uint8_t *p = (const uint8_t *)vector[i].iov_base;
+		size_t len = vector[i].iov_len;
+
+		total += len;
+
+		while (len > 0) {
+			size_t n;
+
+			if (buflen == 0) {
+				while (len >= sizeof(buf)) {
+					y = ghash_4blocks(y, p, h);
+					p += sizeof(buf);
+					len -= sizeof(buf);
+				}
+				while (len >= SMB2_SIGNING_ACCEL_BLOCK) {
+					y = ghash_block(y, p, h[0]);
+					p += SMB2_SIGNING_ACCEL_BLOCK;
+					len -= SMB2_SIGNING_ACCEL_BLOCK;
+				}
+				if (len == 0) {
+					break;
+				}
+			}
+
+			n = MIN(sizeof(buf) - buflen, len);
+			memcpy(buf + buflen, p, n);
+			buflen += n;
+			p += n;
+			len -= n;
+
+			if (buflen == sizeof(buf)) {
+				y = ghash_4blocks(y, buf, h);
+				buflen = 0;
+			}
+		}
+	}
+
+	if (buflen % SMB2_SIGNING_ACCEL_BLOCK != 0) {
+		size_t pad = SMB2_SIGNING_ACCEL_BLOCK -
+			     (buflen % SMB2_SIGNING_ACCEL_BLOCK);
+
+		memset(buf + buflen, 0, pad);
+		buflen += pad;
+	}
+	for (ofs = 0; ofs < buflen; ofs += SMB2_SIGNING_ACCEL_BLOCK) {
+		y = ghash_block(y, buf + ofs, h[0]);
+	}
+
+	/* len(A) || len(C) in bits, there's no C */
+	memset(buf, 0, SMB2_SIGNING_ACCEL_BLOCK);
+	PUSH_BE_U64(buf, 0, total * 8);
+	y = ghash_block(y, buf, h[0]);
+
+	/* J0 = IV || 0^31 || 1 */
+	memcpy(buf, iv, 12);
+	PUSH_BE_U32(buf, 12, 1);
+	s = aes128_encrypt(rk, _mm_loadu_si128((const __m128i *)buf));
+
+	s = _mm_xor_si128(s, bswap128(y));
+	_mm_storeu_si128((__m128i *)tag, s);
+}
+
+bool smb2_signing_accel_available(void)
+{
+	if (smb2_signing_accel_disabled) {
+		return false;
+	}
+
+	return smb2_signing_accel_cpu_supported();
+}
+
+struct smb2_signing_accel *smb2_signing_accel_create(uint16_t sign_algo_id,
+						     const uint8_t *key,
+						     size_t key_len)
+{
+	struct smb2_signing_accel *accel = NULL;
+
+	if (!smb2_signing_accel_available()) {
+		return NULL;
+	}
+
+	switch (sign_algo_id) {
+	case SMB2_SIGNING_AES128_CMAC:
+	case SMB2_SIGNING_AES128_GMAC:
+		break;
+	default:
+		return NULL;
+	}
+
+	if (key_len < 16) {
+		return NULL;
+	}
+
+	/*
+	 * Not talloc, we may be called from a worker thread
+	 * on a key that is part of the main thread's hierarchy.
+	 */
+	accel = calloc(1, sizeof(*accel));
+	if (accel == NULL) {
+		return NULL;
+	}
+	accel->sign_algo_id = sign_algo_id;
+
+	smb2_signing_accel_setup(accel, key);
+
+	return accel;
+}
+
+void smb2_signing_accel_tag(struct smb2_signing_accel *accel,
+			    const uint8_t *iv,
+			    const struct iovec *vector,
+			    int count,
+			    uint8_t tag[16])
+{
+	if (accel->sign_algo_id == SMB2_SIGNING_AES128_CMAC) {
+		smb2_signing_accel_cmac(accel, vector, count, tag);
+		return;
+	}
+
+	smb2_signing_accel_gmac(accel, iv, vector, count, tag);
+}
+
+#else /* SMB2_SIGNING_ACCEL_X86_64 */
+
+bool smb2_signing_accel_available(void)
+{
+	return false;
+}
+
+struct smb2_signing_accel *smb2_signing_accel_create(uint16_t sign_algo_id,
+						     const uint8_t *key,
+						     size_t key_len)
+{
+	return NULL;
+}
+
+void smb2_signing_accel_tag(struct smb2_signing_accel *accel,
+			    const uint8_t *iv,
+			    const struct iovec *vector,
+			    int count,
+			    uint8_t tag[16])
+{
+	abort();
+}
+
+#endif /* SMB2_SIGNING_ACCEL_X86_64 */
+
+void smb2_signing_accel_destroy(struct smb2_signing_accel *accel)
+{
+	if (accel == NULL) {
+		return;
+	}
+
+	BURN_PTR_SIZE(accel, sizeof(*accel));
+	free(accel);
+}
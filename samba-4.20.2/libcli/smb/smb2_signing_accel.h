@@ -0,0 +1,63 @@
+/*
+   Unix SMB/CIFS implementation.
+   SMB2 signing, AES-NI/PCLMULQDQ engine for AES-CMAC and AES-GMAC
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LIBCLI_SMB_SMB2_SIGNING_ACCEL_H__
+#define __LIBCLI_SMB_SMB2_SIGNING_ACCEL_H__
+
+struct iovec;
+struct smb2_signing_accel;
+
+/*
+ * Returns true if the CPU supports the engine and it
+ * is not disabled by smb2_signing_accel_set_enabled().
+ */
+bool smb2_signing_accel_available(void);
+
+/*
+ * Process wide switch, used by the benchmark to compare
+ * against the gnutls code path. Only affects keys
+ * that don't have an engine attached yet.
+ */
+void smb2_signing_accel_set_enabled(bool enabled);
+
+/*
+ * Precomputes the AES key schedule and the CMAC subkeys
+ * or GHASH powers for a 128 bit key.
+ *
+ * Returns NULL if the engine is not available or does not
+ * support sign_algo_id, the caller falls back to gnutls then.
+ *
+ * This does not use talloc, so it can be called from
+ * worker threads.
+ */
+struct smb2_signing_accel *smb2_signing_accel_create(uint16_t sign_algo_id,
+						     const uint8_t *key,
+						     size_t key_len);
+void smb2_signing_accel_destroy(struct smb2_signing_accel *accel);
+
+/*
+ * Calculates the 16 byte AES-CMAC or AES-GMAC tag over all
+ * elements of vector. iv is only used (12 bytes) for GMAC.
+ */
+void smb2_signing_accel_tag(struct smb2_signing_accel *accel,
+			    const uint8_t *iv,
+			    const struct iovec *vector,
+			    int count,
+			    uint8_t tag[16]);
+
+#endif /* __LIBCLI_SMB_SMB2_SIGNING_ACCEL_H__ */
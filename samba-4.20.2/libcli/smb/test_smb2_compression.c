@@ -0,0 +1,301 @@
+/*
+ * Unix SMB/CIFS implementation.
+ *
+ * Tests for the SMB2 compression transform
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "lib/replace/replace.h"
+#include "lib/util/iov_buf.h"
+#include "lib/util/byteorder.h"
+#include "libcli/util/ntstatus.h"
+#include <talloc.h>
+
+#include "libcli/smb/smb2_constants.h"
+#include "libcli/smb/smb2_compression.h"
+
+#define TEST_PREFIX_LEN (SMB2_HDR_BODY + 0x10)
+
+/*
+ * Something that looks a bit like a text file, with runs of zeros
+ * at both ends.
+ */
+static uint8_t *make_data(TALLOC_CTX *mem_ctx,
+			  size_t len,
+			  size_t lead,
+			  size_t trail)
+{
+	static const char *words[] = {
+		"samba ", "share ", "file ", "read ", "write ", "lock ",
+		"oplock ", "lease ", "tree ", "connect\n",
+	};
+	uint8_t *data = talloc_zero_array(mem_ctx, uint8_t, len);
+	size_t i = lead;
+	size_t w = 0;
+
+	assert_non_null(data);
+
+	while (i < len - trail) {
+		const char *s = words[(w * 7 + w / 3) % ARRAY_SIZE(words)];
+		size_t n = MIN(strlen(s), len - trail - i);
+
+		memcpy(data + i, s, n);
+		i += n;
+		w++;
+	}
+	return data;
+}
+
+static void round_trip(const uint16_t *algos,
+		       size_t num_algos,
+		       bool chained,
+		       size_t len,
+		       size_t lead,
+		       size_t trail)
+{
+	TALLOC_CTX *mem_ctx = talloc_new(NULL);
+	struct smb2_compression_ctx *ctx = NULL;
+	uint8_t prefix[TEST_PREFIX_LEN];
+	struct iovec iov = {
+		.iov_base = prefix,
+		.iov_len = sizeof(prefix),
+	};
+	uint8_t *data = NULL;
+	DATA_BLOB compressed;
+	DATA_BLOB decompressed;
+	NTSTATUS status;
+	size_t i;
+
+	for (i = 0; i < sizeof(prefix); i++) {
+		prefix[i] = i * 37 + 11;
+	}
+	data = make_data(mem_ctx, len, lead, trail);
+
+	ctx = smb2_compression_ctx_create(mem_ctx, algos, num_algos,
+					  chained, 0);
+	assert_non_null(ctx);
+
+	assert_true(smb2_compression_worthwhile(data, len));
+
+	status = smb2_compression_compress(ctx, mem_ctx, &iov, 1,
+					   data, len, &compressed);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_int_not_equal(compressed.length, 0);
+	assert_true(compressed.length < sizeof(prefix) + len);
+	assert_int_equal(IVAL(compressed.data, SMB2_COMP_PROTOCOL_ID),
+			 SMB2_COMP_MAGIC);
+
+	status = smb2_compression_decompress(mem_ctx,
+					     compressed.data,
+					     compressed.length,
+					     algos,
+					     num_algos,
+					     chained,
+					     sizeof(prefix) + len,
+					     &decompressed);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_int_equal(decompressed.length, sizeof(prefix) + len);
+	assert_memory_equal(decompressed.data, prefix, sizeof(prefix));
+	assert_memory_equal(decompressed.data + sizeof(prefix), data, len);
+
+	/* one byte short of the real size */
+	status = smb2_compression_decompress(mem_ctx,
+					     compressed.data,
+					     compressed.length,
+					     algos,
+					     num_algos,
+					     chained,
+					     sizeof(prefix) + len - 1,
+					     &decompressed);
+	assert_false(NT_STATUS_IS_OK(status));
+
+	TALLOC_FREE(mem_ctx);
+}
+
+static void test_unchained_lz77(void **state)
+{
+	uint16_t algos[] = { SMB2_COMPRESSION_LZ77 };
+
+	round_trip(algos, ARRAY_SIZE(algos), false, 100000, 0, 0);
+}
+
+static void test_unchained_huffman(void **state)
+{
+	uint16_t algos[] = { SMB2_COMPRESSION_LZ77_HUFFMAN };
+
+	round_trip(algos, ARRAY_SIZE(algos), false, 200000, 0, 0);
+}
+
+static void test_chained_pattern(void **state)
+{
+	uint16_t algos[] = {
+		SMB2_COMPRESSION_LZ77_HUFFMAN,
+		SMB2_COMPRESSION_PATTERN_V1,
+	};
+
+	round_trip(algos, ARRAY_SIZE(algos), true, 150000, 5000, 7000);
+	round_trip(algos, ARRAY_SIZE(algos), true, 150000, 0, 7000);
+	round_trip(algos, ARRAY_SIZE(algos), true, 150000, 10, 0);
+}
+
+static void test_chained_pattern_only(void **state)
+{
+	uint16_t algos[] = { SMB2_COMPRESSION_PATTERN_V1 };
+
+	round_trip(algos, ARRAY_SIZE(algos), true, 8192, 4000, 4000);
+}
+
+static void test_not_worthwhile(void **state)
+{
+	TALLOC_CTX *mem_ctx = talloc_new(NULL);
+	uint16_t algos[] = { SMB2_COMPRESSION_LZ77 };
+	struct smb2_compression_ctx *ctx = NULL;
+	uint8_t prefix[TEST_PREFIX_LEN] = { 0, };
+	struct iovec iov = {
+		.iov_base = prefix,
+		.iov_len = sizeof(prefix),
+	};
+	size_t len = 65536;
+	uint8_t *data = talloc_array(mem_ctx, uint8_t, len);
+	uint32_t x = 0x12345678;
+	DATA_BLOB compressed;
+	NTSTATUS status;
+	size_t i;
+
+	assert_non_null(data);
+	for (i = 0; i < len; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 23;
+	}
+
+	assert_false(smb2_compression_worthwhile(data, len));
+
+	ctx = smb2_compression_ctx_create(mem_ctx, algos, ARRAY_SIZE(algos),
+					  false, 0);
+	assert_non_null(ctx);
+
+	status = smb2_compression_compress(ctx, mem_ctx, &iov, 1,
+					   data, len, &compressed);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_int_equal(compressed.length, 0);
+
+	TALLOC_FREE(mem_ctx);
+}
+
+static void test_bad_input(void **state)
+{
+	TALLOC_CTX *mem_ctx = talloc_new(NULL);
+	uint16_t lz77[] = { SMB2_COMPRESSION_LZ77 };
+	uint16_t pattern[] = { SMB2_COMPRESSION_PATTERN_V1 };
+	uint16_t lznt1[] = { SMB2_COMPRESSION_LZNT1 };
+	uint8_t buf[SMB2_COMP_CHAINED_HDR_SIZE +
+		    SMB2_COMP_PAYLOAD_HDR_SIZE +
+		    SMB2_COMP_PATTERN_SIZE] = { 0, };
+	DATA_BLOB out;
+	NTSTATUS status;
+
+	assert_null(smb2_compression_ctx_create(mem_ctx, lznt1, 1, true, 0));
+	assert_null(smb2_compression_ctx_create(mem_ctx, pattern, 1,
+						false, 0));
+
+	/* a chained message with a single 100 byte pattern */
+	SIVAL(buf, SMB2_COMP_PROTOCOL_ID, SMB2_COMP_MAGIC);
+	SIVAL(buf, SMB2_COMP_ORIG_SIZE, 100);
+	SSVAL(buf, 8 + SMB2_COMP_PAYLOAD_ALGORITHM,
+	      SMB2_COMPRESSION_PATTERN_V1);
+	SSVAL(buf, 8 + SMB2_COMP_PAYLOAD_FLAGS,
+	      SMB2_COMPRESSION_FLAG_CHAINED);
+	SIVAL(buf, 8 + SMB2_COMP_PAYLOAD_LENGTH, SMB2_COMP_PATTERN_SIZE);
+	SCVAL(buf, 16 + SMB2_COMP_PATTERN_PATTERN, 'x');
+	SIVAL(buf, 16 + SMB2_COMP_PATTERN_REPETITIONS, 100);
+
+	status = smb2_compression_decompress(mem_ctx, buf, sizeof(buf),
+					     pattern, 1, true, 1000, &out);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_int_equal(out.length, 100);
+	assert_int_equal(out.data[99], 'x');
+
+	/* not negotiated */
+	status = smb2_compression_decompress(mem_ctx, buf, sizeof(buf),
+					     lz77, 1, true, 1000, &out);
+	assert_true(NT_STATUS_EQUAL(status,
+				    NT_STATUS_UNSUPPORTED_COMPRESSION));
+	status = smb2_compression_decompress(mem_ctx, buf, sizeof(buf),
+					     pattern, 1, false, 1000, &out);
+	assert_false(NT_STATUS_IS_OK(status));
+
+	/* more repetitions than the original size */
+	SIVAL(buf, 16 + SMB2_COMP_PATTERN_REPETITIONS, 101);
+	status = smb2_compression_decompress(mem_ctx, buf, sizeof(buf),
+					     pattern, 1, true, 1000, &out);
+	assert_true(NT_STATUS_EQUAL(status,
+				    NT_STATUS_BAD_COMPRESSION_BUFFER));
+
+	/* fewer */
+	SIVAL(buf, 16 + SMB2_COMP_PATTERN_REPETITIONS, 99);
+	status = smb2_compression_decompress(mem_ctx, buf, sizeof(buf),
+					     pattern, 1, true, 1000, &out);
+	assert_true(NT_STATUS_EQUAL(status,
+				    NT_STATUS_BAD_COMPRESSION_BUFFER));
+
+	/* payload length beyond the end of the buffer */
+	SIVAL(buf, 16 + SMB2_COMP_PATTERN_REPETITIONS, 100);
+	SIVAL(buf, 8 + SMB2_COMP_PAYLOAD_LENGTH, 9);
+	status = smb2_compression_decompress(mem_ctx, buf, sizeof(buf),
+					     pattern, 1, true, 1000, &out);
+	assert_false(NT_STATUS_IS_OK(status));
+
+	/* too large */
+	SIVAL(buf, 8 + SMB2_COMP_PAYLOAD_LENGTH, SMB2_COMP_PATTERN_SIZE);
+	status = smb2_compression_decompress(mem_ctx, buf, sizeof(buf),
+					     pattern, 1, true, 99, &out);
+	assert_false(NT_STATUS_IS_OK(status));
+
+	/* bad magic */
+	SIVAL(buf, SMB2_COMP_PROTOCOL_ID, SMB2_MAGIC);
+	status = smb2_compression_decompress(mem_ctx, buf, sizeof(buf),
+					     pattern, 1, true, 1000, &out);
+	assert_false(NT_STATUS_IS_OK(status));
+
+	TALLOC_FREE(mem_ctx);
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_unchained_lz77),
+		cmocka_unit_test(test_unchained_huffman),
+		cmocka_unit_test(test_chained_pattern),
+		cmocka_unit_test(test_chained_pattern_only),
+		cmocka_unit_test(test_not_worthwhile),
+		cmocka_unit_test(test_bad_input),
+	};
+
+	if (argc == 2) {
+		cmocka_set_test_filter(argv[1]);
+	}
+	cmocka_set_message_output(CM_OUTPUT_SUBUNIT);
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+
+	return rc;
+}
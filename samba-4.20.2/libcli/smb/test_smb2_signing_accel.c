@@ -0,0 +1,229 @@
+/*
+ * Unix SMB/CIFS implementation.
+ *
+ * Tests for the AES-CMAC/AES-GMAC signing engine
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "lib/replace/replace.h"
+#include "lib/util/iov_buf.h"
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include "libcli/smb/smb2_constants.h"
+#include "libcli/smb/smb2_signing_accel.h"
+
+static const uint8_t rfc4493_key[16] = {
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+	0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+
+static const uint8_t rfc4493_msg[64] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+	0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+	0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+	0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+	0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+
+static const struct {
+	size_t len;
+	uint8_t tag[16];
+} rfc4493_tags[] = {
+	{
+		.len = 0,
+		.tag = {
+			0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28,
+			0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46,
+		},
+	},
+	{
+		.len = 16,
+		.tag = {
+			0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44,
+			0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c,
+		},
+	},
+	{
+		.len = 40,
+		.tag = {
+			0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30,
+			0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27,
+		},
+	},
+	{
+		.len = 64,
+		.tag = {
+			0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92,
+			0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe,
+		},
+	},
+};
+
+static int setup(void **state)
+{
+	if (!smb2_signing_accel_available()) {
+		skip();
+	}
+	return 0;
+}
+
+static void test_cmac_rfc4493(void **state)
+{
+	struct smb2_signing_accel *accel = NULL;
+	size_t i;
+
+	accel = smb2_signing_accel_create(SMB2_SIGNING_AES128_CMAC,
+					  rfc4493_key,
+					  sizeof(rfc4493_key));
+	assert_non_null(accel);
+
+	for (i = 0; i < ARRAY_SIZE(rfc4493_tags); i++) {
+		struct iovec iov = {
+			.iov_base = discard_const_p(uint8_t, rfc4493_msg),
+			.iov_len = rfc4493_tags[i].len,
+		};
+		uint8_t tag[16];
+
+		smb2_signing_accel_tag(accel, NULL, &iov, 1, tag);
+		assert_memory_equal(tag, rfc4493_tags[i].tag, sizeof(tag));
+	}
+
+	smb2_signing_accel_destroy(accel);
+}
+
+/*
+ * Compares the engine against gnutls for all lengths up to
+ * 300 bytes, with the data split over three iovecs at
+ * varying offsets.
+ */
+static void test_against_gnutls(uint16_t sign_algo_id)
+{
+	struct smb2_signing_accel *accel = NULL;
+	uint8_t key[16];
+	uint8_t iv[12];
+	uint8_t data[300];
+	size_t len;
+	size_t i;
+
+	for (i = 0; i < sizeof(key); i++) {
+		key[i] = i * 7 + 1;
+	}
+	for (i = 0; i < sizeof(iv); i++) {
+		iv[i] = i * 13 + 5;
+	}
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = i * 31 + 3;
+	}
+
+	accel = smb2_signing_accel_create(sign_algo_id, key, sizeof(key));
+	assert_non_null(accel);
+
+	for (len = 0; len <= sizeof(data); len++) {
+		uint8_t expected[16];
+		size_t a = len / 3;
+		size_t b = (len * 2) / 3;
+		struct iovec iov[3] = {
+			{ .iov_base = data, .iov_len = a },
+			{ .iov_base = data + a, .iov_len = b - a },
+			{ .iov_base = data + b, .iov_len = len - b },
+		};
+		uint8_t tag[16];
+		int rc;
+
+		if (sign_algo_id == SMB2_SIGNING_AES128_CMAC) {
+			rc = gnutls_hmac_fast(GNUTLS_MAC_AES_CMAC_128,
+					      key, sizeof(key),
+					      data, len,
+					      expected);
+			assert_int_equal(rc, 0);
+		} else {
+			gnutls_aead_cipher_hd_t hnd = NULL;
+			gnutls_datum_t k = {
+				.data = key,
+				.size = sizeof(key),
+			};
+			size_t expected_len = sizeof(expected);
+
+			rc = gnutls_aead_cipher_init(&hnd,
+						     GNUTLS_CIPHER_AES_128_GCM,
+						     &k);
+			assert_int_equal(rc, 0);
+			rc = gnutls_aead_cipher_encrypt(hnd,
+							iv, sizeof(iv),
+							data, len,
+							sizeof(expected),
+							NULL, 0,
+							expected,
+							&expected_len);
+			assert_int_equal(rc, 0);
+			gnutls_aead_cipher_deinit(hnd);
+		}
+
+		smb2_signing_accel_tag(accel, iv, iov, ARRAY_SIZE(iov), tag);
+		assert_memory_equal(tag, expected, sizeof(tag));
+	}
+
+	smb2_signing_accel_destroy(accel);
+}
+
+static void test_cmac_against_gnutls(void **state)
+{
+	test_against_gnutls(SMB2_SIGNING_AES128_CMAC);
+}
+
+static void test_gmac_against_gnutls(void **state)
+{
+	test_against_gnutls(SMB2_SIGNING_AES128_GMAC);
+}
+
+static void test_unsupported_algo(void **state)
+{
+	struct smb2_signing_accel *accel = NULL;
+
+	accel = smb2_signing_accel_create(SMB2_SIGNING_HMAC_SHA256,
+					  rfc4493_key,
+					  sizeof(rfc4493_key));
+	assert_null(accel);
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup(test_cmac_rfc4493, setup),
+		cmocka_unit_test_setup(test_cmac_against_gnutls, setup),
+		cmocka_unit_test_setup(test_gmac_against_gnutls, setup),
+		cmocka_unit_test_setup(test_unsupported_algo, setup),
+	};
+
+	if (argc == 2) {
+		cmocka_set_test_filter(argv[1]);
+	}
+	cmocka_set_message_output(CM_OUTPUT_SUBUNIT);
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+
+	return rc;
+}
@@ -18,18 +18,38 @@
 """Tests limits on processes forked by fork on accept in the standard process
    model.
    NOTE: This test runs in an environment with an artificially low setting for
-         smbd max processes
+         smbd max processes. Only the LDAP server uses the standard process
+         model there ("process model:ldap = standard"), the other services
+         use prefork.
 """
 
 
 import os
 from samba.tests import TestCase
 from samba.samdb import SamDB
+from samba.messaging import Messaging
 from ldb import LdbError, ERR_OPERATIONS_ERROR
 
 
 class StandardModelProcessLimitTests(TestCase):
 
+    def setUp(self):
+        super().setUp()
+        lp_ctx = self.get_loadparm()
+        self.msg_ctx = Messaging(lp_ctx=lp_ctx)
+
+    def get_pids(self, name):
+        pids = set()
+        for service in self.msg_ctx.irpc_all_servers():
+            if service.name == name:
+                for id in service.ids:
+                    pids.add(id.pid)
+        return pids
+
+    def get_names(self, prefix):
+        services = self.msg_ctx.irpc_all_servers()
+        return [s.name for s in services if s.name.startswith(prefix)]
+
     def simple_bind(self):
         creds = self.insta_creds(template=self.get_credentials())
         creds.set_bind_dn("%s\\%s" % (creds.get_domain(),
@@ -68,3 +88,20 @@ class StandardModelProcessLimitTests(TestCase):
         # release any resources and close the actual connection to the server.
         for c in connections:
             del c
+
+    def test_ldap_process_model(self):
+        # The other services run in the prefork process model
+        self.assertNotEqual([], self.get_names("prefork-master-"))
+
+        # but the LDAP server doesn't
+        self.assertEqual([], self.get_names("prefork-master-ldap"))
+        self.assertEqual([], self.get_names("prefork-worker-ldap-"))
+
+        # and gets a new process for each connection
+        before = self.get_pids("ldap_server")
+        connections = [self.simple_bind(), self.simple_bind()]
+        after = self.get_pids("ldap_server")
+        self.assertGreaterEqual(len(after - before), 2)
+
+        for c in connections:
+            del c
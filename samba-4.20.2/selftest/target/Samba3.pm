@@ -425,6 +425,7 @@ sub setup_nt4_member
 	security = domain
 	dbwrap_tdb_mutexes:* = yes
 	${require_mutexes}
+	dbwrap_tdb_rehash_hash_size:* = 3
 ";
 	my $ret = $self->provision(
 	    prefix => $prefix,
@@ -3013,7 +3013,8 @@ sub setup_preforkrestartdc
 #
 # ad_dc test environment used solely to test standard process model connection
 # process limits. As the limit is set artificially low it should not be used
-# for other tests.
+# for other tests. Only the LDAP server runs in the standard process model,
+# the others use prefork, to test "process model:<service>".
 sub setup_proclimitdc
 {
 	my ($self, $path) = @_;
@@ -3028,7 +3029,7 @@ sub setup_proclimitdc
 					 "PROCLIMITDOM",
 					 "proclimit.samba.example.com",
 					 undef,
-					 "max smbd processes = 20",
+					 "max smbd processes = 20\nprocess model:ldap = standard",
 					 undef);
 	unless ($env) {
 		return undef;
@@ -3037,7 +3038,7 @@ sub setup_proclimitdc
 	$env->{NSS_WRAPPER_MODULE_SO_PATH} = undef;
 	$env->{NSS_WRAPPER_MODULE_FN_PREFIX} = undef;
 
-	if (not defined($self->check_or_start($env, "standard"))) {
+	if (not defined($self->check_or_start($env, "prefork"))) {
 	    return undef;
 	}
 
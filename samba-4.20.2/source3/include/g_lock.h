@@ -41,6 +41,15 @@ struct g_lock_ctx *g_lock_ctx_init_backend(
 	struct db_context **backend);
 void g_lock_set_lock_order(struct g_lock_ctx *ctx,
 			   enum dbwrap_lock_order lock_order);
+
+/*
+ * Queue G_LOCK_READ and G_LOCK_WRITE waiters in the record and hand
+ * the lock over in order instead of letting them retry. All users of
+ * a database have to agree on this, as the record format differs.
+ * The default comes from "g_lock_fifo:<dbname> = yes" (or
+ * "g_lock_fifo:* = yes") in smb.conf.
+ */
+void g_lock_set_fifo(struct g_lock_ctx *ctx, bool fifo);
 struct g_lock_ctx *g_lock_ctx_init(TALLOC_CTX *mem_ctx,
 				   struct messaging_context *msg);
 
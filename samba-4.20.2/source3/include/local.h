@@ -180,6 +180,13 @@
 #define SMBD_VOLATILE_TDB_FLAGS \
 	(TDB_DEFAULT|TDB_VOLATILE|TDB_CLEAR_IF_FIRST|TDB_INCOMPATIBLE_HASH)
 
+/*
+ * Extra tdb flags for the per open file databases whose size follows
+ * the number of open files: Their hash table grows online instead of
+ * staying at SMBD_VOLATILE_TDB_HASH_SIZE, see db_open().
+ */
+#define SMBD_VOLATILE_TDB_REHASH_FLAGS (TDB_REHASH|TDB_FAST_HASH)
+
 /* Characters we disallow in sharenames. */
 #define INVALID_SHARENAME_CHARS "%<>*?|/\\+=;:\","
 
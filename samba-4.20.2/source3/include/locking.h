@@ -49,10 +49,10 @@ struct files_struct;
 struct byte_range_lock;
 typedef uint64_t br_off;
 
-/* Internal structure in brlock.tdb.
-   The data in brlock records is an unsorted linear array of these
-   records.  It is unnecessary to store the count as tdb provides the
-   size of the record */
+/* Internal structure in brlock_pages.tdb.
+   The data in a page record is a linear array of these records,
+   sorted by start.  It is unnecessary to store the count as tdb
+   provides the size of the record */
 
 struct lock_struct {
 	struct lock_context context;
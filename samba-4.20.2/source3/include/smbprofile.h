@@ -112,6 +112,36 @@ struct tevent_context;
 	SMBPROFILE_STATS_COUNT(statcache_hits) \
 	SMBPROFILE_STATS_SECTION_END \
 	\
+	SMBPROFILE_STATS_SECTION_START(memcache, "Memcache") \
+	SMBPROFILE_STATS_COUNT(memcache_getwd_hits) \
+	SMBPROFILE_STATS_COUNT(memcache_getwd_misses) \
+	SMBPROFILE_STATS_COUNT(memcache_getwd_evictions) \
+	SMBPROFILE_STATS_COUNT(memcache_getrealfilename_hits) \
+	SMBPROFILE_STATS_COUNT(memcache_getrealfilename_misses) \
+	SMBPROFILE_STATS_COUNT(memcache_getrealfilename_evictions) \
+	SMBPROFILE_STATS_COUNT(memcache_getpwnam_hits) \
+	SMBPROFILE_STATS_COUNT(memcache_getpwnam_misses) \
+	SMBPROFILE_STATS_COUNT(memcache_getpwnam_evictions) \
+	SMBPROFILE_STATS_COUNT(memcache_mangle_hash2_hits) \
+	SMBPROFILE_STATS_COUNT(memcache_mangle_hash2_misses) \
+	SMBPROFILE_STATS_COUNT(memcache_mangle_hash2_evictions) \
+	SMBPROFILE_STATS_COUNT(memcache_pdb_getpwsid_hits) \
+	SMBPROFILE_STATS_COUNT(memcache_pdb_getpwsid_misses) \
+	SMBPROFILE_STATS_COUNT(memcache_pdb_getpwsid_evictions) \
+	SMBPROFILE_STATS_COUNT(memcache_singleton_hits) \
+	SMBPROFILE_STATS_COUNT(memcache_singleton_misses) \
+	SMBPROFILE_STATS_COUNT(memcache_singleton_evictions) \
+	SMBPROFILE_STATS_COUNT(memcache_singleton_talloc_hits) \
+	SMBPROFILE_STATS_COUNT(memcache_singleton_talloc_misses) \
+	SMBPROFILE_STATS_COUNT(memcache_singleton_talloc_evictions) \
+	SMBPROFILE_STATS_COUNT(memcache_share_mode_lock_hits) \
+	SMBPROFILE_STATS_COUNT(memcache_share_mode_lock_misses) \
+	SMBPROFILE_STATS_COUNT(memcache_share_mode_lock_evictions) \
+	SMBPROFILE_STATS_COUNT(memcache_dfree_hits) \
+	SMBPROFILE_STATS_COUNT(memcache_dfree_misses) \
+	SMBPROFILE_STATS_COUNT(memcache_dfree_evictions) \
+	SMBPROFILE_STATS_SECTION_END \
+	\
 	SMBPROFILE_STATS_SECTION_START(SMB, "SMB Calls") \
 	SMBPROFILE_STATS_BASIC(SMBmkdir) \
 	SMBPROFILE_STATS_BASIC(SMBrmdir) \
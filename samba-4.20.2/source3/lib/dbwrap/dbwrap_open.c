@@ -127,6 +127,79 @@ struct db_context *db_open(TALLOC_CTX *mem_ctx,
 		}
 	}
 
+	if (tdb_flags & TDB_REHASH) {
+		bool try_rehash = true;
+		bool try_fast_hash = true;
+
+		/*
+		 * Callers ask for the growing hash table on
+		 * CLEAR_IF_FIRST databases only, so older tdb
+		 * versions never see such a file. Allow to switch it
+		 * off per database, e.g. to compare performance.
+		 */
+		try_rehash = lp_parm_bool(-1, "dbwrap_tdb_rehash", "*",
+					  try_rehash);
+		try_rehash = lp_parm_bool(-1, "dbwrap_tdb_rehash", base,
+					  try_rehash);
+		try_fast_hash = lp_parm_bool(-1, "dbwrap_tdb_fast_hash", "*",
+					     try_fast_hash);
+		try_fast_hash = lp_parm_bool(-1, "dbwrap_tdb_fast_hash", base,
+					     try_fast_hash);
+
+		if (try_rehash) {
+			/*
+			 * The table grows with the database, so it
+			 * may start small.
+			 */
+			hash_size = lp_parm_int(-1, "dbwrap_tdb_rehash_hash_size",
+						"*", hash_size);
+			hash_size = lp_parm_int(-1, "dbwrap_tdb_rehash_hash_size",
+						base, hash_size);
+		} else {
+			tdb_flags &= ~TDB_REHASH;
+		}
+		if (!try_fast_hash) {
+			tdb_flags &= ~TDB_FAST_HASH;
+		}
+	}
+
+	if ((open_flags & O_CREAT) && lp_use_mmap()) {
+		bool try_seqlock = false;
+
+		/*
+		 * Lockless readers for read-mostly databases like
+		 * share_info.tdb. This only has an effect when the
+		 * file is created, and older tdb versions can't open
+		 * it afterwards, so it's opt-in.
+		 */
+		try_seqlock = lp_parm_bool(-1, "dbwrap_tdb_seqlock", "*",
+					   try_seqlock);
+		try_seqlock = lp_parm_bool(-1, "dbwrap_tdb_seqlock", base,
+					   try_seqlock);
+
+		if (try_seqlock) {
+			tdb_flags |= TDB_SEQLOCK;
+		}
+	}
+
+	if ((open_flags & O_CREAT) &&
+	    !(tdb_flags & (TDB_CLEAR_IF_FIRST|TDB_MUTEX_LOCKING))) {
+		bool try_wal = false;
+
+		/*
+		 * Persistent databases committing many transactions,
+		 * like registry.tdb or passdb.tdb, sync a write-ahead
+		 * log instead of the file. Like the seqlock this is
+		 * fixed when the file is created.
+		 */
+		try_wal = lp_parm_bool(-1, "dbwrap_tdb_wal", "*", try_wal);
+		try_wal = lp_parm_bool(-1, "dbwrap_tdb_wal", base, try_wal);
+
+		if (try_wal) {
+			tdb_flags |= TDB_WAL;
+		}
+	}
+
 	if (lp_clustering()) {
 		const char *sockname;
 
@@ -143,6 +216,12 @@ struct db_context *db_open(TALLOC_CTX *mem_ctx,
 			struct messaging_context *msg_ctx;
 			struct ctdbd_connection *conn;
 
+			/*
+			 * ctdbd owns the local copies of its databases,
+			 * they can't be renamed away under it.
+			 */
+			tdb_flags &= ~(TDB_REHASH|TDB_FAST_HASH);
+
 			/*
 			 * Initialize messaging before getting the ctdb
 			 * connection, as the ctdb connection requires messaging
@@ -30,32 +30,57 @@
 #include "g_lock.h"
 #include "util_tdb.h"
 #include "../lib/util/tevent_ntstatus.h"
+#include "../libcli/util/error.h"
 #include "messages.h"
 #include "serverid.h"
+#include "server_id_watch.h"
+#include "source3/param/loadparm.h"
 
 struct g_lock_ctx {
 	struct db_context *db;
 	struct messaging_context *msg;
 	enum dbwrap_lock_order lock_order;
 	bool busy;
+	bool fifo;
 };
 
+/*
+ * In fifo mode waiters queue up in the record itself. An unlocker
+ * hands the lock over directly to the first waiter (or the first
+ * batch of read waiters) and sends them MSG_DBWRAP_G_LOCK_GRANTED.
+ */
+struct g_lock_waiter {
+	struct server_id pid;
+	uint64_t instance;
+	enum g_lock_type type;
+};
+
+#define G_LOCK_WAITER_BUF_LENGTH \
+	(SERVER_ID_BUF_LENGTH + sizeof(uint64_t) + sizeof(uint8_t))
+
 struct g_lock {
 	struct server_id exclusive;
 	size_t num_shared;
 	uint8_t *shared;
+	size_t num_waiters;
+	uint8_t *waiters;
 	uint64_t unique_lock_epoch;
 	uint64_t unique_data_epoch;
 	size_t datalen;
 	uint8_t *data;
 };
 
-static bool g_lock_parse(uint8_t *buf, size_t buflen, struct g_lock *lck)
+static bool g_lock_parse(uint8_t *buf,
+			 size_t buflen,
+			 bool fifo,
+			 struct g_lock *lck)
 {
 	struct server_id exclusive;
 	size_t num_shared, shared_len;
 	uint64_t unique_lock_epoch;
 	uint64_t unique_data_epoch;
+	size_t num_waiters = 0, waiters_len = 0;
+	uint8_t *waiters = NULL;
 
 	if (buflen < (SERVER_ID_BUF_LENGTH + /* exclusive */
 		      sizeof(uint64_t) +     /* seqnum */
@@ -93,15 +118,43 @@ static bool g_lock_parse(uint8_t *buf, size_t buflen, struct g_lock *lck)
 	}
 
 	shared_len = num_shared * SERVER_ID_BUF_LENGTH;
+	waiters = buf + shared_len;
+
+	/*
+	 * Only fifo databases have the waiter queue, the others keep
+	 * the record format without it.
+	 */
+	if (fifo) {
+		if ((buflen - shared_len) < sizeof(uint32_t)) {
+			DBG_DEBUG("No waiters count, buflen=%zu\n", buflen);
+			return false;
+		}
+
+		num_waiters = IVAL(waiters, 0);
+		waiters += sizeof(uint32_t);
+
+		if (num_waiters > (buflen - shared_len - sizeof(uint32_t)) /
+		    G_LOCK_WAITER_BUF_LENGTH) {
+			DBG_DEBUG("num_waiters=%zu, buflen=%zu\n",
+				  num_waiters,
+				  buflen);
+			return false;
+		}
+
+		waiters_len = sizeof(uint32_t) +
+			      num_waiters * G_LOCK_WAITER_BUF_LENGTH;
+	}
 
 	*lck = (struct g_lock) {
 		.exclusive = exclusive,
 		.num_shared = num_shared,
 		.shared = buf,
+		.num_waiters = num_waiters,
+		.waiters = waiters,
 		.unique_lock_epoch = unique_lock_epoch,
 		.unique_data_epoch = unique_data_epoch,
-		.datalen = buflen-shared_len,
-		.data = buf+shared_len,
+		.datalen = buflen - shared_len - waiters_len,
+		.data = buf + shared_len + waiters_len,
 	};
 
 	return true;
@@ -130,10 +183,212 @@ static void g_lock_del_shared(struct g_lock *lck, size_t i)
 	}
 }
 
+static void g_lock_waiter_get(struct g_lock_waiter *w, const uint8_t *buf)
+{
+	server_id_get(&w->pid, buf);
+	w->instance = BVAL(buf, SERVER_ID_BUF_LENGTH);
+	w->type = CVAL(buf, SERVER_ID_BUF_LENGTH + sizeof(uint64_t));
+}
+
+static void g_lock_waiter_put(uint8_t buf[G_LOCK_WAITER_BUF_LENGTH],
+			      const struct g_lock_waiter *w)
+{
+	server_id_put(buf, w->pid);
+	SBVAL(buf, SERVER_ID_BUF_LENGTH, w->instance);
+	SCVAL(buf, SERVER_ID_BUF_LENGTH + sizeof(uint64_t), w->type);
+}
+
+static void g_lock_get_waiter(const struct g_lock *lck,
+			      size_t i,
+			      struct g_lock_waiter *waiter)
+{
+	if (i >= lck->num_waiters) {
+		abort();
+	}
+	g_lock_waiter_get(waiter, lck->waiters + i*G_LOCK_WAITER_BUF_LENGTH);
+}
+
+static void g_lock_del_waiter(struct g_lock *lck, size_t i)
+{
+	if (i >= lck->num_waiters) {
+		abort();
+	}
+	if (i == 0) {
+		lck->waiters += G_LOCK_WAITER_BUF_LENGTH;
+		lck->num_waiters -= 1;
+		return;
+	}
+	/*
+	 * Unlike the shared holders the waiters are ordered
+	 */
+	memmove(lck->waiters + i*G_LOCK_WAITER_BUF_LENGTH,
+		lck->waiters + (i+1)*G_LOCK_WAITER_BUF_LENGTH,
+		(lck->num_waiters - i - 1) * G_LOCK_WAITER_BUF_LENGTH);
+	lck->num_waiters -= 1;
+}
+
+static ssize_t g_lock_find_waiter(const struct g_lock *lck,
+				  const struct server_id *self,
+				  uint64_t instance)
+{
+	size_t i;
+
+	for (i=0; i<lck->num_waiters; i++) {
+		struct g_lock_waiter w;
+
+		g_lock_get_waiter(lck, i, &w);
+
+		if ((w.instance == instance) &&
+		    server_id_equal(self, &w.pid)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Hand the lock over to the waiters at the head of the queue if
+ * they don't conflict with the current holders: Either one writer
+ * or all readers up to the next writer. The granted waiters are
+ * appended to *pgranted, to be notified by g_lock_send_grants()
+ * once the record is stored.
+ */
+static NTSTATUS g_lock_grant_waiters(TALLOC_CTX *mem_ctx,
+				     struct g_lock *lck,
+				     struct g_lock_waiter **pgranted,
+				     size_t *pnum_granted)
+{
+	struct g_lock_waiter *granted = *pgranted;
+	size_t num_granted = *pnum_granted;
+	struct g_lock_waiter head;
+	uint8_t *shared = NULL;
+	size_t i, num_readers = 0;
+
+	if (lck->num_waiters == 0) {
+		return NT_STATUS_OK;
+	}
+	if (lck->exclusive.pid != 0) {
+		return NT_STATUS_OK;
+	}
+
+	g_lock_get_waiter(lck, 0, &head);
+
+	if (head.type == G_LOCK_WRITE) {
+		if (lck->num_shared != 0) {
+			return NT_STATUS_OK;
+		}
+
+		granted = talloc_realloc(
+			mem_ctx, granted, struct g_lock_waiter, num_granted+1);
+		if (granted == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+		granted[num_granted] = head;
+
+		lck->exclusive = head.pid;
+		g_lock_del_waiter(lck, 0);
+
+		*pgranted = granted;
+		*pnum_granted = num_granted + 1;
+		return NT_STATUS_OK;
+	}
+
+	while (num_readers < lck->num_waiters) {
+		struct g_lock_waiter w;
+
+		g_lock_get_waiter(lck, num_readers, &w);
+		if (w.type != G_LOCK_READ) {
+			break;
+		}
+		num_readers += 1;
+	}
+
+	granted = talloc_realloc(mem_ctx,
+				 granted,
+				 struct g_lock_waiter,
+				 num_granted + num_readers);
+	if (granted == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+	*pgranted = granted;
+
+	/*
+	 * Hang the new shared array off the granted array, so that
+	 * the caller just has to free that after g_lock_store().
+	 */
+	shared = talloc_array(
+		granted,
+		uint8_t,
+		(lck->num_shared + num_readers) * SERVER_ID_BUF_LENGTH);
+	if (shared == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+	if (lck->num_shared != 0) {
+		memcpy(shared,
+		       lck->shared,
+		       lck->num_shared * SERVER_ID_BUF_LENGTH);
+	}
+
+	for (i=0; i<num_readers; i++) {
+		struct g_lock_waiter *w = &granted[num_granted + i];
+
+		g_lock_get_waiter(lck, i, w);
+		server_id_put(
+			shared + (lck->num_shared + i) * SERVER_ID_BUF_LENGTH,
+			w->pid);
+	}
+
+	lck->shared = shared;
+	lck->num_shared += num_readers;
+	lck->waiters += num_readers * G_LOCK_WAITER_BUF_LENGTH;
+	lck->num_waiters -= num_readers;
+
+	*pnum_granted = num_granted + num_readers;
+	return NT_STATUS_OK;
+}
+
+static void g_lock_send_grants(struct messaging_context *msg,
+			       const struct g_lock_waiter *granted,
+			       size_t num_granted)
+{
+	size_t i;
+
+	for (i=0; i<num_granted; i++) {
+		const struct g_lock_waiter *w = &granted[i];
+		struct server_id_buf tmp;
+		uint8_t instance_buf[8];
+		NTSTATUS status;
+
+		DBG_DEBUG("Granting %s:%"PRIu64"\n",
+			  server_id_str_buf(w->pid, &tmp),
+			  w->instance);
+
+		SBVAL(instance_buf, 0, w->instance);
+
+		/*
+		 * If the waiter is gone, the next one in the queue
+		 * will find out via server_id_watch_send().
+		 */
+		status = messaging_send_buf(msg,
+					    w->pid,
+					    MSG_DBWRAP_G_LOCK_GRANTED,
+					    instance_buf,
+					    sizeof(instance_buf));
+		if (!NT_STATUS_IS_OK(status)) {
+			DBG_DEBUG("messaging_send_buf to %s failed: %s\n",
+				  server_id_str_buf(w->pid, &tmp),
+				  nt_errstr(status));
+		}
+	}
+}
+
 static NTSTATUS g_lock_store(
 	struct db_record *rec,
+	bool fifo,
 	struct g_lock *lck,
 	struct server_id *new_shared,
+	const struct g_lock_waiter *new_waiter,
 	const TDB_DATA *new_dbufs,
 	size_t num_new_dbufs)
 {
@@ -141,8 +396,11 @@ static NTSTATUS g_lock_store(
 	uint8_t seqnum_buf[sizeof(uint64_t)*2];
 	uint8_t sizebuf[sizeof(uint32_t)];
 	uint8_t new_shared_buf[SERVER_ID_BUF_LENGTH];
+	uint8_t waiters_sizebuf[sizeof(uint32_t)];
+	uint8_t new_waiter_buf[G_LOCK_WAITER_BUF_LENGTH];
+	size_t num_waiters = lck->num_waiters;
 
-	struct TDB_DATA dbufs[6 + num_new_dbufs];
+	struct TDB_DATA dbufs[9 + num_new_dbufs];
 
 	dbufs[0] = (TDB_DATA) {
 		.dptr = exclusive, .dsize = sizeof(exclusive),
@@ -159,11 +417,19 @@ static NTSTATUS g_lock_store(
 	};
 	dbufs[4] = (TDB_DATA) { 0 };
 	dbufs[5] = (TDB_DATA) {
+		.dptr = waiters_sizebuf, .dsize = sizeof(waiters_sizebuf),
+	};
+	dbufs[6] = (TDB_DATA) {
+		.dptr = lck->waiters,
+		.dsize = lck->num_waiters * G_LOCK_WAITER_BUF_LENGTH,
+	};
+	dbufs[7] = (TDB_DATA) { 0 };
+	dbufs[8] = (TDB_DATA) {
 		.dptr = lck->data, .dsize = lck->datalen,
 	};
 
 	if (num_new_dbufs != 0) {
-		memcpy(&dbufs[6],
+		memcpy(&dbufs[9],
 		       new_dbufs,
 		       num_new_dbufs * sizeof(TDB_DATA));
 	}
@@ -189,6 +455,28 @@ static NTSTATUS g_lock_store(
 
 	SIVAL(sizebuf, 0, lck->num_shared);
 
+	if (new_waiter != NULL) {
+		if (num_waiters >= UINT32_MAX) {
+			return NT_STATUS_BUFFER_OVERFLOW;
+		}
+
+		g_lock_waiter_put(new_waiter_buf, new_waiter);
+
+		dbufs[7] = (TDB_DATA) {
+			.dptr = new_waiter_buf,
+			.dsize = sizeof(new_waiter_buf),
+		};
+
+		num_waiters += 1;
+	}
+
+	SIVAL(waiters_sizebuf, 0, num_waiters);
+
+	if (!fifo) {
+		SMB_ASSERT(num_waiters == 0);
+		dbufs[5] = (TDB_DATA) { 0 };
+	}
+
 	return dbwrap_record_storev(rec, dbufs, ARRAY_SIZE(dbufs), 0);
 }
 
@@ -199,6 +487,9 @@ struct g_lock_ctx *g_lock_ctx_init_backend(
 {
 	struct g_lock_ctx *result;
 
+	const char *name = NULL;
+	const char *base = NULL;
+
 	result = talloc_zero(mem_ctx, struct g_lock_ctx);
 	if (result == NULL) {
 		return NULL;
@@ -206,6 +497,20 @@ struct g_lock_ctx *g_lock_ctx_init_backend(
 	result->msg = msg;
 	result->lock_order = DBWRAP_LOCK_ORDER_NONE;
 
+	/*
+	 * All processes using a database have to agree on the mode,
+	 * so it's a global option, per database name.
+	 */
+	name = dbwrap_name(*backend);
+	base = strrchr(name, '/');
+	if (base != NULL) {
+		base++;
+	} else {
+		base = name;
+	}
+	result->fifo = lp_parm_bool(-1, "g_lock_fifo", "*", false);
+	result->fifo = lp_parm_bool(-1, "g_lock_fifo", base, result->fifo);
+
 	result->db = db_open_watched(result, backend, msg);
 	if (result->db == NULL) {
 		DBG_WARNING("db_open_watched failed\n");
@@ -221,6 +526,11 @@ void g_lock_set_lock_order(struct g_lock_ctx *ctx,
 	ctx->lock_order = lock_order;
 }
 
+void g_lock_set_fifo(struct g_lock_ctx *ctx, bool fifo)
+{
+	ctx->fifo = fifo;
+}
+
 struct g_lock_ctx *g_lock_ctx_init(TALLOC_CTX *mem_ctx,
 				   struct messaging_context *msg)
 {
@@ -347,6 +657,13 @@ struct g_lock_lock_cb_state {
 	bool existed;
 	bool modified;
 	bool unlock;
+	/*
+	 * We were handed the lock by someone else, the stored record
+	 * already lists us as holder.
+	 */
+	bool must_store;
+	struct g_lock_waiter **granted;
+	size_t *num_granted;
 };
 
 NTSTATUS g_lock_lock_cb_dump(struct g_lock_lock_cb_state *cb_state,
@@ -465,7 +782,7 @@ static void g_lock_lock_cb_watch_data_done_fn(
 	struct g_lock lck;
 	bool ok;
 
-	ok = g_lock_parse(value.dptr, value.dsize, &lck);
+	ok = g_lock_parse(value.dptr, value.dsize, state->ctx->fifo, &lck);
 	if (!ok) {
 		dbwrap_watched_watch_remove_instance(rec, state->watch_instance);
 		state->status = NT_STATUS_INTERNAL_DB_CORRUPTION;
@@ -613,7 +930,7 @@ static NTSTATUS g_lock_lock_cb_run_and_store(struct g_lock_lock_cb_state *cb_sta
 		 */
 		dbwrap_watched_watch_reset_alerting(cb_state->rec);
 		dbwrap_watched_watch_force_alerting(cb_state->rec);
-		if (!cb_state->modified) {
+		if (!cb_state->modified && !cb_state->must_store) {
 			/*
 			 * The record was not changed at
 			 * all, so we can also avoid
@@ -625,7 +942,23 @@ static NTSTATUS g_lock_lock_cb_run_and_store(struct g_lock_lock_cb_state *cb_sta
 		lck->exclusive = (struct server_id) { .pid = 0 };
 		cb_state->new_shared = NULL;
 
-		if (lck->datalen == 0) {
+		if ((lck->num_waiters != 0) && (cb_state->granted != NULL)) {
+			status = g_lock_grant_waiters(cb_state->update_mem_ctx,
+						      lck,
+						      cb_state->granted,
+						      cb_state->num_granted);
+			if (!NT_STATUS_IS_OK(status)) {
+				DBG_WARNING("g_lock_grant_waiters() failed: "
+					    "%s\n",
+					    nt_errstr(status));
+				return status;
+			}
+		}
+
+		if ((lck->exclusive.pid == 0) &&
+		    (lck->num_shared == 0) &&
+		    (lck->num_waiters == 0) &&
+		    (lck->datalen == 0)) {
 			if (!cb_state->existed) {
 				return NT_STATUS_WAS_UNLOCKED;
 			}
@@ -643,9 +976,12 @@ static NTSTATUS g_lock_lock_cb_run_and_store(struct g_lock_lock_cb_state *cb_sta
 	}
 
 	status = g_lock_store(cb_state->rec,
+			      cb_state->ctx->fifo,
 			      cb_state->lck,
 			      cb_state->new_shared,
-			      NULL, 0);
+			      NULL,
+			      NULL,
+			      0);
 	if (!NT_STATUS_IS_OK(status)) {
 		DBG_WARNING("g_lock_store() failed: %s\n",
 			    nt_errstr(status));
@@ -663,6 +999,14 @@ struct g_lock_lock_state {
 	bool retry;
 	g_lock_lock_cb_fn_t cb_fn;
 	void *cb_private;
+
+	/*
+	 * fifo mode: our entry in the waiter queue and the subrequests
+	 * we wait on, all children of fifo_wait
+	 */
+	uint64_t fifo_instance;
+	struct server_id fifo_blocker;
+	TALLOC_CTX *fifo_wait;
 };
 
 struct g_lock_lock_fn_state {
@@ -671,6 +1015,8 @@ struct g_lock_lock_fn_state {
 
 	struct tevent_req *watch_req;
 	uint64_t watch_instance;
+	struct g_lock_waiter *granted;
+	size_t num_granted;
 	NTSTATUS status;
 };
 
@@ -695,12 +1041,17 @@ static NTSTATUS g_lock_trylock(
 		.cb_private = req_state->cb_private,
 		.existed = data.dsize != 0,
 		.update_mem_ctx = talloc_tos(),
+		.granted = &state->granted,
+		.num_granted = &state->num_granted,
 	};
 	struct server_id_buf tmp;
 	NTSTATUS status;
 	bool ok;
 
-	ok = g_lock_parse(data.dptr, data.dsize, &lck);
+	ok = g_lock_parse(data.dptr,
+			  data.dsize,
+			  req_state->ctx->fifo,
+			  &lck);
 	if (!ok) {
 		dbwrap_watched_watch_remove_instance(rec, state->watch_instance);
 		DBG_DEBUG("g_lock_parse failed\n");
@@ -896,7 +1247,8 @@ noexclusive:
 				dbwrap_watched_watch_add_instance(rec);
 		}
 
-		status = g_lock_store(rec, &lck, NULL, NULL, 0);
+		status = g_lock_store(
+			rec, req_state->ctx->fifo, &lck, NULL, NULL, NULL, 0);
 		if (!NT_STATUS_IS_OK(status)) {
 			DBG_DEBUG("g_lock_store() failed: %s\n",
 				  nt_errstr(status));
@@ -920,6 +1272,26 @@ do_shared:
 
 	g_lock_cleanup_shared(&lck);
 	cb_state.new_shared = &self;
+
+	if ((type == G_LOCK_DOWNGRADE) && (lck.num_waiters != 0)) {
+		struct g_lock_waiter head;
+
+		/*
+		 * Let fifo readers queued behind our write lock join
+		 * us. Writers have to wait for our unlock, as we're
+		 * only added to lck.shared by g_lock_store().
+		 */
+		g_lock_get_waiter(&lck, 0, &head);
+		if (head.type == G_LOCK_READ) {
+			status = g_lock_grant_waiters(talloc_tos(),
+						      &lck,
+						      &state->granted,
+						      &state->num_granted);
+			if (!NT_STATUS_IS_OK(status)) {
+				return status;
+			}
+		}
+	}
 	goto got_lock;
 
 got_lock:
@@ -984,6 +1356,527 @@ static int g_lock_lock_state_destructor(struct g_lock_lock_state *s)
 	return 0;
 }
 
+struct g_lock_fifo_fn_state {
+	struct g_lock_lock_state *req_state;
+	struct server_id *dead_blocker;
+	bool check_head;
+	struct server_id blocker;
+	struct g_lock_waiter *granted;
+	size_t num_granted;
+	NTSTATUS status;
+};
+
+static uint64_t g_lock_fifo_new_instance(void)
+{
+	static uint64_t instance = 1;
+	return instance++;
+}
+
+static bool g_lock_fifo_holds(struct g_lock *lck,
+			      struct server_id self,
+			      enum g_lock_type type)
+{
+	if (type == G_LOCK_WRITE) {
+		return server_id_equal(&self, &lck->exclusive);
+	}
+	return (g_lock_find_shared(lck, &self) != -1);
+}
+
+static void g_lock_fifo_lock_fn(
+	struct db_record *rec,
+	TDB_DATA value,
+	void *private_data)
+{
+	struct g_lock_fifo_fn_state *state = private_data;
+	struct g_lock_lock_state *req_state = state->req_state;
+	struct server_id self = messaging_server_id(req_state->ctx->msg);
+	enum g_lock_type type = req_state->type;
+	struct g_lock lck = { .exclusive.pid = 0 };
+	struct g_lock_lock_cb_state cb_state = {
+		.ctx = req_state->ctx,
+		.rec = rec,
+		.lck = &lck,
+		.cb_fn = req_state->cb_fn,
+		.cb_private = req_state->cb_private,
+		.existed = value.dsize != 0,
+		.update_mem_ctx = talloc_tos(),
+		.granted = &state->granted,
+		.num_granted = &state->num_granted,
+	};
+	struct g_lock_waiter new_waiter;
+	struct g_lock_waiter *pnew_waiter = NULL;
+	struct server_id_buf tmp, tmp2;
+	ssize_t idx = -1;
+	NTSTATUS status;
+	bool ok;
+
+	/*
+	 * Lock waiters are not on the dbwrap watcher list, we don't
+	 * need to wake anyone just because the queue changed.
+	 */
+	dbwrap_watched_watch_skip_alerting(rec);
+
+	ok = g_lock_parse(value.dptr,
+			  value.dsize,
+			  req_state->ctx->fifo,
+			  &lck);
+	if (!ok) {
+		DBG_DEBUG("g_lock_parse failed\n");
+		state->status = NT_STATUS_INTERNAL_DB_CORRUPTION;
+		return;
+	}
+
+	g_lock_cleanup_dead(&lck, state->dead_blocker);
+
+	if (state->dead_blocker != NULL) {
+		/*
+		 * g_lock_cleanup_dead() only looks at lck.shared[0],
+		 * which might have been reordered since we picked our
+		 * blocker.
+		 */
+		idx = g_lock_find_shared(&lck, state->dead_blocker);
+		if (idx != -1) {
+			g_lock_del_shared(&lck, idx);
+		}
+		idx = -1;
+	}
+
+	if (state->check_head) {
+		g_lock_cleanup_shared(&lck);
+	}
+
+	/*
+	 * Dead waiters are only looked at by their successor in the
+	 * queue, and by everybody once in a while.
+	 */
+	while (lck.num_waiters != 0) {
+		struct g_lock_waiter head;
+
+		g_lock_get_waiter(&lck, 0, &head);
+
+		if (server_id_equal(&head.pid, &self)) {
+			break;
+		}
+		if ((state->dead_blocker != NULL) &&
+		    server_id_equal(&head.pid, state->dead_blocker)) {
+			DBG_DEBUG("Waiter %s died\n",
+				  server_id_str_buf(head.pid, &tmp));
+			g_lock_del_waiter(&lck, 0);
+			continue;
+		}
+		if (state->check_head && !serverid_exists(&head.pid)) {
+			DBG_DEBUG("Waiter %s died -- removing\n",
+				  server_id_str_buf(head.pid, &tmp));
+			g_lock_del_waiter(&lck, 0);
+			continue;
+		}
+		break;
+	}
+
+	lck.unique_lock_epoch = generate_unique_u64(lck.unique_lock_epoch);
+
+	status = g_lock_grant_waiters(
+		talloc_tos(), &lck, &state->granted, &state->num_granted);
+	if (!NT_STATUS_IS_OK(status)) {
+		state->status = status;
+		return;
+	}
+
+	if (req_state->fifo_instance != 0) {
+		idx = g_lock_find_waiter(&lck, &self, req_state->fifo_instance);
+		if (idx == -1) {
+			size_t i;
+
+			/*
+			 * We're not in the queue anymore, the lock
+			 * has been handed to us. Don't send the grant
+			 * message to ourselves.
+			 */
+			for (i=0; i<state->num_granted; i++) {
+				struct g_lock_waiter *w = &state->granted[i];
+
+				if ((w->instance == req_state->fifo_instance) &&
+				    server_id_equal(&w->pid, &self)) {
+					state->num_granted -= 1;
+					state->granted[i] =
+						state->granted[state->num_granted];
+					break;
+				}
+			}
+
+			if (g_lock_fifo_holds(&lck, self, type)) {
+				cb_state.must_store = true;
+				goto got_lock;
+			}
+
+			DBG_DEBUG("%s lost its queue entry\n",
+				  server_id_str_buf(self, &tmp));
+			req_state->fifo_instance = 0;
+		}
+	}
+
+	if (req_state->fifo_instance == 0) {
+		if (server_id_equal(&self, &lck.exclusive)) {
+			DBG_DEBUG("%s already locked by self\n",
+				  server_id_str_buf(self, &tmp));
+			state->status = NT_STATUS_WAS_LOCKED;
+			return;
+		}
+		if ((type == G_LOCK_WRITE) &&
+		    (lck.num_shared != 0) &&
+		    (g_lock_find_shared(&lck, &self) != -1)) {
+			DBG_DEBUG("Trying to writelock existing shared %s\n",
+				  server_id_str_buf(self, &tmp));
+			state->status = NT_STATUS_WAS_LOCKED;
+			return;
+		}
+
+		if ((lck.num_waiters == 0) && (lck.exclusive.pid == 0)) {
+			if (type == G_LOCK_READ) {
+				cb_state.new_shared = &self;
+				goto got_lock;
+			}
+			if (lck.num_shared == 0) {
+				lck.exclusive = self;
+				goto got_lock;
+			}
+		}
+
+		new_waiter = (struct g_lock_waiter) {
+			.pid = self,
+			.instance = g_lock_fifo_new_instance(),
+			.type = type,
+		};
+		pnew_waiter = &new_waiter;
+		req_state->fifo_instance = new_waiter.instance;
+		idx = lck.num_waiters;
+	}
+
+	/*
+	 * Only the head of the queue watches the lock holder, and
+	 * only the second one watches the head.
+	 */
+	state->blocker = (struct server_id) { .pid = 0 };
+
+	if (idx == 0) {
+		if (lck.exclusive.pid != 0) {
+			state->blocker = lck.exclusive;
+		} else if (lck.num_shared != 0) {
+			g_lock_get_shared(&lck, 0, &state->blocker);
+		}
+	} else if (idx == 1) {
+		struct g_lock_waiter head;
+		g_lock_get_waiter(&lck, 0, &head);
+		state->blocker = head.pid;
+	}
+
+	DBG_DEBUG("%s queued at position %zd, blocker %s\n",
+		  server_id_str_buf(self, &tmp),
+		  idx,
+		  server_id_str_buf(state->blocker, &tmp2));
+
+	status = g_lock_store(
+		rec, req_state->ctx->fifo, &lck, NULL, pnew_waiter, NULL, 0);
+	if (!NT_STATUS_IS_OK(status)) {
+		DBG_DEBUG("g_lock_store() failed: %s\n", nt_errstr(status));
+		state->status = status;
+		return;
+	}
+
+	state->status = NT_STATUS_LOCK_NOT_GRANTED;
+	return;
+
+got_lock:
+	state->status = g_lock_lock_cb_run_and_store(&cb_state);
+	if (!NT_STATUS_IS_OK(state->status) &&
+	    !NT_STATUS_EQUAL(state->status, NT_STATUS_WAS_UNLOCKED))
+	{
+		DBG_WARNING("g_lock_lock_cb_run_and_store() failed: %s\n",
+			    nt_errstr(state->status));
+	}
+}
+
+static int g_lock_fifo_state_destructor(struct g_lock_lock_state *s);
+
+static NTSTATUS g_lock_fifo_trylock(struct g_lock_lock_state *state,
+				    struct server_id *dead_blocker,
+				    bool check_head)
+{
+	struct g_lock_fifo_fn_state fn_state = {
+		.req_state = state,
+		.dead_blocker = dead_blocker,
+		.check_head = check_head,
+	};
+	NTSTATUS status;
+
+	status = dbwrap_do_locked(
+		state->ctx->db, state->key, g_lock_fifo_lock_fn, &fn_state);
+	g_lock_send_grants(
+		state->ctx->msg, fn_state.granted, fn_state.num_granted);
+	TALLOC_FREE(fn_state.granted);
+	if (!NT_STATUS_IS_OK(status)) {
+		DBG_DEBUG("dbwrap_do_locked failed: %s\n",
+			  nt_errstr(status));
+		return status;
+	}
+
+	if (NT_STATUS_IS_OK(fn_state.status) ||
+	    NT_STATUS_EQUAL(fn_state.status, NT_STATUS_WAS_UNLOCKED)) {
+		talloc_set_destructor(state, NULL);
+		return fn_state.status;
+	}
+
+	if (state->fifo_instance != 0) {
+		talloc_set_destructor(state, g_lock_fifo_state_destructor);
+	}
+	state->fifo_blocker = fn_state.blocker;
+
+	return fn_state.status;
+}
+
+static bool g_lock_fifo_granted_filter(struct messaging_rec *rec,
+				       void *private_data)
+{
+	struct g_lock_lock_state *state = talloc_get_type_abort(
+		private_data, struct g_lock_lock_state);
+
+	if (rec->msg_type != MSG_DBWRAP_G_LOCK_GRANTED) {
+		return false;
+	}
+	if (rec->num_fds != 0) {
+		return false;
+	}
+	if (rec->buf.length != sizeof(uint64_t)) {
+		return false;
+	}
+	return (BVAL(rec->buf.data, 0) == state->fifo_instance);
+}
+
+static void g_lock_fifo_granted(struct tevent_req *subreq);
+static void g_lock_fifo_blocker_died(struct tevent_req *subreq);
+static void g_lock_fifo_timedout(struct tevent_req *subreq);
+
+static bool g_lock_fifo_wait(struct tevent_req *req)
+{
+	struct g_lock_lock_state *state = tevent_req_data(
+		req, struct g_lock_lock_state);
+	struct tevent_req *subreq = NULL;
+
+	state->fifo_wait = talloc_new(state);
+	if (tevent_req_nomem(state->fifo_wait, req)) {
+		return false;
+	}
+
+	subreq = messaging_filtered_read_send(state->fifo_wait,
+					      state->ev,
+					      state->ctx->msg,
+					      g_lock_fifo_granted_filter,
+					      state);
+	if (tevent_req_nomem(subreq, req)) {
+		return false;
+	}
+	tevent_req_set_callback(subreq, g_lock_fifo_granted, req);
+
+	if (state->fifo_blocker.pid != 0) {
+		subreq = server_id_watch_send(
+			state->fifo_wait, state->ev, state->fifo_blocker);
+		if (tevent_req_nomem(subreq, req)) {
+			return false;
+		}
+		tevent_req_set_callback(subreq, g_lock_fifo_blocker_died, req);
+	}
+
+	/*
+	 * Just in case someone died without us noticing
+	 */
+	subreq = tevent_wakeup_send(
+		state->fifo_wait,
+		state->ev,
+		timeval_current_ofs(5 + generate_random() % 5, 0));
+	if (tevent_req_nomem(subreq, req)) {
+		return false;
+	}
+	tevent_req_set_callback(subreq, g_lock_fifo_timedout, req);
+
+	return true;
+}
+
+static void g_lock_fifo_retry(struct tevent_req *req,
+			      struct server_id *dead_blocker,
+			      bool check_head)
+{
+	struct g_lock_lock_state *state = tevent_req_data(
+		req, struct g_lock_lock_state);
+	NTSTATUS status;
+
+	status = g_lock_fifo_trylock(state, dead_blocker, check_head);
+	if (NT_STATUS_IS_OK(status)) {
+		tevent_req_done(req);
+		return;
+	}
+	if (!NT_STATUS_EQUAL(status, NT_STATUS_LOCK_NOT_GRANTED)) {
+		tevent_req_nterror(req, status);
+		return;
+	}
+	g_lock_fifo_wait(req);
+}
+
+static void g_lock_fifo_granted(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct g_lock_lock_state *state = tevent_req_data(
+		req, struct g_lock_lock_state);
+	struct messaging_rec *rec = NULL;
+	int ret;
+
+	ret = messaging_filtered_read_recv(subreq, state, &rec);
+	TALLOC_FREE(state->fifo_wait);
+	TALLOC_FREE(rec);
+	if (ret != 0) {
+		tevent_req_nterror(req, map_nt_error_from_unix_common(ret));
+		return;
+	}
+
+	if (state->cb_fn == NULL) {
+		/*
+		 * The unlocker already stored us as holder, no need
+		 * to look at the record again.
+		 */
+		talloc_set_destructor(state, NULL);
+		tevent_req_done(req);
+		return;
+	}
+
+	g_lock_fifo_retry(req, NULL, false);
+}
+
+static void g_lock_fifo_blocker_died(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct g_lock_lock_state *state = tevent_req_data(
+		req, struct g_lock_lock_state);
+	struct server_id blocker = { .pid = 0 };
+	int ret;
+
+	ret = server_id_watch_recv(subreq, &blocker);
+	TALLOC_FREE(state->fifo_wait);
+	if (ret != 0) {
+		tevent_req_nterror(req, map_nt_error_from_unix_common(ret));
+		return;
+	}
+
+	g_lock_fifo_retry(req, &blocker, false);
+}
+
+static void g_lock_fifo_timedout(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct g_lock_lock_state *state = tevent_req_data(
+		req, struct g_lock_lock_state);
+	bool ok;
+
+	ok = tevent_wakeup_recv(subreq);
+	TALLOC_FREE(state->fifo_wait);
+	if (!ok) {
+		tevent_req_oom(req);
+		return;
+	}
+
+	g_lock_fifo_retry(req, NULL, true);
+}
+
+struct g_lock_fifo_cancel_state {
+	bool fifo;
+	struct server_id self;
+	uint64_t instance;
+	enum g_lock_type type;
+	struct g_lock_waiter *granted;
+	size_t num_granted;
+	NTSTATUS status;
+};
+
+static void g_lock_fifo_cancel_fn(
+	struct db_record *rec,
+	TDB_DATA value,
+	void *private_data)
+{
+	struct g_lock_fifo_cancel_state *state = private_data;
+	struct g_lock lck = { .exclusive.pid = 0 };
+	ssize_t idx;
+	bool ok;
+
+	ok = g_lock_parse(value.dptr, value.dsize, state->fifo, &lck);
+	if (!ok) {
+		state->status = NT_STATUS_INTERNAL_DB_CORRUPTION;
+		return;
+	}
+
+	idx = g_lock_find_waiter(&lck, &state->self, state->instance);
+	if (idx != -1) {
+		g_lock_del_waiter(&lck, idx);
+	} else if (state->type == G_LOCK_WRITE) {
+		/*
+		 * We were handed the lock but gave up before
+		 * noticing, pass it on.
+		 */
+		if (server_id_equal(&state->self, &lck.exclusive)) {
+			lck.exclusive = (struct server_id) { .pid = 0 };
+		}
+	} else {
+		idx = g_lock_find_shared(&lck, &state->self);
+		if (idx != -1) {
+			g_lock_del_shared(&lck, idx);
+		}
+	}
+
+	state->status = g_lock_grant_waiters(
+		talloc_tos(), &lck, &state->granted, &state->num_granted);
+	if (!NT_STATUS_IS_OK(state->status)) {
+		return;
+	}
+
+	if ((lck.exclusive.pid == 0) &&
+	    (lck.num_shared == 0) &&
+	    (lck.num_waiters == 0) &&
+	    (lck.datalen == 0)) {
+		state->status = dbwrap_record_delete(rec);
+		return;
+	}
+
+	lck.unique_lock_epoch = generate_unique_u64(lck.unique_lock_epoch);
+
+	state->status = g_lock_store(rec, state->fifo, &lck, NULL, NULL, NULL, 0);
+}
+
+static int g_lock_fifo_state_destructor(struct g_lock_lock_state *s)
+{
+	struct g_lock_fifo_cancel_state state = {
+		.fifo = s->ctx->fifo,
+		.self = messaging_server_id(s->ctx->msg),
+		.instance = s->fifo_instance,
+		.type = s->type,
+	};
+	NTSTATUS status;
+
+	status = dbwrap_do_locked(
+		s->ctx->db, s->key, g_lock_fifo_cancel_fn, &state);
+	g_lock_send_grants(s->ctx->msg, state.granted, state.num_granted);
+	TALLOC_FREE(state.granted);
+	if (!NT_STATUS_IS_OK(status)) {
+		DBG_DEBUG("dbwrap_do_locked failed: %s\n",
+			  nt_errstr(status));
+		return 0;
+	}
+	if (!NT_STATUS_IS_OK(state.status)) {
+		DBG_DEBUG("g_lock_fifo_cancel_fn failed: %s\n",
+			  nt_errstr(state.status));
+	}
+	return 0;
+}
+
 static void g_lock_lock_retry(struct tevent_req *subreq);
 
 struct tevent_req *g_lock_lock_send(TALLOC_CTX *mem_ctx,
@@ -1028,7 +1921,25 @@ struct tevent_req *g_lock_lock_send(TALLOC_CTX *mem_ctx,
 		return tevent_req_post(req, ev);
 	}
 
+	if (ctx->fifo && ((type == G_LOCK_READ) || (type == G_LOCK_WRITE))) {
+		status = g_lock_fifo_trylock(state, NULL, false);
+		if (NT_STATUS_IS_OK(status)) {
+			tevent_req_done(req);
+			return tevent_req_post(req, ev);
+		}
+		if (!NT_STATUS_EQUAL(status, NT_STATUS_LOCK_NOT_GRANTED)) {
+			tevent_req_nterror(req, status);
+			return tevent_req_post(req, ev);
+		}
+		if (!g_lock_fifo_wait(req)) {
+			return tevent_req_post(req, ev);
+		}
+		return req;
+	}
+
 	status = dbwrap_do_locked(ctx->db, key, g_lock_lock_fn, &fn_state);
+	g_lock_send_grants(ctx->msg, fn_state.granted, fn_state.num_granted);
+	TALLOC_FREE(fn_state.granted);
 	if (tevent_req_nterror(req, status)) {
 		DBG_DEBUG("dbwrap_do_locked failed: %s\n",
 			  nt_errstr(status));
@@ -1093,6 +2004,9 @@ static void g_lock_lock_retry(struct tevent_req *subreq)
 
 	status = dbwrap_do_locked(state->ctx->db, state->key,
 				  g_lock_lock_fn, &fn_state);
+	g_lock_send_grants(
+		state->ctx->msg, fn_state.granted, fn_state.num_granted);
+	TALLOC_FREE(fn_state.granted);
 	if (tevent_req_nterror(req, status)) {
 		DBG_DEBUG("dbwrap_do_locked failed: %s\n",
 			  nt_errstr(status));
@@ -1172,7 +2086,7 @@ static void g_lock_lock_simple_fn(
 	};
 	bool ok;
 
-	ok = g_lock_parse(value.dptr, value.dsize, &lck);
+	ok = g_lock_parse(value.dptr, value.dsize, state->ctx->fifo, &lck);
 	if (!ok) {
 		DBG_DEBUG("g_lock_parse failed\n");
 		state->status = NT_STATUS_INTERNAL_DB_CORRUPTION;
@@ -1185,6 +2099,11 @@ static void g_lock_lock_simple_fn(
 		goto not_granted;
 	}
 
+	if (lck.num_waiters != 0) {
+		DBG_DEBUG("num_waiters=%zu\n", lck.num_waiters);
+		goto not_granted;
+	}
+
 	if (state->type == G_LOCK_WRITE) {
 		if (lck.num_shared != 0) {
 			DBG_DEBUG("num_shared=%zu\n", lck.num_shared);
@@ -1328,7 +2247,10 @@ NTSTATUS g_lock_lock(struct g_lock_ctx *ctx, TDB_DATA key,
 }
 
 struct g_lock_unlock_state {
+	bool fifo;
 	struct server_id self;
+	struct g_lock_waiter *granted;
+	size_t num_granted;
 	NTSTATUS status;
 };
 
@@ -1343,7 +2265,7 @@ static void g_lock_unlock_fn(
 	size_t i;
 	bool ok, exclusive;
 
-	ok = g_lock_parse(value.dptr, value.dsize, &lck);
+	ok = g_lock_parse(value.dptr, value.dsize, state->fifo, &lck);
 	if (!ok) {
 		DBG_DEBUG("g_lock_parse() failed\n");
 		state->status = NT_STATUS_INTERNAL_DB_CORRUPTION;
@@ -1382,8 +2304,17 @@ static void g_lock_unlock_fn(
 		lck.exclusive = (struct server_id) { .pid = 0 };
 	}
 
+	state->status = g_lock_grant_waiters(
+		talloc_tos(), &lck, &state->granted, &state->num_granted);
+	if (!NT_STATUS_IS_OK(state->status)) {
+		DBG_DEBUG("g_lock_grant_waiters() failed: %s\n",
+			  nt_errstr(state->status));
+		return;
+	}
+
 	if ((lck.exclusive.pid == 0) &&
 	    (lck.num_shared == 0) &&
+	    (lck.num_waiters == 0) &&
 	    (lck.datalen == 0)) {
 		state->status = dbwrap_record_delete(rec);
 		return;
@@ -1405,12 +2336,13 @@ static void g_lock_unlock_fn(
 
 	lck.unique_lock_epoch = generate_unique_u64(lck.unique_lock_epoch);
 
-	state->status = g_lock_store(rec, &lck, NULL, NULL, 0);
+	state->status = g_lock_store(rec, state->fifo, &lck, NULL, NULL, NULL, 0);
 }
 
 NTSTATUS g_lock_unlock(struct g_lock_ctx *ctx, TDB_DATA key)
 {
 	struct g_lock_unlock_state state = {
+		.fifo = ctx->fifo,
 		.self = messaging_server_id(ctx->msg),
 	};
 	NTSTATUS status;
@@ -1418,6 +2350,8 @@ NTSTATUS g_lock_unlock(struct g_lock_ctx *ctx, TDB_DATA key)
 	SMB_ASSERT(!ctx->busy);
 
 	status = dbwrap_do_locked(ctx->db, key, g_lock_unlock_fn, &state);
+	g_lock_send_grants(ctx->msg, state.granted, state.num_granted);
+	TALLOC_FREE(state.granted);
 	if (!NT_STATUS_IS_OK(status)) {
 		DBG_WARNING("dbwrap_do_locked failed: %s\n",
 			    nt_errstr(status));
@@ -1438,6 +2372,7 @@ NTSTATUS g_lock_unlock(struct g_lock_ctx *ctx, TDB_DATA key)
 }
 
 struct g_lock_writev_data_state {
+	bool fifo;
 	TDB_DATA key;
 	struct server_id self;
 	const TDB_DATA *dbufs;
@@ -1466,7 +2401,7 @@ static void g_lock_writev_data_fn(
 	 */
 	dbwrap_watched_watch_skip_alerting(rec);
 
-	ok = g_lock_parse(value.dptr, value.dsize, &lck);
+	ok = g_lock_parse(value.dptr, value.dsize, state->fifo, &lck);
 	if (!ok) {
 		DBG_DEBUG("g_lock_parse for %s failed\n",
 			  tdb_data_dbg(state->key));
@@ -1497,7 +2432,9 @@ static void g_lock_writev_data_fn(
 	lck.data = NULL;
 	lck.datalen = 0;
 	state->status = g_lock_store(
-		rec, &lck, NULL, state->dbufs, state->num_dbufs);
+		rec,
+		state->fifo,
+		&lck, NULL, NULL, state->dbufs, state->num_dbufs);
 }
 
 NTSTATUS g_lock_writev_data(
@@ -1507,6 +2444,7 @@ NTSTATUS g_lock_writev_data(
 	size_t num_dbufs)
 {
 	struct g_lock_writev_data_state state = {
+		.fifo = ctx->fifo,
 		.key = key,
 		.self = messaging_server_id(ctx->msg),
 		.dbufs = dbufs,
@@ -1578,6 +2516,7 @@ int g_lock_locks(struct g_lock_ctx *ctx,
 
 struct g_lock_dump_state {
 	TALLOC_CTX *mem_ctx;
+	bool fifo;
 	TDB_DATA key;
 	void (*fn)(struct server_id exclusive,
 		   size_t num_shared,
@@ -1599,7 +2538,7 @@ static void g_lock_dump_fn(TDB_DATA key, TDB_DATA data,
 	size_t i;
 	bool ok;
 
-	ok = g_lock_parse(data.dptr, data.dsize, &lck);
+	ok = g_lock_parse(data.dptr, data.dsize, state->fifo, &lck);
 	if (!ok) {
 		DBG_DEBUG("g_lock_parse failed for %s\n",
 			  tdb_data_dbg(state->key));
@@ -1643,7 +2582,7 @@ NTSTATUS g_lock_dump(struct g_lock_ctx *ctx, TDB_DATA key,
 		     void *private_data)
 {
 	struct g_lock_dump_state state = {
-		.mem_ctx = ctx, .key = key,
+		.mem_ctx = ctx, .fifo = ctx->fifo, .key = key,
 		.fn = fn, .private_data = private_data
 	};
 	NTSTATUS status;
@@ -1689,6 +2628,7 @@ struct tevent_req *g_lock_dump_send(
 		return NULL;
 	}
 	state->mem_ctx = state;
+	state->fifo = ctx->fifo;
 	state->key = key;
 	state->fn = fn;
 	state->private_data = private_data;
@@ -1764,7 +2704,7 @@ static void g_lock_watch_data_send_fn(
 	struct g_lock lck;
 	bool ok;
 
-	ok = g_lock_parse(value.dptr, value.dsize, &lck);
+	ok = g_lock_parse(value.dptr, value.dsize, state->ctx->fifo, &lck);
 	if (!ok) {
 		state->status = NT_STATUS_INTERNAL_DB_CORRUPTION;
 		return;
@@ -1842,7 +2782,7 @@ static void g_lock_watch_data_done_fn(
 	struct g_lock lck;
 	bool ok;
 
-	ok = g_lock_parse(value.dptr, value.dsize, &lck);
+	ok = g_lock_parse(value.dptr, value.dsize, state->ctx->fifo, &lck);
 	if (!ok) {
 		dbwrap_watched_watch_remove_instance(rec, state->watch_instance);
 		state->status = NT_STATUS_INTERNAL_DB_CORRUPTION;
@@ -1951,19 +2891,39 @@ static void g_lock_wake_watchers_fn(
 	TDB_DATA value,
 	void *private_data)
 {
+	struct g_lock_ctx *ctx = private_data;
 	struct g_lock lck = { .exclusive.pid = 0 };
 	NTSTATUS status;
 	bool ok;
 
-	ok = g_lock_parse(value.dptr, value.dsize, &lck);
+	ok = g_lock_parse(value.dptr, value.dsize, ctx->fifo, &lck);
 	if (!ok) {
 		DBG_WARNING("g_lock_parse failed\n");
 		return;
 	}
 
+	if ((lck.exclusive.pid == 0) &&
+	    (lck.num_shared == 0) &&
+	    (lck.num_waiters == 0) &&
+	    (lck.datalen == 0)) {
+		/*
+		 * Nobody uses this record for locking or data, its
+		 * only job is to wake watchers. They see an empty
+		 * record as a new data epoch, and the watched
+		 * backend removes it with the last watcher.
+		 */
+		status = dbwrap_record_delete(rec);
+		if (!NT_STATUS_IS_OK(status) &&
+		    !NT_STATUS_EQUAL(status, NT_STATUS_NOT_FOUND)) {
+			DBG_WARNING("dbwrap_record_delete failed: %s\n",
+				    nt_errstr(status));
+		}
+		return;
+	}
+
 	lck.unique_data_epoch = generate_unique_u64(lck.unique_data_epoch);
 
-	status = g_lock_store(rec, &lck, NULL, NULL, 0);
+	status = g_lock_store(rec, ctx->fifo, &lck, NULL, NULL, NULL, 0);
 	if (!NT_STATUS_IS_OK(status)) {
 		DBG_WARNING("g_lock_store failed: %s\n", nt_errstr(status));
 		return;
@@ -1976,7 +2936,7 @@ void g_lock_wake_watchers(struct g_lock_ctx *ctx, TDB_DATA key)
 
 	SMB_ASSERT(!ctx->busy);
 
-	status = dbwrap_do_locked(ctx->db, key, g_lock_wake_watchers_fn, NULL);
+	status = dbwrap_do_locked(ctx->db, key, g_lock_wake_watchers_fn, ctx);
 	if (!NT_STATUS_IS_OK(status)) {
 		DBG_DEBUG("dbwrap_do_locked returned %s\n",
 			  nt_errstr(status));
@@ -132,6 +132,65 @@ static void ping_message(struct messaging_context *msg_ctx,
 	messaging_send(msg_ctx, src, MSG_PONG, data);
 }
 
+static void dgm_stats_print_batches(char **pstr, const char *name,
+				    const struct messaging_dgm_batch_stats *s)
+{
+	size_t i;
+
+	talloc_asprintf_addbuf(
+		pstr,
+		"%s: %"PRIu64" datagrams in %"PRIu64" batches, "
+		"max batch %"PRIu64"\n",
+		name, s->datagrams, s->batches, s->max_batch);
+
+	for (i=0; i<ARRAY_SIZE(s->hist); i++) {
+		unsigned lo = 1U << i;
+
+		if (i == ARRAY_SIZE(s->hist) - 1) {
+			talloc_asprintf_addbuf(pstr, "  %u+: %"PRIu64"\n",
+					       lo, s->hist[i]);
+			break;
+		}
+		talloc_asprintf_addbuf(pstr, "  %u-%u: %"PRIu64"\n",
+				       lo, 2*lo - 1, s->hist[i]);
+	}
+}
+
+static void dgm_stats_message(struct messaging_context *msg_ctx,
+			      void *private_data,
+			      uint32_t msg_type,
+			      struct server_id src,
+			      DATA_BLOB *data)
+{
+	struct messaging_dgm_stats stats;
+	char *str = NULL;
+	int ret;
+
+	ret = messaging_dgm_get_stats(&stats);
+	if (ret != 0) {
+		str = talloc_asprintf(talloc_tos(),
+				      "messaging_dgm_get_stats failed: %s\n",
+				      strerror(ret));
+	} else {
+		str = talloc_strdup(talloc_tos(), "");
+		dgm_stats_print_batches(&str, "send", &stats.send);
+		dgm_stats_print_batches(&str, "recv", &stats.recv);
+		talloc_asprintf_addbuf(
+			&str,
+			"shm: %"PRIu64" sent, %"PRIu64" received, "
+			"%"PRIu64" wakeups, %"PRIu64" fallbacks\n",
+			stats.shm.sent, stats.shm.received,
+			stats.shm.wakeups, stats.shm.fallbacks);
+	}
+	if (str == NULL) {
+		return;
+	}
+
+	messaging_send_buf(msg_ctx, src, MSG_DGM_STATS,
+			   (const uint8_t *)str, strlen(str) + 1);
+	TALLOC_FREE(str);
+}
+
 struct messaging_rec *messaging_rec_create(
 	TALLOC_CTX *mem_ctx, struct server_id src, struct server_id dst,
 	uint32_t msg_type, const struct iovec *iov, int iovlen,
@@ -558,6 +617,8 @@ static NTSTATUS messaging_init_internal(TALLOC_CTX *mem_ctx,
 	}
 	talloc_set_destructor(ctx, messaging_context_destructor);
 
+	messaging_dgm_set_shm_ring_size(lp_messaging_shm_ring_size());
+
 #ifdef CLUSTER_SUPPORT
 	if (lp_clustering()) {
 		ref = messaging_ctdb_ref(
@@ -592,6 +653,7 @@ static NTSTATUS messaging_init_internal(TALLOC_CTX *mem_ctx,
 	}
 
 	messaging_register(ctx, NULL, MSG_PING, ping_message);
+	messaging_register(ctx, NULL, MSG_REQ_DGM_STATS, dgm_stats_message);
 
 	/* Register some debugging related messages */
 
@@ -40,17 +40,70 @@
 
 #define ZERO_ZERO 0
 
-/* The open brlock.tdb database. */
+/*
+ * The locks on a file are kept sorted by their start offset and split
+ * into pages of at most BRL_PAGE_MAX_LOCKS entries. Every page is a
+ * record of its own in brlock_pages.tdb, keyed by the file_id and a
+ * page id. The record for the file_id in brlock.tdb just holds the
+ * array of page descriptors, in the same order as the pages.
+ *
+ * A descriptor carries the lowest start offset and the highest last
+ * byte of all locks in its page. Checking for conflicts only needs to
+ * look into the pages that can overlap the range in question, and
+ * adding or removing a lock only rewrites a single page and the small
+ * index record instead of the whole lock array.
+ *
+ * The pages are only modified with the brlock.tdb record locked, so
+ * they don't need a record lock of their own. Every flush bumps the
+ * generation stored in front of the index, the pages written by it
+ * carry that generation in front of their locks and in their
+ * descriptor. Readers that don't hold the brlock.tdb record lock
+ * only accept a page with the generation their copy of the index
+ * expects, changes to other files don't disturb them.
+ */
+
+#define BRL_PAGE_MAX_LOCKS 64
+
+/* Number of locks per page when all pages are rebuilt */
+#define BRL_PAGE_FILL_LOCKS 48
+
+#define BRL_PAGE_KEY_LEN (sizeof(struct file_id) + sizeof(uint32_t))
+
+struct brl_page_desc {
+	br_off min_start;
+	br_off max_last;
+	uint64_t generation;
+	uint32_t page_id;
+	uint32_t num_locks;
+};
+
+struct brl_page {
+	struct lock_struct *locks;
+	unsigned int num_locks;
+	/* Highest max_last of this and all previous pages */
+	br_off max_last_upto;
+	bool loaded;
+	bool dirty;
+};
+
+/* The open brlock.tdb and brlock_pages.tdb databases. */
 
 static struct db_context *brlock_db;
+static struct db_context *brlock_pages_db;
 
 struct byte_range_lock {
 	struct files_struct *fsp;
+	struct file_id id;
 	TALLOC_CTX *req_mem_ctx;
 	const struct GUID *req_guid;
 	unsigned int num_locks;
 	bool modified;
-	struct lock_struct *lock_data;
+	unsigned int num_pages;
+	struct brl_page_desc *descs;
+	struct brl_page *pages;
+	bool max_last_upto_valid;
+	uint64_t generation;
+	int seqnum;
 	struct db_record *record;
 };
 
@@ -369,7 +422,8 @@ void brl_init(bool read_only)
 		return;
 	}
 
-	tdb_flags = SMBD_VOLATILE_TDB_FLAGS | TDB_SEQNUM;
+	tdb_flags = SMBD_VOLATILE_TDB_FLAGS | SMBD_VOLATILE_TDB_REHASH_FLAGS |
+		TDB_SEQNUM;
 
 	db_path = lock_path(talloc_tos(), "brlock.tdb");
 	if (db_path == NULL) {
@@ -387,16 +441,691 @@ void brl_init(bool read_only)
 		TALLOC_FREE(db_path);
 		return;
 	}
-	TALLOC_FREE(db_path);
+	TALLOC_FREE(db_path);
+
+	db_path = lock_path(talloc_tos(), "brlock_pages.tdb");
+	if (db_path == NULL) {
+		DEBUG(0, ("out of memory!\n"));
+		TALLOC_FREE(brlock_db);
+		return;
+	}
+
+	/*
+	 * Pages are only touched with the brlock.tdb record locked
+	 * and never more than one at a time, there is no lock order
+	 * to check.
+	 */
+	brlock_pages_db = db_open(NULL, db_path,
+				  SMBD_VOLATILE_TDB_HASH_SIZE, tdb_flags,
+				  read_only?O_RDONLY:(O_RDWR|O_CREAT), 0644,
+				  DBWRAP_LOCK_ORDER_NONE, DBWRAP_FLAG_NONE);
+	if (!brlock_pages_db) {
+		DEBUG(0,("Failed to open byte range locking database %s\n",
+			 db_path));
+		TALLOC_FREE(db_path);
+		TALLOC_FREE(brlock_db);
+		return;
+	}
+	TALLOC_FREE(db_path);
+}
+
+/****************************************************************************
+ Close down the brlock.tdb database.
+****************************************************************************/
+
+void brl_shutdown(void)
+{
+	TALLOC_FREE(brlock_pages_db);
+	TALLOC_FREE(brlock_db);
+}
+
+/****************************************************************************
+ Last byte of a lock as far as the page index is concerned. Zero length
+ locks are indexed at their start offset.
+****************************************************************************/
+
+static br_off brl_last(br_off start, br_off size)
+{
+	if (size == 0) {
+		return start;
+	}
+	if (!byte_range_valid(start, size)) {
+		return UINT64_MAX;
+	}
+	return start + size - 1;
+}
+
+static TDB_DATA brl_page_key(struct file_id id,
+			     uint32_t page_id,
+			     uint8_t buf[BRL_PAGE_KEY_LEN])
+{
+	memcpy(buf, &id, sizeof(id));
+	SIVAL(buf, sizeof(id), page_id);
+	return make_tdb_data(buf, BRL_PAGE_KEY_LEN);
+}
+
+/****************************************************************************
+ Recalculate the descriptor of a loaded page.
+****************************************************************************/
+
+static void brl_page_update_desc(struct byte_range_lock *br_lck,
+				 unsigned int idx)
+{
+	struct brl_page_desc *desc = &br_lck->descs[idx];
+	const struct brl_page *page = &br_lck->pages[idx];
+	unsigned int i;
+
+	br_lck->num_locks -= desc->num_locks;
+	br_lck->num_locks += page->num_locks;
+	br_lck->max_last_upto_valid = false;
+	desc->num_locks = page->num_locks;
+	desc->max_last = 0;
+
+	if (page->num_locks == 0) {
+		/*
+		 * Leave min_start alone to keep the descriptors
+		 * sorted, byte_range_lock_flush() removes empty pages.
+		 */
+		return;
+	}
+
+	desc->min_start = page->locks[0].start;
+
+	for (i=0; i<page->num_locks; i++) {
+		const struct lock_struct *lock = &page->locks[i];
+		br_off last = brl_last(lock->start, lock->size);
+
+		desc->max_last = MAX(desc->max_last, last);
+	}
+}
+
+struct brl_load_page_state {
+	TALLOC_CTX *mem_ctx;
+	struct brl_page *page;
+	uint64_t generation;
+	bool ok;
+};
+
+static void brl_load_page_parser(TDB_DATA key, TDB_DATA data,
+				 void *private_data)
+{
+	struct brl_load_page_state *state = private_data;
+	struct brl_page *page = state->page;
+	size_t len;
+
+	if ((data.dsize < sizeof(uint64_t)) ||
+	    ((data.dsize - sizeof(uint64_t)) %
+	     sizeof(struct lock_struct) != 0)) {
+		DBG_WARNING("Invalid page size: %zu\n", data.dsize);
+		return;
+	}
+
+	memcpy(&state->generation, data.dptr, sizeof(uint64_t));
+	len = data.dsize - sizeof(uint64_t);
+
+	page->locks = talloc_memdup(state->mem_ctx,
+				    data.dptr + sizeof(uint64_t),
+				    len);
+	if ((page->locks == NULL) && (len != 0)) {
+		DBG_WARNING("talloc_memdup failed\n");
+		return;
+	}
+	page->num_locks = len / sizeof(struct lock_struct);
+	state->ok = true;
+}
+
+/****************************************************************************
+ Make sure a page is in memory. Without the brlock.tdb record locked this
+ fails if the page changed since the index was read.
+****************************************************************************/
+
+static bool brl_load_page(struct byte_range_lock *br_lck, unsigned int idx)
+{
+	struct brl_page_desc *desc = &br_lck->descs[idx];
+	struct brl_page *page = &br_lck->pages[idx];
+	struct brl_load_page_state state = {
+		.mem_ctx = br_lck->pages, .page = page,
+	};
+	uint8_t keybuf[BRL_PAGE_KEY_LEN];
+	NTSTATUS status;
+
+	if (page->loaded) {
+		return true;
+	}
+
+	status = dbwrap_parse_record(
+		brlock_pages_db,
+		brl_page_key(br_lck->id, desc->page_id, keybuf),
+		brl_load_page_parser,
+		&state);
+	if (NT_STATUS_EQUAL(status, NT_STATUS_NOT_FOUND)) {
+		/*
+		 * Removed after we read the index, or left behind by
+		 * a process that died in byte_range_lock_flush().
+		 */
+		page->num_locks = 0;
+		state.generation = (desc->num_locks == 0) ?
+			desc->generation : 0;
+		state.ok = true;
+	} else if (!NT_STATUS_IS_OK(status)) {
+		DBG_WARNING("Could not parse page %"PRIu32": %s\n",
+			    desc->page_id,
+			    nt_errstr(status));
+		return false;
+	}
+	if (!state.ok) {
+		return false;
+	}
+
+	if (state.generation != desc->generation) {
+		if (br_lck->record == NULL) {
+			DBG_DEBUG("page %"PRIu32" changed after reading "
+				  "the index\n",
+				  desc->page_id);
+			TALLOC_FREE(page->locks);
+			page->num_locks = 0;
+			return false;
+		}
+
+		/*
+		 * A process died in byte_range_lock_flush() between
+		 * storing the page and the index. The page wins,
+		 * rewrite it with the current generation.
+		 */
+		page->dirty = true;
+		br_lck->modified = true;
+	}
+
+	page->loaded = true;
+
+	if (page->num_locks != desc->num_locks) {
+		brl_page_update_desc(br_lck, idx);
+		if (br_lck->record != NULL) {
+			page->dirty = true;
+			br_lck->modified = true;
+		}
+	}
+
+	return true;
+}
+
+static bool brl_load_all_pages(struct byte_range_lock *br_lck)
+{
+	unsigned int i;
+
+	for (i=0; i<br_lck->num_pages; i++) {
+		if (!brl_load_page(br_lck, i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/****************************************************************************
+ Insert an empty page at position idx.
+****************************************************************************/
+
+static bool brl_add_page(struct byte_range_lock *br_lck, unsigned int idx)
+{
+	struct brl_page_desc *descs = NULL;
+	struct brl_page *pages = NULL;
+	uint32_t page_id = 0;
+	unsigned int i;
+
+	for (i=0; i<br_lck->num_pages; i++) {
+		page_id = MAX(page_id, br_lck->descs[i].page_id + 1);
+	}
+
+	descs = talloc_realloc(br_lck, br_lck->descs, struct brl_page_desc,
+			       br_lck->num_pages + 1);
+	if (descs == NULL) {
+		return false;
+	}
+	br_lck->descs = descs;
+
+	pages = talloc_realloc(br_lck, br_lck->pages, struct brl_page,
+			       br_lck->num_pages + 1);
+	if (pages == NULL) {
+		return false;
+	}
+	br_lck->pages = pages;
+
+	memmove(&descs[idx+1], &descs[idx],
+		(br_lck->num_pages - idx) * sizeof(*descs));
+	memmove(&pages[idx+1], &pages[idx],
+		(br_lck->num_pages - idx) * sizeof(*pages));
+
+	descs[idx] = (struct brl_page_desc) { .page_id = page_id };
+	pages[idx] = (struct brl_page) { .loaded = true, .dirty = true };
+	br_lck->num_pages += 1;
+	br_lck->max_last_upto_valid = false;
+
+	return true;
+}
+
+/****************************************************************************
+ Find the page a lock starting at "start" goes into: The last page not
+ starting behind it, or the first one.
+****************************************************************************/
+
+static unsigned int brl_find_page(const struct byte_range_lock *br_lck,
+				  br_off start)
+{
+	unsigned int lo = 0;
+	unsigned int hi = br_lck->num_pages;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (br_lck->descs[mid].min_start <= start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return (lo == 0) ? 0 : lo - 1;
+}
+
+/****************************************************************************
+ Move the upper half of an overflowing page into a new page.
+****************************************************************************/
+
+static void brl_split_page(struct byte_range_lock *br_lck, unsigned int idx)
+{
+	struct brl_page *page = &br_lck->pages[idx];
+	struct lock_struct *upper = NULL;
+	unsigned int half = page->num_locks / 2;
+	unsigned int num_upper = page->num_locks - half;
+	bool ok;
+
+	upper = talloc_memdup(br_lck->pages,
+			      &page->locks[half],
+			      num_upper * sizeof(struct lock_struct));
+	if (upper == NULL) {
+		DBG_DEBUG("talloc_memdup failed, not splitting\n");
+		return;
+	}
+
+	ok = brl_add_page(br_lck, idx + 1);
+	if (!ok) {
+		DBG_DEBUG("brl_add_page failed, not splitting\n");
+		TALLOC_FREE(upper);
+		return;
+	}
+
+	/* brl_add_page() reallocated the pages */
+	br_lck->pages[idx].num_locks = half;
+	br_lck->pages[idx+1].locks = talloc_steal(br_lck->pages, upper);
+	br_lck->pages[idx+1].num_locks = num_upper;
+
+	brl_page_update_desc(br_lck, idx);
+	brl_page_update_desc(br_lck, idx + 1);
+}
+
+/****************************************************************************
+ Add a lock behind all locks starting at or before it.
+****************************************************************************/
+
+static NTSTATUS brl_insert_lock(struct byte_range_lock *br_lck,
+				const struct lock_struct *plock)
+{
+	struct brl_page *page = NULL;
+	struct lock_struct *locks = NULL;
+	unsigned int idx, lo, hi;
+	bool ok;
+
+	if (br_lck->num_pages == 0) {
+		ok = brl_add_page(br_lck, 0);
+		if (!ok) {
+			return NT_STATUS_NO_MEMORY;
+		}
+	}
+
+	idx = brl_find_page(br_lck, plock->start);
+
+	ok = brl_load_page(br_lck, idx);
+	if (!ok) {
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	}
+	page = &br_lck->pages[idx];
+
+	lo = 0;
+	hi = page->num_locks;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (page->locks[mid].start <= plock->start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	locks = talloc_realloc(br_lck->pages, page->locks, struct lock_struct,
+			       page->num_locks + 1);
+	if (locks == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+	memmove(&locks[lo+1], &locks[lo],
+		(page->num_locks - lo) * sizeof(struct lock_struct));
+	locks[lo] = *plock;
+
+	page->locks = locks;
+	page->num_locks += 1;
+	page->dirty = true;
+	br_lck->modified = true;
+
+	if (page->num_locks > BRL_PAGE_MAX_LOCKS) {
+		brl_split_page(br_lck, idx);
+	}
+	brl_page_update_desc(br_lck, idx);
+
+	return NT_STATUS_OK;
+}
+
+static void brl_delete_lock(struct byte_range_lock *br_lck,
+			    unsigned int page_idx,
+			    unsigned int lock_idx)
+{
+	struct brl_page *page = &br_lck->pages[page_idx];
+
+	ARRAY_DEL_ELEMENT(page->locks, lock_idx, page->num_locks);
+	page->num_locks -= 1;
+	page->dirty = true;
+	br_lck->modified = true;
+
+	brl_page_update_desc(br_lck, page_idx);
+}
+
+/****************************************************************************
+ Replace all locks, used by the POSIX code that needs to split and merge
+ ranges. The new locks are re-sorted and paged from scratch.
+****************************************************************************/
+
+static bool brl_set_locks(struct byte_range_lock *br_lck,
+			  struct lock_struct *locks,
+			  unsigned int num_locks)
+{
+	unsigned int num_pages;
+	unsigned int i;
+
+	/*
+	 * The input is almost sorted already. Keep this stable,
+	 * stacked Windows locks are unlocked in the order they were
+	 * granted.
+	 */
+	for (i=1; i<num_locks; i++) {
+		struct lock_struct tmp = locks[i];
+		unsigned int j = i;
+
+		while ((j > 0) && (locks[j-1].start > tmp.start)) {
+			locks[j] = locks[j-1];
+			j -= 1;
+		}
+		locks[j] = tmp;
+	}
+
+	num_pages = (num_locks + BRL_PAGE_FILL_LOCKS - 1) /
+		BRL_PAGE_FILL_LOCKS;
+
+	while (br_lck->num_pages < num_pages) {
+		if (!brl_add_page(br_lck, br_lck->num_pages)) {
+			return false;
+		}
+	}
+
+	for (i=0; i<br_lck->num_pages; i++) {
+		struct brl_page *page = &br_lck->pages[i];
+		unsigned int ofs = i * BRL_PAGE_FILL_LOCKS;
+		unsigned int num = 0;
+
+		if (i < num_pages) {
+			num = MIN(BRL_PAGE_FILL_LOCKS, num_locks - ofs);
+		}
+
+		TALLOC_FREE(page->locks);
+		page->num_locks = 0;
+
+		if (num != 0) {
+			page->locks = talloc_memdup(
+				br_lck->pages,
+				&locks[ofs],
+				num * sizeof(struct lock_struct));
+			if (page->locks == NULL) {
+				return false;
+			}
+			page->num_locks = num;
+		}
+
+		page->loaded = true;
+		page->dirty = true;
+		brl_page_update_desc(br_lck, i);
+
+		if (num == 0) {
+			/* Sort behind everything until removed */
+			br_lck->descs[i].min_start = UINT64_MAX;
+		}
+	}
+
+	br_lck->modified = true;
+	return true;
+}
+
+/****************************************************************************
+ Walk all locks that might overlap a range, loading their pages on demand.
+****************************************************************************/
+
+struct brl_range_iter {
+	br_off start;
+	br_off last;
+	unsigned int page;
+	unsigned int end_page;
+	unsigned int idx;
+	bool started;
+	bool failed;
+};
+
+static void brl_range_iter_init(struct brl_range_iter *it,
+				br_off start,
+				br_off size)
+{
+	*it = (struct brl_range_iter) {
+		.start = start, .last = brl_last(start, size),
+	};
+}
+
+/****************************************************************************
+ The descriptors are sorted by min_start, and max_last_upto never
+ decreases: Both bounds of the pages to look at can be found by
+ bisecting.
+****************************************************************************/
+
+static void brl_range_iter_start(struct byte_range_lock *br_lck,
+				 struct brl_range_iter *it)
+{
+	unsigned int lo, hi;
+
+	if (!br_lck->max_last_upto_valid) {
+		br_off upto = 0;
+		unsigned int i;
+
+		for (i=0; i<br_lck->num_pages; i++) {
+			upto = MAX(upto, br_lck->descs[i].max_last);
+			br_lck->pages[i].max_last_upto = upto;
+		}
+		br_lck->max_last_upto_valid = true;
+	}
+
+	/* First page that has a lock ending at or behind it->start */
+
+	lo = 0;
+	hi = br_lck->num_pages;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (br_lck->pages[mid].max_last_upto < it->start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	it->page = lo;
+
+	/* First page starting behind it->last */
+
+	hi = br_lck->num_pages;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (br_lck->descs[mid].min_start <= it->last) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	it->end_page = lo;
+
+	it->started = true;
+}
+
+static struct lock_struct *brl_range_next(struct byte_range_lock *br_lck,
+					  struct brl_range_iter *it)
+{
+	if (!it->started) {
+		brl_range_iter_start(br_lck, it);
+	}
+
+	while (it->page < it->end_page) {
+		const struct brl_page_desc *desc = &br_lck->descs[it->page];
+		struct brl_page *page = &br_lck->pages[it->page];
+
+		if ((desc->num_locks == 0) || (desc->max_last < it->start)) {
+			it->page += 1;
+			it->idx = 0;
+			continue;
+		}
+
+		if (!brl_load_page(br_lck, it->page)) {
+			it->failed = true;
+			return NULL;
+		}
+
+		while (it->idx < page->num_locks) {
+			struct lock_struct *lock = &page->locks[it->idx];
+
+			if (lock->start > it->last) {
+				break;
+			}
+			it->idx += 1;
+
+			if (brl_last(lock->start, lock->size) >= it->start) {
+				return lock;
+			}
+		}
+
+		it->page += 1;
+		it->idx = 0;
+	}
+
+	return NULL;
+}
+
+/****************************************************************************
+ Autocleanup, the owner of the lock brl_range_next() just returned does
+ not exist anymore. byte_range_lock_flush() removes the lock.
+****************************************************************************/
+
+static void brl_range_mark_dead(struct byte_range_lock *br_lck,
+				const struct brl_range_iter *it,
+				struct lock_struct *lock)
+{
+	lock->context.pid.pid = 0;
+	br_lck->pages[it->page].dirty = true;
+	br_lck->modified = true;
+}
+
+/****************************************************************************
+ Copy the locks that might overlap a range, for the POSIX mapping code.
+****************************************************************************/
+
+static bool brl_range_locks(TALLOC_CTX *mem_ctx,
+			    struct byte_range_lock *br_lck,
+			    br_off start,
+			    br_off size,
+			    struct lock_struct **plocks,
+			    unsigned int *pnum_locks)
+{
+	struct brl_range_iter it;
+	struct lock_struct *lock = NULL;
+	struct lock_struct *locks = NULL;
+	unsigned int num_locks = 0;
+
+	brl_range_iter_init(&it, start, size);
+
+	while ((lock = brl_range_next(br_lck, &it)) != NULL) {
+		struct lock_struct *tmp = NULL;
+
+		tmp = talloc_realloc(mem_ctx, locks, struct lock_struct,
+				     num_locks + 1);
+		if (tmp == NULL) {
+			TALLOC_FREE(locks);
+			return false;
+		}
+		locks = tmp;
+		locks[num_locks] = *lock;
+		num_locks += 1;
+	}
+
+	if (it.failed) {
+		TALLOC_FREE(locks);
+		return false;
+	}
+
+	*plocks = locks;
+	*pnum_locks = num_locks;
+	return true;
 }
 
 /****************************************************************************
- Close down the brlock.tdb database.
+ Copy all locks into one array, sorted by start offset.
 ****************************************************************************/
 
-void brl_shutdown(void)
+static bool brl_get_all_locks(TALLOC_CTX *mem_ctx,
+			      struct byte_range_lock *br_lck,
+			      struct lock_struct **plocks,
+			      unsigned int *pnum_locks)
 {
-	TALLOC_FREE(brlock_db);
+	struct lock_struct *locks = NULL;
+	unsigned int num_locks = 0;
+	unsigned int i;
+
+	if (!brl_load_all_pages(br_lck)) {
+		return false;
+	}
+
+	locks = talloc_array(mem_ctx, struct lock_struct, br_lck->num_locks);
+	if (locks == NULL) {
+		return false;
+	}
+
+	for (i=0; i<br_lck->num_pages; i++) {
+		const struct brl_page *page = &br_lck->pages[i];
+
+		if (page->num_locks == 0) {
+			continue;
+		}
+		memcpy(&locks[num_locks], page->locks,
+		       page->num_locks * sizeof(struct lock_struct));
+		num_locks += page->num_locks;
+	}
+
+	*plocks = locks;
+	*pnum_locks = num_locks;
+	return true;
 }
 
 #if ZERO_ZERO
@@ -421,9 +1150,9 @@ static int lock_compare(const struct lock_struct *lck1,
 NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
 				  struct lock_struct *plock)
 {
-	unsigned int i;
 	files_struct *fsp = br_lck->fsp;
-	struct lock_struct *locks = br_lck->lock_data;
+	struct brl_range_iter it;
+	struct lock_struct *lock = NULL;
 	NTSTATUS status;
 	bool valid;
 
@@ -434,24 +1163,23 @@ NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
 		return NT_STATUS_INVALID_LOCK_RANGE;
 	}
 
-	for (i=0; i < br_lck->num_locks; i++) {
+	brl_range_iter_init(&it, plock->start, plock->size);
+
+	while ((lock = brl_range_next(br_lck, &it)) != NULL) {
 		/* Do any Windows or POSIX locks conflict ? */
-		if (brl_conflict(&locks[i], plock)) {
-			if (!serverid_exists(&locks[i].context.pid)) {
-				locks[i].context.pid.pid = 0;
-				br_lck->modified = true;
+		if (brl_conflict(lock, plock)) {
+			if (!serverid_exists(&lock->context.pid)) {
+				brl_range_mark_dead(br_lck, &it, lock);
 				continue;
 			}
 			/* Remember who blocked us. */
-			plock->context.smblctx = locks[i].context.smblctx;
+			plock->context.smblctx = lock->context.smblctx;
 			return NT_STATUS_LOCK_NOT_GRANTED;
 		}
-#if ZERO_ZERO
-		if (plock->start == 0 && plock->size == 0 &&
-				locks[i].size == 0) {
-			break;
-		}
-#endif
+	}
+
+	if (it.failed) {
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
 	}
 
 	contend_level2_oplocks_begin(fsp, LEVEL2_CONTEND_WINDOWS_BRL);
@@ -461,15 +1189,37 @@ NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
 	   we get it ? */
 
 	if (lp_posix_locking(fsp->conn->params)) {
+		struct lock_struct *locks = NULL;
+		unsigned int num_locks = 0;
 		int errno_ret;
-		if (!set_posix_lock_windows_flavour(fsp,
+		bool ok;
+
+		/*
+		 * Only locks overlapping plock matter for the
+		 * mapping to POSIX locks.
+		 */
+		ok = brl_range_locks(talloc_tos(),
+				     br_lck,
+				     plock->start,
+				     plock->size,
+				     &locks,
+				     &num_locks);
+		if (!ok) {
+			status = NT_STATUS_NO_MEMORY;
+			goto fail;
+		}
+
+		ok = set_posix_lock_windows_flavour(fsp,
 				plock->start,
 				plock->size,
 				plock->lock_type,
 				&plock->context,
 				locks,
-				br_lck->num_locks,
-				&errno_ret)) {
+				num_locks,
+				&errno_ret);
+		TALLOC_FREE(locks);
+
+		if (!ok) {
 
 			/* We don't know who blocked us. */
 			plock->context.smblctx = 0xFFFFFFFFFFFFFFFFLL;
@@ -485,18 +1235,11 @@ NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
 	}
 
 	/* no conflicts - add it to the list of locks */
-	locks = talloc_realloc(br_lck, locks, struct lock_struct,
-			       (br_lck->num_locks + 1));
-	if (!locks) {
-		status = NT_STATUS_NO_MEMORY;
+	status = brl_insert_lock(br_lck, plock);
+	if (!NT_STATUS_IS_OK(status)) {
 		goto fail;
 	}
 
-	memcpy(&locks[br_lck->num_locks], plock, sizeof(struct lock_struct));
-	br_lck->num_locks += 1;
-	br_lck->lock_data = locks;
-	br_lck->modified = True;
-
 	return NT_STATUS_OK;
  fail:
 	contend_level2_oplocks_end(fsp, LEVEL2_CONTEND_WINDOWS_BRL);
@@ -801,10 +1544,13 @@ static NTSTATUS brl_lock_posix(struct byte_range_lock *br_lck,
 			       struct lock_struct *plock)
 {
 	unsigned int i, count, posix_count;
-	struct lock_struct *locks = br_lck->lock_data;
+	struct lock_struct *locks = NULL;
+	unsigned int num_locks = 0;
 	struct lock_struct *tp;
 	bool break_oplocks = false;
+	bool cleaned = false;
 	NTSTATUS status;
+	bool ok;
 
 	/* No zero-zero locks for POSIX. */
 	if (plock->start == 0 && plock->size == 0) {
@@ -816,18 +1562,24 @@ static NTSTATUS brl_lock_posix(struct byte_range_lock *br_lck,
 		return NT_STATUS_INVALID_PARAMETER;
 	}
 
+	ok = brl_get_all_locks(br_lck, br_lck, &locks, &num_locks);
+	if (!ok) {
+		return NT_STATUS_NO_MEMORY;
+	}
+
 	/* The worst case scenario here is we have to split an
 	   existing POSIX lock range into two, and add our lock,
 	   so we need at most 2 more entries. */
 
-	tp = talloc_array(br_lck, struct lock_struct, br_lck->num_locks + 2);
+	tp = talloc_array(br_lck, struct lock_struct, num_locks + 2);
 	if (!tp) {
+		TALLOC_FREE(locks);
 		return NT_STATUS_NO_MEMORY;
 	}
 
 	count = posix_count = 0;
 
-	for (i=0; i < br_lck->num_locks; i++) {
+	for (i=0; i < num_locks; i++) {
 		struct lock_struct *curr_lock = &locks[i];
 
 		if (curr_lock->lock_flav == WINDOWS_LOCK) {
@@ -835,14 +1587,13 @@ static NTSTATUS brl_lock_posix(struct byte_range_lock *br_lck,
 			if (brl_conflict(curr_lock, plock)) {
 				if (!serverid_exists(&curr_lock->context.pid)) {
 					curr_lock->context.pid.pid = 0;
-					br_lck->modified = true;
+					cleaned = true;
 					continue;
 				}
-				/* No games with error messages. */
-				TALLOC_FREE(tp);
 				/* Remember who blocked us. */
 				plock->context.smblctx = curr_lock->context.smblctx;
-				return NT_STATUS_LOCK_NOT_GRANTED;
+				status = NT_STATUS_LOCK_NOT_GRANTED;
+				goto conflict;
 			}
 			/* Just copy the Windows lock into the new array. */
 			memcpy(&tp[count], curr_lock, sizeof(struct lock_struct));
@@ -854,15 +1605,14 @@ static NTSTATUS brl_lock_posix(struct byte_range_lock *br_lck,
 			if (brl_conflict_posix(curr_lock, plock)) {
 				if (!serverid_exists(&curr_lock->context.pid)) {
 					curr_lock->context.pid.pid = 0;
-					br_lck->modified = true;
+					cleaned = true;
 					continue;
 				}
 				/* Can't block ourselves with POSIX locks. */
-				/* No games with error messages. */
-				TALLOC_FREE(tp);
 				/* Remember who blocked us. */
 				plock->context.smblctx = curr_lock->context.smblctx;
-				return NT_STATUS_LOCK_NOT_GRANTED;
+				status = NT_STATUS_LOCK_NOT_GRANTED;
+				goto conflict;
 			}
 
 			/* Work out overlaps. */
@@ -924,38 +1674,43 @@ static NTSTATUS brl_lock_posix(struct byte_range_lock *br_lck,
 			plock->context.smblctx = 0xFFFFFFFFFFFFFFFFLL;
 
 			if (errno_ret == EACCES || errno_ret == EAGAIN) {
-				TALLOC_FREE(tp);
 				status = NT_STATUS_LOCK_NOT_GRANTED;
 				goto fail;
 			} else {
-				TALLOC_FREE(tp);
 				status = map_nt_error_from_unix(errno);
 				goto fail;
 			}
 		}
 	}
 
-	/* If we didn't use all the allocated size,
-	 * Realloc so we don't leak entries per lock call. */
-	if (count < br_lck->num_locks + 2) {
-		tp = talloc_realloc(br_lck, tp, struct lock_struct, count);
-		if (!tp) {
-			status = NT_STATUS_NO_MEMORY;
-			goto fail;
-		}
+	ok = brl_set_locks(br_lck, tp, count);
+	if (!ok) {
+		status = NT_STATUS_NO_MEMORY;
+		goto fail;
 	}
 
-	br_lck->num_locks = count;
-	TALLOC_FREE(br_lck->lock_data);
-	br_lck->lock_data = tp;
-	locks = tp;
-	br_lck->modified = True;
+	TALLOC_FREE(tp);
+	TALLOC_FREE(locks);
 
 	/* A successful downgrade from write to read lock can trigger a lock
 	   re-evalutation where waiting readers can now proceed. */
 
 	return NT_STATUS_OK;
+ conflict:
+	/* No games with error messages. */
+	TALLOC_FREE(tp);
+	if (cleaned) {
+		/*
+		 * Store the autocleanup marks, byte_range_lock_flush()
+		 * removes the dead entries.
+		 */
+		brl_set_locks(br_lck, locks, num_locks);
+	}
+	TALLOC_FREE(locks);
+	return status;
  fail:
+	TALLOC_FREE(tp);
+	TALLOC_FREE(locks);
 	if (break_oplocks) {
 		contend_level2_oplocks_end(br_lck->fsp,
 					   LEVEL2_CONTEND_POSIX_BRL);
@@ -1007,10 +1762,6 @@ NTSTATUS brl_lock(
 		ret = brl_lock_posix(br_lck, &lock);
 	}
 
-#if ZERO_ZERO
-	/* sort the lock list */
-	TYPESAFE_QSORT(br_lck->lock_data, (size_t)br_lck->num_locks, lock_compare);
-#endif
 	/* If we're returning an error, return who blocked us. */
 	if (!NT_STATUS_IS_OK(ret) && psmblctx) {
 		*blocker_pid = lock.context.pid;
@@ -1026,41 +1777,15 @@ NTSTATUS brl_lock(
 bool brl_unlock_windows_default(struct byte_range_lock *br_lck,
 				const struct lock_struct *plock)
 {
-	unsigned int i;
-	struct lock_struct *locks = br_lck->lock_data;
+	struct brl_range_iter it;
+	struct lock_struct *lock = NULL;
 	enum brl_type deleted_lock_type = READ_LOCK; /* shut the compiler up.... */
 
 	SMB_ASSERT(plock->lock_type == UNLOCK_LOCK);
 
-#if ZERO_ZERO
-	/* Delete write locks by preference... The lock list
-	   is sorted in the zero zero case. */
-
-	for (i = 0; i < br_lck->num_locks; i++) {
-		struct lock_struct *lock = &locks[i];
-
-		if (lock->lock_type == WRITE_LOCK &&
-		    brl_same_context(&lock->context, &plock->context) &&
-		    lock->fnum == plock->fnum &&
-		    lock->lock_flav == WINDOWS_LOCK &&
-		    lock->start == plock->start &&
-		    lock->size == plock->size) {
-
-			/* found it - delete it */
-			deleted_lock_type = lock->lock_type;
-			break;
-		}
-	}
-
-	if (i != br_lck->num_locks) {
-		/* We found it - don't search again. */
-		goto unlock_continue;
-	}
-#endif
-
-	for (i = 0; i < br_lck->num_locks; i++) {
-		struct lock_struct *lock = &locks[i];
+	brl_range_iter_init(&it, plock->start, plock->size);
 
+	while ((lock = brl_range_next(br_lck, &it)) != NULL) {
 		/* Only remove our own locks that match in start, size, and flavour. */
 		if (brl_same_context(&lock->context, &plock->context) &&
 					lock->fnum == plock->fnum &&
@@ -1072,28 +1797,38 @@ bool brl_unlock_windows_default(struct byte_range_lock *br_lck,
 		}
 	}
 
-	if (i == br_lck->num_locks) {
+	if (lock == NULL) {
 		/* we didn't find it */
 		return False;
 	}
 
-#if ZERO_ZERO
-  unlock_continue:
-#endif
-
-	ARRAY_DEL_ELEMENT(locks, i, br_lck->num_locks);
-	br_lck->num_locks -= 1;
-	br_lck->modified = True;
+	brl_delete_lock(br_lck, it.page, it.idx - 1);
 
 	/* Unlock the underlying POSIX regions. */
 	if(lp_posix_locking(br_lck->fsp->conn->params)) {
+		struct lock_struct *locks = NULL;
+		unsigned int num_locks = 0;
+		bool ok;
+
+		ok = brl_range_locks(talloc_tos(),
+				     br_lck,
+				     plock->start,
+				     plock->size,
+				     &locks,
+				     &num_locks);
+		if (!ok) {
+			DBG_WARNING("Could not collect overlapping locks, "
+				    "releasing the whole range\n");
+		}
+
 		release_posix_lock_windows_flavour(br_lck->fsp,
 				plock->start,
 				plock->size,
 				deleted_lock_type,
 				&plock->context,
 				locks,
-				br_lck->num_locks);
+				num_locks);
+		TALLOC_FREE(locks);
 	}
 
 	contend_level2_oplocks_end(br_lck->fsp, LEVEL2_CONTEND_WINDOWS_BRL);
@@ -1109,8 +1844,10 @@ static bool brl_unlock_posix(struct byte_range_lock *br_lck,
 {
 	unsigned int i, count;
 	struct lock_struct *tp;
-	struct lock_struct *locks = br_lck->lock_data;
+	struct lock_struct *locks = NULL;
+	unsigned int num_locks = 0;
 	bool overlap_found = False;
+	bool ok;
 
 	/* No zero-zero locks for POSIX. */
 	if (plock->start == 0 && plock->size == 0) {
@@ -1124,18 +1861,25 @@ static bool brl_unlock_posix(struct byte_range_lock *br_lck,
 		return False;
 	}
 
+	ok = brl_get_all_locks(br_lck, br_lck, &locks, &num_locks);
+	if (!ok) {
+		DEBUG(10,("brl_unlock_posix: could not load locks\n"));
+		return False;
+	}
+
 	/* The worst case scenario here is we have to split an
 	   existing POSIX lock range into two, so we need at most
 	   1 more entry. */
 
-	tp = talloc_array(br_lck, struct lock_struct, br_lck->num_locks + 1);
+	tp = talloc_array(br_lck, struct lock_struct, num_locks + 1);
 	if (!tp) {
 		DEBUG(10,("brl_unlock_posix: malloc fail\n"));
+		TALLOC_FREE(locks);
 		return False;
 	}
 
 	count = 0;
-	for (i = 0; i < br_lck->num_locks; i++) {
+	for (i = 0; i < num_locks; i++) {
 		struct lock_struct *lock = &locks[i];
 		unsigned int tmp_count;
 
@@ -1150,6 +1894,7 @@ static bool brl_unlock_posix(struct byte_range_lock *br_lck,
 			/* Do any Windows flavour locks conflict ? */
 			if (brl_conflict(lock, plock)) {
 				TALLOC_FREE(tp);
+				TALLOC_FREE(locks);
 				return false;
 			}
 			/* Just copy the Windows lock into the new array. */
@@ -1182,16 +1927,18 @@ static bool brl_unlock_posix(struct byte_range_lock *br_lck,
 			/* We know we're finished here as we can't overlap any
 			   more POSIX locks. Copy the rest of the lock array. */
 
-			if (i < br_lck->num_locks - 1) {
+			if (i < num_locks - 1) {
 				memcpy(&tp[count], &locks[i+1],
-					sizeof(*locks)*((br_lck->num_locks-1) - i));
-				count += ((br_lck->num_locks-1) - i);
+					sizeof(*locks)*((num_locks-1) - i));
+				count += ((num_locks-1) - i);
 			}
 			break;
 		}
 
 	}
 
+	TALLOC_FREE(locks);
+
 	if (!overlap_found) {
 		/* Just ignore - no change. */
 		TALLOC_FREE(tp);
@@ -1209,28 +1956,16 @@ static bool brl_unlock_posix(struct byte_range_lock *br_lck,
 						count);
 	}
 
-	/* Realloc so we don't leak entries per unlock call. */
-	if (count) {
-		tp = talloc_realloc(br_lck, tp, struct lock_struct, count);
-		if (!tp) {
-			DEBUG(10,("brl_unlock_posix: realloc fail\n"));
-			return False;
-		}
-	} else {
-		/* We deleted the last lock. */
-		TALLOC_FREE(tp);
-		tp = NULL;
+	ok = brl_set_locks(br_lck, tp, count);
+	TALLOC_FREE(tp);
+	if (!ok) {
+		DEBUG(10,("brl_unlock_posix: brl_set_locks failed\n"));
+		return False;
 	}
 
 	contend_level2_oplocks_end(br_lck->fsp,
 				   LEVEL2_CONTEND_POSIX_BRL);
 
-	br_lck->num_locks = count;
-	TALLOC_FREE(br_lck->lock_data);
-	locks = tp;
-	br_lck->lock_data = tp;
-	br_lck->modified = True;
-
 	return True;
 }
 
@@ -1273,24 +2008,25 @@ bool brl_locktest(struct byte_range_lock *br_lck,
 		  const struct lock_struct *rw_probe)
 {
 	bool ret = True;
-	unsigned int i;
-	struct lock_struct *locks = br_lck->lock_data;
+	struct brl_range_iter it;
+	struct lock_struct *lock = NULL;
 	files_struct *fsp = br_lck->fsp;
 
+	brl_range_iter_init(&it, rw_probe->start, rw_probe->size);
+
 	/* Make sure existing locks don't conflict */
-	for (i=0; i < br_lck->num_locks; i++) {
+	while ((lock = brl_range_next(br_lck, &it)) != NULL) {
 		/*
 		 * Our own locks don't conflict.
 		 */
-		if (brl_conflict_other(&locks[i], rw_probe)) {
+		if (brl_conflict_other(lock, rw_probe)) {
 			if (br_lck->record == NULL) {
 				/* readonly */
 				return false;
 			}
 
-			if (!serverid_exists(&locks[i].context.pid)) {
-				locks[i].context.pid.pid = 0;
-				br_lck->modified = true;
+			if (!serverid_exists(&lock->context.pid)) {
+				brl_range_mark_dead(br_lck, &it, lock);
 				continue;
 			}
 
@@ -1298,6 +2034,15 @@ bool brl_locktest(struct byte_range_lock *br_lck,
 		}
 	}
 
+	if (it.failed) {
+		/*
+		 * Readonly, the pages changed while we looked at
+		 * them. Report a conflict, strict_lock_check_default()
+		 * retries with the record locked.
+		 */
+		return false;
+	}
+
 	/*
 	 * There is no lock held by an SMB daemon, check to
 	 * see if there is a POSIX lock from a UNIX or NFS process.
@@ -1341,9 +2086,9 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 		enum brl_type *plock_type,
 		enum brl_flavour lock_flav)
 {
-	unsigned int i;
+	struct brl_range_iter it;
+	const struct lock_struct *exlock = NULL;
 	struct lock_struct lock;
-	const struct lock_struct *locks = br_lck->lock_data;
 	files_struct *fsp = br_lck->fsp;
 
 	lock.context.smblctx = *psmblctx;
@@ -1355,9 +2100,10 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 	lock.lock_type = *plock_type;
 	lock.lock_flav = lock_flav;
 
+	brl_range_iter_init(&it, lock.start, lock.size);
+
 	/* Make sure existing locks don't conflict */
-	for (i=0; i < br_lck->num_locks; i++) {
-		const struct lock_struct *exlock = &locks[i];
+	while ((exlock = brl_range_next(br_lck, &it)) != NULL) {
 		bool conflict = False;
 
 		if (exlock->lock_flav == WINDOWS_LOCK) {
@@ -1375,6 +2121,27 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 		}
 	}
 
+	if (it.failed && (br_lck->record == NULL)) {
+		/*
+		 * The pages changed while we looked at them, ask
+		 * again with the record locked.
+		 */
+		struct byte_range_lock *locked = NULL;
+		NTSTATUS status;
+
+		locked = brl_get_locks(talloc_tos(), fsp);
+		if (locked == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+		status = brl_lockquery(locked, psmblctx, pid, pstart, psize,
+				       plock_type, lock_flav);
+		TALLOC_FREE(locked);
+		return status;
+	}
+	if (it.failed) {
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	}
+
 	/*
 	 * There is no lock held by an SMB daemon, check to
 	 * see if there is a POSIX lock from a UNIX or NFS process.
@@ -1411,23 +2178,15 @@ void brl_close_fnum(struct byte_range_lock *br_lck)
 	uint32_t tid = fsp->conn->cnum;
 	uint64_t fnum = fsp->fnum;
 	unsigned int i;
-	struct lock_struct *locks = br_lck->lock_data;
 	struct server_id pid = messaging_server_id(fsp->conn->sconn->msg_ctx);
 	struct lock_struct *locks_copy;
 	unsigned int num_locks_copy;
 
 	/* Copy the current lock array. */
-	if (br_lck->num_locks) {
-		locks_copy = (struct lock_struct *)talloc_memdup(br_lck, locks, br_lck->num_locks * sizeof(struct lock_struct));
-		if (!locks_copy) {
-			smb_panic("brl_close_fnum: talloc failed");
-			}
-	} else {
-		locks_copy = NULL;
+	if (!brl_get_all_locks(br_lck, br_lck, &locks_copy, &num_locks_copy)) {
+		smb_panic("brl_close_fnum: talloc failed");
 	}
 
-	num_locks_copy = br_lck->num_locks;
-
 	for (i=0; i < num_locks_copy; i++) {
 		struct lock_struct *lock = &locks_copy[i];
 
@@ -1443,6 +2202,8 @@ void brl_close_fnum(struct byte_range_lock *br_lck)
 				lock->lock_flav);
 		}
 	}
+
+	TALLOC_FREE(locks_copy);
 }
 
 bool brl_mark_disconnected(struct files_struct *fsp)
@@ -1453,6 +2214,8 @@ bool brl_mark_disconnected(struct files_struct *fsp)
 	unsigned int i;
 	struct server_id self = messaging_server_id(fsp->conn->sconn->msg_ctx);
 	struct byte_range_lock *br_lck = NULL;
+	struct lock_struct *locks = NULL;
+	unsigned int num_locks = 0;
 
 	if (fsp->op == NULL) {
 		return false;
@@ -1473,8 +2236,13 @@ bool brl_mark_disconnected(struct files_struct *fsp)
 		return false;
 	}
 
-	for (i=0; i < br_lck->num_locks; i++) {
-		struct lock_struct *lock = &br_lck->lock_data[i];
+	if (!brl_get_all_locks(br_lck, br_lck, &locks, &num_locks)) {
+		TALLOC_FREE(br_lck);
+		return false;
+	}
+
+	for (i=0; i < num_locks; i++) {
+		struct lock_struct *lock = &locks[i];
 
 		/*
 		 * as this is a durable handle, we only expect locks
@@ -1506,7 +2274,10 @@ bool brl_mark_disconnected(struct files_struct *fsp)
 		lock->fnum = FNUM_FIELD_INVALID;
 	}
 
-	br_lck->modified = true;
+	if (!brl_set_locks(br_lck, locks, num_locks)) {
+		TALLOC_FREE(br_lck);
+		return false;
+	}
 	TALLOC_FREE(br_lck);
 	return true;
 }
@@ -1519,6 +2290,8 @@ bool brl_reconnect_disconnected(struct files_struct *fsp)
 	unsigned int i;
 	struct server_id self = messaging_server_id(fsp->conn->sconn->msg_ctx);
 	struct byte_range_lock *br_lck = NULL;
+	struct lock_struct *locks = NULL;
+	unsigned int num_locks = 0;
 
 	if (fsp->op == NULL) {
 		return false;
@@ -1546,8 +2319,13 @@ bool brl_reconnect_disconnected(struct files_struct *fsp)
 		return true;
 	}
 
-	for (i=0; i < br_lck->num_locks; i++) {
-		struct lock_struct *lock = &br_lck->lock_data[i];
+	if (!brl_get_all_locks(br_lck, br_lck, &locks, &num_locks)) {
+		TALLOC_FREE(br_lck);
+		return false;
+	}
+
+	for (i=0; i < num_locks; i++) {
+		struct lock_struct *lock = &locks[i];
 
 		/*
 		 * as this is a durable handle we only expect locks
@@ -1579,8 +2357,12 @@ bool brl_reconnect_disconnected(struct files_struct *fsp)
 		lock->fnum = fnum;
 	}
 
-	fsp->current_lock_count = br_lck->num_locks;
-	br_lck->modified = true;
+	if (!brl_set_locks(br_lck, locks, num_locks)) {
+		TALLOC_FREE(br_lck);
+		return false;
+	}
+
+	fsp->current_lock_count = num_locks;
 	TALLOC_FREE(br_lck);
 	return true;
 }
@@ -1603,7 +2385,7 @@ static int brl_traverse_fn(struct db_record *rec, void *state)
 {
 	struct brl_forall_cb *cb = (struct brl_forall_cb *)state;
 	struct lock_struct *locks;
-	struct file_id *key;
+	struct file_id key;
 	unsigned int i;
 	unsigned int num_locks = 0;
 	TDB_DATA dbkey;
@@ -1612,21 +2394,31 @@ static int brl_traverse_fn(struct db_record *rec, void *state)
 	dbkey = dbwrap_record_get_key(rec);
 	value = dbwrap_record_get_value(rec);
 
-	/* In a traverse function we must make a copy of
-	   dbuf before modifying it. */
+	if (dbkey.dsize != BRL_PAGE_KEY_LEN) {
+		DBG_DEBUG("Ignoring key of size %zu\n", dbkey.dsize);
+		return 0;
+	}
+	if (value.dsize <= sizeof(uint64_t)) {
+		DBG_DEBUG("Ignoring page of size %zu\n", value.dsize);
+		return 0;
+	}
+
+	/* Skip the generation. In a traverse function we must make
+	   a copy of dbuf before modifying it. */
 
 	locks = (struct lock_struct *)talloc_memdup(
-		talloc_tos(), value.dptr, value.dsize);
+		talloc_tos(), value.dptr + sizeof(uint64_t),
+		value.dsize - sizeof(uint64_t));
 	if (!locks) {
 		return -1; /* Terminate traversal. */
 	}
 
-	key = (struct file_id *)dbkey.dptr;
-	num_locks = value.dsize/sizeof(*locks);
+	memcpy(&key, dbkey.dptr, sizeof(key));
+	num_locks = (value.dsize - sizeof(uint64_t))/sizeof(*locks);
 
 	if (cb->fn) {
 		for ( i=0; i<num_locks; i++) {
-			cb->fn(*key,
+			cb->fn(key,
 				locks[i].context.pid,
 				locks[i].lock_type,
 				locks[i].lock_flav,
@@ -1655,12 +2447,12 @@ int brl_forall(void (*fn)(struct file_id id, struct server_id pid,
 	NTSTATUS status;
 	int count = 0;
 
-	if (!brlock_db) {
+	if (!brlock_pages_db) {
 		return 0;
 	}
 	cb.fn = fn;
 	cb.private_data = private_data;
-	status = dbwrap_traverse(brlock_db, brl_traverse_fn, &cb, &count);
+	status = dbwrap_traverse(brlock_pages_db, brl_traverse_fn, &cb, &count);
 
 	if (!NT_STATUS_IS_OK(status)) {
 		return -1;
@@ -1671,51 +2463,123 @@ int brl_forall(void (*fn)(struct file_id id, struct server_id pid,
 
 /*******************************************************************
  Store a potentially modified set of byte range lock data back into
- the database.
- Unlock the record.
+ the database: The changed pages first, then the index, all with a
+ new generation. Unlock the record.
 ********************************************************************/
 
 static void byte_range_lock_flush(struct byte_range_lock *br_lck)
 {
-	unsigned i;
-	struct lock_struct *locks = br_lck->lock_data;
+	unsigned int i, j;
+	NTSTATUS status;
 
 	if (!br_lck->modified) {
 		DEBUG(10, ("br_lck not modified\n"));
 		goto done;
 	}
 
-	i = 0;
+	br_lck->generation += 1;
+	if (br_lck->generation == 0) {
+		/* 0 is what brl_load_page() expects from missing pages */
+		br_lck->generation = 1;
+	}
+
+	for (i=0; i < br_lck->num_pages; i++) {
+		struct brl_page *page = &br_lck->pages[i];
+		struct lock_struct *locks = page->locks;
+		uint8_t keybuf[BRL_PAGE_KEY_LEN];
+		TDB_DATA key;
+		unsigned int l = 0;
+
+		if (!page->dirty) {
+			continue;
+		}
+
+		while (l < page->num_locks) {
+			if (locks[l].context.pid.pid == 0) {
+				/*
+				 * Autocleanup, the process conflicted and does not
+				 * exist anymore.
+				 */
+				ARRAY_DEL_ELEMENT(locks, l, page->num_locks);
+				page->num_locks -= 1;
+			} else {
+				l += 1;
+			}
+		}
+
+		brl_page_update_desc(br_lck, i);
+		br_lck->descs[i].generation = br_lck->generation;
 
-	while (i < br_lck->num_locks) {
-		if (locks[i].context.pid.pid == 0) {
-			/*
-			 * Autocleanup, the process conflicted and does not
-			 * exist anymore.
-			 */
-			locks[i] = locks[br_lck->num_locks-1];
-			br_lck->num_locks -= 1;
+		key = brl_page_key(br_lck->id, br_lck->descs[i].page_id, keybuf);
+
+		if (page->num_locks == 0) {
+			status = dbwrap_delete(brlock_pages_db, key);
+			if (!NT_STATUS_IS_OK(status) &&
+			    !NT_STATUS_EQUAL(status, NT_STATUS_NOT_FOUND)) {
+				DEBUG(0, ("delete_rec returned %s\n",
+					  nt_errstr(status)));
+				smb_panic("Could not delete byte range lock page");
+			}
 		} else {
-			i += 1;
+			size_t len = page->num_locks * sizeof(struct lock_struct);
+			TDB_DATA data = {
+				.dsize = sizeof(uint64_t) + len,
+			};
+
+			data.dptr = talloc_size(br_lck, data.dsize);
+			if (data.dptr == NULL) {
+				smb_panic("Could not store byte range lock page");
+			}
+			memcpy(data.dptr, &br_lck->generation, sizeof(uint64_t));
+			memcpy(data.dptr + sizeof(uint64_t), locks, len);
+
+			status = dbwrap_store(brlock_pages_db, key, data,
+					      TDB_REPLACE);
+			TALLOC_FREE(data.dptr);
+			if (!NT_STATUS_IS_OK(status)) {
+				DEBUG(0, ("store returned %s\n",
+					  nt_errstr(status)));
+				smb_panic("Could not store byte range lock page");
+			}
 		}
+
+		page->dirty = false;
 	}
 
-	if (br_lck->num_locks == 0) {
+	/* Drop the empty pages from the index */
+
+	j = 0;
+
+	for (i=0; i < br_lck->num_pages; i++) {
+		if (br_lck->descs[i].num_locks == 0) {
+			continue;
+		}
+		br_lck->descs[j] = br_lck->descs[i];
+		br_lck->pages[j] = br_lck->pages[i];
+		j += 1;
+	}
+	br_lck->num_pages = j;
+	br_lck->max_last_upto_valid = false;
+
+	if (br_lck->num_pages == 0) {
 		/* No locks - delete this entry. */
-		NTSTATUS status = dbwrap_record_delete(br_lck->record);
+		status = dbwrap_record_delete(br_lck->record);
 		if (!NT_STATUS_IS_OK(status)) {
 			DEBUG(0, ("delete_rec returned %s\n",
 				  nt_errstr(status)));
 			smb_panic("Could not delete byte range lock entry");
 		}
 	} else {
-		TDB_DATA data = {
-			.dsize = br_lck->num_locks * sizeof(struct lock_struct),
-			.dptr = (uint8_t *)br_lck->lock_data,
+		TDB_DATA dbufs[] = {
+			{ .dptr = (uint8_t *)&br_lck->generation,
+			  .dsize = sizeof(br_lck->generation) },
+			{ .dptr = (uint8_t *)br_lck->descs,
+			  .dsize = br_lck->num_pages *
+				   sizeof(struct brl_page_desc) },
 		};
-		NTSTATUS status;
 
-		status = dbwrap_record_store(br_lck->record, data, TDB_REPLACE);
+		status = dbwrap_record_storev(br_lck->record, dbufs,
+					      ARRAY_SIZE(dbufs), TDB_REPLACE);
 		if (!NT_STATUS_IS_OK(status)) {
 			DEBUG(0, ("store returned %s\n", nt_errstr(status)));
 			smb_panic("Could not store byte range mode entry");
@@ -1735,36 +2599,57 @@ static int byte_range_lock_destructor(struct byte_range_lock *br_lck)
 	return 0;
 }
 
+/*******************************************************************
+ Parse the index record, the pages are loaded when needed.
+********************************************************************/
+
 static bool brl_parse_data(struct byte_range_lock *br_lck, TDB_DATA data)
 {
-	size_t data_len;
+	unsigned int i;
 
 	if (data.dsize == 0) {
+		/*
+		 * Don't let a new record repeat the generations of a
+		 * deleted one a reader might still look at.
+		 */
+		br_lck->generation = generate_random_u64();
 		return true;
 	}
-	if (data.dsize % sizeof(struct lock_struct) != 0) {
+	if ((data.dsize < sizeof(uint64_t)) ||
+	    ((data.dsize - sizeof(uint64_t)) %
+	     sizeof(struct brl_page_desc) != 0)) {
 		DEBUG(1, ("Invalid data size: %u\n", (unsigned)data.dsize));
 		return false;
 	}
 
-	br_lck->num_locks = data.dsize / sizeof(struct lock_struct);
-	data_len = br_lck->num_locks * sizeof(struct lock_struct);
+	memcpy(&br_lck->generation, data.dptr, sizeof(uint64_t));
+	data.dptr += sizeof(uint64_t);
+	data.dsize -= sizeof(uint64_t);
+
+	br_lck->num_pages = data.dsize / sizeof(struct brl_page_desc);
 
-	br_lck->lock_data = talloc_memdup(br_lck, data.dptr, data_len);
-	if (br_lck->lock_data == NULL) {
+	br_lck->descs = talloc_memdup(br_lck, data.dptr, data.dsize);
+	if (br_lck->descs == NULL) {
 		DEBUG(1, ("talloc_memdup failed\n"));
 		return false;
 	}
+
+	br_lck->pages = talloc_zero_array(br_lck, struct brl_page,
+					  br_lck->num_pages);
+	if (br_lck->pages == NULL) {
+		DEBUG(1, ("talloc_zero_array failed\n"));
+		return false;
+	}
+
+	for (i=0; i < br_lck->num_pages; i++) {
+		br_lck->num_locks += br_lck->descs[i].num_locks;
+	}
+
 	return true;
 }
 
-/*******************************************************************
- Fetch a set of byte range lock data from the database.
- Leave the record locked.
- TALLOC_FREE(brl) will release the lock in the destructor.
-********************************************************************/
-
-struct byte_range_lock *brl_get_locks(TALLOC_CTX *mem_ctx, files_struct *fsp)
+static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
+						      struct file_id id)
 {
 	TDB_DATA key, data;
 	struct byte_range_lock *br_lck;
@@ -1774,9 +2659,9 @@ struct byte_range_lock *brl_get_locks(TALLOC_CTX *mem_ctx, files_struct *fsp)
 		return NULL;
 	}
 
-	br_lck->fsp = fsp;
+	br_lck->id = id;
 
-	key.dptr = (uint8_t *)&fsp->file_id;
+	key.dptr = (uint8_t *)&br_lck->id;
 	key.dsize = sizeof(struct file_id);
 
 	br_lck->record = dbwrap_fetch_locked(brlock_db, br_lck, key);
@@ -1796,15 +2681,41 @@ struct byte_range_lock *brl_get_locks(TALLOC_CTX *mem_ctx, files_struct *fsp)
 
 	talloc_set_destructor(br_lck, byte_range_lock_destructor);
 
+	return br_lck;
+}
+
+/*******************************************************************
+ Fetch a set of byte range lock data from the database.
+ Leave the record locked.
+ TALLOC_FREE(brl) will release the lock in the destructor.
+********************************************************************/
+
+struct byte_range_lock *brl_get_locks(TALLOC_CTX *mem_ctx, files_struct *fsp)
+{
+	struct byte_range_lock *br_lck;
+
+	br_lck = brl_get_locks_internal(mem_ctx, fsp->file_id);
+	if (br_lck == NULL) {
+		return NULL;
+	}
+
+	br_lck->fsp = fsp;
+
 	if (DEBUGLEVEL >= 10) {
-		unsigned int i;
+		unsigned int i, p, n = 0;
 		struct file_id_buf buf;
-		struct lock_struct *locks = br_lck->lock_data;
 		DBG_DEBUG("%u current locks on file_id %s\n",
 			  br_lck->num_locks,
 			  file_id_str_buf(fsp->file_id, &buf));
-		for( i = 0; i < br_lck->num_locks; i++) {
-			print_lock_struct(i, &locks[i]);
+		for (p = 0; p < br_lck->num_pages; p++) {
+			const struct brl_page *page = &br_lck->pages[p];
+
+			if (!brl_load_page(br_lck, p)) {
+				continue;
+			}
+			for (i = 0; i < page->num_locks; i++) {
+				print_lock_struct(n++, &page->locks[i]);
+			}
 		}
 	}
 
@@ -1831,8 +2742,8 @@ struct byte_range_lock *brl_get_locks_for_locking(TALLOC_CTX *mem_ctx,
 }
 
 struct brl_get_locks_readonly_state {
-	TALLOC_CTX *mem_ctx;
-	struct byte_range_lock **br_lock;
+	struct byte_range_lock *br_lck;
+	bool ok;
 };
 
 static void brl_get_locks_readonly_parser(TDB_DATA key, TDB_DATA data,
@@ -1840,20 +2751,8 @@ static void brl_get_locks_readonly_parser(TDB_DATA key, TDB_DATA data,
 {
 	struct brl_get_locks_readonly_state *state =
 		(struct brl_get_locks_readonly_state *)private_data;
-	struct byte_range_lock *br_lck;
 
-	br_lck = talloc_pooled_object(
-		state->mem_ctx, struct byte_range_lock, 1, data.dsize);
-	if (br_lck == NULL) {
-		*state->br_lock = NULL;
-		return;
-	}
-	*br_lck = (struct byte_range_lock) { 0 };
-	if (!brl_parse_data(br_lck, data)) {
-		*state->br_lock = NULL;
-		return;
-	}
-	*state->br_lock = br_lck;
+	state->ok = brl_parse_data(state->br_lck, data);
 }
 
 struct byte_range_lock *brl_get_locks_readonly(files_struct *fsp)
@@ -1874,12 +2773,27 @@ struct byte_range_lock *brl_get_locks_readonly(files_struct *fsp)
 		return fsp->brlock_rec;
 	}
 
+	br_lock = talloc_zero(fsp, struct byte_range_lock);
+	if (br_lock == NULL) {
+		return NULL;
+	}
+	br_lock->fsp = fsp;
+	br_lock->id = fsp->file_id;
+
+	/*
+	 * Remember the sequence number before reading the index for
+	 * the fsp->brlock_rec cache, brl_load_page() checks the page
+	 * generations.
+	 */
+	br_lock->seqnum = dbwrap_get_seqnum(brlock_db);
+
 	/*
 	 * Parse the record fresh from the database
 	 */
 
-	state.mem_ctx = fsp;
-	state.br_lock = &br_lock;
+	state = (struct brl_get_locks_readonly_state) {
+		.br_lck = br_lock, .ok = true,
+	};
 
 	status = dbwrap_parse_record(
 		brlock_db,
@@ -1889,33 +2803,26 @@ struct byte_range_lock *brl_get_locks_readonly(files_struct *fsp)
 
 	if (NT_STATUS_EQUAL(status,NT_STATUS_NOT_FOUND)) {
 		/*
-		 * No locks on this file. Return an empty br_lock.
+		 * No locks on this file. Keep the empty br_lock.
 		 */
-		br_lock = talloc_zero(fsp, struct byte_range_lock);
-		if (br_lock == NULL) {
-			return NULL;
-		}
-
 	} else if (!NT_STATUS_IS_OK(status)) {
 		DEBUG(3, ("Could not parse byte range lock record: "
 			  "%s\n", nt_errstr(status)));
+		TALLOC_FREE(br_lock);
 		return NULL;
 	}
-	if (br_lock == NULL) {
+	if (!state.ok) {
+		TALLOC_FREE(br_lock);
 		return NULL;
 	}
 
-	br_lock->fsp = fsp;
-	br_lock->modified = false;
-	br_lock->record = NULL;
-
 	/*
 	 * Cache the brlock struct, invalidated when the dbwrap_seqnum
 	 * changes. See beginning of this routine.
 	 */
 	TALLOC_FREE(fsp->brlock_rec);
 	fsp->brlock_rec = br_lock;
-	fsp->brlock_seqnum = dbwrap_get_seqnum(brlock_db);
+	fsp->brlock_seqnum = br_lock->seqnum;
 
 	return br_lock;
 }
@@ -1924,32 +2831,33 @@ bool brl_cleanup_disconnected(struct file_id fid, uint64_t open_persistent_id)
 {
 	bool ret = false;
 	TALLOC_CTX *frame = talloc_stackframe();
-	TDB_DATA key, val;
-	struct db_record *rec;
-	struct lock_struct *lock;
-	unsigned n, num;
+	struct byte_range_lock *br_lck = NULL;
+	struct lock_struct *lock = NULL;
+	unsigned n, num = 0;
 	struct file_id_buf buf;
-	NTSTATUS status;
+	bool ok;
 
-	key = make_tdb_data((void*)&fid, sizeof(fid));
-
-	rec = dbwrap_fetch_locked(brlock_db, frame, key);
-	if (rec == NULL) {
+	br_lck = brl_get_locks_internal(frame, fid);
+	if (br_lck == NULL) {
 		DBG_INFO("failed to fetch record for file %s\n",
 			 file_id_str_buf(fid, &buf));
 		goto done;
 	}
 
-	val = dbwrap_record_get_value(rec);
-	lock = (struct lock_struct*)val.dptr;
-	num = val.dsize / sizeof(struct lock_struct);
-	if (lock == NULL) {
+	if (br_lck->num_pages == 0) {
 		DBG_DEBUG("no byte range locks for file %s\n",
 			  file_id_str_buf(fid, &buf));
 		ret = true;
 		goto done;
 	}
 
+	ok = brl_get_all_locks(frame, br_lck, &lock, &num);
+	if (!ok) {
+		DBG_INFO("failed to load byte range locks for file %s\n",
+			 file_id_str_buf(fid, &buf));
+		goto done;
+	}
+
 	for (n=0; n<num; n++) {
 		struct lock_context *ctx = &lock[n].context;
 
@@ -1972,17 +2880,18 @@ bool brl_cleanup_disconnected(struct file_id fid, uint64_t open_persistent_id)
 		}
 	}
 
-	status = dbwrap_record_delete(rec);
-	if (!NT_STATUS_IS_OK(status)) {
-		DBG_INFO("failed to delete record "
-			 "for file %s from %s, open %"PRIu64": %s\n",
+	ok = brl_set_locks(br_lck, NULL, 0);
+	if (!ok) {
+		DBG_INFO("failed to delete byte range locks "
+			 "for file %s, open %"PRIu64"\n",
 			 file_id_str_buf(fid, &buf),
-			 dbwrap_name(brlock_db),
-			 open_persistent_id,
-			 nt_errstr(status));
+			 open_persistent_id);
 		goto done;
 	}
 
+	/* byte_range_lock_flush() deletes the pages and the index */
+	TALLOC_FREE(br_lck);
+
 	DBG_DEBUG("file %s cleaned up %u entries from open %"PRIu64"\n",
 		  file_id_str_buf(fid, &buf),
 		  num,
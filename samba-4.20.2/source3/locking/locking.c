@@ -616,6 +616,7 @@ bool rename_share_filename(struct messaging_context *msg_ctx,
 		return false;
 	}
 	d->modified = True;
+	d->overflow_modified = true;
 
 	ok = share_mode_forall_entries(
 		lck, rename_share_filename_fn, &state);
@@ -802,6 +803,7 @@ static bool add_delete_on_close_token(struct share_mode_data *d,
 	}
 	d->num_delete_tokens += 1;
 	d->modified = true;
+	d->overflow_modified = true;
 	return true;
 }
 
@@ -826,6 +828,7 @@ void reset_delete_on_close_lck(files_struct *fsp,
 
 		if (dt->name_hash == fsp->name_hash) {
 			d->modified = true;
+			d->overflow_modified = true;
 
 			/* Delete this entry. */
 			TALLOC_FREE(dt->delete_nt_token);
@@ -906,6 +909,7 @@ void set_delete_on_close_lck(files_struct *fsp,
 		struct delete_token *dt = &d->delete_tokens[i];
 		if (dt->name_hash == fsp->name_hash) {
 			d->modified = true;
+			d->overflow_modified = true;
 
 			/* Replace this token with the given tok. */
 			TALLOC_FREE(dt->delete_nt_token);
@@ -61,6 +61,7 @@ struct share_mode_lock {
 #include "../lib/util/memcache.h"
 #include "lib/util/tevent_ntstatus.h"
 #include "g_lock.h"
+#include "locking/share_mode_shm.h"
 #include "smbd/fd_handle.h"
 #include "lib/global_contexts.h"
 
@@ -77,37 +78,179 @@ struct share_mode_lock {
 static struct g_lock_ctx *lock_ctx;
 static struct g_lock_lock_cb_state *current_share_mode_glck = NULL;
 
+/*
+ * With "share mode shm size" the records and their locks live in
+ * locking.shm, lock_ctx is then only used to wake watchers.
+ */
+static struct share_mode_shm *lock_shm;
+
 static bool share_mode_g_lock_within_cb(TDB_DATA key);
 
-static NTSTATUS share_mode_g_lock_dump(TDB_DATA key,
-				       void (*fn)(struct server_id exclusive,
-						  size_t num_shared,
-						  const struct server_id *shared,
-						  const uint8_t *data,
-						  size_t datalen,
-						  void *private_data),
-				       void *private_data)
+static struct file_id locking_key_file_id(TDB_DATA key)
+{
+	struct file_id id;
+
+	SMB_ASSERT(key.dsize == sizeof(id));
+	memcpy(&id, key.dptr, sizeof(id));
+	return id;
+}
+
+/*
+ * The dump callbacks below get the fixed share_mode_data fields from
+ * the locking.shm slot, or NULL for locking.tdb where the NDR
+ * share_mode_data contains all of them.
+ */
+struct share_mode_g_lock_dump_state {
+	void (*fn)(const struct share_mode_shm_fixed *fixed,
+		   struct server_id exclusive,
+		   size_t num_shared,
+		   const struct server_id *shared,
+		   const uint8_t *data,
+		   size_t datalen,
+		   void *private_data);
+	void *private_data;
+};
+
+static void share_mode_g_lock_dump_fn(struct server_id exclusive,
+				      size_t num_shared,
+				      const struct server_id *shared,
+				      const uint8_t *data,
+				      size_t datalen,
+				      void *private_data)
+{
+	struct share_mode_g_lock_dump_state *state = private_data;
+
+	state->fn(NULL,
+		  exclusive,
+		  num_shared,
+		  shared,
+		  data,
+		  datalen,
+		  state->private_data);
+}
+
+/*
+ * Like share_mode_g_lock_dump(), but without looking at a share mode
+ * we might have locked.
+ */
+static NTSTATUS share_mode_dump_unlocked(
+	TDB_DATA key,
+	void (*fn)(const struct share_mode_shm_fixed *fixed,
+		   struct server_id exclusive,
+		   size_t num_shared,
+		   const struct server_id *shared,
+		   const uint8_t *data,
+		   size_t datalen,
+		   void *private_data),
+	void *private_data)
+{
+	struct share_mode_g_lock_dump_state state = {
+		.fn = fn, .private_data = private_data,
+	};
+
+	if (lock_shm != NULL) {
+		return share_mode_shm_dump(lock_shm,
+					   locking_key_file_id(key),
+					   fn,
+					   private_data);
+	}
+
+	return g_lock_dump(lock_ctx, key, share_mode_g_lock_dump_fn, &state);
+}
+
+static NTSTATUS share_mode_g_lock_dump(
+	TDB_DATA key,
+	void (*fn)(const struct share_mode_shm_fixed *fixed,
+		   struct server_id exclusive,
+		   size_t num_shared,
+		   const struct server_id *shared,
+		   const uint8_t *data,
+		   size_t datalen,
+		   void *private_data),
+	void *private_data)
 {
 	if (share_mode_g_lock_within_cb(key)) {
+		struct share_mode_g_lock_dump_state state = {
+			.fn = fn, .private_data = private_data,
+		};
 		return g_lock_lock_cb_dump(current_share_mode_glck,
-					   fn, private_data);
+					   share_mode_g_lock_dump_fn,
+					   &state);
 	}
 
-	return g_lock_dump(lock_ctx, key, fn, private_data);
+	return share_mode_dump_unlocked(key, fn, private_data);
 }
 
-static NTSTATUS share_mode_g_lock_writev(TDB_DATA key,
-					 const TDB_DATA *dbufs,
-					 size_t num_dbufs)
+/*
+ * fixed is only stored with lock_shm, NULL keeps what's there.
+ */
+static NTSTATUS share_mode_g_lock_writev(
+	TDB_DATA key,
+	const struct share_mode_shm_fixed *fixed,
+	const TDB_DATA *dbufs,
+	size_t num_dbufs)
 {
 	if (share_mode_g_lock_within_cb(key)) {
 		return g_lock_lock_cb_writev(current_share_mode_glck,
 					     dbufs, num_dbufs);
 	}
 
+	if (lock_shm != NULL) {
+		return share_mode_shm_writev(lock_shm,
+					     locking_key_file_id(key),
+					     fixed,
+					     dbufs,
+					     num_dbufs);
+	}
+
 	return g_lock_writev_data(lock_ctx, key, dbufs, num_dbufs);
 }
 
+static NTSTATUS share_mode_g_lock_lock(TDB_DATA key)
+{
+	if (lock_shm != NULL) {
+		struct server_id self = messaging_server_id(
+			global_messaging_context());
+
+		return share_mode_shm_lock(lock_shm,
+					   locking_key_file_id(key),
+					   self,
+					   (struct timeval) { .tv_sec = 3600 });
+	}
+
+	return g_lock_lock(lock_ctx,
+			   key,
+			   G_LOCK_WRITE,
+			   (struct timeval) { .tv_sec = 3600 },
+			   NULL, NULL);
+}
+
+static NTSTATUS share_mode_g_lock_unlock(TDB_DATA key)
+{
+	if (lock_shm != NULL) {
+		bool wake_watchers = false;
+		NTSTATUS status;
+
+		status = share_mode_shm_unlock(lock_shm,
+					       locking_key_file_id(key),
+					       &wake_watchers);
+		if (NT_STATUS_IS_OK(status) && wake_watchers) {
+			g_lock_wake_watchers(lock_ctx, key);
+		}
+		return status;
+	}
+
+	return g_lock_unlock(lock_ctx, key);
+}
+
+static int share_mode_g_lock_seqnum(void)
+{
+	if (lock_shm != NULL) {
+		return share_mode_shm_seqnum(lock_shm);
+	}
+	return g_lock_seqnum(lock_ctx);
+}
+
 static bool locking_init_internal(bool read_only)
 {
 	struct db_context *backend;
@@ -127,6 +270,7 @@ static bool locking_init_internal(bool read_only)
 	backend = db_open(NULL, db_path,
 			  SMBD_VOLATILE_TDB_HASH_SIZE,
 			  SMBD_VOLATILE_TDB_FLAGS |
+			  SMBD_VOLATILE_TDB_REHASH_FLAGS |
 			  TDB_SEQNUM,
 			  read_only?O_RDONLY:O_RDWR|O_CREAT, 0644,
 			  DBWRAP_LOCK_ORDER_NONE,
@@ -145,7 +289,33 @@ static bool locking_init_internal(bool read_only)
 	}
 	g_lock_set_lock_order(lock_ctx, DBWRAP_LOCK_ORDER_1);
 
+	if ((lp_share_mode_shm_size() > 0) && !lp_clustering()) {
+		db_path = lock_path(talloc_tos(), "locking.shm");
+		if (db_path == NULL) {
+			TALLOC_FREE(lock_ctx);
+			return false;
+		}
+
+		lock_shm = share_mode_shm_open(NULL,
+					       db_path,
+					       lp_share_mode_shm_size(),
+					       read_only);
+		TALLOC_FREE(db_path);
+
+		/*
+		 * All smbds have to agree on where share modes are,
+		 * readers like smbstatus just see nothing.
+		 */
+		if ((lock_shm == NULL) && !read_only) {
+			DBG_ERR("ERROR: Failed to initialise the share "
+				"mode table\n");
+			TALLOC_FREE(lock_ctx);
+			return false;
+		}
+	}
+
 	if (!posix_locking_init(read_only)) {
+		TALLOC_FREE(lock_shm);
 		TALLOC_FREE(lock_ctx);
 		return False;
 	}
@@ -163,6 +333,18 @@ bool locking_init_readonly(void)
 	return locking_init_internal(true);
 }
 
+/*
+ * locking.shm needs the same special fork handling tdb_reopen_all()
+ * does for CLEAR_IF_FIRST databases.
+ */
+bool locking_reinit_after_fork(void)
+{
+	if (lock_shm == NULL) {
+		return true;
+	}
+	return share_mode_shm_reopen(lock_shm);
+}
+
 /*******************************************************************
  Deinitialize the share_mode management.
 ******************************************************************/
@@ -170,6 +352,7 @@ bool locking_init_readonly(void)
 bool locking_end(void)
 {
 	brl_shutdown();
+	TALLOC_FREE(lock_shm);
 	TALLOC_FREE(lock_ctx);
 	return true;
 }
@@ -216,7 +399,7 @@ static void share_mode_memcache_store(struct share_mode_data *d)
 	/*
 	 * Ensure the memory going into the cache
 	 * doesn't have a destructor so it can be
-	 * cleanly evicted by the memcache LRU
+	 * cleanly evicted by the memcache CLOCK
 	 * mechanism.
 	 */
 	talloc_set_destructor(d, NULL);
@@ -331,6 +514,9 @@ static struct share_mode_data *share_mode_memcache_fetch(
  * 132 is the sizeof an ndr-encoded struct share_mode_entry_buf.
  * Reading/writing entries will immediately error out if this
  * size differs (push/pull is done without allocs).
+ *
+ * locking.shm is never seen by another node, there we store the
+ * struct as is, it fits into the same space.
  */
 
 struct share_mode_entry_buf {
@@ -350,6 +536,13 @@ static bool share_mode_entry_put(
 		NDR_PRINT_DEBUG(share_mode_entry, discard_const_p(void, e));
 	}
 
+	if (lock_shm != NULL) {
+		SMB_ASSERT(sizeof(*e) <= sizeof(dst->buf));
+		ZERO_STRUCTP(dst);
+		memcpy(dst->buf, e, sizeof(*e));
+		return true;
+	}
+
 	ndr_err = ndr_push_struct_into_fixed_blob(
 		&blob,
 		e,
@@ -372,6 +565,13 @@ static bool share_mode_entry_get(
 		.length = SHARE_MODE_ENTRY_SIZE,
 	};
 
+	if (lock_shm != NULL) {
+		SMB_ASSERT(sizeof(*e) <= SHARE_MODE_ENTRY_SIZE);
+		memcpy(e, ptr, sizeof(*e));
+		e->stale = false;
+		return true;
+	}
+
 	ndr_err = ndr_pull_struct_blob_all_noalloc(
 		&blob, e, (ndr_pull_flags_fn_t)ndr_pull_share_mode_entry);
 	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
@@ -390,6 +590,11 @@ static bool share_mode_entry_get(
  * 0 [SHARE_MODE_ENTRY_SIZE]       Sorted array of share modes,
  * 1 [SHARE_MODE_ENTRY_SIZE]       filling up the rest of the data in the
  * 2 [SHARE_MODE_ENTRY_SIZE]       g_lock.c maintained record in locking.tdb
+ *
+ * In locking.shm the flags and write times in the NDR blob are
+ * outdated, the current ones are in struct share_mode_shm_fixed
+ * next to the record. The blob is only pushed again when the names
+ * or delete tokens change, see share_mode_data_ltdb_store().
  */
 
 struct locking_tdb_data {
@@ -444,6 +649,7 @@ struct locking_tdb_data_fetch_state {
 };
 
 static void locking_tdb_data_fetch_fn(
+	const struct share_mode_shm_fixed *fixed,
 	struct server_id exclusive,
 	size_t num_shared,
 	const struct server_id *shared,
@@ -502,6 +708,7 @@ done:
 static NTSTATUS locking_tdb_data_store(
 	TDB_DATA key,
 	const struct locking_tdb_data *ltdb,
+	const struct share_mode_shm_fixed *fixed,
 	const TDB_DATA *share_mode_dbufs,
 	size_t num_share_mode_dbufs)
 {
@@ -515,7 +722,7 @@ static NTSTATUS locking_tdb_data_store(
 		/*
 		 * Nothing to write
 		 */
-		status = share_mode_g_lock_writev(key, NULL, 0);
+		status = share_mode_g_lock_writev(key, NULL, NULL, 0);
 		if (!NT_STATUS_IS_OK(status)) {
 			DBG_ERR("share_mode_g_lock_writev(NULL) failed: %s\n",
 				nt_errstr(status));
@@ -549,7 +756,8 @@ static NTSTATUS locking_tdb_data_store(
 		       num_share_mode_dbufs * sizeof(TDB_DATA));
 	}
 
-	status = share_mode_g_lock_writev(key, dbufs, ARRAY_SIZE(dbufs));
+	status = share_mode_g_lock_writev(
+		key, fixed, dbufs, ARRAY_SIZE(dbufs));
 	if (!NT_STATUS_IS_OK(status)) {
 		DBG_ERR("share_mode_g_lock_writev() failed: %s\n",
 			nt_errstr(status));
@@ -564,6 +772,7 @@ static NTSTATUS locking_tdb_data_store(
 static struct share_mode_data *parse_share_modes(
 	TALLOC_CTX *mem_ctx,
 	struct file_id id,
+	const struct share_mode_shm_fixed *fixed,
 	const uint8_t *buf,
 	size_t buflen)
 {
@@ -574,7 +783,7 @@ static struct share_mode_data *parse_share_modes(
 	/* See if we already have a cached copy of this key. */
 	d = share_mode_memcache_fetch(mem_ctx, id, buf, buflen);
 	if (d != NULL) {
-		return d;
+		goto done;
 	}
 
 	d = talloc(mem_ctx, struct share_mode_data);
@@ -595,6 +804,13 @@ static struct share_mode_data *parse_share_modes(
 		goto fail;
 	}
 
+done:
+	if (fixed != NULL) {
+		d->flags = fixed->flags;
+		d->old_write_time = fixed->old_write_time;
+		d->changed_write_time = fixed->changed_write_time;
+	}
+
 	if (DEBUGLEVEL >= 10) {
 		DEBUG(10, ("parse_share_modes:\n"));
 		NDR_PRINT_DEBUG(share_mode_data, d);
@@ -613,6 +829,8 @@ static NTSTATUS share_mode_data_ltdb_store(struct share_mode_data *d,
 					   size_t num_share_mode_dbufs)
 {
 	DATA_BLOB blob = { 0 };
+	struct share_mode_shm_fixed fixed;
+	const struct share_mode_shm_fixed *pfixed = NULL;
 	NTSTATUS status;
 
 	if (!d->modified) {
@@ -620,6 +838,27 @@ static NTSTATUS share_mode_data_ltdb_store(struct share_mode_data *d,
 		goto store;
 	}
 
+	if (lock_shm != NULL) {
+		fixed = (struct share_mode_shm_fixed) {
+			.old_write_time = d->old_write_time,
+			.changed_write_time = d->changed_write_time,
+			.flags = d->flags,
+		};
+		pfixed = &fixed;
+
+		if (!d->overflow_modified &&
+		    (ltdb->share_mode_data_len != 0) &&
+		    ((ltdb->num_share_entries != 0) ||
+		     (num_share_mode_dbufs != 0))) {
+			/*
+			 * Only the fixed fields changed, the NDR blob
+			 * and its unique_content_epoch stay valid.
+			 */
+			DBG_DEBUG("only fixed fields modified\n");
+			goto store;
+		}
+	}
+
 	d->unique_content_epoch = generate_unique_u64(d->unique_content_epoch);
 
 	if (DEBUGLEVEL >= 10) {
@@ -648,6 +887,7 @@ static NTSTATUS share_mode_data_ltdb_store(struct share_mode_data *d,
 store:
 	status = locking_tdb_data_store(key,
 					ltdb,
+					pfixed,
 					share_mode_dbufs,
 					num_share_mode_dbufs);
 	if (!NT_STATUS_IS_OK(status)) {
@@ -657,6 +897,7 @@ store:
 	}
 
 	d->modified = false;
+	d->overflow_modified = false;
 	d->not_stored = (ltdb->share_mode_data_len == 0);
 
 	return NT_STATUS_OK;
@@ -805,6 +1046,7 @@ struct get_static_share_mode_data_state {
 };
 
 static void get_static_share_mode_data_fn(
+	const struct share_mode_shm_fixed *fixed,
 	struct server_id exclusive,
 	size_t num_shared,
 	const struct server_id *shared,
@@ -845,6 +1087,7 @@ static void get_static_share_mode_data_fn(
 		d = parse_share_modes(
 			lock_ctx,
 			state->id,
+			fixed,
 			ltdb.share_mode_data_buf,
 			ltdb.share_mode_data_len);
 		if (d == NULL) {
@@ -936,14 +1179,9 @@ static NTSTATUS get_share_mode_lock_internal(
 		if (!share_mode_lock_skip_g_lock) {
 			TDB_DATA key = locking_key(&id);
 
-			status = g_lock_lock(
-				lock_ctx,
-				key,
-				G_LOCK_WRITE,
-				(struct timeval) { .tv_sec = 3600 },
-				NULL, NULL);
+			status = share_mode_g_lock_lock(key);
 			if (!NT_STATUS_IS_OK(status)) {
-				DBG_DEBUG("g_lock_lock failed: %s\n",
+				DBG_DEBUG("share_mode_g_lock_lock failed: %s\n",
 					  nt_errstr(status));
 				return status;
 			}
@@ -997,9 +1235,10 @@ done:
 fail:
 	if (share_mode_lock_key_refcount == 0) {
 		if (!share_mode_lock_skip_g_lock) {
-			NTSTATUS ulstatus = g_lock_unlock(lock_ctx, share_mode_lock_key);
+			NTSTATUS ulstatus = share_mode_g_lock_unlock(
+				share_mode_lock_key);
 			if (!NT_STATUS_IS_OK(ulstatus)) {
-				DBG_ERR("g_lock_unlock failed: %s\n",
+				DBG_ERR("share_mode_g_lock_unlock failed: %s\n",
 					nt_errstr(ulstatus));
 			}
 		}
@@ -1026,9 +1265,9 @@ static NTSTATUS put_share_mode_lock_internal(struct share_mode_lock *lck)
 	}
 
 	if (!share_mode_lock_skip_g_lock) {
-		status = g_lock_unlock(lock_ctx, share_mode_lock_key);
+		status = share_mode_g_lock_unlock(share_mode_lock_key);
 		if (!NT_STATUS_IS_OK(status)) {
-			DBG_ERR("g_lock_unlock failed: %s\n",
+			DBG_ERR("share_mode_g_lock_unlock failed: %s\n",
 				nt_errstr(status));
 			return status;
 		}
@@ -1122,6 +1361,7 @@ struct fsp_update_share_mode_flags_state {
 };
 
 static void fsp_update_share_mode_flags_fn(
+	const struct share_mode_shm_fixed *fixed,
 	struct server_id exclusive,
 	size_t num_shared,
 	const struct server_id *shared,
@@ -1160,6 +1400,11 @@ static void fsp_update_share_mode_flags_fn(
 		}
 	}
 
+	if (fixed != NULL) {
+		state->share_mode_flags = fixed->flags;
+		return;
+	}
+
 	state->ndr_err = get_share_mode_blob_header(ltdb.share_mode_data_buf,
 						    ltdb.share_mode_data_len,
 						    &state->share_mode_epoch,
@@ -1169,7 +1414,7 @@ static void fsp_update_share_mode_flags_fn(
 static NTSTATUS fsp_update_share_mode_flags(struct files_struct *fsp)
 {
 	struct fsp_update_share_mode_flags_state state = { .fsp = fsp, };
-	int seqnum = g_lock_seqnum(lock_ctx);
+	int seqnum = share_mode_g_lock_seqnum();
 	TDB_DATA key = {0};
 	NTSTATUS status;
 
@@ -1418,8 +1663,22 @@ struct share_mode_watch_state {
 	bool blockerdead;
 	struct server_id blocker;
 	bool within_cb;
+	struct file_id id;
+	bool shm_watch;
 };
 
+static void share_mode_watch_cleanup(struct tevent_req *req,
+				     enum tevent_req_state req_state)
+{
+	struct share_mode_watch_state *state = tevent_req_data(
+		req, struct share_mode_watch_state);
+
+	if (state->shm_watch) {
+		share_mode_shm_watch_del(lock_shm, state->id);
+		state->shm_watch = false;
+	}
+}
+
 static void share_mode_watch_done(struct tevent_req *subreq);
 
 struct tevent_req *share_mode_watch_send(
@@ -1448,6 +1707,21 @@ struct tevent_req *share_mode_watch_send(
 			return tevent_req_post(req, ev);
 		}
 	} else {
+		if (lock_shm != NULL) {
+			/*
+			 * share_mode_g_lock_unlock() only wakes us
+			 * via locking.tdb if it knows about us.
+			 */
+			NTSTATUS status = share_mode_shm_watch_add(lock_shm,
+								   id);
+			if (tevent_req_nterror(req, status)) {
+				return tevent_req_post(req, ev);
+			}
+			state->id = id;
+			state->shm_watch = true;
+			tevent_req_set_cleanup_fn(req,
+						  share_mode_watch_cleanup);
+		}
 		subreq = g_lock_watch_data_send(state, ev, lock_ctx, key, blocker);
 		if (tevent_req_nomem(subreq, req)) {
 			return tevent_req_post(req, ev);
@@ -1508,6 +1782,7 @@ struct fetch_share_mode_unlocked_state {
 };
 
 static void fetch_share_mode_unlocked_parser(
+	const struct share_mode_shm_fixed *fixed,
 	struct server_id exclusive,
 	size_t num_shared,
 	const struct server_id *shared,
@@ -1541,6 +1816,7 @@ static void fetch_share_mode_unlocked_parser(
 	state->lck->cached_data = parse_share_modes(
 		state->lck,
 		state->id,
+		fixed,
 		ltdb.share_mode_data_buf,
 		ltdb.share_mode_data_len);
 	if (state->lck->cached_data == NULL) {
@@ -1564,8 +1840,8 @@ struct share_mode_lock *fetch_share_mode_unlocked(TALLOC_CTX *mem_ctx,
 	TDB_DATA key = locking_key(&id);
 	NTSTATUS status;
 
-	status = g_lock_dump(
-		lock_ctx, key, fetch_share_mode_unlocked_parser, &state);
+	status = share_mode_dump_unlocked(
+		key, fetch_share_mode_unlocked_parser, &state);
 	if (!NT_STATUS_IS_OK(status)) {
 		DBG_DEBUG("g_lock_dump failed: %s\n", nt_errstr(status));
 		return NULL;
@@ -1577,9 +1853,11 @@ struct fetch_share_mode_state {
 	struct file_id id;
 	struct share_mode_lock *lck;
 	NTSTATUS status;
+	struct share_mode_g_lock_dump_state dump_state;
 };
 
 static void fetch_share_mode_fn(
+	const struct share_mode_shm_fixed *fixed,
 	struct server_id exclusive,
 	size_t num_shared,
 	const struct server_id *shared,
@@ -1630,13 +1908,36 @@ struct tevent_req *fetch_share_mode_send(TALLOC_CTX *mem_ctx,
 	}
 	state->id = id;
 
+	if (lock_shm != NULL) {
+		/*
+		 * Nothing to wait for in shared memory
+		 */
+		NTSTATUS status = share_mode_shm_dump(
+			lock_shm, id, fetch_share_mode_fn, state);
+		if (NT_STATUS_EQUAL(status, NT_STATUS_NOT_FOUND)) {
+			status = NT_STATUS_OK;
+		}
+		if (!NT_STATUS_IS_OK(status)) {
+			state->status = status;
+		}
+		if (tevent_req_nterror(req, state->status)) {
+			return tevent_req_post(req, ev);
+		}
+		tevent_req_done(req);
+		return tevent_req_post(req, ev);
+	}
+
+	state->dump_state = (struct share_mode_g_lock_dump_state) {
+		.fn = fetch_share_mode_fn, .private_data = state,
+	};
+
 	subreq = g_lock_dump_send(
 		state,
 		ev,
 		lock_ctx,
 		locking_key(&id),
-		fetch_share_mode_fn,
-		state);
+		share_mode_g_lock_dump_fn,
+		&state->dump_state);
 	if (tevent_req_nomem(subreq, req)) {
 		return tevent_req_post(req, ev);
 	}
@@ -1645,6 +1946,7 @@ struct tevent_req *fetch_share_mode_send(TALLOC_CTX *mem_ctx,
 }
 
 static void fetch_share_mode_fn(
+	const struct share_mode_shm_fixed *fixed,
 	struct server_id exclusive,
 	size_t num_shared,
 	const struct server_id *shared,
@@ -1680,6 +1982,7 @@ static void fetch_share_mode_fn(
 	state->lck->cached_data = parse_share_modes(
 		state->lck,
 		state->id,
+		fixed,
 		ltdb.share_mode_data_buf,
 		ltdb.share_mode_data_len);
 	if (state->lck->cached_data == NULL) {
@@ -1750,6 +2053,7 @@ struct share_mode_forall_state {
 };
 
 static void share_mode_forall_dump_fn(
+	const struct share_mode_shm_fixed *fixed,
 	struct server_id exclusive,
 	size_t num_shared,
 	const struct server_id *shared,
@@ -1778,6 +2082,7 @@ static void share_mode_forall_dump_fn(
 	d = parse_share_modes(
 		talloc_tos(),
 		fid,
+		fixed,
 		ltdb.share_mode_data_buf,
 		ltdb.share_mode_data_len);
 	if (d == NULL) {
@@ -1806,6 +2111,11 @@ static int share_mode_forall_fn(TDB_DATA key, void *private_data)
 	return 0;
 }
 
+static int share_mode_forall_shm_fn(struct file_id id, void *private_data)
+{
+	return share_mode_forall_fn(locking_key(&id), private_data);
+}
+
 int share_mode_forall(int (*fn)(struct file_id fid,
 				const struct share_mode_data *data,
 				void *private_data),
@@ -1821,6 +2131,11 @@ int share_mode_forall(int (*fn)(struct file_id fid,
 		return 0;
 	}
 
+	if (lock_shm != NULL) {
+		return share_mode_shm_traverse(
+			lock_shm, share_mode_forall_shm_fn, &state);
+	}
+
 	ret = g_lock_locks(
 		lock_ctx, share_mode_forall_fn, &state);
 	if (ret < 0) {
@@ -2135,18 +2450,16 @@ static bool share_mode_for_one_entry(
 		.length = SHARE_MODE_ENTRY_SIZE,
 	};
 	struct share_mode_entry e = {.pid.pid=0};
-	enum ndr_err_code ndr_err = NDR_ERR_SUCCESS;
+	struct share_mode_entry_buf e_buf;
 	bool modified = false;
 	bool stop = false;
+	bool ok;
 	struct server_id e_pid;
 	uint64_t e_share_file_id;
 
-	ndr_err = ndr_pull_struct_blob_all_noalloc(
-		&blob,
-		&e,
-		(ndr_pull_flags_fn_t)ndr_pull_share_mode_entry);
-	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-		DBG_WARNING("ndr_pull_share_mode_entry failed\n");
+	ok = share_mode_entry_get(blob.data, &e);
+	if (!ok) {
+		DBG_WARNING("share_mode_entry_get failed\n");
 		*i += 1;
 		return false;
 	}
@@ -2183,26 +2496,17 @@ static bool share_mode_for_one_entry(
 	}
 
 	if (modified) {
-		if (DEBUGLEVEL>=10) {
-			DBG_DEBUG("share_mode_entry:\n");
-			NDR_PRINT_DEBUG(share_mode_entry, &e);
-		}
-
 		/*
 		 * Make sure sorting order is kept intact
 		 */
 		SMB_ASSERT(server_id_equal(&e_pid, &e.pid));
 		SMB_ASSERT(e_share_file_id == e.share_file_id);
 
-		ndr_err = ndr_push_struct_into_fixed_blob(
-			&blob,
-			&e,
-			(ndr_push_flags_fn_t)
-			ndr_push_share_mode_entry);
-		if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-			DBG_WARNING("ndr_push_share_mode_entry "
-				    "failed: %s\n",
-				    ndr_errstr(ndr_err));
+		ok = share_mode_entry_put(&e, &e_buf);
+		if (ok) {
+			memcpy(blob.data, e_buf.buf, SHARE_MODE_ENTRY_SIZE);
+		} else {
+			DBG_WARNING("share_mode_entry_put failed\n");
 			/*
 			 * Not much we can do, just ignore it
 			 */
@@ -2311,6 +2615,7 @@ struct share_mode_count_entries_state {
 };
 
 static void share_mode_count_entries_fn(
+	const struct share_mode_shm_fixed *fixed,
 	struct server_id exclusive,
 	size_t num_shared,
 	const struct server_id *shared,
@@ -2339,11 +2644,8 @@ NTSTATUS share_mode_count_entries(struct file_id fid, size_t *num_share_modes)
 	};
 	NTSTATUS status;
 
-	status = g_lock_dump(
-		lock_ctx,
-		locking_key(&fid),
-		share_mode_count_entries_fn,
-		&state);
+	status = share_mode_dump_unlocked(
+		locking_key(&fid), share_mode_count_entries_fn, &state);
 	if (!NT_STATUS_IS_OK(status)) {
 		DBG_DEBUG("g_lock_dump failed: %s\n",
 			  nt_errstr(status));
@@ -2862,7 +3164,7 @@ NTSTATUS _share_mode_do_locked_vfs_denied(
 		.location = location,
 	};
 
-	if (share_mode_lock_key_refcount == 0) {
+	if ((share_mode_lock_key_refcount == 0) && (lock_shm == NULL)) {
 		TDB_DATA key = locking_key(&id);
 		NTSTATUS status;
 
@@ -2957,7 +3259,10 @@ static void share_mode_entry_prepare_lock_fn(struct g_lock_lock_cb_state *glck,
 		(struct share_mode_entry_prepare_lock_state *)cb_private;
 	struct smb_vfs_deny_state vfs_deny = {};
 
-	SMB_ASSERT(glck != NULL);
+	/*
+	 * glck is NULL with lock_shm, then get_share_mode_lock_internal()
+	 * takes the lock itself.
+	 */
 	current_share_mode_glck = glck;
 
 	state->status = get_share_mode_lock_internal(state->id,
@@ -2969,7 +3274,9 @@ static void share_mode_entry_prepare_lock_fn(struct g_lock_lock_cb_state *glck,
 		/* no DBG_GET_SHARE_MODE_LOCK here! */
 		DBG_ERR("get_share_mode_lock_internal failed: %s\n",
 			nt_errstr(state->status));
-		g_lock_lock_cb_unlock(glck);
+		if (glck != NULL) {
+			g_lock_lock_cb_unlock(glck);
+		}
 		current_share_mode_glck = NULL;
 		return;
 	}
@@ -2991,7 +3298,9 @@ static void share_mode_entry_prepare_lock_fn(struct g_lock_lock_cb_state *glck,
 		return;
 	}
 
-	g_lock_lock_cb_unlock(glck);
+	if (glck != NULL) {
+		g_lock_lock_cb_unlock(glck);
+	}
 	current_share_mode_glck = NULL;
 	return;
 }
@@ -3029,6 +3338,14 @@ NTSTATUS _share_mode_entry_prepare_lock(
 
 	state.lck = prepare_state->__lck_ptr;
 
+	if (lock_shm != NULL) {
+		share_mode_entry_prepare_lock_fn(NULL, &state);
+		if (!state.keep_locked) {
+			prepare_state->__lck_ptr = NULL;
+		}
+		return state.status;
+	}
+
 	share_mode_lock_skip_g_lock = true;
 	status = g_lock_lock(
 		lock_ctx,
@@ -3088,7 +3405,6 @@ static void share_mode_entry_prepare_unlock_relock_fn(struct g_lock_lock_cb_stat
 		(struct share_mode_entry_prepare_unlock_state *)cb_private;
 	struct smb_vfs_deny_state vfs_deny = {};
 
-	SMB_ASSERT(glck != NULL);
 	current_share_mode_glck = glck;
 
 	state->status = get_share_mode_lock_internal(state->id,
@@ -3100,7 +3416,9 @@ static void share_mode_entry_prepare_unlock_relock_fn(struct g_lock_lock_cb_stat
 		/* no DBG_GET_SHARE_MODE_LOCK here! */
 		DBG_ERR("get_share_mode_lock_internal failed: %s\n",
 			nt_errstr(state->status));
-		g_lock_lock_cb_unlock(glck);
+		if (glck != NULL) {
+			g_lock_lock_cb_unlock(glck);
+		}
 		current_share_mode_glck = NULL;
 		return;
 	}
@@ -3117,7 +3435,9 @@ static void share_mode_entry_prepare_unlock_relock_fn(struct g_lock_lock_cb_stat
 		return;
 	}
 
-	g_lock_lock_cb_unlock(glck);
+	if (glck != NULL) {
+		g_lock_lock_cb_unlock(glck);
+	}
 	current_share_mode_glck = NULL;
 	return;
 }
@@ -3174,6 +3494,11 @@ NTSTATUS _share_mode_entry_prepare_unlock(
 	 */
 	state.lck = &prepare_state->__lck_space;
 
+	if (lock_shm != NULL) {
+		share_mode_entry_prepare_unlock_relock_fn(NULL, &state);
+		return state.status;
+	}
+
 	share_mode_lock_skip_g_lock = true;
 	status = g_lock_lock(
 		lock_ctx,
@@ -30,6 +30,7 @@ struct smb2_lease_key;
 
 bool locking_init(void);
 bool locking_init_readonly(void);
+bool locking_reinit_after_fork(void);
 bool locking_end(void);
 
 struct file_id share_mode_lock_file_id(const struct share_mode_lock *lck);
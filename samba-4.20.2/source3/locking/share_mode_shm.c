@@ -0,0 +1,1185 @@
+/*
+ * Unix SMB/CIFS implementation.
+ *
+ * Shared memory table for share mode records
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "replace.h"
+#include "system/filesys.h"
+#include "system/shmem.h"
+#include "system/threads.h"
+#include "lib/util/debug.h"
+#include "lib/util/fault.h"
+#include "lib/util/samba_util.h"
+#include "libcli/util/ntstatus.h"
+#include "libcli/util/error.h"
+#include "source3/locking/share_mode_shm.h"
+
+#if defined(HAVE_ROBUST_MUTEXES) && defined(HAVE___ATOMIC_ADD_FETCH)
+
+/*
+ * File layout:
+ *
+ * struct share_mode_shm_header
+ * struct share_mode_shm_slot [num_slots]
+ * heap                         Blocks of SHM_BLOCK_SIZE << class
+ *
+ * The header mutex protects the heap and the state of all slots, a
+ * slot mutex the record of its file_id. The header mutex is always
+ * taken last.
+ *
+ * Heap blocks are never merged, a free block goes onto the free list
+ * of its class. Larger free blocks are split if the heap is used up.
+ */
+
+#define SHM_MAGIC 0x53484d53484d4f44ULL /* "DOMHSMHS" */
+#define SHM_VERSION 2
+
+#define SHM_BLOCK_SHIFT 8
+#define SHM_BLOCK_SIZE (1U << SHM_BLOCK_SHIFT)
+#define SHM_NUM_CLASSES 17
+
+#define SHM_MIN_SLOTS 64
+
+/*
+ * The header mutex and slot mutexes taken for housekeeping are only
+ * held for short periods, not across a share mode lock.
+ */
+#define SHM_SHORT_TIMEOUT_SECS 60
+
+/*
+ * slot->state is (generation << 2) | SHM_SLOT_*, so that lockless
+ * readers notice if a slot was deleted and reused while they looked.
+ */
+#define SHM_SLOT_EMPTY 0
+#define SHM_SLOT_USED 1
+#define SHM_SLOT_DELETED 2
+#define SHM_SLOT_STATE(s) ((s) & 3)
+#define SHM_SLOT_NEXT(s, st) (((((s) >> 2) + 1) << 2) | (st))
+
+/*
+ * slot->ref: 24 bits length, 24 bits heap block, 16 bits generation
+ */
+#define SHM_REF_LEN(r) ((r) & 0xffffff)
+#define SHM_REF_BLOCK(r) (((r) >> 24) & 0xffffff)
+#define SHM_REF_GEN(r) ((r) >> 48)
+#define SHM_REF(len, block, gen) \
+	((uint64_t)(len) | ((uint64_t)(block) << 24) | ((uint64_t)(gen) << 48))
+#define SHM_MAX_RECORD 0xffffff
+#define SHM_MAX_BLOCKS 0xffffff
+
+/*
+ * slot->fixed[] is double buffered like the records: a writer fills
+ * the entry of the next ref generation before publishing the ref, so
+ * lockless readers can copy the one matching the ref they loaded.
+ */
+#define SHM_SLOT_FIXED(slot, ref) (&(slot)->fixed[SHM_REF_GEN(ref) & 1])
+
+struct share_mode_shm_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t num_slots;
+	uint64_t size;
+	uint64_t heap_ofs;
+	uint64_t heap_blocks;
+	uint64_t heap_used;
+	uint64_t free_lists[SHM_NUM_CLASSES]; /* block + 1, 0 is empty */
+	uint64_t seqnum;
+	pthread_mutex_t mutex;
+};
+
+struct share_mode_shm_slot {
+	pthread_mutex_t mutex;
+	uint64_t state;
+	uint64_t ref;
+	uint32_t watchers;
+	uint32_t changed;
+	struct file_id id;
+	struct server_id owner;
+	struct share_mode_shm_fixed fixed[2];
+};
+
+struct share_mode_shm {
+	char *path;
+	int fd;
+	bool read_only;
+	uint8_t *ptr;
+	size_t size;
+	struct share_mode_shm_header *hdr;
+	struct share_mode_shm_slot *slots;
+	uint8_t *heap;
+	struct share_mode_shm_slot *locked;
+};
+
+static int share_mode_shm_destructor(struct share_mode_shm *shm)
+{
+	if (shm->locked != NULL) {
+		shm->locked->owner = (struct server_id) { .pid = 0 };
+		pthread_mutex_unlock(&shm->locked->mutex);
+		shm->locked = NULL;
+	}
+	if (shm->ptr != NULL) {
+		munmap(shm->ptr, shm->size);
+		shm->ptr = NULL;
+	}
+	if (shm->fd != -1) {
+		close(shm->fd);
+		shm->fd = -1;
+	}
+	return 0;
+}
+
+static int share_mode_shm_mutex_init(pthread_mutex_t *m)
+{
+	pthread_mutexattr_t a;
+	int ret;
+
+	ret = pthread_mutexattr_init(&a);
+	if (ret != 0) {
+		return ret;
+	}
+	ret = pthread_mutexattr_setpshared(&a, PTHREAD_PROCESS_SHARED);
+	if (ret != 0) {
+		goto done;
+	}
+	ret = pthread_mutexattr_setrobust(&a, PTHREAD_MUTEX_ROBUST);
+	if (ret != 0) {
+		goto done;
+	}
+	ret = pthread_mutex_init(m, &a);
+done:
+	pthread_mutexattr_destroy(&a);
+	return ret;
+}
+
+static int share_mode_shm_mutex_locked(pthread_mutex_t *m, int ret)
+{
+	if (ret == EOWNERDEAD) {
+		/*
+		 * Everything we protect is published with single
+		 * atomic stores, so whatever the dead owner left
+		 * behind is consistent. At most it leaked a heap
+		 * block.
+		 */
+		DBG_NOTICE("previous owner of the mutex died\n");
+		ret = pthread_mutex_consistent(m);
+	}
+	return ret;
+}
+
+/*
+ * Like g_lock_lock() we don't wait forever for a holder that is
+ * alive but stuck, returns ETIMEDOUT then.
+ */
+static int share_mode_shm_mutex_lock(pthread_mutex_t *m,
+				     struct timeval timeout)
+{
+	struct timespec abstime;
+	int ret;
+
+	ret = clock_gettime(CLOCK_REALTIME, &abstime);
+	if (ret == -1) {
+		return errno;
+	}
+	abstime.tv_sec += timeout.tv_sec;
+	abstime.tv_nsec += timeout.tv_usec * 1000;
+	if (abstime.tv_nsec >= 1000000000) {
+		abstime.tv_sec += 1;
+		abstime.tv_nsec -= 1000000000;
+	}
+
+	ret = pthread_mutex_timedlock(m, &abstime);
+	return share_mode_shm_mutex_locked(m, ret);
+}
+
+static int share_mode_shm_hdr_lock(struct share_mode_shm *shm)
+{
+	return share_mode_shm_mutex_lock(
+		&shm->hdr->mutex,
+		(struct timeval) { .tv_sec = SHM_SHORT_TIMEOUT_SECS });
+}
+
+static uint32_t share_mode_shm_hash(const struct file_id *id)
+{
+	uint64_t h = id->devid * 0x9E3779B97F4A7C15ULL;
+
+	h ^= id->inode + 0x632BE59BD9B4E019ULL + (h << 6) + (h >> 2);
+	h ^= id->extid + (h << 6) + (h >> 2);
+	h *= 0xFF51AFD7ED558CCDULL;
+
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+static bool share_mode_shm_id_equal(const struct file_id *a,
+				    const struct file_id *b)
+{
+	return (a->devid == b->devid) && (a->inode == b->inode) &&
+	       (a->extid == b->extid);
+}
+
+static bool share_mode_shm_init(struct share_mode_shm *shm, size_t size)
+{
+	struct share_mode_shm_header *hdr = NULL;
+	size_t num_slots = SHM_MIN_SLOTS;
+	size_t slots_ofs, heap_ofs;
+	uint8_t *ptr = NULL;
+	size_t i;
+	int ret;
+
+	while (num_slots < size / 4096) {
+		num_slots *= 2;
+	}
+	slots_ofs = sizeof(struct share_mode_shm_header);
+	slots_ofs = (slots_ofs + 63) & ~63;
+	heap_ofs = slots_ofs + num_slots * sizeof(struct share_mode_shm_slot);
+	heap_ofs = (heap_ofs + SHM_BLOCK_SIZE - 1) & ~(SHM_BLOCK_SIZE - 1);
+
+	if (size < heap_ofs + SHM_BLOCK_SIZE * 16) {
+		size = heap_ofs + SHM_BLOCK_SIZE * 16;
+	}
+
+	ret = ftruncate(shm->fd, 0);
+	if (ret == 0) {
+		ret = ftruncate(shm->fd, size);
+	}
+	if (ret == -1) {
+		DBG_ERR("ftruncate(%zu) failed: %s\n", size, strerror(errno));
+		return false;
+	}
+
+	ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	if (ptr == MAP_FAILED) {
+		DBG_ERR("mmap(%zu) failed: %s\n", size, strerror(errno));
+		return false;
+	}
+	shm->ptr = ptr;
+	shm->size = size;
+
+	hdr = (struct share_mode_shm_header *)ptr;
+	*hdr = (struct share_mode_shm_header) {
+		.version = SHM_VERSION,
+		.num_slots = num_slots,
+		.size = size,
+		.heap_ofs = heap_ofs,
+		.heap_blocks = MIN((size - heap_ofs) / SHM_BLOCK_SIZE,
+				   SHM_MAX_BLOCKS),
+	};
+	ret = share_mode_shm_mutex_init(&hdr->mutex);
+	if (ret != 0) {
+		DBG_ERR("share_mode_shm_mutex_init failed: %s\n",
+			strerror(ret));
+		return false;
+	}
+
+	shm->slots = (struct share_mode_shm_slot *)(ptr + slots_ofs);
+	for (i = 0; i < num_slots; i++) {
+		struct share_mode_shm_slot *s = &shm->slots[i];
+
+		*s = (struct share_mode_shm_slot) { .state = SHM_SLOT_EMPTY };
+		ret = share_mode_shm_mutex_init(&s->mutex);
+		if (ret != 0) {
+			DBG_ERR("share_mode_shm_mutex_init failed: %s\n",
+				strerror(ret));
+			return false;
+		}
+	}
+
+	/*
+	 * Only now the table is valid
+	 */
+	__atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool share_mode_shm_attach(struct share_mode_shm *shm)
+{
+	struct share_mode_shm_header *hdr = NULL;
+	struct stat st;
+	size_t slots_ofs;
+	uint8_t *ptr = NULL;
+	int prot = PROT_READ;
+	int ret;
+
+	ret = fstat(shm->fd, &st);
+	if (ret == -1) {
+		DBG_ERR("fstat failed: %s\n", strerror(errno));
+		return false;
+	}
+	if ((size_t)st.st_size < sizeof(struct share_mode_shm_header)) {
+		DBG_WARNING("share mode table too small\n");
+		return false;
+	}
+
+	if (!shm->read_only) {
+		prot |= PROT_WRITE;
+	}
+	ptr = mmap(NULL, st.st_size, prot, MAP_SHARED, shm->fd, 0);
+	if (ptr == MAP_FAILED) {
+		DBG_ERR("mmap(%zu) failed: %s\n",
+			(size_t)st.st_size,
+			strerror(errno));
+		return false;
+	}
+	shm->ptr = ptr;
+	shm->size = st.st_size;
+
+	hdr = (struct share_mode_shm_header *)ptr;
+	slots_ofs = (sizeof(struct share_mode_shm_header) + 63) & ~63;
+
+	if ((__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) ||
+	    (hdr->version != SHM_VERSION) ||
+	    (hdr->size != shm->size) ||
+	    (hdr->num_slots == 0) ||
+	    ((hdr->num_slots & (hdr->num_slots - 1)) != 0) ||
+	    (hdr->heap_ofs < slots_ofs + (uint64_t)hdr->num_slots *
+			     sizeof(struct share_mode_shm_slot)) ||
+	    (hdr->heap_ofs + hdr->heap_blocks * SHM_BLOCK_SIZE > shm->size)) {
+		DBG_WARNING("share mode table has an invalid header\n");
+		return false;
+	}
+
+	shm->slots = (struct share_mode_shm_slot *)(ptr + slots_ofs);
+	return true;
+}
+
+struct share_mode_shm *share_mode_shm_open(TALLOC_CTX *mem_ctx,
+					   const char *path,
+					   size_t size,
+					   bool read_only)
+{
+	struct share_mode_shm *shm = NULL;
+	bool ok;
+
+	shm = talloc_zero(mem_ctx, struct share_mode_shm);
+	if (shm == NULL) {
+		return NULL;
+	}
+	shm->fd = -1;
+	shm->read_only = read_only;
+	talloc_set_destructor(shm, share_mode_shm_destructor);
+
+	shm->path = talloc_strdup(shm, path);
+	if (shm->path == NULL) {
+		goto fail;
+	}
+
+	shm->fd = open(path, read_only ? O_RDONLY : O_RDWR|O_CREAT, 0644);
+	if (shm->fd == -1) {
+		DBG_ERR("open(%s) failed: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	/*
+	 * Like TDB_CLEAR_IF_FIRST: Everybody holds a read lock on
+	 * the first byte, if we can get a write lock we are the first
+	 * and start from scratch. fcntl locks are not inherited, so
+	 * forked children have to call share_mode_shm_reopen().
+	 */
+	if (!read_only && fcntl_lock(shm->fd, F_SETLK, 0, 1, F_WRLCK)) {
+		ok = share_mode_shm_init(shm, size);
+		if (!ok) {
+			goto fail;
+		}
+		/* downgrade */
+		ok = fcntl_lock(shm->fd, F_SETLKW, 0, 1, F_RDLCK);
+		if (!ok) {
+			DBG_ERR("fcntl_lock failed: %s\n", strerror(errno));
+			goto fail;
+		}
+	} else {
+		ok = fcntl_lock(shm->fd, F_SETLKW, 0, 1, F_RDLCK);
+		if (!ok) {
+			DBG_ERR("fcntl_lock failed: %s\n", strerror(errno));
+			goto fail;
+		}
+		ok = share_mode_shm_attach(shm);
+		if (!ok) {
+			goto fail;
+		}
+	}
+
+	shm->hdr = (struct share_mode_shm_header *)shm->ptr;
+	shm->heap = shm->ptr + shm->hdr->heap_ofs;
+
+	DBG_DEBUG("%s: %"PRIu32" slots, %"PRIu64" heap blocks\n",
+		  path,
+		  shm->hdr->num_slots,
+		  shm->hdr->heap_blocks);
+
+	return shm;
+fail:
+	TALLOC_FREE(shm);
+	return NULL;
+}
+
+bool share_mode_shm_reopen(struct share_mode_shm *shm)
+{
+	struct stat st1, st2;
+	int fd;
+	int ret;
+	bool ok;
+
+	/*
+	 * The mutex of a slot locked by the parent is not ours
+	 */
+	shm->locked = NULL;
+
+	fd = open(shm->path, shm->read_only ? O_RDONLY : O_RDWR);
+	if (fd == -1) {
+		DBG_ERR("open(%s) failed: %s\n", shm->path, strerror(errno));
+		return false;
+	}
+
+	ret = fstat(fd, &st1);
+	if (ret == 0) {
+		ret = fstat(shm->fd, &st2);
+	}
+	if (ret == -1) {
+		DBG_ERR("fstat failed: %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+	if ((st1.st_dev != st2.st_dev) || (st1.st_ino != st2.st_ino)) {
+		DBG_ERR("%s was replaced\n", shm->path);
+		close(fd);
+		return false;
+	}
+
+	/*
+	 * Closing any fd drops all our locks on the file, so close
+	 * the inherited one before locking. Our parent keeps the table
+	 * from being reinitialised meanwhile.
+	 */
+	close(shm->fd);
+	shm->fd = fd;
+
+	ok = fcntl_lock(shm->fd, F_SETLKW, 0, 1, F_RDLCK);
+	if (!ok) {
+		DBG_ERR("fcntl_lock failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Lockless lookup, only the mutex of the returned slot makes the
+ * match stable.
+ */
+static struct share_mode_shm_slot *share_mode_shm_find(
+	struct share_mode_shm *shm,
+	const struct file_id *id,
+	uint64_t *pstate)
+{
+	uint32_t mask = shm->hdr->num_slots - 1;
+	uint32_t h = share_mode_shm_hash(id);
+	uint32_t i;
+
+	for (i = 0; i <= mask; i++) {
+		struct share_mode_shm_slot *s = &shm->slots[(h + i) & mask];
+		uint64_t state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+
+		switch (SHM_SLOT_STATE(state)) {
+		case SHM_SLOT_EMPTY:
+			return NULL;
+		case SHM_SLOT_USED:
+			if (share_mode_shm_id_equal(&s->id, id)) {
+				*pstate = state;
+				return s;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Claim a slot for id, returns with the slot mutex held. NULL with
+ * *retry set means someone else created it meanwhile.
+ */
+static struct share_mode_shm_slot *share_mode_shm_insert(
+	struct share_mode_shm *shm,
+	const struct file_id *id,
+	bool *retry)
+{
+	struct share_mode_shm_header *hdr = shm->hdr;
+	struct share_mode_shm_slot *free_slot = NULL;
+	uint32_t mask = hdr->num_slots - 1;
+	uint32_t h = share_mode_shm_hash(id);
+	uint32_t i;
+	int ret;
+
+	*retry = false;
+
+	ret = share_mode_shm_hdr_lock(shm);
+	if (ret != 0) {
+		DBG_ERR("share_mode_shm_mutex_lock failed: %s\n",
+			strerror(ret));
+		return NULL;
+	}
+
+	for (i = 0; i <= mask; i++) {
+		struct share_mode_shm_slot *s = &shm->slots[(h + i) & mask];
+		uint64_t state = s->state;
+
+		if (SHM_SLOT_STATE(state) == SHM_SLOT_USED) {
+			if (share_mode_shm_id_equal(&s->id, id)) {
+				*retry = true;
+				goto done;
+			}
+			continue;
+		}
+		if (free_slot == NULL) {
+			free_slot = s;
+		}
+		if (SHM_SLOT_STATE(state) == SHM_SLOT_EMPTY) {
+			break;
+		}
+	}
+
+	if (free_slot == NULL) {
+		DBG_ERR("share mode table is full\n");
+		goto done;
+	}
+
+	/*
+	 * Only lookers that lost a race against a delete can hold the
+	 * mutex of a free slot, and they don't wait for anything.
+	 */
+	ret = share_mode_shm_mutex_lock(
+		&free_slot->mutex,
+		(struct timeval) { .tv_sec = SHM_SHORT_TIMEOUT_SECS });
+	if (ret != 0) {
+		DBG_ERR("share_mode_shm_mutex_lock failed: %s\n",
+			strerror(ret));
+		free_slot = NULL;
+		goto done;
+	}
+
+	free_slot->id = *id;
+	free_slot->ref = 0;
+	free_slot->watchers = 0;
+	free_slot->changed = 0;
+	memset(free_slot->fixed, 0, sizeof(free_slot->fixed));
+	__atomic_store_n(&free_slot->state,
+			 SHM_SLOT_NEXT(free_slot->state, SHM_SLOT_USED),
+			 __ATOMIC_RELEASE);
+done:
+	pthread_mutex_unlock(&hdr->mutex);
+	return free_slot;
+}
+
+/*
+ * Called with the header mutex held
+ */
+static void share_mode_shm_delete(struct share_mode_shm *shm,
+				  struct share_mode_shm_slot *slot)
+{
+	uint32_t mask = shm->hdr->num_slots - 1;
+	uint32_t idx = slot - shm->slots;
+	struct share_mode_shm_slot *next = &shm->slots[(idx + 1) & mask];
+
+	__atomic_store_n(&slot->state,
+			 SHM_SLOT_NEXT(slot->state, SHM_SLOT_DELETED),
+			 __ATOMIC_RELEASE);
+
+	if (SHM_SLOT_STATE(next->state) != SHM_SLOT_EMPTY) {
+		return;
+	}
+
+	/*
+	 * No probe sequence goes beyond an empty slot, so deleted
+	 * slots right before it can become empty as well.
+	 */
+	while (SHM_SLOT_STATE(slot->state) == SHM_SLOT_DELETED) {
+		__atomic_store_n(&slot->state,
+				 SHM_SLOT_NEXT(slot->state, SHM_SLOT_EMPTY),
+				 __ATOMIC_RELEASE);
+		idx = (idx - 1) & mask;
+		slot = &shm->slots[idx];
+	}
+}
+
+static unsigned share_mode_shm_class(size_t len)
+{
+	unsigned c = 0;
+
+	while ((SHM_BLOCK_SIZE << c) < len) {
+		c += 1;
+	}
+	return c;
+}
+
+static uint64_t *share_mode_shm_next_ptr(struct share_mode_shm *shm,
+					 uint64_t block)
+{
+	return (uint64_t *)(shm->heap + block * SHM_BLOCK_SIZE);
+}
+
+static void share_mode_shm_free_block(struct share_mode_shm *shm,
+				      uint64_t block,
+				      unsigned c)
+{
+	struct share_mode_shm_header *hdr = shm->hdr;
+
+	*share_mode_shm_next_ptr(shm, block) = hdr->free_lists[c];
+	hdr->free_lists[c] = block + 1;
+}
+
+/*
+ * Called with the header mutex held
+ */
+static bool share_mode_shm_alloc(struct share_mode_shm *shm,
+				 unsigned c,
+				 uint64_t *_block)
+{
+	struct share_mode_shm_header *hdr = shm->hdr;
+	uint64_t nblocks = 1ULL << c;
+	uint64_t block;
+	unsigned b;
+
+	if (hdr->free_lists[c] != 0) {
+		block = hdr->free_lists[c] - 1;
+		hdr->free_lists[c] = *share_mode_shm_next_ptr(shm, block);
+		*_block = block;
+		return true;
+	}
+
+	if (hdr->heap_blocks - hdr->heap_used >= nblocks) {
+		*_block = hdr->heap_used;
+		hdr->heap_used += nblocks;
+		return true;
+	}
+
+	for (b = c + 1; b < SHM_NUM_CLASSES; b++) {
+		if (hdr->free_lists[b] != 0) {
+			break;
+		}
+	}
+	if (b == SHM_NUM_CLASSES) {
+		return false;
+	}
+
+	block = hdr->free_lists[b] - 1;
+	hdr->free_lists[b] = *share_mode_shm_next_ptr(shm, block);
+
+	/*
+	 * Keep the first part, put the upper halves on the smaller
+	 * free lists.
+	 */
+	while (b > c) {
+		b -= 1;
+		share_mode_shm_free_block(shm, block + (1ULL << b), b);
+	}
+
+	*_block = block;
+	return true;
+}
+
+static struct share_mode_shm_slot *share_mode_shm_locked_slot(
+	struct share_mode_shm *shm,
+	const struct file_id *id)
+{
+	if (shm->locked == NULL) {
+		return NULL;
+	}
+	if (!share_mode_shm_id_equal(&shm->locked->id, id)) {
+		return NULL;
+	}
+	return shm->locked;
+}
+
+/*
+ * Called with the slot mutex held
+ */
+static void share_mode_shm_delete_unused(struct share_mode_shm *shm,
+					 struct share_mode_shm_slot *slot)
+{
+	int ret;
+
+	if ((SHM_REF_LEN(slot->ref) != 0) ||
+	    (__atomic_load_n(&slot->watchers, __ATOMIC_ACQUIRE) != 0)) {
+		return;
+	}
+
+	ret = share_mode_shm_hdr_lock(shm);
+	if (ret != 0) {
+		DBG_WARNING("share_mode_shm_hdr_lock failed: %s\n",
+			    strerror(ret));
+		return;
+	}
+	share_mode_shm_delete(shm, slot);
+	pthread_mutex_unlock(&shm->hdr->mutex);
+}
+
+NTSTATUS share_mode_shm_lock(struct share_mode_shm *shm,
+			     struct file_id id,
+			     struct server_id self,
+			     struct timeval timeout)
+{
+	struct share_mode_shm_slot *slot = NULL;
+	uint64_t state;
+	int ret;
+
+	if (shm->read_only) {
+		return NT_STATUS_MEDIA_WRITE_PROTECTED;
+	}
+	if (shm->locked != NULL) {
+		DBG_ERR("Can not lock two share modes simultaneously\n");
+		return NT_STATUS_INVALID_LOCK_SEQUENCE;
+	}
+
+	while (true) {
+		bool retry = false;
+
+		slot = share_mode_shm_find(shm, &id, &state);
+		if (slot == NULL) {
+			slot = share_mode_shm_insert(shm, &id, &retry);
+			if (slot != NULL) {
+				break;
+			}
+			if (retry) {
+				continue;
+			}
+			return NT_STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		ret = share_mode_shm_mutex_lock(&slot->mutex, timeout);
+		if (ret != 0) {
+			DBG_NOTICE("share_mode_shm_mutex_lock failed: %s\n",
+				   strerror(ret));
+			return map_nt_error_from_unix_common(ret);
+		}
+
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if ((SHM_SLOT_STATE(state) == SHM_SLOT_USED) &&
+		    share_mode_shm_id_equal(&slot->id, &id)) {
+			break;
+		}
+
+		/*
+		 * Deleted and maybe reused while we waited
+		 */
+		pthread_mutex_unlock(&slot->mutex);
+	}
+
+	slot->owner = self;
+	slot->changed = 0;
+	shm->locked = slot;
+
+	return NT_STATUS_OK;
+}
+
+NTSTATUS share_mode_shm_unlock(struct share_mode_shm *shm,
+			       struct file_id id,
+			       bool *wake_watchers)
+{
+	struct share_mode_shm_slot *slot = NULL;
+	uint32_t watchers;
+
+	slot = share_mode_shm_locked_slot(shm, &id);
+	if (slot == NULL) {
+		DBG_ERR("file_id not locked\n");
+		return NT_STATUS_NOT_LOCKED;
+	}
+
+	watchers = __atomic_load_n(&slot->watchers, __ATOMIC_ACQUIRE);
+	*wake_watchers = (slot->changed && (watchers != 0));
+
+	slot->owner = (struct server_id) { .pid = 0 };
+
+	share_mode_shm_delete_unused(shm, slot);
+
+	shm->locked = NULL;
+	pthread_mutex_unlock(&slot->mutex);
+
+	return NT_STATUS_OK;
+}
+
+NTSTATUS share_mode_shm_writev(struct share_mode_shm *shm,
+			       struct file_id id,
+			       const struct share_mode_shm_fixed *fixed,
+			       const TDB_DATA *dbufs,
+			       size_t num_dbufs)
+{
+	struct share_mode_shm_slot *slot = NULL;
+	struct share_mode_shm_fixed *new_fixed = NULL;
+	uint64_t old_ref, new_ref;
+	uint64_t block = 0;
+	size_t len = 0;
+	size_t i;
+	int ret;
+
+	slot = share_mode_shm_locked_slot(shm, &id);
+	if (slot == NULL) {
+		DBG_ERR("file_id not locked\n");
+		return NT_STATUS_NOT_LOCKED;
+	}
+
+	for (i = 0; i < num_dbufs; i++) {
+		if (dbufs[i].dsize > SHM_MAX_RECORD - len) {
+			return NT_STATUS_BUFFER_OVERFLOW;
+		}
+		len += dbufs[i].dsize;
+	}
+
+	old_ref = slot->ref;
+
+	if (len != 0) {
+		uint8_t *p = NULL;
+
+		ret = share_mode_shm_hdr_lock(shm);
+		if (ret != 0) {
+			return map_nt_error_from_unix_common(ret);
+		}
+		if (!share_mode_shm_alloc(shm, share_mode_shm_class(len),
+					  &block)) {
+			pthread_mutex_unlock(&shm->hdr->mutex);
+			DBG_ERR("share mode table heap is full, "
+				"increase \"share mode shm size\"\n");
+			return NT_STATUS_INSUFFICIENT_RESOURCES;
+		}
+		pthread_mutex_unlock(&shm->hdr->mutex);
+
+		p = shm->heap + block * SHM_BLOCK_SIZE;
+		for (i = 0; i < num_dbufs; i++) {
+			if (dbufs[i].dsize == 0) {
+				continue;
+			}
+			memcpy(p, dbufs[i].dptr, dbufs[i].dsize);
+			p += dbufs[i].dsize;
+		}
+	}
+
+	new_ref = SHM_REF(len, block, SHM_REF_GEN(old_ref) + 1);
+
+	/*
+	 * Readers of the generation before old_ref might still copy
+	 * this entry, they must see old_ref before our stores to it.
+	 */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	new_fixed = SHM_SLOT_FIXED(slot, new_ref);
+	*new_fixed = (fixed != NULL) ? *fixed : *SHM_SLOT_FIXED(slot, old_ref);
+
+	__atomic_store_n(&slot->ref, new_ref, __ATOMIC_RELEASE);
+
+	if (SHM_REF_LEN(old_ref) != 0) {
+		ret = share_mode_shm_hdr_lock(shm);
+		if (ret == 0) {
+			share_mode_shm_free_block(
+				shm,
+				SHM_REF_BLOCK(old_ref),
+				share_mode_shm_class(SHM_REF_LEN(old_ref)));
+			pthread_mutex_unlock(&shm->hdr->mutex);
+		} else {
+			DBG_WARNING("share_mode_shm_mutex_lock failed: %s, "
+				    "leaking a block\n",
+				    strerror(ret));
+		}
+	}
+
+	slot->changed = 1;
+	__atomic_add_fetch(&shm->hdr->seqnum, 1, __ATOMIC_RELEASE);
+
+	return NT_STATUS_OK;
+}
+
+NTSTATUS share_mode_shm_dump(struct share_mode_shm *shm,
+			     struct file_id id,
+			     void (*fn)(const struct share_mode_shm_fixed *fixed,
+					struct server_id exclusive,
+					size_t num_shared,
+					const struct server_id *shared,
+					const uint8_t *data,
+					size_t datalen,
+					void *private_data),
+			     void *private_data)
+{
+	struct share_mode_shm_slot *slot = NULL;
+	uint8_t stackbuf[2048];
+	uint8_t *buf = stackbuf;
+	size_t buflen = sizeof(stackbuf);
+	NTSTATUS status = NT_STATUS_POSSIBLE_DEADLOCK;
+	unsigned tries;
+
+	slot = share_mode_shm_locked_slot(shm, &id);
+	if (slot != NULL) {
+		uint64_t ref = slot->ref;
+
+		fn(SHM_SLOT_FIXED(slot, ref),
+		   slot->owner,
+		   0,
+		   NULL,
+		   shm->heap + SHM_REF_BLOCK(ref) * SHM_BLOCK_SIZE,
+		   SHM_REF_LEN(ref),
+		   private_data);
+		return NT_STATUS_OK;
+	}
+
+	for (tries = 0; tries < 1000; tries++) {
+		struct share_mode_shm_fixed fixed;
+		struct server_id owner;
+		uint64_t state, state2;
+		uint64_t ref, ref2;
+		size_t len;
+
+		slot = share_mode_shm_find(shm, &id, &state);
+		if (slot == NULL) {
+			status = NT_STATUS_NOT_FOUND;
+			goto done;
+		}
+
+		ref = __atomic_load_n(&slot->ref, __ATOMIC_ACQUIRE);
+		owner = slot->owner;
+		fixed = *SHM_SLOT_FIXED(slot, ref);
+		len = SHM_REF_LEN(ref);
+
+		if (SHM_REF_BLOCK(ref) * SHM_BLOCK_SIZE + len >
+		    shm->hdr->heap_blocks * SHM_BLOCK_SIZE) {
+			/* torn read of ref */
+			continue;
+		}
+
+		if (len > buflen) {
+			/*
+			 * Not shm-owned: fn might dump other
+			 * records while it looks at this one.
+			 */
+			uint8_t *tmp = talloc_realloc(
+				shm, (buf == stackbuf) ? NULL : buf,
+				uint8_t, len);
+			if (tmp == NULL) {
+				status = NT_STATUS_NO_MEMORY;
+				goto done;
+			}
+			buf = tmp;
+			buflen = len;
+		}
+		memcpy(buf,
+		       shm->heap + SHM_REF_BLOCK(ref) * SHM_BLOCK_SIZE,
+		       len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		state2 = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+		ref2 = __atomic_load_n(&slot->ref, __ATOMIC_RELAXED);
+		if ((state != state2) || (ref != ref2) ||
+		    !share_mode_shm_id_equal(&slot->id, &id)) {
+			continue;
+		}
+
+		fn(&fixed, owner, 0, NULL, buf, len, private_data);
+		status = NT_STATUS_OK;
+		goto done;
+	}
+
+	DBG_WARNING("Could not get a stable copy\n");
+done:
+	if (buf != stackbuf) {
+		TALLOC_FREE(buf);
+	}
+	return status;
+}
+
+int share_mode_shm_seqnum(struct share_mode_shm *shm)
+{
+	return (int)__atomic_load_n(&shm->hdr->seqnum, __ATOMIC_ACQUIRE);
+}
+
+int share_mode_shm_traverse(struct share_mode_shm *shm,
+			    int (*fn)(struct file_id id, void *private_data),
+			    void *private_data)
+{
+	uint32_t i;
+	int count = 0;
+
+	for (i = 0; i < shm->hdr->num_slots; i++) {
+		struct share_mode_shm_slot *s = &shm->slots[i];
+		uint64_t state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+		struct file_id id = s->id;
+		uint64_t state2;
+		int ret;
+
+		if ((SHM_SLOT_STATE(state) != SHM_SLOT_USED) ||
+		    (SHM_REF_LEN(__atomic_load_n(&s->ref,
+						 __ATOMIC_ACQUIRE)) == 0)) {
+			continue;
+		}
+		state2 = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+		if (state2 != state) {
+			continue;
+		}
+
+		count += 1;
+
+		ret = fn(id, private_data);
+		if (ret != 0) {
+			break;
+		}
+	}
+
+	return count;
+}
+
+NTSTATUS share_mode_shm_watch_add(struct share_mode_shm *shm,
+				  struct file_id id)
+{
+	struct share_mode_shm_slot *slot = NULL;
+
+	slot = share_mode_shm_locked_slot(shm, &id);
+	if (slot == NULL) {
+		DBG_ERR("file_id not locked\n");
+		return NT_STATUS_NOT_LOCKED;
+	}
+
+	__atomic_add_fetch(&slot->watchers, 1, __ATOMIC_RELEASE);
+	return NT_STATUS_OK;
+}
+
+void share_mode_shm_watch_del(struct share_mode_shm *shm, struct file_id id)
+{
+	struct share_mode_shm_slot *slot = NULL;
+	uint64_t state;
+	int ret;
+
+	slot = share_mode_shm_locked_slot(shm, &id);
+	if (slot != NULL) {
+		/*
+		 * share_mode_shm_unlock() cleans up
+		 */
+		__atomic_sub_fetch(&slot->watchers, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	/*
+	 * Our watch keeps the slot from being deleted
+	 */
+	slot = share_mode_shm_find(shm, &id, &state);
+	if (slot == NULL) {
+		DBG_WARNING("slot for watched file_id not found\n");
+		return;
+	}
+
+	if (shm->locked != NULL) {
+		/*
+		 * There's no lock order between slots, don't wait
+		 * for a second one.
+		 */
+		ret = pthread_mutex_trylock(&slot->mutex);
+		ret = share_mode_shm_mutex_locked(&slot->mutex, ret);
+	} else {
+		ret = share_mode_shm_mutex_lock(
+			&slot->mutex,
+			(struct timeval) { .tv_sec = SHM_SHORT_TIMEOUT_SECS });
+	}
+	if (ret != 0) {
+		/*
+		 * Leave an empty slot behind, the next unlock of this
+		 * file_id removes it.
+		 */
+		DBG_DEBUG("Could not lock slot: %s\n", strerror(ret));
+		__atomic_sub_fetch(&slot->watchers, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	__atomic_sub_fetch(&slot->watchers, 1, __ATOMIC_RELEASE);
+	share_mode_shm_delete_unused(shm, slot);
+
+	pthread_mutex_unlock(&slot->mutex);
+}
+
+#else /* HAVE_ROBUST_MUTEXES && HAVE___ATOMIC_ADD_FETCH */
+
+struct share_mode_shm *share_mode_shm_open(TALLOC_CTX *mem_ctx,
+					   const char *path,
+					   size_t size,
+					   bool read_only)
+{
+	DBG_ERR("The shared memory share mode table needs "
+		"robust mutexes and atomics\n");
+	errno = ENOSYS;
+	return NULL;
+}
+
+bool share_mode_shm_reopen(struct share_mode_shm *shm)
+{
+	return false;
+}
+
+NTSTATUS share_mode_shm_lock(struct share_mode_shm *shm,
+			     struct file_id id,
+			     struct server_id self,
+			     struct timeval timeout)
+{
+	return NT_STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS share_mode_shm_unlock(struct share_mode_shm *shm,
+			       struct file_id id,
+			       bool *wake_watchers)
+{
+	return NT_STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS share_mode_shm_writev(struct share_mode_shm *shm,
+			       struct file_id id,
+			       const struct share_mode_shm_fixed *fixed,
+			       const TDB_DATA *dbufs,
+			       size_t num_dbufs)
+{
+	return NT_STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS share_mode_shm_dump(struct share_mode_shm *shm,
+			     struct file_id id,
+			     void (*fn)(const struct share_mode_shm_fixed *fixed,
+					struct server_id exclusive,
+					size_t num_shared,
+					const struct server_id *shared,
+					const uint8_t *data,
+					size_t datalen,
+					void *private_data),
+			     void *private_data)
+{
+	return NT_STATUS_NOT_SUPPORTED;
+}
+
+int share_mode_shm_seqnum(struct share_mode_shm *shm)
+{
+	return 0;
+}
+
+int share_mode_shm_traverse(struct share_mode_shm *shm,
+			    int (*fn)(struct file_id id, void *private_data),
+			    void *private_data)
+{
+	return -1;
+}
+
+NTSTATUS share_mode_shm_watch_add(struct share_mode_shm *shm,
+				  struct file_id id)
+{
+	return NT_STATUS_NOT_SUPPORTED;
+}
+
+void share_mode_shm_watch_del(struct share_mode_shm *shm, struct file_id id)
+{
+}
+
+#endif /* HAVE_ROBUST_MUTEXES && HAVE___ATOMIC_ADD_FETCH */
@@ -0,0 +1,127 @@
+/*
+ * Unix SMB/CIFS implementation.
+ *
+ * Shared memory table for share mode records
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LOCKING_SHARE_MODE_SHM_H__
+#define __LOCKING_SHARE_MODE_SHM_H__
+
+#include "replace.h"
+#include <talloc.h>
+#include <tdb.h>
+#include "libcli/util/ntstatus.h"
+#include "librpc/gen_ndr/file_id.h"
+#include "librpc/gen_ndr/server_id.h"
+
+/*
+ * A replacement for the g_lock protected records in locking.tdb on
+ * a single node: one slot per file_id in a shared mapping, each with
+ * a process shared robust mutex for the writer and a single 64-bit
+ * reference to the current record. Records are copy-on-write, so
+ * readers can copy them without taking any lock and just check that
+ * the reference did not change while they were copying.
+ *
+ * The record contents are opaque to this table. share_mode_lock.c
+ * stores the share entries as native structs and only the variable
+ * length part of struct share_mode_data (names and delete tokens) as
+ * NDR. The fixed size fields that change with every open and close
+ * are kept natively in the slot, see struct share_mode_shm_fixed.
+ */
+
+struct share_mode_shm;
+
+struct share_mode_shm_fixed {
+	uint64_t old_write_time;
+	uint64_t changed_write_time;
+	uint16_t flags;
+};
+
+struct share_mode_shm *share_mode_shm_open(TALLOC_CTX *mem_ctx,
+					   const char *path,
+					   size_t size,
+					   bool read_only);
+
+/*
+ * To be called in forked children: fcntl locks are not inherited, and
+ * the table is reinitialised by the next opener that finds nobody
+ * holding one.
+ */
+bool share_mode_shm_reopen(struct share_mode_shm *shm);
+
+/*
+ * Only one file_id can be locked at a time by a process, just like
+ * the share mode code only ever locks one share mode record. Gives up
+ * with NT_STATUS_IO_TIMEOUT if the holder does not release the lock
+ * within timeout.
+ */
+NTSTATUS share_mode_shm_lock(struct share_mode_shm *shm,
+			     struct file_id id,
+			     struct server_id self,
+			     struct timeval timeout);
+
+/*
+ * *wake_watchers is set if the record was changed under the lock
+ * and someone registered with share_mode_shm_watch_add().
+ */
+NTSTATUS share_mode_shm_unlock(struct share_mode_shm *shm,
+			       struct file_id id,
+			       bool *wake_watchers);
+
+/*
+ * Replace the record of the locked file_id, no data deletes it. With
+ * fixed == NULL the fixed fields are kept.
+ */
+NTSTATUS share_mode_shm_writev(struct share_mode_shm *shm,
+			       struct file_id id,
+			       const struct share_mode_shm_fixed *fixed,
+			       const TDB_DATA *dbufs,
+			       size_t num_dbufs);
+
+/*
+ * Same callback as g_lock_dump() plus the fixed fields. If we hold
+ * the lock the record is passed directly, otherwise a consistent copy
+ * of it.
+ */
+NTSTATUS share_mode_shm_dump(struct share_mode_shm *shm,
+			     struct file_id id,
+			     void (*fn)(const struct share_mode_shm_fixed *fixed,
+					struct server_id exclusive,
+					size_t num_shared,
+					const struct server_id *shared,
+					const uint8_t *data,
+					size_t datalen,
+					void *private_data),
+			     void *private_data);
+
+/*
+ * Changes with every share_mode_shm_writev()
+ */
+int share_mode_shm_seqnum(struct share_mode_shm *shm);
+
+int share_mode_shm_traverse(struct share_mode_shm *shm,
+			    int (*fn)(struct file_id id, void *private_data),
+			    void *private_data);
+
+/*
+ * Watchers have to be added with the file_id locked, they keep the
+ * slot alive until they are removed again.
+ */
+NTSTATUS share_mode_shm_watch_add(struct share_mode_shm *shm,
+				  struct file_id id);
+void share_mode_shm_watch_del(struct share_mode_shm *shm, struct file_id id);
+
+#endif /* __LOCKING_SHARE_MODE_SHM_H__ */
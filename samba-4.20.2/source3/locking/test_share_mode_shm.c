@@ -0,0 +1,554 @@
+/*
+ * Unix SMB/CIFS implementation.
+ *
+ * Tests for the shared memory share mode table
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "replace.h"
+#include "system/filesys.h"
+#include "system/wait.h"
+#include "source3/locking/share_mode_shm.h"
+
+struct test_state {
+	char dir[64];
+	char path[128];
+};
+
+static int setup(void **pstate)
+{
+	struct test_state *state = talloc_zero(NULL, struct test_state);
+	char *p = NULL;
+
+	assert_non_null(state);
+	strlcpy(state->dir, "/tmp/test_share_mode_shm.XXXXXX",
+		sizeof(state->dir));
+	p = mkdtemp(state->dir);
+	assert_non_null(p);
+	snprintf(state->path, sizeof(state->path), "%s/locking.shm",
+		 state->dir);
+
+	*pstate = state;
+	return 0;
+}
+
+static int teardown(void **pstate)
+{
+	struct test_state *state = *pstate;
+
+	unlink(state->path);
+	rmdir(state->dir);
+	TALLOC_FREE(state);
+	return 0;
+}
+
+static const struct timeval test_timeout = { .tv_sec = 10 };
+
+static struct server_id test_self(void)
+{
+	return (struct server_id) { .pid = getpid() };
+}
+
+struct dump_state {
+	bool called;
+	struct share_mode_shm_fixed fixed;
+	struct server_id exclusive;
+	uint8_t data[4096];
+	size_t datalen;
+};
+
+static void dump_fn(const struct share_mode_shm_fixed *fixed,
+		    struct server_id exclusive,
+		    size_t num_shared,
+		    const struct server_id *shared,
+		    const uint8_t *data,
+		    size_t datalen,
+		    void *private_data)
+{
+	struct dump_state *state = private_data;
+
+	assert_true(datalen <= sizeof(state->data));
+	state->called = true;
+	state->fixed = *fixed;
+	state->exclusive = exclusive;
+	memcpy(state->data, data, datalen);
+	state->datalen = datalen;
+}
+
+static void store_str(struct share_mode_shm *shm,
+		      struct file_id id,
+		      const char *s1,
+		      const char *s2)
+{
+	TDB_DATA dbufs[] = {
+		{ .dptr = discard_const_p(uint8_t, s1), .dsize = strlen(s1) },
+		{ .dptr = discard_const_p(uint8_t, s2), .dsize = strlen(s2) },
+	};
+	NTSTATUS status;
+
+	status = share_mode_shm_writev(shm, id, NULL, dbufs, ARRAY_SIZE(dbufs));
+	assert_true(NT_STATUS_IS_OK(status));
+}
+
+static void test_lock_store_dump(void **pstate)
+{
+	struct test_state *state = *pstate;
+	struct share_mode_shm *shm = NULL;
+	struct file_id id = { .devid = 1, .inode = 2, .extid = 3 };
+	struct file_id other = { .devid = 1, .inode = 3 };
+	struct dump_state d = { .called = false };
+	bool wake = true;
+	NTSTATUS status;
+	int seqnum;
+
+	shm = share_mode_shm_open(NULL, state->path, 1024*1024, false);
+	assert_non_null(shm);
+
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_EQUAL(status, NT_STATUS_NOT_FOUND));
+
+	seqnum = share_mode_shm_seqnum(shm);
+
+	status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+	assert_true(NT_STATUS_IS_OK(status));
+
+	/* only one at a time */
+	status = share_mode_shm_lock(shm, other, test_self(), test_timeout);
+	assert_false(NT_STATUS_IS_OK(status));
+	status = share_mode_shm_writev(shm, other, NULL, NULL, 0);
+	assert_false(NT_STATUS_IS_OK(status));
+
+	store_str(shm, id, "hello ", "world");
+	assert_int_not_equal(seqnum, share_mode_shm_seqnum(shm));
+
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_true(d.called);
+	assert_int_equal(d.exclusive.pid, getpid());
+	assert_int_equal(d.datalen, 11);
+	assert_memory_equal(d.data, "hello world", 11);
+
+	status = share_mode_shm_unlock(shm, id, &wake);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_false(wake);
+
+	d = (struct dump_state) { .called = false };
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_int_equal(d.exclusive.pid, 0);
+	assert_int_equal(d.datalen, 11);
+	assert_memory_equal(d.data, "hello world", 11);
+
+	/* a watcher gets woken, and keeps the slot */
+	status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+	assert_true(NT_STATUS_IS_OK(status));
+	status = share_mode_shm_watch_add(shm, id);
+	assert_true(NT_STATUS_IS_OK(status));
+	status = share_mode_shm_writev(shm, id, NULL, NULL, 0);
+	assert_true(NT_STATUS_IS_OK(status));
+	status = share_mode_shm_unlock(shm, id, &wake);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_true(wake);
+
+	d = (struct dump_state) { .called = false };
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_int_equal(d.datalen, 0);
+
+	/* the last watcher of a deleted record deletes the slot */
+	share_mode_shm_watch_del(shm, id);
+
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_EQUAL(status, NT_STATUS_NOT_FOUND));
+
+	/* deleting the record deletes the slot */
+	status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+	assert_true(NT_STATUS_IS_OK(status));
+	store_str(shm, id, "a", "b");
+	status = share_mode_shm_unlock(shm, id, &wake);
+	assert_true(NT_STATUS_IS_OK(status));
+	status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+	assert_true(NT_STATUS_IS_OK(status));
+	status = share_mode_shm_writev(shm, id, NULL, NULL, 0);
+	assert_true(NT_STATUS_IS_OK(status));
+	status = share_mode_shm_unlock(shm, id, &wake);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_false(wake);
+
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_EQUAL(status, NT_STATUS_NOT_FOUND));
+
+	TALLOC_FREE(shm);
+}
+
+static void test_fixed(void **pstate)
+{
+	struct test_state *state = *pstate;
+	struct share_mode_shm *shm = NULL;
+	struct file_id id = { .devid = 1, .inode = 2 };
+	struct share_mode_shm_fixed fixed = {
+		.old_write_time = 1,
+		.changed_write_time = 2,
+		.flags = 3,
+	};
+	struct dump_state d = { .called = false };
+	bool wake;
+	NTSTATUS status;
+
+	shm = share_mode_shm_open(NULL, state->path, 1024*1024, false);
+	assert_non_null(shm);
+
+	status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+	assert_true(NT_STATUS_IS_OK(status));
+	status = share_mode_shm_writev(shm, id, &fixed, NULL, 0);
+	assert_true(NT_STATUS_IS_OK(status));
+
+	/* a fresh slot starts zeroed, NULL keeps what we stored */
+	store_str(shm, id, "a", "b");
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_int_equal(d.fixed.old_write_time, 1);
+	assert_int_equal(d.fixed.changed_write_time, 2);
+	assert_int_equal(d.fixed.flags, 3);
+
+	fixed.flags = 4;
+	status = share_mode_shm_writev(shm, id, &fixed, NULL, 0);
+	assert_true(NT_STATUS_IS_OK(status));
+	store_str(shm, id, "c", "d");
+	status = share_mode_shm_unlock(shm, id, &wake);
+	assert_true(NT_STATUS_IS_OK(status));
+
+	d = (struct dump_state) { .called = false };
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_int_equal(d.fixed.old_write_time, 1);
+	assert_int_equal(d.fixed.flags, 4);
+	assert_int_equal(d.datalen, 2);
+	assert_memory_equal(d.data, "cd", 2);
+
+	TALLOC_FREE(shm);
+}
+
+static int count_fn(struct file_id id, void *private_data)
+{
+	size_t *count = private_data;
+	*count += 1;
+	return 0;
+}
+
+static void test_many(void **pstate)
+{
+	struct test_state *state = *pstate;
+	struct share_mode_shm *shm = NULL;
+	uint8_t buf[3000];
+	size_t num = 500;
+	size_t count = 0;
+	size_t i, round;
+	bool wake;
+	NTSTATUS status;
+
+	/* small enough to need the freed blocks again */
+	shm = share_mode_shm_open(NULL, state->path, 2*1024*1024, false);
+	assert_non_null(shm);
+
+	for (round = 0; round < 4; round++) {
+		for (i = 0; i < num; i++) {
+			struct file_id id = { .devid = round, .inode = i };
+			TDB_DATA dbuf = {
+				.dptr = buf, .dsize = 1 + (i * 7) % 1500,
+			};
+
+			memset(buf, i, sizeof(buf));
+
+			status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+			assert_true(NT_STATUS_IS_OK(status));
+			status = share_mode_shm_writev(shm, id, NULL, &dbuf, 1);
+			assert_true(NT_STATUS_IS_OK(status));
+			status = share_mode_shm_unlock(shm, id, &wake);
+			assert_true(NT_STATUS_IS_OK(status));
+		}
+
+		count = 0;
+		share_mode_shm_traverse(shm, count_fn, &count);
+		assert_int_equal(count, num);
+
+		for (i = 0; i < num; i++) {
+			struct file_id id = { .devid = round, .inode = i };
+			struct dump_state d = { .called = false };
+
+			status = share_mode_shm_dump(shm, id, dump_fn, &d);
+			assert_true(NT_STATUS_IS_OK(status));
+			assert_int_equal(d.datalen, 1 + (i * 7) % 1500);
+			assert_int_equal(d.data[d.datalen-1], (uint8_t)i);
+
+			status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+			assert_true(NT_STATUS_IS_OK(status));
+			status = share_mode_shm_writev(shm, id, NULL, NULL, 0);
+			assert_true(NT_STATUS_IS_OK(status));
+			status = share_mode_shm_unlock(shm, id, &wake);
+			assert_true(NT_STATUS_IS_OK(status));
+		}
+
+		count = 0;
+		share_mode_shm_traverse(shm, count_fn, &count);
+		assert_int_equal(count, 0);
+	}
+
+	TALLOC_FREE(shm);
+}
+
+static void test_processes(void **pstate)
+{
+	struct test_state *state = *pstate;
+	struct share_mode_shm *shm = NULL;
+	struct file_id id = { .devid = 42, .inode = 42 };
+	struct dump_state d = { .called = false };
+	int nprocs = 8;
+	int loops = 1000;
+	uint64_t counter;
+	bool wake;
+	NTSTATUS status;
+	int i;
+
+	shm = share_mode_shm_open(NULL, state->path, 1024*1024, false);
+	assert_non_null(shm);
+
+	for (i = 0; i < nprocs; i++) {
+		pid_t pid = fork();
+		int j;
+
+		assert_int_not_equal(pid, -1);
+		if (pid != 0) {
+			continue;
+		}
+
+		for (j = 0; j < loops; j++) {
+			/* record size varies with the value */
+			uint8_t buf[8 + 64];
+			TDB_DATA dbuf = { .dptr = buf };
+
+			status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+			if (!NT_STATUS_IS_OK(status)) {
+				_exit(1);
+			}
+			d = (struct dump_state) { .called = false };
+			status = share_mode_shm_dump(shm, id, dump_fn, &d);
+			counter = 0;
+			if (NT_STATUS_IS_OK(status) && (d.datalen >= 8)) {
+				memcpy(&counter, d.data, 8);
+			}
+			counter += 1;
+			memcpy(buf, &counter, 8);
+			dbuf.dsize = 8 + counter % 64;
+			status = share_mode_shm_writev(shm, id, NULL, &dbuf, 1);
+			if (!NT_STATUS_IS_OK(status)) {
+				_exit(2);
+			}
+			status = share_mode_shm_unlock(shm, id, &wake);
+			if (!NT_STATUS_IS_OK(status)) {
+				_exit(3);
+			}
+		}
+		_exit(0);
+	}
+
+	for (i = 0; i < nprocs; i++) {
+		int wstatus;
+		pid_t pid = wait(&wstatus);
+		assert_int_not_equal(pid, -1);
+		assert_true(WIFEXITED(wstatus));
+		assert_int_equal(WEXITSTATUS(wstatus), 0);
+	}
+
+	d = (struct dump_state) { .called = false };
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_IS_OK(status));
+	memcpy(&counter, d.data, 8);
+	assert_int_equal(counter, nprocs * loops);
+
+	/* a holder that does not go away makes us give up */
+	{
+		int p[2];
+		char c = 0;
+		pid_t pid;
+		int ret;
+
+		ret = pipe(p);
+		assert_int_equal(ret, 0);
+
+		pid = fork();
+		assert_int_not_equal(pid, -1);
+		if (pid == 0) {
+			close(p[0]);
+			status = share_mode_shm_lock(shm, id, test_self(),
+						     test_timeout);
+			if (write(p[1], &c, 1) != 1) {
+				_exit(1);
+			}
+			/* the parent kills us */
+			pause();
+			_exit(0);
+		}
+		close(p[1]);
+		assert_int_equal(read(p[0], &c, 1), 1);
+		close(p[0]);
+
+		status = share_mode_shm_lock(shm, id, test_self(),
+					     (struct timeval) { .tv_usec = 100000 });
+		assert_true(NT_STATUS_EQUAL(status, NT_STATUS_IO_TIMEOUT));
+
+		kill(pid, SIGKILL);
+		assert_int_equal(waitpid(pid, NULL, 0), pid);
+	}
+
+	/* a holder dying does not block us */
+	if (fork() == 0) {
+		status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+		_exit(NT_STATUS_IS_OK(status) ? 0 : 1);
+	}
+	{
+		int wstatus;
+		pid_t pid = wait(&wstatus);
+		assert_int_not_equal(pid, -1);
+		assert_int_equal(WEXITSTATUS(wstatus), 0);
+	}
+
+	status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+	assert_true(NT_STATUS_IS_OK(status));
+	d = (struct dump_state) { .called = false };
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_IS_OK(status));
+	memcpy(&counter, d.data, 8);
+	assert_int_equal(counter, nprocs * loops);
+	status = share_mode_shm_unlock(shm, id, &wake);
+	assert_true(NT_STATUS_IS_OK(status));
+
+	TALLOC_FREE(shm);
+}
+
+static void test_reopen(void **pstate)
+{
+	struct test_state *state = *pstate;
+	struct share_mode_shm *shm = NULL;
+	struct share_mode_shm *ro = NULL;
+	struct file_id id = { .devid = 7, .inode = 7 };
+	struct dump_state d = { .called = false };
+	bool wake;
+	NTSTATUS status;
+
+	shm = share_mode_shm_open(NULL, state->path, 1024*1024, false);
+	assert_non_null(shm);
+
+	status = share_mode_shm_lock(shm, id, test_self(), test_timeout);
+	assert_true(NT_STATUS_IS_OK(status));
+	store_str(shm, id, "abc", "def");
+	status = share_mode_shm_unlock(shm, id, &wake);
+	assert_true(NT_STATUS_IS_OK(status));
+
+	/* while we hold it open, others see our records */
+	ro = share_mode_shm_open(NULL, state->path, 0, true);
+	assert_non_null(ro);
+	status = share_mode_shm_dump(ro, id, dump_fn, &d);
+	assert_true(NT_STATUS_IS_OK(status));
+	assert_int_equal(d.datalen, 6);
+	status = share_mode_shm_lock(ro, id, test_self(), test_timeout);
+	assert_false(NT_STATUS_IS_OK(status));
+	TALLOC_FREE(ro);
+
+	/* a forked child keeps the table alive for the next opener */
+	{
+		int p[2], q[2];
+		char c = 0;
+		pid_t pid;
+		int ret;
+
+		ret = pipe(p);
+		assert_int_equal(ret, 0);
+		ret = pipe(q);
+		assert_int_equal(ret, 0);
+
+		pid = fork();
+		assert_int_not_equal(pid, -1);
+		if (pid == 0) {
+			close(p[0]);
+			close(q[1]);
+			c = share_mode_shm_reopen(shm) ? 1 : 0;
+			if (write(p[1], &c, 1) != 1) {
+				_exit(1);
+			}
+			if (read(q[0], &c, 1) != 1) {
+				_exit(2);
+			}
+			_exit(0);
+		}
+		close(p[1]);
+		close(q[0]);
+		assert_int_equal(read(p[0], &c, 1), 1);
+		assert_int_equal(c, 1);
+		close(p[0]);
+
+		TALLOC_FREE(shm);
+		shm = share_mode_shm_open(NULL, state->path, 1024*1024, false);
+		assert_non_null(shm);
+		d = (struct dump_state) { .called = false };
+		status = share_mode_shm_dump(shm, id, dump_fn, &d);
+		assert_true(NT_STATUS_IS_OK(status));
+		assert_int_equal(d.datalen, 6);
+
+		assert_int_equal(write(q[1], &c, 1), 1);
+		close(q[1]);
+		assert_int_equal(waitpid(pid, NULL, 0), pid);
+	}
+
+	/* the first opener starts from scratch */
+	TALLOC_FREE(shm);
+	shm = share_mode_shm_open(NULL, state->path, 1024*1024, false);
+	assert_non_null(shm);
+	status = share_mode_shm_dump(shm, id, dump_fn, &d);
+	assert_true(NT_STATUS_EQUAL(status, NT_STATUS_NOT_FOUND));
+	TALLOC_FREE(shm);
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_lock_store_dump,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_fixed,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_many,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_processes,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_reopen,
+						setup, teardown),
+	};
+
+	if (argc == 2) {
+		cmocka_set_test_filter(argv[1]);
+	}
+	cmocka_set_message_output(CM_OUTPUT_SUBUNIT);
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+
+	return rc;
+}
@@ -50,9 +50,26 @@ struct open_how;
 
 struct vfs_io_uring_request;
 
+/*
+ * The credentials a batched request was queued with, see
+ * vfs_io_uring_request_submit().
+ */
+struct vfs_io_uring_personality {
+	struct vfs_io_uring_config *config;
+	struct security_unix_token *utok;
+	int id;
+	unsigned refcount;
+};
+
 struct vfs_io_uring_config {
 	struct io_uring uring;
+	struct tevent_context *ev;
 	struct tevent_fd *fde;
+	struct connection_struct *conn;
+	/* see vfs_io_uring_request_submit() */
+	bool batch_submit;
+	struct tevent_immediate *im;
+	struct vfs_io_uring_personality *personality;
 	/* recursion guard. See comment above vfs_io_uring_queue_run() */
 	bool busy;
 	/* recursion guard. See comment above vfs_io_uring_queue_run() */
@@ -71,10 +88,89 @@ struct vfs_io_uring_request {
 	struct timespec start_time;
 	struct timespec end_time;
 	SMBPROFILE_BYTES_ASYNC_STATE(profile_bytes);
+	struct vfs_io_uring_personality *personality;
 	struct io_uring_sqe sqe;
 	struct io_uring_cqe cqe;
 };
 
+static int vfs_io_uring_personality_destructor(
+	struct vfs_io_uring_personality *p)
+{
+	struct vfs_io_uring_config *config = p->config;
+
+	if (config->uring.ring_fd != -1) {
+		io_uring_unregister_personality(&config->uring, p->id);
+	}
+	return 0;
+}
+
+static void vfs_io_uring_personality_put(struct vfs_io_uring_personality **_p)
+{
+	struct vfs_io_uring_personality *p = *_p;
+
+	if (p == NULL) {
+		return;
+	}
+	*_p = NULL;
+
+	SMB_ASSERT(p->refcount > 0);
+	p->refcount -= 1;
+	if (p->refcount == 0) {
+		TALLOC_FREE(p);
+	}
+}
+
+/*
+ * Registers the credentials we currently run with as an io_uring
+ * personality, unless the last one registered still matches.
+ */
+static bool vfs_io_uring_request_set_personality(
+	struct vfs_io_uring_request *cur)
+{
+	struct vfs_io_uring_config *config = cur->config;
+	struct vfs_io_uring_personality *p = config->personality;
+	const struct security_unix_token *utok =
+		get_current_utok(config->conn);
+	int id;
+
+	if ((p != NULL) && unix_token_equal(p->utok, utok)) {
+		goto done;
+	}
+
+	id = io_uring_register_personality(&config->uring);
+	if (id < 0) {
+		DBG_DEBUG("io_uring_register_personality() failed: %s\n",
+			  strerror(-id));
+		return false;
+	}
+
+	p = talloc_zero(config, struct vfs_io_uring_personality);
+	if (p == NULL) {
+		io_uring_unregister_personality(&config->uring, id);
+		return false;
+	}
+	p->config = config;
+	p->id = id;
+	talloc_set_destructor(p, vfs_io_uring_personality_destructor);
+
+	p->utok = copy_unix_token(p, utok);
+	if (p->utok == NULL) {
+		TALLOC_FREE(p);
+		return false;
+	}
+
+	/* The config keeps a reference to the last one */
+	vfs_io_uring_personality_put(&config->personality);
+	config->personality = p;
+	p->refcount = 1;
+
+done:
+	p->refcount += 1;
+	cur->personality = p;
+	cur->sqe.personality = p->id;
+	return true;
+}
+
 static void vfs_io_uring_finish_req(struct vfs_io_uring_request *cur,
 				    const struct io_uring_cqe *cqe,
 				    struct timespec end_time,
@@ -90,6 +186,8 @@ static void vfs_io_uring_finish_req(struct vfs_io_uring_request *cur,
 		DLIST_REMOVE((*cur->list_head), cur);
 		cur->list_head = NULL;
 	}
+	vfs_io_uring_personality_put(&cur->personality);
+	cur->sqe.personality = 0;
 	cur->cqe = *cqe;
 
 	SMBPROFILE_BYTES_ASYNC_SET_IDLE(cur->profile_bytes);
@@ -145,6 +243,10 @@ static int vfs_io_uring_config_destructor(struct vfs_io_uring_config *config)
 	return 0;
 }
 
+/*
+ * All request states start with their struct vfs_io_uring_request,
+ * that's how the destructors below find it.
+ */
 static int vfs_io_uring_request_state_deny_destructor(void *_state)
 {
 	struct __vfs_io_uring_generic_state {
@@ -168,6 +270,24 @@ static int vfs_io_uring_request_state_deny_destructor(void *_state)
 	return 0;
 }
 
+/*
+ * A batched request that was not handed to the kernel yet
+ */
+static int vfs_io_uring_request_state_queued_destructor(void *_state)
+{
+	struct __vfs_io_uring_generic_state {
+		struct vfs_io_uring_request ur;
+	} *state = (struct __vfs_io_uring_generic_state *)_state;
+	struct vfs_io_uring_request *cur = &state->ur;
+
+	if (cur->list_head != NULL) {
+		DLIST_REMOVE((*cur->list_head), cur);
+		cur->list_head = NULL;
+	}
+	vfs_io_uring_personality_put(&cur->personality);
+	return 0;
+}
+
 static void vfs_io_uring_fd_handler(struct tevent_context *ev,
 				    struct tevent_fd *fde,
 				    uint16_t flags,
@@ -187,6 +307,7 @@ static int vfs_io_uring_connect(vfs_handle_struct *handle, const char *service,
 		DEBUG(0, ("talloc_zero() failed\n"));
 		return -1;
 	}
+	config->conn = handle->conn;
 
 	SMB_VFS_HANDLE_SET_DATA(handle, config,
 				NULL, struct vfs_io_uring_config,
@@ -211,6 +332,19 @@ static int vfs_io_uring_connect(vfs_handle_struct *handle, const char *service,
 		flags |= IORING_SETUP_SQPOLL;
 	}
 
+	config->batch_submit = lp_parm_bool(SNUM(handle->conn),
+					    "io_uring",
+					    "batch submit",
+					    false);
+	if (config->batch_submit) {
+		config->im = tevent_create_immediate(config);
+		if (config->im == NULL) {
+			SMB_VFS_NEXT_DISCONNECT(handle);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
 	ret = io_uring_queue_init(num_entries, &config->uring, flags);
 	if (ret < 0) {
 		SMB_VFS_NEXT_DISCONNECT(handle);
@@ -229,7 +363,8 @@ static int vfs_io_uring_connect(vfs_handle_struct *handle, const char *service,
 	}
 #endif /* HAVE_IO_URING_RING_DONTFORK */
 
-	config->fde = tevent_add_fd(handle->conn->sconn->ev_ctx,
+	config->ev = handle->conn->sconn->ev_ctx;
+	config->fde = tevent_add_fd(config->ev,
 				    config,
 				    config->uring.ring_fd,
 				    TEVENT_FD_READ,
@@ -390,14 +525,56 @@ static void vfs_io_uring_queue_run(struct vfs_io_uring_config *config)
 	config->busy = false;
 }
 
+static void vfs_io_uring_queue_run_immediate(struct tevent_context *ev,
+					     struct tevent_immediate *im,
+					     void *private_data)
+{
+	struct vfs_io_uring_config *config = talloc_get_type_abort(
+		private_data, struct vfs_io_uring_config);
+
+	vfs_io_uring_queue_run(config);
+}
+
 static void vfs_io_uring_request_submit(struct vfs_io_uring_request *cur)
 {
 	struct vfs_io_uring_config *config = cur->config;
+	bool ok;
 
 	io_uring_sqe_set_data(&cur->sqe, cur);
 	DLIST_ADD_END(config->queue, cur);
 	cur->list_head = &config->queue;
 
+	if (config->batch_submit && !config->busy) {
+		/*
+		 * Collect all requests queued during the current
+		 * event loop iteration, e.g. the getxattr calls
+		 * for the dos attributes of a whole directory
+		 * listing, and hand them to the kernel with a
+		 * single io_uring_submit() call.
+		 *
+		 * By then smbd may run as a different user, so the
+		 * kernel has to use the credentials of the caller
+		 * via its personality. Without one we submit right
+		 * away.
+		 *
+		 * Resubmissions from completion functions
+		 * (config->busy is set) are picked up by the
+		 * retry loop in vfs_io_uring_queue_run().
+		 */
+		ok = vfs_io_uring_request_set_personality(cur);
+		if (ok) {
+			talloc_set_destructor(
+				_tevent_req_data(cur->req),
+				vfs_io_uring_request_state_queued_destructor);
+			tevent_schedule_immediate(
+				config->im,
+				config->ev,
+				vfs_io_uring_queue_run_immediate,
+				config);
+			return;
+		}
+	}
+
 	vfs_io_uring_queue_run(config);
 }
 
@@ -417,11 +594,15 @@ static void vfs_io_uring_fd_handler(struct tevent_context *ev,
 }
 
 struct vfs_io_uring_pread_state {
+	/*
+	 * Must be first, see
+	 * vfs_io_uring_request_state_deny_destructor()
+	 */
+	struct vfs_io_uring_request ur;
 	struct files_struct *fsp;
 	off_t offset;
 	struct iovec iov;
 	size_t nread;
-	struct vfs_io_uring_request ur;
 };
 
 static void vfs_io_uring_pread_submit(struct vfs_io_uring_pread_state *state);
@@ -565,11 +746,15 @@ static ssize_t vfs_io_uring_pread_recv(struct tevent_req *req,
 }
 
 struct vfs_io_uring_pwrite_state {
+	/*
+	 * Must be first, see
+	 * vfs_io_uring_request_state_deny_destructor()
+	 */
+	struct vfs_io_uring_request ur;
 	struct files_struct *fsp;
 	off_t offset;
 	struct iovec iov;
 	size_t nwritten;
-	struct vfs_io_uring_request ur;
 };
 
 static void vfs_io_uring_pwrite_submit(struct vfs_io_uring_pwrite_state *state);
@@ -713,6 +898,10 @@ static ssize_t vfs_io_uring_pwrite_recv(struct tevent_req *req,
 }
 
 struct vfs_io_uring_fsync_state {
+	/*
+	 * Must be first, see
+	 * vfs_io_uring_request_state_deny_destructor()
+	 */
 	struct vfs_io_uring_request ur;
 };
 
@@ -804,6 +993,227 @@ static int vfs_io_uring_fsync_recv(struct tevent_req *req,
 	return 0;
 }
 
+#ifdef HAVE_IO_URING_PREP_FGETXATTR
+
+struct vfs_io_uring_getxattrat_state {
+	/*
+	 * Must be first, see
+	 * vfs_io_uring_request_state_deny_destructor()
+	 */
+	struct vfs_io_uring_request ur;
+	struct files_struct *fsp;
+	bool via_next;
+	struct sys_proc_fd_path_buf buf;
+	char *xattr_name;
+	uint8_t *xattr_value;
+	ssize_t xattr_size;
+	struct vfs_aio_state next_aio_state;
+};
+
+static void vfs_io_uring_getxattrat_completion(struct vfs_io_uring_request *cur,
+					       const char *location);
+static void vfs_io_uring_getxattrat_next_done(struct tevent_req *subreq);
+
+static struct tevent_req *vfs_io_uring_getxattrat_send(
+			TALLOC_CTX *mem_ctx,
+			struct tevent_context *ev,
+			struct vfs_handle_struct *handle,
+			files_struct *dir_fsp,
+			const struct smb_filename *smb_fname,
+			const char *xattr_name,
+			size_t alloc_hint)
+{
+	struct tevent_req *req = NULL;
+	struct tevent_req *subreq = NULL;
+	struct vfs_io_uring_getxattrat_state *state = NULL;
+	struct vfs_io_uring_config *config = NULL;
+	struct files_struct *fsp = smb_fname->fsp;
+	int fd;
+
+	SMB_VFS_HANDLE_GET_DATA(handle, config,
+				struct vfs_io_uring_config,
+				smb_panic(__location__));
+
+	SMB_ASSERT(!is_named_stream(smb_fname));
+
+	req = tevent_req_create(mem_ctx, &state,
+				struct vfs_io_uring_getxattrat_state);
+	if (req == NULL) {
+		return NULL;
+	}
+	state->fsp = fsp;
+
+	if ((fsp == NULL) ||
+	    (fsp->fsp_flags.is_pathref && !fsp->fsp_flags.have_proc_fds))
+	{
+		/*
+		 * No handle based call possible,
+		 * let the next module deal with it.
+		 */
+		state->via_next = true;
+		subreq = SMB_VFS_NEXT_GETXATTRAT_SEND(state,
+						      ev,
+						      handle,
+						      dir_fsp,
+						      smb_fname,
+						      xattr_name,
+						      alloc_hint);
+		if (tevent_req_nomem(subreq, req)) {
+			return tevent_req_post(req, ev);
+		}
+		tevent_req_set_callback(subreq,
+					vfs_io_uring_getxattrat_next_done,
+					req);
+		return req;
+	}
+
+	state->ur.config = config;
+	state->ur.req = req;
+	state->ur.completion_fn = vfs_io_uring_getxattrat_completion;
+
+	SMBPROFILE_BYTES_ASYNC_START(syscall_asys_getxattrat, profile_p,
+				     state->ur.profile_bytes, 0);
+	SMBPROFILE_BYTES_ASYNC_SET_IDLE(state->ur.profile_bytes);
+
+	/*
+	 * The kernel may look at the name and buffer
+	 * after we return, so they need to be owned
+	 * by the state.
+	 */
+	state->xattr_name = talloc_strdup(state, xattr_name);
+	if (tevent_req_nomem(state->xattr_name, req)) {
+		return tevent_req_post(req, ev);
+	}
+
+	if (alloc_hint > 0) {
+		state->xattr_value = talloc_zero_array(state,
+						       uint8_t,
+						       alloc_hint);
+		if (tevent_req_nomem(state->xattr_value, req)) {
+			return tevent_req_post(req, ev);
+		}
+	}
+
+	fd = fsp_get_pathref_fd(fsp);
+
+	if (!fsp->fsp_flags.is_pathref) {
+		io_uring_prep_fgetxattr(&state->ur.sqe,
+					fd,
+					state->xattr_name,
+					(char *)state->xattr_value,
+					talloc_array_length(state->xattr_value));
+	} else {
+		const char *path = sys_proc_fd_path(fd, &state->buf);
+
+		io_uring_prep_getxattr(&state->ur.sqe,
+				       state->xattr_name,
+				       (char *)state->xattr_value,
+				       path,
+				       talloc_array_length(state->xattr_value));
+	}
+	vfs_io_uring_request_submit(&state->ur);
+
+	if (!tevent_req_is_in_progress(req)) {
+		return tevent_req_post(req, ev);
+	}
+
+	tevent_req_defer_callback(req, ev);
+	return req;
+}
+
+static void vfs_io_uring_getxattrat_completion(struct vfs_io_uring_request *cur,
+					       const char *location)
+{
+	struct vfs_io_uring_getxattrat_state *state = tevent_req_data(
+		cur->req, struct vfs_io_uring_getxattrat_state);
+
+	/*
+	 * We rely on being inside the _send() function
+	 * or tevent_req_defer_callback() being called
+	 * already.
+	 */
+
+	if (cur->cqe.res < 0) {
+		int err = -cur->cqe.res;
+		_tevent_req_error(cur->req, err, location);
+		return;
+	}
+
+	state->xattr_size = cur->cqe.res;
+
+	if (state->xattr_value == NULL) {
+		/*
+		 * The caller only wanted the size.
+		 */
+		tevent_req_done(cur->req);
+		return;
+	}
+
+	/*
+	 * shrink the buffer to the returned size.
+	 * (can't fail). It means NULL if size is 0.
+	 */
+	state->xattr_value = talloc_realloc(state,
+					    state->xattr_value,
+					    uint8_t,
+					    state->xattr_size);
+
+	tevent_req_done(cur->req);
+}
+
+static void vfs_io_uring_getxattrat_next_done(struct tevent_req *subreq)
+{
+	struct tevent_req *req = tevent_req_callback_data(
+		subreq, struct tevent_req);
+	struct vfs_io_uring_getxattrat_state *state = tevent_req_data(
+		req, struct vfs_io_uring_getxattrat_state);
+
+	state->xattr_size = SMB_VFS_NEXT_GETXATTRAT_RECV(subreq,
+							 &state->next_aio_state,
+							 state,
+							 &state->xattr_value);
+	TALLOC_FREE(subreq);
+	if (state->xattr_size == -1) {
+		tevent_req_error(req, state->next_aio_state.error);
+		return;
+	}
+
+	tevent_req_done(req);
+}
+
+static ssize_t vfs_io_uring_getxattrat_recv(struct tevent_req *req,
+					    struct vfs_aio_state *aio_state,
+					    TALLOC_CTX *mem_ctx,
+					    uint8_t **xattr_value)
+{
+	struct vfs_io_uring_getxattrat_state *state = tevent_req_data(
+		req, struct vfs_io_uring_getxattrat_state);
+	ssize_t xattr_size;
+
+	if (!state->via_next) {
+		SMBPROFILE_BYTES_ASYNC_END(state->ur.profile_bytes);
+		state->next_aio_state.duration = nsec_time_diff(
+			&state->ur.end_time, &state->ur.start_time);
+	}
+
+	if (tevent_req_is_unix_error(req, &aio_state->error)) {
+		tevent_req_received(req);
+		return -1;
+	}
+
+	*aio_state = state->next_aio_state;
+	aio_state->error = 0;
+	xattr_size = state->xattr_size;
+	if (xattr_value != NULL) {
+		*xattr_value = talloc_move(mem_ctx, &state->xattr_value);
+	}
+
+	tevent_req_received(req);
+	return xattr_size;
+}
+
+#endif /* HAVE_IO_URING_PREP_FGETXATTR */
+
 static struct vfs_fn_pointers vfs_io_uring_fns = {
 	.connect_fn = vfs_io_uring_connect,
 	.pread_send_fn = vfs_io_uring_pread_send,
@@ -812,6 +1222,10 @@ static struct vfs_fn_pointers vfs_io_uring_fns = {
 	.pwrite_recv_fn = vfs_io_uring_pwrite_recv,
 	.fsync_send_fn = vfs_io_uring_fsync_send,
 	.fsync_recv_fn = vfs_io_uring_fsync_recv,
+#ifdef HAVE_IO_URING_PREP_FGETXATTR
+	.getxattrat_send_fn = vfs_io_uring_getxattrat_send,
+	.getxattrat_recv_fn = vfs_io_uring_getxattrat_recv,
+#endif /* HAVE_IO_URING_PREP_FGETXATTR */
 };
 
 static_decl_vfs;
@@ -27,6 +27,7 @@
 #include "lib/tdb_wrap/tdb_wrap.h"
 #include <tevent.h>
 #include "../lib/crypto/crypto.h"
+#include "../lib/util/memcache.h"
 
 #ifdef HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
@@ -210,6 +211,32 @@ static int profile_stats_parser(TDB_DATA key, TDB_DATA value,
 	return 0;
 }
 
+/*
+ * Move the counters of the global memcache into our stats, they are
+ * reset so we only add what happened since the last dump.
+ */
+static void smbprofile_memcache_collect(struct profile_stats *p)
+{
+#define __MEMCACHE_COLLECT(_n, _name) do { \
+	struct memcache_stats _s; \
+	memcache_get_stats(NULL, _n, &_s); \
+	memcache_reset_stats(NULL, _n); \
+	p->values.memcache_##_name##_hits_stats.count += _s.hits; \
+	p->values.memcache_##_name##_misses_stats.count += _s.misses; \
+	p->values.memcache_##_name##_evictions_stats.count += _s.evictions; \
+} while(0)
+	__MEMCACHE_COLLECT(GETWD_CACHE, getwd);
+	__MEMCACHE_COLLECT(GETREALFILENAME_CACHE, getrealfilename);
+	__MEMCACHE_COLLECT(GETPWNAM_CACHE, getpwnam);
+	__MEMCACHE_COLLECT(MANGLE_HASH2_CACHE, mangle_hash2);
+	__MEMCACHE_COLLECT(PDB_GETPWSID_CACHE, pdb_getpwsid);
+	__MEMCACHE_COLLECT(SINGLETON_CACHE, singleton);
+	__MEMCACHE_COLLECT(SINGLETON_CACHE_TALLOC, singleton_talloc);
+	__MEMCACHE_COLLECT(SHARE_MODE_LOCK_CACHE, share_mode_lock);
+	__MEMCACHE_COLLECT(DFREE_CACHE, dfree);
+#undef __MEMCACHE_COLLECT
+}
+
 void smbprofile_dump(void)
 {
 	pid_t pid = 0;
@@ -241,6 +268,7 @@ void smbprofile_dump(void)
 	tdb_parse_record(smbprofile_state.internal.db->tdb,
 			 key, profile_stats_parser, &s);
 
+	smbprofile_memcache_collect(profile_p);
 	smbprofile_stats_accumulate(profile_p, &s);
 
 #ifdef HAVE_GETRUSAGE
@@ -25,7 +25,7 @@
 #include "reg_objects.h"
 #include "util_tdb.h"
 #include "dbwrap/dbwrap.h"
-#include "dbwrap/dbwrap_rbt.h"
+#include "dbwrap/dbwrap_btree.h"
 #include "../libcli/registry/util_reg.h"
 #include "lib/util/string_wrappers.h"
 
@@ -80,7 +80,7 @@ WERROR regsubkey_ctr_init(TALLOC_CTX *mem_ctx, struct regsubkey_ctr **ctr)
 		return WERR_NOT_ENOUGH_MEMORY;
 	}
 
-	(*ctr)->subkeys_hash = db_open_rbt(*ctr);
+	(*ctr)->subkeys_hash = db_open_btree(*ctr);
 	if ((*ctr)->subkeys_hash == NULL) {
 		talloc_free(*ctr);
 		return WERR_NOT_ENOUGH_MEMORY;
@@ -101,7 +101,7 @@ WERROR regsubkey_ctr_reinit(struct regsubkey_ctr *ctr)
 	}
 
 	talloc_free(ctr->subkeys_hash);
-	ctr->subkeys_hash = db_open_rbt(ctr);
+	ctr->subkeys_hash = db_open_btree(ctr);
 	W_ERROR_HAVE_NO_MEMORY(ctr->subkeys_hash);
 
 	TALLOC_FREE(ctr->subkeys);
@@ -544,6 +544,7 @@ local_tests = [
     "LOCAL-GENCACHE",
     "LOCAL-BASE64",
     "LOCAL-RBTREE",
+    "LOCAL-DBWRAP-BTREE",
     "LOCAL-MEMCACHE",
     "LOCAL-STREAM-NAME",
     "LOCAL-STR-MATCH-MSWILD",
@@ -565,6 +566,8 @@ local_tests = [
     "LOCAL-MESSAGING-FDPASS2a",
     "LOCAL-MESSAGING-FDPASS2b",
     "LOCAL-MESSAGING-SEND-ALL",
+    "LOCAL-MESSAGING-COALESCE",
+    "LOCAL-MESSAGING-SHM",
     "LOCAL-PTHREADPOOL-TEVENT",
     "LOCAL-CANONICALIZE-PATH",
     "LOCAL-DBWRAP-WATCH1",
@@ -581,6 +584,7 @@ local_tests = [
     "LOCAL-G-LOCK6",
     "LOCAL-G-LOCK7",
     "LOCAL-G-LOCK8",
+    "LOCAL-G-LOCK-FIFO1",
     "LOCAL-NAMEMAP-CACHE1",
     "LOCAL-IDMAP-CACHE1",
     "LOCAL-TDB-VALIDATE",
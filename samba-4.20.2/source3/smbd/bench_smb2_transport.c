@@ -0,0 +1,508 @@
+/*
+   Unix SMB/CIFS implementation.
+
+   Loopback benchmark for the SMB2 server transport, measures the
+   request/response latency and the throughput over local TCP and
+   AF_UNIX connections.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "replace.h"
+#include "system/network.h"
+#include "system/filesys.h"
+#include "system/wait.h"
+#include "lib/util/talloc_stack.h"
+#include "lib/util/time.h"
+#include "lib/util/iov_buf.h"
+#include "lib/util/byteorder.h"
+#include "libcli/util/ntstatus.h"
+#include "source3/smbd/smb2_transport.h"
+#include <poll.h>
+
+/* An SMB2 ECHO request is 4 + 64 + 4 bytes */
+#define BENCH_SMALL_PDU 68
+#define BENCH_LARGE_PDU (1024 * 1024)
+
+/* The first byte of a PDU tells the echo side what to do */
+#define BENCH_OP_PING	'P'
+#define BENCH_OP_WRITE	'W'
+#define BENCH_OP_SYNC	'S'
+#define BENCH_OP_READ	'R'
+#define BENCH_OP_EXIT	'X'
+
+struct bench_end {
+	struct smbd_smb2_transport *recv_t;
+	struct smbd_smb2_transport *send_t;
+};
+
+static bool bench_wait(struct smbd_smb2_transport *t, short events)
+{
+	struct pollfd pfd = {
+		.fd = t->fd,
+		.events = events,
+	};
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, -1);
+	} while (ret == -1 && errno == EINTR);
+
+	return (ret == 1);
+}
+
+static bool bench_send_pdu(struct smbd_smb2_transport *t,
+			   uint8_t *pdu,
+			   size_t len)
+{
+	struct iovec _iov = {
+		.iov_base = pdu,
+		.iov_len = len,
+	};
+	struct iovec *iov = &_iov;
+	int iovcnt = 1;
+
+	/* the NBT length header */
+	RSIVAL(pdu, 0, len - 4);
+
+	while (iovcnt > 0) {
+		ssize_t ret;
+
+		ret = smbd_smb2_transport_send(t, iov, iovcnt);
+		if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+			if (!bench_wait(t, POLLOUT)) {
+				return false;
+			}
+			continue;
+		}
+		if (ret <= 0) {
+			return false;
+		}
+		if (!iov_advance(&iov, &iovcnt, ret)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool bench_recv_all(struct smbd_smb2_transport *t,
+			   uint8_t *buf,
+			   size_t len)
+{
+	struct iovec _iov = {
+		.iov_base = buf,
+		.iov_len = len,
+	};
+	struct iovec *iov = &_iov;
+	int iovcnt = 1;
+
+	while (iovcnt > 0) {
+		ssize_t ret;
+
+		ret = smbd_smb2_transport_recv(t, iov, iovcnt);
+		if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+			if (!bench_wait(t, POLLIN)) {
+				return false;
+			}
+			continue;
+		}
+		if (ret <= 0) {
+			return false;
+		}
+		if (!iov_advance(&iov, &iovcnt, ret)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static ssize_t bench_recv_pdu(struct smbd_smb2_transport *t,
+			      uint8_t *buf,
+			      size_t buflen)
+{
+	size_t len;
+	bool ok;
+
+	ok = bench_recv_all(t, buf, 4);
+	if (!ok) {
+		return -1;
+	}
+	len = RIVAL(buf, 0) + 4;
+	if (len > buflen || len < 5) {
+		return -1;
+	}
+	ok = bench_recv_all(t, buf + 4, len - 4);
+	if (!ok) {
+		return -1;
+	}
+	return len;
+}
+
+/*
+ * The other end, it does what an SMB2 server does with the
+ * PDUs: answer every ping, swallow writes until a sync and send
+ * back as much data as a read asks for.
+ */
+static int bench_echo(struct bench_end *e, uint8_t *buf)
+{
+	while (true) {
+		ssize_t len;
+		uint32_t i, count;
+		bool ok = true;
+
+		len = bench_recv_pdu(e->recv_t, buf, BENCH_LARGE_PDU);
+		if (len == -1) {
+			return 1;
+		}
+
+		switch (buf[4]) {
+		case BENCH_OP_PING:
+		case BENCH_OP_SYNC:
+			ok = bench_send_pdu(e->send_t, buf, len);
+			break;
+		case BENCH_OP_WRITE:
+			break;
+		case BENCH_OP_READ:
+			count = IVAL(buf, 5);
+			for (i = 0; ok && i < count; i++) {
+				ok = bench_send_pdu(e->send_t,
+						    buf,
+						    BENCH_LARGE_PDU);
+			}
+			break;
+		case BENCH_OP_EXIT:
+			return 0;
+		default:
+			return 1;
+		}
+		if (!ok) {
+			return 1;
+		}
+	}
+}
+
+struct bench_result {
+	double latency_usecs;
+	double write_mbytes;
+	double read_mbytes;
+};
+
+static bool bench_client(struct bench_end *e,
+			 uint8_t *buf,
+			 unsigned iterations,
+			 unsigned mbytes,
+			 struct bench_result *r)
+{
+	struct timespec start, end;
+	unsigned i;
+	bool ok;
+
+	memset(buf, 0x5a, BENCH_LARGE_PDU);
+
+	clock_gettime_mono(&start);
+	for (i = 0; i < iterations; i++) {
+		buf[4] = BENCH_OP_PING;
+		ok = bench_send_pdu(e->send_t, buf, BENCH_SMALL_PDU);
+		if (!ok) {
+			return false;
+		}
+		if (bench_recv_pdu(e->recv_t, buf, BENCH_LARGE_PDU) !=
+		    BENCH_SMALL_PDU) {
+			return false;
+		}
+	}
+	clock_gettime_mono(&end);
+	r->latency_usecs = (double)nsec_time_diff(&end, &start) /
+		iterations / 1000;
+
+	clock_gettime_mono(&start);
+	for (i = 0; i < mbytes; i++) {
+		buf[4] = BENCH_OP_WRITE;
+		ok = bench_send_pdu(e->send_t, buf, BENCH_LARGE_PDU);
+		if (!ok) {
+			return false;
+		}
+	}
+	buf[4] = BENCH_OP_SYNC;
+	ok = bench_send_pdu(e->send_t, buf, BENCH_SMALL_PDU);
+	if (!ok) {
+		return false;
+	}
+	if (bench_recv_pdu(e->recv_t, buf, BENCH_LARGE_PDU) !=
+	    BENCH_SMALL_PDU) {
+		return false;
+	}
+	clock_gettime_mono(&end);
+	r->write_mbytes = mbytes /
+		((double)nsec_time_diff(&end, &start) / 1000000000);
+
+	clock_gettime_mono(&start);
+	buf[4] = BENCH_OP_READ;
+	SIVAL(buf, 5, mbytes);
+	ok = bench_send_pdu(e->send_t, buf, BENCH_SMALL_PDU);
+	if (!ok) {
+		return false;
+	}
+	for (i = 0; i < mbytes; i++) {
+		if (bench_recv_pdu(e->recv_t, buf, BENCH_LARGE_PDU) !=
+		    BENCH_LARGE_PDU) {
+			return false;
+		}
+	}
+	clock_gettime_mono(&end);
+	r->read_mbytes = mbytes /
+		((double)nsec_time_diff(&end, &start) / 1000000000);
+
+	buf[4] = BENCH_OP_EXIT;
+	return bench_send_pdu(e->send_t, buf, BENCH_SMALL_PDU);
+}
+
+/*
+ * fds[0] and fds[1] are the receiving and sending fd of the
+ * client end, fds[2] and fds[3] those of the server end. For
+ * sockets they are the same.
+ */
+static bool bench_channel_tcp(int fds[4])
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t addrlen = sizeof(addr);
+	int one = 1;
+	int lfd, cfd, sfd;
+	int ret;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd == -1) {
+		return false;
+	}
+	ret = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret == 0) {
+		ret = listen(lfd, 1);
+	}
+	if (ret == 0) {
+		ret = getsockname(lfd, (struct sockaddr *)&addr, &addrlen);
+	}
+	if (ret != 0) {
+		close(lfd);
+		return false;
+	}
+
+	cfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (cfd == -1) {
+		close(lfd);
+		return false;
+	}
+	ret = connect(cfd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret != 0) {
+		close(cfd);
+		close(lfd);
+		return false;
+	}
+	sfd = accept(lfd, NULL, NULL);
+	close(lfd);
+	if (sfd == -1) {
+		close(cfd);
+		return false;
+	}
+
+	/* smbd sets TCP_NODELAY via the default "socket options" */
+	setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	fds[0] = fds[1] = cfd;
+	fds[2] = fds[3] = sfd;
+	return true;
+}
+
+static bool bench_channel_unix(int fds[4])
+{
+	int sv[2];
+	int ret;
+
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	if (ret != 0) {
+		return false;
+	}
+	fds[0] = fds[1] = sv[0];
+	fds[2] = fds[3] = sv[1];
+	return true;
+}
+
+static void bench_close_fds(int fds[4])
+{
+	size_t i, j;
+
+	for (i = 0; i < 4; i++) {
+		bool dup = false;
+
+		for (j = 0; j < i; j++) {
+			dup |= (fds[j] == fds[i]);
+		}
+		if (!dup && fds[i] != -1) {
+			close(fds[i]);
+		}
+	}
+}
+
+static bool bench_end_init(TALLOC_CTX *mem_ctx,
+			   int recv_fd,
+			   int send_fd,
+			   struct bench_end *e)
+{
+	NTSTATUS status;
+
+	status = smbd_smb2_transport_create(mem_ctx,
+					    recv_fd,
+					    &e->recv_t);
+	if (!NT_STATUS_IS_OK(status)) {
+		return false;
+	}
+	if (send_fd == recv_fd) {
+		e->send_t = e->recv_t;
+		return true;
+	}
+	status = smbd_smb2_transport_create(mem_ctx,
+					    send_fd,
+					    &e->send_t);
+	return NT_STATUS_IS_OK(status);
+}
+
+static bool bench_run(TALLOC_CTX *mem_ctx,
+		      bool (*channel_fn)(int fds[4]),
+		      unsigned iterations,
+		      unsigned mbytes,
+		      struct bench_result *r)
+{
+	int fds[4] = { -1, -1, -1, -1 };
+	struct bench_end client = { NULL, };
+	uint8_t *buf = NULL;
+	pid_t pid;
+	int status;
+	bool ok;
+
+	buf = talloc_array(mem_ctx, uint8_t, BENCH_LARGE_PDU);
+	if (buf == NULL) {
+		return false;
+	}
+
+	ok = channel_fn(fds);
+	if (!ok) {
+		TALLOC_FREE(buf);
+		return false;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		bench_close_fds(fds);
+		TALLOC_FREE(buf);
+		return false;
+	}
+	if (pid == 0) {
+		struct bench_end server = { NULL, };
+
+		close(fds[0]);
+		if (fds[1] != fds[0]) {
+			close(fds[1]);
+		}
+		ok = bench_end_init(mem_ctx, fds[2], fds[3], &server);
+		if (!ok) {
+			_exit(1);
+		}
+		_exit(bench_echo(&server, buf));
+	}
+
+	close(fds[2]);
+	if (fds[3] != fds[2]) {
+		close(fds[3]);
+	}
+	fds[2] = fds[3] = -1;
+
+	ok = bench_end_init(mem_ctx, fds[0], fds[1], &client);
+	if (ok) {
+		ok = bench_client(&client, buf, iterations, mbytes, r);
+	}
+
+	bench_close_fds(fds);
+	if (client.send_t != client.recv_t) {
+		TALLOC_FREE(client.send_t);
+	}
+	TALLOC_FREE(client.recv_t);
+	TALLOC_FREE(buf);
+
+	if (waitpid(pid, &status, 0) != pid) {
+		return false;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		return false;
+	}
+	return ok;
+}
+
+int main(int argc, const char *argv[])
+{
+	TALLOC_CTX *frame = talloc_stackframe();
+	static const struct {
+		const char *name;
+		bool (*fn)(int fds[4]);
+	} channels[] = {
+		{ "tcp", bench_channel_tcp },
+		{ "unix", bench_channel_unix },
+	};
+	unsigned iterations = 10000;
+	unsigned mbytes = 256;
+	size_t c;
+	int ret = 0;
+
+	if (argc >= 2) {
+		iterations = atoi(argv[1]);
+	}
+	if (argc >= 3) {
+		mbytes = atoi(argv[2]);
+	}
+	if (iterations == 0 || mbytes == 0 || argc > 3) {
+		fprintf(stderr, "Usage: %s [ITERATIONS] [MBYTES]\n", argv[0]);
+		TALLOC_FREE(frame);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-6s %14s %12s %12s\n",
+	       "conn", "latency us/op", "write MB/s", "read MB/s");
+
+	for (c = 0; c < ARRAY_SIZE(channels); c++) {
+		struct bench_result r = { 0, };
+		bool ok;
+
+		ok = bench_run(frame, channels[c].fn,
+			       iterations, mbytes, &r);
+		if (!ok) {
+			fprintf(stderr, "%s failed\n", channels[c].name);
+			ret = 1;
+			continue;
+		}
+
+		printf("%-6s %14.2f %12.1f %12.1f\n",
+		       channels[c].name,
+		       r.latency_usecs, r.write_mbytes,
+		       r.read_mbytes);
+	}
+
+	TALLOC_FREE(frame);
+	return ret;
+}
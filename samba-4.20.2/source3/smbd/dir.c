@@ -30,6 +30,7 @@
 #include "lib/util/string_wrappers.h"
 #include "libcli/smb/reparse.h"
 #include "source3/smbd/dir.h"
+#include "lib/pthreadpool/pthreadpool_tevent.h"
 
 /*
    This module implements directory related functions for Samba.
@@ -42,6 +43,9 @@
 
 /* Make directory handle internals available. */
 
+struct smb_Dir_prefetch;
+struct smb_Dir_prefetch_result;
+
 struct smb_Dir {
 	connection_struct *conn;
 	DIR *dir;
@@ -50,6 +54,7 @@ struct smb_Dir {
 	bool case_sensitive;
 	files_struct *fsp; /* Back pointer to containing fsp, only
 			      set from OpenDir_fsp(). */
+	struct smb_Dir_prefetch *prefetch; /* See ReadDirName() */
 };
 
 struct dptr_struct {
@@ -79,6 +84,14 @@ static NTSTATUS OpenDir_fsp(
 	const char *mask,
 	uint32_t attr,
 	struct smb_Dir **_dir_hnd);
+static void smb_Dir_enable_prefetch(struct smb_Dir *dir_hnd);
+static const struct smb_Dir_prefetch_result *dptr_prefetched(
+	struct dptr_struct *dptr);
+static bool smb_Dir_prefetch_skip(connection_struct *conn,
+				  const struct smb_Dir_prefetch_result *r,
+				  bool posix);
+static void smb_Dir_prefetch_dosmode(const struct smb_Dir_prefetch_result *r,
+				     struct smb_filename *smb_fname);
 
 static int smb_Dir_destructor(struct smb_Dir *dir_hnd);
 
@@ -252,6 +265,10 @@ NTSTATUS dptr_create(connection_struct *conn,
 
 	dptr->attr = attr;
 
+	if (dptr->has_wild) {
+		smb_Dir_enable_prefetch(dir_hnd);
+	}
+
 	if (sconn->using_smb2) {
 		goto done;
 	}
@@ -553,6 +570,7 @@ bool smbd_dirptr_get_entry(TALLOC_CTX *ctx,
 		char *dname = NULL;
 		char *fname = NULL;
 		struct smb_filename *smb_fname = NULL;
+		const struct smb_Dir_prefetch_result *prefetched = NULL;
 		uint32_t mode = 0;
 		bool get_dosmode = get_dosmode_in;
 		bool toplevel_dotdot;
@@ -591,6 +609,16 @@ bool smbd_dirptr_get_entry(TALLOC_CTX *ctx,
 
 		toplevel_dotdot = toplevel && ISDOTDOT(dname);
 
+		prefetched = dptr_prefetched(dirptr);
+		if ((prefetched != NULL) &&
+		    smb_Dir_prefetch_skip(conn, prefetched, posix))
+		{
+			DBG_DEBUG("Skipping %s from the read-ahead\n", dname);
+			TALLOC_FREE(fname);
+			TALLOC_FREE(dname);
+			continue;
+		}
+
 		smb_fname = synthetic_smb_fname(talloc_tos(),
 						toplevel_dotdot ? "." : dname,
 						NULL,
@@ -692,6 +720,9 @@ bool smbd_dirptr_get_entry(TALLOC_CTX *ctx,
 
 done:
 		if (get_dosmode) {
+			if (prefetched != NULL) {
+				smb_Dir_prefetch_dosmode(prefetched, smb_fname);
+			}
 			mode = fdos_mode(smb_fname->fsp);
 			smb_fname->st = smb_fname->fsp->fsp_name->st;
 		}
@@ -1159,6 +1190,451 @@ static NTSTATUS OpenDir_fsp(
 }
 
 
+/*******************************************************************
+ Directory read-ahead.
+
+ For real directory traversals ("smbd directory prefetch" > 0) we
+ read the names in batches and let the pthreadpool lstat each batch,
+ stat the targets of symlinks and fetch the DOS attribute xattr in
+ parallel, while the main loop still works on the previous entries.
+ The names are still returned in readdir order.
+
+ The worker threads use plain syscalls on the directory fd, so
+ smbd_dirptr_get_entry() only looks at their results if the share
+ runs on vfs_default alone. It then drops vanished entries, symlinks
+ we don't follow and dangling symlinks without opening them, and
+ takes the DOS attributes from the prefetched xattr instead of
+ reading it again. With other VFS modules the read-ahead just warms
+ the kernel caches.
+********************************************************************/
+
+struct smb_Dir_prefetch_result {
+	int ready; /* Set by the worker thread, use __atomic */
+	int stat_err;
+	struct stat st;
+	int target_err;
+	int xattr_err;
+	size_t xattr_len;
+	uint8_t xattr[sizeof(fstring)];
+};
+
+struct smb_Dir_prefetch_job {
+	struct smb_Dir_prefetch_job *prev, *next;
+	bool running;
+	bool released;
+	int dir_fd;
+	bool get_dosattrib;
+	struct security_unix_token *token;
+	char **names;
+	struct smb_Dir_prefetch_result *results;
+	size_t num_names;
+	size_t next_name;
+};
+
+struct smb_Dir_prefetch {
+	size_t batch_size;
+	bool use_results;
+	struct smb_Dir_prefetch_job *jobs; /* In readdir order */
+	const struct smb_Dir_prefetch_result *current;
+	bool eof;
+};
+
+static void smb_Dir_prefetch_job_fn(void *private_data);
+static void smb_Dir_prefetch_job_done(struct tevent_req *subreq);
+static int smb_Dir_prefetch_destructor(struct smb_Dir_prefetch *prefetch);
+
+static void smb_Dir_enable_prefetch(struct smb_Dir *dir_hnd)
+{
+	connection_struct *conn = dir_hnd->conn;
+	struct smb_Dir_prefetch *prefetch = NULL;
+	int batch_size;
+
+	batch_size = lp_smbd_directory_prefetch(SNUM(conn));
+	if (batch_size <= 0) {
+		return;
+	}
+
+#ifndef HAVE_LINUX_THREAD_CREDENTIALS
+	/*
+	 * We can't stat as the user in a worker thread.
+	 */
+	return;
+#endif
+
+	if (pthreadpool_tevent_max_threads(conn->sconn->pool) == 0) {
+		/*
+		 * A sync pool would stat everything twice.
+		 */
+		return;
+	}
+
+	prefetch = talloc_zero(dir_hnd, struct smb_Dir_prefetch);
+	if (prefetch == NULL) {
+		return;
+	}
+	prefetch->batch_size = batch_size;
+
+	/*
+	 * vfs_default is always the last handle, if it's the only
+	 * one nobody remaps names, stat or xattrs.
+	 */
+	prefetch->use_results = (conn->vfs_handles != NULL) &&
+				(conn->vfs_handles->next == NULL);
+
+	talloc_set_destructor(prefetch, smb_Dir_prefetch_destructor);
+	dir_hnd->prefetch = prefetch;
+}
+
+static void smb_Dir_prefetch_release(struct smb_Dir_prefetch *prefetch,
+				     struct smb_Dir_prefetch_job *job)
+{
+	DLIST_REMOVE(prefetch->jobs, job);
+
+	if (job->running) {
+		/*
+		 * smb_Dir_prefetch_job_done() frees it
+		 */
+		job->released = true;
+		return;
+	}
+	TALLOC_FREE(job);
+}
+
+static int smb_Dir_prefetch_destructor(struct smb_Dir_prefetch *prefetch)
+{
+	while (prefetch->jobs != NULL) {
+		smb_Dir_prefetch_release(prefetch, prefetch->jobs);
+	}
+	return 0;
+}
+
+static void smb_Dir_prefetch_reset(struct smb_Dir *dir_hnd)
+{
+	struct smb_Dir_prefetch *prefetch = dir_hnd->prefetch;
+
+	if (prefetch == NULL) {
+		return;
+	}
+
+	while (prefetch->jobs != NULL) {
+		smb_Dir_prefetch_release(prefetch, prefetch->jobs);
+	}
+	prefetch->current = NULL;
+	prefetch->eof = false;
+}
+
+static void smb_Dir_prefetch_start(struct smb_Dir *dir_hnd,
+				   struct smb_Dir_prefetch_job *job)
+{
+	connection_struct *conn = dir_hnd->conn;
+	struct tevent_req *subreq = NULL;
+
+	job->get_dosattrib = lp_store_dos_attributes(SNUM(conn)) &&
+			     sys_have_proc_fds();
+
+	job->token = copy_unix_token(job, get_current_utok(conn));
+	if (job->token == NULL) {
+		return;
+	}
+
+	job->dir_fd = dup(fsp_get_io_fd(dir_hnd->fsp));
+	if (job->dir_fd == -1) {
+		return;
+	}
+
+	subreq = pthreadpool_tevent_job_send(job,
+					     conn->sconn->ev_ctx,
+					     conn->sconn->pool,
+					     smb_Dir_prefetch_job_fn,
+					     job);
+	if (subreq == NULL) {
+		close(job->dir_fd);
+		job->dir_fd = -1;
+		return;
+	}
+	tevent_req_set_callback(subreq, smb_Dir_prefetch_job_done, job);
+	job->running = true;
+}
+
+static void smb_Dir_prefetch_job_fn(void *private_data)
+{
+	struct smb_Dir_prefetch_job *job = talloc_get_type_abort(
+		private_data, struct smb_Dir_prefetch_job);
+	size_t i;
+	int ret;
+
+	/* Become the correct credential on this thread. */
+	ret = set_thread_credentials(job->token->uid,
+				     job->token->gid,
+				     (size_t)job->token->ngroups,
+				     job->token->groups);
+	if (ret != 0) {
+		return;
+	}
+
+	for (i = 0; i < job->num_names; i++) {
+		struct smb_Dir_prefetch_result *r = &job->results[i];
+
+		r->xattr_err = ENOSYS;
+
+		ret = fstatat(job->dir_fd,
+			      job->names[i],
+			      &r->st,
+			      AT_SYMLINK_NOFOLLOW);
+		if (ret == -1) {
+			r->stat_err = errno;
+			goto next;
+		}
+
+		if (S_ISLNK(r->st.st_mode)) {
+			struct stat target;
+
+			ret = fstatat(job->dir_fd, job->names[i], &target, 0);
+			if (ret == -1) {
+				r->target_err = errno;
+			}
+			goto next;
+		}
+
+		if (job->get_dosattrib) {
+			struct sys_proc_fd_path_buf buf;
+			char path[PATH_MAX];
+			ssize_t len;
+
+			/* No talloc on this thread */
+			ret = snprintf(path,
+				       sizeof(path),
+				       "%s/%s",
+				       sys_proc_fd_path(job->dir_fd, &buf),
+				       job->names[i]);
+			if (ret < 0 || (size_t)ret >= sizeof(path)) {
+				r->xattr_err = ENAMETOOLONG;
+				goto next;
+			}
+			len = getxattr(path,
+				       SAMBA_XATTR_DOS_ATTRIB,
+				       r->xattr,
+				       sizeof(r->xattr));
+			if (len == -1) {
+				r->xattr_err = errno;
+			} else {
+				r->xattr_err = 0;
+				r->xattr_len = len;
+			}
+		}
+next:
+		__atomic_store_n(&r->ready, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void smb_Dir_prefetch_job_done(struct tevent_req *subreq)
+{
+	struct smb_Dir_prefetch_job *job = tevent_req_callback_data(
+		subreq, struct smb_Dir_prefetch_job);
+
+	/*
+	 * The results are in job->results, per entry
+	 */
+	(void)pthreadpool_tevent_job_recv(subreq);
+	TALLOC_FREE(subreq);
+
+	close(job->dir_fd);
+	job->dir_fd = -1;
+	job->running = false;
+
+	if (job->released) {
+		TALLOC_FREE(job);
+	}
+}
+
+/*
+ * Make sure we always have the names of the next batch in the
+ * read-ahead queue, so they can be stat'ed in the background
+ * while we return the current batch.
+ */
+static void smb_Dir_prefetch_fill(struct smb_Dir *dir_hnd)
+{
+	struct smb_Dir_prefetch *prefetch = dir_hnd->prefetch;
+	struct smb_Dir_prefetch_job *job = NULL;
+	size_t remaining = 0;
+
+	for (job = prefetch->jobs; job != NULL; job = job->next) {
+		remaining += job->num_names - job->next_name;
+	}
+
+	if (prefetch->eof || remaining > prefetch->batch_size) {
+		return;
+	}
+
+	/*
+	 * The job can outlive the directory handle, so hang it off
+	 * the connection.
+	 */
+	job = talloc_zero(dir_hnd->conn->sconn, struct smb_Dir_prefetch_job);
+	if (job == NULL) {
+		return;
+	}
+	job->dir_fd = -1;
+
+	job->names = talloc_array(job, char *, prefetch->batch_size);
+	job->results = talloc_zero_array(job,
+					 struct smb_Dir_prefetch_result,
+					 prefetch->batch_size);
+	if ((job->names == NULL) || (job->results == NULL)) {
+		TALLOC_FREE(job);
+		return;
+	}
+
+	while (job->num_names < prefetch->batch_size) {
+		const char *n = NULL;
+		char *talloced = NULL;
+
+		n = vfs_readdirname(dir_hnd->conn,
+				    dir_hnd->fsp,
+				    dir_hnd->dir,
+				    &talloced);
+		if (n == NULL) {
+			prefetch->eof = true;
+			break;
+		}
+		/* Ignore . and .. - ReadDirName() returns them. */
+		if (ISDOT(n) || ISDOTDOT(n)) {
+			TALLOC_FREE(talloced);
+			continue;
+		}
+		if (talloced != NULL) {
+			job->names[job->num_names] =
+				talloc_move(job->names, &talloced);
+		} else {
+			job->names[job->num_names] =
+				talloc_strdup(job->names, n);
+		}
+		if (job->names[job->num_names] == NULL) {
+			break;
+		}
+		job->num_names += 1;
+	}
+
+	if (job->num_names == 0) {
+		TALLOC_FREE(job);
+		return;
+	}
+
+	DLIST_ADD_END(prefetch->jobs, job);
+	smb_Dir_prefetch_start(dir_hnd, job);
+}
+
+static const char *smb_Dir_prefetch_next(struct smb_Dir *dir_hnd,
+					 char **ptalloced)
+{
+	struct smb_Dir_prefetch *prefetch = dir_hnd->prefetch;
+	struct smb_Dir_prefetch_job *job = NULL;
+
+	prefetch->current = NULL;
+	*ptalloced = NULL;
+
+	smb_Dir_prefetch_fill(dir_hnd);
+
+	while ((job = prefetch->jobs) != NULL &&
+	       job->next_name == job->num_names) {
+		smb_Dir_prefetch_release(prefetch, job);
+	}
+	if (job == NULL) {
+		return NULL;
+	}
+
+	/*
+	 * The worker may still look at job->names, hand out a copy.
+	 */
+	*ptalloced = talloc_strdup(talloc_tos(), job->names[job->next_name]);
+	if (*ptalloced == NULL) {
+		return NULL;
+	}
+	prefetch->current = &job->results[job->next_name];
+	job->next_name += 1;
+
+	return *ptalloced;
+}
+
+/*
+ * What the worker found out about the name dptr_ReadDirName() just
+ * returned, NULL if it's not there (yet) or we can't use it.
+ */
+static const struct smb_Dir_prefetch_result *dptr_prefetched(
+	struct dptr_struct *dptr)
+{
+	struct smb_Dir_prefetch *prefetch = dptr->dir_hnd->prefetch;
+	int ready;
+
+	if (!dptr->has_wild || (prefetch == NULL) || !prefetch->use_results ||
+	    (prefetch->current == NULL)) {
+		return NULL;
+	}
+
+	ready = __atomic_load_n(&prefetch->current->ready, __ATOMIC_ACQUIRE);
+	if (ready == 0) {
+		return NULL;
+	}
+	return prefetch->current;
+}
+
+/*
+ * Entries smbd_dirptr_get_entry() would drop anyway after opening
+ * them: vanished ones, symlinks we don't follow and dangling symlinks.
+ */
+static bool smb_Dir_prefetch_skip(connection_struct *conn,
+				  const struct smb_Dir_prefetch_result *r,
+				  bool posix)
+{
+	if (r->stat_err == ENOENT) {
+		return true;
+	}
+	if ((r->stat_err != 0) || !S_ISLNK(r->st.st_mode) || posix) {
+		return false;
+	}
+	if (lp_host_msdfs() && lp_msdfs_root(SNUM(conn))) {
+		/*
+		 * Might be an msdfs link.
+		 */
+		return false;
+	}
+	if (!lp_follow_symlinks(SNUM(conn))) {
+		return true;
+	}
+	return (r->target_err == ENOENT) || (r->target_err == ELOOP);
+}
+
+static void smb_Dir_prefetch_dosmode(const struct smb_Dir_prefetch_result *r,
+				     struct smb_filename *smb_fname)
+{
+	struct files_struct *fsp = smb_fname->fsp;
+	struct stat_ex st;
+	DATA_BLOB blob;
+
+	if ((r->stat_err != 0) || (fsp == NULL) ||
+	    lp_dmapi_support(SNUM(fsp->conn))) {
+		return;
+	}
+	if ((r->xattr_err != 0) && (r->xattr_err != ENOATTR)) {
+		return;
+	}
+
+	/*
+	 * Only if it's still the same inode and nobody touched the
+	 * xattr since (that changes the ctime).
+	 */
+	init_stat_ex_from_stat(&st, &r->st, false);
+	if ((st.st_ex_dev != fsp->fsp_name->st.st_ex_dev) ||
+	    (st.st_ex_ino != fsp->fsp_name->st.st_ex_ino) ||
+	    (timespec_compare(&st.st_ex_ctime,
+			      &fsp->fsp_name->st.st_ex_ctime) != 0)) {
+		return;
+	}
+
+	blob = data_blob_const(r->xattr, r->xattr_len);
+	fdos_mode_from_blob(fsp, (r->xattr_err == 0) ? &blob : NULL);
+}
+
 /*******************************************************************
  Read from a directory.
  Return directory entry, current offset, and optional stat information.
@@ -1182,6 +1658,14 @@ const char *ReadDirName(struct smb_Dir *dir_hnd, char **ptalloced)
 		return n;
 	}
 
+	if (dir_hnd->prefetch != NULL) {
+		n = smb_Dir_prefetch_next(dir_hnd, ptalloced);
+		if (n != NULL) {
+			dir_hnd->file_number++;
+		}
+		return n;
+	}
+
 	while ((n = vfs_readdirname(conn,
 				    dir_hnd->fsp,
 				    dir_hnd->dir,
@@ -1206,6 +1690,7 @@ const char *ReadDirName(struct smb_Dir *dir_hnd, char **ptalloced)
 void RewindDir(struct smb_Dir *dir_hnd)
 {
 	SMB_VFS_REWINDDIR(dir_hnd->conn, dir_hnd->dir);
+	smb_Dir_prefetch_reset(dir_hnd);
 	dir_hnd->file_number = 0;
 }
 
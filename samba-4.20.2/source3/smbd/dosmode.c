@@ -723,6 +723,37 @@ uint32_t fdos_mode(struct files_struct *fsp)
 	return fsp->fsp_name->st.cached_dos_attributes;
 }
 
+/****************************************************************************
+ Fill the DOS attribute cache of a pathref fsp from a DOS attribute
+ xattr blob that was read ahead, the next fdos_mode() won't fetch it
+ again. A NULL blob means the file has no DOS attribute xattr. Only
+ valid when SMB_VFS_FGET_DOS_ATTRIBUTES() ends up in vfs_default.
+****************************************************************************/
+
+void fdos_mode_from_blob(struct files_struct *fsp, const DATA_BLOB *blob)
+{
+	uint32_t dosmode = 0;
+	NTSTATUS status;
+
+	if (!VALID_STAT(fsp->fsp_name->st) ||
+	    S_ISLNK(fsp->fsp_name->st.st_ex_mode)) {
+		return;
+	}
+
+	if (blob != NULL) {
+		status = parse_dos_attribute_blob(fsp->fsp_name,
+						  *blob,
+						  &dosmode);
+		if (!NT_STATUS_IS_OK(status)) {
+			return;
+		}
+	}
+
+	fsp->fsp_name->st.cached_dos_attributes = dos_mode_post(dosmode,
+								fsp,
+								__func__);
+}
+
 struct dos_mode_at_state {
 	files_struct *dir_fsp;
 	struct smb_filename *smb_fname;
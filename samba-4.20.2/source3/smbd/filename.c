@@ -31,6 +31,7 @@
 #include "smbd/globals.h"
 #include "libcli/smb/reparse.h"
 #include "source3/smbd/dir.h"
+#include "../librpc/gen_ndr/ndr_notify.h"
 
 uint32_t ucf_flags_from_smb_request(struct smb_request *req)
 {
@@ -262,6 +263,520 @@ static bool sname_equal(const char *name1, const char *name2,
 	return match;
 }
 
+/****************************************************************************
+ Per-process index of the names of recently scanned directories.
+
+ For case insensitive lookups that miss, get_real_filename_full_scan_at()
+ has to read the whole directory. Creating many files in one directory
+ (build trees, unpacking archives) therefore costs O(n) per create.
+
+ With "smbd name index cache" enabled a full scan collects all names of
+ the directory into a sorted array of case-folded names, so further
+ lookups in the same directory (including misses) are a binary search.
+
+ An index is identified by the file_id of the directory. Misses are
+ only as good as our knowledge of changes by others, so an index only
+ exists while a notify watch with notifyd covers the directory. Without
+ notifyd we always scan. Changes by other processes arrive through the
+ watch and drop the index, see name_index_notify_event().
+
+ Changes done by this smbd are reported to us via notify_fname(), see
+ name_index_notify(), and are applied to the index directly. The
+ directory timestamps are a second line of defence: The index is
+ dropped if they change without a change of our own since we last
+ looked.
+****************************************************************************/
+
+#define NAME_INDEX_MAX_DIRS 16
+
+struct name_index_entry {
+	char *upper;
+	char *name;
+	size_t seq;
+};
+
+struct name_index {
+	struct name_index *prev, *next;
+	struct file_id id;
+	struct timespec mtime;
+	struct timespec ctime;
+	char *connectpath;
+	char *dirpath;
+	struct notify_context *notify_ctx;
+	char *notify_path;
+	bool change_expected;
+	bool has_case_dups;
+	size_t num_entries;
+	struct name_index_entry *entries;
+};
+
+static struct name_index *name_indexes;
+static size_t num_name_indexes;
+
+static int name_index_entry_cmp(const struct name_index_entry *e1,
+				const struct name_index_entry *e2)
+{
+	int cmp = strcmp(e1->upper, e2->upper);
+
+	if (cmp != 0) {
+		return cmp;
+	}
+	/* Keep readdir order for names only differing in case */
+	return NUMERIC_CMP(e1->seq, e2->seq);
+}
+
+/*
+ * Return the index of the first entry >= upper
+ */
+static size_t name_index_find(const struct name_index *idx,
+			      const char *upper)
+{
+	size_t b = 0;
+	size_t e = idx->num_entries;
+
+	while (b < e) {
+		size_t i = b + (e - b) / 2;
+
+		if (strcmp(idx->entries[i].upper, upper) < 0) {
+			b = i + 1;
+		} else {
+			e = i;
+		}
+	}
+	return b;
+}
+
+static void name_index_free(struct name_index *idx)
+{
+	DLIST_REMOVE(name_indexes, idx);
+	num_name_indexes -= 1;
+	TALLOC_FREE(idx);
+}
+
+static bool name_index_enabled(struct connection_struct *conn)
+{
+	return lp_smbd_name_index_cache(SNUM(conn)) && !conn->case_sensitive;
+}
+
+static struct name_index *name_index_get(struct files_struct *dirfsp)
+{
+	const struct stat_ex *st = &dirfsp->fsp_name->st;
+	struct file_id id;
+	struct name_index *idx = NULL;
+
+	if (!VALID_STAT(*st)) {
+		return NULL;
+	}
+	id = vfs_file_id_from_sbuf(dirfsp->conn, st);
+
+	for (idx = name_indexes; idx != NULL; idx = idx->next) {
+		if (file_id_equal(&idx->id, &id)) {
+			break;
+		}
+	}
+	if (idx == NULL) {
+		return NULL;
+	}
+
+	if ((timespec_compare(&idx->mtime, &st->st_ex_mtime) != 0) ||
+	    (timespec_compare(&idx->ctime, &st->st_ex_ctime) != 0))
+	{
+		if (!idx->change_expected) {
+			DBG_DEBUG("Directory [%s] changed, dropping index\n",
+				  fsp_str_dbg(dirfsp));
+			name_index_free(idx);
+			return NULL;
+		}
+		/*
+		 * We changed it ourselves, changes by others
+		 * mixed in are reported by the notify watch.
+		 */
+		idx->mtime = st->st_ex_mtime;
+		idx->ctime = st->st_ex_ctime;
+		idx->change_expected = false;
+	}
+
+	DLIST_PROMOTE(name_indexes, idx);
+	return idx;
+}
+
+static NTSTATUS name_index_lookup(struct name_index *idx,
+				  const char *name,
+				  TALLOC_CTX *mem_ctx,
+				  char **found_name)
+{
+	char *upper = NULL;
+	size_t i;
+
+	upper = talloc_strdup_upper(talloc_tos(), name);
+	if (upper == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+	i = name_index_find(idx, upper);
+	if ((i == idx->num_entries) ||
+	    (strcmp(idx->entries[i].upper, upper) != 0))
+	{
+		TALLOC_FREE(upper);
+		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+	TALLOC_FREE(upper);
+
+	*found_name = talloc_strdup(mem_ctx, idx->entries[i].name);
+	if (*found_name == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+	return NT_STATUS_OK;
+}
+
+static int name_index_destructor(struct name_index *idx)
+{
+	if (idx->notify_path != NULL) {
+		notify_remove(idx->notify_ctx, idx, idx->notify_path);
+	}
+	return 0;
+}
+
+static struct name_index *name_index_create(struct files_struct *dirfsp)
+{
+	struct connection_struct *conn = dirfsp->conn;
+	struct name_index *idx = NULL;
+	NTSTATUS status;
+
+	if (!VALID_STAT(dirfsp->fsp_name->st)) {
+		return NULL;
+	}
+	if (conn->sconn->notify_ctx == NULL) {
+		/* Nobody tells us about changes by others */
+		return NULL;
+	}
+
+	idx = talloc_zero(NULL, struct name_index);
+	if (idx == NULL) {
+		return NULL;
+	}
+	idx->id = vfs_file_id_from_sbuf(conn, &dirfsp->fsp_name->st);
+	idx->mtime = dirfsp->fsp_name->st.st_ex_mtime;
+	idx->ctime = dirfsp->fsp_name->st.st_ex_ctime;
+
+	idx->connectpath = talloc_strdup(idx, conn->connectpath);
+	idx->dirpath = talloc_strdup(idx, dirfsp->fsp_name->base_name);
+	if ((idx->connectpath == NULL) || (idx->dirpath == NULL)) {
+		TALLOC_FREE(idx);
+		return NULL;
+	}
+
+	/*
+	 * Have notifyd tell us about changes by others, including
+	 * the ones it gets from the kernel. Registered before the
+	 * scan, so nothing in between is missed.
+	 */
+	idx->notify_ctx = conn->sconn->notify_ctx;
+	if (ISDOT(idx->dirpath)) {
+		idx->notify_path = talloc_strdup(idx, idx->connectpath);
+	} else {
+		idx->notify_path = talloc_asprintf(idx,
+						   "%s/%s",
+						   idx->connectpath,
+						   idx->dirpath);
+	}
+	if (idx->notify_path == NULL) {
+		TALLOC_FREE(idx);
+		return NULL;
+	}
+	status = notify_add(idx->notify_ctx,
+			    idx->notify_path,
+			    FILE_NOTIFY_CHANGE_NAME,
+			    0,
+			    idx);
+	if (!NT_STATUS_IS_OK(status)) {
+		DBG_DEBUG("notify_add for [%s] failed: %s\n",
+			  idx->notify_path,
+			  nt_errstr(status));
+		TALLOC_FREE(idx);
+		return NULL;
+	}
+	talloc_set_destructor(idx, name_index_destructor);
+
+	return idx;
+}
+
+static bool name_index_add_scanned(struct name_index *idx, const char *name)
+{
+	struct name_index_entry *entries = NULL;
+	struct name_index_entry *e = NULL;
+	size_t num = talloc_array_length(idx->entries);
+
+	if (idx->num_entries == num) {
+		num = MAX(num * 2, 64);
+		entries = talloc_realloc(idx,
+					 idx->entries,
+					 struct name_index_entry,
+					 num);
+		if (entries == NULL) {
+			return false;
+		}
+		idx->entries = entries;
+	}
+
+	e = &idx->entries[idx->num_entries];
+	*e = (struct name_index_entry) {
+		.seq = idx->num_entries,
+	};
+	e->name = talloc_strdup(idx->entries, name);
+	if (e->name == NULL) {
+		return false;
+	}
+	e->upper = talloc_strdup_upper(idx->entries, name);
+	if (e->upper == NULL) {
+		TALLOC_FREE(e->name);
+		return false;
+	}
+	idx->num_entries += 1;
+	return true;
+}
+
+static void name_index_finish(struct name_index *idx)
+{
+	size_t i, j;
+
+	TYPESAFE_QSORT(idx->entries, idx->num_entries, name_index_entry_cmp);
+
+	/*
+	 * Only keep the first name in readdir order for names only
+	 * differing in case, that's what the full scan would return.
+	 */
+	for (i = 0, j = 0; i < idx->num_entries; i++) {
+		if ((j > 0) &&
+		    (strcmp(idx->entries[j-1].upper,
+			    idx->entries[i].upper) == 0))
+		{
+			idx->has_case_dups = true;
+			TALLOC_FREE(idx->entries[i].name);
+			TALLOC_FREE(idx->entries[i].upper);
+			continue;
+		}
+		idx->entries[j++] = idx->entries[i];
+	}
+	idx->num_entries = j;
+
+	if (num_name_indexes == NAME_INDEX_MAX_DIRS) {
+		name_index_free(DLIST_TAIL(name_indexes));
+	}
+	DLIST_ADD(name_indexes, idx);
+	num_name_indexes += 1;
+}
+
+static void name_index_insert(struct name_index *idx, const char *name)
+{
+	struct name_index_entry *entries = NULL;
+	char *upper = NULL;
+	size_t i;
+
+	upper = talloc_strdup_upper(idx, name);
+	if (upper == NULL) {
+		goto fail;
+	}
+	i = name_index_find(idx, upper);
+	if ((i < idx->num_entries) &&
+	    (strcmp(idx->entries[i].upper, upper) == 0))
+	{
+		/* The existing name wins, as in a full scan */
+		idx->has_case_dups |= (strcmp(idx->entries[i].name, name) != 0);
+		TALLOC_FREE(upper);
+		return;
+	}
+
+	if (idx->num_entries == talloc_array_length(idx->entries)) {
+		entries = talloc_realloc(idx,
+					 idx->entries,
+					 struct name_index_entry,
+					 MAX(idx->num_entries * 2, 64));
+		if (entries == NULL) {
+			goto fail;
+		}
+		idx->entries = entries;
+	}
+
+	memmove(&idx->entries[i+1],
+		&idx->entries[i],
+		(idx->num_entries - i) * sizeof(struct name_index_entry));
+	idx->entries[i] = (struct name_index_entry) {
+		.upper = talloc_move(idx->entries, &upper),
+		.name = talloc_strdup(idx->entries, name),
+	};
+	idx->num_entries += 1;
+	if (idx->entries[i].name == NULL) {
+		goto fail;
+	}
+	return;
+
+fail:
+	TALLOC_FREE(upper);
+	name_index_free(idx);
+}
+
+static void name_index_remove(struct name_index *idx, const char *name)
+{
+	char *upper = NULL;
+	size_t i;
+
+	if (idx->has_case_dups) {
+		/*
+		 * Another name might now be the one a
+		 * full scan finds, start over.
+		 */
+		name_index_free(idx);
+		return;
+	}
+
+	upper = talloc_strdup_upper(talloc_tos(), name);
+	if (upper == NULL) {
+		name_index_free(idx);
+		return;
+	}
+	i = name_index_find(idx, upper);
+	TALLOC_FREE(upper);
+
+	if ((i == idx->num_entries) ||
+	    (strcmp(idx->entries[i].name, name) != 0))
+	{
+		return;
+	}
+
+	TALLOC_FREE(idx->entries[i].upper);
+	TALLOC_FREE(idx->entries[i].name);
+	memmove(&idx->entries[i],
+		&idx->entries[i+1],
+		(idx->num_entries - i - 1) * sizeof(struct name_index_entry));
+	idx->num_entries -= 1;
+}
+
+/*
+ * Called from notify_fname() for every change done by this smbd,
+ * path is relative to the share root.
+ */
+void name_index_notify(connection_struct *conn,
+		       uint32_t action,
+		       const char *path)
+{
+	struct name_index *idx = NULL;
+	const char *dirpath = ".";
+	size_t dirlen = 1;
+	const char *name = path;
+	const char *p = NULL;
+
+	if (name_indexes == NULL) {
+		return;
+	}
+
+	switch (action) {
+	case NOTIFY_ACTION_ADDED:
+	case NOTIFY_ACTION_REMOVED:
+	case NOTIFY_ACTION_OLD_NAME:
+	case NOTIFY_ACTION_NEW_NAME:
+		break;
+	default:
+		return;
+	}
+
+	p = strrchr_m(path, '/');
+	if (p != NULL) {
+		dirpath = path;
+		dirlen = p - path;
+		name = p + 1;
+	}
+
+	for (idx = name_indexes; idx != NULL; idx = idx->next) {
+		if ((strlen(idx->dirpath) == dirlen) &&
+		    (strncmp(idx->dirpath, dirpath, dirlen) == 0) &&
+		    (strcmp(idx->connectpath, conn->connectpath) == 0))
+		{
+			break;
+		}
+	}
+	if (idx == NULL) {
+		return;
+	}
+
+	idx->change_expected = true;
+
+	if ((action == NOTIFY_ACTION_ADDED) ||
+	    (action == NOTIFY_ACTION_NEW_NAME))
+	{
+		name_index_insert(idx, name);
+	} else {
+		name_index_remove(idx, name);
+	}
+}
+
+/*
+ * Called from notify_callback(), returns true if private_data is one
+ * of our watches. notifyd also reports our own changes, those are
+ * already in the index. Anything else drops it.
+ */
+bool name_index_notify_event(void *private_data, const struct notify_event *e)
+{
+	struct name_index *idx = NULL;
+	char *upper = NULL;
+	bool found = false;
+	size_t i;
+
+	for (idx = name_indexes; idx != NULL; idx = idx->next) {
+		if (idx == private_data) {
+			break;
+		}
+	}
+	if (idx == NULL) {
+		return false;
+	}
+
+	switch (e->action) {
+	case NOTIFY_ACTION_ADDED:
+	case NOTIFY_ACTION_REMOVED:
+	case NOTIFY_ACTION_OLD_NAME:
+	case NOTIFY_ACTION_NEW_NAME:
+		break;
+	default:
+		/* Not our filter, don't take chances */
+		name_index_free(idx);
+		return true;
+	}
+
+	if (strchr(e->path, '/') != NULL) {
+		name_index_free(idx);
+		return true;
+	}
+
+	upper = talloc_strdup_upper(talloc_tos(), e->path);
+	if (upper == NULL) {
+		name_index_free(idx);
+		return true;
+	}
+	i = name_index_find(idx, upper);
+	TALLOC_FREE(upper);
+
+	found = ((i < idx->num_entries) &&
+		 (strcmp(idx->entries[i].name, e->path) == 0));
+
+	if ((e->action == NOTIFY_ACTION_ADDED) ||
+	    (e->action == NOTIFY_ACTION_NEW_NAME))
+	{
+		if (found) {
+			return true;
+		}
+	} else {
+		if (!found && !idx->has_case_dups) {
+			return true;
+		}
+	}
+
+	DBG_DEBUG("Change of [%s] in [%s] by someone else, dropping index\n",
+		  e->path,
+		  idx->dirpath);
+	name_index_free(idx);
+	return true;
+}
+
 /****************************************************************************
  Scan a directory to find a filename, matching without case sensitivity.
  If the name looks like a mangled name then try via the mangling functions
@@ -275,6 +790,7 @@ NTSTATUS get_real_filename_full_scan_at(struct files_struct *dirfsp,
 {
 	struct connection_struct *conn = dirfsp->conn;
 	struct smb_Dir *cur_dir = NULL;
+	struct name_index *idx = NULL;
 	const char *dname = NULL;
 	char *talloced = NULL;
 	char *unmangled_name = NULL;
@@ -313,6 +829,22 @@ NTSTATUS get_real_filename_full_scan_at(struct files_struct *dirfsp,
 		}
 	}
 
+	if (!mangled && name_index_enabled(conn)) {
+		idx = name_index_get(dirfsp);
+		if (idx != NULL) {
+			status = name_index_lookup(idx,
+						   name,
+						   mem_ctx,
+						   found_name);
+			TALLOC_FREE(unmangled_name);
+			return status;
+		}
+		/*
+		 * Collect all names while scanning
+		 */
+		idx = name_index_create(dirfsp);
+	}
+
 	/* open the directory */
 	status = OpenDir_from_pathref(talloc_tos(), dirfsp, NULL, 0, &cur_dir);
 	if (!NT_STATUS_IS_OK(status)) {
@@ -320,6 +852,7 @@ NTSTATUS get_real_filename_full_scan_at(struct files_struct *dirfsp,
 			   fsp_str_dbg(dirfsp),
 			   nt_errstr(status));
 		TALLOC_FREE(unmangled_name);
+		TALLOC_FREE(idx);
 		return status;
 	}
 
@@ -332,6 +865,19 @@ NTSTATUS get_real_filename_full_scan_at(struct files_struct *dirfsp,
 			continue;
 		}
 
+		if (idx != NULL) {
+			bool ok = name_index_add_scanned(idx, dname);
+			TALLOC_FREE(talloced);
+			if (!ok) {
+				/*
+				 * Fall back to a plain scan
+				 */
+				TALLOC_FREE(idx);
+				RewindDir(cur_dir);
+			}
+			continue;
+		}
+
 		/*
 		 * At this point dname is the unmangled name.
 		 * name is either mangled or not, depending on the state
@@ -361,6 +907,12 @@ NTSTATUS get_real_filename_full_scan_at(struct files_struct *dirfsp,
 
 	TALLOC_FREE(unmangled_name);
 	TALLOC_FREE(cur_dir);
+
+	if (idx != NULL) {
+		name_index_finish(idx);
+		return name_index_lookup(idx, name, mem_ctx, found_name);
+	}
+
 	return NT_STATUS_OBJECT_NAME_NOT_FOUND;
 }
 
@@ -82,16 +82,28 @@ struct smbXsrv_client *global_smbXsrv_client = NULL;
 struct memcache *smbd_memcache(void)
 {
 	if (!smbd_memcache_ctx) {
+		size_t max_size = lp_max_stat_cache_size()*1024;
+
 		/*
 		 * Note we MUST use the NULL context here, not the
 		 * autofree context, to avoid side effects in forked
 		 * children exiting.
 		 */
-		smbd_memcache_ctx = memcache_init(NULL,
-						  lp_max_stat_cache_size()*1024);
-	}
-	if (!smbd_memcache_ctx) {
-		smb_panic("Could not init smbd memcache");
+		smbd_memcache_ctx = memcache_init(NULL, max_size);
+		if (smbd_memcache_ctx == NULL) {
+			smb_panic("Could not init smbd memcache");
+		}
+
+		/*
+		 * Directory scans fill the name caches quickly, don't
+		 * let them push out the share mode and passwd entries.
+		 */
+		memcache_set_limit(smbd_memcache_ctx,
+				   GETREALFILENAME_CACHE,
+				   max_size / 4);
+		memcache_set_limit(smbd_memcache_ctx,
+				   MANGLE_HASH2_CACHE,
+				   max_size / 4);
 	}
 
 	return smbd_memcache_ctx;
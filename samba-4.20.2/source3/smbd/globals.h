@@ -346,6 +346,12 @@ struct smbXsrv_connection {
 		int sock;
 		struct tevent_fd *fde;
 
+		/*
+		 * How SMB2 PDUs are read from and written to
+		 * sock, see smbd_smb2_transport_create().
+		 */
+		struct smbd_smb2_transport *io;
+
 		struct {
 			bool got_session;
 		} nbt;
@@ -435,16 +441,32 @@ struct smbXsrv_connection {
 			struct iovec _vector[1];
 			struct iovec *vector;
 			int count;
-			struct msghdr msg;
 			bool doing_receivefile;
 			size_t min_recv_size;
 			size_t pktfull;
 			size_t pktlen;
 			uint8_t *pktbuf;
 		} request_read_state;
+
+		/*
+		 * Requests read completely, waiting for a channel
+		 * worker thread to decrypt them or for one in
+		 * front of them. They are dispatched in order,
+		 * see smbd_smb2_request_queue_incoming().
+		 */
+		struct smbd_smb2_incoming *incoming_queue;
+		size_t incoming_queue_len;
+
 		struct smbd_smb2_send_queue *send_queue;
 		size_t send_queue_len;
 
+		/*
+		 * Worker threads of this channel, used for the
+		 * crypto of large PDUs off the main event loop,
+		 * see "smb2 channel worker threads".
+		 */
+		struct pthreadpool_tevent *channel_pool;
+
 		struct {
 			/*
 			 * seq_low is the lowest sequence number
@@ -511,8 +533,17 @@ struct smbXsrv_connection {
 			uint16_t sign_algo;
 			uint16_t cipher;
 			bool posix_extensions_negotiated;
+			uint16_t compression_algos[3];
+			uint8_t num_compression_algos;
+			bool compression_chained;
 		} server;
 
+		/*
+		 * Only set if SMB2_COMPRESSION_CAPABILITIES
+		 * were negotiated, see "smb2 compression".
+		 */
+		struct smb2_compression_ctx *compression;
+
 		struct smbXsrv_preauth preauth;
 
 		struct smbd_smb2_request *requests;
@@ -658,6 +689,19 @@ bool smbXsrv_set_crypto_flag(uint8_t *flags, uint8_t flag);
 bool smbXsrv_is_signed(uint8_t signing_flags);
 bool smbXsrv_is_partially_signed(uint8_t signing_flags);
 
+/*
+ * A request in xconn->smb2.incoming_queue
+ */
+struct smbd_smb2_incoming {
+	struct smbd_smb2_incoming *prev, *next;
+
+	struct smbd_smb2_request *req;
+	bool queued;
+	bool tf_decrypted;
+	uint8_t *pktbuf;
+	size_t pktlen;
+};
+
 struct smbd_smb2_send_queue {
 	struct smbd_smb2_send_queue *prev, *next;
 
@@ -665,10 +709,16 @@ struct smbd_smb2_send_queue {
 	uint32_t sendfile_body_size;
 	NTSTATUS *sendfile_status;
 
-	struct msghdr msg;
 	struct iovec *vector;
 	int count;
 
+	/*
+	 * A channel worker thread is still signing,
+	 * encrypting or decrypting the request, don't
+	 * send it yet.
+	 */
+	bool crypto_pending;
+
 	struct {
 		struct tevent_req *req;
 		struct timeval timeout;
@@ -745,6 +795,14 @@ struct smbd_smb2_request {
 	 */
 	struct tevent_req *subreq;
 
+	/*
+	 * Signing, encryption or decryption running in a
+	 * channel worker thread, see queue_entry.crypto_pending.
+	 */
+	struct smbd_smb2_crypto_job *crypto_job;
+
+	struct smbd_smb2_incoming incoming;
+
 #define SMBD_SMB2_TF_IOV_OFS 0
 #define SMBD_SMB2_HDR_IOV_OFS 1
 #define SMBD_SMB2_BODY_IOV_OFS 2
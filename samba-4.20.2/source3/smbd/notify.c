@@ -279,6 +279,10 @@ void notify_callback(struct smbd_server_connection *sconn,
 	struct notify_fsp_state state = {
 		.notified_fsp = private_data, .when = when, .e = e
 	};
+
+	if (name_index_notify_event(private_data, e)) {
+		return;
+	}
 	files_forall(sconn, notify_fsp_cb, &state);
 }
 
@@ -597,6 +601,8 @@ void notify_fname(connection_struct *conn, uint32_t action, uint32_t filter,
 		path += 2;
 	}
 
+	name_index_notify(conn, action, path);
+
 	notify_trigger(notify_ctx, action, filter, conn->connectpath, path);
 }
 
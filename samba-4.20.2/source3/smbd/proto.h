@@ -198,6 +198,7 @@ uint32_t dos_mode_msdfs(connection_struct *conn,
 			const char *name,
 			const struct stat_ex *st);
 uint32_t fdos_mode(struct files_struct *fsp);
+void fdos_mode_from_blob(struct files_struct *fsp, const DATA_BLOB *blob);
 struct tevent_req *dos_mode_at_send(TALLOC_CTX *mem_ctx,
 				    struct tevent_context *ev,
 				    files_struct *dir_fsp,
@@ -287,6 +288,10 @@ uint32_t filename_create_ucf_flags(struct smb_request *req, uint32_t create_disp
 NTSTATUS canonicalize_snapshot_path(struct smb_filename *smb_fname,
 				    uint32_t ucf_flags,
 				    NTTIME twrp);
+void name_index_notify(connection_struct *conn,
+		       uint32_t action,
+		       const char *path);
+bool name_index_notify_event(void *private_data, const struct notify_event *e);
 NTSTATUS get_real_filename_full_scan_at(struct files_struct *dirfsp,
 					const char *name,
 					bool mangled,
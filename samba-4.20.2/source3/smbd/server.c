@@ -58,6 +58,7 @@
 #include "g_lock.h"
 #include "lib/global_contexts.h"
 #include "source3/lib/substitute.h"
+#include "dbwrap/dbwrap_tdb.h"
 
 #ifdef CLUSTER_SUPPORT
 #include "ctdb_protocol.h"
@@ -83,8 +84,12 @@ struct smbd_parent_context {
 	struct server_id notifyd;
 
 	struct tevent_timer *cleanup_te;
+	struct tevent_timer *rehash_te;
 };
 
+/* seconds between looking for TDB_REHASH databases that need to grow */
+#define SMBD_PARENT_REHASH_INTERVAL 10
+
 struct smbd_open_socket {
 	struct smbd_open_socket *prev, *next;
 	struct smbd_parent_context *parent;
@@ -1355,6 +1360,34 @@ static void smbd_parent_tevent_trace_callback(enum tevent_trace_point point,
 	errno = 0;
 }
 
+/*
+ * Growing a hash table copies the whole database and holds off all
+ * writers meanwhile. The children only note that a table is too small,
+ * the parent, which has no client waiting on it, does the copy.
+ */
+static void smbd_parent_rehash(struct tevent_context *ev,
+			       struct tevent_timer *te,
+			       struct timeval now,
+			       void *private_data)
+{
+	struct smbd_parent_context *parent = talloc_get_type_abort(
+		private_data, struct smbd_parent_context);
+
+	parent->rehash_te = NULL;
+
+	(void)dbwrap_tdb_rehash_if_wanted();
+
+	parent->rehash_te = tevent_add_timer(
+		ev,
+		parent,
+		timeval_current_ofs(SMBD_PARENT_REHASH_INTERVAL, 0),
+		smbd_parent_rehash,
+		parent);
+	if (parent->rehash_te == NULL) {
+		DBG_ERR("tevent_add_timer failed\n");
+	}
+}
+
 static void smbd_parent_loop(struct tevent_context *ev_ctx,
 			     struct smbd_parent_context *parent)
 {
@@ -2028,6 +2061,16 @@ extern void build_options(bool screen);
 		exit_daemon("Samba cannot init global open", map_errno_from_nt_status(status));
 	}
 
+	parent->rehash_te = tevent_add_timer(
+		ev_ctx,
+		parent,
+		timeval_current_ofs(SMBD_PARENT_REHASH_INTERVAL, 0),
+		smbd_parent_rehash,
+		parent);
+	if (parent->rehash_te == NULL) {
+		exit_daemon("Samba cannot add rehash timer", ENOMEM);
+	}
+
 	if (lp_clustering() && !lp_allow_unsafe_cluster_upgrade()) {
 		status = smbd_claim_version(msg_ctx, samba_version_string());
 		if (!NT_STATUS_IS_OK(status)) {
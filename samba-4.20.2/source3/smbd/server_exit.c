@@ -257,6 +257,10 @@ NTSTATUS smbd_reinit_after_fork(struct messaging_context *msg_ctx,
 	NTSTATUS ret;
 	am_parent = NULL;
 	ret = reinit_after_fork(msg_ctx, ev_ctx, parent_longlived);
+	if (NT_STATUS_IS_OK(ret) && !locking_reinit_after_fork()) {
+		DBG_ERR("locking_reinit_after_fork failed\n");
+		ret = NT_STATUS_OPEN_FAILED;
+	}
 	initialize_password_db(true, ev_ctx);
 	return ret;
 }
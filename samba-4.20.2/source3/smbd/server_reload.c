@@ -30,6 +30,7 @@
 #include "printing/load.h"
 #include "auth.h"
 #include "messages.h"
+#include "lib/messaging/messages_dgm.h"
 #include "lib/param/loadparm.h"
 
 /*
@@ -161,6 +162,9 @@ bool reload_services(struct smbd_server_connection *sconn,
 
 	load_interfaces();
 
+	messaging_dgm_set_coalesce(lp_messaging_coalesce());
+	messaging_dgm_set_shm_ring_size(lp_messaging_shm_ring_size());
+
 	if (sconn != NULL && sconn->client != NULL) {
 		xconn = sconn->client->connections;
 	}
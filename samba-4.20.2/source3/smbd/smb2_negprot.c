@@ -23,6 +23,7 @@
 #include "smbd/globals.h"
 #include "../libcli/smb/smb_common.h"
 #include "../libcli/smb/smb2_negotiate_context.h"
+#include "../libcli/smb/smb2_compression.h"
 #include "../lib/tsocket/tsocket.h"
 #include "../librpc/ndr/libndr.h"
 #include "../libcli/smb/smb_signing.h"
@@ -217,6 +218,7 @@ NTSTATUS smbd_smb2_request_process_negprot(struct smbd_smb2_request *req)
 	struct smb2_negotiate_context *in_preauth = NULL;
 	struct smb2_negotiate_context *in_cipher = NULL;
 	struct smb2_negotiate_context *in_sign_algo = NULL;
+	struct smb2_negotiate_context *in_compression = NULL;
 	struct smb2_negotiate_contexts out_c = { .num_contexts = 0, };
 	const struct smb311_capabilities default_smb3_capabilities =
 		smb311_capabilities_parse("server",
@@ -379,6 +381,8 @@ NTSTATUS smbd_smb2_request_process_negprot(struct smbd_smb2_request *req)
 					SMB2_ENCRYPTION_CAPABILITIES);
 	in_sign_algo = smb2_negotiate_context_find(&in_c,
 					SMB2_SIGNING_CAPABILITIES);
+	in_compression = smb2_negotiate_context_find(&in_c,
+					SMB2_COMPRESSION_CAPABILITIES);
 
 	/* negprot_spnego() returns the server guid in the first 16 bytes */
 	negprot_spnego_blob = negprot_spnego(req, xconn);
@@ -680,6 +684,113 @@ NTSTATUS smbd_smb2_request_process_negprot(struct smbd_smb2_request *req)
 		}
 	}
 
+	if (in_compression != NULL && lp_smb2_compression()) {
+		size_t needed = 8;
+		uint16_t algo_count;
+		uint32_t flags;
+		const uint8_t *p;
+		uint8_t buf[8 + ARRAY_SIZE(xconn->smb2.server.compression_algos) * 2];
+		uint16_t num_algos;
+		bool chained;
+		size_t i;
+
+		if (in_compression->data.length < needed) {
+			return smbd_smb2_request_error(req,
+					NT_STATUS_INVALID_PARAMETER);
+		}
+
+		algo_count = SVAL(in_compression->data.data, 0);
+		flags = IVAL(in_compression->data.data, 4);
+		if (algo_count == 0) {
+			return smbd_smb2_request_error(req,
+					NT_STATUS_INVALID_PARAMETER);
+		}
+
+		p = in_compression->data.data + needed;
+		needed += algo_count * 2;
+
+		if (in_compression->data.length < needed) {
+			return smbd_smb2_request_error(req,
+					NT_STATUS_INVALID_PARAMETER);
+		}
+
+		chained = (flags & SMB2_COMPRESSION_CAPABILITIES_FLAG_CHAINED);
+
+		/*
+		 * Keep the algorithms we support in the order
+		 * the client prefers them, Pattern_V1 only
+		 * makes sense with chained compression.
+		 */
+		num_algos = 0;
+		for (i = 0; i < algo_count; i++) {
+			uint16_t v = SVAL(p, i * 2);
+			size_t ai;
+
+			if (!smb2_compression_algo_supported(v)) {
+				continue;
+			}
+			if (v == SMB2_COMPRESSION_PATTERN_V1 && !chained) {
+				continue;
+			}
+			for (ai = 0; ai < num_algos; ai++) {
+				if (xconn->smb2.server.compression_algos[ai] == v) {
+					break;
+				}
+			}
+			if (ai < num_algos) {
+				continue;
+			}
+			if (num_algos ==
+			    ARRAY_SIZE(xconn->smb2.server.compression_algos))
+			{
+				break;
+			}
+			xconn->smb2.server.compression_algos[num_algos++] = v;
+		}
+
+		if (num_algos != 0) {
+			xconn->smb2.compression = smb2_compression_ctx_create(
+				xconn,
+				xconn->smb2.server.compression_algos,
+				num_algos,
+				chained,
+				lp_smb2_channel_worker_threads());
+		}
+		if (xconn->smb2.compression == NULL) {
+			num_algos = 0;
+			chained = false;
+		}
+		xconn->smb2.server.num_compression_algos = num_algos;
+		xconn->smb2.server.compression_chained = chained;
+
+		SIVAL(buf, 4, chained ?
+		      SMB2_COMPRESSION_CAPABILITIES_FLAG_CHAINED :
+		      SMB2_COMPRESSION_CAPABILITIES_FLAG_NONE);
+		SSVAL(buf, 2, 0); /* Padding */
+		if (num_algos == 0) {
+			SSVAL(buf, 0, 1); /* CompressionAlgorithmCount */
+			SSVAL(buf, 8, SMB2_COMPRESSION_NONE);
+			needed = 10;
+		} else {
+			SSVAL(buf, 0, num_algos);
+			for (i = 0; i < num_algos; i++) {
+				SSVAL(buf, 8 + i * 2,
+				      xconn->smb2.server.compression_algos[i]);
+			}
+			needed = 8 + num_algos * 2;
+		}
+
+		status = smb2_negotiate_context_add(
+			req,
+			&out_c,
+			SMB2_COMPRESSION_CAPABILITIES,
+			buf,
+			needed);
+		if (!NT_STATUS_IS_OK(status)) {
+			return smbd_smb2_request_error(req, status);
+		}
+	}
+
 	status = smb311_capabilities_check(&default_smb3_capabilities,
 					   "smb2srv_negprot",
 					   DBGLVL_NOTICE,
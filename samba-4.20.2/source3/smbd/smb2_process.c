@@ -1410,6 +1410,22 @@ NTSTATUS smbd_add_connection(struct smbXsrv_client *client, int sock_fd,
 	}
 	tevent_fd_set_auto_close(xconn->transport.fde);
 
+	tmp = lp_smb2_channel_worker_threads();
+	if (tmp > 0) {
+		/*
+		 * Each channel gets its own threads, so a
+		 * multichannel client spreads the signing
+		 * work of its channels over several cores.
+		 */
+		ret = pthreadpool_tevent_init(xconn, tmp,
+					      &xconn->smb2.channel_pool);
+		if (ret != 0) {
+			DBG_WARNING("pthreadpool_tevent_init() failed: %s, "
+				    "signing inline\n", strerror(ret));
+			xconn->smb2.channel_pool = NULL;
+		}
+	}
+
 	/* for now we only have one connection */
 	DLIST_ADD_END(client->connections, xconn);
 	talloc_steal(client, xconn);
@@ -27,6 +27,7 @@
 #include "../lib/util/tevent_ntstatus.h"
 #include "rpc_server/srv_pipe_hnd.h"
 #include "lib/util/sys_rw_data.h"
+#include "source3/smbd/smb2_transport.h"
 
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_SMB2
@@ -361,6 +362,7 @@ static NTSTATUS schedule_smb2_sendfile_read(struct smbd_smb2_request *smb2req,
 	*/
 
 	if (!lp__use_sendfile(SNUM(fsp->conn)) ||
+	    !smb2req->xconn->transport.io->ops->zero_copy ||
 	    smb2req->do_signing ||
 	    smb2req->do_encryption ||
 	    smbd_smb2_is_compound(smb2req) ||
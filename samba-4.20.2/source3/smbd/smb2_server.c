@@ -32,6 +32,9 @@
 #include "../lib/util/bitmap.h"
 #include "../librpc/gen_ndr/krb5pac.h"
 #include "lib/util/iov_buf.h"
+#include "lib/pthreadpool/pthreadpool_tevent.h"
+#include "libcli/smb/smb2_compression.h"
+#include "source3/smbd/smb2_transport.h"
 #include "auth.h"
 #include "libcli/smb/smbXcli_base.h"
 #include "source3/lib/substitute.h"
@@ -50,6 +53,7 @@
 #include "lib/crypto/gnutls_helpers.h"
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
+#include <sched.h>
 
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_SMB2
@@ -295,7 +299,7 @@ bool smbd_smb2_is_last_in_compound(const struct smbd_smb2_request *req)
 static NTSTATUS smbd_initialize_smb2(struct smbXsrv_connection *xconn,
 				     uint64_t expected_seq_low)
 {
-	int rc;
+	NTSTATUS status;
 
 	xconn->smb2.credits.seq_low = expected_seq_low;
 	xconn->smb2.credits.seq_range = 1;
@@ -325,22 +329,17 @@ static NTSTATUS smbd_initialize_smb2(struct smbXsrv_connection *xconn,
 	tevent_fd_set_auto_close(xconn->transport.fde);
 
 	/*
-	 * Ensure child is set to non-blocking mode,
-	 * unless the system supports MSG_DONTWAIT,
-	 * if MSG_DONTWAIT is available we should force
-	 * blocking mode.
+	 * This also puts the socket into the mode the
+	 * transport needs, e.g. blocking mode if the
+	 * system supports MSG_DONTWAIT.
 	 */
-#ifdef MSG_DONTWAIT
-	rc = set_blocking(xconn->transport.sock, true);
-	if (rc < 0) {
-		return NT_STATUS_INTERNAL_ERROR;
-	}
-#else
-	rc = set_blocking(xconn->transport.sock, false);
-	if (rc < 0) {
-		return NT_STATUS_INTERNAL_ERROR;
+	TALLOC_FREE(xconn->transport.io);
+	status = smbd_smb2_transport_create(xconn,
+					    xconn->transport.sock,
+					    &xconn->transport.io);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
 	}
-#endif
 
 	return NT_STATUS_OK;
 }
@@ -372,8 +371,27 @@ static bool smb2_setup_nbt_length(struct iovec *vector, int count)
 	return true;
 }
 
+static void smbd_smb2_request_unqueue_incoming(struct smbd_smb2_request *req)
+{
+	struct smbXsrv_connection *xconn = req->xconn;
+
+	if (!req->incoming.queued) {
+		return;
+	}
+
+	DLIST_REMOVE(xconn->smb2.incoming_queue, &req->incoming);
+	xconn->smb2.incoming_queue_len--;
+	req->incoming.queued = false;
+}
+
 static int smbd_smb2_request_destructor(struct smbd_smb2_request *req)
 {
+	smbd_smb2_request_unqueue_incoming(req);
+	/*
+	 * Waits for the worker thread if it is still
+	 * on our buffers.
+	 */
+	TALLOC_FREE(req->crypto_job);
 	TALLOC_FREE(req->first_enc_key);
 	TALLOC_FREE(req->last_sign_key);
 	return 0;
@@ -421,10 +439,57 @@ static struct smbd_smb2_request *smbd_smb2_request_allocate(struct smbXsrv_conne
 	return req;
 }
 
+static NTSTATUS smbd_smb2_inbuf_decompress(struct smbXsrv_connection *xconn,
+					   TALLOC_CTX *mem_ctx,
+					   const uint8_t *buf,
+					   size_t buflen,
+					   uint8_t **_out,
+					   size_t *_outlen)
+{
+	size_t max_size;
+	DATA_BLOB out;
+	NTSTATUS status;
+
+	if (xconn->smb2.compression == NULL) {
+		DBG_INFO("Got SMB2_COMPRESSION_TRANSFORM header, "
+			 "but compression was not negotiated\n");
+		return NT_STATUS_INVALID_PARAMETER;
+	}
+
+	/*
+	 * Nothing we accept can be larger than this, the
+	 * 64 KiB are for the SMB2 header and body.
+	 */
+	max_size = MAX(xconn->smb2.server.max_trans,
+		       xconn->smb2.server.max_read);
+	max_size = MAX(max_size, xconn->smb2.server.max_write);
+	max_size += 64 * 1024;
+
+	status = smb2_compression_decompress(
+		mem_ctx,
+		buf,
+		buflen,
+		xconn->smb2.server.compression_algos,
+		xconn->smb2.server.num_compression_algos,
+		xconn->smb2.server.compression_chained,
+		max_size,
+		&out);
+	if (!NT_STATUS_IS_OK(status)) {
+		DBG_INFO("Failed to decompress %zu bytes: %s\n",
+			 buflen, nt_errstr(status));
+		return status;
+	}
+
+	*_out = out.data;
+	*_outlen = out.length;
+	return NT_STATUS_OK;
+}
+
 static NTSTATUS smbd_smb2_inbuf_parse_compound(struct smbXsrv_connection *xconn,
 					       NTTIME now,
 					       uint8_t *buf,
 					       size_t buflen,
+					       bool tf_decrypted,
 					       struct smbd_smb2_request *req,
 					       struct iovec **piov,
 					       int *pnum_iov)
@@ -437,6 +502,7 @@ static NTSTATUS smbd_smb2_inbuf_parse_compound(struct smbXsrv_connection *xconn,
 	size_t verified_buflen = 0;
 	uint8_t *tf = NULL;
 	size_t tf_len = 0;
+	bool decompressed = false;
 
 	/*
 	 * Note: index '0' is reserved for the transport protocol
@@ -544,8 +610,18 @@ static NTSTATUS smbd_smb2_inbuf_parse_compound(struct smbXsrv_connection *xconn,
 			tf_iov[1].iov_base = (void *)hdr;
 			tf_iov[1].iov_len = enc_len;
 
-			status = smb2_signing_decrypt_pdu(s->global->decryption_key,
-							  tf_iov, 2);
+			if (tf_decrypted && tf == first_hdr) {
+				/*
+				 * A channel worker thread already
+				 * decrypted it, see
+				 * smbd_smb2_request_decrypt_offload().
+				 */
+				status = NT_STATUS_OK;
+			} else {
+				status = smb2_signing_decrypt_pdu(
+					s->global->decryption_key,
+					tf_iov, 2);
+			}
 			if (!NT_STATUS_IS_OK(status)) {
 				TALLOC_FREE(iov_alloc);
 				return status;
@@ -555,6 +631,50 @@ static NTSTATUS smbd_smb2_inbuf_parse_compound(struct smbXsrv_connection *xconn,
 			len = enc_len;
 		}
 
+		if (len >= 4 && IVAL(hdr, 0) == SMB2_COMP_MAGIC) {
+			uint8_t *dbuf = NULL;
+			size_t dlen = 0;
+			NTSTATUS status;
+
+			/*
+			 * A COMPRESSION_TRANSFORM covers the whole
+			 * message (inside of the SMB2_TRANSFORM), it
+			 * can't be part of a compound chain.
+			 */
+			if (decompressed || taken != tf_len) {
+				DEBUG(10, ("Got SMB2_COMPRESSION_TRANSFORM "
+					   "header at offset %zu\n", taken));
+				goto inval;
+			}
+			if (tf == NULL && len != buflen - taken) {
+				goto inval;
+			}
+
+			status = smbd_smb2_inbuf_decompress(xconn,
+							    mem_ctx,
+							    hdr,
+							    len,
+							    &dbuf,
+							    &dlen);
+			if (!NT_STATUS_IS_OK(status)) {
+				TALLOC_FREE(iov_alloc);
+				return status;
+			}
+			decompressed = true;
+
+			/*
+			 * Continue with the decompressed message, any
+			 * following compound requests in it were
+			 * protected by the same SMB2_TRANSFORM.
+			 */
+			first_hdr = dbuf;
+			buflen = dlen;
+			taken = 0;
+			verified_buflen = (tf != NULL) ? dlen : 0;
+			hdr = dbuf;
+			len = dlen;
+		}
+
 		/*
 		 * We need the header plus the body length field
 		 */
@@ -718,6 +838,7 @@ static NTSTATUS smbd_smb2_request_create(struct smbXsrv_connection *xconn,
 						now,
 						inpdu,
 						size,
+						false,
 						req, &req->in.vector,
 						&req->in.vector_count);
 	if (!NT_STATUS_IS_OK(status)) {
@@ -3618,184 +3739,674 @@ static void smbd_smb2_request_reply_update_counts(struct smbd_smb2_request *req)
 	}
 }
 
-static NTSTATUS smbd_smb2_request_reply(struct smbd_smb2_request *req)
-{
-	struct smbXsrv_connection *xconn = req->xconn;
-	int first_idx = 1;
-	struct iovec *firsttf = SMBD_SMB2_IDX_TF_IOV(req,out,first_idx);
-	struct iovec *outhdr = SMBD_SMB2_OUT_HDR_IOV(req);
-	struct iovec *outdyn = SMBD_SMB2_OUT_DYN_IOV(req);
-	NTSTATUS status;
-	bool ok;
+/*
+ * PDUs smaller than this are signed, encrypted and decrypted
+ * inline, for them the round trip through the worker threads
+ * costs more than the crypto itself.
+ */
+#define SMBD_SMB2_CRYPTO_OFFLOAD_MIN_SIZE (64*1024)
 
-	req->subreq = NULL;
-	TALLOC_FREE(req->async_te);
+typedef NTSTATUS (*smbd_smb2_crypto_fn_t)(struct smb2_signing_key *key,
+					  struct iovec *vector,
+					  int count);
 
-	/* MS-SMB2: 3.3.4.1 Sending Any Outgoing Message */
-	smbd_smb2_request_reply_update_counts(req);
+/*
+ * The state of a job, the worker thread and the main thread race
+ * for it, see smbd_smb2_crypto_job_fn() and
+ * smbd_smb2_crypto_job_destructor().
+ */
+#define SMBD_SMB2_CRYPTO_JOB_QUEUED	0
+#define SMBD_SMB2_CRYPTO_JOB_RUNNING	1
+#define SMBD_SMB2_CRYPTO_JOB_DONE	2
+#define SMBD_SMB2_CRYPTO_JOB_CANCELLED	3
 
-	if (req->do_encryption &&
-	    (firsttf->iov_len == 0) &&
-	    (!smb2_signing_key_valid(req->first_enc_key)) &&
-	    (req->session != NULL) &&
-	    smb2_signing_key_valid(req->session->global->encryption_key))
-	{
-		struct smb2_signing_key *encryption_key =
-			req->session->global->encryption_key;
-		uint8_t *tf;
-		uint64_t session_id = req->session->global->session_wire_id;
-		uint64_t nonce_high;
-		uint64_t nonce_low;
+struct smbd_smb2_crypto_job {
+	/*
+	 * NULL once the request is done with the job.
+	 */
+	struct smbd_smb2_request *req;
 
-		status = smb2_get_new_nonce(req->session,
-					    &nonce_high,
-					    &nonce_low);
-		if (!NT_STATUS_IS_OK(status)) {
-			return status;
-		}
+	/*
+	 * The worker thread only touches the key, vector and the
+	 * buffers vector describes. Those belong to req, the job
+	 * destructor waits for the worker before req goes away.
+	 */
+	smbd_smb2_crypto_fn_t fn;
+	struct smb2_signing_key *key;
+	uint8_t *buf;
+	struct iovec *vector;
+	int count;
+	uint32_t state;
+	NTSTATUS status;
+};
 
-		/*
-		 * We need to place the SMB2_TRANSFORM header before the
-		 * first SMB2 header
-		 */
+static bool smbd_smb2_crypto_offload_possible(struct smbd_smb2_request *req,
+					      const struct iovec *vector,
+					      int count)
+{
+	struct smbXsrv_connection *xconn = req->xconn;
+	ssize_t len;
+
+	if (xconn->smb2.channel_pool == NULL) {
+		return false;
+	}
 
+	if (req->preauth != NULL) {
 		/*
-		 * we need to remember the encryption key
-		 * and defer the signing/encryption until
-		 * we are sure that we do not change
-		 * the header again.
+		 * The preauth hash is calculated over the
+		 * final response right after signing.
 		 */
-		status = smb2_signing_key_copy(req,
-					       encryption_key,
-					       &req->first_enc_key);
-		if (!NT_STATUS_IS_OK(status)) {
-			return status;
-		}
+		return false;
+	}
 
-		tf = talloc_zero_array(req, uint8_t,
-				       SMB2_TF_HDR_SIZE);
-		if (tf == NULL) {
-			return NT_STATUS_NO_MEMORY;
-		}
+	len = iov_buflen(vector, count);
+	if (len < SMBD_SMB2_CRYPTO_OFFLOAD_MIN_SIZE) {
+		return false;
+	}
 
-		SIVAL(tf, SMB2_TF_PROTOCOL_ID, SMB2_TF_MAGIC);
-		SBVAL(tf, SMB2_TF_NONCE+0, nonce_low);
-		SBVAL(tf, SMB2_TF_NONCE+8, nonce_high);
-		SBVAL(tf, SMB2_TF_SESSION_ID, session_id);
+	return true;
+}
 
-		firsttf->iov_base = (void *)tf;
-		firsttf->iov_len = SMB2_TF_HDR_SIZE;
+static bool smbd_smb2_crypto_offload_cipher(const struct smb2_signing_key *key)
+{
+	if (!smb2_signing_key_valid(key)) {
+		return false;
 	}
 
-	if ((req->current_idx > SMBD_SMB2_NUM_IOV_PER_REQ) &&
-	    (smb2_signing_key_valid(req->last_sign_key)) &&
-	    (firsttf->iov_len == 0))
-	{
-		int last_idx = req->current_idx - SMBD_SMB2_NUM_IOV_PER_REQ;
-		struct iovec *lasthdr = SMBD_SMB2_IDX_HDR_IOV(req,out,last_idx);
-
-		/*
-		 * As we are sure the header of the last request in the
-		 * compound chain will not change, we can to sign here
-		 * with the last signing key we remembered.
-		 */
-		status = smb2_signing_sign_pdu(req->last_sign_key,
-					       lasthdr,
-					       SMBD_SMB2_NUM_IOV_PER_REQ - 1);
-		if (!NT_STATUS_IS_OK(status)) {
-			return status;
-		}
+	/*
+	 * Only the GCM ciphers en/decrypt in place without
+	 * talloc_tos() buffers, which is required in a
+	 * worker thread.
+	 */
+	switch (key->cipher_algo_id) {
+	case SMB2_ENCRYPTION_AES128_GCM:
+	case SMB2_ENCRYPTION_AES256_GCM:
+		return true;
+	default:
+		break;
 	}
-	TALLOC_FREE(req->last_sign_key);
 
-	SMBPROFILE_IOBYTES_ASYNC_END(req->profile,
-		iov_buflen(outhdr, SMBD_SMB2_NUM_IOV_PER_REQ-1));
+	return false;
+}
 
-	req->current_idx += SMBD_SMB2_NUM_IOV_PER_REQ;
+static void smbd_smb2_crypto_job_fn(void *private_data)
+{
+	/*
+	 * Runs in a channel worker thread: no talloc, no
+	 * logging, no access to anything but the job.
+	 */
+	struct smbd_smb2_crypto_job *job =
+		(struct smbd_smb2_crypto_job *)private_data;
+	uint32_t state = SMBD_SMB2_CRYPTO_JOB_QUEUED;
+	bool ok;
 
-	if (req->current_idx < req->out.vector_count) {
+	ok = __atomic_compare_exchange_n(&job->state,
+					 &state,
+					 SMBD_SMB2_CRYPTO_JOB_RUNNING,
+					 false,
+					 __ATOMIC_ACQUIRE,
+					 __ATOMIC_RELAXED);
+	if (!ok) {
 		/*
-		 * We must process the remaining compound
-		 * SMB2 requests before any new incoming SMB2
-		 * requests. This is because incoming SMB2
-		 * requests may include a cancel for a
-		 * compound request we haven't processed
-		 * yet.
+		 * The job was freed before we got to it.
 		 */
-		struct tevent_immediate *im = tevent_create_immediate(req);
-		if (!im) {
-			return NT_STATUS_NO_MEMORY;
-		}
+		return;
+	}
 
-		if (req->do_signing && firsttf->iov_len == 0) {
-			struct smbXsrv_session *x = req->session;
-			struct smb2_signing_key *signing_key =
-				smbd_smb2_signing_key(x, xconn, NULL);
+	job->status = job->fn(job->key, job->vector, job->count);
 
-			/*
-			 * we need to remember the signing key
-			 * and defer the signing until
-			 * we are sure that we do not change
-			 * the header again.
-			 */
-			status = smb2_signing_key_copy(req,
-						       signing_key,
-						       &req->last_sign_key);
-			if (!NT_STATUS_IS_OK(status)) {
-				return status;
-			}
-		}
+	__atomic_store_n(&job->state,
+			 SMBD_SMB2_CRYPTO_JOB_DONE,
+			 __ATOMIC_RELEASE);
+}
 
-		/*
-		 * smbd_smb2_request_dispatch() will redo the impersonation.
-		 * So we use req->xconn->client->raw_ev_ctx instead
-		 * of req->ev_ctx here.
-		 */
-		tevent_schedule_immediate(im,
-					req->xconn->client->raw_ev_ctx,
-					smbd_smb2_request_dispatch_immediate,
-					req);
-		return NT_STATUS_OK;
-	}
+static int smbd_smb2_crypto_job_destructor(struct smbd_smb2_crypto_job *job)
+{
+	uint32_t state = SMBD_SMB2_CRYPTO_JOB_QUEUED;
+	bool ok;
 
-	if (req->compound_related) {
-		req->compound_related = false;
+	/*
+	 * Either the worker has not started yet, then it never
+	 * will, or we have to wait until it's off the buffers of
+	 * req. That's only the case if the request or the channel
+	 * goes away while the job is running.
+	 */
+	ok = __atomic_compare_exchange_n(&job->state,
+					 &state,
+					 SMBD_SMB2_CRYPTO_JOB_CANCELLED,
+					 false,
+					 __ATOMIC_ACQUIRE,
+					 __ATOMIC_ACQUIRE);
+	while (!ok && (state != SMBD_SMB2_CRYPTO_JOB_DONE)) {
+		sched_yield();
+		state = __atomic_load_n(&job->state, __ATOMIC_ACQUIRE);
 	}
 
-	ok = smb2_setup_nbt_length(req->out.vector, req->out.vector_count);
-	if (!ok) {
-		return NT_STATUS_INVALID_PARAMETER_MIX;
+	if (job->req != NULL) {
+		job->req->crypto_job = NULL;
+		job->req->queue_entry.crypto_pending = false;
+		job->req = NULL;
 	}
 
-	/* Set credit for these operations (zero credits if this
-	   is a final reply for an async operation). */
-	smb2_calculate_credits(req, req);
+	return 0;
+}
+
+/*
+ * The job works on vector in place. If buf is not NULL, it's the
+ * talloc buffer vector points into, the job takes it over and
+ * smbd_smb2_crypto_job_recv() hands it back.
+ */
+static NTSTATUS smbd_smb2_crypto_job_send(struct smbd_smb2_request *req,
+					  struct smb2_signing_key *key,
+					  smbd_smb2_crypto_fn_t fn,
+					  uint8_t *buf,
+					  struct iovec *vector,
+					  int count,
+					  tevent_req_fn done_fn)
+{
+	struct smbXsrv_connection *xconn = req->xconn;
+	struct smbd_smb2_crypto_job *job = NULL;
+	struct tevent_req *subreq = NULL;
+	NTSTATUS status;
+
+	SMB_ASSERT(req->crypto_job == NULL);
 
 	/*
-	 * now check if we need to sign the current response
+	 * Below the channel pool, not req: if the channel goes
+	 * away, the pool reaps the jobs once its threads are
+	 * stopped, req frees its job itself.
 	 */
-	if (firsttf->iov_len == SMB2_TF_HDR_SIZE) {
-		status = smb2_signing_encrypt_pdu(req->first_enc_key,
-					firsttf,
-					req->out.vector_count - first_idx);
-		if (!NT_STATUS_IS_OK(status)) {
-			return status;
-		}
-	} else if (req->do_signing) {
-		struct smbXsrv_session *x = req->session;
-		struct smb2_signing_key *signing_key =
-			smbd_smb2_signing_key(x, xconn, NULL);
-
-		status = smb2_signing_sign_pdu(signing_key,
-					       outhdr,
-					       SMBD_SMB2_NUM_IOV_PER_REQ - 1);
-		if (!NT_STATUS_IS_OK(status)) {
-			return status;
-		}
+	job = talloc_zero(xconn->smb2.channel_pool,
+			  struct smbd_smb2_crypto_job);
+	if (job == NULL) {
+		return NT_STATUS_NO_MEMORY;
 	}
-	TALLOC_FREE(req->first_enc_key);
+	job->fn = fn;
+	job->state = SMBD_SMB2_CRYPTO_JOB_QUEUED;
 
-	if (req->preauth != NULL) {
+	/*
+	 * The worker thread gets a private copy of the key,
+	 * the gnutls handles of the session keys are only
+	 * used by the main thread.
+	 */
+	status = smb2_signing_key_copy(job, key, &job->key);
+	if (!NT_STATUS_IS_OK(status)) {
+		TALLOC_FREE(job);
+		return status;
+	}
+
+	/*
+	 * Only the array, so the worker does not depend on
+	 * where req keeps it.
+	 */
+	job->vector = talloc_memdup(job, vector, sizeof(*vector) * count);
+	if (job->vector == NULL) {
+		TALLOC_FREE(job);
+		return NT_STATUS_NO_MEMORY;
+	}
+	job->count = count;
+
+	subreq = pthreadpool_tevent_job_send(job,
+					     xconn->client->raw_ev_ctx,
+					     xconn->smb2.channel_pool,
+					     smbd_smb2_crypto_job_fn,
+					     job);
+	if (subreq == NULL) {
+		TALLOC_FREE(job);
+		return NT_STATUS_NO_MEMORY;
+	}
+	tevent_req_set_callback(subreq, done_fn, job);
+
+	job->buf = talloc_steal(job, buf);
+	job->req = req;
+	talloc_set_destructor(job, smbd_smb2_crypto_job_destructor);
+
+	req->crypto_job = job;
+	req->queue_entry.crypto_pending = true;
+	return NT_STATUS_OK;
+}
+
+/*
+ * *_buf is the buf passed to smbd_smb2_crypto_job_send(),
+ * now owned by the request.
+ */
+static NTSTATUS smbd_smb2_crypto_job_recv(struct tevent_req *subreq,
+					  struct smbd_smb2_request **_req,
+					  uint8_t **_buf)
+{
+	struct smbd_smb2_crypto_job *job =
+		tevent_req_callback_data(subreq,
+		struct smbd_smb2_crypto_job);
+	struct smbd_smb2_request *req = job->req;
+	NTSTATUS status;
+	int ret;
+
+	ret = pthreadpool_tevent_job_recv(subreq);
+	TALLOC_FREE(subreq);
+
+	if (ret != 0) {
+		/*
+		 * The job did not run, do it here.
+		 */
+		smbd_smb2_crypto_job_fn(job);
+	}
+
+	status = job->status;
+	if (!NT_STATUS_IS_OK(status)) {
+		DBG_ERR("crypto offload failed: %s\n", nt_errstr(status));
+	}
+
+	*_buf = talloc_move(req, &job->buf);
+	TALLOC_FREE(job);
+
+	*_req = req;
+	return status;
+}
+
+static void smbd_smb2_sign_reply_done(struct tevent_req *subreq)
+{
+	struct smbd_smb2_request *req = NULL;
+	struct smbXsrv_connection *xconn = NULL;
+	uint8_t *buf = NULL;
+	NTSTATUS status;
+
+	status = smbd_smb2_crypto_job_recv(subreq, &req, &buf);
+	xconn = req->xconn;
+	if (!NT_STATUS_IS_OK(status)) {
+		smbd_server_connection_terminate(xconn, nt_errstr(status));
+		return;
+	}
+
+	/*
+	 * The header got the signature in place.
+	 */
+	status = smbd_smb2_flush_send_queue(xconn);
+	if (!NT_STATUS_IS_OK(status)) {
+		smbd_server_connection_terminate(xconn, nt_errstr(status));
+		return;
+	}
+}
+
+static void smbd_smb2_encrypt_reply_done(struct tevent_req *subreq)
+{
+	struct smbd_smb2_request *req = NULL;
+	struct smbXsrv_connection *xconn = NULL;
+	uint8_t *buf = NULL;
+	NTSTATUS status;
+
+	status = smbd_smb2_crypto_job_recv(subreq, &req, &buf);
+	xconn = req->xconn;
+	if (!NT_STATUS_IS_OK(status)) {
+		smbd_server_connection_terminate(xconn, nt_errstr(status));
+		return;
+	}
+
+	/*
+	 * The response got encrypted in place.
+	 */
+	status = smbd_smb2_flush_send_queue(xconn);
+	if (!NT_STATUS_IS_OK(status)) {
+		smbd_server_connection_terminate(xconn, nt_errstr(status));
+		return;
+	}
+}
+
+/*
+ * MS-SMB2 3.3.4.1.4: a READ response is compressed if the client
+ * asked for it, or the share wants its data to be compressed.
+ */
+static bool smbd_smb2_compress_reply_wanted(struct smbd_smb2_request *req)
+{
+	struct smbXsrv_connection *xconn = req->xconn;
+	int first_idx = 1;
+	const struct iovec *inbody = NULL;
+	const struct iovec *outhdr = NULL;
+	const struct iovec *outdyn = NULL;
+	bool wanted = false;
+
+	if (xconn->smb2.compression == NULL) {
+		return false;
+	}
+	if (req->out.vector_count != 1 + SMBD_SMB2_NUM_IOV_PER_REQ) {
+		/* no compound responses */
+		return false;
+	}
+
+	outhdr = SMBD_SMB2_IDX_HDR_IOV(req,out,first_idx);
+	if (SVAL(outhdr->iov_base, SMB2_HDR_OPCODE) != SMB2_OP_READ) {
+		return false;
+	}
+	if (IVAL(outhdr->iov_base, SMB2_HDR_STATUS) != 0) {
+		return false;
+	}
+
+	outdyn = SMBD_SMB2_IDX_DYN_IOV(req,out,first_idx);
+	if (outdyn->iov_base == NULL) {
+		/* sendfile */
+		return false;
+	}
+	if (outdyn->iov_len < (size_t)lp_smb2_compression_threshold()) {
+		return false;
+	}
+
+	inbody = SMBD_SMB2_IDX_BODY_IOV(req,in,first_idx);
+	if (inbody->iov_len >= 4) {
+		uint8_t in_flags = CVAL(inbody->iov_base, 0x03);
+
+		if (in_flags & SMB2_READFLAG_REQUEST_COMPRESSED) {
+			wanted = true;
+		}
+	}
+	if (!wanted && req->tcon != NULL &&
+	    lp_smb2_compress_data(SNUM(req->tcon->compat))) {
+		wanted = true;
+	}
+	if (!wanted) {
+		return false;
+	}
+
+	return smb2_compression_worthwhile(outdyn->iov_base,
+					   outdyn->iov_len);
+}
+
+/*
+ * Replaces the SMB2 header, body and data of the response with a
+ * COMPRESSION_TRANSFORM message, if that turns out to be smaller.
+ */
+static NTSTATUS smbd_smb2_compress_reply(struct smbd_smb2_request *req)
+{
+	struct smbXsrv_connection *xconn = req->xconn;
+	int first_idx = 1;
+	struct iovec *outhdr = SMBD_SMB2_IDX_HDR_IOV(req,out,first_idx);
+	struct iovec *outbody = SMBD_SMB2_IDX_BODY_IOV(req,out,first_idx);
+	struct iovec *outdyn = SMBD_SMB2_IDX_DYN_IOV(req,out,first_idx);
+	DATA_BLOB blob;
+	NTSTATUS status;
+	bool ok;
+
+	status = smb2_compression_compress(xconn->smb2.compression,
+					   req,
+					   outhdr,
+					   2,
+					   outdyn->iov_base,
+					   outdyn->iov_len,
+					   &blob);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+	if (blob.length == 0) {
+		/* Not worth it, send it as it is */
+		return NT_STATUS_OK;
+	}
+
+	DBG_DEBUG("compressed READ response from %zu to %zu bytes\n",
+		  outhdr->iov_len + outbody->iov_len + outdyn->iov_len,
+		  blob.length);
+
+	*outhdr = (struct iovec) {
+		.iov_base = blob.data,
+		.iov_len = blob.length,
+	};
+	*outbody = (struct iovec) { .iov_base = NULL, };
+	*outdyn = (struct iovec) { .iov_base = NULL, };
+
+	ok = smb2_setup_nbt_length(req->out.vector, req->out.vector_count);
+	if (!ok) {
+		return NT_STATUS_INVALID_PARAMETER_MIX;
+	}
+
+	return NT_STATUS_OK;
+}
+
+static NTSTATUS smbd_smb2_request_reply(struct smbd_smb2_request *req)
+{
+	struct smbXsrv_connection *xconn = req->xconn;
+	int first_idx = 1;
+	struct iovec *firsttf = SMBD_SMB2_IDX_TF_IOV(req,out,first_idx);
+	struct iovec *outhdr = SMBD_SMB2_OUT_HDR_IOV(req);
+	struct iovec *outdyn = SMBD_SMB2_OUT_DYN_IOV(req);
+	NTSTATUS status;
+	bool compress;
+	bool ok;
+
+	req->subreq = NULL;
+	TALLOC_FREE(req->async_te);
+
+	/* MS-SMB2: 3.3.4.1 Sending Any Outgoing Message */
+	smbd_smb2_request_reply_update_counts(req);
+
+	if (req->do_encryption &&
+	    (firsttf->iov_len == 0) &&
+	    (!smb2_signing_key_valid(req->first_enc_key)) &&
+	    (req->session != NULL) &&
+	    smb2_signing_key_valid(req->session->global->encryption_key))
+	{
+		struct smb2_signing_key *encryption_key =
+			req->session->global->encryption_key;
+		uint8_t *tf;
+		uint64_t session_id = req->session->global->session_wire_id;
+		uint64_t nonce_high;
+		uint64_t nonce_low;
+
+		status = smb2_get_new_nonce(req->session,
+					    &nonce_high,
+					    &nonce_low);
+		if (!NT_STATUS_IS_OK(status)) {
+			return status;
+		}
+
+		/*
+		 * We need to place the SMB2_TRANSFORM header before the
+		 * first SMB2 header
+		 */
+
+		/*
+		 * we need to remember the encryption key
+		 * and defer the signing/encryption until
+		 * we are sure that we do not change
+		 * the header again.
+		 */
+		status = smb2_signing_key_copy(req,
+					       encryption_key,
+					       &req->first_enc_key);
+		if (!NT_STATUS_IS_OK(status)) {
+			return status;
+		}
+
+		tf = talloc_zero_array(req, uint8_t,
+				       SMB2_TF_HDR_SIZE);
+		if (tf == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+
+		SIVAL(tf, SMB2_TF_PROTOCOL_ID, SMB2_TF_MAGIC);
+		SBVAL(tf, SMB2_TF_NONCE+0, nonce_low);
+		SBVAL(tf, SMB2_TF_NONCE+8, nonce_high);
+		SBVAL(tf, SMB2_TF_SESSION_ID, session_id);
+
+		firsttf->iov_base = (void *)tf;
+		firsttf->iov_len = SMB2_TF_HDR_SIZE;
+	}
+
+	if ((req->current_idx > SMBD_SMB2_NUM_IOV_PER_REQ) &&
+	    (smb2_signing_key_valid(req->last_sign_key)) &&
+	    (firsttf->iov_len == 0))
+	{
+		int last_idx = req->current_idx - SMBD_SMB2_NUM_IOV_PER_REQ;
+		struct iovec *lasthdr = SMBD_SMB2_IDX_HDR_IOV(req,out,last_idx);
+
+		/*
+		 * As we are sure the header of the last request in the
+		 * compound chain will not change, we can to sign here
+		 * with the last signing key we remembered.
+		 */
+		status = smb2_signing_sign_pdu(req->last_sign_key,
+					       lasthdr,
+					       SMBD_SMB2_NUM_IOV_PER_REQ - 1);
+		if (!NT_STATUS_IS_OK(status)) {
+			return status;
+		}
+	}
+	TALLOC_FREE(req->last_sign_key);
+
+	SMBPROFILE_IOBYTES_ASYNC_END(req->profile,
+		iov_buflen(outhdr, SMBD_SMB2_NUM_IOV_PER_REQ-1));
+
+	req->current_idx += SMBD_SMB2_NUM_IOV_PER_REQ;
+
+	if (req->current_idx < req->out.vector_count) {
+		/*
+		 * We must process the remaining compound
+		 * SMB2 requests before any new incoming SMB2
+		 * requests. This is because incoming SMB2
+		 * requests may include a cancel for a
+		 * compound request we haven't processed
+		 * yet.
+		 */
+		struct tevent_immediate *im = tevent_create_immediate(req);
+		if (!im) {
+			return NT_STATUS_NO_MEMORY;
+		}
+
+		if (req->do_signing && firsttf->iov_len == 0) {
+			struct smbXsrv_session *x = req->session;
+			struct smb2_signing_key *signing_key =
+				smbd_smb2_signing_key(x, xconn, NULL);
+
+			/*
+			 * we need to remember the signing key
+			 * and defer the signing until
+			 * we are sure that we do not change
+			 * the header again.
+			 */
+			status = smb2_signing_key_copy(req,
+						       signing_key,
+						       &req->last_sign_key);
+			if (!NT_STATUS_IS_OK(status)) {
+				return status;
+			}
+		}
+
+		/*
+		 * smbd_smb2_request_dispatch() will redo the impersonation.
+		 * So we use req->xconn->client->raw_ev_ctx instead
+		 * of req->ev_ctx here.
+		 */
+		tevent_schedule_immediate(im,
+					req->xconn->client->raw_ev_ctx,
+					smbd_smb2_request_dispatch_immediate,
+					req);
+		return NT_STATUS_OK;
+	}
+
+	if (req->compound_related) {
+		req->compound_related = false;
+	}
+
+	ok = smb2_setup_nbt_length(req->out.vector, req->out.vector_count);
+	if (!ok) {
+		return NT_STATUS_INVALID_PARAMETER_MIX;
+	}
+
+	/* Set credit for these operations (zero credits if this
+	   is a final reply for an async operation). */
+	smb2_calculate_credits(req, req);
+
+	compress = smbd_smb2_compress_reply_wanted(req);
+
+	/*
+	 * now check if we need to sign the current response
+	 */
+	if (firsttf->iov_len == SMB2_TF_HDR_SIZE) {
+		int count = req->out.vector_count - first_idx;
+
+		/*
+		 * MS-SMB2 3.3.4.1.4: the compressed message
+		 * gets encrypted.
+		 */
+		if (compress) {
+			status = smbd_smb2_compress_reply(req);
+			if (!NT_STATUS_IS_OK(status)) {
+				return status;
+			}
+		}
+
+		if (smbd_smb2_crypto_offload_cipher(req->first_enc_key) &&
+		    smbd_smb2_crypto_offload_possible(req, firsttf, count))
+		{
+			/*
+			 * The response is queued below, but
+			 * smbd_smb2_flush_with_sendmsg() holds it
+			 * back until it is encrypted in place.
+			 */
+			status = smbd_smb2_crypto_job_send(
+				req,
+				req->first_enc_key,
+				smb2_signing_encrypt_pdu_nolog,
+				NULL,
+				firsttf,
+				count,
+				smbd_smb2_encrypt_reply_done);
+		} else {
+			status = smb2_signing_encrypt_pdu(req->first_enc_key,
+							  firsttf,
+							  count);
+		}
+		if (!NT_STATUS_IS_OK(status)) {
+			return status;
+		}
+	} else if (req->do_signing) {
+		struct smbXsrv_session *x = req->session;
+		struct smb2_signing_key *signing_key =
+			smbd_smb2_signing_key(x, xconn, NULL);
+
+		/*
+		 * With compression the signature is over the
+		 * uncompressed message, so it has to be there
+		 * before we compress.
+		 */
+		if (!compress &&
+		    smb2_signing_key_valid(signing_key) &&
+		    smbd_smb2_crypto_offload_possible(
+			    req, outhdr, SMBD_SMB2_NUM_IOV_PER_REQ - 1))
+		{
+			/*
+			 * The response is queued below, but
+			 * smbd_smb2_flush_with_sendmsg() holds it
+			 * back until the signature is in the header.
+			 */
+			status = smbd_smb2_crypto_job_send(
+				req,
+				signing_key,
+				smb2_signing_sign_pdu_nolog,
+				NULL,
+				outhdr,
+				SMBD_SMB2_NUM_IOV_PER_REQ - 1,
+				smbd_smb2_sign_reply_done);
+		} else {
+			status = smb2_signing_sign_pdu(
+				signing_key,
+				outhdr,
+				SMBD_SMB2_NUM_IOV_PER_REQ - 1);
+		}
+		if (!NT_STATUS_IS_OK(status)) {
+			return status;
+		}
+		if (compress) {
+			status = smbd_smb2_compress_reply(req);
+			if (!NT_STATUS_IS_OK(status)) {
+				return status;
+			}
+		}
+	} else if (compress) {
+		status = smbd_smb2_compress_reply(req);
+		if (!NT_STATUS_IS_OK(status)) {
+			return status;
+		}
+	}
+	TALLOC_FREE(req->first_enc_key);
+
+	if (req->preauth != NULL) {
 		gnutls_hash_hd_t hash_hnd = NULL;
 		size_t i;
 		int rc;
@@ -4554,6 +5165,29 @@ static bool is_smb2_recvfile_write(struct smbd_smb2_request_read_state *state)
 	return true;
 }
 
+static size_t smbd_smb2_min_recvfile_size(struct smbXsrv_connection *xconn)
+{
+	/*
+	 * SMB_VFS_RECVFILE() reads directly from the socket,
+	 * which only works if the transport has nothing
+	 * of its own between us and the socket.
+	 */
+	if (xconn->transport.io == NULL ||
+	    !xconn->transport.io->ops->zero_copy) {
+		return 0;
+	}
+
+	/*
+	 * The write data would have to wait in the socket
+	 * until the requests in front of it are decrypted.
+	 */
+	if (xconn->smb2.incoming_queue != NULL) {
+		return 0;
+	}
+
+	return lp_min_receive_file_size();
+}
+
 static NTSTATUS smbd_smb2_request_next_incoming(struct smbXsrv_connection *xconn)
 {
 	struct smbd_smb2_request_read_state *state = &xconn->smb2.request_read_state;
@@ -4588,6 +5222,15 @@ static NTSTATUS smbd_smb2_request_next_incoming(struct smbXsrv_connection *xconn
 		return NT_STATUS_OK;
 	}
 
+	if (xconn->smb2.incoming_queue_len > max_send_queue_len) {
+		/*
+		 * The same for requests waiting to be
+		 * decrypted, smbd_smb2_request_decrypt_done()
+		 * asks for the next one.
+		 */
+		return NT_STATUS_OK;
+	}
+
 	/* ask for the next request */
 	req = smbd_smb2_request_allocate(xconn);
 	if (req == NULL) {
@@ -4595,7 +5238,7 @@ static NTSTATUS smbd_smb2_request_next_incoming(struct smbXsrv_connection *xconn
 	}
 	*state = (struct smbd_smb2_request_read_state) {
 		.req = req,
-		.min_recv_size = lp_min_receive_file_size(),
+		.min_recv_size = smbd_smb2_min_recvfile_size(xconn),
 		._vector = {
 			[0] = (struct iovec) {
 				.iov_base = (void *)state->hdr.nbt,
@@ -4760,175 +5403,492 @@ static NTSTATUS smbd_smb2_advance_send_queue(struct smbXsrv_connection *xconn,
 	xconn->smb2.send_queue_len--;
 	DLIST_REMOVE(xconn->smb2.send_queue, e);
 
-	if (e->ack.req == NULL) {
-		*_e = NULL;
-		talloc_free(e->mem_ctx);
-		return NT_STATUS_OK;
-	}
+	if (e->ack.req == NULL) {
+		*_e = NULL;
+		talloc_free(e->mem_ctx);
+		return NT_STATUS_OK;
+	}
+
+	e->ack.required_acked_bytes = xconn->ack.unacked_bytes;
+	DLIST_ADD_END(xconn->ack.queue, e);
+
+	return NT_STATUS_OK;
+}
+
+static NTSTATUS smbd_smb2_flush_with_sendmsg(struct smbXsrv_connection *xconn)
+{
+	int ret;
+	int err;
+	bool retry;
+	NTSTATUS status;
+
+	if (xconn->smb2.send_queue == NULL) {
+		TEVENT_FD_NOT_WRITEABLE(xconn->transport.fde);
+		return NT_STATUS_OK;
+	}
+
+	while (xconn->smb2.send_queue != NULL) {
+		struct smbd_smb2_send_queue *e = xconn->smb2.send_queue;
+
+		if (e->crypto_pending) {
+			/*
+			 * Keep the order of the responses,
+			 * the done function of the job flushes
+			 * again once the signature is there.
+			 */
+			TEVENT_FD_NOT_WRITEABLE(xconn->transport.fde);
+			return NT_STATUS_OK;
+		}
+
+		if (!NT_STATUS_IS_OK(xconn->transport.status)) {
+			/*
+			 * we're not supposed to do any io
+			 * just flush all pending stuff.
+			 */
+			xconn->smb2.send_queue_len--;
+			DLIST_REMOVE(xconn->smb2.send_queue, e);
+
+			talloc_free(e->mem_ctx);
+			continue;
+		}
+
+		if (e->sendfile_header != NULL) {
+			size_t size = 0;
+			size_t i = 0;
+			uint8_t *buf;
+
+			status = NT_STATUS_INTERNAL_ERROR;
+
+			for (i=0; i < e->count; i++) {
+				size += e->vector[i].iov_len;
+			}
+
+			if (size <= e->sendfile_header->length) {
+				buf = e->sendfile_header->data;
+			} else {
+				buf = talloc_array(e->mem_ctx, uint8_t, size);
+				if (buf == NULL) {
+					return NT_STATUS_NO_MEMORY;
+				}
+			}
+
+			size = 0;
+			for (i=0; i < e->count; i++) {
+				memcpy(buf+size,
+				       e->vector[i].iov_base,
+				       e->vector[i].iov_len);
+				size += e->vector[i].iov_len;
+			}
+
+			e->sendfile_header->data = buf;
+			e->sendfile_header->length = size;
+			e->sendfile_status = &status;
+			e->count = 0;
+
+			xconn->smb2.send_queue_len--;
+			DLIST_REMOVE(xconn->smb2.send_queue, e);
+
+			size += e->sendfile_body_size;
+
+			/*
+			 * This triggers the sendfile path via
+			 * the destructor.
+			 */
+			talloc_free(e->mem_ctx);
+
+			if (!NT_STATUS_IS_OK(status)) {
+				smbXsrv_connection_disconnect_transport(xconn,
+									status);
+				return status;
+			}
+			xconn->ack.unacked_bytes += size;
+			continue;
+		}
+
+		ret = smbd_smb2_transport_send(xconn->transport.io,
+					       e->vector,
+					       e->count);
+		if (ret == 0) {
+			/* propagate end of file */
+			return NT_STATUS_INTERNAL_ERROR;
+		}
+		err = socket_error_from_errno(ret, errno, &retry);
+		if (retry) {
+			/* retry later */
+			TEVENT_FD_WRITEABLE(xconn->transport.fde);
+			return NT_STATUS_OK;
+		}
+		if (err != 0) {
+			status = map_nt_error_from_unix_common(err);
+			smbXsrv_connection_disconnect_transport(xconn,
+								status);
+			return status;
+		}
+
+		status = smbd_smb2_advance_send_queue(xconn, &e, ret);
+		if (NT_STATUS_EQUAL(status, NT_STATUS_RETRY)) {
+			/* retry later */
+			TEVENT_FD_WRITEABLE(xconn->transport.fde);
+			return NT_STATUS_OK;
+		}
+		if (!NT_STATUS_IS_OK(status)) {
+			smbXsrv_connection_disconnect_transport(xconn,
+								status);
+			return status;
+		}
+	}
+
+	return NT_STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static NTSTATUS smbd_smb2_flush_send_queue(struct smbXsrv_connection *xconn)
+{
+	NTSTATUS status;
+
+	status = smbd_smb2_flush_with_sendmsg(xconn);
+	if (!NT_STATUS_EQUAL(status, NT_STATUS_MORE_PROCESSING_REQUIRED)) {
+		return status;
+	}
+
+	/*
+	 * Restart reads if we were blocked on
+	 * draining the send queue.
+	 */
+
+	status = smbd_smb2_request_next_incoming(xconn);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+
+	return NT_STATUS_OK;
+}
+
+static NTSTATUS smbd_smb2_request_dispatch_incoming(
+	struct smbXsrv_connection *xconn,
+	struct smbd_smb2_request *req,
+	uint8_t *pktbuf,
+	size_t pktlen,
+	bool tf_decrypted,
+	size_t unread_bytes)
+{
+	struct smbd_server_connection *sconn = xconn->client->sconn;
+	NTSTATUS status;
+	NTTIME now;
+
+	now = timeval_to_nttime(&req->request_time);
+
+	status = smbd_smb2_inbuf_parse_compound(xconn,
+						now,
+						pktbuf,
+						pktlen,
+						tf_decrypted,
+						req,
+						&req->in.vector,
+						&req->in.vector_count);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+
+	if (unread_bytes > 0) {
+		req->smb1req = talloc_zero(req, struct smb_request);
+		if (req->smb1req == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+		req->smb1req->unread_bytes = unread_bytes;
+	}
+
+	req->current_idx = 1;
+
+	DEBUG(10,("smbd_smb2_request idx[%d] of %d vectors\n",
+		 req->current_idx, req->in.vector_count));
+
+	status = smbd_smb2_request_validate(req);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+
+	status = smbd_smb2_request_setup_out(req);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+
+	status = smbd_smb2_request_dispatch(req);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
+
+	sconn->num_requests++;
+
+	/* The timeout_processing function isn't run nearly
+	   often enough to implement 'max log size' without
+	   overrunning the size of the file by many megabytes.
+	   This is especially true if we are running at debug
+	   level 10.  Checking every 50 SMB2s is a nice
+	   tradeoff of performance vs log file size overrun. */
+
+	if ((sconn->num_requests % 50) == 0 &&
+	    need_to_check_log_size()) {
+		change_to_root_user();
+		check_log_size();
+	}
+
+	return NT_STATUS_OK;
+}
+
+/*
+ * Requests are dispatched in the order they were read. While a
+ * channel worker thread decrypts one, we go on reading, the
+ * requests behind it wait in xconn->smb2.incoming_queue.
+ */
+static void smbd_smb2_request_queue_incoming(struct smbXsrv_connection *xconn,
+					     struct smbd_smb2_request *req,
+					     uint8_t *pktbuf,
+					     size_t pktlen,
+					     bool tf_decrypted)
+{
+	req->incoming = (struct smbd_smb2_incoming) {
+		.req = req,
+		.queued = true,
+		.tf_decrypted = tf_decrypted,
+		.pktbuf = pktbuf,
+		.pktlen = pktlen,
+	};
+	DLIST_ADD_END(xconn->smb2.incoming_queue, &req->incoming);
+	xconn->smb2.incoming_queue_len++;
+}
+
+static NTSTATUS smbd_smb2_request_process_queued(struct smbXsrv_connection *xconn)
+{
+	while (xconn->smb2.incoming_queue != NULL) {
+		struct smbd_smb2_incoming *e = xconn->smb2.incoming_queue;
+		struct smbd_smb2_request *req = e->req;
+		NTSTATUS status;
+
+		if (req->crypto_job != NULL) {
+			/*
+			 * smbd_smb2_request_decrypt_done()
+			 * comes back here.
+			 */
+			break;
+		}
+
+		smbd_smb2_request_unqueue_incoming(req);
 
-	e->ack.required_acked_bytes = xconn->ack.unacked_bytes;
-	DLIST_ADD_END(xconn->ack.queue, e);
+		status = smbd_smb2_request_dispatch_incoming(xconn,
+							     req,
+							     e->pktbuf,
+							     e->pktlen,
+							     e->tf_decrypted,
+							     0);
+		if (!NT_STATUS_IS_OK(status)) {
+			return status;
+		}
+	}
 
-	return NT_STATUS_OK;
+	return smbd_smb2_request_next_incoming(xconn);
 }
 
-static NTSTATUS smbd_smb2_flush_with_sendmsg(struct smbXsrv_connection *xconn)
+static NTSTATUS smbd_smb2_request_process_incoming(
+	struct smbXsrv_connection *xconn)
 {
-	int ret;
-	int err;
-	bool retry;
+	struct smbd_smb2_request_read_state *state = &xconn->smb2.request_read_state;
+	struct smbd_smb2_request *req = state->req;
+	uint8_t *pktbuf = state->pktbuf;
+	size_t pktlen = state->pktlen;
+	size_t unread_bytes = 0;
 	NTSTATUS status;
 
-	if (xconn->smb2.send_queue == NULL) {
-		TEVENT_FD_NOT_WRITEABLE(xconn->transport.fde);
-		return NT_STATUS_OK;
+	if (state->doing_receivefile) {
+		unread_bytes = state->pktfull - state->pktlen;
 	}
 
-	while (xconn->smb2.send_queue != NULL) {
-		struct smbd_smb2_send_queue *e = xconn->smb2.send_queue;
-		unsigned sendmsg_flags = 0;
-
-		if (!NT_STATUS_IS_OK(xconn->transport.status)) {
-			/*
-			 * we're not supposed to do any io
-			 * just flush all pending stuff.
-			 */
-			xconn->smb2.send_queue_len--;
-			DLIST_REMOVE(xconn->smb2.send_queue, e);
+	*state = (struct smbd_smb2_request_read_state) {
+		.req = NULL,
+	};
 
-			talloc_free(e->mem_ctx);
-			continue;
-		}
+	if (xconn->smb2.incoming_queue != NULL) {
+		/*
+		 * See smbd_smb2_min_recvfile_size()
+		 */
+		SMB_ASSERT(unread_bytes == 0);
+
+		smbd_smb2_request_queue_incoming(xconn,
+						 req,
+						 pktbuf,
+						 pktlen,
+						 false);
+		return smbd_smb2_request_next_incoming(xconn);
+	}
+
+	status = smbd_smb2_request_dispatch_incoming(xconn,
+						     req,
+						     pktbuf,
+						     pktlen,
+						     false,
+						     unread_bytes);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
 
-		if (e->sendfile_header != NULL) {
-			size_t size = 0;
-			size_t i = 0;
-			uint8_t *buf;
+	status = smbd_smb2_request_next_incoming(xconn);
+	if (!NT_STATUS_IS_OK(status)) {
+		return status;
+	}
 
-			status = NT_STATUS_INTERNAL_ERROR;
+	return NT_STATUS_OK;
+}
 
-			for (i=0; i < e->count; i++) {
-				size += e->vector[i].iov_len;
-			}
+/*
+ * Returns the key to decrypt the PDU in the read state with,
+ * if that is worth doing in a channel worker thread.
+ */
+static struct smb2_signing_key *smbd_smb2_decrypt_offload_key(
+	struct smbXsrv_connection *xconn,
+	struct smbd_smb2_request_read_state *state)
+{
+	struct smbXsrv_session *session = NULL;
+	struct smb2_signing_key *key = NULL;
+	const uint8_t *tf = state->pktbuf;
+	uint64_t uid;
+	uint32_t enc_len;
+	NTTIME now;
+	NTSTATUS status;
 
-			if (size <= e->sendfile_header->length) {
-				buf = e->sendfile_header->data;
-			} else {
-				buf = talloc_array(e->mem_ctx, uint8_t, size);
-				if (buf == NULL) {
-					return NT_STATUS_NO_MEMORY;
-				}
-			}
+	if (xconn->smb2.channel_pool == NULL) {
+		return NULL;
+	}
 
-			size = 0;
-			for (i=0; i < e->count; i++) {
-				memcpy(buf+size,
-				       e->vector[i].iov_base,
-				       e->vector[i].iov_len);
-				size += e->vector[i].iov_len;
-			}
+	if (state->doing_receivefile) {
+		return NULL;
+	}
 
-			e->sendfile_header->data = buf;
-			e->sendfile_header->length = size;
-			e->sendfile_status = &status;
-			e->count = 0;
+	if (state->pktlen < SMB2_TF_HDR_SIZE +
+	    SMBD_SMB2_CRYPTO_OFFLOAD_MIN_SIZE)
+	{
+		return NULL;
+	}
 
-			xconn->smb2.send_queue_len--;
-			DLIST_REMOVE(xconn->smb2.send_queue, e);
+	if (IVAL(tf, 0) != SMB2_TF_MAGIC) {
+		return NULL;
+	}
 
-			size += e->sendfile_body_size;
+	/*
+	 * Only a single transform covering the whole PDU,
+	 * e.g. a large WRITE. Everything else, including all
+	 * error handling, is left to
+	 * smbd_smb2_inbuf_parse_compound().
+	 */
+	enc_len = IVAL(tf, SMB2_TF_MSG_SIZE);
+	if (state->pktlen != SMB2_TF_HDR_SIZE + (size_t)enc_len) {
+		return NULL;
+	}
 
-			/*
-			 * This triggers the sendfile path via
-			 * the destructor.
-			 */
-			talloc_free(e->mem_ctx);
+	if (xconn->protocol < PROTOCOL_SMB3_00) {
+		return NULL;
+	}
 
-			if (!NT_STATUS_IS_OK(status)) {
-				smbXsrv_connection_disconnect_transport(xconn,
-									status);
-				return status;
-			}
-			xconn->ack.unacked_bytes += size;
-			continue;
-		}
+	if (xconn->smb2.server.cipher == 0) {
+		return NULL;
+	}
 
-		e->msg = (struct msghdr) {
-			.msg_iov = e->vector,
-			.msg_iovlen = e->count,
-		};
+	if (!xconn->smb2.got_authenticated_session) {
+		return NULL;
+	}
 
-#ifdef MSG_NOSIGNAL
-		sendmsg_flags |= MSG_NOSIGNAL;
-#endif
-#ifdef MSG_DONTWAIT
-		sendmsg_flags |= MSG_DONTWAIT;
-#endif
+	uid = BVAL(tf, SMB2_TF_SESSION_ID);
+	now = timeval_to_nttime(&state->req->request_time);
 
-		ret = sendmsg(xconn->transport.sock, &e->msg, sendmsg_flags);
-		if (ret == 0) {
-			/* propagate end of file */
-			return NT_STATUS_INTERNAL_ERROR;
-		}
-		err = socket_error_from_errno(ret, errno, &retry);
-		if (retry) {
-			/* retry later */
-			TEVENT_FD_WRITEABLE(xconn->transport.fde);
-			return NT_STATUS_OK;
-		}
-		if (err != 0) {
-			status = map_nt_error_from_unix_common(err);
-			smbXsrv_connection_disconnect_transport(xconn,
-								status);
-			return status;
-		}
+	status = smb2srv_session_lookup_conn(xconn, uid, now, &session);
+	if (!NT_STATUS_IS_OK(status)) {
+		return NULL;
+	}
 
-		status = smbd_smb2_advance_send_queue(xconn, &e, ret);
-		if (NT_STATUS_EQUAL(status, NT_STATUS_RETRY)) {
-			/* retry later */
-			TEVENT_FD_WRITEABLE(xconn->transport.fde);
-			return NT_STATUS_OK;
-		}
-		if (!NT_STATUS_IS_OK(status)) {
-			smbXsrv_connection_disconnect_transport(xconn,
-								status);
-			return status;
-		}
+	key = session->global->decryption_key;
+	if (!smbd_smb2_crypto_offload_cipher(key)) {
+		return NULL;
 	}
 
-	return NT_STATUS_MORE_PROCESSING_REQUIRED;
+	return key;
 }
 
-static NTSTATUS smbd_smb2_flush_send_queue(struct smbXsrv_connection *xconn)
+static void smbd_smb2_request_decrypt_done(struct tevent_req *subreq);
+
+static NTSTATUS smbd_smb2_request_decrypt_offload(
+	struct smbXsrv_connection *xconn,
+	struct smb2_signing_key *decryption_key)
 {
+	struct smbd_smb2_request_read_state *state = &xconn->smb2.request_read_state;
+	struct smbd_smb2_request *req = state->req;
+	uint8_t *pktbuf = state->pktbuf;
+	size_t pktlen = state->pktlen;
+	struct iovec tf_iov[2];
 	NTSTATUS status;
 
-	status = smbd_smb2_flush_with_sendmsg(xconn);
-	if (!NT_STATUS_EQUAL(status, NT_STATUS_MORE_PROCESSING_REQUIRED)) {
+	tf_iov[0] = (struct iovec) {
+		.iov_base = state->pktbuf,
+		.iov_len = SMB2_TF_HDR_SIZE,
+	};
+	tf_iov[1] = (struct iovec) {
+		.iov_base = state->pktbuf + SMB2_TF_HDR_SIZE,
+		.iov_len = state->pktlen - SMB2_TF_HDR_SIZE,
+	};
+
+	/*
+	 * The job takes over pktbuf and decrypts it in place,
+	 * smbd_smb2_request_decrypt_done() gets it back.
+	 */
+	status = smbd_smb2_crypto_job_send(state->req,
+					   decryption_key,
+					   smb2_signing_decrypt_pdu_nolog,
+					   state->pktbuf,
+					   tf_iov,
+					   ARRAY_SIZE(tf_iov),
+					   smbd_smb2_request_decrypt_done);
+	if (!NT_STATUS_IS_OK(status)) {
 		return status;
 	}
 
+	*state = (struct smbd_smb2_request_read_state) {
+		.req = NULL,
+	};
+
 	/*
-	 * Restart reads if we were blocked on
-	 * draining the send queue.
+	 * Requests are dispatched in order, the ones we read
+	 * meanwhile are queued behind this one.
 	 */
+	smbd_smb2_request_queue_incoming(xconn, req, pktbuf, pktlen, true);
 
-	status = smbd_smb2_request_next_incoming(xconn);
+	return smbd_smb2_request_next_incoming(xconn);
+}
+
+static void smbd_smb2_request_decrypt_done(struct tevent_req *subreq)
+{
+	struct smbd_smb2_request *req = NULL;
+	struct smbXsrv_connection *xconn = NULL;
+	uint8_t *buf = NULL;
+	NTSTATUS status;
+
+	status = smbd_smb2_crypto_job_recv(subreq, &req, &buf);
+	xconn = req->xconn;
 	if (!NT_STATUS_IS_OK(status)) {
-		return status;
+		smbd_server_connection_terminate(xconn, nt_errstr(status));
+		return;
 	}
+	SMB_ASSERT(buf == req->incoming.pktbuf);
 
-	return NT_STATUS_OK;
+	status = smbd_smb2_request_process_queued(xconn);
+	if (!NT_STATUS_IS_OK(status)) {
+		smbd_server_connection_terminate(xconn, nt_errstr(status));
+		return;
+	}
 }
 
 static NTSTATUS smbd_smb2_advance_incoming(struct smbXsrv_connection *xconn, size_t n)
 {
-	struct smbd_server_connection *sconn = xconn->client->sconn;
 	struct smbd_smb2_request_read_state *state = &xconn->smb2.request_read_state;
 	struct smbd_smb2_request *req = NULL;
+	struct smb2_signing_key *decryption_key = NULL;
 	size_t min_recvfile_size = UINT32_MAX;
-	NTSTATUS status;
-	NTTIME now;
 	bool ok;
 
 	ok = iov_advance(&state->vector, &state->count, n);
@@ -5037,7 +5997,7 @@ got_full:
 		req = state->req;
 		*state = (struct smbd_smb2_request_read_state) {
 			.req = req,
-			.min_recv_size = lp_min_receive_file_size(),
+			.min_recv_size = smbd_smb2_min_recvfile_size(xconn),
 			._vector = {
 				[0] = (struct iovec) {
 					.iov_base = (void *)state->hdr.nbt,
@@ -5053,79 +6013,20 @@ got_full:
 	req = state->req;
 
 	req->request_time = timeval_current();
-	now = timeval_to_nttime(&req->request_time);
 
-	status = smbd_smb2_inbuf_parse_compound(xconn,
-						now,
-						state->pktbuf,
-						state->pktlen,
-						req,
-						&req->in.vector,
-						&req->in.vector_count);
-	if (!NT_STATUS_IS_OK(status)) {
-		return status;
-	}
-
-	if (state->doing_receivefile) {
-		req->smb1req = talloc_zero(req, struct smb_request);
-		if (req->smb1req == NULL) {
-			return NT_STATUS_NO_MEMORY;
-		}
-		req->smb1req->unread_bytes = state->pktfull - state->pktlen;
-	}
-
-	*state = (struct smbd_smb2_request_read_state) {
-		.req = NULL,
-	};
-
-	req->current_idx = 1;
-
-	DEBUG(10,("smbd_smb2_request idx[%d] of %d vectors\n",
-		 req->current_idx, req->in.vector_count));
-
-	status = smbd_smb2_request_validate(req);
-	if (!NT_STATUS_IS_OK(status)) {
-		return status;
-	}
-
-	status = smbd_smb2_request_setup_out(req);
-	if (!NT_STATUS_IS_OK(status)) {
-		return status;
-	}
-
-	status = smbd_smb2_request_dispatch(req);
-	if (!NT_STATUS_IS_OK(status)) {
-		return status;
-	}
-
-	sconn->num_requests++;
-
-	/* The timeout_processing function isn't run nearly
-	   often enough to implement 'max log size' without
-	   overrunning the size of the file by many megabytes.
-	   This is especially true if we are running at debug
-	   level 10.  Checking every 50 SMB2s is a nice
-	   tradeoff of performance vs log file size overrun. */
-
-	if ((sconn->num_requests % 50) == 0 &&
-	    need_to_check_log_size()) {
-		change_to_root_user();
-		check_log_size();
-	}
-
-	status = smbd_smb2_request_next_incoming(xconn);
-	if (!NT_STATUS_IS_OK(status)) {
-		return status;
+	decryption_key = smbd_smb2_decrypt_offload_key(xconn, state);
+	if (decryption_key != NULL) {
+		return smbd_smb2_request_decrypt_offload(xconn,
+							 decryption_key);
 	}
 
-	return NT_STATUS_OK;
+	return smbd_smb2_request_process_incoming(xconn);
 }
 
 static NTSTATUS smbd_smb2_io_handler(struct smbXsrv_connection *xconn,
 				     uint16_t fde_flags)
 {
 	struct smbd_smb2_request_read_state *state = &xconn->smb2.request_read_state;
-	unsigned recvmsg_flags = 0;
 	int ret;
 	int err;
 	bool retry;
@@ -5175,19 +6076,9 @@ static NTSTATUS smbd_smb2_io_handler(struct smbXsrv_connection *xconn,
 
 again:
 
-	state->msg = (struct msghdr) {
-		.msg_iov = state->vector,
-		.msg_iovlen = state->count,
-	};
-
-#ifdef MSG_NOSIGNAL
-	recvmsg_flags |= MSG_NOSIGNAL;
-#endif
-#ifdef MSG_DONTWAIT
-	recvmsg_flags |= MSG_DONTWAIT;
-#endif
-
-	ret = recvmsg(xconn->transport.sock, &state->msg, recvmsg_flags);
+	ret = smbd_smb2_transport_recv(xconn->transport.io,
+				       state->vector,
+				       state->count);
 	if (ret == 0) {
 		/* propagate end of file */
 		status = NT_STATUS_END_OF_FILE;
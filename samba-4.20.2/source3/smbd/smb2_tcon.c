@@ -425,6 +425,11 @@ static NTSTATUS smbd_smb2_tree_connect(struct smbd_smb2_request *req,
 		*out_share_flags |= SMB2_SHAREFLAG_ENCRYPT_DATA;
 	}
 
+	if (conn->smb2.compression != NULL &&
+	    lp_smb2_compress_data(SNUM(tcon->compat))) {
+		*out_share_flags |= SMB2_SHAREFLAG_COMPRESS_DATA;
+	}
+
 	/*
 	 * For disk shares we can change the client
 	 * behavior on a cluster...
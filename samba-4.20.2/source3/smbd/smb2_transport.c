@@ -0,0 +1,121 @@
+/*
+ * Unix SMB/CIFS implementation.
+ *
+ * Byte stream transport of the SMB2 server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "replace.h"
+#include "system/network.h"
+#include "system/filesys.h"
+#include "lib/util/blocking.h"
+#include "lib/util/debug.h"
+#include "libcli/util/error.h"
+#include "source3/smbd/smb2_transport.h"
+
+/*
+ * Sockets (TCP, AF_UNIX) with sendmsg()/recvmsg(), the fd stays in
+ * blocking mode if we have MSG_DONTWAIT, so that sendfile() and
+ * recvfile() can use it.
+ */
+
+static int smbd_smb2_transport_socket_setup(struct smbd_smb2_transport *t)
+{
+#ifdef MSG_DONTWAIT
+	return set_blocking(t->fd, true);
+#else
+	return set_blocking(t->fd, false);
+#endif
+}
+
+static int smbd_smb2_transport_socket_flags(void)
+{
+	int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+#ifdef MSG_DONTWAIT
+	flags |= MSG_DONTWAIT;
+#endif
+	return flags;
+}
+
+static ssize_t smbd_smb2_transport_socket_recv(struct smbd_smb2_transport *t,
+					       struct iovec *iov,
+					       int iovcnt)
+{
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = iovcnt,
+	};
+
+	return recvmsg(t->fd, &msg, smbd_smb2_transport_socket_flags());
+}
+
+static ssize_t smbd_smb2_transport_socket_send(struct smbd_smb2_transport *t,
+					       const struct iovec *iov,
+					       int iovcnt)
+{
+	struct msghdr msg = {
+		.msg_iov = discard_const_p(struct iovec, iov),
+		.msg_iovlen = iovcnt,
+	};
+
+	return sendmsg(t->fd, &msg, smbd_smb2_transport_socket_flags());
+}
+
+static const struct smbd_smb2_transport_ops smbd_smb2_transport_socket_ops = {
+	.name = "socket",
+	.setup_fn = smbd_smb2_transport_socket_setup,
+	.recv_fn = smbd_smb2_transport_socket_recv,
+	.send_fn = smbd_smb2_transport_socket_send,
+	.zero_copy = true,
+};
+
+NTSTATUS smbd_smb2_transport_create(TALLOC_CTX *mem_ctx,
+				    int fd,
+				    struct smbd_smb2_transport **_t)
+{
+	const struct smbd_smb2_transport_ops *ops =
+		&smbd_smb2_transport_socket_ops;
+	struct smbd_smb2_transport *t = NULL;
+	int ret;
+
+	t = talloc_zero(mem_ctx, struct smbd_smb2_transport);
+	if (t == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+	*t = (struct smbd_smb2_transport) {
+		.ops = ops,
+		.fd = fd,
+	};
+
+	if (ops->setup_fn != NULL) {
+		ret = ops->setup_fn(t);
+		if (ret == -1) {
+			NTSTATUS status = map_nt_error_from_unix_common(errno);
+			DBG_ERR("Setting up SMB2 transport [%s] failed: %s\n",
+				ops->name, strerror(errno));
+			TALLOC_FREE(t);
+			return status;
+		}
+	}
+
+	DBG_DEBUG("Using SMB2 transport [%s] on fd %d\n", ops->name, fd);
+
+	*_t = t;
+	return NT_STATUS_OK;
+}
@@ -0,0 +1,91 @@
+/*
+ * Unix SMB/CIFS implementation.
+ *
+ * Byte stream transport of the SMB2 server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SMBD_SMB2_TRANSPORT_H__
+#define __SMBD_SMB2_TRANSPORT_H__
+
+#include "replace.h"
+#include "system/network.h"
+#include "libcli/util/ntstatus.h"
+#include <talloc.h>
+
+struct smbd_smb2_transport;
+
+/*
+ * The SMB2 server waits for the fd of a transport to become
+ * readable or writeable (with tevent) and then calls recv_fn or
+ * send_fn, which must not block.
+ *
+ * Both return the number of bytes transferred, 0 for end of file
+ * (recv_fn only), or -1 with errno set. EAGAIN and EINTR mean
+ * "try again once the fd is ready".
+ */
+struct smbd_smb2_transport_ops {
+	const char *name;
+
+	/*
+	 * Optional, called once for every new transport, e.g. to
+	 * set up the fd mode or t->private_data. Returns 0 or -1
+	 * with errno set.
+	 */
+	int (*setup_fn)(struct smbd_smb2_transport *t);
+
+	ssize_t (*recv_fn)(struct smbd_smb2_transport *t,
+			   struct iovec *iov,
+			   int iovcnt);
+	ssize_t (*send_fn)(struct smbd_smb2_transport *t,
+			   const struct iovec *iov,
+			   int iovcnt);
+
+	/*
+	 * Whether file data may be moved between the fd and files
+	 * directly, with SMB_VFS_SENDFILE() and SMB_VFS_RECVFILE().
+	 */
+	bool zero_copy;
+};
+
+struct smbd_smb2_transport {
+	const struct smbd_smb2_transport_ops *ops;
+	int fd;
+	void *private_data;
+};
+
+/*
+ * Creates a transport on fd (the caller keeps owning it). For
+ * now there is only the "socket" one.
+ */
+NTSTATUS smbd_smb2_transport_create(TALLOC_CTX *mem_ctx,
+				    int fd,
+				    struct smbd_smb2_transport **_t);
+
+static inline ssize_t smbd_smb2_transport_recv(struct smbd_smb2_transport *t,
+					       struct iovec *iov,
+					       int iovcnt)
+{
+	return t->ops->recv_fn(t, iov, iovcnt);
+}
+
+static inline ssize_t smbd_smb2_transport_send(struct smbd_smb2_transport *t,
+					       const struct iovec *iov,
+					       int iovcnt)
+{
+	return t->ops->send_fn(t, iov, iovcnt);
+}
+
+#endif /* __SMBD_SMB2_TRANSPORT_H__ */
@@ -68,7 +68,8 @@ NTSTATUS smbXsrv_open_global_init(void)
 
 	db_ctx = db_open(NULL, global_path,
 			 SMBD_VOLATILE_TDB_HASH_SIZE,
-			 SMBD_VOLATILE_TDB_FLAGS,
+			 SMBD_VOLATILE_TDB_FLAGS |
+			 SMBD_VOLATILE_TDB_REHASH_FLAGS,
 			 O_RDWR | O_CREAT, 0600,
 			 DBWRAP_LOCK_ORDER_1,
 			 DBWRAP_FLAG_NONE);
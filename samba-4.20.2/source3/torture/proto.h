@@ -168,6 +168,8 @@ bool run_messaging_fdpass2(int dummy);
 bool run_messaging_fdpass2a(int dummy);
 bool run_messaging_fdpass2b(int dummy);
 bool run_messaging_send_all(int dummy);
+bool run_messaging_coalesce(int dummy);
+bool run_messaging_shm(int dummy);
 bool run_oplock_cancel(int dummy);
 bool run_pthreadpool_tevent(int dummy);
 bool run_g_lock1(int dummy);
@@ -180,6 +182,8 @@ bool run_g_lock6(int dummy);
 bool run_g_lock7(int dummy);
 bool run_g_lock8(int dummy);
 bool run_g_lock_ping_pong(int dummy);
+bool run_g_lock_fifo1(int dummy);
+bool run_g_lock_fifo_bench(int dummy);
 bool run_local_namemap_cache1(int dummy);
 bool run_local_idmap_cache1(int dummy);
 bool run_hidenewfiles(int dummy);
@@ -188,5 +192,7 @@ bool run_readdir_timestamp(int dummy);
 bool run_ctdbd_conn1(int dummy);
 bool run_rpc_scale(int dummy);
 bool run_tdb_validate(int dummy);
+bool run_local_dbwrap_btree(int dummy);
+bool run_local_dbwrap_btree_bench(int dummy);
 
 #endif /* __TORTURE_H__ */
@@ -0,0 +1,495 @@
+/*
+ * Unix SMB/CIFS implementation.
+ * Test the in-memory B+tree dbwrap backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "torture/proto.h"
+#include "lib/dbwrap/dbwrap.h"
+#include "lib/dbwrap/dbwrap_rbt.h"
+#include "lib/dbwrap/dbwrap_btree.h"
+#include "lib/util/time.h"
+
+#define BTREE_TEST_ROUNDS 10
+#define BTREE_TEST_OPS 20000
+#define BTREE_BENCH_KEYS 1000000
+
+static TDB_DATA btree_test_key(char *buf, size_t buflen, unsigned round)
+{
+	long r = random();
+	int len;
+
+	/*
+	 * Mix short keys and keys with a common 8-byte prefix, so
+	 * both the prefix and the full comparison get exercised
+	 */
+	len = snprintf(buf, buflen, "%s%ld",
+		       (r & 1) ? "k" : "prefixed",
+		       random() % (1 + round * 400));
+	if ((r & 6) == 0) {
+		len = MAX(len - 2, 0);
+	}
+	return make_tdb_data((uint8_t *)buf, len);
+}
+
+static bool btree_test_store(struct db_context *db, TDB_DATA key,
+			     TDB_DATA value)
+{
+	NTSTATUS status;
+
+	status = dbwrap_store(db, key, value, 0);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "dbwrap_store failed: %s\n",
+			nt_errstr(status));
+		return false;
+	}
+	return true;
+}
+
+struct btree_test_state {
+	struct db_context *btree;
+	struct db_context *rbt;
+	TDB_DATA last;
+	bool ok;
+};
+
+static int btree_test_order_fn(struct db_record *rec, void *private_data)
+{
+	struct btree_test_state *state = private_data;
+	TDB_DATA key = dbwrap_record_get_key(rec);
+	TDB_DATA value = dbwrap_record_get_value(rec);
+	TDB_DATA other;
+	NTSTATUS status;
+	int cmp;
+
+	if (state->last.dptr != NULL) {
+		cmp = memcmp(state->last.dptr, key.dptr,
+			     MIN(state->last.dsize, key.dsize));
+		if ((cmp > 0) ||
+		    ((cmp == 0) && (state->last.dsize >= key.dsize))) {
+			fprintf(stderr, "traverse out of order\n");
+			state->ok = false;
+		}
+	}
+
+	TALLOC_FREE(state->last.dptr);
+	state->last = (TDB_DATA) {
+		.dptr = talloc_memdup(state, key.dptr, key.dsize),
+		.dsize = key.dsize,
+	};
+
+	status = dbwrap_fetch(state->rbt, talloc_tos(), key, &other);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "key missing in rbt: %s\n",
+			nt_errstr(status));
+		state->ok = false;
+		return 0;
+	}
+	if ((value.dsize != other.dsize) ||
+	    (memcmp(value.dptr, other.dptr, value.dsize) != 0)) {
+		fprintf(stderr, "value mismatch\n");
+		state->ok = false;
+	}
+	TALLOC_FREE(other.dptr);
+
+	return 0;
+}
+
+static int btree_test_count_fn(struct db_record *rec, void *private_data)
+{
+	return 0;
+}
+
+/*
+ * Both databases must have the same contents, and the B+tree must
+ * traverse in key order
+ */
+
+static bool btree_test_compare(struct btree_test_state *state)
+{
+	NTSTATUS status;
+	int count_btree = 0;
+	int count_rbt = 0;
+
+	state->ok = true;
+	TALLOC_FREE(state->last.dptr);
+
+	status = dbwrap_traverse_read(state->btree, btree_test_order_fn,
+				      state, &count_btree);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "dbwrap_traverse_read failed: %s\n",
+			nt_errstr(status));
+		return false;
+	}
+
+	status = dbwrap_traverse_read(state->rbt, btree_test_count_fn,
+				      NULL, &count_rbt);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "dbwrap_traverse_read failed: %s\n",
+			nt_errstr(status));
+		return false;
+	}
+
+	if (count_btree != count_rbt) {
+		fprintf(stderr, "btree has %d records, rbt %d\n",
+			count_btree, count_rbt);
+		return false;
+	}
+
+	return state->ok;
+}
+
+/*
+ * Change the tree underneath the traverse: delete the current
+ * record, grow it, or add a new one elsewhere
+ */
+
+static int btree_test_modify_fn(struct db_record *rec, void *private_data)
+{
+	struct btree_test_state *state = private_data;
+	TDB_DATA key = dbwrap_record_get_key(rec);
+	uint8_t buf[128] = { 0 };
+	char newkey[32];
+	NTSTATUS status;
+
+	key.dptr = talloc_memdup(state, key.dptr, key.dsize);
+	if (key.dptr == NULL) {
+		state->ok = false;
+		return -1;
+	}
+
+	switch (random() % 4) {
+	case 0:
+		status = dbwrap_record_delete(rec);
+		if (NT_STATUS_IS_OK(status)) {
+			status = dbwrap_delete(state->rbt, key);
+		}
+		break;
+	case 1: {
+		TDB_DATA value = make_tdb_data(buf, 64 + random() % 64);
+
+		status = dbwrap_record_store(rec, value, 0);
+		if (NT_STATUS_IS_OK(status)) {
+			status = dbwrap_store(state->rbt, key, value, 0);
+		}
+		break;
+	}
+	case 2: {
+		TDB_DATA nkey;
+
+		snprintf(newkey, sizeof(newkey), "new%ld", random() % 5000);
+		nkey = string_tdb_data(newkey);
+
+		status = dbwrap_store(state->btree, nkey,
+				      make_tdb_data(buf, 3), 0);
+		if (NT_STATUS_IS_OK(status)) {
+			status = dbwrap_store(state->rbt, nkey,
+					      make_tdb_data(buf, 3), 0);
+		}
+		break;
+	}
+	default:
+		status = NT_STATUS_OK;
+		break;
+	}
+
+	TALLOC_FREE(key.dptr);
+
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "modify failed: %s\n", nt_errstr(status));
+		state->ok = false;
+		return -1;
+	}
+	return 0;
+}
+
+static int btree_test_write_fn(struct db_record *rec, void *private_data)
+{
+	bool *ok = private_data;
+	NTSTATUS status;
+
+	status = dbwrap_record_delete(rec);
+	if (!NT_STATUS_EQUAL(status, NT_STATUS_MEDIA_WRITE_PROTECTED)) {
+		fprintf(stderr, "delete in traverse_read returned %s\n",
+			nt_errstr(status));
+		*ok = false;
+	}
+	return 1;
+}
+
+static bool btree_test_flags(struct db_context *db)
+{
+	struct db_record *rec;
+	TDB_DATA key = string_tdb_data("flagkey");
+	NTSTATUS status;
+	bool ret = false;
+
+	rec = dbwrap_fetch_locked(db, db, key);
+	if (rec == NULL) {
+		fprintf(stderr, "dbwrap_fetch_locked failed\n");
+		return false;
+	}
+
+	status = dbwrap_record_store(rec, string_tdb_data("v"), TDB_MODIFY);
+	if (!NT_STATUS_EQUAL(status, NT_STATUS_OBJECT_NAME_NOT_FOUND)) {
+		fprintf(stderr, "TDB_MODIFY returned %s\n", nt_errstr(status));
+		goto done;
+	}
+	status = dbwrap_record_store(rec, string_tdb_data("v"), TDB_INSERT);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "TDB_INSERT returned %s\n", nt_errstr(status));
+		goto done;
+	}
+	status = dbwrap_record_store(rec, string_tdb_data("v"), TDB_INSERT);
+	if (!NT_STATUS_EQUAL(status, NT_STATUS_OBJECT_NAME_COLLISION)) {
+		fprintf(stderr, "TDB_INSERT returned %s\n", nt_errstr(status));
+		goto done;
+	}
+	status = dbwrap_record_store(rec, string_tdb_data("longer value"),
+				     TDB_MODIFY);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "TDB_MODIFY returned %s\n", nt_errstr(status));
+		goto done;
+	}
+	status = dbwrap_record_delete(rec);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "delete returned %s\n", nt_errstr(status));
+		goto done;
+	}
+	if (dbwrap_exists(db, key)) {
+		fprintf(stderr, "deleted key still exists\n");
+		goto done;
+	}
+
+	ret = true;
+done:
+	TALLOC_FREE(rec);
+	return ret;
+}
+
+bool run_local_dbwrap_btree(int dummy)
+{
+	TALLOC_CTX *frame = talloc_stackframe();
+	struct btree_test_state *state = NULL;
+	uint8_t buf[200] = { 0 };
+	unsigned round;
+	int i, count;
+	bool ok = true;
+	bool ret = false;
+	NTSTATUS status;
+
+	state = talloc_zero(frame, struct btree_test_state);
+	if (state == NULL) {
+		goto fail;
+	}
+
+	srandom(1);
+
+	for (round = 0; round < BTREE_TEST_ROUNDS; round++) {
+		state->btree = db_open_btree(state);
+		state->rbt = db_open_rbt(state);
+		if ((state->btree == NULL) || (state->rbt == NULL)) {
+			fprintf(stderr, "db_open failed\n");
+			goto fail;
+		}
+
+		if (!btree_test_flags(state->btree)) {
+			goto fail;
+		}
+
+		for (i = 0; i < BTREE_TEST_OPS; i++) {
+			char keybuf[32];
+			TDB_DATA key, value;
+			bool in_btree, in_rbt;
+
+			key = btree_test_key(keybuf, sizeof(keybuf), round);
+			value = make_tdb_data(buf, random() % sizeof(buf));
+
+			switch (random() % 10) {
+			case 0: case 1: case 2: case 3: case 4: case 5:
+				if (!btree_test_store(state->btree, key,
+						      value) ||
+				    !btree_test_store(state->rbt, key,
+						      value)) {
+					goto fail;
+				}
+				break;
+			case 6: case 7: case 8:
+				dbwrap_delete(state->btree, key);
+				dbwrap_delete(state->rbt, key);
+				break;
+			default:
+				in_btree = dbwrap_exists(state->btree, key);
+				in_rbt = dbwrap_exists(state->rbt, key);
+				if (in_btree != in_rbt) {
+					fprintf(stderr, "exists mismatch\n");
+					goto fail;
+				}
+				break;
+			}
+		}
+
+		if (!btree_test_compare(state)) {
+			goto fail;
+		}
+
+		state->ok = true;
+		status = dbwrap_traverse(state->btree, btree_test_modify_fn,
+					 state, NULL);
+		if (!NT_STATUS_IS_OK(status) || !state->ok) {
+			fprintf(stderr, "dbwrap_traverse failed: %s\n",
+				nt_errstr(status));
+			goto fail;
+		}
+
+		if (!btree_test_compare(state)) {
+			goto fail;
+		}
+
+		status = dbwrap_traverse_read(state->btree,
+					      btree_test_write_fn, &ok, NULL);
+		if (!ok) {
+			goto fail;
+		}
+
+		status = dbwrap_wipe(state->btree);
+		if (!NT_STATUS_IS_OK(status)) {
+			fprintf(stderr, "dbwrap_wipe failed: %s\n",
+				nt_errstr(status));
+			goto fail;
+		}
+		status = dbwrap_traverse_read(state->btree,
+					      btree_test_count_fn, NULL,
+					      &count);
+		if (!NT_STATUS_IS_OK(status) || (count != 0)) {
+			fprintf(stderr, "wiped db has %d records\n", count);
+			goto fail;
+		}
+
+		TALLOC_FREE(state->btree);
+		TALLOC_FREE(state->rbt);
+	}
+
+	ret = true;
+fail:
+	TALLOC_FREE(frame);
+	return ret;
+}
+
+static int btree_bench_traverse_fn(struct db_record *rec,
+				   void *private_data)
+{
+	size_t *bytes = private_data;
+	*bytes += dbwrap_record_get_value(rec).dsize;
+	return 0;
+}
+
+static bool btree_bench_one(const char *name,
+			    struct db_context *(*open_fn)(TALLOC_CTX *mem_ctx),
+			    const uint32_t *keys, size_t num_keys)
+{
+	struct db_context *db;
+	struct timeval start;
+	double insert, lookup, traverse;
+	size_t i, bytes = 0;
+	NTSTATUS status;
+	int count;
+
+	db = open_fn(talloc_tos());
+	if (db == NULL) {
+		fprintf(stderr, "open %s failed\n", name);
+		return false;
+	}
+
+	start = timeval_current();
+	for (i = 0; i < num_keys; i++) {
+		char keybuf[32];
+
+		snprintf(keybuf, sizeof(keybuf), "key/%08"PRIx32, keys[i]);
+		status = dbwrap_store_bystring(db, keybuf,
+					       string_tdb_data("value"), 0);
+		if (!NT_STATUS_IS_OK(status)) {
+			fprintf(stderr, "store failed: %s\n",
+				nt_errstr(status));
+			TALLOC_FREE(db);
+			return false;
+		}
+	}
+	insert = timeval_elapsed(&start);
+
+	start = timeval_current();
+	for (i = 0; i < num_keys; i++) {
+		char keybuf[32];
+
+		snprintf(keybuf, sizeof(keybuf), "key/%08"PRIx32,
+			 keys[(i * 7919) % num_keys]);
+		if (!dbwrap_exists(db, string_tdb_data(keybuf))) {
+			fprintf(stderr, "%s not found\n", keybuf);
+			TALLOC_FREE(db);
+			return false;
+		}
+	}
+	lookup = timeval_elapsed(&start);
+
+	start = timeval_current();
+	status = dbwrap_traverse_read(db, btree_bench_traverse_fn, &bytes,
+				      &count);
+	traverse = timeval_elapsed(&start);
+
+	TALLOC_FREE(db);
+
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "traverse failed: %s\n", nt_errstr(status));
+		return false;
+	}
+
+	printf("%-6s %zu keys: insert %.3fs, lookup %.3fs, "
+	       "traverse %.3fs\n",
+	       name, num_keys, insert, lookup, traverse);
+
+	return true;
+}
+
+bool run_local_dbwrap_btree_bench(int dummy)
+{
+	TALLOC_CTX *frame = talloc_stackframe();
+	uint32_t *keys;
+	size_t i;
+	bool ret = false;
+
+	keys = talloc_array(frame, uint32_t, BTREE_BENCH_KEYS);
+	if (keys == NULL) {
+		goto fail;
+	}
+
+	/* distinct keys in a scrambled order */
+	for (i = 0; i < BTREE_BENCH_KEYS; i++) {
+		keys[i] = (uint32_t)i * 2654435761U;
+	}
+
+	if (!btree_bench_one("rbt", db_open_rbt, keys, BTREE_BENCH_KEYS)) {
+		goto fail;
+	}
+	if (!btree_bench_one("btree", db_open_btree, keys,
+			     BTREE_BENCH_KEYS)) {
+		goto fail;
+	}
+
+	ret = true;
+fail:
+	TALLOC_FREE(frame);
+	return ret;
+}
@@ -1401,3 +1401,436 @@ fail:
 	TALLOC_FREE(ev);
 	return ret;
 }
+
+/*
+ * Test the fifo mode: Waiters must get the lock in the order they
+ * queued up, consecutive readers together.
+ */
+
+static bool lock_fifo1_child(struct messaging_context *msg,
+			     struct tevent_context *ev,
+			     const char *lockname,
+			     size_t idx,
+			     enum g_lock_type type,
+			     int ready_fd,
+			     int result_fd)
+{
+	struct g_lock_ctx *ctx = NULL;
+	struct tevent_req *req = NULL;
+	NTSTATUS status;
+	uint8_t c;
+	bool ok;
+
+	status = reinit_after_fork(msg, ev, false);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "reinit_after_fork failed: %s\n",
+			nt_errstr(status));
+		return false;
+	}
+
+	ok = get_g_lock_ctx(talloc_tos(), &ev, &msg, &ctx);
+	if (!ok) {
+		fprintf(stderr, "get_g_lock_ctx failed");
+		return false;
+	}
+	g_lock_set_fifo(ctx, true);
+
+	req = g_lock_lock_send(
+		ev, ev, ctx, string_term_tdb_data(lockname), type, NULL, NULL);
+	if (req == NULL) {
+		fprintf(stderr, "g_lock_lock_send failed\n");
+		return false;
+	}
+
+	/*
+	 * g_lock_lock_send() queued us synchronously
+	 */
+	c = idx;
+	if (sys_write(ready_fd, &c, sizeof(c)) != sizeof(c)) {
+		perror("write failed");
+		return false;
+	}
+
+	ok = tevent_req_poll_ntstatus(req, ev, &status);
+	if (!ok) {
+		fprintf(stderr, "tevent_req_poll_ntstatus failed\n");
+		return false;
+	}
+	status = g_lock_lock_recv(req);
+	TALLOC_FREE(req);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "g_lock_lock failed: %s\n",
+			nt_errstr(status));
+		return false;
+	}
+
+	c = idx;
+	if (sys_write(result_fd, &c, sizeof(c)) != sizeof(c)) {
+		perror("write failed");
+		return false;
+	}
+
+	/*
+	 * Give the other readers of our batch a chance to overlap
+	 */
+	smb_msleep(100);
+
+	c = idx | 0x80;
+	if (sys_write(result_fd, &c, sizeof(c)) != sizeof(c)) {
+		perror("write failed");
+		return false;
+	}
+
+	status = g_lock_unlock(ctx, string_term_tdb_data(lockname));
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "g_lock_unlock failed: %s\n",
+			nt_errstr(status));
+		return false;
+	}
+
+	return true;
+}
+
+bool run_g_lock_fifo1(int dummy)
+{
+	struct tevent_context *ev = NULL;
+	struct messaging_context *msg = NULL;
+	struct g_lock_ctx *ctx = NULL;
+	const char *lockname = "lock_fifo1";
+	TDB_DATA key = string_term_tdb_data(lockname);
+	const enum g_lock_type types[] = {
+		G_LOCK_READ, G_LOCK_READ, G_LOCK_WRITE,
+		G_LOCK_READ, G_LOCK_WRITE, G_LOCK_WRITE,
+		G_LOCK_READ, G_LOCK_READ, G_LOCK_READ,
+	};
+	size_t nprocs = ARRAY_SIZE(types);
+	size_t batch[ARRAY_SIZE(types)];
+	bool granted[ARRAY_SIZE(types)] = { false, };
+	size_t num_readers = 0, num_writers = 0;
+	int ready_pipe[2], result_pipe[2];
+	NTSTATUS status;
+	size_t i, j;
+	bool ret = false;
+	bool ok;
+	uint8_t c;
+
+	if ((pipe(ready_pipe) != 0) || (pipe(result_pipe) != 0)) {
+		perror("pipe failed");
+		return false;
+	}
+
+	ok = get_g_lock_ctx(talloc_tos(), &ev, &msg, &ctx);
+	if (!ok) {
+		fprintf(stderr, "get_g_lock_ctx failed");
+		return false;
+	}
+	g_lock_set_fifo(ctx, true);
+
+	status = g_lock_lock(ctx, key, G_LOCK_WRITE,
+			     (struct timeval) { .tv_sec = 1 },
+			     NULL, NULL);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "g_lock_lock failed %s\n",
+			nt_errstr(status));
+		goto fail;
+	}
+
+	for (i=0; i<nprocs; i++) {
+		pid_t child;
+
+		batch[i] = i;
+		if ((i > 0) &&
+		    (types[i] == G_LOCK_READ) &&
+		    (types[i-1] == G_LOCK_READ)) {
+			batch[i] = batch[i-1];
+		}
+
+		child = fork();
+		if (child == -1) {
+			perror("fork failed");
+			goto fail;
+		}
+
+		if (child == 0) {
+			TALLOC_FREE(ctx);
+			close(ready_pipe[0]);
+			close(result_pipe[0]);
+			ok = lock_fifo1_child(msg,
+					      ev,
+					      lockname,
+					      i,
+					      types[i],
+					      ready_pipe[1],
+					      result_pipe[1]);
+			exit(ok ? 0 : 1);
+		}
+
+		/*
+		 * Wait for the child to be queued before starting
+		 * the next one
+		 */
+		if (sys_read(ready_pipe[0], &c, sizeof(c)) != sizeof(c)) {
+			perror("read failed");
+			goto fail;
+		}
+	}
+
+	close(ready_pipe[1]);
+	close(result_pipe[1]);
+
+	status = g_lock_unlock(ctx, key);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "g_lock_unlock failed: %s\n",
+			nt_errstr(status));
+		goto fail;
+	}
+
+	for (i=0; i<2*nprocs; i++) {
+		size_t idx;
+
+		if (sys_read(result_pipe[0], &c, sizeof(c)) != sizeof(c)) {
+			fprintf(stderr, "child died\n");
+			goto fail;
+		}
+		idx = c & 0x7f;
+		if (idx >= nprocs) {
+			fprintf(stderr, "Invalid index %zu\n", idx);
+			goto fail;
+		}
+
+		if (c & 0x80) {
+			if (types[idx] == G_LOCK_WRITE) {
+				num_writers -= 1;
+			} else {
+				num_readers -= 1;
+			}
+			continue;
+		}
+
+		for (j=0; j<nprocs; j++) {
+			if ((batch[j] < batch[idx]) && !granted[j]) {
+				fprintf(stderr,
+					"%zu got the lock before %zu\n",
+					idx,
+					j);
+				goto fail;
+			}
+		}
+		if (num_writers != 0) {
+			fprintf(stderr, "%zu got the lock with a writer\n",
+				idx);
+			goto fail;
+		}
+		if ((types[idx] == G_LOCK_WRITE) && (num_readers != 0)) {
+			fprintf(stderr, "%zu got the lock with %zu readers\n",
+				idx,
+				num_readers);
+			goto fail;
+		}
+
+		granted[idx] = true;
+		if (types[idx] == G_LOCK_WRITE) {
+			num_writers += 1;
+		} else {
+			num_readers += 1;
+		}
+	}
+
+	for (i=0; i<nprocs; i++) {
+		int child_status;
+		int wret = waitpid(-1, &child_status, 0);
+		if (wret == -1) {
+			perror("waitpid failed");
+			goto fail;
+		}
+		if (!WIFEXITED(child_status) ||
+		    (WEXITSTATUS(child_status) != 0)) {
+			fprintf(stderr, "child failed\n");
+			goto fail;
+		}
+	}
+
+	ret = true;
+fail:
+	TALLOC_FREE(ctx);
+	return ret;
+}
+
+/*
+ * Scalability of one contended g_lock with and without fifo mode
+ */
+
+static bool lock_bench_child(struct messaging_context *msg,
+			     struct tevent_context *ev,
+			     const char *lockname,
+			     bool fifo,
+			     int ready_fd,
+			     int start_fd)
+{
+	struct g_lock_ctx *ctx = NULL;
+	TDB_DATA key = string_term_tdb_data(lockname);
+	NTSTATUS status;
+	ssize_t nread;
+	int i;
+	bool ok;
+	char c;
+
+	status = reinit_after_fork(msg, ev, false);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "reinit_after_fork failed: %s\n",
+			nt_errstr(status));
+		return false;
+	}
+
+	ok = get_g_lock_ctx(talloc_tos(), &ev, &msg, &ctx);
+	if (!ok) {
+		fprintf(stderr, "get_g_lock_ctx failed");
+		return false;
+	}
+	g_lock_set_fifo(ctx, fifo);
+
+	close(ready_fd);
+
+	nread = sys_read(start_fd, &c, sizeof(c));
+	if (nread != 0) {
+		fprintf(stderr, "sys_read returned %zd\n", nread);
+		return false;
+	}
+
+	for (i=0; i<torture_numops; i++) {
+		status = g_lock_lock(ctx, key, G_LOCK_WRITE,
+				     (struct timeval) { .tv_sec = 600 },
+				     NULL, NULL);
+		if (!NT_STATUS_IS_OK(status)) {
+			fprintf(stderr, "g_lock_lock failed: %s\n",
+				nt_errstr(status));
+			return false;
+		}
+		status = g_lock_unlock(ctx, key);
+		if (!NT_STATUS_IS_OK(status)) {
+			fprintf(stderr, "g_lock_unlock failed: %s\n",
+				nt_errstr(status));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool lock_bench_run(struct messaging_context *msg,
+			   struct tevent_context *ev,
+			   struct g_lock_ctx **pctx,
+			   bool fifo,
+			   size_t nprocs)
+{
+	const char *lockname = "lock_bench";
+	int ready_pipe[2], start_pipe[2];
+	size_t i, num_failed = 0;
+	ssize_t nread;
+	double t;
+	bool ok;
+	char c;
+
+	if ((pipe(ready_pipe) != 0) || (pipe(start_pipe) != 0)) {
+		perror("pipe failed");
+		return false;
+	}
+
+	for (i=0; i<nprocs; i++) {
+		pid_t child = fork();
+
+		if (child == -1) {
+			perror("fork failed");
+			return false;
+		}
+
+		if (child == 0) {
+			TALLOC_FREE(*pctx);
+			close(ready_pipe[0]);
+			close(start_pipe[1]);
+			ok = lock_bench_child(msg,
+					      ev,
+					      lockname,
+					      fifo,
+					      ready_pipe[1],
+					      start_pipe[0]);
+			exit(ok ? 0 : 1);
+		}
+	}
+
+	close(ready_pipe[1]);
+	close(start_pipe[0]);
+
+	/*
+	 * All children closed ready_pipe[1] once set up
+	 */
+	nread = sys_read(ready_pipe[0], &c, sizeof(c));
+	if (nread != 0) {
+		fprintf(stderr, "sys_read returned %zd\n", nread);
+		return false;
+	}
+	close(ready_pipe[0]);
+
+	start_timer();
+	close(start_pipe[1]);
+
+	for (i=0; i<nprocs; i++) {
+		int child_status;
+		int ret = waitpid(-1, &child_status, 0);
+		if (ret == -1) {
+			perror("waitpid failed");
+			return false;
+		}
+		if (!WIFEXITED(child_status) ||
+		    (WEXITSTATUS(child_status) != 0)) {
+			num_failed += 1;
+		}
+	}
+
+	t = end_timer();
+
+	printf("%-6s %5zu procs: %10.0f locks/sec (%zu failed)\n",
+	       fifo ? "fifo" : "retry",
+	       nprocs,
+	       (double)(nprocs * torture_numops) / t,
+	       num_failed);
+
+	return (num_failed == 0);
+}
+
+bool run_g_lock_fifo_bench(int dummy)
+{
+	struct tevent_context *ev = NULL;
+	struct messaging_context *msg = NULL;
+	struct g_lock_ctx *ctx = NULL;
+	const size_t nprocs[] = {
+		1, 2, 5, 10, 20, 50, 100, 200, 500, 1000,
+	};
+	size_t i;
+	bool ret = false;
+	bool ok;
+
+	ok = get_g_lock_ctx(talloc_tos(), &ev, &msg, &ctx);
+	if (!ok) {
+		fprintf(stderr, "get_g_lock_ctx failed");
+		return false;
+	}
+
+	for (i=0; i<ARRAY_SIZE(nprocs); i++) {
+		ok = lock_bench_run(msg, ev, &ctx, false, nprocs[i]);
+		if (!ok) {
+			goto fail;
+		}
+		ok = lock_bench_run(msg, ev, &ctx, true, nprocs[i]);
+		if (!ok) {
+			goto fail;
+		}
+	}
+
+	ret = true;
+fail:
+	TALLOC_FREE(ctx);
+	TALLOC_FREE(msg);
+	TALLOC_FREE(ev);
+	return ret;
+}
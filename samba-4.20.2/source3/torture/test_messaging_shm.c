@@ -0,0 +1,382 @@
+/*
+ * Unix SMB/CIFS implementation.
+ * Test messaging_dgm shared memory rings
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "torture/proto.h"
+#include "messages.h"
+#include "lib/messaging/messages_dgm.h"
+#include "lib/util/sys_rw.h"
+
+#define MSG_TORTURE_SHM 0xF106
+
+#define SHM_NUM_MSGS 20000
+#define SHM_BURST 100
+#define SHM_RING_SIZE 65536
+
+/*
+ * Every SHM_BIG_EVERY'th message would be fragmented on the socket,
+ * every SHM_FD_EVERY'th one passes an fd and has to go through the
+ * socket between ring messages.
+ */
+#define SHM_BIG_EVERY 997
+#define SHM_BIG_LEN 5000
+#define SHM_FD_EVERY 1009
+
+struct shm_child_state {
+	uint32_t expected;
+	bool failed;
+};
+
+static void shm_child_msg(struct messaging_context *msg_ctx,
+			       void *private_data,
+			       uint32_t msg_type,
+			       struct server_id server_id,
+			       DATA_BLOB *data)
+{
+	struct shm_child_state *state = private_data;
+	uint32_t seq;
+
+	if (data->length < sizeof(seq)) {
+		fprintf(stderr, "child: short message\n");
+		state->failed = true;
+		return;
+	}
+	seq = IVAL(data->data, 0);
+
+	if (seq != state->expected) {
+		fprintf(stderr, "child: got msg %"PRIu32", expected %"PRIu32
+			"\n", seq, state->expected);
+		state->failed = true;
+	}
+
+	if ((seq % SHM_BIG_EVERY) == 0) {
+		size_t i;
+
+		if (data->length != SHM_BIG_LEN) {
+			fprintf(stderr, "child: msg %"PRIu32" has %zu "
+				"bytes\n", seq, data->length);
+			state->failed = true;
+			return;
+		}
+		for (i=sizeof(seq); i<data->length; i++) {
+			if (data->data[i] != (uint8_t)(seq + i)) {
+				fprintf(stderr, "child: msg %"PRIu32
+					" corrupt at %zu\n", seq, i);
+				state->failed = true;
+				break;
+			}
+		}
+	}
+
+	state->expected = seq + 1;
+}
+
+static bool shm_child(int ready_fd)
+{
+	struct tevent_context *ev = NULL;
+	struct messaging_context *msg_ctx = NULL;
+	TALLOC_CTX *frame = talloc_stackframe();
+	struct shm_child_state state = { .expected = 0 };
+	struct messaging_dgm_stats stats;
+	bool retval = false;
+	uint8_t c = 1;
+	ssize_t bytes;
+	NTSTATUS status;
+	int ret;
+
+	ev = samba_tevent_context_init(frame);
+	if (ev == NULL) {
+		fprintf(stderr, "child: tevent_context_init failed\n");
+		goto done;
+	}
+
+	msg_ctx = messaging_init(ev, ev);
+	if (msg_ctx == NULL) {
+		fprintf(stderr, "child: messaging_init failed\n");
+		goto done;
+	}
+
+	status = messaging_register(msg_ctx, &state, MSG_TORTURE_SHM,
+				    shm_child_msg);
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "child: messaging_register failed: %s\n",
+			nt_errstr(status));
+		goto done;
+	}
+
+	bytes = sys_write(ready_fd, &c, 1);
+	if (bytes != 1) {
+		perror("child: failed to write to ready_fd");
+		goto done;
+	}
+
+	while ((state.expected < SHM_NUM_MSGS) && !state.failed) {
+		ret = tevent_loop_once(ev);
+		if (ret != 0) {
+			fprintf(stderr, "child: tevent_loop_once failed\n");
+			goto done;
+		}
+	}
+
+	ret = messaging_dgm_get_stats(&stats);
+	if (ret == 0) {
+		printf("child: received %"PRIu64" datagrams and %"PRIu64
+		       " ring messages\n",
+		       stats.recv.datagrams, stats.shm.received);
+	}
+
+	if (state.failed) {
+		goto done;
+	}
+
+	bytes = sys_write(ready_fd, &c, 1);
+	if (bytes != 1) {
+		perror("child: failed to write to ready_fd");
+		goto done;
+	}
+
+	retval = true;
+done:
+	TALLOC_FREE(frame);
+	return retval;
+}
+
+static bool shm_send_one(struct messaging_context *msg_ctx,
+			      struct server_id dst,
+			      uint32_t seq)
+{
+	uint8_t buf[SHM_BIG_LEN];
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(seq) };
+	int fd = -1;
+	NTSTATUS status;
+
+	SIVAL(buf, 0, seq);
+
+	if ((seq % SHM_BIG_EVERY) == 0) {
+		size_t i;
+
+		for (i=sizeof(seq); i<sizeof(buf); i++) {
+			buf[i] = seq + i;
+		}
+		iov.iov_len = sizeof(buf);
+	}
+
+	if ((seq % SHM_FD_EVERY) == 0) {
+		fd = open("/dev/null", O_RDONLY);
+		if (fd == -1) {
+			perror("parent: open failed");
+			return false;
+		}
+	}
+
+	status = messaging_send_iov(msg_ctx, dst, MSG_TORTURE_SHM,
+				    &iov, 1, &fd, (fd == -1) ? 0 : 1);
+	if (fd != -1) {
+		close(fd);
+	}
+	if (!NT_STATUS_IS_OK(status)) {
+		fprintf(stderr, "parent: messaging_send_iov failed: %s\n",
+			nt_errstr(status));
+		return false;
+	}
+	return true;
+}
+
+static void shm_noop(struct tevent_context *ev,
+		     struct tevent_immediate *im,
+		     void *private_data)
+{
+	return;
+}
+
+static void shm_child_done(struct tevent_context *ev,
+				struct tevent_fd *fde,
+				uint16_t flags,
+				void *private_data)
+{
+	int *pchild_done = private_data;
+	uint8_t c;
+	ssize_t bytes;
+
+	bytes = sys_read(tevent_fd_get_fd(fde), &c, 1);
+	*pchild_done = (bytes == 1) ? 1 : -1;
+	TALLOC_FREE(fde);
+}
+
+static bool shm_parent(pid_t child_pid, int ready_fd)
+{
+	struct tevent_context *ev = NULL;
+	struct messaging_context *msg_ctx = NULL;
+	TALLOC_CTX *frame = talloc_stackframe();
+	struct messaging_dgm_stats stats;
+	struct tevent_fd *child_done_fde = NULL;
+	struct tevent_immediate *im = NULL;
+	int child_done = 0;
+	struct server_id dst;
+	bool retval = false;
+	uint32_t seq = 0;
+	uint8_t c;
+	ssize_t bytes;
+	size_t i;
+	int ret;
+
+	bytes = sys_read(ready_fd, &c, 1);
+	if (bytes != 1) {
+		perror("parent: read from ready_fd failed");
+		goto done;
+	}
+
+	ev = samba_tevent_context_init(frame);
+	if (ev == NULL) {
+		fprintf(stderr, "parent: tevent_context_init failed\n");
+		goto done;
+	}
+
+	msg_ctx = messaging_init(ev, ev);
+	if (msg_ctx == NULL) {
+		fprintf(stderr, "parent: messaging_init failed\n");
+		goto done;
+	}
+
+	child_done_fde = tevent_add_fd(ev, ev, ready_fd, TEVENT_FD_READ,
+				       shm_child_done, &child_done);
+	if (child_done_fde == NULL) {
+		fprintf(stderr, "parent: tevent_add_fd failed\n");
+		goto done;
+	}
+
+	im = tevent_create_immediate(frame);
+	if (im == NULL) {
+		fprintf(stderr, "parent: tevent_create_immediate failed\n");
+		goto done;
+	}
+
+	messaging_dgm_set_shm_ring_size(SHM_RING_SIZE);
+
+	dst = messaging_server_id(msg_ctx);
+	dst.pid = child_pid;
+
+	while (seq < SHM_NUM_MSGS) {
+		for (i=0; (i<SHM_BURST) && (seq<SHM_NUM_MSGS); i++) {
+			if (!shm_send_one(msg_ctx, dst, seq)) {
+				goto done;
+			}
+			seq += 1;
+		}
+
+		/*
+		 * The ring might take everything, don't block here
+		 */
+		tevent_schedule_immediate(im, ev, shm_noop, NULL);
+
+		ret = tevent_loop_once(ev);
+		if (ret != 0) {
+			fprintf(stderr, "parent: tevent_loop_once failed\n");
+			goto done;
+		}
+	}
+
+	while (child_done == 0) {
+		ret = tevent_loop_once(ev);
+		if (ret != 0) {
+			fprintf(stderr, "parent: tevent_loop_once failed\n");
+			goto done;
+		}
+	}
+
+	if (child_done != 1) {
+		fprintf(stderr, "parent: child failed\n");
+		goto done;
+	}
+
+	ret = messaging_dgm_get_stats(&stats);
+	if (ret != 0) {
+		fprintf(stderr, "parent: messaging_dgm_get_stats failed: "
+			"%s\n", strerror(ret));
+		goto done;
+	}
+
+	printf("parent: sent %"PRIu64" datagrams and %"PRIu64" ring "
+	       "messages, %"PRIu64" wakeups, %"PRIu64" fallbacks\n",
+	       stats.send.datagrams, stats.shm.sent, stats.shm.wakeups,
+	       stats.shm.fallbacks);
+
+	if (stats.shm.sent == 0) {
+		fprintf(stderr, "parent: nothing went through the ring\n");
+		goto done;
+	}
+
+	ret = waitpid(child_pid, NULL, 0);
+	if (ret == -1) {
+		perror("parent: waitpid failed");
+		goto done;
+	}
+
+	/*
+	 * The ring to the child is still around, but a dead
+	 * receiver has to be reported like without it.
+	 */
+	{
+		struct iovec iov = { .iov_base = &seq,
+				     .iov_len = sizeof(seq) };
+		NTSTATUS status;
+
+		status = messaging_send_iov(msg_ctx, dst, MSG_TORTURE_SHM,
+					    &iov, 1, NULL, 0);
+		if (!NT_STATUS_EQUAL(status,
+				     NT_STATUS_OBJECT_NAME_NOT_FOUND)) {
+			fprintf(stderr, "parent: send to exited child "
+				"returned %s\n", nt_errstr(status));
+			goto done;
+		}
+	}
+
+	retval = true;
+done:
+	messaging_dgm_set_shm_ring_size(0);
+	TALLOC_FREE(frame);
+	return retval;
+}
+
+bool run_messaging_shm(int dummy)
+{
+	bool retval = false;
+	pid_t child_pid;
+	int ready_pipe[2];
+	int ret;
+
+	ret = pipe(ready_pipe);
+	if (ret != 0) {
+		perror("parent: pipe failed for ready_pipe");
+		return retval;
+	}
+
+	child_pid = fork();
+	if (child_pid == -1) {
+		perror("fork failed");
+	} else if (child_pid == 0) {
+		close(ready_pipe[0]);
+		retval = shm_child(ready_pipe[1]);
+		exit(retval ? 0 : 1);
+	} else {
+		close(ready_pipe[1]);
+		retval = shm_parent(child_pid, ready_pipe[0]);
+	}
+
+	return retval;
+}
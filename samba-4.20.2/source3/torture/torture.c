@@ -16040,6 +16040,14 @@ static struct {
 		.name  = "LOCAL-MESSAGING-SEND-ALL",
 		.fn    = run_messaging_send_all,
 	},
+	{
+		.name  = "LOCAL-MESSAGING-COALESCE",
+		.fn    = run_messaging_coalesce,
+	},
+	{
+		.name  = "LOCAL-MESSAGING-SHM",
+		.fn    = run_messaging_shm,
+	},
 	{
 		.name  = "LOCAL-BASE64",
 		.fn    = run_local_base64,
@@ -16048,6 +16056,14 @@ static struct {
 		.name  = "LOCAL-RBTREE",
 		.fn    = run_local_rbtree,
 	},
+	{
+		.name  = "LOCAL-DBWRAP-BTREE",
+		.fn    = run_local_dbwrap_btree,
+	},
+	{
+		.name  = "LOCAL-DBWRAP-BTREE-BENCH",
+		.fn    = run_local_dbwrap_btree_bench,
+	},
 	{
 		.name  = "LOCAL-MEMCACHE",
 		.fn    = run_local_memcache,
@@ -16168,6 +16184,14 @@ static struct {
 		.name  = "LOCAL-G-LOCK-PING-PONG",
 		.fn    = run_g_lock_ping_pong,
 	},
+	{
+		.name  = "LOCAL-G-LOCK-FIFO1",
+		.fn    = run_g_lock_fifo1,
+	},
+	{
+		.name  = "LOCAL-G-LOCK-FIFO-BENCH",
+		.fn    = run_g_lock_fifo_bench,
+	},
 	{
 		.name  = "LOCAL-CANONICALIZE-PATH",
 		.fn    = run_local_canonicalize_path,
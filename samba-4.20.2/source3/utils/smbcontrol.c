@@ -982,6 +982,59 @@ static bool do_ringbuflog(struct tevent_context *ev_ctx,
 	return num_replies != 0;
 }
 
+/* Fetch and print the internal messaging batch statistics */
+
+static void print_dgm_stats_cb(struct messaging_context *msg,
+			       void *private_data,
+			       uint32_t msg_type,
+			       struct server_id pid,
+			       DATA_BLOB *data)
+{
+	struct server_id_buf idbuf;
+
+	if ((data->length == 0) || (data->data[data->length-1] != '\0')) {
+		fprintf(stderr, "Got invalid dgm stats from %s\n",
+			server_id_str_buf(pid, &idbuf));
+		num_replies++;
+		return;
+	}
+
+	printf("PID %s:\n%s", server_id_str_buf(pid, &idbuf),
+	       (const char *)data->data);
+	num_replies++;
+}
+
+static bool do_dgm_stats(struct tevent_context *ev_ctx,
+			 struct messaging_context *msg_ctx,
+			 const struct server_id pid,
+			 const int argc, const char **argv)
+{
+	if (argc != 1) {
+		fprintf(stderr, "Usage: smbcontrol <dest> dgm-stats\n");
+		return false;
+	}
+
+	messaging_register(msg_ctx, NULL, MSG_DGM_STATS, print_dgm_stats_cb);
+
+	/* Send a message and register our interest in a reply */
+
+	if (!send_message(msg_ctx, pid, MSG_REQ_DGM_STATS, NULL, 0)) {
+		return false;
+	}
+
+	wait_replies(ev_ctx, msg_ctx, procid_to_pid(&pid) == 0);
+
+	/* No replies were received within the timeout period */
+
+	if (num_replies == 0) {
+		printf("No replies received\n");
+	}
+
+	messaging_deregister(msg_ctx, MSG_DGM_STATS, NULL);
+
+	return num_replies != 0;
+}
+
 /* Perform a dmalloc mark */
 
 static bool do_dmalloc_mark(struct tevent_context *ev_ctx,
@@ -1536,6 +1589,11 @@ static const struct {
 		.fn   = do_ringbuflog,
 		.help = "Display ringbuf log",
 	},
+	{
+		.name = "dgm-stats",
+		.fn   = do_dgm_stats,
+		.help = "Display internal messaging batch statistics",
+	},
 	{
 		.name = "dmalloc-mark",
 		.fn   = do_dmalloc_mark,
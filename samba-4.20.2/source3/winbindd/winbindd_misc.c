@@ -24,6 +24,7 @@
 #include "winbindd.h"
 #include "libcli/security/dom_sid.h"
 #include "lib/util/string_wrappers.h"
+#include "lib/messaging/messages_dgm.h"
 
 #undef DBGC_CLASS
 #define DBGC_CLASS DBGC_WINBIND
@@ -472,6 +473,7 @@ bool winbindd_reload_services_file(const char *lfile)
 	reopen_logs();
 	load_interfaces();
 	winbindd_setup_max_fds();
+	messaging_dgm_set_shm_ring_size(lp_messaging_shm_ring_size());
 
 	return(ret);
 }
@@ -47,6 +47,24 @@ struct ldb_attr_vec {
 	size_t capacity;
 };
 
+/*
+ * A small direct-mapped cache of attribute access check results,
+ * private to one search.  The token, the schema and the sd_flags are
+ * constant for the lifetime of the search, so the result only depends
+ * on the security descriptor, the structural objectclass, the attribute
+ * and, if the descriptor has any PRINCIPAL_SELF ACEs, the objectSid.
+ */
+#define ACLREAD_ACCESS_CACHE_SIZE 256
+
+struct aclread_access_cache_entry {
+	uint64_t sd_id; /* 0 means unused */
+	const struct dsdb_class *objectclass;
+	const struct dsdb_attribute *attr;
+	bool have_sid;
+	struct dom_sid sid;
+	bool granted;
+};
+
 struct aclread_context {
 	struct ldb_module *module;
 	struct ldb_request *req;
@@ -70,20 +88,42 @@ struct aclread_context {
 
 	bool got_tree_attrs;
 	struct ldb_attr_vec tree_attrs;
+
+	/* allocated on first use */
+	struct aclread_access_cache_entry *access_cache;
+};
+
+/*
+ * The security descriptors of most objects in a domain are
+ * deduplicated by inheritance, so a handful of entries covers the vast
+ * majority of the objects returned by a search.
+ */
+#define ACLREAD_SD_CACHE_SIZE 16
+
+struct aclread_sd_cache_entry {
+	/* unique for the lifetime of the module, 0 means unused */
+	uint64_t id;
+	uint32_t hash;
+	struct ldb_val blob;
+	struct security_descriptor *sd;
+	bool has_self_ace;
 };
 
 struct aclread_private {
 	bool enabled;
 
-	/* cache of the last SD we read during any search */
-	struct security_descriptor *sd_cached;
-	struct ldb_val sd_cached_blob;
+	/* cache of the last SDs we read during any search */
+	struct aclread_sd_cache_entry sd_cache[ACLREAD_SD_CACHE_SIZE];
+	unsigned int sd_cache_next;
+	uint64_t sd_cache_last_id;
 	const char **password_attrs;
 	size_t num_password_attrs;
 };
 
 struct access_check_context {
 	struct security_descriptor *sd;
+	uint64_t sd_id;
+	bool sd_has_self_ace;
 	struct dom_sid sid_buf;
 	const struct dom_sid *sid;
 	const struct dsdb_class *objectclass;
@@ -450,9 +490,41 @@ static int aclread_check_object_visible(struct aclread_context *ac,
 	return LDB_ERR_INSUFFICIENT_ACCESS_RIGHTS;
 }
 
+static uint32_t aclread_sd_blob_hash(const struct ldb_val *blob)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < blob->length; i++) {
+		hash ^= blob->data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static bool aclread_sd_has_self_ace(const struct security_descriptor *sd)
+{
+	uint32_t i;
+
+	if (sd->dacl == NULL) {
+		return false;
+	}
+
+	for (i = 0; i < sd->dacl->num_aces; i++) {
+		if (dom_sid_equal(&sd->dacl->aces[i].trustee,
+				  &global_sid_Self)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /*
- * The sd returned from this function is valid until the next call on
- * this module context
+ * The cache entry returned from this function is valid until the next
+ * call on this module context
  *
  * This helper function uses a cache on the module private data to
  * speed up repeated use of the same SD.
@@ -460,14 +532,19 @@ static int aclread_check_object_visible(struct aclread_context *ac,
 
 static int aclread_get_sd_from_ldb_message(struct aclread_context *ac,
 					   const struct ldb_message *acl_res,
-					   struct security_descriptor **sd)
+					   const struct aclread_sd_cache_entry **_entry)
 {
 	struct ldb_message_element *sd_element;
 	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
 	struct aclread_private *private_data
 		= talloc_get_type_abort(ldb_module_get_private(ac->module),
 				  struct aclread_private);
+	struct aclread_sd_cache_entry *entry = NULL;
+	struct security_descriptor *sd = NULL;
+	struct ldb_val blob;
 	enum ndr_err_code ndr_err;
+	uint32_t hash;
+	unsigned int i;
 
 	sd_element = ldb_msg_find_element(acl_res, "nTSecurityDescriptor");
 	if (sd_element == NULL) {
@@ -481,41 +558,63 @@ static int aclread_get_sd_from_ldb_message(struct aclread_context *ac,
 
 	/*
 	 * The time spent in ndr_pull_security_descriptor() is quite
-	 * expensive, so we check if this is the same binary blob as last
-	 * time, and if so return the memory tree from that previous parse.
+	 * expensive, so we check if this is the same binary blob as one
+	 * we have seen recently, and if so return the memory tree from
+	 * that previous parse.
+	 *
+	 * As the key is the exact binary blob, a modified SD will never
+	 * match a stale entry.
 	 */
+	hash = aclread_sd_blob_hash(&sd_element->values[0]);
 
-	if (private_data->sd_cached != NULL &&
-	    private_data->sd_cached_blob.data != NULL &&
-	    ldb_val_equal_exact(&sd_element->values[0],
-				&private_data->sd_cached_blob)) {
-		*sd = private_data->sd_cached;
-		return LDB_SUCCESS;
+	for (i = 0; i < ACLREAD_SD_CACHE_SIZE; i++) {
+		entry = &private_data->sd_cache[i];
+
+		if (entry->id == 0 || entry->hash != hash) {
+			continue;
+		}
+		if (ldb_val_equal_exact(&sd_element->values[0],
+					&entry->blob)) {
+			*_entry = entry;
+			return LDB_SUCCESS;
+		}
 	}
 
-	*sd = talloc(private_data, struct security_descriptor);
-	if(!*sd) {
+	sd = talloc(private_data, struct security_descriptor);
+	if (sd == NULL) {
 		return ldb_oom(ldb);
 	}
-	ndr_err = ndr_pull_struct_blob(&sd_element->values[0], *sd, *sd,
+	ndr_err = ndr_pull_struct_blob(&sd_element->values[0], sd, sd,
 			     (ndr_pull_flags_fn_t)ndr_pull_security_descriptor);
 
 	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-		TALLOC_FREE(*sd);
+		TALLOC_FREE(sd);
 		return ldb_operr(ldb);
 	}
 
-	talloc_unlink(private_data, private_data->sd_cached_blob.data);
-	private_data->sd_cached_blob = ldb_val_dup(private_data,
-						   &sd_element->values[0]);
-	if (private_data->sd_cached_blob.data == NULL) {
-		TALLOC_FREE(*sd);
+	blob = ldb_val_dup(private_data, &sd_element->values[0]);
+	if (blob.data == NULL) {
+		TALLOC_FREE(sd);
 		return ldb_operr(ldb);
 	}
 
-	talloc_unlink(private_data, private_data->sd_cached);
-	private_data->sd_cached = *sd;
+	/* Replace the entries in turn */
+	entry = &private_data->sd_cache[private_data->sd_cache_next];
+	private_data->sd_cache_next =
+		(private_data->sd_cache_next + 1) % ACLREAD_SD_CACHE_SIZE;
+
+	talloc_unlink(private_data, entry->blob.data);
+	talloc_unlink(private_data, entry->sd);
+
+	*entry = (struct aclread_sd_cache_entry) {
+		.id = ++private_data->sd_cache_last_id,
+		.hash = hash,
+		.blob = blob,
+		.sd = sd,
+		.has_self_ace = aclread_sd_has_self_ace(sd),
+	};
 
+	*_entry = entry;
 	return LDB_SUCCESS;
 }
 
@@ -571,6 +670,57 @@ static uint32_t get_attr_access_mask(const struct dsdb_attribute *attr,
 	return access_mask;
 }
 
+/*
+ * Returns the slot in the per-search access check cache for the given
+ * attribute on an object described by ctx.
+ */
+static struct aclread_access_cache_entry *aclread_access_cache_slot(
+	struct aclread_context *ac,
+	const struct access_check_context *ctx,
+	const struct dsdb_attribute *attr)
+{
+	const uint64_t mul = 0x9e3779b97f4a7c15ULL;
+	uint64_t h;
+
+	if (ac->access_cache == NULL) {
+		ac->access_cache = talloc_zero_array(ac,
+						     struct aclread_access_cache_entry,
+						     ACLREAD_ACCESS_CACHE_SIZE);
+		if (ac->access_cache == NULL) {
+			return NULL;
+		}
+	}
+
+	h = ctx->sd_id * mul;
+	h = (h ^ (uintptr_t)ctx->objectclass) * mul;
+	h = (h ^ (uintptr_t)attr) * mul;
+
+	return &ac->access_cache[(h >> 32) % ACLREAD_ACCESS_CACHE_SIZE];
+}
+
+static bool aclread_access_cache_match(const struct aclread_access_cache_entry *entry,
+				       const struct access_check_context *ctx,
+				       const struct dsdb_attribute *attr)
+{
+	if (entry->sd_id != ctx->sd_id ||
+	    entry->objectclass != ctx->objectclass ||
+	    entry->attr != attr)
+	{
+		return false;
+	}
+
+	if (!ctx->sd_has_self_ace) {
+		/* The objectSid is not used by the access check */
+		return true;
+	}
+
+	if (ctx->sid == NULL) {
+		return !entry->have_sid;
+	}
+
+	return entry->have_sid && dom_sid_equal(&entry->sid, ctx->sid);
+}
+
 /*
  * Checks that the user has sufficient access rights to view an attribute, else
  * marks it as inaccessible.
@@ -581,12 +731,11 @@ static int acl_redact_attr(TALLOC_CTX *mem_ctx,
 			   const struct aclread_private *private_data,
 			   const struct ldb_message *msg,
 			   const struct dsdb_schema *schema,
-			   const struct security_descriptor *sd,
-			   const struct dom_sid *sid,
-			   const struct dsdb_class *objectclass)
+			   const struct access_check_context *acl_ctx)
 {
 	int ret;
 	const struct dsdb_attribute *attr = NULL;
+	struct aclread_access_cache_entry *cached = NULL;
 	uint32_t access_mask;
 	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
 
@@ -613,11 +762,41 @@ static int acl_redact_attr(TALLOC_CTX *mem_ctx,
 		return LDB_SUCCESS;
 	}
 
+	/*
+	 * Most objects returned by a search share a few security
+	 * descriptors, so we have likely made this decision before.
+	 */
+	cached = aclread_access_cache_slot(ac, acl_ctx, attr);
+	if (cached == NULL) {
+		return ldb_oom(ldb);
+	}
+	if (aclread_access_cache_match(cached, acl_ctx, attr)) {
+		if (!cached->granted) {
+			ldb_msg_element_mark_inaccessible(el);
+		}
+		return LDB_SUCCESS;
+	}
+
 	/* We must check whether the user has rights to view the attribute. */
 
-	ret = acl_check_access_on_attribute_implicit_owner(ac->module, mem_ctx, sd, sid,
-							   access_mask, attr, objectclass,
+	ret = acl_check_access_on_attribute_implicit_owner(ac->module, mem_ctx,
+							   acl_ctx->sd, acl_ctx->sid,
+							   access_mask, attr,
+							   acl_ctx->objectclass,
 							   IMPLICIT_OWNER_READ_CONTROL_RIGHTS);
+	if (ret == LDB_SUCCESS || ret == LDB_ERR_INSUFFICIENT_ACCESS_RIGHTS) {
+		*cached = (struct aclread_access_cache_entry) {
+			.sd_id = acl_ctx->sd_id,
+			.objectclass = acl_ctx->objectclass,
+			.attr = attr,
+			.granted = (ret == LDB_SUCCESS),
+		};
+		if (acl_ctx->sd_has_self_ace && acl_ctx->sid != NULL) {
+			cached->have_sid = true;
+			cached->sid = *acl_ctx->sid;
+		}
+	}
+
 	if (ret == LDB_ERR_INSUFFICIENT_ACCESS_RIGHTS) {
 		ldb_msg_element_mark_inaccessible(el);
 	} else if (ret != LDB_SUCCESS) {
@@ -635,6 +814,7 @@ static int setup_access_check_context(struct aclread_context *ac,
 				      const struct ldb_message *msg,
 				      struct access_check_context *ctx)
 {
+	const struct aclread_sd_cache_entry *sd_entry = NULL;
 	int ret;
 
 	/*
@@ -654,18 +834,21 @@ static int setup_access_check_context(struct aclread_context *ac,
 	}
 
 	/* Fetch the object's security descriptor. */
-	ret = aclread_get_sd_from_ldb_message(ac, msg, &ctx->sd);
+	ret = aclread_get_sd_from_ldb_message(ac, msg, &sd_entry);
 	if (ret != LDB_SUCCESS) {
 		ldb_debug_set(ldb_module_get_ctx(ac->module), LDB_DEBUG_FATAL,
 			      "acl_read: cannot get descriptor of %s: %s\n",
 			      ldb_dn_get_linearized(msg->dn), ldb_strerror(ret));
 		return LDB_ERR_OPERATIONS_ERROR;
-	} else if (ctx->sd == NULL) {
+	} else if (sd_entry == NULL || sd_entry->sd == NULL) {
 		ldb_debug_set(ldb_module_get_ctx(ac->module), LDB_DEBUG_FATAL,
 			      "acl_read: cannot get descriptor of %s (attribute not found)\n",
 			      ldb_dn_get_linearized(msg->dn));
 		return LDB_ERR_OPERATIONS_ERROR;
 	}
+	ctx->sd = sd_entry->sd;
+	ctx->sd_id = sd_entry->id;
+	ctx->sd_has_self_ace = sd_entry->has_self_ace;
 	/*
 	 * Get the most specific structural object class for the ACL check
 	 */
@@ -826,9 +1009,7 @@ static int aclread_callback(struct ldb_request *req, struct ldb_reply *ares)
 					      private_data,
 					      msg,
 					      ac->schema,
-					      acl_ctx.sd,
-					      acl_ctx.sid,
-					      acl_ctx.objectclass);
+					      &acl_ctx);
 			if (ret != LDB_SUCCESS) {
 				return ldb_module_done(ac->req, NULL, NULL, ret);
 			}
@@ -1121,9 +1302,7 @@ static int acl_redact_msg_for_filter(struct ldb_module *module, struct ldb_reque
 				      private_data,
 				      msg,
 				      ac->schema,
-				      acl_ctx.sd,
-				      acl_ctx.sid,
-				      acl_ctx.objectclass);
+				      &acl_ctx);
 		if (ret != LDB_SUCCESS) {
 			return ret;
 		}
@@ -1153,6 +1332,9 @@ static int aclread_init(struct ldb_module *module)
 	static const char * const secret_attrs[] = {
 		DSDB_SECRET_ATTRIBUTES
 	};
+	static const char * const redact_attrs[] = {
+		"nTSecurityDescriptor", "objectClass", "objectSid", NULL
+	};
 	struct ldb_result *res;
 	struct ldb_message *msg;
 	struct ldb_message_element *password_attributes;
@@ -1247,6 +1429,15 @@ static int aclread_init(struct ldb_module *module)
 		return ret;
 	}
 
+	/*
+	 * On top of the attributes in the filter, see
+	 * setup_access_check_context().
+	 */
+	ret = ldb_register_redact_attrs(ldb, redact_attrs);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
 done:
 	talloc_free(mem_ctx);
 	ret = ldb_next_init(module);
@@ -4250,6 +4250,65 @@ class AclSearchTests(AclTests):
             self.assert_search_on_attr(str(ou1_dn), self.ldb_admin, attr,
                                        expected_list=self.full_list)
 
+    def test_search8(self):
+        """Objects sharing a security descriptor with a PRINCIPAL_SELF ACE
+        are redacted according to their own objectSid"""
+        ou_dn = "OU=test_search_ps_ou," + self.base_dn
+        self.create_clean_ou(ou_dn)
+        self.addCleanup(delete_force, self.ldb_admin, ou_dn)
+        self.sd_utils.dacl_add_ace(ou_dn, "(A;;LC;;;AU)")
+
+        # schemaIDGUID of description
+        desc_guid = "bf967950-0de6-11d0-a285-00aa003049e2"
+        sddl = ("O:DAG:DAD:P(A;;RPWPCRCCDCLCLORCWOWDSDDTSW;;;DA)"
+                "(A;;RC;;;AU)(OA;;RP;%s;;PS)" % desc_guid)
+
+        names = ["search_ps_u1", "search_ps_u2"]
+        dns = []
+        for name in names:
+            dn = "CN=%s,%s" % (name, ou_dn)
+            self.ldb_admin.newuser(name, self.user_pass,
+                                   userou="OU=test_search_ps_ou",
+                                   description="description of %s" % name)
+            self.addCleanup(delete_force, self.ldb_admin, dn)
+            self.sd_utils.modify_sd_on_dn(dn, sddl)
+            dns.append(dn)
+
+        # Both objects must have the very same descriptor
+        sds = [self.ldb_admin.search(dn, scope=SCOPE_BASE,
+                                     attrs=["nTSecurityDescriptor"])[0]
+               ["nTSecurityDescriptor"][0] for dn in dns]
+        self.assertEqual(sds[0], sds[1])
+
+        def descriptions(samdb):
+            res = samdb.search(ou_dn, expression="(objectClass=user)",
+                               scope=SCOPE_SUBTREE, attrs=["description"])
+            return {str(msg.dn): "description" in msg for msg in res}
+
+        # Each user can only read its own description, even though both
+        # objects are returned by the same search
+        for i, name in enumerate(names):
+            samdb = self.get_ldb_connection(name, self.user_pass)
+            got = descriptions(samdb)
+            self.assertEqual(len(got), 2)
+            for j, dn in enumerate(dns):
+                self.assertEqual(got[dn], i == j,
+                                 "%s reading %s" % (name, dn))
+
+        samdb = self.get_ldb_connection(names[0], self.user_pass)
+
+        # A modified descriptor is evaluated again
+        for dn in dns:
+            self.sd_utils.modify_sd_on_dn(dn, sddl.replace(";;PS)", ";;AU)"))
+        got = descriptions(samdb)
+        self.assertEqual(got, {dn: True for dn in dns})
+
+        for dn in dns:
+            self.sd_utils.modify_sd_on_dn(dn, sddl.replace(
+                "(OA;;RP;%s;;PS)" % desc_guid, ""))
+        got = descriptions(samdb)
+        self.assertEqual(got, {dn: False for dn in dns})
+
 
 # tests on ldap delete operations
 
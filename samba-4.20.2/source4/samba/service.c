@@ -23,6 +23,7 @@
 #include "includes.h"
 #include "../lib/util/dlinklist.h"
 #include "samba/process_model.h"
+#include "param/param.h"
 #include "lib/util/samba_modules.h"
 
 #undef strcasecmp
@@ -102,10 +103,33 @@ NTSTATUS server_service_startup(struct tevent_context *event_ctx,
 	}
 
 	for (i=0;server_services[i];i++) {
+		const struct model_ops *service_model_ops = model_ops;
+		const char *service_model = NULL;
 		NTSTATUS status;
 
+		/*
+		 * "process model:ldap = standard" gives each LDAP client
+		 * its own process (and its own database handle), while
+		 * the other services stay with the global model. "single"
+		 * is for debugging and keeps everything in one process.
+		 */
+		service_model = lpcfg_parm_string(lp_ctx, NULL,
+						  "process model",
+						  server_services[i]);
+		if ((service_model != NULL) &&
+		    (strcmp(model, "single") != 0) &&
+		    (strcmp(model, service_model) != 0)) {
+			service_model_ops = process_model_startup(
+				service_model);
+			DBG_NOTICE("Using process model '%s' for "
+				   "service '%s'\n",
+				   service_model,
+				   server_services[i]);
+		}
+
 		status = server_service_init(server_services[i], event_ctx,
-					     lp_ctx, model_ops, from_parent_fd);
+					     lp_ctx, service_model_ops,
+					     from_parent_fd);
 		if (!NT_STATUS_IS_OK(status)) {
 			DBG_ERR("Failed to start service '%s' - %s\n",
 				 server_services[i], nt_errstr(status));
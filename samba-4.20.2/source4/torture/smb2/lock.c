@@ -3465,6 +3465,386 @@ done:
 	return ret;
 }
 
+/*
+ * smbd keeps the byte range locks of a file in pages of at most 64
+ * locks sorted by offset, found by bisecting an index of the
+ * pages. Take a few thousand locks on one file in random order, so
+ * pages are split in the middle, and check every answer of the server
+ * against a linear scan of the locks we hold.
+ */
+
+struct lock_many_lock {
+	uint64_t offset;
+	uint64_t length;
+	bool exclusive;
+	bool held;
+};
+
+struct lock_many_state {
+	struct lock_many_lock *locks;
+	unsigned int num_locks;
+	uint64_t filesize;
+	uint32_t rand;
+};
+
+static uint32_t lock_many_random(struct lock_many_state *s)
+{
+	/* xorshift32, reproducible across runs */
+	s->rand ^= s->rand << 13;
+	s->rand ^= s->rand >> 17;
+	s->rand ^= s->rand << 5;
+	return s->rand;
+}
+
+static bool lock_many_overlap(const struct lock_many_lock *l,
+			      uint64_t offset,
+			      uint64_t length)
+{
+	return (offset < l->offset + l->length) &&
+	       (l->offset < offset + length);
+}
+
+/*
+ * Would a lock or access from the handle that holds all the locks
+ * conflict? Only exclusive ones, a shared lock stacks on top of our
+ * own exclusive lock.
+ */
+static bool lock_many_own_conflict(const struct lock_many_state *s,
+				   uint64_t offset,
+				   uint64_t length,
+				   bool exclusive)
+{
+	unsigned int i;
+
+	if (!exclusive) {
+		return false;
+	}
+
+	for (i = 0; i < s->num_locks; i++) {
+		const struct lock_many_lock *l = &s->locks[i];
+
+		if (l->held && lock_many_overlap(l, offset, length)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Would a lock or access from another handle conflict?
+ */
+static bool lock_many_other_conflict(const struct lock_many_state *s,
+				     uint64_t offset,
+				     uint64_t length,
+				     bool exclusive)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->num_locks; i++) {
+		const struct lock_many_lock *l = &s->locks[i];
+
+		if (!l->held || (!exclusive && !l->exclusive)) {
+			continue;
+		}
+		if (lock_many_overlap(l, offset, length)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool lock_many_denied(NTSTATUS status)
+{
+	return NT_STATUS_EQUAL(status, NT_STATUS_LOCK_NOT_GRANTED) ||
+	       NT_STATUS_EQUAL(status, NT_STATUS_FILE_LOCK_CONFLICT);
+}
+
+/*
+ * Probe random ranges from another handle with locks, reads and
+ * writes, the server has to agree with the linear scan.
+ */
+static bool lock_many_probe(struct torture_context *torture,
+			    struct smb2_tree *tree2,
+			    struct smb2_handle h2,
+			    struct lock_many_state *s,
+			    unsigned int num_probes)
+{
+	unsigned int i;
+	uint8_t buf[64] = { 0 };
+
+	for (i = 0; i < num_probes; i++) {
+		uint64_t offset = lock_many_random(s) % s->filesize;
+		uint64_t length = 1 + lock_many_random(s) % sizeof(buf);
+		unsigned int kind = lock_many_random(s) % 4;
+		bool exclusive = (kind == 0) || (kind == 3);
+		bool conflict;
+		NTSTATUS status;
+
+		length = MIN(length, s->filesize - offset);
+		conflict = lock_many_other_conflict(s, offset, length,
+						    exclusive);
+
+		if (kind < 2) {
+			status = test_smb2_lock(tree2, h2, offset, length,
+						exclusive);
+			if (conflict) {
+				torture_assert(torture,
+					lock_many_denied(status),
+					talloc_asprintf(torture,
+						"lock %"PRIu64"/%"PRIu64" "
+						"not denied: %s",
+						offset, length,
+						nt_errstr(status)));
+				continue;
+			}
+			torture_assert_ntstatus_ok(torture, status,
+				talloc_asprintf(torture,
+					"lock %"PRIu64"/%"PRIu64,
+					offset, length));
+			status = test_smb2_unlock(tree2, h2, offset, length);
+			torture_assert_ntstatus_ok(torture, status,
+						   "unlock probe");
+		} else if (kind == 2) {
+			struct smb2_read rd = {
+				.in.file.handle = h2,
+				.in.offset = offset,
+				.in.length = length,
+			};
+
+			status = smb2_read(tree2, torture, &rd);
+			torture_assert_ntstatus_equal(torture, status,
+				conflict ? NT_STATUS_FILE_LOCK_CONFLICT :
+					   NT_STATUS_OK,
+				talloc_asprintf(torture,
+					"read %"PRIu64"/%"PRIu64,
+					offset, length));
+			data_blob_free(&rd.out.data);
+		} else {
+			struct smb2_write wr = {
+				.in.file.handle = h2,
+				.in.offset = offset,
+				.in.data = data_blob_const(buf, length),
+			};
+
+			status = smb2_write(tree2, &wr);
+			torture_assert_ntstatus_equal(torture, status,
+				conflict ? NT_STATUS_FILE_LOCK_CONFLICT :
+					   NT_STATUS_OK,
+				talloc_asprintf(torture,
+					"write %"PRIu64"/%"PRIu64,
+					offset, length));
+		}
+	}
+
+	return true;
+}
+
+static bool test_many(struct torture_context *torture,
+		      struct smb2_tree *tree,
+		      struct smb2_tree *tree2)
+{
+	NTSTATUS status;
+	bool ret = true;
+	struct smb2_handle h = {{0}};
+	struct smb2_handle h2 = {{0}};
+	struct lock_many_state s = { .rand = 0x5eed };
+	unsigned int num_locks = torture_setting_int(torture, "numlocks",
+						     4096);
+	unsigned int *order = NULL;
+	uint8_t *buf = NULL;
+	unsigned int i;
+
+	const char *fname = BASEDIR "\\many.txt";
+
+	torture_assert(torture, num_locks > 0, "numlocks must be > 0");
+
+	/* Each lock gets its own 16 byte slot, a few span many slots */
+	s.filesize = (uint64_t)num_locks * 16 + 8192;
+
+	s.locks = talloc_zero_array(torture, struct lock_many_lock,
+				    num_locks);
+	torture_assert(torture, s.locks != NULL, "talloc failed");
+	order = talloc_array(torture, unsigned int, num_locks);
+	torture_assert(torture, order != NULL, "talloc failed");
+	buf = talloc_zero_array(torture, uint8_t, s.filesize);
+	torture_assert(torture, buf != NULL, "talloc failed");
+
+	status = torture_smb2_testdir(tree, BASEDIR, &h);
+	CHECK_STATUS(status, NT_STATUS_OK);
+	smb2_util_close(tree, h);
+
+	status = torture_smb2_testfile(tree, fname, &h);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	status = smb2_util_write(tree, h, buf, 0, s.filesize);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	status = torture_smb2_testfile(tree2, fname, &h2);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+	for (i = 0; i < num_locks; i++) {
+		unsigned int j = lock_many_random(&s) % (i + 1);
+
+		order[i] = order[j];
+		order[j] = i;
+	}
+
+	torture_comment(torture, "Taking %u locks in random order\n",
+			num_locks);
+
+	for (i = 0; i < num_locks; i++) {
+		struct lock_many_lock *l = &s.locks[s.num_locks];
+		bool conflict;
+
+		l->offset = (uint64_t)order[i] * 16 +
+			lock_many_random(&s) % 4;
+		l->length = 1 + lock_many_random(&s) % 12;
+		l->exclusive = (lock_many_random(&s) % 3) == 0;
+		if ((i % 50) == 0) {
+			/* Up to 200 slots wide */
+			l->length = 1 + lock_many_random(&s) % 3200;
+			l->exclusive = false;
+		}
+
+		conflict = lock_many_own_conflict(&s, l->offset, l->length,
+						  l->exclusive);
+
+		status = test_smb2_lock(tree, h, l->offset, l->length,
+					l->exclusive);
+		if (conflict) {
+			torture_assert_goto(torture, lock_many_denied(status),
+					    ret, done,
+					    talloc_asprintf(torture,
+						"lock %"PRIu64"/%"PRIu64" "
+						"not denied: %s",
+						l->offset, l->length,
+						nt_errstr(status)));
+			continue;
+		}
+		CHECK_STATUS(status, NT_STATUS_OK);
+
+		l->held = true;
+		s.num_locks += 1;
+	}
+
+	torture_comment(torture, "%u locks granted\n", s.num_locks);
+
+	ret = lock_many_probe(torture, tree2, h2, &s, 2 * num_locks);
+	torture_assert_goto(torture, ret, ret, done, "probe failed");
+
+	torture_comment(torture, "Dropping half of the locks\n");
+
+	for (i = 0; i < s.num_locks; i++) {
+		struct lock_many_lock *l = &s.locks[i];
+
+		if ((lock_many_random(&s) % 2) == 0) {
+			continue;
+		}
+		status = test_smb2_unlock(tree, h, l->offset, l->length);
+		CHECK_STATUS(status, NT_STATUS_OK);
+		l->held = false;
+	}
+
+	ret = lock_many_probe(torture, tree2, h2, &s, num_locks);
+	torture_assert_goto(torture, ret, ret, done, "probe failed");
+
+	/*
+	 * Change locks while the other connection reads next to
+	 * them. Reads check the locks without the record lock and
+	 * have to notice pages changing under them.
+	 */
+	torture_comment(torture, "Changing locks while reading\n");
+
+	for (i = 0; i < num_locks; i++) {
+		struct lock_many_lock *l =
+			&s.locks[lock_many_random(&s) % s.num_locks];
+		struct smb2_lock lck = { .in.file.handle = h };
+		struct smb2_lock_element el = {
+			.offset = l->offset,
+			.length = l->length,
+		};
+		struct smb2_read rd = { .in.file.handle = h2 };
+		struct smb2_request *lreq = NULL;
+		struct smb2_request *rreq = NULL;
+		NTSTATUS rstatus;
+		bool conflict;
+
+		if (l->held) {
+			el.flags = SMB2_LOCK_FLAG_UNLOCK;
+		} else {
+			conflict = lock_many_own_conflict(
+				&s, l->offset, l->length, l->exclusive);
+			if (conflict) {
+				continue;
+			}
+			el.flags = (l->exclusive ?
+				    SMB2_LOCK_FLAG_EXCLUSIVE :
+				    SMB2_LOCK_FLAG_SHARED) |
+				   SMB2_LOCK_FLAG_FAIL_IMMEDIATELY;
+		}
+		lck.in.lock_count = 1;
+		lck.in.locks = &el;
+
+		/* Read within a few pages, but not from the lock itself */
+		do {
+			uint64_t slot = l->offset / 16;
+			uint64_t lo = (slot > 128) ? slot - 128 : 0;
+
+			rd.in.offset = (lo + lock_many_random(&s) % 256) * 16;
+			rd.in.length = 1 + lock_many_random(&s) % 32;
+			rd.in.offset = MIN(rd.in.offset,
+					   s.filesize - rd.in.length);
+		} while (lock_many_overlap(l, rd.in.offset, rd.in.length));
+
+		conflict = lock_many_other_conflict(
+			&s, rd.in.offset, rd.in.length, false);
+
+		lreq = smb2_lock_send(tree, &lck);
+		rreq = smb2_read_send(tree2, &rd);
+		torture_assert_goto(torture, (lreq != NULL) && (rreq != NULL),
+				    ret, done, "send failed");
+
+		status = smb2_lock_recv(lreq, &lck);
+		rstatus = smb2_read_recv(rreq, torture, &rd);
+
+		/*
+		 * The read doesn't touch the lock, so both answers are
+		 * known whatever order the server handles them in
+		 */
+		CHECK_STATUS(status, NT_STATUS_OK);
+		l->held = !l->held;
+
+		CHECK_STATUS(rstatus, conflict ?
+			     NT_STATUS_FILE_LOCK_CONFLICT : NT_STATUS_OK);
+		data_blob_free(&rd.out.data);
+	}
+
+	ret = lock_many_probe(torture, tree2, h2, &s, num_locks);
+	torture_assert_goto(torture, ret, ret, done, "probe failed");
+
+	torture_comment(torture, "Closing the handle drops all locks\n");
+
+	status = smb2_util_close(tree, h);
+	CHECK_STATUS(status, NT_STATUS_OK);
+	ZERO_STRUCT(h);
+
+	status = test_smb2_lock(tree2, h2, 0, s.filesize, true);
+	CHECK_STATUS(status, NT_STATUS_OK);
+	status = test_smb2_unlock(tree2, h2, 0, s.filesize);
+	CHECK_STATUS(status, NT_STATUS_OK);
+
+done:
+	smb2_util_close(tree2, h2);
+	if (!smb2_util_handle_empty(h)) {
+		smb2_util_close(tree, h);
+	}
+	smb2_deltree(tree, BASEDIR);
+	TALLOC_FREE(buf);
+	TALLOC_FREE(order);
+	TALLOC_FREE(s.locks);
+	return ret;
+}
+
 /* basic testing of SMB2 locking
 */
 struct torture_suite *torture_smb2_lock_init(TALLOC_CTX *ctx)
@@ -3506,6 +3886,7 @@ struct torture_suite *torture_smb2_lock_init(TALLOC_CTX *ctx)
 	torture_suite_add_1smb2_test(suite, "replay_smb3_specification_multi",
 				     test_replay_smb3_specification_multi);
 	torture_suite_add_1smb2_test(suite, "ctdb-delrec-deadlock", test_deadlock);
+	torture_suite_add_2smb2_test(suite, "many", test_many);
 
 	suite->description = talloc_strdup(suite, "SMB2-LOCK tests");
 